@@ -0,0 +1,708 @@
+/*
+ *
+ * Copyright (c) 2018 Cisco Systems, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials provided
+ *   with the distribution.
+ *
+ *   Neither the name of the Cisco Systems, Inc. nor the names of its
+ *   contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+/**
+ * \file af_packet.c
+ *
+ * \brief live capture through a Linux TPACKET_V3 ring
+ *
+ ** The ring is an array of blocks in memory shared with the kernel.
+ *  Each block starts with a tpacket_block_desc, whose status says who
+ *  owns it; the kernel fills the blocks in order, and sets the status
+ *  of a block to TP_STATUS_USER when it hands it over, after which the
+ *  block holds num_pkts packets, each behind a tpacket3_hdr.  The block
+ *  goes back to the kernel when its status is set to TP_STATUS_KERNEL.
+ *
+ ** The socket is created for no protocol, and only starts to receive
+ *  packets when it is bound to the interface, after its filter and ring
+ *  are in place.
+ *
+ ** Like libpcap, the reader puts back the VLAN tags that the kernel
+ *  strips from packets, so that joy sees the packets as they were on
+ *  the wire.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#ifdef __linux__
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <net/if.h>
+#include <net/if_arp.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+#include <linux/filter.h>
+#endif
+#include "safe_lib.h"
+#include "p2f.h"
+#include "af_packet.h"
+#include "err.h"
+
+#ifdef __linux__
+
+/** bytes of a VLAN tag */
+#define AF_PACKET_VLAN_TAG_LEN 4
+
+/** bytes of the two MAC addresses, after which a VLAN tag goes */
+#define AF_PACKET_MAC_ADDRS_LEN 12
+
+static uint32_t af_packet_block_status (const struct tpacket_block_desc *desc) {
+    return __atomic_load_n(&desc->hdr.bh1.block_status, __ATOMIC_ACQUIRE);
+}
+
+static void af_packet_block_release (struct tpacket_block_desc *desc) {
+    __atomic_store_n(&desc->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+}
+
+/**
+ * \brief Copy a packet into the bounce buffer, with its VLAN tag put back.
+ * \param a Socket
+ * \param h Header of the packet in the ring
+ * \param packet The packet, without its tag
+ * \param header pcap header of the packet, whose lengths are updated
+ * \return The packet with its tag
+ */
+static const unsigned char *af_packet_put_vlan_tag (af_packet_t *a, const struct tpacket3_hdr *h,
+                                                    const unsigned char *packet,
+                                                    struct pcap_pkthdr *header) {
+    uint16_t tpid = ETH_P_8021Q;
+    uint16_t v;
+
+    if (h->hv1.tp_vlan_tpid || (h->tp_status & TP_STATUS_VLAN_TPID_VALID)) {
+        tpid = h->hv1.tp_vlan_tpid;
+    }
+
+    memcpy(a->bounce, packet, AF_PACKET_MAC_ADDRS_LEN);
+    v = htons(tpid);
+    memcpy(a->bounce + AF_PACKET_MAC_ADDRS_LEN, &v, sizeof(v));
+    v = htons((uint16_t)h->hv1.tp_vlan_tci);
+    memcpy(a->bounce + AF_PACKET_MAC_ADDRS_LEN + 2, &v, sizeof(v));
+    memcpy(a->bounce + AF_PACKET_MAC_ADDRS_LEN + AF_PACKET_VLAN_TAG_LEN,
+           packet + AF_PACKET_MAC_ADDRS_LEN, header->caplen - AF_PACKET_MAC_ADDRS_LEN);
+    header->caplen += AF_PACKET_VLAN_TAG_LEN;
+    header->len += AF_PACKET_VLAN_TAG_LEN;
+
+    return a->bounce;
+}
+
+/**
+ * \brief Hand the packets of a block to a callback.
+ * \param a Socket
+ * \param desc The block, owned by joy
+ * \param callback Called for each packet
+ * \param user Passed on to the callback
+ * \return Number of packets handed to the callback
+ */
+static int af_packet_walk_block (af_packet_t *a, const struct tpacket_block_desc *desc,
+                                 pcap_handler callback, unsigned char *user) {
+    const unsigned char *p = (const unsigned char *)desc + desc->hdr.bh1.offset_to_first_pkt;
+    uint32_t i, num_pkts = desc->hdr.bh1.num_pkts;
+    int n = 0;
+
+    for (i = 0; i < num_pkts; i++) {
+        const struct tpacket3_hdr *h = (const struct tpacket3_hdr *)p;
+        const struct sockaddr_ll *sll = (const struct sockaddr_ll *)(p + TPACKET_ALIGN(sizeof(struct tpacket3_hdr)));
+        const unsigned char *packet = p + h->tp_mac;
+        struct pcap_pkthdr header;
+
+        p += h->tp_next_offset;
+
+        /* on loopback, each packet also shows up on its way out, as libpcap knows */
+        if (a->loopback && sll->sll_pkttype == PACKET_OUTGOING) {
+            continue;
+        }
+
+        header.ts.tv_sec = h->tp_sec;
+        header.ts.tv_usec = h->tp_nsec / 1000;
+        header.caplen = h->tp_snaplen;
+        header.len = h->tp_len;
+        if (header.caplen > AF_PACKET_SNAPLEN) {
+            header.caplen = AF_PACKET_SNAPLEN;
+        }
+        if ((h->hv1.tp_vlan_tci || (h->tp_status & TP_STATUS_VLAN_VALID)) &&
+            header.caplen >= AF_PACKET_MAC_ADDRS_LEN) {
+            packet = af_packet_put_vlan_tag(a, h, packet, &header);
+        }
+        callback(user, &header, packet);
+        n++;
+    }
+
+    return n;
+}
+
+/**
+ * \brief Install a BPF filter on a socket.
+ * \param fd The socket
+ * \param filter_exp Filter, in the syntax of pcap_compile()
+ * \return ok, or failure if the filter cannot be compiled or installed
+ */
+static joy_status_e af_packet_set_filter (int fd, const char *filter_exp) {
+    struct bpf_program fp;
+    struct sock_fprog prog;
+    joy_status_e rc = ok;
+    pcap_t *dead;
+
+    dead = pcap_open_dead(DLT_EN10MB, AF_PACKET_SNAPLEN);
+    if (dead == NULL) {
+        joy_log_err("out of memory");
+        return failure;
+    }
+    if (pcap_compile(dead, &fp, filter_exp, 1, PCAP_NETMASK_UNKNOWN) == -1) {
+        joy_log_err("could not parse filter %s: %s", filter_exp, pcap_geterr(dead));
+        pcap_close(dead);
+        return failure;
+    }
+
+    /* the kernel takes the same instructions as libpcap produces */
+    prog.len = (unsigned short)fp.bf_len;
+    prog.filter = (struct sock_filter *)(void *)fp.bf_insns;
+    if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) != 0) {
+        joy_log_err("could not install filter %s: %s", filter_exp, strerror(errno));
+        rc = failure;
+    }
+    pcap_freecode(&fp);
+    pcap_close(dead);
+
+    return rc;
+}
+
+/**
+ * \brief Find an interface, and check that it has Ethernet headers.
+ * \param fd A packet socket
+ * \param if_name Name of the interface
+ * \param loopback Set to nonzero if the interface is a loopback interface
+ * \return Index of the interface, or 0 if it cannot be used
+ */
+static int af_packet_if_index (int fd, const char *if_name, int *loopback) {
+    struct ifreq ifr;
+
+    memset_s(&ifr, sizeof(ifr), 0x00, sizeof(ifr));
+    strncpy(ifr.ifr_name, if_name, sizeof(ifr.ifr_name) - 1);
+    if (ioctl(fd, SIOCGIFINDEX, &ifr) != 0) {
+        joy_log_err("could not find interface %s: %s", if_name, strerror(errno));
+        return 0;
+    }
+    if (ioctl(fd, SIOCGIFHWADDR, &ifr) != 0) {
+        joy_log_err("could not get the link type of %s: %s", if_name, strerror(errno));
+        return 0;
+    }
+
+    /* the loopback interface gets Ethernet headers too */
+    if (ifr.ifr_hwaddr.sa_family != ARPHRD_ETHER && ifr.ifr_hwaddr.sa_family != ARPHRD_LOOPBACK) {
+        joy_log_err("interface %s has unsupported link type (%d)", if_name, ifr.ifr_hwaddr.sa_family);
+        return 0;
+    }
+    *loopback = (ifr.ifr_hwaddr.sa_family == ARPHRD_LOOPBACK);
+
+    return (int)if_nametoindex(if_name);
+}
+
+#endif /* __linux__ */
+
+/**
+ * \fn joy_status_e af_packet_open (af_packet_t *a, const char *if_name, unsigned int ring_mb,
+ *                                  int promisc, const char *filter_exp, unsigned int fanout_group)
+ *
+ * \brief Open a packet socket with a TPACKET_V3 ring on an interface.
+ *
+ * \param a Socket
+ * \param if_name Name of the interface
+ * \param ring_mb Size of the ring in megabytes, 0 for AF_PACKET_RING_MB
+ * \param promisc Nonzero to put the interface into promiscuous mode
+ * \param filter_exp BPF filter, or NULL
+ * \param fanout_group Nonzero to join that PACKET_FANOUT group
+ * \return ok, or failure (which is logged)
+ */
+joy_status_e af_packet_open (af_packet_t *a, const char *if_name, unsigned int ring_mb,
+                             int promisc, const char *filter_exp, unsigned int fanout_group) {
+#ifndef __linux__
+    (void)if_name;
+    (void)ring_mb;
+    (void)promisc;
+    (void)filter_exp;
+    (void)fanout_group;
+    memset_s(a, sizeof(af_packet_t), 0x00, sizeof(af_packet_t));
+    a->fd = -1;
+    joy_log_err("afpacket capture is only available on Linux");
+    return failure;
+#else
+    struct tpacket_req3 req;
+    struct sockaddr_ll sll;
+    int version = TPACKET_V3;
+    int if_index;
+
+    memset_s(a, sizeof(af_packet_t), 0x00, sizeof(af_packet_t));
+
+    /* no protocol yet, so no packets arrive before the socket is bound */
+    a->fd = socket(AF_PACKET, SOCK_RAW, 0);
+    if (a->fd < 0) {
+        joy_log_err("could not open packet socket: %s", strerror(errno));
+        return failure;
+    }
+
+    if_index = af_packet_if_index(a->fd, if_name, &a->loopback);
+    if (if_index == 0) {
+        goto fail;
+    }
+    if (filter_exp && af_packet_set_filter(a->fd, filter_exp) != ok) {
+        goto fail;
+    }
+
+    if (setsockopt(a->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) != 0) {
+        joy_log_err("could not select TPACKET_V3: %s", strerror(errno));
+        goto fail;
+    }
+
+    if (ring_mb == 0) {
+        ring_mb = AF_PACKET_RING_MB;
+    }
+    a->num_blocks = (unsigned int)(((size_t)ring_mb << 20) / AF_PACKET_BLOCK_SIZE);
+    if (a->num_blocks < 2) {
+        a->num_blocks = 2;
+    }
+    memset_s(&req, sizeof(req), 0x00, sizeof(req));
+    req.tp_block_size = AF_PACKET_BLOCK_SIZE;
+    req.tp_block_nr = a->num_blocks;
+    req.tp_frame_size = AF_PACKET_FRAME_SIZE;
+    req.tp_frame_nr = a->num_blocks * (AF_PACKET_BLOCK_SIZE / AF_PACKET_FRAME_SIZE);
+    req.tp_retire_blk_tov = AF_PACKET_BLOCK_TIMEOUT;
+    if (setsockopt(a->fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) != 0) {
+        joy_log_err("could not set up a ring of %u blocks: %s", a->num_blocks, strerror(errno));
+        goto fail;
+    }
+    a->map_size = (size_t)a->num_blocks * AF_PACKET_BLOCK_SIZE;
+    a->map = mmap(NULL, a->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, a->fd, 0);
+    if (a->map == MAP_FAILED) {
+        a->map = NULL;
+        joy_log_err("could not map the ring: %s", strerror(errno));
+        goto fail;
+    }
+
+    a->bounce = malloc(AF_PACKET_SNAPLEN + AF_PACKET_VLAN_TAG_LEN);
+    if (a->bounce == NULL) {
+        joy_log_err("out of memory");
+        goto fail;
+    }
+
+    memset_s(&sll, sizeof(sll), 0x00, sizeof(sll));
+    sll.sll_family = AF_PACKET;
+    sll.sll_protocol = htons(ETH_P_ALL);
+    sll.sll_ifindex = if_index;
+    if (bind(a->fd, (struct sockaddr *)&sll, sizeof(sll)) != 0) {
+        joy_log_err("could not bind to %s: %s", if_name, strerror(errno));
+        goto fail;
+    }
+
+    if (promisc) {
+        struct packet_mreq mr;
+
+        memset_s(&mr, sizeof(mr), 0x00, sizeof(mr));
+        mr.mr_ifindex = if_index;
+        mr.mr_type = PACKET_MR_PROMISC;
+        if (setsockopt(a->fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mr, sizeof(mr)) != 0) {
+            joy_log_err("could not put %s into promiscuous mode: %s", if_name, strerror(errno));
+            goto fail;
+        }
+    }
+
+    if (fanout_group) {
+        /* the flow hash is the same in both directions, and fragments are put together first */
+        int fanout = (int)((fanout_group & 0xffff) | ((PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_DEFRAG) << 16));
+
+        if (setsockopt(a->fd, SOL_PACKET, PACKET_FANOUT, &fanout, sizeof(fanout)) != 0) {
+            joy_log_err("could not join fanout group %u: %s", fanout_group, strerror(errno));
+            goto fail;
+        }
+    }
+
+    return ok;
+
+ fail:
+    af_packet_close(a);
+    return failure;
+#endif
+}
+
+/**
+ * \fn int af_packet_dispatch (af_packet_t *a, int timeout, pcap_handler callback, unsigned char *user)
+ *
+ * \brief Hand the packets of the next block of the ring to a callback.
+ *
+ * \param a Socket
+ * \param timeout Most milliseconds to wait for a block, or -1 to wait for ever
+ * \param callback Called for each packet
+ * \param user Passed on to the callback
+ * \return Number of packets handed over, 0 if no block was ready, -1 on error
+ */
+int af_packet_dispatch (af_packet_t *a, int timeout, pcap_handler callback, unsigned char *user) {
+#ifndef __linux__
+    (void)a;
+    (void)timeout;
+    (void)callback;
+    (void)user;
+    return -1;
+#else
+    struct tpacket_block_desc *desc;
+    struct pollfd pfd;
+    int n;
+
+    desc = (struct tpacket_block_desc *)(a->map + (size_t)a->block * AF_PACKET_BLOCK_SIZE);
+    if ((af_packet_block_status(desc) & TP_STATUS_USER) == 0) {
+        pfd.fd = a->fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if (poll(&pfd, 1, timeout) < 0) {
+            if (errno == EINTR) {
+                return 0;
+            }
+            joy_log_err("poll failed: %s", strerror(errno));
+            return -1;
+        }
+        if (pfd.revents & (POLLERR | POLLNVAL)) {
+            joy_log_err("capture socket failed (the interface may have gone down)");
+            return -1;
+        }
+        if ((af_packet_block_status(desc) & TP_STATUS_USER) == 0) {
+            return 0;
+        }
+    }
+
+    n = af_packet_walk_block(a, desc, callback, user);
+    af_packet_block_release(desc);
+    a->block = (a->block + 1) % a->num_blocks;
+
+    return n;
+#endif
+}
+
+/**
+ * \fn void af_packet_get_stats (af_packet_t *a, af_packet_stats_t *stats)
+ *
+ * \brief Read the counters of a socket.
+ *
+ * The kernel resets its counters when they are read, so they are added
+ * up in the socket.
+ *
+ * \param a Socket
+ * \param stats Counters since the socket was opened
+ * \return none
+ */
+void af_packet_get_stats (af_packet_t *a, af_packet_stats_t *stats) {
+#ifdef __linux__
+    struct tpacket_stats_v3 st;
+    socklen_t len = sizeof(st);
+
+    if (a->fd >= 0 && getsockopt(a->fd, SOL_PACKET, PACKET_STATISTICS, &st, &len) == 0) {
+        a->stats.packets += st.tp_packets;
+        a->stats.drops += st.tp_drops;
+        a->stats.freezes += st.tp_freeze_q_cnt;
+    }
+#endif
+    *stats = a->stats;
+}
+
+/**
+ * \fn void af_packet_close (af_packet_t *a)
+ *
+ * \brief Close a socket and release its ring.
+ *
+ * \param a Socket
+ * \return none
+ */
+void af_packet_close (af_packet_t *a) {
+#ifdef __linux__
+    if (a->map) {
+        munmap(a->map, a->map_size);
+    }
+    if (a->fd >= 0) {
+        close(a->fd);
+    }
+#endif
+    free(a->bounce);
+    memset_s(a, sizeof(af_packet_t), 0x00, sizeof(af_packet_t));
+    a->fd = -1;
+}
+
+/*
+ * Unit test: a block laid out the way the kernel lays it out, walked
+ * without a socket; then, if packet sockets can be opened, datagrams
+ * sent over the loopback interface and captured through the ring
+ */
+
+#ifdef __linux__
+
+#define AF_PACKET_TEST_PACKETS 3
+#define AF_PACKET_TEST_PORT 50123
+#define AF_PACKET_TEST_DATAGRAMS 20
+
+typedef struct af_packet_test_seen_ {
+    unsigned int num_packets;
+    struct pcap_pkthdr headers[AF_PACKET_TEST_DATAGRAMS];
+    unsigned char first_bytes[AF_PACKET_TEST_DATAGRAMS][40];
+} af_packet_test_seen_t;
+
+static void af_packet_test_callback (unsigned char *arg, const struct pcap_pkthdr *header,
+                                     const unsigned char *packet) {
+    af_packet_test_seen_t *seen = (af_packet_test_seen_t *)arg;
+
+    if (seen->num_packets < AF_PACKET_TEST_DATAGRAMS) {
+        seen->headers[seen->num_packets] = *header;
+        memcpy(seen->first_bytes[seen->num_packets], packet,
+               header->caplen < 40 ? header->caplen : 40);
+    }
+    seen->num_packets++;
+}
+
+static int af_packet_test_block (void) {
+    static const uint16_t tci[AF_PACKET_TEST_PACKETS] = { 0, 0x0123, 0x0456 };
+    static const uint16_t tpid[AF_PACKET_TEST_PACKETS] = { 0, 0, ETH_P_8021AD };
+    af_packet_test_seen_t seen;
+    struct tpacket_block_desc *desc;
+    unsigned char *block, *p;
+    af_packet_t a;
+    unsigned int i;
+    int num_fails = 0;
+
+    block = calloc(1, 8192);
+    memset_s(&a, sizeof(a), 0x00, sizeof(a));
+    a.bounce = malloc(AF_PACKET_SNAPLEN + AF_PACKET_VLAN_TAG_LEN);
+    if (block == NULL || a.bounce == NULL) {
+        free(block);
+        free(a.bounce);
+        return 1;
+    }
+
+    desc = (struct tpacket_block_desc *)block;
+    desc->hdr.bh1.block_status = TP_STATUS_USER;
+    desc->hdr.bh1.num_pkts = AF_PACKET_TEST_PACKETS;
+    desc->hdr.bh1.offset_to_first_pkt = 48;
+    p = block + desc->hdr.bh1.offset_to_first_pkt;
+    for (i = 0; i < AF_PACKET_TEST_PACKETS; i++) {
+        struct tpacket3_hdr *h = (struct tpacket3_hdr *)p;
+        unsigned char *packet;
+        unsigned int j;
+
+        h->tp_sec = 1000 + i;
+        h->tp_nsec = 123456789 + i * 1000;
+        h->tp_snaplen = 60 + i;
+        h->tp_len = 1000 + i;
+        h->tp_mac = 80;
+        h->tp_next_offset = 80 + 128;
+        if (tci[i]) {
+            h->tp_status = TP_STATUS_VLAN_VALID | (tpid[i] ? TP_STATUS_VLAN_TPID_VALID : 0);
+            h->hv1.tp_vlan_tci = tci[i];
+            h->hv1.tp_vlan_tpid = tpid[i];
+        }
+        packet = p + h->tp_mac;
+        for (j = 0; j < h->tp_snaplen; j++) {
+            packet[j] = (unsigned char)(i * 16 + j);
+        }
+        p += h->tp_next_offset;
+    }
+
+    memset_s(&seen, sizeof(seen), 0x00, sizeof(seen));
+    if (af_packet_walk_block(&a, desc, af_packet_test_callback, (unsigned char *)&seen) != AF_PACKET_TEST_PACKETS ||
+        seen.num_packets != AF_PACKET_TEST_PACKETS) {
+        joy_log_err("wrong number of packets in the block");
+        num_fails++;
+    }
+    for (i = 0; i < AF_PACKET_TEST_PACKETS && i < seen.num_packets; i++) {
+        const unsigned char *b = seen.first_bytes[i];
+        unsigned int tag = tci[i] ? AF_PACKET_VLAN_TAG_LEN : 0;
+
+        if (seen.headers[i].ts.tv_sec != (time_t)(1000 + i) ||
+            seen.headers[i].ts.tv_usec != (long)(123456 + i)) {
+            joy_log_err("packet %u has a wrong timestamp", i);
+            num_fails++;
+        }
+        if (seen.headers[i].caplen != 60 + i + tag || seen.headers[i].len != 1000 + i + tag) {
+            joy_log_err("packet %u has wrong lengths", i);
+            num_fails++;
+        }
+        if (b[0] != (unsigned char)(i * 16) || b[11] != (unsigned char)(i * 16 + 11) ||
+            b[12 + tag] != (unsigned char)(i * 16 + 12)) {
+            joy_log_err("packet %u has wrong contents", i);
+            num_fails++;
+        }
+        if (tag && (((b[12] << 8) | b[13]) != (tpid[i] ? tpid[i] : ETH_P_8021Q) ||
+                    ((b[14] << 8) | b[15]) != tci[i])) {
+            joy_log_err("packet %u has a wrong VLAN tag", i);
+            num_fails++;
+        }
+    }
+
+    free(block);
+    free(a.bounce);
+    return num_fails;
+}
+
+/**
+ * \brief Send datagrams over the loopback interface and capture them.
+ * \param num_sockets Sockets to capture with, in one fanout group if more than one
+ * \return Number of failures
+ */
+static int af_packet_test_loopback (unsigned int num_sockets) {
+    char filter[64];
+    af_packet_t a[2];
+    af_packet_test_seen_t seen[2];
+    af_packet_stats_t stats;
+    struct sockaddr_in dst, src;
+    unsigned int i, j, total = 0;
+    int fd[4];
+    int num_fails = 0;
+
+    snprintf(filter, sizeof(filter), "udp and dst port %u", AF_PACKET_TEST_PORT);
+    for (i = 0; i < num_sockets; i++) {
+        if (af_packet_open(&a[i], "lo", 4, 0, filter, num_sockets > 1 ? (unsigned int)getpid() : 0) != ok) {
+            while (i--) {
+                af_packet_close(&a[i]);
+            }
+            return 1;
+        }
+        memset_s(&seen[i], sizeof(seen[i]), 0x00, sizeof(seen[i]));
+    }
+
+    /* four flows, from four source ports */
+    memset_s(&dst, sizeof(dst), 0x00, sizeof(dst));
+    dst.sin_family = AF_INET;
+    dst.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    dst.sin_port = htons(AF_PACKET_TEST_PORT);
+    src = dst;
+    for (j = 0; j < 4; j++) {
+        fd[j] = socket(AF_INET, SOCK_DGRAM, 0);
+        src.sin_port = 0;
+        if (fd[j] >= 0) {
+            bind(fd[j], (struct sockaddr *)&src, sizeof(src));
+        }
+    }
+    for (j = 0; j < AF_PACKET_TEST_DATAGRAMS; j++) {
+        char payload[16];
+
+        memset_s(payload, sizeof(payload), (int)j, sizeof(payload));
+        if (fd[j % 4] < 0 || sendto(fd[j % 4], payload, sizeof(payload), 0,
+                                    (struct sockaddr *)&dst, sizeof(dst)) != sizeof(payload)) {
+            joy_log_err("could not send datagram %u", j);
+            num_fails++;
+        }
+    }
+    for (j = 0; j < 4; j++) {
+        if (fd[j] >= 0) {
+            close(fd[j]);
+        }
+    }
+
+    /* the blocks are handed over when they time out */
+    for (j = 0; j < 40 && total < AF_PACKET_TEST_DATAGRAMS; j++) {
+        for (i = 0; i < num_sockets; i++) {
+            if (af_packet_dispatch(&a[i], 50, af_packet_test_callback, (unsigned char *)&seen[i]) < 0) {
+                num_fails++;
+            }
+        }
+        for (i = 0, total = 0; i < num_sockets; i++) {
+            total += seen[i].num_packets;
+        }
+    }
+    if (total != AF_PACKET_TEST_DATAGRAMS) {
+        joy_log_err("captured %u of %u datagrams with %u sockets", total, AF_PACKET_TEST_DATAGRAMS, num_sockets);
+        num_fails++;
+    }
+
+    for (i = 0; i < num_sockets; i++) {
+        for (j = 0; j < seen[i].num_packets && j < AF_PACKET_TEST_DATAGRAMS; j++) {
+            /* Ethernet, IPv4 and UDP headers, and the payload */
+            if (seen[i].headers[j].caplen != 14 + 20 + 8 + 16 || seen[i].headers[j].len != seen[i].headers[j].caplen ||
+                seen[i].first_bytes[j][12] != 0x08 || seen[i].first_bytes[j][13] != 0x00) {
+                joy_log_err("datagram %u of socket %u is wrong", j, i);
+                num_fails++;
+            }
+        }
+        /* the kernel counts each datagram twice, on its way out and on its way in */
+        af_packet_get_stats(&a[i], &stats);
+        if (stats.packets != 2 * seen[i].num_packets || stats.drops != 0) {
+            joy_log_err("socket %u counted %lu packets and %lu drops, for %u packets",
+                        i, stats.packets, stats.drops, seen[i].num_packets);
+            num_fails++;
+        }
+        af_packet_close(&a[i]);
+    }
+
+    return num_fails;
+}
+
+#endif /* __linux__ */
+
+int af_packet_unit_test (void) {
+    int num_fails = 0;
+#ifdef __linux__
+    int fd;
+#endif
+
+    fprintf(info, "\n******************************\n");
+    fprintf(info, "AF_PACKET capture Unit Test starting...\n");
+
+#ifndef __linux__
+    fprintf(info, "not available on this platform\n");
+#else
+    num_fails += af_packet_test_block();
+
+    /* capturing needs CAP_NET_RAW */
+    fd = socket(AF_PACKET, SOCK_RAW, 0);
+    if (fd < 0 || if_nametoindex("lo") == 0) {
+        fprintf(info, "live capture not tested (no packet sockets or loopback interface)\n");
+    } else {
+        num_fails += af_packet_test_loopback(1);
+        num_fails += af_packet_test_loopback(2);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+#endif
+
+    if (num_fails) {
+        fprintf(info, "Finished - failures: %d\n", num_fails);
+    } else {
+        fprintf(info, "Finished - success\n");
+    }
+    fprintf(info, "******************************\n\n");
+
+    return num_fails;
+}
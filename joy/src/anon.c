@@ -124,15 +124,15 @@ joy_status_e key_init (const char *ANON_KEYFILE) {
         }
     } else {
 #ifdef WIN32
-                if (!CryptAcquireContextW(&hProv, 0, 0, PROV_RSA_AES, CRYPT_VERIFYCONTEXT | CRYPT_SILENT)) {
+                if (!CryptAcquireContextW(&hProv, 0, 0, PROV_RSA_AES, CRYPT_VERIFYCONTEXT | CRYPT_SILENT)) {
                         return failure;
-                }
-                if(!CryptGenRandom(hProv, 16, buf)) {
-                        CryptReleaseContext(hProv, 0);
+                }
+                if(!CryptGenRandom(hProv, 16, buf)) {
+                        CryptReleaseContext(hProv, 0);
                         perror("error: could not get random data");
                         return failure;
-                }
-                CryptReleaseContext(hProv, 0);
+                }
+                CryptReleaseContext(hProv, 0);
 #else
         /* key file does not exist, so generate new one */
         fd = open("/dev/urandom", O_RDONLY);
@@ -351,17 +351,28 @@ joy_status_e anon_init (const char *pathname, FILE *logfile) {
 /** buffer used for anonymized data */
 static char hexout[33];
 
+/**
+ * \fn void addr_get_anon_bytes (const struct in_addr *a, unsigned char *c)
+ * \param a address to be anonymized
+ * \param c 16 bytes that receive the anonymized address
+ * \return none
+ */
+void addr_get_anon_bytes (const struct in_addr *a, unsigned char *c) {
+    unsigned char pt[16] = { 0, };
+
+    memcpy_s(pt, sizeof(struct in_addr), a, sizeof(struct in_addr));
+    AES_encrypt(pt, c, &key.enc_key);
+}
+
 /**
  * \fn char *addr_get_anon_hexstring (const struct in_addr *a)
  * \param a address to be anonymized
  * \return pointer to the anonymized output
  */
 char *addr_get_anon_hexstring (const struct in_addr *a) {
-    unsigned char pt[16] = { 0, };
     unsigned char c[16];
 
-    memcpy_s(pt, sizeof(struct in_addr), a, sizeof(struct in_addr));
-    AES_encrypt(pt, c, &key.enc_key);
+    addr_get_anon_bytes(a, c);
     snprintf(hexout, 33, "%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x", 
                c[0], c[1], c[2], c[3], c[4], c[5], c[6], c[7], 
                c[8], c[9], c[10], c[11], c[12], c[13], c[14], c[15]);
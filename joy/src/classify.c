@@ -242,91 +242,83 @@ float parameters_bd[NUM_PARAMETERS_BD_LOGREG] = {
 };
 
 /**
- * \fn void merge_splt_arrays (const uint16_t *pkt_len, const struct timeval *pkt_time,
-         const uint16_t *pkt_len_twin, const struct timeval *pkt_time_twin,
+ * \fn void merge_splt_arrays (const uint16_t *pkt_len, const joy_time_delta_t *pkt_time,
+         const joy_time_base_t *time_base,
+         const uint16_t *pkt_len_twin, const joy_time_delta_t *pkt_time_twin,
+         const joy_time_base_t *time_base_twin,
          struct timeval start_time, struct timeval start_time_twin,
          uint16_t s_idx, uint16_t r_idx,
-         uint16_t *merged_lens, uint16_t *merged_times,
-         uint32_t max_num_pkt_len, uint32_t max_merged_num_pkts)
+         uint16_t *merged_lens, uint16_t *merged_times)
  * \param pkt_len length of the packet
  * \param pkt_time time of the packet
+ * \param time_base base of the packet times
  * \param pkt_len_twin length of the twin packet
  * \param pkt_time_twin time of the twin packet
+ * \param time_base_twin base of the twin packet times
  * \param start_time start time
  * \param start_time_twin start time of twin
  * \param s_idx s index in the merge
  * \param r_idx r index in the merge
  * \param merged_lens length of the merge
  * \param merged_times time of the merge
- * \param max_merged_num_pkts number of packets merged
  * \return none
  */
-void merge_splt_arrays (const uint16_t *pkt_len, const struct timeval *pkt_time, 
-		       const uint16_t *pkt_len_twin, const struct timeval *pkt_time_twin,
+void merge_splt_arrays (const uint16_t *pkt_len, const joy_time_delta_t *pkt_time,
+		       const joy_time_base_t *time_base,
+		       const uint16_t *pkt_len_twin, const joy_time_delta_t *pkt_time_twin,
+		       const joy_time_base_t *time_base_twin,
 		       struct timeval start_time, struct timeval start_time_twin,
 		       uint16_t s_idx, uint16_t r_idx,
 		       uint16_t *merged_lens, uint16_t *merged_times) {
     int s,r;
-    struct timeval ts_start = { 0, 0 }; /* initialize to avoid spurious warnings */
-    struct timeval tmp, tmp_r;
-    struct timeval start_m;
+    int64_t t, t_s = 0, t_r = 0;
+    int64_t t_last = 0;
+    int64_t start_m;
+
+    /* all times are microseconds since the epoch */
+    if (s_idx) {
+        t_s = joy_time_delta_to_usec(time_base, pkt_time[0]);
+    }
+    if (r_idx) {
+        t_r = joy_time_delta_to_usec(time_base_twin, pkt_time_twin[0]);
+    }
 
     if (r_idx + s_idx == 0) {
         return ;
     } else if (r_idx == 0) {
-        ts_start = pkt_time[0];
-        tmp = pkt_time[0];
-        joy_timer_sub(&tmp, &start_time, &start_m);
+        t_last = t_s;
+        start_m = t_s - joy_timeval_to_usec(&start_time);
     } else if (s_idx == 0) {
-        ts_start = pkt_time_twin[0];
-        tmp = pkt_time_twin[0];
-        joy_timer_sub(&tmp, &start_time_twin, &start_m);
+        t_last = t_r;
+        start_m = t_r - joy_timeval_to_usec(&start_time_twin);
     } else {
         if (joy_timer_lt(&start_time, &start_time_twin)) {
-            ts_start = pkt_time[0];
-            tmp = pkt_time[0];
-            joy_timer_sub(&tmp, &start_time, &start_m);
+            t_last = t_s;
+            start_m = t_s - joy_timeval_to_usec(&start_time);
         } else {
-            //      ts_start = pkt_time_twin[0];
-            tmp = pkt_time_twin[0];
-            joy_timer_sub(&tmp, &start_time_twin, &start_m);
+            start_m = t_r - joy_timeval_to_usec(&start_time_twin);
         }
     }
     s = r = 0;
     while ((s < s_idx) || (r < r_idx)) {
-        if (s >= s_idx) {
-            merged_lens[s+r] = pkt_len_twin[r];
-            tmp = pkt_time_twin[r];
-            joy_timer_sub(&tmp, &ts_start, &tmp_r);
-            merged_times[s+r] = joy_timeval_to_milliseconds(tmp_r);
-            ts_start = tmp;
-            r++;
-        } else if (r >= r_idx) {
+        if (r >= r_idx || (s < s_idx && t_s < t_r)) {
             merged_lens[s+r] = pkt_len[s];
-            tmp = pkt_time[s];
-            joy_timer_sub(&tmp, &ts_start, &tmp_r);
-            merged_times[s+r] = joy_timeval_to_milliseconds(tmp_r);
-            ts_start = tmp;
-            s++;
+            t = t_s;
+            merged_times[s+r] = joy_usec_to_milliseconds(t - t_last);
+            if (++s < s_idx) {
+                t_s = joy_time_delta_to_usec(time_base, pkt_time[s]);
+            }
         } else {
-            if (joy_timer_lt(&pkt_time[s], &pkt_time_twin[r])) {
-                merged_lens[s+r] = pkt_len[s];
-	               tmp = pkt_time[s];
-	               joy_timer_sub(&tmp, &ts_start, &tmp_r);
-	               merged_times[s+r] = joy_timeval_to_milliseconds(tmp_r);
-	               ts_start = tmp;
-                s++;
-            } else {
-                merged_lens[s+r] = pkt_len_twin[r];
-	               tmp = pkt_time_twin[r];
-	               joy_timer_sub(&tmp, &ts_start, &tmp_r);
-	               merged_times[s+r] = joy_timeval_to_milliseconds(tmp_r);
-	               ts_start = tmp;
-                r++;
+            merged_lens[s+r] = pkt_len_twin[r];
+            t = t_r;
+            merged_times[s+r] = joy_usec_to_milliseconds(t - t_last);
+            if (++r < r_idx) {
+                t_r = joy_time_delta_to_usec(time_base_twin, pkt_time_twin[r]);
             }
         }
+        t_last = t;
     }
-    merged_times[0] = joy_timeval_to_milliseconds(start_m);
+    merged_times[0] = joy_usec_to_milliseconds(start_m);
 }
 
 /* transform lens array to Markov chain */
@@ -405,15 +397,19 @@ void get_mc_rep_times (uint16_t *times, float *time_mc, uint16_t num_packets) {
 }
 
 /**
- * \fn float classify (const unsigned short *pkt_len, const struct timeval *pkt_time,
-        const unsigned short *pkt_len_twin, const struct timeval *pkt_time_twin,
+ * \fn float classify (const unsigned short *pkt_len, const joy_time_delta_t *pkt_time,
+        const joy_time_base_t *time_base,
+        const unsigned short *pkt_len_twin, const joy_time_delta_t *pkt_time_twin,
+        const joy_time_base_t *time_base_twin,
           struct timeval start_time, struct timeval start_time_twin, uint32_t max_num_pkt_len,
         uint16_t sp, uint16_t dp, uint32_t op, uint32_t ip, uint32_t np_o, uint32_t np_i,
         uint32_t ob, uint32_t ib, uint16_t use_bd, const uint32_t *bd, const uint32_t *bd_t)
  * \param pkt_len length of the packet
  * \param pkt_time time of the packet
+ * \param time_base base of the packet times
  * \param pkt_len_twin length of the packet twin
  * \param pkt_time_twin time of the packet twin
+ * \param time_base_twin base of the packet twin times
  * \param start_time start time
  * \param start_time_twin start time of the twin
  * \param max_num_pkt_len maximum len of number of packets
@@ -430,8 +426,10 @@ void get_mc_rep_times (uint16_t *times, float *time_mc, uint16_t num_packets) {
  * \param *bd_t pointer to bd type
  * \return float score
  */
-float classify (const unsigned short *pkt_len, const struct timeval *pkt_time,
-	       const unsigned short *pkt_len_twin, const struct timeval *pkt_time_twin,
+float classify (const unsigned short *pkt_len, const joy_time_delta_t *pkt_time,
+	       const joy_time_base_t *time_base,
+	       const unsigned short *pkt_len_twin, const joy_time_delta_t *pkt_time_twin,
+	       const joy_time_base_t *time_base_twin,
   	       struct timeval start_time, struct timeval start_time_twin, uint32_t max_num_pkt_len,
 	       uint16_t sp, uint16_t dp, uint32_t op, uint32_t ip, uint32_t np_o, uint32_t np_i,
 	       uint32_t ob, uint32_t ib, uint16_t use_bd, const uint32_t *bd, const uint32_t *bd_t) {
@@ -469,7 +467,7 @@ float classify (const unsigned short *pkt_len, const struct timeval *pkt_time,
     features[7] = 0.0;// skipping 7 until we process the pkt_time arrays
 
     // find the raw features
-    merge_splt_arrays(pkt_len, pkt_time, pkt_len_twin, pkt_time_twin, start_time, start_time_twin, op_n, ip_n,
+    merge_splt_arrays(pkt_len, pkt_time, time_base, pkt_len_twin, pkt_time_twin, time_base_twin, start_time, start_time_twin, op_n, ip_n,
 		                    merged_lens, merged_times);
 
     // find new duration
@@ -52,6 +52,12 @@
 #include "radix_trie.h"
 #include "hdr_dsc.h" 
 #include "p2f.h"
+#include "flow_table.h"
+#include "output_writer.h"
+#include "zsink.h"
+#include "joybin.h"
+#include "joyarrow.h"
+#include "json_buf.h"
 
 #ifdef WIN32
 #include "unistd.h"
@@ -141,6 +147,44 @@ static int parse_string (char **s, char *arg, int num_arg) {
     return ok;
 }
 
+/* parses the backpressure setting of the output writer */
+static int parse_backpressure (unsigned int *x, const char *arg, int num_arg) {
+    if (x == NULL || arg == NULL || num_arg != 2) {
+        return failure;
+    }
+
+    if (strcmp(arg, "block") == 0) {
+        *x = OUTPUT_WRITER_BLOCK;
+    } else if (strcmp(arg, "drop") == 0) {
+        *x = OUTPUT_WRITER_DROP;
+    } else if (strcmp(arg, "spill") == 0) {
+        *x = OUTPUT_WRITER_SPILL;
+    } else {
+        printf("error: value must be block, drop or spill");
+        return failure;
+    }
+    return ok;
+}
+
+/* parses the format of the flow records */
+static int parse_format (unsigned int *x, const char *arg, int num_arg) {
+    if (x == NULL || arg == NULL || num_arg != 2) {
+        return failure;
+    }
+
+    if (strcmp(arg, "json") == 0) {
+        *x = OUTPUT_FORMAT_JSON;
+    } else if (strcmp(arg, "binary") == 0) {
+        *x = OUTPUT_FORMAT_BINARY;
+    } else if (strcmp(arg, "arrow") == 0) {
+        *x = OUTPUT_FORMAT_ARROW;
+    } else {
+        printf("error: value must be json, binary or arrow");
+        return failure;
+    }
+    return ok;
+}
+
 /* parses mutliple part string values */
 static int parse_string_multiple (char **s, char *arg, int num_arg,
            unsigned int string_num, unsigned int string_num_max) {
@@ -292,6 +336,48 @@ static int config_parse_command (struct configuration *config,
     } else if (match(command, "aux_resource_path")) {
         parse_check(parse_string(&config->aux_resource_path, arg, num));
 
+    } else if (match(command, "hugepages")) {
+        parse_check(parse_bool(&config->hugepages, arg, num));
+
+    } else if (match(command, "afpacket_ring")) {
+        parse_check(parse_int(&config->afpacket_ring, arg, num, 0, 4096));
+
+    } else if (match(command, "afpacket")) {
+        parse_check(parse_bool(&config->afpacket, arg, num));
+
+    } else if (match(command, "flow_table_size")) {
+        parse_check(parse_int(&config->flow_table_size, arg, num, 0, FLOW_TABLE_MAX_CAPACITY));
+
+    } else if (match(command, "max_flows")) {
+        parse_check(parse_int(&config->max_flows, arg, num, 0, FLOW_TABLE_MAX_CAPACITY));
+
+    } else if (match(command, "admission")) {
+        parse_check(parse_bool(&config->admission, arg, num));
+
+    } else if (match(command, "dedup")) {
+        parse_check(parse_int(&config->dedup, arg, num, 0, 1000000));
+
+    } else if (match(command, "writer_queue")) {
+        parse_check(parse_int(&config->writer_queue, arg, num, 0, 1 << 20));
+
+    } else if (match(command, "backpressure")) {
+        parse_check(parse_backpressure(&config->backpressure, arg, num));
+
+    } else if (match(command, "compress_threads")) {
+        parse_check(parse_int(&config->compress_threads, arg, num, 0, ZSINK_MAX_THREADS));
+
+    } else if (match(command, "compress_level")) {
+        parse_check(parse_int(&config->compress_level, arg, num, 0, 9));
+
+    } else if (match(command, "format")) {
+        parse_check(parse_format(&config->output_format, arg, num));
+
+    } else if (match(command, "threads")) {
+        parse_check(parse_int(&config->num_threads, arg, num, 0, MAX_NUM_THREADS));
+
+    } else if (match(command, "jobs")) {
+        parse_check(parse_int(&config->num_jobs, arg, num, 0, MAX_NUM_THREADS));
+
     } else if (match(command, "preemptive_timeout")) {
         parse_check(parse_bool(&config->preemptive_timeout, arg, num));
 
@@ -533,6 +619,21 @@ void config_print (FILE *f, const struct configuration *c) {
     fprintf(f, "outputdir = %s\n", val(c->outputdir));
     fprintf(f, "username = %s\n", val(c->username));
     fprintf(f, "count = %u\n", c->max_records); 
+    fprintf(f, "flow_table_size = %u\n", c->flow_table_size);
+    fprintf(f, "max_flows = %u\n", c->max_flows);
+    fprintf(f, "admission = %u\n", c->admission);
+    fprintf(f, "dedup = %u\n", c->dedup);
+    fprintf(f, "writer_queue = %u\n", c->writer_queue);
+    fprintf(f, "backpressure = %s\n", output_writer_backpressure_name(c->backpressure));
+    fprintf(f, "compress_threads = %u\n", c->compress_threads);
+    fprintf(f, "compress_level = %u\n", c->compress_level);
+    fprintf(f, "format = %s\n", c->output_format == OUTPUT_FORMAT_ARROW ? "arrow" :
+                                 c->output_format == OUTPUT_FORMAT_BINARY ? "binary" : "json");
+    fprintf(f, "hugepages = %u\n", c->hugepages);
+    fprintf(f, "threads = %u\n", c->num_threads);
+    fprintf(f, "jobs = %u\n", c->num_jobs);
+    fprintf(f, "afpacket = %u\n", c->afpacket);
+    fprintf(f, "afpacket_ring = %u\n", c->afpacket_ring);
     fprintf(f, "upload = %s\n", val(c->upload_servername));
     fprintf(f, "keyfile = %s\n", val(c->upload_key));
     for (i=0; i<c->num_subnets; i++) {
@@ -569,40 +670,161 @@ void config_print (FILE *f, const struct configuration *c) {
  * \return none
  */
 void config_print_json (zfile f, const struct configuration *c) {
+    json_buf_t line;
     unsigned int i;
 
-    zprintf(f, "{\"version\":\"%s\",", VERSION);
-    zprintf(f, "\"interface\":\"%s\",", val(c->intface));
-    zprintf(f, "\"promisc\":%u,", c->promisc);
-    zprintf(f, "\"output\":\"%s\",", val(c->filename));
-    zprintf(f, "\"outputdir\":\"%s\",", val(c->outputdir));
-    zprintf(f, "\"username\":\"%s\",", val(c->username));
-    zprintf(f, "\"info\":\"%s\",", val(c->logfile));
-    zprintf(f, "\"count\":%u,", c->max_records); 
-    zprintf(f, "\"upload\":\"%s\",", val(c->upload_servername));
-    zprintf(f, "\"keyfile\":\"%s\",", val(c->upload_key));
+    if (json_buf_init(&line, JSON_BUF_INITIAL_SIZE) != ok) {
+        return;
+    }
+
+    json_buf_printf(&line, "{\"version\":\"%s\",", VERSION);
+    json_buf_printf(&line, "\"interface\":\"%s\",", val(c->intface));
+    json_buf_printf(&line, "\"promisc\":%u,", c->promisc);
+    json_buf_printf(&line, "\"output\":\"%s\",", val(c->filename));
+    json_buf_printf(&line, "\"outputdir\":\"%s\",", val(c->outputdir));
+    json_buf_printf(&line, "\"username\":\"%s\",", val(c->username));
+    json_buf_printf(&line, "\"info\":\"%s\",", val(c->logfile));
+    json_buf_printf(&line, "\"count\":%u,", c->max_records); 
+    json_buf_printf(&line, "\"upload\":\"%s\",", val(c->upload_servername));
+    json_buf_printf(&line, "\"keyfile\":\"%s\",", val(c->upload_key));
     for (i=0; i<c->num_subnets; i++) {
-        zprintf(f, "\"label\":\"%s\",", c->subnet[i]);
-    }
-    zprintf(f, "\"retain\":%u,", c->retain_local);
-    zprintf(f, "\"bidir\":%u,", c->bidir);
-    zprintf(f, "\"num_pkts\":%u,", c->num_pkts);
-    zprintf(f, "\"zeros\":%u,", c->include_zeroes);
-    zprintf(f, "\"retrans\":%u,", c->include_retrans);
-    zprintf(f, "\"dist\":%u,", c->byte_distribution);
-    zprintf(f, "\"cdist\":\"%s\",", val(c->compact_byte_distribution));
-    zprintf(f, "\"entropy\":%u,", c->report_entropy);
-    zprintf(f, "\"hd\":%u,", c->report_hd);
-    zprintf(f, "\"classify\":%u,", c->include_classifier);
-    zprintf(f, "\"idp\":%u,", c->idp);
-    zprintf(f, "\"exe\":%u,", c->report_exe);
-    zprintf(f, "\"anon\":\"%s\",", val(c->anon_addrs_file));
-    zprintf(f, "\"useranon\":\"%s\",", val(c->anon_http_file));
-    zprintf(f, "\"bpf\":\"%s\",", val(c->bpf_filter_exp));
-    zprintf(f, "\"verbosity\":%u,", c->verbosity);
+        json_buf_printf(&line, "\"label\":\"%s\",", c->subnet[i]);
+    }
+    json_buf_printf(&line, "\"retain\":%u,", c->retain_local);
+    json_buf_printf(&line, "\"bidir\":%u,", c->bidir);
+    json_buf_printf(&line, "\"num_pkts\":%u,", c->num_pkts);
+    json_buf_printf(&line, "\"zeros\":%u,", c->include_zeroes);
+    json_buf_printf(&line, "\"retrans\":%u,", c->include_retrans);
+    json_buf_printf(&line, "\"dist\":%u,", c->byte_distribution);
+    json_buf_printf(&line, "\"cdist\":\"%s\",", val(c->compact_byte_distribution));
+    json_buf_printf(&line, "\"entropy\":%u,", c->report_entropy);
+    json_buf_printf(&line, "\"hd\":%u,", c->report_hd);
+    json_buf_printf(&line, "\"classify\":%u,", c->include_classifier);
+    json_buf_printf(&line, "\"idp\":%u,", c->idp);
+    json_buf_printf(&line, "\"exe\":%u,", c->report_exe);
+    json_buf_printf(&line, "\"anon\":\"%s\",", val(c->anon_addrs_file));
+    json_buf_printf(&line, "\"useranon\":\"%s\",", val(c->anon_http_file));
+    json_buf_printf(&line, "\"bpf\":\"%s\",", val(c->bpf_filter_exp));
+    json_buf_printf(&line, "\"verbosity\":%u,", c->verbosity);
 
     config_print_json_all_features_bool(feature_list);
 
-    zprintf(f, "\"end-config\":1}\n");  
+    json_buf_printf(&line, "\"end-config\":1}\n");  
+
+    if (c->output_format == OUTPUT_FORMAT_BINARY) {
+        joybin_schema_t schema;
+        uint8_t header[JOYBIN_MAX_NAME * (JOYBIN_MAX_OMITTED + 8)];
+        size_t len;
+
+        /* the configuration line completes the header of a binary file */
+        config_binary_schema(c, &schema);
+        len = joybin_header_encode(header, sizeof(header), &schema);
+        if (len) {
+            zwrite(f, header, len);
+        }
+    }
+
+    if (c->output_format == OUTPUT_FORMAT_ARROW) {
+        joybin_schema_t schema;
+        uint8_t *msg;
+        size_t len = 0;
+
+        /* an Arrow stream starts with its schema, which holds the configuration line */
+        config_binary_schema(c, &schema);
+        msg = malloc(JOYARROW_META_MAX);
+        if (msg != NULL && !line.failed) {
+            len = joyarrow_schema_encode(msg, JOYARROW_META_MAX, &schema, line.data, line.len - 1);
+        }
+        if (len) {
+            zwrite(f, msg, len);
+        } else {
+            joy_log_err("could not write the schema of the Arrow stream");
+        }
+        free(msg);
+    } else {
+        json_buf_commit(&line, f);
+    }
+    json_buf_free(&line);
+}
+
+/**
+ * \fn unsigned int config_binary_fields (const struct configuration *c)
+ * \param c pointer to the configuration structure
+ * \return the optional fields that binary flow records carry, as joybin_field_e bits
+ */
+unsigned int config_binary_fields (const struct configuration *c) {
+    unsigned int fields = 0;
+
+    if (c->byte_distribution) {
+        fields |= JOYBIN_BYTE_DIST;
+    }
+    if (c->compact_byte_distribution) {
+        fields |= JOYBIN_COMPACT_BYTE_DIST;
+    }
+    if (c->report_entropy) {
+        fields |= JOYBIN_ENTROPY;
+    }
+    if (c->include_classifier) {
+        fields |= JOYBIN_P_MALWARE;
+    }
+    if (c->idp) {
+        fields |= JOYBIN_IDP;
+    }
+    return fields;
+}
+
+/* notes in the schema that what JSON output has under name is not carried */
+static void config_binary_omit (joybin_schema_t *schema, const char *name) {
+    if (schema->num_omitted < JOYBIN_MAX_OMITTED) {
+        strncpy_s(schema->omitted[schema->num_omitted], JOYBIN_MAX_NAME, name, JOYBIN_MAX_NAME - 1);
+        schema->num_omitted++;
+    }
+}
+
+#define config_feature_on(F) || c->report_##F
+
+/**
+ * \fn int config_check_format (const struct configuration *c)
+ * \brief check that the output format carries what the configuration reports
+ * \param c pointer to the configuration structure
+ * \return ok
+ * \return failure - binary records and arrow columns cannot carry the data
+ *         of the feature modules
+ */
+int config_check_format (const struct configuration *c) {
+    if (c->output_format == OUTPUT_FORMAT_BINARY && (0 MAP(config_feature_on, feature_list))) {
+        joy_log_crit("format=binary cannot be used with the feature modules (dns, tls, http, ...)");
+        return failure;
+    }
+    if (c->output_format == OUTPUT_FORMAT_ARROW && (0 MAP(config_feature_on, feature_list))) {
+        joy_log_crit("format=arrow cannot be used with the feature modules (dns, tls, http, ...)");
+        return failure;
+    }
+    return ok;
+}
+
+/**
+ * \fn void config_binary_schema (const struct configuration *c, joybin_schema_t *schema)
+ * \param c pointer to the configuration structure
+ * \param schema schema of the binary flow records written with this configuration
+ * \return none
+ */
+void config_binary_schema (const struct configuration *c, joybin_schema_t *schema) {
+    memset_s(schema, sizeof(joybin_schema_t), 0, sizeof(joybin_schema_t));
+    schema->num_pkts = c->num_pkts;
+    schema->fields = config_binary_fields(c);
+
+    /* what flow_record_print_json() prints that binary records leave out */
+    if (c->num_subnets) {
+        config_binary_omit(schema, "labels");
+    }
+    config_binary_omit(schema, "opts");
+    config_binary_omit(schema, "probable_os");
+    if (c->report_exe) {
+        config_binary_omit(schema, "exe");
+    }
+    if (c->report_hd) {
+        config_binary_omit(schema, "hd");
+    }
 }
 
@@ -127,16 +127,17 @@ static const char *dhcp_option_message_types[] = {
  * \brief Initialize the memory of DHCP struct.
  *
  * \param dhcp_handle contains dhcp structure to initialize
+ * \param pool pool to allocate the structure from, or NULL for the heap
  *
  * \return none
  */
-void dhcp_init(dhcp_t **dhcp_handle)
+void dhcp_init(dhcp_t **dhcp_handle, flow_pool_t *pool)
 {
     if (*dhcp_handle != NULL) {
-        dhcp_delete(dhcp_handle);
+        dhcp_delete(dhcp_handle, pool);
     }
 
-    *dhcp_handle = calloc(1, sizeof(dhcp_t));
+    *dhcp_handle = flow_pool_calloc(pool, sizeof(dhcp_t));
     if (*dhcp_handle == NULL) {
         /* Allocation failed */
         joy_log_err("malloc failed");
@@ -148,10 +149,11 @@ void dhcp_init(dhcp_t **dhcp_handle)
  * \brief Delete the memory of DHCP struct \r.
  *
  * \param dhcp_handle contains dhcp structure to delete
+ * \param pool pool that the structure was allocated from, or NULL
  *
  * \return none
  */
-void dhcp_delete(dhcp_t **dhcp_handle)
+void dhcp_delete(dhcp_t **dhcp_handle, flow_pool_t *pool)
 {
     int i = 0;
     dhcp_t *dhcp = *dhcp_handle;
@@ -180,7 +182,7 @@ void dhcp_delete(dhcp_t **dhcp_handle)
     }
 
     /* Free the memory and set to NULL */
-    free(dhcp);
+    flow_pool_free(pool, dhcp);
     *dhcp_handle = NULL;
 }
 
@@ -792,8 +794,8 @@ static int dhcp_test_vanilla_parsing(void) {
     unsigned char kat_chaddr[] = {0x08, 0x00, 0x27, 0x83, 0xf4, 0x42, 0x00, 0x00,
                                   0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
 
-    dhcp_init(&d);
-    dhcp_init(&known_dhcp);
+    dhcp_init(&d, NULL);
+    dhcp_init(&known_dhcp, NULL);
 
     /*
      * Known answers
@@ -958,8 +960,8 @@ end:
     if (pcap_handle) {
         pcap_close(pcap_handle);
     }
-    dhcp_delete(&d);
-    dhcp_delete(&known_dhcp);
+    dhcp_delete(&d, NULL);
+    dhcp_delete(&known_dhcp, NULL);
 
     return num_fails;
 }
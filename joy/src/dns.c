@@ -682,15 +682,16 @@ void dns_unit_test () {
  * \brief Initialize the memory of DNS struct.
  *
  * \param dns_handle contains dns structure to initialize
+ * \param pool pool to allocate the structure from, or NULL for the heap
  *
  * \return none
  */
-void dns_init (dns_t **dns_handle) {
+void dns_init (dns_t **dns_handle, flow_pool_t *pool) {
     if (*dns_handle != NULL) {
-        dns_delete(dns_handle);
+        dns_delete(dns_handle, pool);
     }
 
-    *dns_handle = calloc(1, sizeof(dns_t));
+    *dns_handle = flow_pool_calloc(pool, sizeof(dns_t));
     if (*dns_handle == NULL) {
         /* Allocation failed */
         joy_log_err("malloc failed");
@@ -702,10 +703,11 @@ void dns_init (dns_t **dns_handle) {
  * \brief Delete the memory of DNS struct.
  *
  * \param dns_handle contains dns structure to delete
+ * \param pool pool that the structure was allocated from, or NULL
  *
  * \return none
  */
-void dns_delete (dns_t **dns_handle) {
+void dns_delete (dns_t **dns_handle, flow_pool_t *pool) {
     unsigned int i;
     dns_t *dns = *dns_handle;
 
@@ -720,7 +722,7 @@ void dns_delete (dns_t **dns_handle) {
     }
 
     /* Free the memory and set to NULL */
-    free(dns);
+    flow_pool_free(pool, dns);
     *dns_handle = NULL;
 }
 
@@ -54,15 +54,16 @@ extern FILE *info;
  * \brief Initialize the memory of Example struct.
  *
  * \param example_handle contains example structure to init
+ * \param pool pool to allocate the structure from, or NULL for the heap
  *
  * \return none
  */
-__inline void example_init (struct example **example_handle) {
+__inline void example_init (struct example **example_handle, flow_pool_t *pool) {
     if (*example_handle != NULL) {
-        example_delete(example_handle);
+        example_delete(example_handle, pool);
     }
 
-    *example_handle = calloc(1, sizeof(struct example));
+    *example_handle = flow_pool_calloc(pool, sizeof(struct example));
     if (*example_handle == NULL) {
         /* Allocation failed */
         joy_log_err("malloc failed");
@@ -125,10 +126,11 @@ void example_print_json (const struct example *x1, const struct example *x2, zfi
  * \brief Delete the memory of Example struct.
  *
  * \param example_handle contains example structure to delete
+ * \param pool pool that the structure was allocated from, or NULL
  *
  * \return none
  */
-void example_delete (struct example **example_handle) { 
+void example_delete (struct example **example_handle, flow_pool_t *pool) { 
     struct example *example = *example_handle;
 
     if (example == NULL) {
@@ -136,7 +138,7 @@ void example_delete (struct example **example_handle) {
     }
 
     /* Free the memory and set to NULL */
-    free(example);
+    flow_pool_free(pool, example);
     *example_handle = NULL;
 }
 
@@ -149,7 +151,7 @@ void example_unit_test () {
     struct example *example = NULL;
     const struct pcap_pkthdr *header = NULL; 
 
-    example_init(&example);
+    example_init(&example, NULL);
     example_update(example, header, NULL, 1, 1);
     example_update(example, header, NULL, 2, 1);
     example_update(example, header, NULL, 3, 1);
@@ -160,6 +162,6 @@ void example_unit_test () {
     example_update(example, header, NULL, 8, 1);
     example_update(example, header, NULL, 9, 1);
 
-    example_delete(&example);
+    example_delete(&example, NULL);
 } 
 
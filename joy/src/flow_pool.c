@@ -0,0 +1,688 @@
+/*
+ *
+ * Copyright (c) 2018 Cisco Systems, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials provided
+ *   with the distribution.
+ *
+ *   Neither the name of the Cisco Systems, Inc. nor the names of its
+ *   contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+/**
+ * \file flow_pool.c
+ *
+ * \brief slab pools for flow records and per-feature state
+ *
+ ** Each pool carves its slabs into objects of a single (rounded up)
+ *  size.  Free objects are kept on a singly linked list threaded
+ *  through their first word, so allocation and release are both a
+ *  couple of pointer moves.  When the free list runs dry a new slab is
+ *  allocated and all of its objects are pushed onto the list.
+ *
+ ** With huge pages enabled, a slab is a whole huge page obtained with
+ *  mmap(MAP_HUGETLB); if the system has no huge pages reserved, the
+ *  slab is allocated on a huge page boundary and the kernel is asked to
+ *  back it with transparent huge pages instead.
+ *
+ */
+
+#include <stdlib.h>
+#ifndef WIN32
+#include <sys/mman.h>
+#endif
+#include "safe_lib.h"
+#include "p2f.h"
+#include "flow_pool.h"
+#include "err.h"
+
+/** space at the start of a slab taken by its header */
+#define FLOW_POOL_SLAB_HDR \
+    ((sizeof(flow_pool_slab_t) + FLOW_POOL_ALIGN - 1) & ~((size_t)FLOW_POOL_ALIGN - 1))
+
+/**
+ * \brief Set up a pool of fixed size objects.
+ *
+ * No memory is allocated until the first object is requested.  If the
+ * pool already holds slabs for objects of the same size (because it is
+ * being set up again for another input file), they are kept, along
+ * with the free list and the counters.
+ *
+ * \param p Pool
+ * \param name Name of the pool, used in the stats output
+ * \param obj_size Size of the objects
+ * \param use_hugepages Nonzero to back the slabs with huge pages
+ * \return none
+ */
+void flow_pool_init (flow_pool_t *p, const char *name, size_t obj_size, unsigned int use_hugepages) {
+    size_t slab_bytes;
+
+    if (obj_size < sizeof(void *)) {
+        obj_size = sizeof(void *);
+    }
+    obj_size = (obj_size + FLOW_POOL_ALIGN - 1) & ~((size_t)FLOW_POOL_ALIGN - 1);
+
+    if (p->slabs != NULL && p->obj_size == obj_size) {
+        p->name = name;
+        return;
+    }
+    flow_pool_destroy(p);
+
+    slab_bytes = use_hugepages ? FLOW_POOL_HUGEPAGE_SIZE : FLOW_POOL_SLAB_SIZE;
+    while (slab_bytes < FLOW_POOL_SLAB_HDR + FLOW_POOL_MIN_OBJECTS * obj_size) {
+        slab_bytes *= 2;
+    }
+
+    p->name = name;
+    p->obj_size = obj_size;
+    p->objs_per_slab = (unsigned int)((slab_bytes - FLOW_POOL_SLAB_HDR) / obj_size);
+    p->use_hugepages = use_hugepages;
+    p->free_list = NULL;
+    p->slabs = NULL;
+    p->num_slabs = 0;
+    p->num_huge_slabs = 0;
+    p->in_use = 0;
+    p->high_water = 0;
+    p->alloc_fails = 0;
+}
+
+/**
+ * \brief Release the memory of a slab.
+ * \param s Slab
+ * \return none
+ */
+static void flow_pool_slab_free (flow_pool_slab_t *s) {
+#ifndef WIN32
+    if (s->mapped) {
+        munmap(s, s->bytes);
+        return;
+    }
+#endif
+    free(s);
+}
+
+/**
+ * \brief Release all of the slabs of a pool.
+ *
+ * Every object handed out by the pool becomes invalid; the pool is left
+ * empty, and has to be set up with flow_pool_init() before it is used
+ * again.
+ *
+ * \param p Pool
+ * \return none
+ */
+void flow_pool_destroy (flow_pool_t *p) {
+    flow_pool_slab_t *s, *next;
+
+    if (p->in_use) {
+        joy_log_warn("pool %s destroyed with %lu objects in use", p->name, p->in_use);
+    }
+    for (s = p->slabs; s != NULL; s = next) {
+        next = s->next;
+        flow_pool_slab_free(s);
+    }
+    p->slabs = NULL;
+    p->free_list = NULL;
+    p->num_slabs = 0;
+    p->num_huge_slabs = 0;
+    p->in_use = 0;
+    p->obj_size = 0;
+}
+
+/**
+ * \brief Allocate the memory for a new slab.
+ * \param p Pool
+ * \param bytes Size of the slab
+ * \return Slab (with bytes and mapped set), or NULL if out of memory
+ */
+static flow_pool_slab_t *flow_pool_slab_alloc (flow_pool_t *p, size_t bytes) {
+    flow_pool_slab_t *s = NULL;
+
+#ifndef WIN32
+    if (p->use_hugepages) {
+        void *mem = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+        mem = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (mem != MAP_FAILED) {
+            p->num_huge_slabs++;
+        }
+#endif
+        if (mem == MAP_FAILED) {
+            /* no reserved huge pages; fall back on transparent ones */
+            if (posix_memalign(&mem, FLOW_POOL_HUGEPAGE_SIZE, bytes) != 0) {
+                return NULL;
+            }
+#ifdef MADV_HUGEPAGE
+            madvise(mem, bytes, MADV_HUGEPAGE);
+#endif
+            s = mem;
+            s->mapped = 0;
+        } else {
+            s = mem;
+            s->mapped = 1;
+        }
+        s->bytes = bytes;
+        return s;
+    }
+#endif
+
+    s = malloc(bytes);
+    if (s == NULL) {
+        return NULL;
+    }
+    s->bytes = bytes;
+    s->mapped = 0;
+    return s;
+}
+
+/**
+ * \brief Add a slab to a pool and put all of its objects on the free list.
+ * \param p Pool
+ * \return ok, or failure if the slab could not be allocated
+ */
+static joy_status_e flow_pool_grow (flow_pool_t *p) {
+    size_t bytes = FLOW_POOL_SLAB_HDR + (size_t)p->objs_per_slab * p->obj_size;
+    flow_pool_slab_t *s;
+    unsigned char *obj;
+    unsigned int i;
+
+    if (p->use_hugepages) {
+        bytes = (bytes + FLOW_POOL_HUGEPAGE_SIZE - 1) & ~((size_t)FLOW_POOL_HUGEPAGE_SIZE - 1);
+    }
+    s = flow_pool_slab_alloc(p, bytes);
+    if (s == NULL) {
+        p->alloc_fails++;
+        return failure;
+    }
+    s->next = p->slabs;
+    p->slabs = s;
+    p->num_slabs++;
+
+    /* push in reverse, so that objects are handed out in address order */
+    obj = (unsigned char *)s + FLOW_POOL_SLAB_HDR + (size_t)(p->objs_per_slab - 1) * p->obj_size;
+    for (i = 0; i < p->objs_per_slab; i++) {
+        *(void **)obj = p->free_list;
+        p->free_list = obj;
+        obj -= p->obj_size;
+    }
+
+    return ok;
+}
+
+/**
+ * \brief Get an object from a pool.
+ *
+ * The contents of the object are undefined.  If \p p is NULL, the
+ * object comes from malloc() and has to be released with
+ * flow_pool_free(NULL, obj).
+ *
+ * \param p Pool, or NULL
+ * \param size Size of the object, which must fit in the pool objects
+ * \return Object, or NULL if out of memory
+ */
+void *flow_pool_alloc (flow_pool_t *p, size_t size) {
+    void *obj;
+
+    if (p == NULL) {
+        return malloc(size);
+    }
+    if (p->obj_size == 0) {
+        /* pool was never set up; size it for this object */
+        flow_pool_init(p, p->name ? p->name : "unnamed", size, p->use_hugepages);
+    }
+    if (size > p->obj_size) {
+        joy_log_err("object of %zu bytes does not fit in pool %s", size, p->name);
+        return NULL;
+    }
+    if (p->free_list == NULL && flow_pool_grow(p) != ok) {
+        return NULL;
+    }
+
+    obj = p->free_list;
+    p->free_list = *(void **)obj;
+    if (++p->in_use > p->high_water) {
+        p->high_water = p->in_use;
+    }
+
+    return obj;
+}
+
+/**
+ * \brief Get a zeroed object from a pool.
+ * \param p Pool, or NULL to use calloc()
+ * \param size Size of the object, which must fit in the pool objects
+ * \return Object, or NULL if out of memory
+ */
+void *flow_pool_calloc (flow_pool_t *p, size_t size) {
+    void *obj;
+
+    if (p == NULL) {
+        return calloc(1, size);
+    }
+    obj = flow_pool_alloc(p, size);
+    if (obj != NULL) {
+        memset_s(obj, size, 0x00, size);
+    }
+
+    return obj;
+}
+
+/**
+ * \brief Return an object to its pool.
+ * \param p Pool that the object came from, or NULL if it came from malloc()
+ * \param obj Object (NULL is ignored)
+ * \return none
+ */
+void flow_pool_free (flow_pool_t *p, void *obj) {
+    if (obj == NULL) {
+        return;
+    }
+    if (p == NULL) {
+        free(obj);
+        return;
+    }
+
+    *(void **)obj = p->free_list;
+    p->free_list = obj;
+    p->in_use--;
+}
+
+/**
+ * \brief Amount of slab memory held by a pool.
+ * \param p Pool
+ * \return Number of bytes
+ */
+size_t flow_pool_bytes (const flow_pool_t *p) {
+    const flow_pool_slab_t *s;
+    size_t bytes = 0;
+
+    for (s = p->slabs; s != NULL; s = s->next) {
+        bytes += s->bytes;
+    }
+
+    return bytes;
+}
+
+/**
+ * \brief Print the occupancy of a pool.
+ * \param p Pool
+ * \param prefix Text printed at the start of the line
+ * \param f Output file
+ * \return none
+ */
+void flow_pool_print_stats (const flow_pool_t *p, const char *prefix, FILE *f) {
+    fprintf(f, "%s pool %s: %lu in use, %lu peak, %lu of %lu slabs on huge pages, %lu KB, %lu alloc fails\n",
+            prefix, p->name ? p->name : "unnamed", p->in_use, p->high_water,
+            p->num_huge_slabs, p->num_slabs, (unsigned long)(flow_pool_bytes(p) / 1024), p->alloc_fails);
+}
+
+/** names of the pools of a pool set, one per size class */
+static const char *flow_pool_set_names[FLOW_POOL_SET_CLASSES] = {
+    "cold_32", "cold_64", "cold_128", "cold_256",
+    "cold_512", "cold_1024", "cold_2048", "cold_4096"
+};
+
+/**
+ * \brief Find the size class of an object.
+ * \param size Size of the object
+ * \return Index of the size class, or -1 if the object is too large
+ */
+static int flow_pool_set_class (size_t size) {
+    size_t class_size = FLOW_POOL_SET_MIN_SIZE;
+    int i;
+
+    for (i = 0; i < FLOW_POOL_SET_CLASSES; i++) {
+        if (size <= class_size) {
+            return i;
+        }
+        class_size <<= 1;
+    }
+
+    return -1;
+}
+
+/**
+ * \brief Set up the pools of a pool set.
+ *
+ * As with flow_pool_init(), no memory is allocated until an object is
+ * requested, and slabs that the set already holds are kept.
+ *
+ * \param s Pool set
+ * \param use_hugepages Nonzero to back the slabs with huge pages
+ * \return none
+ */
+void flow_pool_set_init (flow_pool_set_t *s, unsigned int use_hugepages) {
+    int i;
+
+    for (i = 0; i < FLOW_POOL_SET_CLASSES; i++) {
+        flow_pool_init(&s->pools[i], flow_pool_set_names[i],
+                       (size_t)FLOW_POOL_SET_MIN_SIZE << i, use_hugepages);
+    }
+}
+
+/**
+ * \brief Release all of the slabs of a pool set.
+ * \param s Pool set
+ * \return none
+ */
+void flow_pool_set_destroy (flow_pool_set_t *s) {
+    int i;
+
+    for (i = 0; i < FLOW_POOL_SET_CLASSES; i++) {
+        flow_pool_destroy(&s->pools[i]);
+    }
+}
+
+/**
+ * \brief Number of bytes that a pool set reserves for an object.
+ *
+ * Callers that grow an array can use this to make use of all of the
+ * room in the size class of the array.
+ *
+ * \param size Size of the object
+ * \return Size of its size class, or \p size if it is too large for the set
+ */
+size_t flow_pool_set_class_size (size_t size) {
+    int i = flow_pool_set_class(size);
+
+    return (i < 0) ? size : (size_t)FLOW_POOL_SET_MIN_SIZE << i;
+}
+
+/**
+ * \brief Find the pool of a size class, setting it up again if needed.
+ *
+ * A context whose flow records were freed (for instance by
+ * joy_context_cleanup()) can still be used; its pools are then set up
+ * again here for the size of their class, rather than by
+ * flow_pool_alloc() for the size of the first object requested.
+ *
+ * \param s Pool set
+ * \param i Index of the size class
+ * \return Pool
+ */
+static flow_pool_t *flow_pool_set_pool (flow_pool_set_t *s, int i) {
+    flow_pool_t *p = &s->pools[i];
+
+    if (p->obj_size == 0) {
+        flow_pool_init(p, flow_pool_set_names[i], (size_t)FLOW_POOL_SET_MIN_SIZE << i, p->use_hugepages);
+    }
+
+    return p;
+}
+
+/**
+ * \brief Get an object from the pool of its size class.
+ * \param s Pool set, or NULL to use malloc()
+ * \param size Size of the object
+ * \return Object, or NULL if out of memory
+ */
+void *flow_pool_set_alloc (flow_pool_set_t *s, size_t size) {
+    int i = flow_pool_set_class(size);
+
+    if (s == NULL || i < 0) {
+        return malloc(size);
+    }
+
+    return flow_pool_alloc(flow_pool_set_pool(s, i), size);
+}
+
+/**
+ * \brief Get a zeroed object from the pool of its size class.
+ * \param s Pool set, or NULL to use calloc()
+ * \param size Size of the object
+ * \return Object, or NULL if out of memory
+ */
+void *flow_pool_set_calloc (flow_pool_set_t *s, size_t size) {
+    int i = flow_pool_set_class(size);
+
+    if (s == NULL || i < 0) {
+        return calloc(1, size);
+    }
+
+    return flow_pool_calloc(flow_pool_set_pool(s, i), size);
+}
+
+/**
+ * \brief Return an object to its pool set.
+ * \param s Pool set that the object came from, or NULL if it came from malloc()
+ * \param obj Object (NULL is ignored)
+ * \param size Size the object was allocated with
+ * \return none
+ */
+void flow_pool_set_free (flow_pool_set_t *s, void *obj, size_t size) {
+    int i = flow_pool_set_class(size);
+
+    if (s == NULL || i < 0) {
+        free(obj);
+        return;
+    }
+    flow_pool_free(&s->pools[i], obj);
+}
+
+/**
+ * \brief Print the occupancy of the size classes of a pool set.
+ * \param s Pool set
+ * \param prefix Text printed at the start of each line
+ * \param f Output file
+ * \return none
+ */
+void flow_pool_set_print_stats (const flow_pool_set_t *s, const char *prefix, FILE *f) {
+    int i;
+
+    for (i = 0; i < FLOW_POOL_SET_CLASSES; i++) {
+        if (s->pools[i].num_slabs) {
+            flow_pool_print_stats(&s->pools[i], prefix, f);
+        }
+    }
+}
+
+/**
+ * \brief Exercise a pool by allocating and releasing objects.
+ * \param p Pool, already set up for objects of size bytes
+ * \param size Size of the objects
+ * \return Number of failures
+ */
+static int flow_pool_test_pool (flow_pool_t *p, size_t size) {
+    unsigned char **objs;
+    unsigned int i, j, n = 3 * p->objs_per_slab + 1;
+    unsigned long int num_slabs;
+    int num_fails = 0;
+
+    objs = calloc(n, sizeof(unsigned char *));
+    if (objs == NULL) {
+        return 1;
+    }
+
+    for (i = 0; i < n; i++) {
+        objs[i] = flow_pool_calloc(p, size);
+        if (objs[i] == NULL) {
+            joy_log_err("pool %s: allocation %u failed", p->name, i);
+            num_fails++;
+            break;
+        }
+        if ((size_t)objs[i] % FLOW_POOL_ALIGN) {
+            joy_log_err("pool %s: object %u is misaligned", p->name, i);
+            num_fails++;
+        }
+        for (j = 0; j < size; j++) {
+            if (objs[i][j] != 0) {
+                joy_log_err("pool %s: object %u is not zeroed", p->name, i);
+                num_fails++;
+                break;
+            }
+        }
+        memset_s(objs[i], size, 0xa5, size);
+    }
+    if (num_fails) {
+        n = i;
+    }
+    if (p->in_use != n || p->high_water != n || p->num_slabs != 4) {
+        joy_log_err("pool %s: %lu in use, %lu peak, %lu slabs after %u allocations",
+                    p->name, p->in_use, p->high_water, p->num_slabs, n);
+        num_fails++;
+    }
+
+    /* released objects are reused before any new slab is allocated */
+    num_slabs = p->num_slabs;
+    for (i = 0; i < n; i += 2) {
+        flow_pool_free(p, objs[i]);
+    }
+    for (i = 0; i < n; i += 2) {
+        objs[i] = flow_pool_calloc(p, size);
+        if (objs[i] == NULL || objs[i][0] != 0) {
+            joy_log_err("pool %s: reallocation %u failed", p->name, i);
+            num_fails++;
+        }
+    }
+    if (p->num_slabs != num_slabs || p->high_water != n) {
+        joy_log_err("pool %s: grew to %lu slabs (peak %lu) while reusing objects",
+                    p->name, p->num_slabs, p->high_water);
+        num_fails++;
+    }
+
+    for (i = 0; i < n; i++) {
+        flow_pool_free(p, objs[i]);
+    }
+    if (p->in_use != 0) {
+        joy_log_err("pool %s: %lu objects in use after freeing all", p->name, p->in_use);
+        num_fails++;
+    }
+    free(objs);
+
+    return num_fails;
+}
+
+/**
+ * \brief Unit test for the pools.
+ * \param none
+ * \return Number of failures
+ */
+int flow_pool_unit_test (void) {
+    flow_pool_t pool;
+    flow_pool_set_t set;
+    void *obj;
+    int num_fails = 0;
+
+    fprintf(info, "\n******************************\n");
+    fprintf(info, "Flow pool Unit Test starting...\n");
+
+    /* small objects, then reuse of the same slabs by a second init */
+    memset_s(&pool, sizeof(pool), 0x00, sizeof(pool));
+    flow_pool_init(&pool, "small", 40, 0);
+    if (pool.obj_size != 48) {
+        joy_log_err("object size %zu, expected 48", pool.obj_size);
+        num_fails++;
+    }
+    num_fails += flow_pool_test_pool(&pool, 40);
+    flow_pool_init(&pool, "small", 40, 0);
+    if (pool.num_slabs != 4) {
+        joy_log_err("slabs not kept across init");
+        num_fails++;
+    }
+    flow_pool_destroy(&pool);
+
+    /* objects too large for the default slab size */
+    flow_pool_init(&pool, "large", 20000, 0);
+    num_fails += flow_pool_test_pool(&pool, 20000);
+    obj = flow_pool_alloc(&pool, 20001);
+    if (obj != NULL) {
+        joy_log_err("oversized object allocated");
+        num_fails++;
+    }
+    flow_pool_destroy(&pool);
+
+    /* huge page slabs (with or without huge pages reserved) */
+    flow_pool_init(&pool, "huge", 4000, 1);
+    num_fails += flow_pool_test_pool(&pool, 4000);
+    flow_pool_destroy(&pool);
+
+    /* a pool that was never set up sizes itself on first use */
+    memset_s(&pool, sizeof(pool), 0x00, sizeof(pool));
+    obj = flow_pool_alloc(&pool, 100);
+    if (obj == NULL || pool.obj_size != 112 || pool.in_use != 1) {
+        joy_log_err("lazy pool setup failed");
+        num_fails++;
+    }
+    flow_pool_free(&pool, obj);
+    flow_pool_destroy(&pool);
+
+    /* a pool set picks the smallest class that fits */
+    memset_s(&set, sizeof(set), 0x00, sizeof(set));
+    flow_pool_set_init(&set, 0);
+    if (flow_pool_set_class_size(1) != 32 || flow_pool_set_class_size(33) != 64 ||
+        flow_pool_set_class_size(4096) != 4096 || flow_pool_set_class_size(5000) != 5000) {
+        joy_log_err("wrong pool set size classes");
+        num_fails++;
+    }
+    obj = flow_pool_set_calloc(&set, 100);
+    if (obj == NULL || set.pools[2].in_use != 1) {
+        joy_log_err("pool set allocation not taken from the 128 byte class");
+        num_fails++;
+    }
+    flow_pool_set_free(&set, obj, 100);
+    obj = flow_pool_set_alloc(&set, 5000);
+    if (obj == NULL) {
+        joy_log_err("pool set heap allocation failed");
+        num_fails++;
+    }
+    flow_pool_set_free(&set, obj, 5000);
+    if (set.pools[2].in_use != 0) {
+        joy_log_err("pool set object not released");
+        num_fails++;
+    }
+    flow_pool_set_destroy(&set);
+
+    /* a destroyed set is set up again with the sizes of its classes */
+    obj = flow_pool_set_alloc(&set, 100);
+    if (obj == NULL || set.pools[2].obj_size != 128) {
+        joy_log_err("pool set not set up again after being destroyed");
+        num_fails++;
+    }
+    flow_pool_set_free(&set, obj, 100);
+    flow_pool_set_destroy(&set);
+
+    /* without a pool, objects come from the heap */
+    obj = flow_pool_calloc(NULL, 64);
+    if (obj == NULL) {
+        joy_log_err("heap allocation failed");
+        num_fails++;
+    }
+    flow_pool_free(NULL, obj);
+
+    if (num_fails) {
+        fprintf(info, "Finished - failures: %d\n", num_fails);
+    } else {
+        fprintf(info, "Finished - success\n");
+    }
+    fprintf(info, "******************************\n\n");
+
+    return num_fails;
+}
@@ -0,0 +1,1022 @@
+/*
+ *
+ * Copyright (c) 2018 Cisco Systems, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials provided
+ *   with the distribution.
+ *
+ *   Neither the name of the Cisco Systems, Inc. nor the names of its
+ *   contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/**
+ * \file flow_table.c
+ *
+ * \brief open addressing hash table for flow records
+ *
+ ** The layout follows the "swiss table" design: an array of one byte
+ *  control tags runs alongside the array of slots.  A tag is either
+ *  FLOW_TABLE_EMPTY, FLOW_TABLE_DELETED (a tombstone), or the low seven
+ *  bits of the hash of the key held in the slot.  A probe starts at the
+ *  position given by the rest of the hash, and compares the tags of a
+ *  group of FLOW_TABLE_GROUP_WIDTH slots against the wanted tag in one
+ *  go; groups are visited with triangular probing, which reaches every
+ *  group because the capacity is a power of two.  A probe stops at the
+ *  first group that holds an empty slot.
+ *
+ ** The first FLOW_TABLE_GROUP_WIDTH tags are cloned after the last one,
+ *  so that a group can be loaded from any position without wrapping.
+ *
+ ** The table grows (doubling its capacity) when it is 7/8 full, counting
+ *  tombstones, is rebuilt at the same size if most of that is
+ *  tombstones, and shrinks (halving its capacity, but not below the
+ *  initial one) when it is less than 1/8 full.  Resizing is incremental:
+ *  the previous arrays are kept as t->old, and each insertion moves the
+ *  records of the next FLOW_TABLE_MIGRATE_STEP old slots into the new
+ *  arrays until none are left.
+ *
+ */
+
+#include <stdlib.h>
+#include "safe_lib.h"
+#include "flow_table.h"
+#include "utils.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define FLOW_TABLE_USE_SSE2 1
+#endif
+
+#if defined(__SSE4_2__)
+#include <nmmintrin.h>
+#elif defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+/* not built for SSE4.2, but the crc32 instruction can be used if present */
+#include <nmmintrin.h>
+#define FLOW_TABLE_CRC_DISPATCH 1
+#endif
+
+#define FLOW_TABLE_EMPTY   ((uint8_t)0x80)
+#define FLOW_TABLE_DELETED ((uint8_t)0xFE)
+
+#define flow_table_h1(hash) ((hash) >> 7)
+#define flow_table_h2(hash) ((uint8_t)((hash) & 0x7F))
+#define flow_table_is_full(c) ((c) < 0x80)
+
+/** the largest number of records a table of \p cap slots may hold */
+#define flow_table_max_load(cap) ((cap) - ((cap) >> 3))
+
+/*
+ * CRC32C (Castagnoli) table, for processors without the SSE4.2 crc32
+ * instruction; both give the same result.
+ */
+#ifndef __SSE4_2__
+static const uint32_t crc32c_table[256] = {
+    0x00000000, 0xf26b8303, 0xe13b70f7, 0x1350f3f4, 0xc79a971f, 0x35f1141c,
+    0x26a1e7e8, 0xd4ca64eb, 0x8ad958cf, 0x78b2dbcc, 0x6be22838, 0x9989ab3b,
+    0x4d43cfd0, 0xbf284cd3, 0xac78bf27, 0x5e133c24, 0x105ec76f, 0xe235446c,
+    0xf165b798, 0x030e349b, 0xd7c45070, 0x25afd373, 0x36ff2087, 0xc494a384,
+    0x9a879fa0, 0x68ec1ca3, 0x7bbcef57, 0x89d76c54, 0x5d1d08bf, 0xaf768bbc,
+    0xbc267848, 0x4e4dfb4b, 0x20bd8ede, 0xd2d60ddd, 0xc186fe29, 0x33ed7d2a,
+    0xe72719c1, 0x154c9ac2, 0x061c6936, 0xf477ea35, 0xaa64d611, 0x580f5512,
+    0x4b5fa6e6, 0xb93425e5, 0x6dfe410e, 0x9f95c20d, 0x8cc531f9, 0x7eaeb2fa,
+    0x30e349b1, 0xc288cab2, 0xd1d83946, 0x23b3ba45, 0xf779deae, 0x05125dad,
+    0x1642ae59, 0xe4292d5a, 0xba3a117e, 0x4851927d, 0x5b016189, 0xa96ae28a,
+    0x7da08661, 0x8fcb0562, 0x9c9bf696, 0x6ef07595, 0x417b1dbc, 0xb3109ebf,
+    0xa0406d4b, 0x522bee48, 0x86e18aa3, 0x748a09a0, 0x67dafa54, 0x95b17957,
+    0xcba24573, 0x39c9c670, 0x2a993584, 0xd8f2b687, 0x0c38d26c, 0xfe53516f,
+    0xed03a29b, 0x1f682198, 0x5125dad3, 0xa34e59d0, 0xb01eaa24, 0x42752927,
+    0x96bf4dcc, 0x64d4cecf, 0x77843d3b, 0x85efbe38, 0xdbfc821c, 0x2997011f,
+    0x3ac7f2eb, 0xc8ac71e8, 0x1c661503, 0xee0d9600, 0xfd5d65f4, 0x0f36e6f7,
+    0x61c69362, 0x93ad1061, 0x80fde395, 0x72966096, 0xa65c047d, 0x5437877e,
+    0x4767748a, 0xb50cf789, 0xeb1fcbad, 0x197448ae, 0x0a24bb5a, 0xf84f3859,
+    0x2c855cb2, 0xdeeedfb1, 0xcdbe2c45, 0x3fd5af46, 0x7198540d, 0x83f3d70e,
+    0x90a324fa, 0x62c8a7f9, 0xb602c312, 0x44694011, 0x5739b3e5, 0xa55230e6,
+    0xfb410cc2, 0x092a8fc1, 0x1a7a7c35, 0xe811ff36, 0x3cdb9bdd, 0xceb018de,
+    0xdde0eb2a, 0x2f8b6829, 0x82f63b78, 0x709db87b, 0x63cd4b8f, 0x91a6c88c,
+    0x456cac67, 0xb7072f64, 0xa457dc90, 0x563c5f93, 0x082f63b7, 0xfa44e0b4,
+    0xe9141340, 0x1b7f9043, 0xcfb5f4a8, 0x3dde77ab, 0x2e8e845f, 0xdce5075c,
+    0x92a8fc17, 0x60c37f14, 0x73938ce0, 0x81f80fe3, 0x55326b08, 0xa759e80b,
+    0xb4091bff, 0x466298fc, 0x1871a4d8, 0xea1a27db, 0xf94ad42f, 0x0b21572c,
+    0xdfeb33c7, 0x2d80b0c4, 0x3ed04330, 0xccbbc033, 0xa24bb5a6, 0x502036a5,
+    0x4370c551, 0xb11b4652, 0x65d122b9, 0x97baa1ba, 0x84ea524e, 0x7681d14d,
+    0x2892ed69, 0xdaf96e6a, 0xc9a99d9e, 0x3bc21e9d, 0xef087a76, 0x1d63f975,
+    0x0e330a81, 0xfc588982, 0xb21572c9, 0x407ef1ca, 0x532e023e, 0xa145813d,
+    0x758fe5d6, 0x87e466d5, 0x94b49521, 0x66df1622, 0x38cc2a06, 0xcaa7a905,
+    0xd9f75af1, 0x2b9cd9f2, 0xff56bd19, 0x0d3d3e1a, 0x1e6dcdee, 0xec064eed,
+    0xc38d26c4, 0x31e6a5c7, 0x22b65633, 0xd0ddd530, 0x0417b1db, 0xf67c32d8,
+    0xe52cc12c, 0x1747422f, 0x49547e0b, 0xbb3ffd08, 0xa86f0efc, 0x5a048dff,
+    0x8ecee914, 0x7ca56a17, 0x6ff599e3, 0x9d9e1ae0, 0xd3d3e1ab, 0x21b862a8,
+    0x32e8915c, 0xc083125f, 0x144976b4, 0xe622f5b7, 0xf5720643, 0x07198540,
+    0x590ab964, 0xab613a67, 0xb831c993, 0x4a5a4a90, 0x9e902e7b, 0x6cfbad78,
+    0x7fab5e8c, 0x8dc0dd8f, 0xe330a81a, 0x115b2b19, 0x020bd8ed, 0xf0605bee,
+    0x24aa3f05, 0xd6c1bc06, 0xc5914ff2, 0x37faccf1, 0x69e9f0d5, 0x9b8273d6,
+    0x88d28022, 0x7ab90321, 0xae7367ca, 0x5c18e4c9, 0x4f48173d, 0xbd23943e,
+    0xf36e6f75, 0x0105ec76, 0x12551f82, 0xe03e9c81, 0x34f4f86a, 0xc69f7b69,
+    0xd5cf889d, 0x27a40b9e, 0x79b737ba, 0x8bdcb4b9, 0x988c474d, 0x6ae7c44e,
+    0xbe2da0a5, 0x4c4623a6, 0x5f16d052, 0xad7d5351
+};
+
+static inline uint32_t crc32c_u8 (uint32_t crc, uint8_t v) {
+    return (crc >> 8) ^ crc32c_table[(crc ^ v) & 0xFF];
+}
+
+static inline uint32_t crc32c_u32 (uint32_t crc, uint32_t v) {
+    crc = crc32c_u8(crc, (uint8_t)v);
+    crc = crc32c_u8(crc, (uint8_t)(v >> 8));
+    crc = crc32c_u8(crc, (uint8_t)(v >> 16));
+    return crc32c_u8(crc, (uint8_t)(v >> 24));
+}
+#else
+#define crc32c_u8(crc, v) _mm_crc32_u8((crc), (v))
+#define crc32c_u32(crc, v) _mm_crc32_u32((crc), (v))
+#endif
+
+/**
+ * \brief Add the rest of the addresses of an IPv6 key to a CRC; the
+ *        first word of each is in already, as sa and da.
+ * \param crc CRC of the other fields of \p key
+ * \param key Flow key
+ * \return \p crc, unchanged for an IPv4 key
+ */
+static inline uint32_t flow_table_hash_addr6 (uint32_t crc, const flow_key_t *key) {
+    uint32_t w[6];
+    unsigned int i;
+
+    if (!key->ipv6) {
+        return crc;
+    }
+    memcpy_s(w, sizeof(w), &key->sa6.s6_addr[4], 12);
+    memcpy_s(w + 3, sizeof(w) - 12, &key->da6.s6_addr[4], 12);
+    for (i = 0; i < 6; i++) {
+        crc = crc32c_u32(crc, w[i]);
+    }
+    return crc;
+}
+
+#ifdef FLOW_TABLE_CRC_DISPATCH
+/**
+ * \brief flow_table_hash() using the SSE4.2 crc32 instruction.
+ */
+__attribute__((target("sse4.2")))
+static uint32_t flow_table_hash_sse42 (const flow_key_t *key) {
+    uint32_t crc = 0xFFFFFFFF;
+
+    crc = _mm_crc32_u32(crc, (uint32_t)key->sa.s_addr);
+    crc = _mm_crc32_u32(crc, (uint32_t)key->da.s_addr);
+    crc = _mm_crc32_u32(crc, (uint32_t)key->sp | ((uint32_t)key->dp << 16));
+    crc = _mm_crc32_u8(crc, key->prot);
+
+    return ~crc;
+}
+
+/** 1 if the processor has the crc32 instruction, -1 if not checked yet */
+static int flow_table_have_sse42 = -1;
+#endif
+
+/**
+ * \brief Hash a flow key.
+ * \param key Flow key
+ * \return CRC32C of the address, port and protocol fields of \p key
+ */
+uint32_t flow_table_hash (const flow_key_t *key) {
+    uint32_t crc = 0xFFFFFFFF;
+
+#ifdef FLOW_TABLE_CRC_DISPATCH
+    if (flow_table_have_sse42) {
+        if (flow_table_have_sse42 < 0) {
+            flow_table_have_sse42 = __builtin_cpu_supports("sse4.2") ? 1 : 0;
+        }
+        if (flow_table_have_sse42) {
+            return ~flow_table_hash_addr6(~flow_table_hash_sse42(key), key);
+        }
+    }
+#endif
+
+    crc = crc32c_u32(crc, (uint32_t)key->sa.s_addr);
+    crc = crc32c_u32(crc, (uint32_t)key->da.s_addr);
+    crc = crc32c_u32(crc, (uint32_t)key->sp | ((uint32_t)key->dp << 16));
+    crc = crc32c_u8(crc, key->prot);
+
+    return ~flow_table_hash_addr6(crc, key);
+}
+
+/**
+ * \brief Compare the control tags of a group of slots with a value.
+ * \param ctrl First tag of the group
+ * \param tag Value to look for
+ * \return Bitmask with bit i set if ctrl[i] == tag
+ */
+static inline uint32_t flow_table_group_match (const uint8_t *ctrl, uint8_t tag) {
+#ifdef FLOW_TABLE_USE_SSE2
+    __m128i group = _mm_loadu_si128((const __m128i *)(const void *)ctrl);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char)tag)));
+#else
+    uint32_t mask = 0;
+    unsigned int i;
+
+    for (i = 0; i < FLOW_TABLE_GROUP_WIDTH; i++) {
+        if (ctrl[i] == tag) {
+            mask |= (1u << i);
+        }
+    }
+    return mask;
+#endif
+}
+
+/**
+ * \brief Find the empty or deleted slots in a group.
+ * \param ctrl First tag of the group
+ * \return Bitmask with bit i set if slot i is not in use
+ */
+static inline uint32_t flow_table_group_match_free (const uint8_t *ctrl) {
+#ifdef FLOW_TABLE_USE_SSE2
+    /* the free tags are the only ones with the top bit set */
+    return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(const void *)ctrl));
+#else
+    uint32_t mask = 0;
+    unsigned int i;
+
+    for (i = 0; i < FLOW_TABLE_GROUP_WIDTH; i++) {
+        if (!flow_table_is_full(ctrl[i])) {
+            mask |= (1u << i);
+        }
+    }
+    return mask;
+#endif
+}
+
+/**
+ * \brief Index of the lowest set bit of a non-zero mask.
+ */
+static inline unsigned int flow_table_lowest_bit (uint32_t mask) {
+#if defined(__GNUC__)
+    return (unsigned int)__builtin_ctz(mask);
+#else
+    unsigned int i = 0;
+
+    while (!(mask & 1)) {
+        mask >>= 1;
+        i++;
+    }
+    return i;
+#endif
+}
+
+/**
+ * \brief Compare two flow keys field by field (padding is not compared).
+ * \return 1 if equal, 0 otherwise
+ */
+static inline int flow_table_key_eq (const flow_key_t *a, const flow_key_t *b) {
+    return a->sa.s_addr == b->sa.s_addr && a->da.s_addr == b->da.s_addr &&
+           a->sp == b->sp && a->dp == b->dp && a->prot == b->prot &&
+           a->ipv6 == b->ipv6 &&
+           (!a->ipv6 || (flow_key_addr_eq(a->sa6, b->sa6, 1) && flow_key_addr_eq(a->da6, b->da6, 1)));
+}
+
+/**
+ * \brief Set the control tag of slot \p i, and its clone if it has one.
+ */
+static inline void flow_table_set_ctrl (flow_table_array_t *a, uint32_t i, uint8_t tag) {
+    a->ctrl[i] = tag;
+    if (i < FLOW_TABLE_GROUP_WIDTH) {
+        a->ctrl[a->capacity + i] = tag;
+    }
+}
+
+/**
+ * \brief Allocate empty slot arrays.
+ * \param a Slot arrays to fill in
+ * \param capacity Number of slots; a power of two, at least FLOW_TABLE_GROUP_WIDTH
+ * \return ok, or failure if the memory could not be allocated
+ */
+static joy_status_e flow_table_array_alloc (flow_table_array_t *a, uint32_t capacity) {
+    a->ctrl = malloc(capacity + FLOW_TABLE_GROUP_WIDTH);
+    a->slots = malloc(sizeof(flow_table_slot_t) * capacity);
+    if (a->ctrl == NULL || a->slots == NULL) {
+        free(a->ctrl);
+        free(a->slots);
+        a->ctrl = NULL;
+        a->slots = NULL;
+        joy_log_err("could not allocate flow table with %u slots", capacity);
+        return failure;
+    }
+    memset_s(a->ctrl, capacity + FLOW_TABLE_GROUP_WIDTH, FLOW_TABLE_EMPTY, capacity + FLOW_TABLE_GROUP_WIDTH);
+    a->capacity = capacity;
+    a->size = 0;
+    a->growth_left = flow_table_max_load(capacity);
+
+    return ok;
+}
+
+/**
+ * \brief Release slot arrays.
+ */
+static void flow_table_array_free (flow_table_array_t *a) {
+    free(a->ctrl);
+    free(a->slots);
+    a->ctrl = NULL;
+    a->slots = NULL;
+    a->capacity = 0;
+    a->size = 0;
+    a->growth_left = 0;
+}
+
+/**
+ * \brief Round a requested capacity to one that the table can use.
+ * \param capacity Requested number of slots, or 0 for the default
+ * \return Power of two between FLOW_TABLE_GROUP_WIDTH and FLOW_TABLE_MAX_CAPACITY
+ */
+static uint32_t flow_table_round_capacity (uint32_t capacity) {
+    uint32_t c = FLOW_TABLE_GROUP_WIDTH;
+
+    if (capacity == 0) {
+        return FLOW_TABLE_DEFAULT_CAPACITY;
+    }
+    while (c < capacity && c < FLOW_TABLE_MAX_CAPACITY) {
+        c <<= 1;
+    }
+    return c;
+}
+
+/**
+ * \brief Reset a flow table so that it holds no records.
+ *
+ * The current slot arrays are kept for reuse if they have the requested
+ * capacity; the table must have been zeroed before its first use.
+ *
+ * \param t Flow table
+ * \param capacity Number of slots to allocate on the first insertion,
+ *        which is also the size below which the table never shrinks;
+ *        rounded up to a power of two, or 0 for FLOW_TABLE_DEFAULT_CAPACITY
+ * \return none
+ */
+void flow_table_init (flow_table_t *t, uint32_t capacity) {
+    t->min_capacity = flow_table_round_capacity(capacity);
+    t->migrate_pos = 0;
+    t->num_grows = 0;
+    t->num_shrinks = 0;
+    flow_table_array_free(&t->old);
+
+    if (t->cur.capacity == t->min_capacity) {
+        memset_s(t->cur.ctrl, t->cur.capacity + FLOW_TABLE_GROUP_WIDTH, FLOW_TABLE_EMPTY, t->cur.capacity + FLOW_TABLE_GROUP_WIDTH);
+        t->cur.size = 0;
+        t->cur.growth_left = flow_table_max_load(t->cur.capacity);
+    } else {
+        flow_table_array_free(&t->cur);
+    }
+}
+
+/**
+ * \brief Release the memory of a flow table.
+ *
+ * The flow records that are in the table are not touched.
+ *
+ * \param t Flow table
+ * \return none
+ */
+void flow_table_free (flow_table_t *t) {
+    flow_table_array_free(&t->cur);
+    flow_table_array_free(&t->old);
+    t->migrate_pos = 0;
+}
+
+/**
+ * \brief Find a free slot for a key with the given hash.
+ * \param a Slot arrays, with capacity > 0
+ * \param hash Hash of the key
+ * \return Index of the first empty or deleted slot on the probe sequence
+ */
+static uint32_t flow_table_find_free (const flow_table_array_t *a, uint32_t hash) {
+    uint32_t mask = a->capacity - 1;
+    uint32_t pos = flow_table_h1(hash) & mask;
+    uint32_t step = 0;
+    uint32_t free_mask;
+
+    while (1) {
+        free_mask = flow_table_group_match_free(a->ctrl + pos);
+        if (free_mask) {
+            return (pos + flow_table_lowest_bit(free_mask)) & mask;
+        }
+        step += FLOW_TABLE_GROUP_WIDTH;
+        pos = (pos + step) & mask;
+    }
+}
+
+/**
+ * \brief Store a slot in the first free position of its probe sequence.
+ * \param a Slot arrays, which must not be full
+ * \param slot Slot to copy in
+ * \return none
+ */
+static inline void flow_table_array_place (flow_table_array_t *a, const flow_table_slot_t *slot) {
+    uint32_t i = flow_table_find_free(a, slot->hash);
+
+    if (a->ctrl[i] == FLOW_TABLE_EMPTY && a->growth_left) {
+        a->growth_left--;
+    }
+    flow_table_set_ctrl(a, i, flow_table_h2(slot->hash));
+    a->slots[i] = *slot;
+    a->size++;
+}
+
+/**
+ * \brief Move records from the old slot arrays into the current ones.
+ *
+ * This is the incremental part of a resize: each insertion moves a
+ * bounded number of slots, and the old arrays are released once they
+ * have all been moved.
+ *
+ * \param t Flow table with a resize in progress
+ * \param count Number of old slots to visit
+ * \return none
+ */
+static void flow_table_migrate (flow_table_t *t, uint32_t count) {
+    flow_table_array_t *old = &t->old;
+    uint32_t end = t->migrate_pos + count;
+
+    if (end > old->capacity || end < t->migrate_pos) {
+        end = old->capacity;
+    }
+    for (; t->migrate_pos < end && old->size; t->migrate_pos++) {
+        if (flow_table_is_full(old->ctrl[t->migrate_pos])) {
+            flow_table_array_place(&t->cur, &old->slots[t->migrate_pos]);
+            flow_table_set_ctrl(old, t->migrate_pos, FLOW_TABLE_DELETED);
+            old->size--;
+        }
+    }
+    if (old->size == 0) {
+        flow_table_array_free(old);
+        t->migrate_pos = 0;
+    }
+}
+
+/**
+ * \brief Start moving the records of a flow table into new slot arrays.
+ *
+ * Any resize already in progress is completed first.  The records are
+ * then moved a few at a time by later insertions (see
+ * flow_table_migrate()), and lookups look in both sets of arrays until
+ * that is done.
+ *
+ * \param t Flow table
+ * \param capacity Capacity of the new arrays
+ * \return ok, or failure if the memory could not be allocated
+ */
+static joy_status_e flow_table_resize (flow_table_t *t, uint32_t capacity) {
+    flow_table_array_t new_array;
+
+    if (t->old.capacity) {
+        flow_table_migrate(t, t->old.capacity);
+    }
+    if (flow_table_array_alloc(&new_array, capacity) != ok) {
+        return failure;
+    }
+    if (t->cur.size == 0) {
+        flow_table_array_free(&t->cur);
+    } else {
+        t->old = t->cur;
+        t->migrate_pos = 0;
+    }
+    t->cur = new_array;
+
+    return ok;
+}
+
+/**
+ * \brief Probe one set of slot arrays for a key.
+ * \param a Slot arrays
+ * \param key Flow key to look for
+ * \param hash Hash of \p key
+ * \return Slot index, or a->capacity if the key is not there
+ */
+static inline uint32_t flow_table_probe (const flow_table_array_t *a,
+                                         const flow_key_t *key,
+                                         uint32_t hash) {
+    uint32_t mask = a->capacity - 1;
+    uint32_t pos = flow_table_h1(hash) & mask;
+    uint32_t step = 0;
+    uint32_t match, i;
+    uint8_t tag = flow_table_h2(hash);
+
+    if (a->capacity == 0) {
+        return 0;
+    }
+
+    while (1) {
+        match = flow_table_group_match(a->ctrl + pos, tag);
+        while (match) {
+            i = (pos + flow_table_lowest_bit(match)) & mask;
+            if (a->slots[i].hash == hash && flow_table_key_eq(&a->slots[i].key, key)) {
+                return i;
+            }
+            match &= match - 1;
+        }
+        if (flow_table_group_match(a->ctrl + pos, FLOW_TABLE_EMPTY)) {
+            return a->capacity;
+        }
+        step += FLOW_TABLE_GROUP_WIDTH;
+        if (step > a->capacity) {
+            /* every group has been visited */
+            return a->capacity;
+        }
+        pos = (pos + step) & mask;
+    }
+}
+
+/**
+ * \brief Find the flow record whose key is equal to \p key.
+ * \param t Flow table
+ * \param key Flow key to look for
+ * \param hash Hash of \p key (from flow_table_hash() or an equivalent)
+ * \return The flow record, or NULL
+ */
+flow_record_t *flow_table_find (const flow_table_t *t,
+                                const flow_key_t *key,
+                                uint32_t hash) {
+    uint32_t i = flow_table_probe(&t->cur, key, hash);
+
+    if (i < t->cur.capacity) {
+        return t->cur.slots[i].record;
+    }
+    if (t->old.size) {
+        i = flow_table_probe(&t->old, key, hash);
+        if (i < t->old.capacity) {
+            return t->old.slots[i].record;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * \brief Start loading the control tags and slot where a lookup of \p hash begins.
+ *
+ * Lookups of a batch of keys can be overlapped this way, since
+ * each one is likely to end at the first slot that it looks at.
+ *
+ * \param t Flow table
+ * \param hash Hash of the flow key that is going to be looked up
+ * \return none
+ */
+void flow_table_prefetch (const flow_table_t *t, uint32_t hash) {
+    uint32_t pos;
+
+    if (t->cur.capacity == 0) {
+        return;
+    }
+    pos = flow_table_h1(hash) & (t->cur.capacity - 1);
+    joy_prefetch(t->cur.ctrl + pos);
+    joy_prefetch(t->cur.slots + pos);
+}
+
+/**
+ * \brief Find the most recently created matching record in one set of slot arrays.
+ */
+static flow_record_t *flow_table_array_find_match (const flow_table_array_t *a,
+                                                   const flow_key_t *key,
+                                                   uint32_t hash,
+                                                   int (*match)(const flow_key_t *a, const flow_key_t *b),
+                                                   flow_record_t *best) {
+    uint32_t mask = a->capacity - 1;
+    uint32_t pos = flow_table_h1(hash) & mask;
+    uint32_t step = 0;
+    uint32_t bits, i;
+    uint8_t tag = flow_table_h2(hash);
+
+    if (a->capacity == 0) {
+        return best;
+    }
+
+    while (1) {
+        bits = flow_table_group_match(a->ctrl + pos, tag);
+        while (bits) {
+            i = (pos + flow_table_lowest_bit(bits)) & mask;
+            if (a->slots[i].hash == hash && match(key, &a->slots[i].key) == 0) {
+                if (best == NULL || a->slots[i].record->seq > best->seq) {
+                    best = a->slots[i].record;
+                }
+            }
+            bits &= bits - 1;
+        }
+        if (flow_table_group_match(a->ctrl + pos, FLOW_TABLE_EMPTY)) {
+            break;
+        }
+        step += FLOW_TABLE_GROUP_WIDTH;
+        if (step > a->capacity) {
+            break;
+        }
+        pos = (pos + step) & mask;
+    }
+
+    return best;
+}
+
+/**
+ * \brief Find a flow record using a caller supplied match function.
+ *
+ * All of the records with exactly the hash value \p hash are visited;
+ * this is intended for hash functions that deliberately ignore part of
+ * the key, such as the one used for NAT twin matching.  When several
+ * records match, the most recently created one is returned.
+ *
+ * \param t Flow table
+ * \param key Flow key to match against
+ * \param hash Hash value of the records to look at
+ * \param match Returns 0 if the two keys match
+ * \return The flow record, or NULL
+ */
+flow_record_t *flow_table_find_match (const flow_table_t *t,
+                                      const flow_key_t *key,
+                                      uint32_t hash,
+                                      int (*match)(const flow_key_t *a, const flow_key_t *b)) {
+    flow_record_t *best = flow_table_array_find_match(&t->cur, key, hash, match, NULL);
+
+    if (t->old.size) {
+        best = flow_table_array_find_match(&t->old, key, hash, match, best);
+    }
+    return best;
+}
+
+/**
+ * \brief Insert a flow record into a flow table.
+ *
+ * The caller must make sure that no record with the same key is in the
+ * table already.  This is where the table is resized: it grows (doubles)
+ * when the current arrays are 7/8 full, counting tombstones, is rebuilt
+ * at the same size when most of that is tombstones, and shrinks (halves)
+ * when it is less than 1/8 full.  Records are never moved in memory, but
+ * slot indexes are not stable across insertions.
+ *
+ * \param t Flow table
+ * \param record Flow record; its key is copied into the table
+ * \param hash Hash of the record key
+ * \return ok, or failure if the table needed to grow and could not
+ */
+joy_status_e flow_table_insert (flow_table_t *t,
+                                flow_record_t *record,
+                                uint32_t hash) {
+    flow_table_slot_t slot;
+    uint32_t i, capacity;
+    int grow = 0;
+
+    if (t->cur.capacity == 0) {
+        if (flow_table_array_alloc(&t->cur, t->min_capacity ? t->min_capacity : FLOW_TABLE_DEFAULT_CAPACITY) != ok) {
+            return failure;
+        }
+    }
+
+    if (t->old.capacity) {
+        flow_table_migrate(t, FLOW_TABLE_MIGRATE_STEP);
+    } else if (t->cur.capacity > t->min_capacity && t->cur.size < (t->cur.capacity >> 3)) {
+        if (flow_table_resize(t, t->cur.capacity >> 1) == ok) {
+            t->num_shrinks++;
+        }
+    }
+
+    i = flow_table_find_free(&t->cur, hash);
+    if (t->cur.growth_left == 0 && t->cur.ctrl[i] == FLOW_TABLE_EMPTY) {
+        /*
+         * Out of room: if most of the used up space is tombstones, clean
+         * them up by rebuilding at the same size, otherwise grow
+         */
+        if (t->cur.size + t->old.size < flow_table_max_load(t->cur.capacity) / 2) {
+            capacity = t->cur.capacity;
+        } else if (t->cur.capacity < FLOW_TABLE_MAX_CAPACITY) {
+            capacity = t->cur.capacity << 1;
+            grow = 1;
+        } else {
+            return failure;
+        }
+        if (flow_table_resize(t, capacity) != ok) {
+            return failure;
+        }
+        t->num_grows += grow;
+    }
+
+    slot.key = record->key;
+    slot.hash = hash;
+    slot.record = record;
+    flow_table_array_place(&t->cur, &slot);
+
+    return ok;
+}
+
+/**
+ * \brief Remove a flow record from a flow table.
+ *
+ * If no probe can have gone past the slot (its neighbourhood has never
+ * been completely full), it is marked empty again; otherwise it becomes
+ * a tombstone.  Removal never moves other records, so it is safe to
+ * remove records while walking over the table with flow_table_record_at().
+ *
+ * \param t Flow table
+ * \param record Flow record to remove
+ * \param hash Hash of the record key
+ * \return ok, or failure if the record is not in the table
+ */
+joy_status_e flow_table_remove (flow_table_t *t,
+                                const flow_record_t *record,
+                                uint32_t hash) {
+    flow_table_array_t *a = &t->cur;
+    uint32_t mask = a->capacity - 1;
+    uint32_t i = flow_table_probe(a, &record->key, hash);
+    uint32_t empty_before, empty_after;
+    unsigned int lead, trail;
+
+    if (i >= a->capacity || a->slots[i].record != record) {
+        /* not in the current arrays; it may not have been moved yet */
+        a = &t->old;
+        i = flow_table_probe(a, &record->key, hash);
+        if (i >= a->capacity || a->slots[i].record != record) {
+            return failure;
+        }
+        flow_table_set_ctrl(a, i, FLOW_TABLE_DELETED);
+        a->size--;
+        return ok;
+    }
+
+    empty_after = flow_table_group_match(a->ctrl + i, FLOW_TABLE_EMPTY);
+    empty_before = flow_table_group_match(a->ctrl + ((i - FLOW_TABLE_GROUP_WIDTH) & mask), FLOW_TABLE_EMPTY);
+    if (empty_before && empty_after) {
+        trail = flow_table_lowest_bit(empty_after);
+        lead = 0;
+        while (!(empty_before & (1u << (FLOW_TABLE_GROUP_WIDTH - 1 - lead)))) {
+            lead++;
+        }
+        if (trail + lead < FLOW_TABLE_GROUP_WIDTH) {
+            flow_table_set_ctrl(a, i, FLOW_TABLE_EMPTY);
+            a->growth_left++;
+            a->size--;
+            return ok;
+        }
+    }
+    flow_table_set_ctrl(a, i, FLOW_TABLE_DELETED);
+    a->size--;
+
+    return ok;
+}
+
+/**
+ * \brief Number of records in a flow table.
+ */
+uint32_t flow_table_size (const flow_table_t *t) {
+    return t->cur.size + t->old.size;
+}
+
+/**
+ * \brief Fraction of the slots of a flow table that hold a record.
+ * \param t Flow table
+ * \return Load factor (between 0 and 7/8), or 0 if nothing is allocated
+ */
+double flow_table_load (const flow_table_t *t) {
+    uint32_t size = flow_table_size(t);
+
+    if (t->cur.capacity == 0) {
+        return 0.0;
+    }
+    return (double)size / (double)(t->cur.capacity + t->old.capacity);
+}
+
+/**
+ * \brief Number of slot positions to walk with flow_table_record_at().
+ */
+uint32_t flow_table_num_slots (const flow_table_t *t) {
+    return t->cur.capacity + t->old.capacity;
+}
+
+/**
+ * \brief Get the flow record in a slot of a flow table.
+ *
+ * Used to walk over all of the records, with \p i going from 0 up to
+ * flow_table_num_slots(); removing the record that was just returned
+ * does not disturb the walk.
+ *
+ * \param t Flow table
+ * \param i Slot position
+ * \return The flow record, or NULL if the slot is not in use
+ */
+flow_record_t *flow_table_record_at (const flow_table_t *t, uint32_t i) {
+    const flow_table_array_t *a = &t->cur;
+
+    if (i >= a->capacity) {
+        i -= a->capacity;
+        a = &t->old;
+        if (i >= a->capacity) {
+            return NULL;
+        }
+    }
+    return flow_table_is_full(a->ctrl[i]) ? a->slots[i].record : NULL;
+}
+
+/**
+ * \brief Check that every record of an array is in a flow table.
+ * \return Number of records that were not found
+ */
+static unsigned int flow_table_test_find_all (const flow_table_t *t,
+                                              flow_record_t *rec,
+                                              unsigned int n,
+                                              unsigned int stride) {
+    unsigned int i, missing = 0;
+
+    for (i = 0; i < n; i += stride) {
+        if (flow_table_find(t, &rec[i].key, rec[i].key_hash) != &rec[i]) {
+            missing++;
+        }
+    }
+    return missing;
+}
+
+/**
+ * \brief Unit test for the flow table.
+ * \param none
+ * \return Number of failures
+ */
+int flow_table_unit_test (void) {
+    flow_table_t t;
+    flow_record_t *rec;
+    flow_key_t key;
+    unsigned int i, n = 20000, num_fails = 0;
+    uint32_t slots;
+
+    fprintf(info, "\n******************************\n");
+    fprintf(info, "Flow table Unit Test starting...\n");
+
+    rec = calloc(n, sizeof(flow_record_t));
+    if (rec == NULL) {
+        fprintf(info, "Out of memory\n");
+        return 1;
+    }
+    memset_s(&t, sizeof(t), 0x00, sizeof(t));
+    flow_table_init(&t, 0);
+
+    /* CRC32C of the key fields; the same with or without SSE4.2 */
+    memset_s(&key, sizeof(key), 0x00, sizeof(key));
+    key.sa.s_addr = 0x01020304;
+    key.da.s_addr = 0x05060708;
+    key.sp = 0x090a;
+    key.dp = 0x0b0c;
+    key.prot = 0x0d;
+    if (flow_table_hash(&key) != 0x88c14df0) {
+        joy_log_err("unexpected hash value 0x%08x", flow_table_hash(&key));
+        num_fails++;
+    }
+#ifdef FLOW_TABLE_CRC_DISPATCH
+    flow_table_have_sse42 = 0;
+    if (flow_table_hash(&key) != 0x88c14df0) {
+        joy_log_err("unexpected hash value 0x%08x without SSE4.2", flow_table_hash(&key));
+        num_fails++;
+    }
+    flow_table_have_sse42 = -1;
+#endif
+
+    if (flow_table_find(&t, &rec[0].key, flow_table_hash(&rec[0].key)) != NULL) {
+        joy_log_err("found a record in an empty table");
+        num_fails++;
+    }
+
+    for (i = 0; i < n; i++) {
+        rec[i].key.sa.s_addr = 0x0a000000 + i;
+        rec[i].key.da.s_addr = 0xc0a80001;
+        rec[i].key.sp = (uint16_t)i;
+        rec[i].key.dp = 443;
+        rec[i].key.prot = 6;
+        rec[i].seq = i + 1;
+        rec[i].key_hash = flow_table_hash(&rec[i].key);
+    }
+
+    /*
+     * enough records to make the table grow a few times; all of them
+     * must be found at every point of the incremental resizes
+     */
+    for (i = 0; i < n; i++) {
+        if (flow_table_insert(&t, &rec[i], rec[i].key_hash) != ok) {
+            joy_log_err("could not insert record %u", i);
+            num_fails++;
+        }
+        if ((i % 997) == 0 && flow_table_test_find_all(&t, rec, i + 1, 1)) {
+            joy_log_err("records missing after %u insertions", i + 1);
+            num_fails++;
+        }
+    }
+    if (flow_table_size(&t) != n || flow_table_num_slots(&t) < n || t.num_grows == 0) {
+        joy_log_err("unexpected size %u / slots %u / grows %lu",
+                    flow_table_size(&t), flow_table_num_slots(&t), t.num_grows);
+        num_fails++;
+    }
+    if (flow_table_test_find_all(&t, rec, n, 1)) {
+        joy_log_err("records missing after all insertions");
+        num_fails++;
+    }
+
+    /* keys that differ only in the protocol are different flows */
+    key = rec[7].key;
+    key.prot = 17;
+    if (flow_table_find(&t, &key, flow_table_hash(&key)) != NULL) {
+        joy_log_err("found a record with the wrong key");
+        num_fails++;
+    }
+
+    /* remove every other record, then insert them again */
+    for (i = 0; i < n; i += 2) {
+        if (flow_table_remove(&t, &rec[i], rec[i].key_hash) != ok) {
+            joy_log_err("could not remove record %u", i);
+            num_fails++;
+        }
+    }
+    for (i = 0; i < n; i++) {
+        if (flow_table_find(&t, &rec[i].key, rec[i].key_hash) != ((i & 1) ? &rec[i] : NULL)) {
+            joy_log_err("wrong lookup result for record %u after removal", i);
+            num_fails++;
+        }
+    }
+    if (flow_table_remove(&t, &rec[0], rec[0].key_hash) != failure) {
+        joy_log_err("removed a record that is not in the table");
+        num_fails++;
+    }
+    for (i = 0; i < n; i += 2) {
+        flow_table_insert(&t, &rec[i], rec[i].key_hash);
+    }
+    if (flow_table_test_find_all(&t, rec, n, 1)) {
+        joy_log_err("records missing after reinsertion");
+        num_fails++;
+    }
+
+    /*
+     * remove almost everything; the table shrinks on later insertions,
+     * down to the initial capacity
+     */
+    slots = flow_table_num_slots(&t);
+    for (i = 64; i < n; i++) {
+        flow_table_remove(&t, &rec[i], rec[i].key_hash);
+    }
+    for (i = 64; i < n; i++) {
+        flow_table_insert(&t, &rec[i], rec[i].key_hash);
+        flow_table_remove(&t, &rec[i], rec[i].key_hash);
+    }
+    if (t.num_shrinks == 0 || flow_table_num_slots(&t) >= slots ||
+        flow_table_size(&t) != 64 || flow_table_test_find_all(&t, rec, 64, 1)) {
+        joy_log_err("table did not shrink correctly (%lu shrinks, %u slots, %u records)",
+                    t.num_shrinks, flow_table_num_slots(&t), flow_table_size(&t));
+        num_fails++;
+    }
+
+    /* a walk that removes every record, in the middle of a resize */
+    for (i = 64; i < n; i++) {
+        flow_table_insert(&t, &rec[i], rec[i].key_hash);
+        if (t.old.size) {
+            break;
+        }
+    }
+    if (t.old.size == 0) {
+        joy_log_err("no resize in progress for the walk test");
+        num_fails++;
+    }
+    for (i = 0; i < flow_table_num_slots(&t); i++) {
+        flow_record_t *r = flow_table_record_at(&t, i);
+
+        if (r != NULL && flow_table_remove(&t, r, r->key_hash) != ok) {
+            joy_log_err("could not remove record found by the walk");
+            num_fails++;
+        }
+    }
+    if (flow_table_size(&t) != 0) {
+        joy_log_err("walk left %u records in the table", flow_table_size(&t));
+        num_fails++;
+    }
+
+    flow_table_free(&t);
+    free(rec);
+
+    if (num_fails) {
+        fprintf(info, "Finished - failures: %d\n", num_fails);
+    } else {
+        fprintf(info, "Finished - success\n");
+    }
+    fprintf(info, "******************************\n\n");
+
+    return num_fails;
+}
@@ -0,0 +1,301 @@
+/*
+ *
+ * Copyright (c) 2018 Cisco Systems, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials provided
+ *   with the distribution.
+ *
+ *   Neither the name of the Cisco Systems, Inc. nor the names of its
+ *   contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/**
+ * \file flow_table_bench.c
+ *
+ * \brief microbenchmark for the flow table
+ *
+ ** Compares the insert and lookup throughput of the open addressing
+ *  flow table (flow_table.c) with the 65536 bucket linked list flow
+ *  cache that it replaced, at several numbers of concurrent flows.
+ *
+ *  usage: flow_table_bench [num_flows ...]
+ *
+ *  With no arguments, 10k, 1M and 10M flows are measured.
+ */
+#ifdef HAVE_CONFIG_H
+#include "joy_config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "safe_lib.h"
+#include "p2f.h"
+#include "flow_table.h"
+#include "joy_api.h"
+
+/** number of lookups timed for each table size */
+#define BENCH_NUM_LOOKUPS 2000000
+
+/** the legacy flow cache dimensions */
+#define LEGACY_HASH_MASK 0xFFFF
+#define LEGACY_LIST_LEN (LEGACY_HASH_MASK + 1)
+
+/*
+ * Stand-in for a flow record; the real one is several kilobytes, so
+ * every record visited costs at least one cache miss, which a cache
+ * line sized record reproduces at a fraction of the memory.  The key
+ * comes first, as in flow_record_t, because the flow table copies the
+ * key from the record on insertion (and does not otherwise look inside
+ * the record on the paths measured here).
+ */
+typedef struct bench_record_ {
+    flow_key_t key;
+    struct bench_record_ *next;
+    struct bench_record_ *prev;
+    uint32_t key_hash;
+    uint8_t pad[20];
+} bench_record_t;
+
+/*
+ * The legacy flow cache: an additive hash masked to 16 bits, indexing
+ * an array of doubly linked lists, as in p2f.c before the flow table
+ */
+static unsigned int legacy_hash (const flow_key_t *f) {
+    uint32_t hash = 0;
+
+    hash += (uint32_t)f->sa.s_addr;
+    hash += (uint32_t)f->da.s_addr;
+    hash += (uint32_t)f->sp;
+    hash += (uint32_t)f->dp;
+    hash += (uint32_t)f->prot;
+
+    hash *= 0xFFD9;
+    hash -= (hash >> 16);
+    hash &= LEGACY_HASH_MASK;
+
+    return hash;
+}
+
+static int legacy_key_is_eq (const flow_key_t *a, const flow_key_t *b) {
+    return !(a->prot == b->prot && a->sp == b->sp && a->dp == b->dp &&
+             a->sa.s_addr == b->sa.s_addr && a->da.s_addr == b->da.s_addr);
+}
+
+static bench_record_t *legacy_find (bench_record_t **list, const flow_key_t *key) {
+    bench_record_t *record = list[legacy_hash(key)];
+
+    while (record != NULL) {
+        if (legacy_key_is_eq(key, &record->key) == 0) {
+            return record;
+        }
+        record = record->next;
+    }
+    return NULL;
+}
+
+static void legacy_prepend (bench_record_t **list, bench_record_t *record) {
+    bench_record_t **head = &list[record->key_hash];
+
+    record->prev = NULL;
+    record->next = *head;
+    if (*head != NULL) {
+        (*head)->prev = record;
+    }
+    *head = record;
+}
+
+/*
+ * xorshift64, so that runs are repeatable
+ */
+static uint64_t bench_rand (uint64_t *state) {
+    uint64_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+/*
+ * Fill in a key that looks like client to server traffic: many
+ * clients and source ports, few servers and destination ports.  The
+ * source address and port are derived from the flow number, so that
+ * every key is distinct.
+ */
+static void bench_key (flow_key_t *key, unsigned int i, uint64_t *state) {
+    static const uint16_t ports[] = { 443, 80, 53, 22, 8080, 123, 993, 3389 };
+    uint64_t r = bench_rand(state);
+
+    key->sa.s_addr = htonl(0x0a000000 | ((i >> 10) & 0x00ffffff));
+    key->sp = (uint16_t)(1024 + (i & 0x3ff) * 32 + (r & 0x1f));
+    key->da.s_addr = htonl(0xc0a80000 | (uint32_t)((r >> 8) & 0x3ff));
+    key->dp = ports[(r >> 20) & 7];
+    key->prot = ((r >> 24) & 3) ? 6 : 17;
+}
+
+static double bench_elapsed (const struct timeval *start) {
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return (double)(now.tv_sec - start->tv_sec) + (double)(now.tv_usec - start->tv_usec) / 1e6;
+}
+
+/**
+ * \brief Run the benchmark for one number of flows.
+ * \param n Number of flows
+ * \return 0 on success, 1 on error
+ */
+static int bench_run (unsigned int n) {
+    bench_record_t *rec;
+    bench_record_t **list;
+    unsigned int *order;
+    flow_table_t table;
+    struct timeval start;
+    double legacy_insert, legacy_lookup, table_insert, table_lookup;
+    uint64_t state = 0x9e3779b97f4a7c15ULL;
+    unsigned int i, found = 0;
+
+    rec = calloc(n, sizeof(bench_record_t));
+    list = calloc(LEGACY_LIST_LEN, sizeof(bench_record_t *));
+    order = malloc(sizeof(unsigned int) * BENCH_NUM_LOOKUPS);
+    if (rec == NULL || list == NULL || order == NULL) {
+        fprintf(stderr, "error: could not allocate memory for %u flows\n", n);
+        free(rec);
+        free(list);
+        free(order);
+        return 1;
+    }
+    for (i = 0; i < n; i++) {
+        bench_key(&rec[i].key, i, &state);
+    }
+    for (i = 0; i < BENCH_NUM_LOOKUPS; i++) {
+        order[i] = (unsigned int)(bench_rand(&state) % n);
+    }
+
+    /*
+     * legacy lists; every insert is preceded by a lookup that misses,
+     * as in flow_key_get_record()
+     */
+    gettimeofday(&start, NULL);
+    for (i = 0; i < n; i++) {
+        if (legacy_find(list, &rec[i].key) == NULL) {
+            rec[i].key_hash = legacy_hash(&rec[i].key);
+            legacy_prepend(list, &rec[i]);
+        }
+    }
+    legacy_insert = bench_elapsed(&start);
+
+    gettimeofday(&start, NULL);
+    for (i = 0; i < BENCH_NUM_LOOKUPS; i++) {
+        found += (legacy_find(list, &rec[order[i]].key) == &rec[order[i]]);
+    }
+    legacy_lookup = bench_elapsed(&start);
+
+    /* flow table */
+    memset_s(&table, sizeof(table), 0x00, sizeof(table));
+    flow_table_init(&table, 0);
+    gettimeofday(&start, NULL);
+    for (i = 0; i < n; i++) {
+        uint32_t hash = flow_table_hash(&rec[i].key);
+
+        if (flow_table_find(&table, &rec[i].key, hash) == NULL) {
+            if (flow_table_insert(&table, (flow_record_t *)(void *)&rec[i], hash) != ok) {
+                fprintf(stderr, "error: flow table insert failed at %u flows\n", i);
+                break;
+            }
+        }
+    }
+    table_insert = bench_elapsed(&start);
+
+    gettimeofday(&start, NULL);
+    for (i = 0; i < BENCH_NUM_LOOKUPS; i++) {
+        const flow_key_t *key = &rec[order[i]].key;
+
+        found += (flow_table_find(&table, key, flow_table_hash(key)) == (flow_record_t *)(void *)&rec[order[i]]);
+    }
+    table_lookup = bench_elapsed(&start);
+
+    printf("%10u flows | insert: lists %8.2f Mops/s, table %8.2f Mops/s | lookup: lists %8.2f Mops/s, table %8.2f Mops/s\n",
+           n, n / legacy_insert / 1e6, n / table_insert / 1e6,
+           BENCH_NUM_LOOKUPS / legacy_lookup / 1e6, BENCH_NUM_LOOKUPS / table_lookup / 1e6);
+    if (found != 2 * BENCH_NUM_LOOKUPS) {
+        fprintf(stderr, "error: %u of %u lookups failed\n", 2 * BENCH_NUM_LOOKUPS - found, 2 * BENCH_NUM_LOOKUPS);
+    }
+
+    flow_table_free(&table);
+    free(rec);
+    free(list);
+    free(order);
+
+    return (found != 2 * BENCH_NUM_LOOKUPS);
+}
+
+/**
+ * \fn int main (int argc, char* argv[])
+ * \brief main entry point for the flow table benchmark
+ * \return 0 on success, 1 on error
+ */
+int main (int argc, char *argv[]) {
+    static const unsigned int default_sizes[] = { 10000, 1000000, 10000000 };
+    joy_init_t init_data;
+    int i, rc = 0;
+
+    /* setup the joy options we want */
+    memset_s(&init_data, sizeof(joy_init_t), 0x00, sizeof(joy_init_t));
+    init_data.verbosity = JOY_LOG_WARN;
+
+    /* intialize joy */
+    if (joy_initialize(&init_data, NULL, NULL, NULL) != 0) {
+        printf(" -= Joy Initialized Failed =-\n");
+        return -1;
+    }
+
+    if (argc > 1) {
+        for (i = 1; i < argc; i++) {
+            unsigned long n = strtoul(argv[i], NULL, 0);
+
+            if (n == 0 || n > 0x40000000) {
+                fprintf(stderr, "error: invalid number of flows \"%s\"\n", argv[i]);
+                rc = 1;
+                continue;
+            }
+            rc |= bench_run((unsigned int)n);
+        }
+    } else {
+        for (i = 0; i < (int)(sizeof(default_sizes) / sizeof(default_sizes[0])); i++) {
+            rc |= bench_run(default_sizes[i]);
+        }
+    }
+
+    joy_context_cleanup(0);
+    joy_shutdown();
+    return rc;
+}
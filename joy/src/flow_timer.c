@@ -0,0 +1,380 @@
+/*
+ *
+ * Copyright (c) 2018 Cisco Systems, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials provided
+ *   with the distribution.
+ *
+ *   Neither the name of the Cisco Systems, Inc. nor the names of its
+ *   contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/**
+ * \file flow_timer.c
+ *
+ * \brief hierarchical timer wheel for flow record expiry
+ *
+ ** The wheel has FLOW_TIMER_LEVELS levels of FLOW_TIMER_SLOTS slots
+ *  each.  A tick is one millisecond.  A record due less than 2^8 ticks
+ *  from the current tick lives on level 0, indexed by the low eight bits
+ *  of its tick; a record due less than 2^16 ticks away lives on level 1,
+ *  indexed by the next eight bits, and so on.  Whenever the low bits of
+ *  the clock wrap to zero, the matching slot of the next level up is
+ *  cascaded down, so that every record reaches level 0 before its tick.
+ *
+ ** Records are threaded through their slot with an intrusive singly
+ *  linked list (wheel_next) plus a back pointer to the link that points
+ *  at them (wheel_pprev), so removal does not need to know the slot.
+ *
+ */
+
+#include <stdlib.h>
+#include "safe_lib.h"
+#include "flow_timer.h"
+#include "err.h"
+
+/**
+ * \brief Convert a timeval into a timer wheel tick.
+ * \param tv Time to convert
+ * \return Number of milliseconds represented by \p tv
+ */
+uint64_t flow_timer_tick (const struct timeval *tv) {
+    return (uint64_t)tv->tv_sec * 1000 + (uint64_t)tv->tv_usec / 1000;
+}
+
+/**
+ * \brief Reset the timer wheel so that it holds no records.
+ *
+ * The scratch batch array is kept, so that a wheel can be reset
+ * between input files without giving up its memory.
+ *
+ * \param w Timer wheel
+ * \return none
+ */
+void flow_timer_init (flow_timer_wheel_t *w) {
+    w->clk = 0;
+    w->cascaded = 0;
+    memset_s(w->level_count, sizeof(w->level_count), 0x00, sizeof(w->level_count));
+    memset_s(w->slot, sizeof(w->slot), 0x00, sizeof(w->slot));
+}
+
+/**
+ * \brief Release the memory owned by the timer wheel and reset it.
+ * \param w Timer wheel
+ * \return none
+ */
+void flow_timer_free (flow_timer_wheel_t *w) {
+    free(w->batch);
+    w->batch = NULL;
+    w->batch_size = 0;
+    flow_timer_init(w);
+}
+
+/**
+ * \brief Link a record into the slot that corresponds to its tick.
+ * \param w Timer wheel
+ * \param r Flow record; r->wheel_expires must already be set
+ * \return none
+ */
+static void flow_timer_link (flow_timer_wheel_t *w, flow_record_t *r) {
+    uint64_t delta;
+    unsigned int level = 0;
+    flow_record_t **head;
+
+    if (r->wheel_expires < w->clk) {
+        /* overdue; it will be looked at by the next sweep */
+        r->wheel_expires = w->clk;
+    }
+    delta = r->wheel_expires - w->clk;
+    if (delta > FLOW_TIMER_MAX_DELTA) {
+        /* too far away; park it at the edge of the wheel and look again then */
+        r->wheel_expires = w->clk + FLOW_TIMER_MAX_DELTA;
+        delta = FLOW_TIMER_MAX_DELTA;
+    }
+    while (level < FLOW_TIMER_LEVELS - 1 &&
+           delta >= (1ULL << ((level + 1) * FLOW_TIMER_SLOT_BITS))) {
+        level++;
+    }
+
+    head = &w->slot[level][(r->wheel_expires >> (level * FLOW_TIMER_SLOT_BITS)) & FLOW_TIMER_SLOT_MASK];
+    r->wheel_next = *head;
+    if (*head != NULL) {
+        (*head)->wheel_pprev = &r->wheel_next;
+    }
+    *head = r;
+    r->wheel_pprev = head;
+    r->wheel_level = level;
+    w->level_count[level]++;
+}
+
+/**
+ * \brief Schedule a flow record in the timer wheel.
+ * \param w Timer wheel
+ * \param r Flow record, which must not already be scheduled
+ * \param expires Tick at which the record should be looked at
+ * \return none
+ */
+void flow_timer_add (flow_timer_wheel_t *w, flow_record_t *r, uint64_t expires) {
+    r->wheel_expires = expires;
+    flow_timer_link(w, r);
+}
+
+/**
+ * \brief Remove a flow record from the timer wheel.
+ * \param w Timer wheel
+ * \param r Flow record; nothing is done if it is not scheduled
+ * \return none
+ */
+void flow_timer_del (flow_timer_wheel_t *w, flow_record_t *r) {
+    if (r->wheel_pprev == NULL) {
+        return;
+    }
+    *r->wheel_pprev = r->wheel_next;
+    if (r->wheel_next != NULL) {
+        r->wheel_next->wheel_pprev = r->wheel_pprev;
+    }
+    r->wheel_next = NULL;
+    r->wheel_pprev = NULL;
+    w->level_count[r->wheel_level]--;
+}
+
+/**
+ * \brief Move a flow record to a new tick in the timer wheel.
+ * \param w Timer wheel
+ * \param r Flow record
+ * \param expires Tick at which the record should be looked at
+ * \return none
+ */
+void flow_timer_mod (flow_timer_wheel_t *w, flow_record_t *r, uint64_t expires) {
+    flow_timer_del(w, r);
+    flow_timer_add(w, r, expires);
+}
+
+/**
+ * \brief Move the records of one upper level slot down the wheel.
+ * \param w Timer wheel
+ * \param level Level to cascade from (at least 1)
+ * \return Index of the slot that was cascaded
+ */
+static unsigned int flow_timer_cascade (flow_timer_wheel_t *w, unsigned int level) {
+    unsigned int idx = (w->clk >> (level * FLOW_TIMER_SLOT_BITS)) & FLOW_TIMER_SLOT_MASK;
+    flow_record_t *r = w->slot[level][idx];
+    flow_record_t *next;
+
+    w->slot[level][idx] = NULL;
+    while (r != NULL) {
+        next = r->wheel_next;
+        w->level_count[level]--;
+        flow_timer_link(w, r);
+        r = next;
+    }
+    return idx;
+}
+
+/**
+ * \brief Unlink all of the records in the level 0 slot for the current tick
+ * and prepend them to \p due.
+ * \param w Timer wheel
+ * \param due List of records that are due
+ * \return The new head of the due list
+ */
+static flow_record_t *flow_timer_collect (flow_timer_wheel_t *w, flow_record_t *due) {
+    unsigned int level;
+    flow_record_t **head;
+    flow_record_t *r;
+
+    if (!w->cascaded) {
+        for (level = 1; level < FLOW_TIMER_LEVELS; level++) {
+            if ((w->clk & ((1ULL << (level * FLOW_TIMER_SLOT_BITS)) - 1)) != 0) {
+                break;
+            }
+            if (flow_timer_cascade(w, level) != 0) {
+                break;
+            }
+        }
+        w->cascaded = 1;
+    }
+
+    head = &w->slot[0][w->clk & FLOW_TIMER_SLOT_MASK];
+    while (*head != NULL) {
+        r = *head;
+        *head = r->wheel_next;
+        r->wheel_pprev = NULL;
+        r->wheel_next = due;
+        due = r;
+        w->level_count[0]--;
+    }
+    return due;
+}
+
+/**
+ * \brief Advance the wheel clock by one step towards \p now.
+ *
+ * Empty stretches of the wheel are skipped: if levels 0 through k-1
+ * hold no records, nothing can happen before the next tick at which
+ * level k cascades, so the clock jumps straight there.
+ *
+ * \param w Timer wheel
+ * \param now Tick to advance towards
+ * \return none
+ */
+static void flow_timer_step (flow_timer_wheel_t *w, uint64_t now) {
+    unsigned int level = 0;
+    uint64_t next;
+
+    while (level < FLOW_TIMER_LEVELS && w->level_count[level] == 0) {
+        level++;
+    }
+    if (level == FLOW_TIMER_LEVELS) {
+        next = now;
+    } else if (level == 0) {
+        next = w->clk + 1;
+    } else {
+        next = ((w->clk >> (level * FLOW_TIMER_SLOT_BITS)) + 1) << (level * FLOW_TIMER_SLOT_BITS);
+        if (next > now) {
+            next = now;
+        }
+    }
+    w->clk = next;
+    w->cascaded = 0;
+}
+
+/**
+ * \brief Unlink every record that is due at or before tick \p now.
+ *
+ * The slot for the current tick is looked at on every call, even if
+ * the clock does not move, so records that were rescheduled within
+ * the current millisecond are not missed.
+ *
+ * \param w Timer wheel
+ * \param now Current tick
+ * \return Records that are due, linked through wheel_next, or NULL
+ */
+flow_record_t *flow_timer_expire (flow_timer_wheel_t *w, uint64_t now) {
+    flow_record_t *due = NULL;
+
+    while (w->clk < now) {
+        due = flow_timer_collect(w, due);
+        flow_timer_step(w, now);
+    }
+    return flow_timer_collect(w, due);
+}
+
+/**
+ * \brief Unit test for the timer wheel.
+ * \param none
+ * \return Number of failures
+ */
+int flow_timer_unit_test (void) {
+    flow_timer_wheel_t *w;
+    flow_record_t rec[4];
+    flow_record_t *due;
+    uint64_t ticks[4] = { 5, 300, 70000, 20000000 };
+    uint64_t now;
+    unsigned int i, n, num_fails = 0;
+
+    fprintf(info, "\n******************************\n");
+    fprintf(info, "Flow timer Unit Test starting...\n");
+
+    w = calloc(1, sizeof(flow_timer_wheel_t));
+    if (w == NULL) {
+        fprintf(info, "Out of memory\n");
+        return 1;
+    }
+    flow_timer_init(w);
+    memset_s(rec, sizeof(rec), 0x00, sizeof(rec));
+
+    /* start the clock somewhere that is not on a slot boundary */
+    w->clk = 1000003;
+    for (i = 0; i < 4; i++) {
+        flow_timer_add(w, &rec[i], w->clk + ticks[i]);
+    }
+
+    /* nothing is due yet */
+    if (flow_timer_expire(w, w->clk) != NULL) {
+        joy_log_err("record due too early");
+        num_fails++;
+    }
+
+    /* each record must come out at its own tick, and not before */
+    for (i = 0; i < 4; i++) {
+        now = rec[i].wheel_expires;
+        if (flow_timer_expire(w, now - 1) != NULL) {
+            joy_log_err("record %u due before its tick", i);
+            num_fails++;
+        }
+        due = flow_timer_expire(w, now);
+        if (due != &rec[i] || due->wheel_next != NULL) {
+            joy_log_err("record %u not due at its tick", i);
+            num_fails++;
+        }
+    }
+
+    /* a record added in the past is due on the next sweep */
+    flow_timer_add(w, &rec[0], 0);
+    if (flow_timer_expire(w, w->clk) != &rec[0]) {
+        joy_log_err("overdue record not returned");
+        num_fails++;
+    }
+
+    /* deleted records never come out, rescheduled ones come out once */
+    flow_timer_add(w, &rec[1], w->clk + 10);
+    flow_timer_add(w, &rec[2], w->clk + 20);
+    flow_timer_del(w, &rec[1]);
+    flow_timer_mod(w, &rec[2], w->clk + 1000);
+    n = 0;
+    for (due = flow_timer_expire(w, w->clk + 5000); due != NULL; due = due->wheel_next) {
+        if (due != &rec[2]) {
+            joy_log_err("unexpected record returned");
+            num_fails++;
+        }
+        n++;
+    }
+    if (n != 1) {
+        joy_log_err("expected 1 record, got %u", n);
+        num_fails++;
+    }
+    for (i = 0; i < FLOW_TIMER_LEVELS; i++) {
+        if (w->level_count[i] != 0) {
+            joy_log_err("level %u not empty", i);
+            num_fails++;
+        }
+    }
+
+    flow_timer_free(w);
+    free(w);
+
+    if (num_fails) {
+        fprintf(info, "Finished - failures: %d\n", num_fails);
+    } else {
+        fprintf(info, "Finished - success\n");
+    }
+    fprintf(info, "******************************\n\n");
+
+    return num_fails;
+}
@@ -57,15 +57,16 @@ extern FILE *info;
  * \brief Initialize the memory of fpx struct.
  *
  * \param fpx_handle contains fpx structure to init
+ * \param pool pool to allocate the structure from, or NULL for the heap
  *
  * \return none
  */
-void fpx_init(struct fpx **fpx_handle) {
+void fpx_init(struct fpx **fpx_handle, flow_pool_t *pool) {
     if (*fpx_handle != NULL) {
-        fpx_delete(fpx_handle);
+        fpx_delete(fpx_handle, pool);
     }
 
-    *fpx_handle = calloc(1, sizeof(struct fpx));
+    *fpx_handle = flow_pool_calloc(pool, sizeof(struct fpx));
     if (*fpx_handle == NULL) {
         /* Allocation failed */
         joy_log_err("malloc failed");
@@ -161,10 +162,11 @@ void fpx_print_json (const struct fpx *x1, const struct fpx *x2, zfile f) {
  * \brief Delete the memory of fpx struct.
  *
  * \param fpx_handle contains fpx structure to delete
+ * \param pool pool that the structure was allocated from, or NULL
  *
  * \return none
  */
-void fpx_delete (struct fpx **fpx_handle) { 
+void fpx_delete (struct fpx **fpx_handle, flow_pool_t *pool) { 
     struct fpx *fpx = *fpx_handle;
 
     if (fpx == NULL) {
@@ -172,7 +174,7 @@ void fpx_delete (struct fpx **fpx_handle) {
     }
 
     /* Free the memory and set to NULL */
-    free(fpx);
+    flow_pool_free(pool, fpx);
     *fpx_handle = NULL;
 }
 
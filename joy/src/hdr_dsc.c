@@ -44,9 +44,6 @@
 #include "safe_lib.h"
 #include "p2f.h"
 
-/** maximum number of description headers */
-#define MAX_NUM_HDRS 10
-
 /**
  * \fn void header_description_init (header_description_t *hd)
  * \param hd pointer to the header description structure
@@ -77,15 +77,16 @@ static void http_print_message(zfile f, const struct http_message *msg);
  * \brief Initialize the memory of HTTP struct.
  *
  * \param http_handle contains http structure to initialize
+ * \param pool pool to allocate the structure from, or NULL for the heap
  *
  * \return none
  */
-void http_init (http_t **http_handle) {
+void http_init (http_t **http_handle, flow_pool_t *pool) {
     if (*http_handle != NULL) {
-        http_delete(http_handle);
+        http_delete(http_handle, pool);
     }
 
-    *http_handle = calloc(1, sizeof(http_t));
+    *http_handle = flow_pool_calloc(pool, sizeof(http_t));
     if (*http_handle == NULL) {
         /* Allocation failed */
         joy_log_err("malloc failed");
@@ -321,9 +322,10 @@ void http_free_message(struct http_message *msg) {
 /**
  * \fn void http_delete (http_data_t *data)
  * \param data pointer to the http data structure
+ * \param pool pool that the structure was allocated from, or NULL
  * \return none
  */
-void http_delete (struct http **http_handle) {
+void http_delete (struct http **http_handle, flow_pool_t *pool) {
     struct http *http = *http_handle;
     struct http_message *msg = NULL;
     int i = 0;
@@ -338,7 +340,7 @@ void http_delete (struct http **http_handle) {
     }
 
     /* Free the memory and set to NULL */
-    free(http);
+    flow_pool_free(pool, http);
     *http_handle = NULL;
 }
 
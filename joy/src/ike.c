@@ -4983,21 +4983,22 @@ static void ike_process(const ike_t *init,
  */
 
 /**
- * \fn void ike_init(ike_t **ike_handle)
+ * \fn void ike_init(ike_t **ike_handle, flow_pool_t *pool)
  *
  * \brief Initialize the memory of IKE structure.
  *
  * \param ike_handle Contains IKE structure to initialize.
+ * \param pool pool to allocate the structure from, or NULL for the heap
  *
  * \return
  */
-void ike_init(ike_t **ike_handle) {
+void ike_init(ike_t **ike_handle, flow_pool_t *pool) {
 
     if (*ike_handle != NULL) {
-        ike_delete(ike_handle);
+        ike_delete(ike_handle, pool);
     }
 
-    *ike_handle = calloc(1, sizeof(ike_t));
+    *ike_handle = flow_pool_calloc(pool, sizeof(ike_t));
     if (*ike_handle == NULL) {
         joy_log_err("malloc failed");
         return;
@@ -5149,15 +5150,16 @@ void ike_print_json(const ike_t *data,
 }
 
 /**
- * \fn void ike_delete (const ike_t **ike_handle)
+ * \fn void ike_delete (const ike_t **ike_handle, flow_pool_t *pool)
  *
  * \brief Delete IKE structure structure and free all associated memory.
  *
  * \param ike_handle Contains IKE structure to delete.
+ * \param pool pool that the structure was allocated from, or NULL
  *
  * \return
  */
-void ike_delete(ike_t **ike_handle) {
+void ike_delete(ike_t **ike_handle, flow_pool_t *pool) {
     ike_t *ike= *ike_handle;
     unsigned int i;
 
@@ -5169,7 +5171,7 @@ void ike_delete(ike_t **ike_handle) {
     }
 
     vector_delete(&ike->buffer);
-    free(ike);
+    flow_pool_free(pool, ike);
     *ike_handle = NULL;
 }
 
@@ -5384,7 +5386,7 @@ static int ike_test_v1_handshake(void) {
         0xa3, 0x80, 0xbe, 0x24, 0x12, 0xe2, 0xc0, 0xd4
     };
 
-    ike_init(&init);
+    ike_init(&init, NULL);
     ike_update(init, NULL, init_main_sa, sizeof(init_main_sa), 1);
     ike_update(init, NULL, init_main_notify, sizeof(init_main_notify), 1);
     ike_update(init, NULL, init_main_ke, sizeof(init_main_ke), 1);
@@ -5392,7 +5394,7 @@ static int ike_test_v1_handshake(void) {
     ike_update(init, NULL, init_main_hash, sizeof(init_main_hash), 1);
     ike_update(init, NULL, init_main_hash_2, sizeof(init_main_hash_2), 1);
 
-    ike_init(&resp);
+    ike_init(&resp, NULL);
     ike_update(resp, NULL, resp_main_sa, sizeof(resp_main_sa), 1);
     ike_update(resp, NULL, resp_main_sa_2, sizeof(resp_main_sa_2), 1);
     ike_update(resp, NULL, resp_main_ke, sizeof(resp_main_ke), 1);
@@ -5427,8 +5429,8 @@ static int ike_test_v1_handshake(void) {
         num_fails++;
     }
 
-    ike_delete(&init);
-    ike_delete(&resp);
+    ike_delete(&init, NULL);
+    ike_delete(&resp, NULL);
     return num_fails;
 }
 
@@ -5579,12 +5581,12 @@ static int ike_test_v2_handshake(void) {
         0x68, 0x6f, 0x60, 0xca
     };
 
-    ike_init(&init);
+    ike_init(&init, NULL);
     ike_update(init, NULL, init_sa, sizeof(init_sa), 1);
     ike_update(init, NULL, init_auth, sizeof(init_auth), 1);
     ike_update(init, NULL, init_info, sizeof(init_info), 1);
 
-    ike_init(&resp);
+    ike_init(&resp, NULL);
     ike_update(resp, NULL, resp_sa, sizeof(resp_sa), 1);
     ike_update(resp, NULL, resp_auth, sizeof(resp_auth), 1);
     ike_update(resp, NULL, resp_info, sizeof(resp_info), 1);
@@ -5618,8 +5620,8 @@ static int ike_test_v2_handshake(void) {
         num_fails++;
     }
 
-    ike_delete(&init);
-    ike_delete(&resp);
+    ike_delete(&init, NULL);
+    ike_delete(&resp, NULL);
     return num_fails;
 }
 
@@ -0,0 +1,124 @@
+/*
+ *
+ * Copyright (c) 2018 Cisco Systems, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials provided
+ *   with the distribution.
+ *
+ *   Neither the name of the Cisco Systems, Inc. nor the names of its
+ *   contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+/**
+ * \file af_packet.h
+ *
+ * \brief live capture through a Linux TPACKET_V3 ring
+ *
+ ** An AF_PACKET socket shares a ring of blocks with the kernel, which
+ *  fills a block with as many packets as fit (or as arrive before the
+ *  block times out) and then hands the whole block over.  Joy processes
+ *  the packets of a block in place and gives the block back, so there is
+ *  one wakeup per block rather than per packet, and no copies.
+ *
+ ** Several sockets can join a PACKET_FANOUT group, with the kernel
+ *  spreading the packets among them by a hash of the flow; the hash is
+ *  the same for both directions of a flow, so each socket sees whole
+ *  bidirectional flows.
+ *
+ ** The kernel counts the packets that it had to drop because the ring
+ *  was full; they are read with af_packet_get_stats().
+ *
+ ** On systems other than Linux, af_packet_open() fails.
+ *
+ */
+
+#ifndef AF_PACKET_H
+#define AF_PACKET_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pcap.h>
+#include "err.h"
+
+/** size of the ring of a socket when none is given, in megabytes */
+#define AF_PACKET_RING_MB 64
+
+/** size of a block of the ring; a power of two, and a multiple of the page size */
+#define AF_PACKET_BLOCK_SIZE (1 << 20)
+
+/** nominal size of a frame; TPACKET_V3 packs packets, but the kernel wants one */
+#define AF_PACKET_FRAME_SIZE 2048
+
+/** the kernel hands over a block that is not full after this many milliseconds */
+#define AF_PACKET_BLOCK_TIMEOUT 50
+
+/** longest packet that is handed to the callback */
+#define AF_PACKET_SNAPLEN 65535
+
+/** counters kept by the kernel for a socket */
+typedef struct af_packet_stats_ {
+    unsigned long int packets;             /*!< packets seen, including the dropped ones */
+    unsigned long int drops;               /*!< packets dropped because the ring was full */
+    unsigned long int freezes;             /*!< times the ring was found full            */
+} af_packet_stats_t;
+
+typedef struct af_packet_ {
+    int fd;                                /*!< the socket, or -1                 */
+    unsigned char *map;                    /*!< the ring, mapped from the kernel  */
+    size_t map_size;                       /*!< bytes in the ring                 */
+    unsigned int num_blocks;               /*!< blocks in the ring                */
+    unsigned int block;                    /*!< next block to be handed over      */
+    af_packet_stats_t stats;               /*!< counters read from the kernel so far */
+    unsigned char *bounce;                 /*!< packet with its VLAN tag put back */
+    int loopback;                          /*!< nonzero on a loopback interface   */
+} af_packet_t;
+
+/**
+ * open a socket on the interface if_name, with a ring of ring_mb
+ * megabytes (0 for the default), in promiscuous mode if promisc is
+ * nonzero, keeping only the packets that match filter_exp (if not
+ * NULL); a nonzero fanout_group makes the socket join that fanout group
+ */
+joy_status_e af_packet_open(af_packet_t *a, const char *if_name, unsigned int ring_mb,
+                            int promisc, const char *filter_exp, unsigned int fanout_group);
+
+/**
+ * hand the packets of the next block of the ring to callback, waiting
+ * up to timeout milliseconds for one; returns the number of packets,
+ * 0 if no block was ready, or -1 on error
+ */
+int af_packet_dispatch(af_packet_t *a, int timeout, pcap_handler callback, unsigned char *user);
+
+/** bring the counters of the socket up to date, and copy them to stats */
+void af_packet_get_stats(af_packet_t *a, af_packet_stats_t *stats);
+
+/** close the socket and unmap its ring */
+void af_packet_close(af_packet_t *a);
+
+int af_packet_unit_test(void);
+
+#endif /* AF_PACKET_H */
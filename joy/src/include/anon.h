@@ -96,6 +96,9 @@ joy_status_e anon_init(const char *pathname, FILE *logfile);
 /** \brief prints the subnets that have been anonymized to output file */
 int anon_print_subnets(FILE *f);
 
+/** \brief converts an address into its 16 anonymized bytes */
+void addr_get_anon_bytes(const struct in_addr *a, unsigned char *c);
+
 /** \brief converts an address into an anonymized string */
 char *addr_get_anon_hexstring(const struct in_addr *a);
 
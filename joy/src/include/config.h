@@ -51,6 +51,7 @@
 #endif
 
 #include "output.h"
+#include "joybin.h"
 #include "radix_trie.h"
 #include "feature.h"
 
@@ -58,6 +59,9 @@
 #define LINEMAX 512
 #define COMPACT_BD_MAP_MAX 16
 
+/** most worker threads that threads=N or jobs=N can ask for */
+#define MAX_NUM_THREADS 64
+
 #define NULL_KEYWORD "none"
 #define NULL_KEYWORD_LEN 4
  
@@ -85,6 +89,9 @@ struct configuration {
     bool show_config;
     bool show_interfaces;
     bool preemptive_timeout;
+    bool hugepages;                    /*!< back the flow record pools with huge pages */
+    bool afpacket;                     /*!< capture live packets from a TPACKET_V3 ring */
+    bool admission;                    /*!< create flow records on the second packet of a flow */
     enum SALT_algorithm salt_algo;
 
     uint8_t report_hd;
@@ -122,7 +129,18 @@ struct configuration {
     char *aux_resource_path;
 
     uint32_t max_records;
-    uint16_t compact_bd_mapping[COMPACT_BD_MAP_MAX];
+    uint32_t flow_table_size;          /*!< initial flow table capacity, 0 for default */
+    uint32_t max_flows;                /*!< flow records per context before eviction, 0 for no limit */
+    uint32_t dedup;                    /*!< microseconds within which copies of a packet are dropped, 0 for off */
+    uint32_t writer_queue;             /*!< records queued for the output writer thread, 0 for no writer */
+    uint32_t backpressure;             /*!< output_backpressure_e: what to do when that queue is full */
+    uint32_t compress_threads;         /*!< threads that compress the output in blocks, 0 for one gzip stream */
+    uint32_t compress_level;           /*!< zlib compression level of the output, 0 for the default */
+    uint32_t output_format;            /*!< output_format_e: flow records as JSON or binary */
+    uint32_t num_threads;              /*!< worker threads for pcap files, 0 or 1 for none */
+    uint32_t num_jobs;                 /*!< input files processed at the same time, 0 or 1 for one */
+    uint32_t afpacket_ring;            /*!< size of each capture ring in MB, 0 for the default */
+    uint16_t compact_bd_mapping[256];  /*!< byte value to compact bin (< COMPACT_BD_MAP_MAX) */
 
     radix_trie_t rt;
 };
@@ -143,5 +161,14 @@ void config_print(FILE *f, const struct configuration *c);
 /** print out the configuration in JSON format */
 void config_print_json(zfile f, const struct configuration *c);
 
+/** optional fields of binary flow records, as joybin_field_e bits */
+unsigned int config_binary_fields(const struct configuration *c);
+
+/** check that the output format can be used with the rest of the configuration */
+int config_check_format(const struct configuration *c);
+
+/** schema of binary flow records */
+void config_binary_schema(const struct configuration *c, joybin_schema_t *schema);
+
 extern struct configuration *glb_config;
 #endif /* CONFIG_H */
@@ -48,6 +48,7 @@
 #include <stdint.h>
 #include <pcap.h>
 #include "output.h"
+#include "flow_pool.h"
 #include "utils.h"
 
 #ifdef WIN32
@@ -65,6 +66,9 @@
      ) \
     )
 
+/** dhcp done: true once the message array is full */
+#define dhcp_done(dhcp) ((dhcp)->message_count >= MAX_DHCP_LEN)
+
 #define MAX_DHCP_LEN 16
 #define MAX_DHCP_CHADDR 16
 #define MAX_DHCP_SNAME 64
@@ -105,7 +109,7 @@ typedef struct dhcp_ {
     uint16_t message_count;
 } dhcp_t;
 
-void dhcp_init(dhcp_t **dhcp_handle);
+void dhcp_init(dhcp_t **dhcp_handle, flow_pool_t *pool);
 
 void dhcp_update(dhcp_t *dhcp,
                  const struct pcap_pkthdr *header,
@@ -117,7 +121,7 @@ void dhcp_print_json(const dhcp_t *d1,
                      const dhcp_t *d2,
                      zfile f);
 
-void dhcp_delete(dhcp_t **dhcp_handle);
+void dhcp_delete(dhcp_t **dhcp_handle, flow_pool_t *pool);
 
 void dhcp_unit_test(void);
 
@@ -43,6 +43,7 @@
 
 #include <pcap.h>
 #include "output.h"
+#include "flow_pool.h"
 
 /** usage string */
 #define dns_usage "  dns=1                      report DNS response information\n"
@@ -53,6 +54,9 @@
      (record->app == 53 || (record->key.dp == 53 || record->key.sp == 53)) \
     )
 
+/** dns done: true once the DNS packet array is full */
+#define dns_done(dns) ((dns)->pkt_count >= MAX_NUM_DNS_PKT)
+
 /** maximum number of DNS packets */
 #define MAX_NUM_DNS_PKT 200
 
@@ -67,7 +71,7 @@ typedef struct dns_ {
 } dns_t;
 
 /** initialize DNS structure */
-void dns_init(dns_t **dns_handle);
+void dns_init(dns_t **dns_handle, flow_pool_t *pool);
 
 /** DNS structure update */
 void dns_update(dns_t *dns, 
@@ -80,7 +84,7 @@ void dns_update(dns_t *dns,
 void dns_print_json(const dns_t *dns1, const dns_t *dns2, zfile f);
 
 /** remove a DNS entry */
-void dns_delete(dns_t **dns_handle);
+void dns_delete(dns_t **dns_handle, flow_pool_t *pool);
 
 /** main entry point for DNS unit testing */
 void dns_unit_test(void);
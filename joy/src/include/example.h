@@ -53,6 +53,9 @@
 
 /** example filter key */
 #define example_filter(record) 1
+
+/** example is never done, the counter counts every packet */
+#define example_done(example) 0
   
 /** example structure */
 typedef struct example {
@@ -63,7 +66,7 @@ typedef struct example {
 declare_feature(example);
 
 /** initialization function */
-void example_init(struct example **example_handle);
+void example_init(struct example **example_handle, flow_pool_t *pool);
 
 /** update example */
 void example_update(struct example *example, 
@@ -78,7 +81,7 @@ void example_print_json(const struct example *w1,
 		    zfile f);
 
 /** delete example */
-void example_delete(struct example **example_handle);
+void example_delete(struct example **example_handle, flow_pool_t *pool);
 
 /** example unit test entry point */
 void example_unit_test(void);
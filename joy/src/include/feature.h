@@ -69,11 +69,19 @@
  *   4) define the macro F_filter(key), in the header file, to be a C
  *      expression that operates on the struct flow_key (in p2f.h) and
  *      evaluates to true for flows on which the data feature should
- *      be collecting information, 
+ *      be collecting information (it is evaluated when the flow record
+ *      is created and when its application protocol is identified,
+ *      not on every packet),
  *
- *   5) add the C header file to the files included in modules.h, and
+ *   5) define the macro F_done(f), in the header file, to be a C
+ *      expression that evaluates to true once the feature context f
+ *      will not change on any further packet (or to 0, if it never
+ *      stops changing); flows on which every feature is done take
+ *      the counters-only fast path in pkt_proc.c,
  *
- *   6) add F to the comma-separated list, in the #define for
+ *   6) add the C header file to the files included in modules.h, and
+ *
+ *   7) add F to the comma-separated list, in the #define for
  *   feature_list below.
  *
  * The files example.c and example.h provide a simple example of a
@@ -104,6 +112,7 @@
 #include "err.h"
 #include "output.h"
 #include "map.h"
+#include "flow_pool.h"
 
 
 /** The feature_list macro defines all of the features that will be
@@ -112,10 +121,32 @@
  */
 //#define ip_feature_list
 #define tcp_feature_list salt, ppi, fpx
-#define payload_feature_list wht, example, dns, ssh, tls, dhcp, http, ike, payload
+/* wht is updated by flow_record_update_payload_stats(), with the byte distribution */
+#define scanned_feature_list wht
+#define parsed_feature_list example, dns, ssh, tls, dhcp, http, ike, payload
+#define payload_feature_list scanned_feature_list, parsed_feature_list
 #define feature_list payload_feature_list, tcp_feature_list
 //#define feature_list payload_feature_list, ip_feature_list, tcp_feature_list
 
+/** The macro declare_feature_index(f) names the position of feature f
+ * in feature_list
+ */
+#define declare_feature_index(f) feature_index_##f,
+
+/** feature_index_F is the position of feature F in feature_list, and
+ * num_features is the number of features; they must fit in the
+ * features mask of a flow record
+ */
+enum feature_index {
+    MAP(declare_feature_index, feature_list)
+    num_features
+};
+
+/** The macro feature_bit(f) is the bit of feature f in the features
+ * mask of a flow record
+ */
+#define feature_bit(f) (1u << feature_index_##f)
+
 //#define define_feature_config_uint(f) unsigned int report_##f = 0;
 //#define define_all_features_config_uint(flist) MAP(define_feature_config_uint, flist)
 
@@ -129,12 +160,14 @@
 //#define set_config_all_features(flist) MAP(set_config_feature, flist)
 
 
-/** The function feature_init(ptr) is invoked on a pointer to a data
+/** The function feature_init(ptr, pool) is invoked on a pointer to a data
  * feature, it initializes an instance of the feature, possibly 
- * performing memory allocation as a side effect
+ * performing memory allocation as a side effect; the feature structure
+ * itself is allocated from pool (see flow_pool.h), or from the heap if
+ * pool is NULL.
  * This function is called in flow_record_init() in p2f.c.
  */
-#define declare_init(F) void F##_init(F##_t **f)
+#define declare_init(F) void F##_init(F##_t **f, flow_pool_t *pool)
 
 /** \brief \verbatim
  * The function feature_update(feature, header, data, data_len, report_feature)
@@ -176,14 +209,15 @@ void F##_print_json(const F##_t *F,      \
 
 
 /** \brief \verbatim
- * The function feature_delete_func(ptr), when invoked on a feature_ptr,
- * frees any and all memory that is allocated by feature_init().  It
+ * The function feature_delete_func(ptr, pool), when invoked on a feature_ptr,
+ * frees any and all memory that is allocated by feature_init(), returning
+ * the feature structure to the pool that it was allocated from.  It
  * may also zeroize that memory.
  * 
  * This function is called in flow_record_delete(), in the file p2f.c
  * \endverbatim
  */
-#define declare_delete(F) void F##_delete(F##_t **F);
+#define declare_delete(F) void F##_delete(F##_t **F, flow_pool_t *pool);
 
 
 /** \brief \verbatim
@@ -221,12 +255,25 @@ void F##_print_json(const F##_t *F,      \
  */
 #define init_feature(f) record->f=NULL;
 
+/** The macro feature_mask_bit(f) is the bit of feature f if it is
+ * reported and applies to record, and zero otherwise
+ */
+#define feature_mask_bit(f) \
+    | ((glb_config->report_##f && f##_filter(record)) ? feature_bit(f) : 0u)
+
+/** The macro feature_mask(list) is the mask of the features in list
+ * that are reported and apply to record; it is worked out when the
+ * record is created, and again when its application protocol is
+ * identified, so that the packet path tests one bit per feature
+ */
+#define feature_mask(list) (0u MAP(feature_mask_bit, list))
+
 /** The macro update_feature(f) processes a single packet and updates
  * the feature context
  */
 #define update_feature(f) \
-    if (f##_filter(record) && (glb_config->report_##f)) { \
-        if (record->f == NULL) f##_init(&record->f); \
+    if (record->features & feature_bit(f)) { \
+        if (record->f == NULL) f##_init(&record->f, &ctx->feature_pools.f); \
         f##_update(record->f, header, payload, size_payload, glb_config->report_##f); \
     }
 
@@ -236,7 +283,7 @@ void F##_print_json(const F##_t *F,      \
 #if 0
 #define update_ip_feature(f) \
     if (f##_filter(key) && (glb_config->report_##f)) { \
-        if (record->f == NULL) f##_init(&record->f); \
+        if (record->f == NULL) f##_init(&record->f, &ctx->feature_pools.f); \
         f##_update(record->f, header, ip, ip_hdr_len, glb_config->report_##f); \
     }
 #endif
@@ -245,11 +292,23 @@ void F##_print_json(const F##_t *F,      \
  * a pointer to the TCP header, and updates the feature context
  */
 #define update_tcp_feature(f) \
-    if (f##_filter(record) && (glb_config->report_##f)) { \
-        if (record->f == NULL) f##_init(&record->f); \
+    if (record->features & feature_bit(f)) { \
+        if (record->f == NULL) f##_init(&record->f, &ctx->feature_pools.f); \
         f##_update(record->f, header, transport_start, transport_len, glb_config->report_##f); \
     }
 
+/** The macro feature_done(f) is true when the feature f of record
+ * will not change on any further packet, because it is not in the
+ * features mask of the record, or has collected all it looks at
+ */
+#define feature_done(f) \
+    && (!(record->features & feature_bit(f)) || (record->f != NULL && f##_done(record->f)))
+
+/** The macro all_features_done(list) is true when every feature in
+ * list is done with record
+ */
+#define all_features_done(list) (1 MAP(feature_done, list))
+
 /** The macro print_feature(f) prints the feature as JSON 
  */
 #define print_feature(f) if (rec->f != NULL) f##_print_json(rec->f, (rec->twin ? rec->twin->f : NULL), ctx->output);
@@ -258,7 +317,29 @@ void F##_print_json(const F##_t *F,      \
 /** The macro init_feature(f) initializes the element f in the
  * structure record
  */
-#define delete_feature(f) if (r->f != NULL) f##_delete(&r->f);
+#define delete_feature(f) if (r->f != NULL) f##_delete(&r->f, &ctx->feature_pools.f);
+
+/** The macro define_feature_pool(f) instantiates the pool that the
+ * structures of feature f are allocated from
+ */
+#define define_feature_pool(f) flow_pool_t f;
+
+/** The macro init_feature_pool(f) sets up the pool of feature f in the
+ * context ctx
+ */
+#define init_feature_pool(f) \
+    flow_pool_init(&ctx->feature_pools.f, #f, sizeof(f##_t), glb_config->hugepages);
+
+/** The macro destroy_feature_pool(f) releases the pool of feature f in
+ * the context ctx
+ */
+#define destroy_feature_pool(f) flow_pool_destroy(&ctx->feature_pools.f);
+
+/** The macro print_feature_pool_stats(F) prints the occupancy of the pool
+ * of feature F in the context ctx to the file f, if it has ever been used
+ */
+#define print_feature_pool_stats(F) \
+    if (ctx->feature_pools.F.high_water) flow_pool_print_stats(&ctx->feature_pools.F, time_str, f);
 
 #define unit_test_feature(F) F##_unit_test();
 
@@ -274,7 +355,7 @@ void F##_print_json(const F##_t *F,      \
 
 #define config_print_all_features_bool(feature_list) MAP(config_print_feature_bool, feature_list)
 
-#define config_print_json_feature_bool(F) zprintf(f, "\"" #F "\":%u,", c->report_##F);
+#define config_print_json_feature_bool(F) json_buf_printf(&line, "\"" #F "\":%u,", c->report_##F);
 
 #define config_print_json_all_features_bool(feature_list) MAP(config_print_json_feature_bool, feature_list)
 
@@ -320,6 +401,26 @@ void F##_print_json(const F##_t *F,      \
 #define delete_all_features(feature_list) MAP(delete_feature, feature_list)
 
 
+/** The macro define_all_feature_pools(list) invokes define_feature_pool()
+ * for each feature in list
+ */
+#define define_all_feature_pools(feature_list) MAP(define_feature_pool, feature_list)
+
+/** The macro init_all_feature_pools(list) invokes init_feature_pool() for
+ * each feature in list
+ */
+#define init_all_feature_pools(feature_list) MAP(init_feature_pool, feature_list)
+
+/** The macro destroy_all_feature_pools(list) invokes destroy_feature_pool()
+ * for each feature in list
+ */
+#define destroy_all_feature_pools(feature_list) MAP(destroy_feature_pool, feature_list)
+
+/** The macro print_all_feature_pool_stats(list) invokes
+ * print_feature_pool_stats() for each feature in list
+ */
+#define print_all_feature_pool_stats(feature_list) MAP(print_feature_pool_stats, feature_list)
+
 /** The macro unit_test_all_features(list) invokes feature_unit_test() for each
  * feature in list
  */
@@ -0,0 +1,156 @@
+/*
+ *
+ * Copyright (c) 2018 Cisco Systems, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials provided
+ *   with the distribution.
+ *
+ *   Neither the name of the Cisco Systems, Inc. nor the names of its
+ *   contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+/**
+ * \file flow_pool.h
+ *
+ * \brief slab pools for flow records and per-feature state
+ *
+ ** A pool hands out fixed size objects that are carved from large
+ *  slabs and kept on a free list when they are released, so that flow
+ *  churn does not turn into a malloc/free pair per flow record and per
+ *  feature.  Slabs are only returned to the system when the pool is
+ *  destroyed; the occupancy and high-water counters tell how much
+ *  memory a capture really needed.
+ *
+ ** Slabs can optionally be backed by huge pages, which cuts the number
+ *  of TLB misses when there are many flows in flight.
+ *
+ */
+
+#ifndef FLOW_POOL_H
+#define FLOW_POOL_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+/** size of the slabs allocated by a pool without huge pages */
+#define FLOW_POOL_SLAB_SIZE (64 * 1024)
+
+/** size of the slabs allocated by a pool with huge pages */
+#define FLOW_POOL_HUGEPAGE_SIZE (2 * 1024 * 1024)
+
+/** a slab always has room for at least this many objects */
+#define FLOW_POOL_MIN_OBJECTS 8
+
+/** objects are aligned on (and their size rounded up to) this boundary */
+#define FLOW_POOL_ALIGN 16
+
+/** a slab of objects; the header sits at the start of the slab memory */
+typedef struct flow_pool_slab_ {
+    struct flow_pool_slab_ *next;          /*!< next slab of the pool               */
+    size_t bytes;                          /*!< size of the slab memory             */
+    unsigned int mapped;                   /*!< slab came from mmap(), not malloc() */
+} flow_pool_slab_t;
+
+typedef struct flow_pool_ {
+    const char *name;                      /*!< name used in the stats output       */
+    size_t obj_size;                       /*!< object size, rounded up             */
+    unsigned int objs_per_slab;            /*!< number of objects carved per slab   */
+    unsigned int use_hugepages;            /*!< back slabs with huge pages          */
+    void *free_list;                       /*!< released objects, linked via first word */
+    flow_pool_slab_t *slabs;               /*!< all slabs of the pool               */
+    unsigned long int num_slabs;           /*!< number of slabs allocated           */
+    unsigned long int num_huge_slabs;      /*!< slabs that are on huge pages        */
+    unsigned long int in_use;              /*!< objects currently handed out        */
+    unsigned long int high_water;          /*!< largest value in_use has reached    */
+    unsigned long int alloc_fails;         /*!< slab allocations that failed        */
+} flow_pool_t;
+
+/** smallest object size class of a pool set */
+#define FLOW_POOL_SET_MIN_SIZE 32
+
+/** number of size classes in a pool set (32 bytes up to 4 KB) */
+#define FLOW_POOL_SET_CLASSES 8
+
+/** largest object size class of a pool set */
+#define FLOW_POOL_SET_MAX_SIZE (FLOW_POOL_SET_MIN_SIZE << (FLOW_POOL_SET_CLASSES - 1))
+
+/**
+ * a pool per power of two size class, for variable sized objects (such
+ * as arrays that grow with a flow); larger objects come from the heap
+ */
+typedef struct flow_pool_set_ {
+    flow_pool_t pools[FLOW_POOL_SET_CLASSES];
+} flow_pool_set_t;
+
+/** set up a pool of objects of obj_size bytes; an existing pool of that size keeps its slabs */
+void flow_pool_init(flow_pool_t *p, const char *name, size_t obj_size, unsigned int use_hugepages);
+
+/** release all of the slabs of a pool; every object must already be freed */
+void flow_pool_destroy(flow_pool_t *p);
+
+/** get an uninitialized object of size bytes; a NULL pool falls back to malloc() */
+void *flow_pool_alloc(flow_pool_t *p, size_t size);
+
+/** get a zeroed object of size bytes; a NULL pool falls back to calloc() */
+void *flow_pool_calloc(flow_pool_t *p, size_t size);
+
+/** return an object to the pool it came from (NULL pool: free()) */
+void flow_pool_free(flow_pool_t *p, void *obj);
+
+/** bytes of slab memory held by a pool */
+size_t flow_pool_bytes(const flow_pool_t *p);
+
+/** print a one line occupancy summary of a pool */
+void flow_pool_print_stats(const flow_pool_t *p, const char *prefix, FILE *f);
+
+/** set up the pools of a pool set */
+void flow_pool_set_init(flow_pool_set_t *s, unsigned int use_hugepages);
+
+/** release all of the slabs of a pool set */
+void flow_pool_set_destroy(flow_pool_set_t *s);
+
+/** number of bytes actually reserved for an object of size bytes */
+size_t flow_pool_set_class_size(size_t size);
+
+/** get an uninitialized object of size bytes; a NULL set falls back to malloc() */
+void *flow_pool_set_alloc(flow_pool_set_t *s, size_t size);
+
+/** get a zeroed object of size bytes; a NULL set falls back to calloc() */
+void *flow_pool_set_calloc(flow_pool_set_t *s, size_t size);
+
+/** return an object of size bytes to the pool set it came from */
+void flow_pool_set_free(flow_pool_set_t *s, void *obj, size_t size);
+
+/** print the occupancy of the size classes of a pool set that are in use */
+void flow_pool_set_print_stats(const flow_pool_set_t *s, const char *prefix, FILE *f);
+
+/** unit test for the pools */
+int flow_pool_unit_test(void);
+
+#endif /* FLOW_POOL_H */
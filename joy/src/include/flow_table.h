@@ -0,0 +1,144 @@
+/*
+ *
+ * Copyright (c) 2018 Cisco Systems, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials provided
+ *   with the distribution.
+ *
+ *   Neither the name of the Cisco Systems, Inc. nor the names of its
+ *   contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/**
+ * \file flow_table.h
+ *
+ * \brief open addressing hash table that maps flow keys to flow records
+ *
+ ** The table keeps a compact slot (key, hash and record pointer) for each
+ *  flow, so that a lookup can be resolved without touching the flow
+ *  record itself.  Each slot also has a one byte control tag holding
+ *  seven bits of the hash; a probe compares a whole group of tags at
+ *  once (with SSE2 where available) and only looks at the slots whose
+ *  tag matches.
+ *
+ ** The table grows and shrinks with the number of flows.  A resize
+ *  allocates new slot arrays and moves the records over a few at a time
+ *  on later insertions, so that no single packet pays for moving all of
+ *  them; until it is done, lookups look in both sets of arrays.
+ *
+ */
+
+#ifndef FLOW_TABLE_H
+#define FLOW_TABLE_H
+
+#include <stdint.h>
+#include "err.h"
+#include "p2f.h"
+
+/** number of control tags examined at a time */
+#define FLOW_TABLE_GROUP_WIDTH 16
+
+/** capacity allocated when the first record is inserted, by default */
+#define FLOW_TABLE_DEFAULT_CAPACITY 4096
+
+/** largest capacity the table grows to */
+#define FLOW_TABLE_MAX_CAPACITY 0x40000000
+
+/** number of old slots moved by each insertion while the table is being resized */
+#define FLOW_TABLE_MIGRATE_STEP 64
+
+/**
+ * A slot holds a copy of the flow key and its hash next to the record
+ * pointer; it is 56 bytes on LP64 platforms, most of them taken by the
+ * room for IPv6 addresses in the key.
+ */
+typedef struct flow_table_slot_ {
+    flow_key_t key;                        /*!< key of the flow record              */
+    uint32_t hash;                         /*!< full hash of the key                */
+    flow_record_t *record;                 /*!< the flow record                     */
+} flow_table_slot_t;
+
+/** a set of slot arrays; a table has two of them while it is being resized */
+typedef struct flow_table_array_ {
+    uint8_t *ctrl;                         /*!< control tags, plus cloned first group */
+    flow_table_slot_t *slots;              /*!< slots, indexed like ctrl            */
+    uint32_t capacity;                     /*!< number of slots (power of two)      */
+    uint32_t size;                         /*!< number of records in the arrays     */
+    uint32_t growth_left;                  /*!< inserts left before a resize        */
+} flow_table_array_t;
+
+typedef struct flow_table_ {
+    flow_table_array_t cur;                /*!< arrays that records are inserted into */
+    flow_table_array_t old;                /*!< arrays being emptied by a resize    */
+    uint32_t migrate_pos;                  /*!< next slot of old to move            */
+    uint32_t min_capacity;                 /*!< initial capacity, and the smallest one */
+    unsigned long int num_grows;           /*!< number of times the table grew      */
+    unsigned long int num_shrinks;         /*!< number of times the table shrank    */
+} flow_table_t;
+
+/** hash a flow key (CRC32C over the 5-tuple) */
+uint32_t flow_table_hash(const flow_key_t *key);
+
+/** reset a table so that it holds no records, setting its initial capacity (0 for the default) */
+void flow_table_init(flow_table_t *t, uint32_t capacity);
+
+/** release the memory of a table; the records themselves are not freed */
+void flow_table_free(flow_table_t *t);
+
+/** find the record whose key is equal to \p key */
+flow_record_t *flow_table_find(const flow_table_t *t, const flow_key_t *key, uint32_t hash);
+
+/** start loading the part of the table that a lookup of \p hash looks at first */
+void flow_table_prefetch(const flow_table_t *t, uint32_t hash);
+
+/** find the most recently created record with hash \p hash for which match(key, record key) is 0 */
+flow_record_t *flow_table_find_match(const flow_table_t *t, const flow_key_t *key, uint32_t hash,
+                                     int (*match)(const flow_key_t *a, const flow_key_t *b));
+
+/** insert a record that is not already in the table */
+joy_status_e flow_table_insert(flow_table_t *t, flow_record_t *record, uint32_t hash);
+
+/** remove a record from the table */
+joy_status_e flow_table_remove(flow_table_t *t, const flow_record_t *record, uint32_t hash);
+
+/** number of records in the table */
+uint32_t flow_table_size(const flow_table_t *t);
+
+/** fraction of the allocated slots that hold a record */
+double flow_table_load(const flow_table_t *t);
+
+/** number of slot positions, for walking over the table with flow_table_record_at() */
+uint32_t flow_table_num_slots(const flow_table_t *t);
+
+/** return the record held in slot position \p i, or NULL if the slot is not in use */
+flow_record_t *flow_table_record_at(const flow_table_t *t, uint32_t i);
+
+/** unit test for the flow table */
+int flow_table_unit_test(void);
+
+#endif /* FLOW_TABLE_H */
@@ -0,0 +1,105 @@
+/*
+ *
+ * Copyright (c) 2018 Cisco Systems, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials provided
+ *   with the distribution.
+ *
+ *   Neither the name of the Cisco Systems, Inc. nor the names of its
+ *   contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/**
+ * \file flow_timer.h
+ *
+ * \brief hierarchical timer wheel used to schedule flow record expiry
+ *
+ ** Each flow record that is on the chronological list is also kept in
+ *  a timer wheel slot, keyed on the earliest time (in milliseconds) at
+ *  which it could possibly expire.  An expiry sweep then only needs to
+ *  look at the records whose slot is due, rather than walking every
+ *  record in the flow cache.
+ *
+ ** The wheel is lazy: a scheduled time only needs to be a lower bound on
+ *  the real deadline of the record.  Records that turn out not to be
+ *  expired when their slot comes due are simply rescheduled.
+ *
+ */
+
+#ifndef FLOW_TIMER_H
+#define FLOW_TIMER_H
+
+#include <stdint.h>
+#include <sys/time.h>
+#include "p2f.h"
+
+/** number of levels in the timer wheel hierarchy */
+#define FLOW_TIMER_LEVELS 4
+
+/** each level of the wheel has 2^FLOW_TIMER_SLOT_BITS slots */
+#define FLOW_TIMER_SLOT_BITS 8
+#define FLOW_TIMER_SLOTS (1 << FLOW_TIMER_SLOT_BITS)
+#define FLOW_TIMER_SLOT_MASK (FLOW_TIMER_SLOTS - 1)
+
+/** largest distance (in ticks) into the future that can be scheduled */
+#define FLOW_TIMER_MAX_DELTA ((1ULL << (FLOW_TIMER_LEVELS * FLOW_TIMER_SLOT_BITS)) - 1)
+
+typedef struct flow_timer_wheel_ {
+    uint64_t clk;                          /*!< current tick (milliseconds)          */
+    uint8_t cascaded;                      /*!< upper levels cascaded for clk        */
+    uint32_t level_count[FLOW_TIMER_LEVELS]; /*!< records held on each level         */
+    flow_record_t *slot[FLOW_TIMER_LEVELS][FLOW_TIMER_SLOTS];
+    flow_record_t **batch;                 /*!< scratch array for expired records    */
+    unsigned int batch_size;               /*!< allocated entries in batch           */
+} flow_timer_wheel_t;
+
+/** convert a timeval into a timer wheel tick */
+uint64_t flow_timer_tick(const struct timeval *tv);
+
+/** reset the wheel so that it holds no records */
+void flow_timer_init(flow_timer_wheel_t *w);
+
+/** release memory owned by the wheel and reset it */
+void flow_timer_free(flow_timer_wheel_t *w);
+
+/** schedule a record (which must not already be scheduled) at tick expires */
+void flow_timer_add(flow_timer_wheel_t *w, flow_record_t *r, uint64_t expires);
+
+/** remove a record from the wheel, if it is scheduled */
+void flow_timer_del(flow_timer_wheel_t *w, flow_record_t *r);
+
+/** move a record to a new tick, whether or not it is already scheduled */
+void flow_timer_mod(flow_timer_wheel_t *w, flow_record_t *r, uint64_t expires);
+
+/** unlink and return (via wheel_next) all records due at or before tick now */
+flow_record_t *flow_timer_expire(flow_timer_wheel_t *w, uint64_t now);
+
+/** unit test for the timer wheel */
+int flow_timer_unit_test(void);
+
+#endif /* FLOW_TIMER_H */
@@ -58,6 +58,9 @@
 /** fpx filter key */
 #define fpx_filter(record) 1
 
+/** fpx done: true once both fingerprints have been extracted */
+#define fpx_done(fpx) ((fpx)->tcp_fp_len && (fpx)->fp_len)
+
 /** fpx structure */
 typedef struct fpx {
     unsigned int tcp_fp_len;
@@ -69,7 +72,7 @@ typedef struct fpx {
 declare_feature(fpx);
 
 /** initialization function */
-void fpx_init(struct fpx **fpx_handle);
+void fpx_init(struct fpx **fpx_handle, flow_pool_t *pool);
 
 /** update fpx */
 void fpx_update(struct fpx *fpx, 
@@ -84,7 +87,7 @@ void fpx_print_json(const struct fpx *w1,
 		    zfile f);
 
 /** delete fpx */
-void fpx_delete(struct fpx **fpx_handle);
+void fpx_delete(struct fpx **fpx_handle, flow_pool_t *pool);
 
 /** fpx unit test entry point */
 void fpx_unit_test(void);
@@ -49,6 +49,9 @@
 /** Header description length */
 #define HDR_DSC_LEN 32
 
+/** maximum number of description headers */
+#define MAX_NUM_HDRS 10
+
 /** header description structure */
 typedef struct {
   unsigned char initial[HDR_DSC_LEN];
@@ -58,6 +61,9 @@ typedef struct {
   unsigned int num_headers_seen;
 } header_description_t;
 
+/** header description has seen all of the headers it looks at */
+#define header_description_done(hd) ((hd)->num_headers_seen >= MAX_NUM_HDRS)
+
 /** initialize header description */
 void header_description_init(header_description_t *hd);
 
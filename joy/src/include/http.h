@@ -46,6 +46,7 @@
 #include <stdint.h>
 #include <pcap.h>
 #include "output.h"
+#include "flow_pool.h"
 
 #define http_usage "  http=1                     report http information\n"
 
@@ -54,6 +55,9 @@
      (record->app == 80 || (record->key.sp == 80 || record->key.dp == 80)) \
     )
 
+/** http done: true once the message array is full */
+#define http_done(http) ((http)->num_messages >= HTTP_MAX_MESSAGES - 1)
+
 enum http_line_type {
     HTTP_LINE_INVALID  = 0,
     HTTP_LINE_REQUEST   = 1,
@@ -104,7 +108,7 @@ typedef struct http {
 } http_t;
 
 /** initialize http data structure */
-void http_init(http_t **http_handle);
+void http_init(http_t **http_handle, flow_pool_t *pool);
 
 /** update http data structure */
 void http_update(http_t *http,
@@ -120,7 +124,7 @@ void  http_print_json(const http_t *h1,
 
 
 /** remove an http data structure */
-void http_delete(http_t **http_handle);
+void http_delete(http_t **http_handle, flow_pool_t *pool);
 
 void http_unit_test(void);
 
@@ -59,6 +59,9 @@
      ) \
     )
 
+/** ike done: true once the message array is full */
+#define ike_done(ike) ((ike)->num_messages >= IKE_MAX_MESSAGES)
+
 #define IKE_MAX_MESSAGE_LEN 35000 /* must be at least 1200, should be at least 3000 according to RFC 5996 */
 
 /* these should all be reasonably conservative limits */
@@ -208,7 +211,7 @@ typedef struct ike_ {
 
 declare_feature(ike);
 
-void ike_init(ike_t **ike_handle);
+void ike_init(ike_t **ike_handle, flow_pool_t *pool);
 
 void ike_update(ike_t *ike,
                 const struct pcap_pkthdr *header,
@@ -220,7 +223,7 @@ void ike_print_json(const ike_t *w1,
 		    const ike_t *w2,
 		    zfile f);
 
-void ike_delete(ike_t **ike_handle);
+void ike_delete(ike_t **ike_handle, flow_pool_t *pool);
 
 void ike_unit_test(void);
 
@@ -126,6 +126,8 @@ typedef enum {
 #define JOY_IPFIX_EXPORT_ON        (1 << 17)
 #define JOY_PPI_ON                 (1 << 18)
 #define JOY_SALT_ON                (1 << 19)
+#define JOY_HUGEPAGES_ON           (1 << 20)
+#define JOY_ADMISSION_ON           (1 << 21)
 
 
 /* structure to hold feature ready counts for reporting */
@@ -149,6 +151,14 @@ typedef struct joy_init {
     const char *ipfix_host;      /* ip string of the host to send IPFix data to */
     uint16_t ipfix_port;         /* port to send IPFix to remote on */
     uint32_t bitmask;            /* bitmask representing which features are on */
+    uint32_t flow_table_size;    /* initial flow table capacity per context - if 0, then default used */
+    uint32_t max_flows;          /* flow records per context before the least recently active are evicted - 0 for no limit */
+    uint32_t dedup;              /* microseconds within which copies of a packet are dropped - 0 for off */
+    uint32_t writer_queue;       /* records queued for the output writer thread of a context - 0 for no writer */
+    uint8_t backpressure;        /* when that queue is full: 0 block, 1 drop, 2 spill the record */
+    uint8_t compress_threads;    /* threads that compress the output in blocks - 0 for one gzip stream */
+    uint8_t compress_level;      /* zlib compression level of the output, 1-9 - 0 for the default */
+    uint8_t output_format;       /* format of the flow records: 0 JSON, 1 binary, 2 Arrow */
 } joy_init_t;
 
 /* structure definition for the library context data */
@@ -323,6 +333,60 @@ extern int joy_label_subnets (const char *label, uint8_t type, const char* subne
 extern void joy_update_ctx_global_time (uint8_t ctx_index,
                                         struct timeval *new_time);
 
+/*
+ * Storage for a packet decoded by joy_decode_packet().  What it holds
+ * is private to the library; applications only allocate it, on the
+ * stack or next to the packet, and hand it back to the library.
+ */
+#define JOY_PACKET_DESC_SIZE 64
+typedef struct joy_packet_desc {
+    uint64_t opaque[JOY_PACKET_DESC_SIZE / sizeof(uint64_t)];
+} joy_packet_desc_t;
+
+/*
+ * Function: joy_decode_packet
+ *
+ * Description: This function decodes the headers of a packet once,
+ *      so that the result can be handed to both
+ *      joy_packet_desc_to_context() and joy_process_decoded_packet().
+ *      Ethernet with any number of VLAN tags and MPLS labels, and
+ *      IPv4 and IPv6 are understood.
+ *
+ * Parameters:
+ *      header - libpcap header of the packet, or NULL if the captured
+ *               length is not known
+ *      packet - pointer to the packet data
+ *      desc - filled in with the decoded packet
+ *
+ * Returns:
+ *      1 - success
+ *      0 - the packet is not part of any flow; desc still has to be
+ *          handed to joy_process_decoded_packet(), to count the packet
+ *
+ */
+extern int joy_decode_packet (const struct pcap_pkthdr *header,
+                              const unsigned char *packet,
+                              joy_packet_desc_t *desc);
+
+/*
+ * Function: joy_packet_desc_to_context
+ *
+ * Description: This function uses the 5-tuple of a packet decoded by
+ *      joy_decode_packet() to determine which context it should be
+ *      sent to for data feature processing.
+ *
+ * Parameters:
+ *      desc - the packet, as decoded by joy_decode_packet()
+ *      num_contexts - number of contexts to use for distribution
+ *
+ * Returns:
+ *      context - the context number the packet belongs to for JOY processing.
+ *          Bidirectional flows stay in the same context; packets that
+ *          are not part of any flow go to context 0.
+ *
+ */
+extern uint8_t joy_packet_desc_to_context (const joy_packet_desc_t *desc, uint8_t num_contexts);
+
 /*
  * Function: joy_packet_to_context
  *
@@ -332,6 +396,9 @@ extern void joy_update_ctx_global_time (uint8_t ctx_index,
  *      that use the JOY library and want to use the libraries default
  *      scheme for dividing up traffic among various worker contexts.
  *
+ *      The packet is decoded here and again when it is processed;
+ *      joy_decode_packet() and joy_packet_desc_to_context() avoid that.
+ *
  * Parameters:
  *      packet - pointer to the IP packet data
  *      num_contexts - number of contexts to use for distribution
@@ -376,6 +443,33 @@ extern void* joy_process_packet (unsigned char *ctx_index,
                                  unsigned int app_data_len,
                                  const unsigned char *app_data);
 
+/*
+ * Function: joy_process_decoded_packet
+ *
+ * Description: This function is joy_process_packet() for a packet
+ *      that joy_decode_packet() has decoded already, so that its
+ *      headers are not looked at again.
+ *
+ * Parameters:
+ *      ctx_index - index of the thread context to use
+ *      header - libpcap header which contains timestamp, cap length
+ *               and length
+ *      packet - the actual data packet
+ *      desc - the packet, as decoded by joy_decode_packet()
+ *      app_data_len - length of the application specific data
+ *      app_data - pointer to the application data
+ *
+ * Returns:
+ *      Pointer to the flow record
+ *
+ */
+extern void* joy_process_decoded_packet (unsigned char *ctx_index,
+                                         const struct pcap_pkthdr *header,
+                                         const unsigned char *packet,
+                                         const joy_packet_desc_t *desc,
+                                         unsigned int app_data_len,
+                                         const unsigned char *app_data);
+
 /*
  * Function: joy_libpcap_process_packet
  *
@@ -397,6 +491,33 @@ extern void joy_libpcap_process_packet (unsigned char *ctx_index,
                                         const struct pcap_pkthdr *header,
                                         const unsigned char *packet);
 
+/*
+ * Function: joy_process_packet_batch
+ *
+ * Description: This function processes a vector of packets, such
+ *      as a poller hands over, in the order given.  The packets are
+ *      parsed and hashed first, and their flow table slots and flow
+ *      records are prefetched, before any of them is processed, so
+ *      that the cache misses of the flow lookups overlap.  The result
+ *      is the same as calling joy_libpcap_process_packet() for each
+ *      of the packets.
+ *
+ * Parameters:
+ *      ctx_index - index of the thread context to use
+ *      num_packets - number of packets in the vector
+ *      headers - array of num_packets libpcap headers, which contain
+ *               timestamp, cap length and length
+ *      packets - array of num_packets pointers to the packets
+ *
+ * Returns:
+ *      none
+ *
+ */
+extern void joy_process_packet_batch (unsigned char *ctx_index,
+                                      unsigned int num_packets,
+                                      const struct pcap_pkthdr *headers,
+                                      const unsigned char *const *packets);
+
 /*
  * Function: joy_print_flow_data
  *
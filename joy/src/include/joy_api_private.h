@@ -44,8 +44,15 @@
 #ifndef JOY_API_PRV_H
 #define JOY_API_PRV_H
 
+#include <pthread.h>
 #include "output.h"
 #include "ipfix.h"
+#include "flow_timer.h"
+#include "flow_table.h"
+#include "pkt_dedup.h"
+#include "json_buf.h"
+#include "joyarrow.h"
+#include "output_writer.h"
 
 #ifdef JOY_USE_VPP_OPT
 #include "vppinfra/vec.h"
@@ -83,6 +90,11 @@
 
 #endif
 
+/* pools that the feature structures of a context are allocated from */
+typedef struct joy_feature_pools_ {
+    define_all_feature_pools(feature_list)
+} joy_feature_pools_t;
+
 /* per instance context data */
 struct joy_ctx_data  {
     unsigned int ctx_id;
@@ -92,6 +104,11 @@ struct joy_ctx_data  {
     uint32_t salt_recs_ready;
     uint32_t bd_recs_ready;
     zfile output;
+    pthread_mutex_t *output_lock;   /* held while writing, if output is shared */
+    json_buf_t json;                /* flow record being put together for output */
+    joyarrow_batch_t *columns;      /* flow records put together into a chunk, with format=arrow */
+    output_writer_t writer;         /* thread that writes the records, if writer_queue is set */
+    unsigned long int records_held; /* records handed to the writer and not yet freed */
     char *output_file_basename;
     unsigned int records_in_file;
     struct timeval global_time;
@@ -101,7 +118,15 @@ struct joy_ctx_data  {
     ipfix_message_t *export_message;
     flow_record_t *flow_record_chrono_first;
     flow_record_t *flow_record_chrono_last;
-    flow_record_list flow_record_list_array[FLOW_RECORD_LIST_LEN];
+    uint64_t flow_record_seq;
+    flow_timer_wheel_t expiry_wheel;
+    flow_table_t flow_table;
+    flow_table_t nat_index;         /* records waiting for a NAT'ed twin */
+    uint32_t *admission_filter;     /* flows seen once, when admission is on */
+    pkt_dedup_t dedup;              /* packets seen just before, when dedup is on */
+    flow_pool_t record_pool;
+    flow_pool_set_t cold_pools;
+    joy_feature_pools_t feature_pools;
     unsigned long int reserved_info;
     unsigned long int reserved_ctx;
 #ifdef JOY_USE_VPP_OPT
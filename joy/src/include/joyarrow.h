@@ -0,0 +1,194 @@
+/*
+ *
+ * Copyright (c) 2018 Cisco Systems, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials provided
+ *   with the distribution.
+ *
+ *   Neither the name of the Cisco Systems, Inc. nor the names of its
+ *   contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+/**
+ * \file joyarrow.h
+ *
+ * \brief flow records in column chunks, written as an Apache Arrow IPC stream
+ *
+ ** With format=arrow, joy puts the flow records together into column
+ *  chunks, and writes each chunk as an Arrow record batch once it has
+ *  JOYARROW_BATCH_ROWS rows or JOYARROW_BATCH_BYTES bytes, and when
+ *  all the flows are printed.  A file is an Arrow IPC stream, so that
+ *  it can be loaded into a data frame without parsing anything:
+ *
+ *      import pyarrow as pa
+ *      df = pa.ipc.open_stream(pa.input_stream("flows.gz", compression="gzip")).read_pandas()
+ *
+ ** The stream starts with the schema, whose metadata holds the
+ *  configuration line that a JSON file starts with under "config",
+ *  and the features that JSON output has but the columns leave out
+ *  under "omitted", separated by commas.  Each chunk is then the
+ *  dictionaries of sa and da, which replace those of the chunk
+ *  before, followed by the record batch.  There is no end of stream
+ *  marker; readers stop at the end of the file.
+ *
+ ** The columns carry what binary records do (see joybin.h), so joy
+ *  does not take format=arrow together with any of the feature modules
+ *  either.  They go under the names of JSON output where there is one:
+ *
+ *      sa, da              dictionary of strings, as in JSON
+ *      pr                  uint8
+ *      sp, dp              uint16, null for protocols without ports
+ *      bytes_out, num_pkts_out, bytes_in, num_pkts_in
+ *                          uint32, the last two null for one-way flows
+ *      time_start, time_end
+ *                          timestamp in microseconds
+ *      pkt_len             list of int16; -n for {"rep":n}
+ *      pkt_out             list of bool; true for "dir":">"
+ *      pkt_ipt             list of uint32, in milliseconds
+ *      byte_dist           fixed size list of 256 uint8, with dist
+ *      byte_dist_mean, byte_dist_std
+ *                          double, with dist; null without payload
+ *      compact_byte_dist   fixed size list of 16 uint8, with cdist
+ *      entropy, total_entropy
+ *                          double, with entropy; null without payload
+ *      p_malware           double, with classify
+ *      ttl_out, ttl_in     uint8
+ *      ip_id_out, ip_id_in list of uint16
+ *      first_seq           uint32, null for other protocols than TCP
+ *      tcp_flags_out, tcp_flags_in
+ *                          uint8, bits in the order of "FSRPAUEC"
+ *      window_out, window_in
+ *                          uint16, the first window sizes
+ *      idp_out, idp_in     binary, with idp
+ *      tcp_retrans, invalid
+ *                          uint32
+ *      expire_type         string, null if there is none
+ *
+ *  The columns of the other direction are null for one-way flows, and
+ *  those of TCP for other protocols.
+ *
+ ** joyarrow.c has no dependencies beyond libc and joybin.c.
+ *
+ */
+
+#ifndef JOYARROW_H
+#define JOYARROW_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "joybin.h"
+
+/** rows of a chunk */
+#define JOYARROW_BATCH_ROWS 16384
+
+/** bytes of the columns of a chunk, beyond which it is written out early */
+#define JOYARROW_BATCH_BYTES (16 * 1024 * 1024)
+
+/** most bytes of the metadata of a message */
+#define JOYARROW_META_MAX (64 * 1024)
+
+/** most bytes of the configuration line in the schema */
+#define JOYARROW_CONFIG_MAX (32 * 1024)
+
+typedef enum joyarrow_type_ {
+    JOYARROW_INT = 0,                      /*!< integer, of width bytes           */
+    JOYARROW_DOUBLE = 1,
+    JOYARROW_TIMESTAMP = 2,                /*!< int64 microseconds                */
+    JOYARROW_UTF8 = 3,
+    JOYARROW_BINARY = 4,
+    JOYARROW_LIST = 5,                     /*!< of integers, or of bools if width is 0 */
+    JOYARROW_FIXED_LIST = 6,               /*!< list_size integers a row          */
+    JOYARROW_DICT = 7                      /*!< addresses, as int32 indices into a dictionary of strings */
+} joyarrow_type_e;
+
+typedef struct joyarrow_buf_ {
+    uint8_t *data;
+    size_t len;
+    size_t size;
+} joyarrow_buf_t;
+
+/** bytes of the key of an address in a dictionary: its kind, then 16 bytes */
+#define JOYARROW_KEY_LEN 17
+
+/** slots of the hash table of a dictionary, twice its most entries */
+#define JOYARROW_DICT_SLOTS (2 * JOYARROW_BATCH_ROWS)
+
+/* the distinct addresses of a chunk */
+typedef struct joyarrow_dict_ {
+    uint32_t *slots;                       /*!< 1 + index of an entry, or 0; a hash table */
+    uint8_t *keys;                         /*!< JOYARROW_KEY_LEN bytes an entry    */
+    unsigned int num_entries;
+    joyarrow_buf_t offsets;                /*!< int32 offsets of the strings       */
+    joyarrow_buf_t data;                   /*!< the strings                        */
+} joyarrow_dict_t;
+
+typedef struct joyarrow_column_ {
+    unsigned int active;                   /*!< the schema has this column         */
+    unsigned int null_count;
+    size_t num_items;                      /*!< items of a list, over all its rows */
+    joyarrow_buf_t validity;               /*!< a bit a row, set unless it is null */
+    joyarrow_buf_t offsets;                /*!< int32 offsets of the rows of a list or string */
+    joyarrow_buf_t values;                 /*!< values, items, bytes or indices    */
+    joyarrow_dict_t dict;                  /*!< for JOYARROW_DICT                  */
+} joyarrow_column_t;
+
+/** number of columns that a chunk may have */
+#define JOYARROW_MAX_COLUMNS 35
+
+typedef struct joyarrow_batch_ {
+    unsigned int fields;                   /*!< joybin_field_e bits of the schema  */
+    unsigned int num_rows;
+    joyarrow_column_t columns[JOYARROW_MAX_COLUMNS];
+} joyarrow_batch_t;
+
+/** encode the schema message of a stream into buf; returns its length, or 0 if size is too small */
+size_t joyarrow_schema_encode(uint8_t *buf, size_t size, const joybin_schema_t *schema,
+                              const char *config, size_t config_len);
+
+/** allocate a chunk for the columns of a schema; returns NULL if there is no memory */
+joyarrow_batch_t *joyarrow_batch_new(const joybin_schema_t *schema);
+
+/** add a record to a chunk as a row; returns 0, or -1 if there is no memory for it */
+int joyarrow_batch_append(joyarrow_batch_t *b, const joybin_record_t *rec);
+
+/** returns 1 if a chunk is to be written out before more rows are added */
+int joyarrow_batch_full(const joyarrow_batch_t *b);
+
+/** most bytes that joyarrow_batch_encode() takes for a chunk */
+size_t joyarrow_batch_encoded_size(const joyarrow_batch_t *b);
+
+/** encode the messages of a chunk into buf, and empty it; returns their length, or 0 if size is too small */
+size_t joyarrow_batch_encode(uint8_t *buf, size_t size, joyarrow_batch_t *b);
+
+/** free a chunk */
+void joyarrow_batch_free(joyarrow_batch_t *b);
+
+int joyarrow_unit_test(void);
+
+#endif /* JOYARROW_H */
@@ -0,0 +1,238 @@
+/*
+ *
+ * Copyright (c) 2018 Cisco Systems, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials provided
+ *   with the distribution.
+ *
+ *   Neither the name of the Cisco Systems, Inc. nor the names of its
+ *   contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/**
+ * \file joybin.h
+ *
+ * \brief compact binary flow records, and a streaming reader for them
+ *
+ ** With format=binary, joy writes each flow record as a binary record
+ *  instead of a line of JSON.  A binary output file starts with a
+ *  header:
+ *
+ *      "JOYB"  magic
+ *      u16     format version (JOYBIN_VERSION)
+ *      u16     length of the schema that follows
+ *      schema  u16 num_pkts, then the optional fields that the records
+ *              carry, then the features that were reported in JSON
+ *              but are not carried, each as a count and a list of
+ *              names (u8 length, then the name)
+ *      config  the configuration line that a JSON file starts with,
+ *              up to and including its newline
+ *
+ ** Then come the records, each as a u32 length and that many bytes.
+ *  Integers are little endian.  Counters and addresses are fixed
+ *  width; the lengths, directions and inter-packet times of the
+ *  packets are varints, as are the differences between IP ids and
+ *  the other values that are usually small.  Doubles are IEEE 754, as they are held in memory.
+ *
+ ** The core of a record (addresses, ports, counters, times, packets,
+ *  ip, tcp flags and window sizes, debug counters and expire type)
+ *  is always there; the optional fields follow in the order of
+ *  joybin_field_e.  Subnet labels, TCP options, exe, hd and os are
+ *  only in JSON output, and joy does not take format=binary together
+ *  with any of the feature modules, whose data records do not carry.
+ *
+ ** joybin.c has no dependencies beyond libc (and zlib with USE_GZIP,
+ *  so that gzip compressed files are read too), so that readers can
+ *  link it on its own.  joybin2json converts a file back to the JSON
+ *  that joy would have written, minus what is not carried.
+ *
+ */
+
+#ifndef JOYBIN_H
+#define JOYBIN_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef USE_GZIP
+#include <zlib.h>
+#endif
+
+#define JOYBIN_MAGIC "JOYB"
+#define JOYBIN_VERSION 1
+
+/** most packets in a record; a bidirectional flow has num_pkts each way */
+#define JOYBIN_MAX_PKTS 400
+
+/** most IP ids in each direction */
+#define JOYBIN_MAX_IP_ID 50
+
+/** most bytes of an initial data packet */
+#define JOYBIN_MAX_IDP 1500
+
+/** most feature names in the schema, and their longest name */
+#define JOYBIN_MAX_OMITTED 64
+#define JOYBIN_MAX_NAME 32
+
+/** most bytes that a record takes, its length included */
+#define JOYBIN_RECORD_MAX (4 + 1 + 32 + 5 + 16 + 8 + 10 + 3 + JOYBIN_MAX_PKTS * 8 + \
+                           256 + 16 + 16 + 16 + 8 + 2 * (2 + 3 * JOYBIN_MAX_IP_ID) + \
+                           10 + 2 * (3 + JOYBIN_MAX_IDP) + 10 + 1)
+
+/** bytes of an address formatted by joybin_addr_string(), its NUL included */
+#define JOYBIN_ADDR_STRLEN 46
+
+/** bytes that a reader reads at a time */
+#define JOYBIN_READ_SIZE (256 * 1024)
+
+/** output format of the flow records */
+typedef enum output_format_ {
+    OUTPUT_FORMAT_JSON = 0,
+    OUTPUT_FORMAT_BINARY = 1,
+    OUTPUT_FORMAT_ARROW = 2                /*!< column chunks, see joyarrow.h      */
+} output_format_e;
+
+/** optional fields of a record, as bits of joybin_schema_t.fields */
+typedef enum joybin_field_ {
+    JOYBIN_BYTE_DIST = 1,                  /*!< byte_dist, with its mean and std   */
+    JOYBIN_COMPACT_BYTE_DIST = 2,          /*!< compact_byte_dist                  */
+    JOYBIN_ENTROPY = 4,                    /*!< entropy and total_entropy          */
+    JOYBIN_P_MALWARE = 8,                  /*!< p_malware                          */
+    JOYBIN_IDP = 16                        /*!< idp_out, idp_in and their lengths  */
+} joybin_field_e;
+
+/** flags of a record */
+#define JOYBIN_IPV6        0x01            /*!< the addresses are IPv6 ones        */
+#define JOYBIN_TWIN        0x02            /*!< the flow is bidirectional          */
+#define JOYBIN_SA_ANON     0x04            /*!< sa is an anonymized IPv4 address   */
+#define JOYBIN_DA_ANON     0x08            /*!< da is an anonymized IPv4 address   */
+#define JOYBIN_BD_STATS    0x10            /*!< byte_dist_mean and byte_dist_std   */
+#define JOYBIN_HAS_ENTROPY 0x20            /*!< entropy and total_entropy          */
+#define JOYBIN_IDP_OUT     0x40            /*!< idp_out                            */
+#define JOYBIN_IDP_IN      0x80            /*!< idp_in                             */
+
+typedef struct joybin_schema_ {
+    unsigned int num_pkts;                 /*!< num_pkts of the capture            */
+    unsigned int fields;                   /*!< joybin_field_e bits                */
+    unsigned int num_omitted;
+    char omitted[JOYBIN_MAX_OMITTED][JOYBIN_MAX_NAME]; /*!< features only in JSON */
+} joybin_schema_t;
+
+typedef struct joybin_pkt_ {
+    uint16_t len;                          /*!< bytes of application data          */
+    uint8_t in;                            /*!< 1 for ">", 0 for "<"               */
+    uint32_t ipt;                          /*!< milliseconds since the last packet */
+} joybin_pkt_t;
+
+typedef struct joybin_record_ {
+    uint8_t flags;                         /*!< JOYBIN_IPV6 etc.                   */
+    uint8_t sa[16];                        /*!< IPv4 in 4 bytes, or IPv6 or anonymized in 16 */
+    uint8_t da[16];
+    uint8_t prot;
+    uint16_t sp;                           /*!< ports, for TCP and UDP only        */
+    uint16_t dp;
+    uint32_t bytes_out;
+    uint32_t num_pkts_out;
+    uint32_t bytes_in;                     /*!< these two with JOYBIN_TWIN only    */
+    uint32_t num_pkts_in;
+    int64_t time_start;                    /*!< microseconds since the epoch       */
+    int64_t time_end;
+    unsigned int num_pkts;
+    joybin_pkt_t pkts[JOYBIN_MAX_PKTS];
+    uint8_t byte_dist[256];
+    double byte_dist_mean;
+    double byte_dist_std;
+    uint8_t compact_byte_dist[16];
+    double entropy;
+    double total_entropy;
+    double p_malware;
+    uint8_t ttl_out;
+    uint8_t ttl_in;
+    unsigned int num_id_out;
+    unsigned int num_id_in;
+    uint16_t id_out[JOYBIN_MAX_IP_ID];
+    uint16_t id_in[JOYBIN_MAX_IP_ID];
+    uint32_t first_seq;                    /*!< this and what follows, for TCP only */
+    uint8_t tcp_flags_out;
+    uint8_t tcp_flags_in;
+    uint16_t window_out;
+    uint16_t window_in;
+    const uint8_t *idp_out;                /*!< points into the encoded record     */
+    const uint8_t *idp_in;
+    unsigned int idp_len_out;
+    unsigned int idp_len_in;
+    uint32_t tcp_retrans;
+    uint32_t invalid;
+    char expire_type;                      /*!< 0 for none                         */
+} joybin_record_t;
+
+typedef struct joybin_reader_ {
+#ifdef USE_GZIP
+    gzFile f;                              /*!< reads plain files too              */
+#else
+    FILE *f;
+#endif
+    joybin_schema_t schema;
+    char *config;                          /*!< the configuration line             */
+    uint8_t *buf;                          /*!< what has been read of the file     */
+    size_t size;
+    size_t len;                            /*!< bytes read into buf                */
+    size_t pos;                            /*!< bytes of those already decoded     */
+} joybin_reader_t;
+
+/** encode a file header into buf; returns its length, or 0 if size is too small */
+size_t joybin_header_encode(uint8_t *buf, size_t size, const joybin_schema_t *schema);
+
+/** encode a record, its length included, into buf; returns its length, or 0 if size is too small */
+size_t joybin_record_encode(uint8_t *buf, size_t size,
+                            const joybin_schema_t *schema, const joybin_record_t *rec);
+
+/** decode the len bytes of a record that follow its length; returns 0, or -1 if they are malformed */
+int joybin_record_decode(joybin_record_t *rec, const joybin_schema_t *schema,
+                         const uint8_t *buf, size_t len);
+
+/** print a record as joy would print it in JSON, newline included */
+void joybin_record_print_json(FILE *f, const joybin_schema_t *schema,
+                              const joybin_record_t *rec);
+
+/** format sa or da of a record as JSON output has it; returns str */
+const char *joybin_addr_string(char *str, const uint8_t *addr, uint8_t flags, uint8_t anon_flag);
+
+/** open a file and read its header; returns 0, or -1 if it is not a binary flow record file */
+int joybin_reader_open(joybin_reader_t *r, const char *fname);
+
+/** read the next record; returns 1, 0 at the end of the file, or -1 on error */
+int joybin_reader_next(joybin_reader_t *r, joybin_record_t *rec);
+
+/** close the file */
+void joybin_reader_close(joybin_reader_t *r);
+
+int joybin_unit_test(void);
+
+#endif /* JOYBIN_H */
@@ -0,0 +1,153 @@
+/*
+ *
+ * Copyright (c) 2018 Cisco Systems, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials provided
+ *   with the distribution.
+ *
+ *   Neither the name of the Cisco Systems, Inc. nor the names of its
+ *   contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+/**
+ * \file json_buf.h
+ *
+ * \brief growable buffer in which a JSON flow record is put together
+ *
+ ** A flow record used to go out through a zprintf() for every field and
+ *  every element of an array, and each of those runs vsnprintf() and,
+ *  with compressed output, a pass through zlib's input buffer.  The
+ *  record is now written into a json_buf_t with formatting of its own
+ *  for integers, times, doubles and hex strings, and handed to the
+ *  output with a single zwrite() by json_buf_commit().
+ *
+ ** The buffer belongs to a context and keeps its memory from one record
+ *  to the next, so once it has grown to the largest record it does not
+ *  allocate again.  Anything that prints through a zfile in the middle
+ *  of a record has to be preceded by json_buf_commit(), so that the
+ *  output keeps its order.
+ *
+ */
+
+#ifndef JSON_BUF_H
+#define JSON_BUF_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "safe_lib.h"
+#include "err.h"
+#include "output.h"
+
+/** bytes that a buffer starts with; it doubles as records need more */
+#define JSON_BUF_INITIAL_SIZE 16384
+
+typedef struct json_buf_ {
+    char *data;                            /*!< bytes of the record so far          */
+    size_t len;                            /*!< number of bytes in data             */
+    size_t size;                           /*!< bytes allocated for data            */
+    unsigned int failed;                   /*!< set when data could not grow        */
+} json_buf_t;
+
+/** allocate the buffer */
+joy_status_e json_buf_init(json_buf_t *b, size_t size);
+
+/** release the buffer */
+void json_buf_free(json_buf_t *b);
+
+/** make room for len more bytes; returns 0 if there is none */
+int json_buf_grow(json_buf_t *b, size_t len);
+
+/** write what is in the buffer to f, and empty it */
+void json_buf_commit(json_buf_t *b, zfile f);
+
+/** append an unsigned integer, as %u or %llu would */
+void json_buf_uint(json_buf_t *b, uint64_t x);
+
+/** append a signed integer, as %d or %lld would */
+void json_buf_int(json_buf_t *b, int64_t x);
+
+/** append a double, as %f would */
+void json_buf_double(json_buf_t *b, double x);
+
+/** append seconds and microseconds, as %zd.%06zd would */
+void json_buf_time(json_buf_t *b, int64_t sec, long usec);
+
+/** append data as a quoted string of lower case hex digits */
+void json_buf_hex(json_buf_t *b, const unsigned char *data, unsigned int len);
+
+/** append formatted text, for what the functions above do not cover */
+#ifdef __GNUC__
+void json_buf_printf(json_buf_t *b, const char *format, ...) __attribute__((format(printf, 2, 3)));
+#else
+void json_buf_printf(json_buf_t *b, const char *format, ...);
+#endif
+
+int json_buf_unit_test(void);
+
+/**
+ * \brief Append len bytes.
+ * \param b Buffer
+ * \param s Bytes to append
+ * \param len Number of bytes
+ * \return none
+ */
+static inline void json_buf_write (json_buf_t *b, const char *s, size_t len) {
+    if (len == 0) {
+        return;
+    }
+    if (b->size - b->len < len && !json_buf_grow(b, len)) {
+        return;
+    }
+    memcpy_s(b->data + b->len, len, s, len);
+    b->len += len;
+}
+
+/**
+ * \brief Append a string.
+ * \param b Buffer
+ * \param s String to append, without its terminating null
+ * \return none
+ */
+static inline void json_buf_puts (json_buf_t *b, const char *s) {
+    json_buf_write(b, s, strlen(s));
+}
+
+/**
+ * \brief Append one character.
+ * \param b Buffer
+ * \param c Character to append
+ * \return none
+ */
+static inline void json_buf_putc (json_buf_t *b, char c) {
+    if (b->len == b->size && !json_buf_grow(b, 1)) {
+        return;
+    }
+    b->data[b->len++] = c;
+}
+
+#endif /* JSON_BUF_H */
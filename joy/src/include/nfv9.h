@@ -418,6 +418,7 @@ void nfv9_flow_key_init(flow_key_t *key,
            const char *flow_data);
 
 /** main function for parsing nfv9 packets */
-void nfv9_process_flow_record(flow_record_t *nf_record,
+void nfv9_process_flow_record(joy_ctx_data *ctx,
+           flow_record_t *nf_record,
            const struct nfv9_template *cur_template,
            const char *flow_data, int record_num);
@@ -73,6 +73,7 @@ typedef FILE *zfile;
 #define zopen(fname, ...)    (fopen(fname, __VA_ARGS__))
 #define zattach(fd, ...)     (fd)
 #define zprintf(output, ...) (fprintf(output, __VA_ARGS__))
+#define zwrite(output, buf, len) (fwrite(buf, 1, len, output))
 #define zflush(FILEp)        (fflush(FILEp))
 #define zclose(output)       (fclose(output))
 #define zsuffix              ""
@@ -94,26 +95,25 @@ typedef FILE *zfile;
         #define zattach(FILEp, ...)  (BZ2_bzdopen(fileno(FILEp), __VA_ARGS__))
     #endif
     #define zprintf              BZ2_bzprintf
+    #define zwrite(output, buf, len) (BZ2_bzwrite(output, (void *)(buf), (int)(len)))
     #define zflush(FILEp)        (BZ2_bzflush(FILEp))
     #define zclose(output)       (BZ2_bzclose(output))
     #define zsuffix              ".bz2"
 
 #else
-    /** gzip compressed output */
-    #include <zlib.h>
-    typedef gzFile zfile;
-
-    #define zopen(fname, ...)    (gzopen(fname, __VA_ARGS__))
-
-    #ifdef WIN32
-        #define zattach(FILEp, ...)  (gzdopen(_fileno(FILEp), __VA_ARGS__))
-    #else
-        #define zattach(FILEp, ...)  (gzdopen(fileno(FILEp), __VA_ARGS__))
-    #endif
-
-    #define zprintf(output, ...) (gzprintf(output, __VA_ARGS__))
-    #define zflush(FILEp)        (gzflush(FILEp))
-    #define zclose(output)       (gzclose(output))
+    /**
+     * gzip compressed output; with compress_threads=N, it is compressed
+     * in blocks on N threads (see zsink.h)
+     */
+    #include "zsink.h"
+    typedef zsink_t *zfile;
+
+    #define zopen(fname, ...)    (zsink_open(fname, __VA_ARGS__))
+    #define zattach(FILEp, ...)  (zsink_attach(FILEp, __VA_ARGS__))
+    #define zprintf(output, ...) (zsink_printf(output, __VA_ARGS__))
+    #define zwrite(output, buf, len) (zsink_write(output, buf, len))
+    #define zflush(FILEp)        (zsink_flush(FILEp))
+    #define zclose(output)       (zsink_close(output))
     #define zsuffix              ".gz"
 #endif
 
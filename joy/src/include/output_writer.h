@@ -0,0 +1,146 @@
+/*
+ *
+ * Copyright (c) 2018 Cisco Systems, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials provided
+ *   with the distribution.
+ *
+ *   Neither the name of the Cisco Systems, Inc. nor the names of its
+ *   contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/**
+ * \file output_writer.h
+ *
+ * \brief thread that writes out the flow records of a context
+ *
+ ** With an output writer, the packet thread does not format, compress
+ *  or write flow records itself.  It hands each finished record to the
+ *  writer thread through a single producer, single consumer ring of
+ *  pointers, and goes back to the packets; the writer calls the write
+ *  function on the record.  Written records stay in the ring until the
+ *  packet thread takes them back, so that the memory is released on
+ *  the thread that owns it.
+ *
+ ** Each slot is passed along by three counters that only ever grow:
+ *  head (records handed over), written (records the writer is done
+ *  with) and tail (records taken back).  The packet thread owns head
+ *  and tail, the writer owns written, and they live on separate cache
+ *  lines; no locks are taken.
+ *
+ ** When the ring is full, the backpressure setting decides what the
+ *  packet thread does: wait for the writer (block), release the record
+ *  without writing it (drop), or keep it in an overflow list that goes
+ *  into the ring ahead of later records (spill).
+ *
+ */
+
+#ifndef OUTPUT_WRITER_H
+#define OUTPUT_WRITER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "err.h"
+
+/** keeps the fields of the two threads on their own cache lines */
+#define OUTPUT_WRITER_CACHE_LINE 64
+
+/** what the packet thread does with a record when the ring is full */
+typedef enum output_backpressure_ {
+    OUTPUT_WRITER_BLOCK = 0,               /*!< wait until the writer makes room   */
+    OUTPUT_WRITER_DROP = 1,                /*!< release the record, unwritten      */
+    OUTPUT_WRITER_SPILL = 2                /*!< hold it in an overflow list        */
+} output_backpressure_e;
+
+/** function called with the arg of the writer and a record */
+typedef void (output_writer_fn)(void *arg, void *record);
+
+typedef struct output_writer_ {
+    void **slots;                          /*!< records, a power of two of them    */
+    size_t size;                           /*!< number of slots                    */
+    output_writer_fn *write;               /*!< writes a record (writer thread)    */
+    output_writer_fn *release;             /*!< releases a record (packet thread)  */
+    void *arg;                             /*!< first argument of both functions   */
+    output_backpressure_e backpressure;    /*!< what to do when the ring is full   */
+    pthread_t thread;                      /*!< the writer                         */
+
+    void **spill;                          /*!< records waiting for room, oldest first */
+    size_t spill_first;                    /*!< index of the oldest spilled record */
+    size_t num_spill;                      /*!< spilled records still waiting      */
+    size_t spill_size;                     /*!< room in the spill list             */
+    uint64_t num_dropped;                  /*!< records released unwritten         */
+    uint64_t num_spilled;                  /*!< records that went to the spill list */
+    uint64_t num_waits;                    /*!< times the packet thread waited     */
+
+    char pad0[OUTPUT_WRITER_CACHE_LINE];
+    size_t head;                           /*!< records handed over (packet thread writes) */
+    size_t tail;                           /*!< records taken back (packet thread writes)  */
+    size_t stop;                           /*!< the writer is to exit once it is idle */
+
+    char pad1[OUTPUT_WRITER_CACHE_LINE];
+    size_t written;                        /*!< records written (writer writes)    */
+
+    char pad2[OUTPUT_WRITER_CACHE_LINE];
+} output_writer_t;
+
+/** default number of slots of the ring */
+#define OUTPUT_WRITER_SIZE 4096
+
+/** true if the writer thread has been started */
+#define output_writer_running(w) ((w)->slots != NULL)
+
+/**
+ * start a writer thread with a ring of size slots (rounded up to a
+ * power of two); write is called on the writer thread for each record,
+ * release on the calling thread once the record is written or dropped
+ */
+joy_status_e output_writer_start(output_writer_t *w, size_t size, output_backpressure_e backpressure,
+                                 output_writer_fn *write, output_writer_fn *release, void *arg);
+
+/**
+ * hand a record to the writer; returns failure if the record was
+ * dropped, in which case it has been released already
+ */
+joy_status_e output_writer_submit(output_writer_t *w, void *record);
+
+/** release the records that the writer is done with */
+void output_writer_reclaim(output_writer_t *w);
+
+/** wait until every record handed over has been written, and release them */
+void output_writer_flush(output_writer_t *w);
+
+/** flush the writer, stop its thread and free the ring */
+void output_writer_stop(output_writer_t *w);
+
+/** name of a backpressure setting, as used in the configuration */
+const char *output_writer_backpressure_name(unsigned int backpressure);
+
+int output_writer_unit_test(void);
+
+#endif /* OUTPUT_WRITER_H */
@@ -56,6 +56,7 @@
 #include <dirent.h>
 #include <time.h>
 
+#include "utils.h"        /* joy_time_delta_t              */
 #include "hdr_dsc.h"      /* header description (proto id) */
 #include "modules.h"      
 #include "feature.h"
@@ -65,10 +66,6 @@
 #define ETTA_MIN_PACKETS 10
 #define ETTA_MIN_OCTETS 4000
 
-/* flow value definitions */
-#define flow_key_hash_mask 0xFFFF
-#define FLOW_RECORD_LIST_LEN (flow_key_hash_mask + 1)
-
 enum twins_match {
     EXACT_MATCH = 0,
     NEAR_MATCH = 1,
@@ -83,7 +80,8 @@ enum twins_match {
 typedef struct ip_info_ {
     unsigned char ttl;              /*!< Smallest IP TTL in flow */
     unsigned char num_id;           /*!< Number of IP ids */
-    uint16_t id[MAX_NUM_IP_ID];     /*!< Array of IP ids in flow */
+    unsigned char id_cap;           /*!< Number of IP ids that id can hold */
+    uint16_t *id;                   /*!< Array of IP ids in flow (cold, grown on demand) */
 } ip_info_t;
 
 typedef struct tcp_info_ {
@@ -97,14 +95,30 @@ typedef struct tcp_info_ {
     unsigned char opts[TCP_OPT_LEN];
 } tcp_info_t;
 
+/**
+ * The addresses of an IPv4 flow are in sa and da; those of an IPv6
+ * flow take all of sa6 and da6, and ipv6 is set.  Code that builds an
+ * IPv4 key needs to clear ipv6, but not the rest of sa6 and da6.
+ */
 typedef struct flow_key_ {
-    struct in_addr sa;
-    struct in_addr da;
+    union {
+        struct in_addr sa;
+        struct in6_addr sa6;
+    };
+    union {
+        struct in_addr da;
+        struct in6_addr da6;
+    };
     uint16_t sp;
     uint16_t dp;
     uint8_t prot;
+    uint8_t ipv6;       /*!< 1 if the addresses are IPv6 ones */
 } flow_key_t;
 
+/** compare the addresses a and b of flow keys, which are IPv6 ones if ipv6 is set */
+#define flow_key_addr_eq(a, b, ipv6) \
+    (memcmp(&(a), &(b), (ipv6) ? sizeof(struct in6_addr) : sizeof(struct in_addr)) == 0)
+
 typedef struct tcp_retrans_ {
     uint32_t seq;
     uint16_t len;
@@ -126,26 +140,35 @@ extern FILE *info;
 #define MAX_IDP 1500
 #define MAX_TCP_RETRANS_BUFFER 10
 
+/*
+ * bytes taken by each packet in the per-packet arrays of a flow
+ * record (arrival time, length and flags)
+ */
+#define FLOW_RECORD_PKT_BYTES (sizeof(joy_time_delta_t) + sizeof(uint16_t) + sizeof(uint8_t))
+
 typedef struct flow_record_ {
     flow_key_t key;                       /*!< identifies flow by 5-tuple          */
-    uint32_t key_hash;                    /*!< hash of the 5-tuple key             */
+    uint32_t key_hash;                    /*!< flow table hash of the 5-tuple key  */
     uint16_t app;                         /*!< application protocol prediction     */
     uint8_t dir;                          /*!< direction of the flow               */
     uint8_t np;                           /*!< number of packets                   */
     uint8_t op;                           /*!< number of packets (w/nonzero data)  */
     uint16_t ob;                          /*!< number of bytes of application data */
+    uint16_t features;                    /*!< feature_bit() of the features that apply */
     struct timeval start;                 /*!< start time                          */ 
     struct timeval end;                   /*!< end time                            */
     uint16_t last_pkt_len;                /*!< last observed appdata length        */
-    uint16_t pkt_len[MAX_NUM_PKT_LEN];    /*!< array of packet appdata lengths */  
-    struct timeval pkt_time[MAX_NUM_PKT_LEN]; /*!< array of arrival times          */
-    uint8_t pkt_flags[MAX_NUM_PKT_LEN];   /*!< array of packet flags           */
-    uint32_t byte_count[256];             /*!< number of occurences of each byte   */
-    uint32_t compact_byte_count[16];      /*!< number of occurences of each byte, mapping to compact form   */
-    uint32_t num_bytes;
-    double bd_mean;
-    double bd_variance;
-    header_description_t hd;              /*!< header description (proto ident)    */
+    uint8_t pkt_cap;                      /*!< number of packets the arrays can hold */
+    joy_time_base_t pkt_time_base;        /*!< base of the pkt_time offsets        */
+    joy_time_delta_t *pkt_time;           /*!< array of arrival times (cold)       */
+    uint16_t *pkt_len;                    /*!< array of packet appdata lengths (cold) */
+    uint8_t *pkt_flags;                   /*!< array of packet flags (cold)        */
+    uint32_t *byte_count;                 /*!< number of occurences of each byte (cold) */
+    uint32_t *compact_byte_count;         /*!< number of occurences of each byte, mapping to compact form (cold) */
+    uint32_t num_bytes;                   /*!< number of bytes in bd_sum and bd_sum_sq */
+    uint64_t bd_sum;                      /*!< sum of the bytes of application data */
+    uint64_t bd_sum_sq;                   /*!< sum of their squares                */
+    header_description_t *hd;             /*!< header description (proto ident, cold) */
     bool idp_packet;                   /*!< determines if packet is used for IDP */
     int32_t idp_seq_num;                  /*!< marks the SYN packet for IDP determination */
     void *idp;
@@ -154,8 +177,10 @@ typedef struct flow_record_ {
     tcp_info_t tcp;
     uint8_t is_tcp_retrans;
     uint8_t tcp_retrans_tail;
-    tcp_retrans_t tcp_retrans[MAX_TCP_RETRANS_BUFFER];
+    tcp_retrans_t *tcp_retrans;           /*!< retransmission buffer (cold)        */
     bool invalid;
+    bool saturated;                       /*!< every feature is done; counters only */
+    bool twin_candidate;                  /*!< in the NAT twin index, waiting for a twin */
     char *exe_name;                       /*!< executable associated with flow    */
     char *full_path;                      /*!< executable path associated with flow    */
     char *file_version;                   /*!< executable version associated with flow    */
@@ -175,19 +200,36 @@ typedef struct flow_record_ {
     define_all_features(feature_list)     /*!< define all features listed in feature.h */
   
     struct flow_record_ *twin;             /*!< other half of bidirectional flow    */
-    struct flow_record_ *next;             /*!< next record in flow_record_list     */
-    struct flow_record_ *prev;             /*!< previous record in flow_record_list */
     struct flow_record_ *time_prev;        /*!< previous record in chronological list */
     struct flow_record_ *time_next;        /*!< next record in chronological list     */
+    struct flow_record_ *wheel_next;       /*!< next record in expiry timer slot      */
+    struct flow_record_ **wheel_pprev;     /*!< link that points at this record       */
+    uint64_t wheel_expires;                /*!< tick at which expiry is next checked  */
+    uint8_t wheel_level;                   /*!< timer wheel level holding the record  */
+    uint64_t seq;                          /*!< order in which records were created   */
 } flow_record_t;
 
 
 /** \remarks \verbatim
+   A flow_record is split into a hot part, which is the structure
+   above, and cold sections that are allocated from the per-context
+   cold_pools only when they are needed: the per-packet arrays
+   (pkt_time, pkt_len and pkt_flags share one block that grows with
+   the flow, up to num_pkts entries), the byte distributions and the
+   header description (only when the corresponding options are on and
+   the flow carries data), the TCP retransmission buffer and the IP
+   ids.  A NULL section reads as all zeroes.  Most flows only see a
+   handful of packets, so this keeps the memory per flow close to the
+   size of the hot part.
+
    flow_records can be accessed in either of two ways: 
   
      - An individual record can be looked up by its flow key, which
-       uses the flow_record_list_array[], which is indexed by the
-       flow_key_hash() function; this is a doubly linked list.
+       uses the per-context flow table (see flow_table.h), an open
+       addressing hash table keyed by the flow_key_hash() function.
+       With NAT twin matching (nat=1), records that are still waiting
+       for a twin are also in a second table, the NAT index, which is
+       keyed by protocol and ports only.
   
      - All records can be listed in chronological order, using the
        time_next pointer's linked list.  (That list will actually be
@@ -196,6 +238,10 @@ typedef struct flow_record_ {
        flows are observed.)  The head and tail of that list are
        flow_record_chrono_first and flow_record_chrono_last,
        respectively.
+
+     - Every record on the chronological list is also scheduled in
+       the per-context expiry timer wheel (see flow_timer.h), which
+       lets expiry sweeps visit only the records that may be due.
   
    Flows are allocated and initialized by the flow_key_get_record()
    function when the CREATE_RECORDS flag is set in the arguments to
@@ -210,20 +256,13 @@ typedef struct flow_record_ {
    it has no twin.
   
    The function flow_record_list_free() frees *all* flow records in
-   the flow_record_list_array[].  This function should only be used
+   the flow table.  This function should only be used
    after all processing of all of the associated flows is done.
    
  \endverbatim
  */
 
 
-/*
- * A flow_record_list is a handle for a linked list of flow_records;
- * an array of such lists is used as a flow cache
- */
-
-typedef flow_record_t *flow_record_list;
-
 #define CREATE_RECORDS      1
 #define DONT_CREATE_RECORDS 0
 /**
@@ -259,14 +298,40 @@ flow_record_t *flow_key_get_record(joy_ctx_data *ctx,
                                         unsigned int create_new_records,
                                         const struct pcap_pkthdr *header);
 
+/**
+ * \brief flow_key_prefetch_slot(k) and then flow_key_prefetch_record(k)
+ * get what flow_key_get_record(k) is going to look at on its way into
+ * the cache, without changing anything; doing so for a batch of keys
+ * lets the cache misses of the batch overlap.
+ */
+uint32_t flow_key_prefetch_slot(joy_ctx_data *ctx, const flow_key_t *key);
+
+void flow_key_prefetch_record(joy_ctx_data *ctx, const flow_key_t *key, uint32_t hash_key);
+
+
+/** make room in the per-packet arrays of the flow record for n packets */
+unsigned int flow_record_reserve_pkts(joy_ctx_data *ctx, flow_record_t *rec, unsigned int n);
 
-/** update the byte count of the flow record */
-void flow_record_update_byte_count(flow_record_t *f, const void *x, unsigned int len);
+/** make room in the per-packet arrays for the next packet of the flow record */
+unsigned int flow_record_reserve_pkt(joy_ctx_data *ctx, flow_record_t *rec);
 
-/** update the compact byte count of the flow record */
-void flow_record_update_compact_byte_count(flow_record_t *f, const void *x, unsigned int len);
+/** number of packets held in the per-packet arrays of the flow record */
+unsigned int flow_record_num_pkts(const flow_record_t *rec);
 
-void flow_record_update_byte_dist_mean_var(flow_record_t *f, const void *x, unsigned int len);
+/** append an IP id to the flow record */
+void flow_record_add_ip_id(joy_ctx_data *ctx, flow_record_t *rec, uint16_t id);
+
+/** get the byte count of the flow record, allocating it on first use */
+uint32_t *flow_record_byte_count(joy_ctx_data *ctx, flow_record_t *rec);
+
+/** get the retransmission buffer of the flow record, allocating it on first use */
+tcp_retrans_t *flow_record_tcp_retrans(joy_ctx_data *ctx, flow_record_t *rec);
+
+/** get the header description of the flow record, allocating it on first use */
+header_description_t *flow_record_header_description(joy_ctx_data *ctx, flow_record_t *rec);
+
+/** update the byte distribution statistics and the walsh-hadamard transform of the flow record */
+void flow_record_update_payload_stats(joy_ctx_data *ctx, flow_record_t *f, const void *x, unsigned int len);
 
 void flow_record_update_timeouts(unsigned int inact, unsigned int act);
 
@@ -278,6 +343,12 @@ void flow_record_export_as_ipfix(joy_ctx_data *ctx, unsigned int print_all);
 
 void flow_record_list_print_json(joy_ctx_data *ctx, unsigned int print_all);
 
+/** wait until the output writer of the context, if any, has written every record */
+void flow_record_list_flush(joy_ctx_data *ctx);
+
+/** write out the column chunk of the Arrow output, once the writer is flushed */
+void flow_record_list_flush_chunk(joy_ctx_data *ctx);
+
 unsigned int flow_record_is_expired(joy_ctx_data *ctx, flow_record_t *record);
 
 void remove_record_and_update_list(joy_ctx_data *ctx, flow_record_t *rec);
@@ -297,6 +368,36 @@ int process_pcap_file(char *file_name, const char *filter_exp, bpf_u_int32 *net,
  * num_records_output is the total number of flow records that have been 
  * written to output
  *
+ * flow_table_load is the fraction of the flow table slots that are in
+ * use, and flow_table_grows and flow_table_shrinks count the number of
+ * times that the table has been resized up and down; these are updated
+ * each time the stats are output
+ *
+ * capture_packets, capture_drops and capture_freezes are the counters
+ * of the live capture (packets seen, packets dropped because joy did not
+ * keep up, and times the capture ring was found full); they are filled
+ * in by the capture loop, and are zero for pcap files
+ *
+ * saturated_records counts the records that had collected everything
+ * their features look at, and fast_path_packets counts the packets of
+ * those records that only updated the flow counters
+ *
+ * evicted_records counts the records that were output early to stay
+ * within max_flows, which also counts the records that are waiting for
+ * the output writer, and refused_records counts the new flows that did
+ * not get a record, because of admission control or because nothing
+ * could be evicted
+ *
+ * duplicate_packets counts the packets that were dropped as copies of
+ * a packet seen just before, when dedup is on; they are included in
+ * num_packets
+ *
+ * dropped_records counts the records that were not output because the
+ * queue of the output writer was full, with backpressure=drop;
+ * spilled_records and writer_waits count the records that were held
+ * back (spill) and the times the packet thread waited (block) for the
+ * same reason, and are updated each time the stats are output
+ *
  */
 typedef struct flocap_stats_ {
   unsigned long int num_packets;
@@ -304,6 +405,20 @@ typedef struct flocap_stats_ {
   unsigned long int num_records_in_table;
   unsigned long int num_records_output;
   unsigned long int malloc_fail;
+  double flow_table_load;
+  unsigned long int flow_table_grows;
+  unsigned long int flow_table_shrinks;
+  unsigned long int capture_packets;
+  unsigned long int capture_drops;
+  unsigned long int capture_freezes;
+  unsigned long int saturated_records;
+  unsigned long int fast_path_packets;
+  unsigned long int evicted_records;
+  unsigned long int refused_records;
+  unsigned long int duplicate_packets;
+  unsigned long int dropped_records;
+  unsigned long int spilled_records;
+  unsigned long int writer_waits;
 } flocap_stats_t;
 
 //#define flocap_stats_init(c) flocap_stats_t stats = {  0, 0, 0, 0 };
@@ -324,6 +439,18 @@ typedef struct flocap_stats_ {
 
 #define flocap_stats_incr_malloc_fail(c) (c->stats.malloc_fail++)
 
+#define flocap_stats_incr_saturated_records(c) (c->stats.saturated_records++)
+
+#define flocap_stats_incr_fast_path_packets(c) (c->stats.fast_path_packets++)
+
+#define flocap_stats_incr_evicted_records(c) (c->stats.evicted_records++)
+
+#define flocap_stats_incr_refused_records(c) (c->stats.refused_records++)
+
+#define flocap_stats_incr_duplicate_packets(c) (c->stats.duplicate_packets++)
+
+#define flocap_stats_incr_dropped_records(c) (c->stats.dropped_records++)
+
 #define flocap_stats_format "packets: %lu\tcurrent records: %lu\toutput records: %lu"
 
 
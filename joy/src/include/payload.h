@@ -55,6 +55,9 @@
 
 /** payload filter key */
 #define payload_filter(record) 1
+
+/** payload done: true once the first payload has been copied */
+#define payload_done(payload) ((payload)->length != 0)
   
 /** payload structure */
 typedef struct payload {
@@ -66,7 +69,7 @@ typedef struct payload {
 declare_feature(payload);
 
 /** initialization function */
-void payload_init(struct payload **payload_handle);
+void payload_init(struct payload **payload_handle, flow_pool_t *pool);
 
 /** update payload */
 void payload_update(struct payload *payload, 
@@ -81,7 +84,7 @@ void payload_print_json(const struct payload *w1,
 		    zfile f);
 
 /** delete payload */
-void payload_delete(struct payload **payload_handle);
+void payload_delete(struct payload **payload_handle, flow_pool_t *pool);
 
 /** payload unit test entry point */
 void payload_unit_test(void);
@@ -0,0 +1,99 @@
+/*
+ *
+ * Copyright (c) 2018 Cisco Systems, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials provided
+ *   with the distribution.
+ *
+ *   Neither the name of the Cisco Systems, Inc. nor the names of its
+ *   contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/**
+ * \file payload_stats.h
+ *
+ * \brief statistics gathered from the bytes of each payload in one pass
+ *
+ ** The byte distribution, the compact byte distribution, the byte
+ *  mean and variance and the walsh-hadamard transform all look at every
+ *  byte of the application data.  payload_stats_scan() works all of the
+ *  ones that are enabled out of a single pass over the payload, with
+ *  SSE2 or AVX2 where the processor has them.
+ *
+ ** Instead of a running mean and variance, the sum of the bytes and the
+ *  sum of their squares are kept; payload_stats_moments() turns them
+ *  into a mean and a sum of squared deviations when a flow is printed.
+ *
+ */
+
+#ifndef PAYLOAD_STATS_H
+#define PAYLOAD_STATS_H
+
+#include <stdint.h>
+
+/** what payload_stats_scan() found in a payload */
+typedef struct payload_stats_ {
+    uint64_t sum;                          /*!< sum of the bytes                    */
+    uint64_t sum_sq;                       /*!< sum of the squares of the bytes     */
+    int64_t wht[4];                        /*!< walsh-hadamard spectrum, unscaled   */
+} payload_stats_t;
+
+/** implementations of payload_stats_scan() */
+typedef enum {
+    PAYLOAD_STATS_AUTO = 0,                /*!< the best one the processor supports */
+    PAYLOAD_STATS_SCALAR = 1,
+    PAYLOAD_STATS_SSE2 = 2,
+    PAYLOAD_STATS_AVX2 = 3
+} payload_stats_impl_e;
+
+/**
+ * pick the implementation used by payload_stats_scan(); returns 0, or -1
+ * if it is not available on this processor or in this build
+ */
+int payload_stats_set_impl(payload_stats_impl_e impl);
+
+/** name of the implementation that payload_stats_scan() uses */
+const char *payload_stats_impl_name(void);
+
+/**
+ * scan len bytes of payload: count the first byte_count_len of them in
+ * byte_count (if not NULL), count all of them in compact_byte_count
+ * through compact_map (if not NULL), and fill in stats (if not NULL)
+ */
+void payload_stats_scan(const void *data, unsigned int len,
+                        uint32_t *byte_count, unsigned int byte_count_len,
+                        uint32_t *compact_byte_count, const uint16_t *compact_map,
+                        payload_stats_t *stats);
+
+/** mean and sum of squared deviations of n bytes with the given sums */
+void payload_stats_moments(uint32_t n, uint64_t sum, uint64_t sum_sq,
+                           double *mean, double *sq_dev);
+
+int payload_stats_unit_test(void);
+
+#endif /* PAYLOAD_STATS_H */
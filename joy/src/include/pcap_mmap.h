@@ -0,0 +1,113 @@
+/*
+ *
+ * Copyright (c) 2018 Cisco Systems, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials provided
+ *   with the distribution.
+ *
+ *   Neither the name of the Cisco Systems, Inc. nor the names of its
+ *   contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+/**
+ * \file pcap_mmap.h
+ *
+ * \brief reader for pcap and pcapng files that maps them into memory
+ *
+ ** The reader walks the records of a file in place and hands pointers
+ *  to the packets straight to a pcap callback, a batch at a time, the
+ *  way pcap_dispatch() does; nothing is copied or read with system
+ *  calls.  The kernel is asked to read ahead of the packets that are
+ *  being processed.  A packet stays where it is until the reader is
+ *  closed, so the packets of a batch can be kept and processed together.
+ *
+ ** Only Ethernet captures are read.  The one filter that the reader
+ *  applies on its own is joy's default, "ip or ip6 or mpls or vlan";
+ *  with any other BPF filter, or on systems without mmap(), files are
+ *  read with libpcap.
+ *
+ */
+
+#ifndef PCAP_MMAP_H
+#define PCAP_MMAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pcap.h>
+#include "err.h"
+
+/** bytes that the kernel is asked to read ahead of the current packet */
+#define PCAP_MMAP_READAHEAD (16 * 1024 * 1024)
+
+/** largest captured length accepted, as in libpcap */
+#define PCAP_MMAP_MAX_SNAPLEN 262144
+
+/** pcapng interface, as described by its Interface Description Block */
+typedef struct pcap_mmap_if_ {
+    uint32_t snaplen;                      /*!< snapshot length of the interface  */
+    uint64_t tsresol;                      /*!< timestamp units per second        */
+    uint8_t tsresol_bin;                   /*!< tsresol is 2^tsresol_exp          */
+    uint8_t tsresol_exp;                   /*!< exponent of tsresol               */
+    int64_t tsoffset;                      /*!< seconds added to timestamps       */
+} pcap_mmap_if_t;
+
+typedef struct pcap_mmap_ {
+    const unsigned char *base;             /*!< the mapped file                   */
+    size_t size;                           /*!< bytes in the file                 */
+    size_t offset;                         /*!< next record or block              */
+    size_t advised;                        /*!< end of the read ahead so far      */
+    uint8_t pcapng;                        /*!< pcapng, rather than classic pcap  */
+    uint8_t swapped;                       /*!< byte order differs from the host's */
+    uint8_t ip_only;                       /*!< apply joy's default filter          */
+    uint8_t nsec;                          /*!< classic pcap with nanoseconds     */
+    uint8_t old_version;                   /*!< classic pcap before 2.3           */
+    uint32_t snaplen;                      /*!< classic pcap snapshot length      */
+    pcap_mmap_if_t *ifs;                   /*!< pcapng interfaces of the section  */
+    unsigned int num_ifs;
+    unsigned int max_ifs;
+    const unsigned char *tail;             /*!< start of the end of the file, if copied */
+    unsigned char *bounce;                 /*!< copy of the end of the file       */
+} pcap_mmap_t;
+
+/**
+ * map a pcap or pcapng file; fails when the file cannot be mapped or is
+ * not an Ethernet capture, in which case it is left to libpcap
+ */
+joy_status_e pcap_mmap_open(pcap_mmap_t *r, const char *file_name, int ip_only);
+
+/**
+ * hand up to cnt packets (all of them if cnt <= 0) to callback; returns
+ * the number of packets, 0 at the end of the file, -1 if it is corrupt
+ */
+int pcap_mmap_dispatch(pcap_mmap_t *r, int cnt, pcap_handler callback, unsigned char *user);
+
+/** unmap the file */
+void pcap_mmap_close(pcap_mmap_t *r);
+
+int pcap_mmap_unit_test(void);
+
+#endif /* PCAP_MMAP_H */
@@ -65,6 +65,14 @@
 #define ETH_TYPE_IP    0X0800
 #define ETH_TYPE_DOT1Q 0X08100
 #define ETH_TYPE_QNQ   0X088A8
+#define ETH_TYPE_QINQ_OLD 0X09100
+#define ETH_TYPE_IPV6  0X086DD
+#define ETH_TYPE_MPLS  0X08847
+#define ETH_TYPE_MPLS_MC 0X08848
+
+/** MPLS label stack entry; the last one has the bottom of stack bit set */
+#define MPLS_HDR_LEN 4
+#define mpls_bottom_of_stack(p) ((p)[2] & 0x01)
 
 /** ethernet header structure */
 struct ethernet_hdr {
@@ -115,6 +123,28 @@ struct ip_hdr {
     struct in_addr ip_dst;    /* destination address    */
 };
 
+/** Internet Protocol version six header */
+#define IPV6_HDR_LEN 40
+
+/** IPv6 header structure */
+struct ipv6_hdr {
+    unsigned int    ipv6_vtcfl;  /* version, class, flow label */
+    unsigned short  ipv6_plen;   /* payload length            */
+    unsigned char   ipv6_next;   /* next header               */
+    unsigned char   ipv6_hlim;   /* hop limit                 */
+    struct in6_addr ipv6_src;    /* source address            */
+    struct in6_addr ipv6_dst;    /* destination address       */
+};
+
+/** IPv6 fragment header; the offset is in the top 13 bits of frag_off */
+#define IPV6_FOFF 0xfff8
+struct ipv6_frag_hdr {
+    unsigned char  next;         /* next header               */
+    unsigned char  reserved;
+    unsigned short frag_off;     /* offset and more fragments */
+    unsigned int   frag_id;      /* identification            */
+};
+
 /** Transmission Control Protocol (TCP) header */
 #define TCP_FIN  0x01
 #define TCP_SYN  0x02
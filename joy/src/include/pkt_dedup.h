@@ -0,0 +1,95 @@
+/*
+ *
+ * Copyright (c) 2018 Cisco Systems, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials provided
+ *   with the distribution.
+ *
+ *   Neither the name of the Cisco Systems, Inc. nor the names of its
+ *   contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/**
+ * \file pkt_dedup.h
+ *
+ * \brief time windowed set of packet fingerprints, to drop duplicates
+ *
+ ** SPAN ports and taps often deliver the same packet twice, for
+ *  instance once on the way into a switch and once on the way out.
+ *  Each packet gets a 64 bit fingerprint of the fields that a copy
+ *  has in common with the original, and a packet whose fingerprint
+ *  was seen less than a window ago is a duplicate.
+ *
+ ** The set is a fixed size table of small buckets, so it costs one
+ *  cache line per packet and never allocates; when a bucket is full,
+ *  the oldest fingerprint in it makes room.
+ *
+ */
+
+#ifndef PKT_DEDUP_H
+#define PKT_DEDUP_H
+
+#include <stdint.h>
+#include <pcap.h>
+#include "err.h"
+#include "pkt_proc.h"
+
+/** number of buckets in the set (a power of two) */
+#define PKT_DEDUP_BUCKETS 4096
+
+/** number of fingerprints in a bucket */
+#define PKT_DEDUP_WAYS 8
+
+/** a fingerprint, and when it was last seen */
+typedef struct pkt_dedup_entry_ {
+    uint32_t tag;                          /*!< low half of the fingerprint, 0 if unused */
+    uint32_t time;                         /*!< arrival time, in microseconds (wraps)   */
+} pkt_dedup_entry_t;
+
+typedef struct pkt_dedup_ {
+    pkt_dedup_entry_t *entries;            /*!< PKT_DEDUP_BUCKETS * PKT_DEDUP_WAYS entries */
+    void *mem;                             /*!< allocation that holds the entries   */
+    uint32_t window;                       /*!< microseconds within which copies are dropped */
+} pkt_dedup_t;
+
+/** allocate the set; window is in microseconds */
+joy_status_e pkt_dedup_init(pkt_dedup_t *d, uint32_t window);
+
+/** release the set */
+void pkt_dedup_destroy(pkt_dedup_t *d);
+
+/** fingerprint of a decoded packet of caplen captured bytes */
+uint64_t pkt_dedup_fingerprint(const unsigned char *packet, unsigned int caplen,
+                               const pkt_desc_t *desc);
+
+/** remember a fingerprint; returns 1 if it was seen within the window, 0 otherwise */
+int pkt_dedup_check(pkt_dedup_t *d, uint64_t fp, const struct timeval *ts);
+
+int pkt_dedup_unit_test(void);
+
+#endif /* PKT_DEDUP_H */
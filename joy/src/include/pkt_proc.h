@@ -49,14 +49,75 @@
 
 #define MAX_TEMPLATES 100
 
+/** most packets that process_packet_prefetch() looks at in one go */
+#define PKT_BATCH_SIZE 32
+
+/** caplen to give decode_packet() when the captured length is not known */
+#define PKT_DECODE_NO_CAPLEN 0xffffffff
+
+/**
+ * A packet as decode_packet() finds it: where its IP and transport
+ * headers are, the key of its flow, and a hash of the key that does
+ * not depend on the direction of the packet.  The offsets are from the
+ * start of the packet.
+ */
+typedef struct pkt_desc_ {
+    flow_key_t key;             /*!< key of the flow of the packet          */
+    uint32_t hash;              /*!< symmetric hash of key                  */
+    uint32_t ip_len;            /*!< length of the IP packet, headers included */
+    uint16_t l3_offset;         /*!< offset of the IP header                */
+    uint16_t l4_offset;         /*!< offset of the transport header         */
+    uint8_t ip_version;         /*!< 4 or 6; 0 if the packet is not in any flow */
+} pkt_desc_t;
+
+/** find the headers, flow key and hash of a packet */
+int decode_packet(const unsigned char *packet, unsigned int caplen, pkt_desc_t *desc);
+
 /** main packet processing entry point */
 void* process_packet(unsigned char *ctx_ptr, const struct pcap_pkthdr *header, const unsigned char *packet);
 void libpcap_process_packet(unsigned char *ctx_ptr, const struct pcap_pkthdr *header, const unsigned char *packet);
 
-uint8_t get_packet_5tuple_key(const unsigned char *packet, flow_key_t *key);
+/** process_packet(), for a packet that decode_packet() has looked at already */
+void* process_decoded_packet(unsigned char *ctx_ptr, const struct pcap_pkthdr *header,
+                             const unsigned char *packet, const pkt_desc_t *desc);
+
+/** packet pipelines, each for the configurations that leave some options off */
+typedef enum {
+    PKT_PIPELINE_AUTO = 0,      /*!< the smallest one for the configuration */
+    PKT_PIPELINE_BASIC = 1,     /*!< no byte statistics, idp, hd, zeroes or retrans */
+    PKT_PIPELINE_STATS = 2,     /*!< as basic, with the byte statistics     */
+    PKT_PIPELINE_FULL = 3,      /*!< all but logging and flow collection    */
+    PKT_PIPELINE_GENERIC = 4    /*!< any configuration                      */
+} pkt_pipeline_e;
+
+/**
+ * pick the pipeline of process_decoded_packet(), once the configuration
+ * is set; returns 0, or -1 if it does not cover the configuration
+ */
+int pkt_proc_set_pipeline(pkt_pipeline_e id);
+
+/** name of the pipeline that process_decoded_packet() runs */
+const char *pkt_proc_pipeline_name(void);
+
+/** process num_packets packets, in order, overlapping their flow table lookups */
+void process_packet_batch(unsigned char *ctx_ptr, unsigned int num_packets,
+                          const struct pcap_pkthdr *headers, const unsigned char *const *packets);
+
+/**
+ * decode up to PKT_BATCH_SIZE packets, and get their flow table slots
+ * and flow records on their way into the cache
+ */
+void process_packet_prefetch(joy_ctx_data *ctx, unsigned int num_packets,
+                             const struct pcap_pkthdr *headers, const unsigned char *const *packets,
+                             pkt_desc_t *descs);
+
+/** pick one of num_shards worker contexts for a packet; both directions of a flow get the same one */
+int get_packet_shard(const pkt_desc_t *desc, unsigned int num_shards);
 
 joy_status_e process_ipfix(joy_ctx_data *ctx, const char *start, int len, flow_record_t *r);
 
+int pkt_proc_unit_test(void);
+
 /* The tls_type_code structure describes the content of a TLS record */
 /*
 struct tls_type_code {
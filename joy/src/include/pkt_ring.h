@@ -0,0 +1,137 @@
+/*
+ *
+ * Copyright (c) 2018 Cisco Systems, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials provided
+ *   with the distribution.
+ *
+ *   Neither the name of the Cisco Systems, Inc. nor the names of its
+ *   contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/**
+ * \file pkt_ring.h
+ *
+ * \brief single producer, single consumer ring of captured packets
+ *
+ ** The ring hands packets from the thread that reads a capture file to
+ *  a worker thread that owns a context.  Each packet is copied into the
+ *  ring together with its pcap header, so the reader can go on to the
+ *  next packet straight away.  The two sides only share the head and
+ *  tail offsets, which live on separate cache lines; no locks are taken.
+ *
+ ** The descriptor that the reader got from decode_packet(), to pick
+ *  the worker, goes along with the packet, so that the worker does not
+ *  decode it again.
+ *
+ ** Besides packets, the reader can push ticks, which only carry the
+ *  capture time; they keep the clock of a worker going when it gets
+ *  no packets for a while.
+ *
+ ** A side that finds the ring full (reader) or empty (worker) yields
+ *  the processor until the other side has caught up.
+ *
+ */
+
+#ifndef PKT_RING_H
+#define PKT_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pcap.h>
+#include "err.h"
+#include "pkt_proc.h"
+
+/** default size of the ring of a worker, in bytes */
+#define PKT_RING_SIZE (4 * 1024 * 1024)
+
+/** entries are aligned on (and their size rounded up to) this boundary */
+#define PKT_RING_ALIGN 16
+
+/** keeps the producer and consumer fields of a ring on their own cache lines */
+#define PKT_RING_CACHE_LINE 64
+
+/** entry flag: a tick, which carries a capture time but no packet */
+#define PKT_RING_TICK 0x1
+
+/** a packet in the ring; the captured bytes follow the header */
+typedef struct pkt_ring_entry_ {
+    uint32_t size;                         /*!< bytes taken by the entry, 0 marks a wrap */
+    uint32_t caplen;                       /*!< captured length of the packet       */
+    uint32_t len;                          /*!< length of the packet on the wire     */
+    uint32_t flags;                        /*!< PKT_RING_TICK, or 0 for a packet    */
+    struct timeval ts;                     /*!< capture time of the packet          */
+    pkt_desc_t desc;                       /*!< the packet, decoded                 */
+} pkt_ring_entry_t;
+
+/** captured bytes of a packet entry */
+#define pkt_ring_entry_data(e) ((const unsigned char *)((e) + 1))
+
+typedef struct pkt_ring_ {
+    unsigned char *buf;                    /*!< entry storage                       */
+    size_t size;                           /*!< bytes of storage, a power of two    */
+    uint64_t num_waits;                    /*!< times the producer found the ring full */
+
+    char pad0[PKT_RING_CACHE_LINE];
+    size_t head;                           /*!< bytes ever produced (producer writes) */
+    size_t closed;                         /*!< no more entries will be produced    */
+
+    char pad1[PKT_RING_CACHE_LINE];
+    size_t tail;                           /*!< bytes ever consumed (consumer writes) */
+
+    char pad2[PKT_RING_CACHE_LINE];
+} pkt_ring_t;
+
+/** allocate the storage of a ring; size is rounded up to a power of two */
+joy_status_e pkt_ring_init(pkt_ring_t *r, size_t size);
+
+/** release the storage of a ring */
+void pkt_ring_destroy(pkt_ring_t *r);
+
+/** copy a packet and its descriptor into the ring, waiting for room if it is full */
+void pkt_ring_push(pkt_ring_t *r, const struct pcap_pkthdr *header, const unsigned char *packet,
+                   const pkt_desc_t *desc);
+
+/** push a tick carrying the capture time ts */
+void pkt_ring_push_tick(pkt_ring_t *r, const struct timeval *ts);
+
+/** tell the consumer that no more packets will be pushed */
+void pkt_ring_close(pkt_ring_t *r);
+
+/**
+ * get the oldest entry in the ring, waiting for one if it is empty;
+ * returns NULL once the ring has been closed and drained
+ */
+const pkt_ring_entry_t *pkt_ring_peek(pkt_ring_t *r);
+
+/** release the entry returned by the last pkt_ring_peek() */
+void pkt_ring_pop(pkt_ring_t *r);
+
+int pkt_ring_unit_test(void);
+
+#endif /* PKT_RING_H */
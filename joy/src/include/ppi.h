@@ -47,6 +47,7 @@
 #include <stdio.h> 
 #include "output.h"
 #include "feature.h"
+#include "utils.h"
 
 #define MAX_NUM_PKT 200
 
@@ -56,10 +57,13 @@
 /** ppi filter key */
 #define ppi_filter(record) 1
 
+/** ppi done: true once the packet array is full */
+#define ppi_done(ppi) ((ppi)->np >= MAX_NUM_PKT)
+
 #define TCP_OPT_LEN 24
   
 struct pkt_info {
-    struct timeval time; 
+    joy_time_delta_t time; /**< arrival time, relative to ppi_t time_base */
     unsigned int ack;
     unsigned int seq;
     unsigned short len;  
@@ -71,6 +75,7 @@ struct pkt_info {
 /** ppi structure */
 typedef struct ppi {
     unsigned int np;
+    joy_time_base_t time_base;
     struct pkt_info pkt_info[MAX_NUM_PKT];
 } ppi_t;
 
@@ -83,7 +88,7 @@ void tcp_opt_print_json(zfile f,
 declare_feature(ppi);
 
 /** initialization function */
-void ppi_init(struct ppi **ppi_handle);
+void ppi_init(struct ppi **ppi_handle, flow_pool_t *pool);
 
 /** update ppi */
 void ppi_update(struct ppi *ppi, 
@@ -98,7 +103,7 @@ void ppi_print_json(const struct ppi *w1,
 		     zfile f);
 
 /** delete ppi */
-void ppi_delete(struct ppi **ppi_handle);
+void ppi_delete(struct ppi **ppi_handle, flow_pool_t *pool);
 
 /** ppi unit test entry point */
 void ppi_unit_test(void);
@@ -47,6 +47,7 @@
 #include <stdio.h> 
 #include "output.h"
 #include "feature.h"
+#include "utils.h"
 
 #ifdef WIN32
 #include "Ws2tcpip.h"
@@ -59,6 +60,9 @@
 
 /** salt filter key */
 #define salt_filter(record) 1
+
+/** salt done: true once the sequence and acknowledgement arrays are full */
+#define salt_done(salt) ((salt)->np >= MAX_NUM_PKT && (salt)->idx >= MAX_NUM_PKT - 1)
   
 /** salt structure */
 typedef struct salt {
@@ -67,7 +71,8 @@ typedef struct salt {
     unsigned int idx;                     /* used for tracking array entries */
     unsigned int tcp_ack;                 /* acknowledgement number */
     unsigned short pkt_len[MAX_NUM_PKT];  /*!< array of packet appdata lengths */  
-    struct timeval pkt_time[MAX_NUM_PKT]; /*!< array of arrival times          */
+    joy_time_base_t pkt_time_base;        /*!< base of the pkt_time offsets    */
+    joy_time_delta_t pkt_time[MAX_NUM_PKT]; /*!< array of arrival times        */
     unsigned int ack[MAX_NUM_PKT];
     unsigned int seq[MAX_NUM_PKT];
 } salt_t;
@@ -76,7 +81,7 @@ typedef struct salt {
 declare_feature(salt);
 
 /** initialization function */
-void salt_init(struct salt **salt_handle);
+void salt_init(struct salt **salt_handle, flow_pool_t *pool);
 
 /** update salt */
 void salt_update(struct salt *salt, 
@@ -91,7 +96,7 @@ void salt_print_json(const struct salt *w1,
 		     zfile f);
 
 /** delete salt */
-void salt_delete(struct salt **salt_handle);
+void salt_delete(struct salt **salt_handle, flow_pool_t *pool);
 
 /** salt unit test entry point */
 void salt_unit_test(void);
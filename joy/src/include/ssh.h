@@ -57,6 +57,9 @@
      (record->app == 22 || (record->key.dp == 22 || record->key.sp == 22)) \
     )
 
+/** ssh done: true once the keys have been exchanged */
+#define ssh_done(ssh) ((ssh)->newkeys)
+
 #define MAX_SSH_STRING_LEN 512
 #define MAX_SSH_KEX_MESSAGES 2 /* large enough for DH, RSA, and GEX key exchanges */
 #define MAX_SSH_PACKET_LEN 35000 /* RFC 4253, Section 6.1. */
@@ -100,7 +103,7 @@ typedef struct ssh {
 
 declare_feature(ssh);
 
-void ssh_init(struct ssh **ssh_handle);
+void ssh_init(struct ssh **ssh_handle, flow_pool_t *pool);
 
 void ssh_update(struct ssh *ssh,
                 const struct pcap_pkthdr *header,
@@ -112,7 +115,7 @@ void ssh_print_json(const struct ssh *w1,
 		    const struct ssh *w2,
 		    zfile f);
 
-void ssh_delete(struct ssh **ssh_handle);
+void ssh_delete(struct ssh **ssh_handle, flow_pool_t *pool);
 
 void ssh_unit_test(void);
 
@@ -45,6 +45,7 @@
 
 #include <pcap.h>
 #include "output.h"
+#include "flow_pool.h"
 #include "utils.h"
 #include "fingerprint.h"
 
@@ -54,12 +55,18 @@
 /** tls filter key */
 #define tls_filter(record) (record->app == 443 || (record->key.dp == 443 || record->key.sp == 443))
 
+/** tls done: true once the handshake is parsed and the record array is full */
+#define tls_done(tls) ((tls)->done_handshake && (tls)->op >= MAX_NUM_RCD_LEN)
+
 /* constants for TLS awareness */
 #define MAX_CS 256
 #define MAX_EXTENSIONS 256
 #define MAX_SID_LEN 256
 #define MAX_NUM_RCD_LEN 100
 
+/* length of the header of a TLS record */
+#define TLS_HDR_LEN 5
+
 /* Maxiumum handshakes we should see under a single content message */
 #define MAX_TLS_HANDSHAKES 5
 
@@ -191,7 +198,8 @@ typedef struct tls_ {
     joy_role_e role; /**< client, server, or unknown */
     uint16_t op;
     uint16_t lengths[MAX_NUM_RCD_LEN]; /**< TLS record lengths */
-    struct timeval times[MAX_NUM_RCD_LEN]; /**< Arrival times */
+    joy_time_base_t times_base; /**< Base of the arrival time offsets */
+    joy_time_delta_t times[MAX_NUM_RCD_LEN]; /**< Arrival times */
     tls_message_stat_t msg_stats[MAX_NUM_RCD_LEN]; /**< Message generic stats */
     uint16_t num_ciphersuites; /**< Number of ciphersuites */
     uint16_t ciphersuites[MAX_CS]; /**< Ciphersuites */
@@ -213,6 +221,8 @@ typedef struct tls_ {
     uint16_t handshake_length; /**< Length of data in handshake buffer */
     unsigned char done_handshake; /**< Flag indicating the hanshake phase has completed */
     uint16_t seg_offset;
+    unsigned char seg_hdr[TLS_HDR_LEN]; /**< Start of a record header that goes on in the next packet */
+    unsigned char seg_hdr_len; /**< Number of bytes in seg_hdr */
     fingerprint_t *tls_fingerprint;
 } tls_t;
 
@@ -308,10 +318,10 @@ typedef enum tls_content_type_ {
  */
 
 /** initialize TLS structure */
-void tls_init(tls_t **tls_handle);
+void tls_init(tls_t **tls_handle, flow_pool_t *pool);
 
 /** free data associated with TLS record */
-void tls_delete(tls_t **tls_handle);
+void tls_delete(tls_t **tls_handle, flow_pool_t *pool);
 
 /** process TLS packet for consumption */
 void tls_update(tls_t *r,
@@ -43,6 +43,7 @@
 #define P2FUTILS
 
 #include <stdio.h>
+#include <stdint.h>
 #include <ctype.h>      /* for isprint()           */
 #include <pcap.h>
 #include "parson.h"
@@ -64,6 +65,16 @@
 # endif
 #endif
 
+/* start loading the cache line that holds addr, ahead of its use */
+#if defined(__GNUC__)
+# define joy_prefetch(addr) __builtin_prefetch((addr), 0, 3)
+#elif defined(WIN32)
+# include <xmmintrin.h>
+# define joy_prefetch(addr) _mm_prefetch((const char *)(addr), _MM_HINT_T0)
+#else
+# define joy_prefetch(addr) ((void)(addr))
+#endif
+
 #ifdef WIN32
 int gettimeofday(struct timeval *tp,
                  struct timezone *tzp);
@@ -83,6 +94,31 @@ void joy_timer_clear(struct timeval *a);
 
 unsigned int joy_timeval_to_milliseconds(struct timeval ts);
 
+/*
+ * Arrival times of the packets (or messages) of a flow are kept as
+ * 32-bit offsets, in microseconds, from a single 64-bit base time in
+ * nanoseconds, which is the first time that is stored.  Offsets
+ * saturate at about 35 minutes either side of the base.
+ */
+typedef int32_t joy_time_delta_t;
+
+/** base time of a set of joy_time_delta_t offsets */
+typedef struct joy_time_base_ {
+    int64_t ns;                 /*!< base time, in nanoseconds since the epoch */
+    uint8_t set;                /*!< nonzero once ns holds a time              */
+} joy_time_base_t;
+
+int64_t joy_timeval_to_usec(const struct timeval *t);
+
+joy_time_delta_t joy_time_delta(joy_time_base_t *base, const struct timeval *t);
+
+int64_t joy_time_delta_to_usec(const joy_time_base_t *base, joy_time_delta_t d);
+
+void joy_time_delta_to_timeval(const joy_time_base_t *base, joy_time_delta_t d,
+                               struct timeval *t);
+
+unsigned int joy_usec_to_milliseconds(int64_t usec);
+
 FILE* joy_utils_open_test_file(const char *filename);
 
 pcap_t* joy_utils_open_test_pcap(const char *filename);
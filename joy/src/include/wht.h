@@ -50,6 +50,7 @@
 
 #include <stdio.h> 
 #include "output.h"
+#include "flow_pool.h"
 #include <pcap.h>
 
 /** inclusion string */
@@ -58,6 +59,9 @@
 /** walsh-hadamard filter key */
 #define wht_filter(record) 1
 
+/** wht is never done, the spectrum takes in every payload byte */
+#define wht_done(wht) 0
+
 /** walsh-hadamard structure */
 typedef struct wht_ {
     uint32_t b;           /*!< byte count */
@@ -65,7 +69,7 @@ typedef struct wht_ {
 } wht_t;
 
 /** initializes a walsh-hadamard structure */
-void wht_init(wht_t **wht_handle);
+void wht_init(wht_t **wht_handle, flow_pool_t *pool);
 
 /** updates the contents of walsh-hadamard structure */
 void wht_update(wht_t *wht, 
@@ -74,11 +78,14 @@ void wht_update(wht_t *wht,
 		unsigned int len, 
 		unsigned int report_wht);
 
+/** adds the spectrum of a payload, from payload_stats_scan(), to a walsh-hadamard structure */
+void wht_update_spectrum(wht_t *wht, unsigned int len, const int64_t spectrum[4]);
+
 /** prints out the walsh-hadamard structure in JSON format */
 void wht_print_json(const wht_t *w1, const wht_t *w2, zfile f);
 
 /** clear out the walsh-hadamard structure */
-void wht_delete(wht_t **wht_handle);
+void wht_delete(wht_t **wht_handle, flow_pool_t *pool);
 
 /** unit test entry point */
 void wht_unit_test(void);
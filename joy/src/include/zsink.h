@@ -0,0 +1,138 @@
+/*
+ *
+ * Copyright (c) 2018 Cisco Systems, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials provided
+ *   with the distribution.
+ *
+ *   Neither the name of the Cisco Systems, Inc. nor the names of its
+ *   contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/**
+ * \file zsink.h
+ *
+ * \brief gzip compressed output file, compressed on a pool of threads
+ *
+ ** With compress_threads=0, a sink is a thin wrapper around a zlib
+ *  gzFile, and the output is compressed by the thread that writes it,
+ *  as one gzip stream.
+ *
+ ** Otherwise, the output is cut into blocks of ZSINK_BLOCK_SIZE bytes
+ *  or a little more, and each block is compressed into a gzip member
+ *  of its own by one of the sink's threads.  The members are written
+ *  to the file in order, so the file is an ordinary multi-member gzip
+ *  file: gunzip, zcat and Python's gzip.open read it as one stream.
+ *
+ ** A sink is used by one thread at a time, like a gzFile.  Sinks are
+ *  only there when joy is built with gzip output (USE_GZIP).
+ *
+ */
+
+#ifndef ZSINK_H
+#define ZSINK_H
+
+/** most threads that a sink compresses on */
+#define ZSINK_MAX_THREADS 64
+
+int zsink_unit_test(void);
+
+#ifdef USE_GZIP
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <zlib.h>
+
+/** bytes of output that go into a block before it is compressed */
+#define ZSINK_BLOCK_SIZE (256 * 1024)
+
+/** state of a block */
+typedef enum zsink_block_state_ {
+    ZSINK_BLOCK_FREE = 0,                  /*!< can be filled                      */
+    ZSINK_BLOCK_FILLED = 1,                /*!< waiting to be compressed           */
+    ZSINK_BLOCK_DONE = 2                   /*!< compressed, waiting to be written  */
+} zsink_block_state_e;
+
+typedef struct zsink_block_ {
+    unsigned char *in;                     /*!< output, as written to the sink     */
+    size_t in_len;
+    size_t in_size;
+    unsigned char *out;                    /*!< the same, as a gzip member         */
+    size_t out_len;
+    size_t out_size;
+    zsink_block_state_e state;
+} zsink_block_t;
+
+typedef struct zsink_ {
+    gzFile gz;                             /*!< the file, without threads          */
+
+    FILE *f;                               /*!< the file, with threads             */
+    int level;                             /*!< zlib compression level             */
+    unsigned int num_threads;
+    pthread_t threads[ZSINK_MAX_THREADS];
+    zsink_block_t *blocks;                 /*!< ring of 2 blocks per thread        */
+    unsigned int num_blocks;
+    uint64_t fill_seq;                     /*!< block being filled                 */
+    uint64_t compress_seq;                 /*!< next block to be compressed        */
+    uint64_t write_seq;                    /*!< next block to be written           */
+    unsigned int writing;                  /*!< a thread is writing blocks out     */
+    unsigned int stop;                     /*!< the threads are to exit            */
+    unsigned int failed;                   /*!< compressing or writing failed      */
+    pthread_mutex_t lock;
+    pthread_cond_t work;                   /*!< signalled when a block is filled   */
+    pthread_cond_t room;                   /*!< signalled when a block is written  */
+} zsink_t;
+
+/** open a file for compressed output, with the compress_threads and compress_level settings */
+zsink_t *zsink_open(const char *fname, const char *mode);
+
+/** compress output to an open stdio file, which is closed with the sink */
+zsink_t *zsink_attach(FILE *f, const char *mode);
+
+/** write len bytes of buf; returns len, or 0 on error */
+int zsink_write(zsink_t *z, const void *buf, size_t len);
+
+/** formatted output; returns the number of bytes written, or a negative value on error */
+int zsink_printf(zsink_t *z, const char *format, ...)
+#ifdef __GNUC__
+    __attribute__((format(printf, 2, 3)))
+#endif
+    ;
+
+/** compress and write everything written so far */
+int zsink_flush(zsink_t *z);
+
+/** flush the sink, stop its threads and close the file; returns 0, or -1 on error */
+int zsink_close(zsink_t *z);
+
+#endif /* USE_GZIP */
+
+#endif /* ZSINK_H */
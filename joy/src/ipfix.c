@@ -186,7 +186,8 @@ static int ipfix_skip_idp_header(flow_record_t *nf_record,
                                  const unsigned char **payload,
                                  unsigned int *size_payload);
 
-static void ipfix_process_flow_record(flow_record_t *ix_record,
+static void ipfix_process_flow_record(joy_ctx_data *ctx,
+                                      flow_record_t *ix_record,
                                       const ipfix_template_t *cur_template,
                                       const char *flow_data,
                                       int record_num);
@@ -1072,9 +1073,9 @@ int ipfix_parse_data_set(joy_ctx_data *ctx,
                 /* Fill out record */
                 if ((memcmp_s(&key, sizeof(flow_key_t), prev_data_key, sizeof(flow_key_t), &ind) == EOK) 
                     && (ind != 0)) {
-                    ipfix_process_flow_record(ix_record, cur_template, (const char*)data_ptr, 0);
+                    ipfix_process_flow_record(ctx, ix_record, cur_template, (const char*)data_ptr, 0);
                 } else {
-                    ipfix_process_flow_record(ix_record, cur_template, (const char*)data_ptr, 1);
+                    ipfix_process_flow_record(ctx, ix_record, cur_template, (const char*)data_ptr, 1);
                 }
                 memcpy_s(prev_data_key, sizeof(flow_key_t), &key, sizeof(flow_key_t));
 
@@ -1298,7 +1299,8 @@ static int ipfix_process_flow_time_micro(const void *flow_data,
  * @param data_length Length in octets of the data.
  * @param element_length Length in octets of each element.
  */
-static void ipfix_process_byte_distribution(flow_record_t *ix_record,
+static void ipfix_process_byte_distribution(joy_ctx_data *ctx,
+                                            flow_record_t *ix_record,
                                             const char *data,
                                             uint16_t data_length,
                                             uint16_t element_length) {
@@ -1308,8 +1310,11 @@ static void ipfix_process_byte_distribution(flow_record_t *ix_record,
         loginfo("api-error: expecting element_length == 2");
         return;
     }
+    if (flow_record_byte_count(ctx, ix_record) == NULL) {
+        return;
+    }
     
-    while (data_length > 0) {
+    while (data_length > 0 && i < 256) {
         ix_record->byte_count[i] = (uint16_t)ntohs(*(const uint16_t *)data);
         
         data += element_length;
@@ -1327,7 +1332,8 @@ static void ipfix_process_byte_distribution(flow_record_t *ix_record,
  * @param data_length Length in octets of the data.
  * @param element_length Length in octets of each element.
  */
-static void ipfix_process_spl(flow_record_t *ix_record,
+static void ipfix_process_spl(joy_ctx_data *ctx,
+                              flow_record_t *ix_record,
                               const char *data,
                               uint16_t data_length,
                               uint16_t element_length) {
@@ -1346,6 +1352,7 @@ static void ipfix_process_spl(flow_record_t *ix_record,
      */
     splt_pkt_index = ix_record->op;
     pkt_len_index = splt_pkt_index;
+    flow_record_reserve_pkts(ctx, ix_record, MAX_NUM_PKT_LEN);
     
     while (data_length > 0) {
         int16_t packet_length = (int16_t)ntohs(*(const int16_t *)data);
@@ -1355,7 +1362,7 @@ static void ipfix_process_spl(flow_record_t *ix_record,
             if (packet_length > 0) {
                 ix_record->op += 1;
             }
-            if (pkt_len_index < MAX_NUM_PKT_LEN) {
+            if (pkt_len_index < ix_record->pkt_cap) {
                 ix_record->pkt_len[pkt_len_index] = packet_length;
                 ix_record->ob += packet_length;
                 pkt_len_index++;
@@ -1371,7 +1378,7 @@ static void ipfix_process_spl(flow_record_t *ix_record,
             repeated_length = packet_length * -1;
             ix_record->op += repeated_length;
             for (i = 0; i < repeated_length; i++) {
-                if (pkt_len_index < MAX_NUM_PKT_LEN) {
+                if (pkt_len_index < ix_record->pkt_cap) {
                     ix_record->pkt_len[pkt_len_index] = old_value;
                     ix_record->ob += old_value;
                     pkt_len_index++;
@@ -1396,7 +1403,8 @@ static void ipfix_process_spl(flow_record_t *ix_record,
  * @param element_length Length in octets of each element.
  * @param hdr_length Length in octets of the basicList header.
  */
-static void ipfix_process_spt(flow_record_t *ix_record,
+static void ipfix_process_spt(joy_ctx_data *ctx,
+                              flow_record_t *ix_record,
                               const char *data,
                               uint16_t data_length,
                               uint16_t element_length,
@@ -1409,11 +1417,12 @@ static void ipfix_process_spt(flow_record_t *ix_record,
     memset_s(&previous_time, sizeof(struct timeval), 0, sizeof(struct timeval));
     
     pkt_time_index = splt_pkt_index;
+    flow_record_reserve_pkts(ctx, ix_record, MAX_NUM_PKT_LEN);
     
     /* Initialize the most recent previous time */
-    if (pkt_time_index > 0) {
-        previous_time.tv_sec = ix_record->pkt_time[pkt_time_index-1].tv_sec;
-        previous_time.tv_usec = ix_record->pkt_time[pkt_time_index-1].tv_usec;
+    if (pkt_time_index > 0 && pkt_time_index <= ix_record->pkt_cap) {
+        joy_time_delta_to_timeval(&ix_record->pkt_time_base,
+                                  ix_record->pkt_time[pkt_time_index-1], &previous_time);
     } else {
         previous_time.tv_sec = ix_record->start.tv_sec;
         previous_time.tv_usec = ix_record->start.tv_usec;
@@ -1428,8 +1437,9 @@ static void ipfix_process_spt(flow_record_t *ix_record,
         if (packet_length < 0) {
             int16_t repeated_length = packet_length * -1;
             while (repeated_length > 0) {
-                if (pkt_time_index < MAX_NUM_PKT_LEN) {
-                    ix_record->pkt_time[pkt_time_index] = previous_time;
+                if (pkt_time_index < ix_record->pkt_cap) {
+                    ix_record->pkt_time[pkt_time_index] =
+                        joy_time_delta(&ix_record->pkt_time_base, &previous_time);
                     pkt_time_index++;
                 } else {
                     break;
@@ -1443,7 +1453,7 @@ static void ipfix_process_spt(flow_record_t *ix_record,
          * Packet_time value represents the positive time delta between
          * the previous packet and the current packet.
          */
-        if (pkt_time_index < MAX_NUM_PKT_LEN) {
+        if (pkt_time_index < ix_record->pkt_cap) {
             previous_time.tv_sec += (time_t)(packet_time/1000);
             previous_time.tv_usec +=
                 (uint32_t)(packet_time - ((int)(packet_time/1000.0))*1000)*1000;
@@ -1458,7 +1468,8 @@ static void ipfix_process_spt(flow_record_t *ix_record,
                 previous_time.tv_usec %= 1000000;
             }
             
-            ix_record->pkt_time[pkt_time_index] = previous_time;
+            ix_record->pkt_time[pkt_time_index] =
+                joy_time_delta(&ix_record->pkt_time_base, &previous_time);
             pkt_time_index++;
         } else {
             break;
@@ -1524,13 +1535,16 @@ static void ipfix_process_tls_record_times(flow_record_t *ix_record,
 
     while (data_length > 0) {
         uint16_t value_time = ntohs(*((const uint16_t *)data));
-        ix_record->tls->times[i].tv_sec =
+        struct timeval ts;
+
+        ts.tv_sec =
             ((total_ms + value_time) + (ix_record->start.tv_sec * 1000)
              + (ix_record->start.tv_usec / 1000)) / 1000;
         
-        ix_record->tls->times[i].tv_usec =
+        ts.tv_usec =
             (((total_ms + value_time) + (ix_record->start.tv_sec * 1000)
               + (ix_record->start.tv_usec/1000)) % 1000) * 1000;
+        ix_record->tls->times[i] = joy_time_delta(&ix_record->tls->times_base, &ts);
         
         total_ms += value_time;
         
@@ -1698,7 +1712,8 @@ static void ipfix_process_tls_ext_types(flow_record_t *ix_record,
  * @param data Contains the basicList.
  * @param data_length Length in octets of the basicList.
  */
-static void ipfix_parse_basic_list(flow_record_t *ix_record,
+static void ipfix_parse_basic_list(joy_ctx_data *ctx,
+                                   flow_record_t *ix_record,
                                    const void *data,
                                    uint16_t data_length) {
     const char *ptr = data;
@@ -1723,17 +1738,17 @@ static void ipfix_parse_basic_list(flow_record_t *ix_record,
     
     switch (field_id) {
     case IPFIX_BYTE_DISTRIBUTION:
-        ipfix_process_byte_distribution(ix_record, ptr, remaining_length,
+        ipfix_process_byte_distribution(ctx, ix_record, ptr, remaining_length,
                                         element_length);
         break;
         
     case IPFIX_SEQUENCE_PACKET_LENGTHS:
-        ipfix_process_spl(ix_record, ptr, remaining_length,
+        ipfix_process_spl(ctx, ix_record, ptr, remaining_length,
                           element_length);
         break;
         
     case IPFIX_SEQUENCE_PACKET_TIMES:
-        ipfix_process_spt(ix_record, ptr, remaining_length,
+        ipfix_process_spt(ctx, ix_record, ptr, remaining_length,
                           element_length, hdr_length);
         break;
         
@@ -1781,6 +1796,7 @@ static void ipfix_parse_basic_list(flow_record_t *ix_record,
 /*
  * @brief Parse through the contents of an IPFIX Data Set.
  *
+ * @param ctx Context that the flow record belongs to.
  * @param ix_record IPFIX flow record being encoded.
  * @param cur_template IPFIX template used to interpret the data.
  * @param flow_data Flow data representing an IPFIX data record.
@@ -1788,7 +1804,8 @@ static void ipfix_parse_basic_list(flow_record_t *ix_record,
  *                   Use 0 for yes, otherwise no
  *
  */
-static void ipfix_process_flow_record(flow_record_t *ix_record,
+static void ipfix_process_flow_record(joy_ctx_data *ctx,
+                                      flow_record_t *ix_record,
                                       const ipfix_template_t *cur_template,
                                       const char *flow_data,
                                       int record_num) {
@@ -1929,7 +1946,7 @@ static void ipfix_process_flow_record(flow_record_t *ix_record,
             break;
 
         case IPFIX_BASIC_LIST:
-            ipfix_parse_basic_list(ix_record, flow_data, field_length);
+            ipfix_parse_basic_list(ctx, ix_record, flow_data, field_length);
             flow_ptr += field_length;
             break;
             
@@ -4376,6 +4393,11 @@ int ipfix_export_main(joy_ctx_data *ctx, const flow_record_t *fr_record) {
 
     int attach_code = 0;
 
+    /* the export templates only have room for IPv4 addresses */
+    if (fr_record->key.ipv6) {
+        return 0;
+    }
+
     /* Init the exporter for use, if not done already */
     if (gateway_export.socket == 0) {
         loginfo("error: IPFix export not initialized");
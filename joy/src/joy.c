@@ -91,6 +91,9 @@
 #include "ipfix.h"    /* IPFIX cleanup */
 #include "proto_identify.h"
 #include "pcap.h"
+#include "pkt_ring.h"   /* packet rings of the worker threads */
+#include "pcap_mmap.h"  /* memory mapped pcap file reader */
+#include "af_packet.h"  /* TPACKET_V3 live capture */
 #include "joy_api_private.h"
 
 /**
@@ -115,6 +118,7 @@ typedef enum joy_operating_mode_ {
 #define NUM_PACKETS_BETWEEN_STATS_OUTPUT 100000
 #endif
 #define MAX_RECORDS 2147483647
+#define AF_PACKET_POLL_MS 1000
 #define MAX_FILENAME_LEN 1024
 
 /*
@@ -122,11 +126,16 @@ typedef enum joy_operating_mode_ {
  */
 static joy_operating_mode_e joy_mode = MODE_NONE;
 static pcap_t *handle = NULL;
-static const char *filter_exp = "ip or vlan";
+static af_packet_t live_sock;
+/* "vlan" moves the offsets of what follows it in a BPF filter, so it comes last */
+static const char *filter_exp = "ip or ip6 or mpls or vlan";
 static char dir_output[MAX_FILENAME_LEN];
 
 struct joy_ctx_data main_ctx;
 
+/* held while writing to an output that is shared by several threads */
+static pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /* config is the global configuration */
 struct configuration active_config;
 struct configuration *glb_config = NULL;
@@ -405,6 +414,234 @@ static unsigned int interface_list_get(void) {
  *************************************************************************
  */
 
+/*
+ * Live capture threads (afpacket=1 threads=N)
+ *
+ * Each thread reads from an AF_PACKET socket of its own.  The sockets
+ * are in one fanout group, and the kernel hashes both directions of a
+ * flow to the same socket, so each thread sees whole flows.  Each
+ * thread has a context of its own, and runs the same packet processing
+ * on it as the single threaded loop does, looking for expired flows
+ * after every block.  The main thread looks after the output file, which
+ * the threads share, writing a whole flow record at a time.
+ */
+typedef struct live_worker_ {
+    pthread_t thread;
+    struct joy_ctx_data ctx;
+    af_packet_t sock;
+} live_worker_t;
+
+static live_worker_t *live_workers = NULL;
+static unsigned int num_live_workers = 0;
+static volatile int live_workers_done = 0;
+
+/**
+ * \fn void capture_stats_update (joy_ctx_data *ctx, af_packet_t *sock)
+ * \brief copy the counters of the live capture into the stats of a context
+ * \param ctx the context
+ * \param sock the socket of the context, if it has one
+ * \return none
+ */
+static void capture_stats_update (joy_ctx_data *ctx, af_packet_t *sock) {
+    af_packet_stats_t as;
+    struct pcap_stat ps;
+
+    if (sock->map != NULL) {
+        af_packet_get_stats(sock, &as);
+        ctx->stats.capture_packets = as.packets;
+        ctx->stats.capture_drops = as.drops;
+        ctx->stats.capture_freezes = as.freezes;
+    } else if (handle && joy_mode == MODE_ONLINE && pcap_stats(handle, &ps) == 0) {
+        ctx->stats.capture_packets = ps.ps_recv;
+        ctx->stats.capture_drops = ps.ps_drop;
+    }
+}
+
+/**
+ * \fn void *live_worker_main (void *arg)
+ * \brief process the packets of a capture socket until the capture stops
+ * \param arg the worker
+ * \return NULL
+ */
+static void *live_worker_main (void *arg) {
+    live_worker_t *w = (live_worker_t *)arg;
+    unsigned long int num_packets;
+
+    while (!live_workers_done) {
+        num_packets = w->ctx.stats.num_packets;
+        if (af_packet_dispatch(&w->sock, AF_PACKET_POLL_MS, libpcap_process_packet,
+                               (unsigned char *)&w->ctx) < 0) {
+            joy_log_err("capture thread %u could not read from its socket", w->ctx.ctx_id);
+            break;
+        }
+
+        /* Periodically report on progress */
+        if (num_packets / NUM_PACKETS_BETWEEN_STATS_OUTPUT !=
+            w->ctx.stats.num_packets / NUM_PACKETS_BETWEEN_STATS_OUTPUT) {
+            capture_stats_update(&w->ctx, &w->sock);
+            pthread_mutex_lock(&output_lock);
+            flocap_stats_output(&w->ctx, info);
+            pthread_mutex_unlock(&output_lock);
+        }
+
+        /* Print out expired flows */
+        flow_record_list_print_json(&w->ctx, JOY_EXPIRED_FLOWS);
+    }
+
+    return NULL;
+}
+
+/**
+ * \fn int live_capture_open (const char *if_name)
+ * \brief open the capture socket, or one socket per thread with threads=N
+ * \param if_name interface to capture on
+ * \return 0 success, -1 failure
+ */
+static int live_capture_open (const char *if_name) {
+    unsigned int group, i;
+
+    if (glb_config->num_threads <= 1) {
+        if (af_packet_open(&live_sock, if_name, glb_config->afpacket_ring,
+                           glb_config->promisc, filter_exp, 0) != ok) {
+            fprintf(info, "error: could not open capture socket on %s\n", if_name);
+            return -1;
+        }
+        return 0;
+    }
+
+    live_workers = calloc(glb_config->num_threads, sizeof(live_worker_t));
+    if (live_workers == NULL) {
+        joy_log_err("out of memory");
+        return -1;
+    }
+
+    /* fanout groups are system wide, so use one that other processes are unlikely to */
+    group = getpid() & 0xffff;
+    if (group == 0) {
+        group = 1;
+    }
+    for (i = 0; i < glb_config->num_threads; i++) {
+        if (af_packet_open(&live_workers[i].sock, if_name, glb_config->afpacket_ring,
+                           glb_config->promisc, filter_exp, group) != ok) {
+            fprintf(info, "error: could not open capture socket %u on %s\n", i, if_name);
+            while (i--) {
+                af_packet_close(&live_workers[i].sock);
+            }
+            free(live_workers);
+            live_workers = NULL;
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * \fn int live_workers_start (void)
+ * \brief set up the contexts of the capture threads and start them
+ * \return 0 success, -1 failure
+ */
+static int live_workers_start (void) {
+    live_worker_t *w;
+    unsigned int i;
+    int rc = 0;
+#ifndef WIN32
+    sigset_t block, old;
+
+    /* the signals are handled by the main thread, which stops the others */
+    sigemptyset(&block);
+    sigaddset(&block, SIGINT);
+    sigaddset(&block, SIGTERM);
+    sigaddset(&block, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &block, &old);
+#endif
+
+    for (i = 0; i < glb_config->num_threads; i++) {
+        w = &live_workers[i];
+        w->ctx.ctx_id = i;
+        w->ctx.output = main_ctx.output;
+        w->ctx.output_lock = &output_lock;
+        flow_record_list_init(&w->ctx);
+        flocap_stats_timer_init(&w->ctx);
+        if (pthread_create(&w->thread, NULL, live_worker_main, w) != 0) {
+            joy_log_err("could not start capture thread %u", i);
+            flow_record_list_free(&w->ctx);
+            rc = -1;
+            break;
+        }
+        num_live_workers++;
+    }
+
+#ifndef WIN32
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+#endif
+
+    return rc;
+}
+
+/**
+ * \fn void live_workers_stop (void)
+ * \brief stop the capture threads, and print out all of their flows
+ * \return none
+ */
+static void live_workers_stop (void) {
+    live_worker_t *w;
+    unsigned int i;
+
+    if (live_workers == NULL) {
+        return;
+    }
+
+    live_workers_done = 1;
+    for (i = 0; i < num_live_workers; i++) {
+        pthread_join(live_workers[i].thread, NULL);
+    }
+    for (i = 0; i < glb_config->num_threads; i++) {
+        w = &live_workers[i];
+        if (i < num_live_workers) {
+            capture_stats_update(&w->ctx, &w->sock);
+            flocap_stats_output(&w->ctx, info);
+            flow_record_list_print_json(&w->ctx, JOY_ALL_FLOWS);
+            flow_record_list_free(&w->ctx);
+        }
+        af_packet_close(&w->sock);
+    }
+    free(live_workers);
+    live_workers = NULL;
+    num_live_workers = 0;
+}
+
+/**
+ * \fn unsigned int live_workers_records_in_file (void)
+ * \brief count the records that the capture threads wrote to the output
+ *        file; the output lock must be held
+ * \return number of records
+ */
+static unsigned int live_workers_records_in_file (void) {
+    unsigned int i, n = 0;
+
+    for (i = 0; i < num_live_workers; i++) {
+        n += live_workers[i].ctx.records_in_file;
+    }
+    return n;
+}
+
+/**
+ * \fn void live_workers_set_output (zfile output)
+ * \brief point the capture threads at a new output file; the output
+ *        lock must be held
+ * \param output the new output file
+ * \return none
+ */
+static void live_workers_set_output (zfile output) {
+    unsigned int i;
+
+    for (i = 0; i < num_live_workers; i++) {
+        live_workers[i].ctx.output = output;
+        live_workers[i].ctx.records_in_file = 0;
+    }
+}
+
 /*
  * sig_close() causes a graceful shutdown of the program after recieving 
  * an appropriate signal
@@ -418,6 +655,8 @@ __attribute__((__noreturn__)) static void sig_close (int signal_arg) {
     if (handle) {
       pcap_breakloop(handle);
     }
+    live_workers_stop();
+    capture_stats_update(&main_ctx, &live_sock);
     flocap_stats_output(&main_ctx,info);
     /*
      * flush remaining flow records, and print them even though they are
@@ -474,6 +713,56 @@ static int usage (char *s) {
            "  preemptive_timeout=1       For active flows, look at incoming packets timestamp to decide if\n"
            "                             adding that packet to the flow record will automatically time it out.\n"
            "                             Default=0\n"
+           "  flow_table_size=N          start with room for about N flows in the flow table; the table\n"
+           "                             grows as needed, and does not shrink below that size\n"
+           "                             Default=4096\n"
+           "  max_flows=N                keep at most N flow records per thread; past that, the least\n"
+           "                             recently active flows are evicted and output early, with\n"
+           "                             expire_type \"e\"; records waiting for the writer count too,\n"
+           "                             and with backpressure=drop or spill, new flows are refused\n"
+           "                             while those fill the budget\n"
+           "                             Default=0 (no limit)\n"
+           "  admission=1                create flow records only for flows whose second packet is seen\n"
+           "                             (or that answer a known flow), so that scans do not fill the\n"
+           "                             flow table; the first packet of other flows is not counted\n"
+           "                             Default=0\n"
+           "  dedup=N                    drop packets that are exact copies of one seen less than N\n"
+           "                             microseconds before, as SPAN ports and taps deliver them\n"
+           "                             Default=0 (off)\n"
+           "  writer_queue=N             format, compress and write flow records on a thread of their own,\n"
+           "                             which takes them from a queue of N records\n"
+           "                             Default=0 (records are written by the packet thread)\n"
+           "  backpressure=P             what to do with a record when the writer's queue is full: block\n"
+           "                             (wait for the writer), drop (lose the record) or spill (hold it\n"
+           "                             in memory until there is room)\n"
+           "                             Default=block\n"
+           "  compress_threads=N         compress the output in blocks on N threads; each block is a gzip\n"
+           "                             member of its own, and the members are written in order\n"
+           "                             Default=0 (one gzip stream, compressed by the writing thread)\n"
+           "  compress_level=L           compress the output with zlib level L, 1 (fastest) to 9 (smallest)\n"
+           "                             Default=0 (the zlib default, 6)\n"
+           "  format=F                   write flow records as json, or as compact binary records that\n"
+           "                             joybin2json converts back, or as arrow, an Apache Arrow IPC\n"
+           "                             stream of column chunks that pyarrow loads into a data frame;\n"
+           "                             binary records and arrow columns leave out subnet labels, TCP\n"
+           "                             options, exe, hd and os, and neither can be used with the\n"
+           "                             feature modules (dns, tls, http, ...)\n"
+           "                             Default=json\n"
+           "  hugepages=1                allocate flow records and feature state from pools backed by\n"
+           "                             huge pages (transparent huge pages if none are reserved)\n"
+           "                             Default=0\n"
+           "  threads=N                  process pcap files with N worker threads, each with its own\n"
+           "                             flow table; both directions of a flow go to the same worker;\n"
+           "                             with afpacket=1, capture on N sockets in a fanout group\n"
+           "                             Default=1\n"
+           "  jobs=N                     process up to N input files at the same time, largest first,\n"
+           "                             when each of them gets an output file of its own\n"
+           "                             Default=1\n"
+           "  afpacket=1                 capture live packets from a TPACKET_V3 ring (Linux only)\n"
+           "                             rather than with libpcap\n"
+           "                             Default=0\n"
+           "  afpacket_ring=N            give each capture ring N megabytes\n"
+           "                             Default=64\n"
            "  nfv9_port=N                enable Netflow V9 capture on port N\n" 
            "  ipfix_collect_port=N       enable IPFIX collector on port N\n"
            "  ipfix_collect_online=1     use an active UDP socket for IPFIX collector\n"
@@ -544,6 +833,31 @@ static int config_sanity_check(void) {
         return 1;
     }
 
+    if ((glb_config->num_threads > 1 || glb_config->num_jobs > 1) &&
+        (glb_config->nfv9_capture_port || glb_config->ipfix_collect_port || glb_config->ipfix_export_port)) {
+        /*
+         * NetFlow and IPFIX templates are shared by all flows, so they
+         * cannot be split up among worker threads
+         */
+        joy_log_crit("threads and jobs cannot be used with NetFlow V9 or IPFIX");
+        return 1;
+    }
+
+    if (glb_config->num_threads > 1 && glb_config->num_jobs > 1) {
+        joy_log_crit("threads and jobs cannot be used at the same time");
+        return 1;
+    }
+
+    if (glb_config->num_threads > 1 && glb_config->report_exe) {
+        /* the host flow data is gathered into the context of the main thread */
+        joy_log_crit("threads cannot be used with exe");
+        return 1;
+    }
+
+    if (config_check_format(glb_config) != ok) {
+        return 1;
+    }
+
     return 0;
 }
 
@@ -577,6 +891,30 @@ static int set_operating_mode(void) {
         joy_mode = MODE_OFFLINE;
     }
 
+#ifndef __linux__
+    if (glb_config->afpacket) {
+        joy_log_warn("afpacket=1 ignored, it is only available on Linux");
+        glb_config->afpacket = 0;
+    }
+#endif
+
+    if (joy_mode != MODE_ONLINE && glb_config->afpacket) {
+        joy_log_warn("afpacket=1 ignored, it only applies to live capture");
+        glb_config->afpacket = 0;
+    }
+
+    if (joy_mode != MODE_OFFLINE && glb_config->num_threads > 1 && !glb_config->afpacket) {
+        /* worker threads are only used for pcap files, and for fanout sockets */
+        joy_log_warn("threads=%u ignored, it only applies to pcap files and afpacket=1", glb_config->num_threads);
+        glb_config->num_threads = 1;
+    }
+
+    if (glb_config->num_jobs > 1 && (joy_mode != MODE_OFFLINE || !glb_config->filename)) {
+        /* files are only processed at the same time when they have outputs of their own */
+        joy_log_warn("jobs=%u ignored, it only applies to pcap files with output=F", glb_config->num_jobs);
+        glb_config->num_jobs = 1;
+    }
+
     return 0;
 }
 
@@ -653,6 +991,9 @@ static int initial_setup(char *config_file, unsigned int num_cmds) {
     /* Initialize the protocol identification module */
     if (proto_identify_init()) return 1;
 
+    /* Pick the packet pipeline for the configuration */
+    pkt_proc_set_pipeline(PKT_PIPELINE_AUTO);
+
     if (glb_config->show_config) {
         /* Print running configuration */
         config_print(info, glb_config);
@@ -729,7 +1070,7 @@ static int get_compact_bd(void) {
     fp = fopen(glb_config->compact_byte_distribution, "r");
     if (fp != NULL) {
         while (fscanf(fp, "%hu\t%hu", &b_value, &map_b_value) != EOF) {
-	    if (b_value < COMPACT_BD_MAP_MAX) {
+	    if (b_value < 256 && map_b_value < COMPACT_BD_MAP_MAX) {
                 glb_config->compact_bd_mapping[b_value] = map_b_value;
                 count++;
                 if (count >= 256) {
@@ -856,6 +1197,11 @@ static int open_interface (char **capture_if, char **capture_mac) {
         return -1;
     }
 
+    if (glb_config->afpacket) {
+        /* the capture sockets are opened along with the filter */
+        return 0;
+    }
+
     errbuf[0] = 0;
     handle = pcap_open_live(*capture_if, 65535, glb_config->promisc, 10000, errbuf);
     if (handle == NULL) {
@@ -995,6 +1341,375 @@ end:
     return rc;
 }
 
+/*
+ * Pcap files are read with the memory mapped reader of pcap_mmap.c
+ * when it can stand in for libpcap, which is for Ethernet captures
+ * with no filter other than the default one; libpcap reads the others.
+ */
+typedef struct joy_offline_ {
+    pcap_t *pcap;
+    pcap_mmap_t mm;
+} joy_offline_t;
+
+/**
+ * \fn int offline_open (joy_offline_t *in, const char *file_name, const char *filtr_exp,
+                          bpf_u_int32 *net, struct bpf_program *fp)
+ * \brief open a pcap file and set up its filter
+ * \param in the reader
+ * \param file_name name of the file with pcap data in it
+ * \param filtr_exp filter to use, or NULL
+ * \param net netmask for the filter
+ * \param fp compiled filter, if libpcap reads the file
+ * \return -1 could not open pcap file error
+ * \return -2 could not parse filter error
+ * \return -3 could not install filter
+ * \return 0 success
+ */
+static int offline_open (joy_offline_t *in, const char *file_name, const char *filtr_exp,
+                         bpf_u_int32 *net, struct bpf_program *fp) {
+    char errbuf[PCAP_ERRBUF_SIZE];
+
+    in->pcap = NULL;
+    if (filtr_exp == NULL || glb_config->bpf_filter_exp == NULL) {
+        if (pcap_mmap_open(&in->mm, file_name, filtr_exp != NULL) == ok) {
+            return 0;
+        }
+    }
+
+    in->pcap = pcap_open_offline(file_name, errbuf);
+    if (in->pcap == NULL) {
+        fprintf(stderr,"Couldn't open pcap file %s: %s\n", file_name, errbuf);
+        return -1;
+    }
+
+    if (filtr_exp) {
+
+        /* compile the filter expression */
+        if (pcap_compile(in->pcap, fp, filtr_exp, 0, *net) == -1) {
+            fprintf(stderr, "error: could not parse filter %s: %s\n",
+                    filtr_exp, pcap_geterr(in->pcap));
+            pcap_close(in->pcap);
+            return -2;
+        }
+
+        /* apply the compiled filter */
+        if (pcap_setfilter(in->pcap, fp) == -1) {
+            fprintf(stderr, "error: could not install filter %s: %s\n",
+                    filtr_exp, pcap_geterr(in->pcap));
+            pcap_freecode(fp);
+            pcap_close(in->pcap);
+            return -3;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * \fn int offline_dispatch (joy_offline_t *in, int cnt, pcap_handler callback, unsigned char *user)
+ * \brief hand the next cnt packets of a pcap file to callback, like pcap_dispatch()
+ */
+static int offline_dispatch (joy_offline_t *in, int cnt, pcap_handler callback, unsigned char *user) {
+    if (in->pcap) {
+        return pcap_dispatch(in->pcap, cnt, callback, user);
+    }
+    return pcap_mmap_dispatch(&in->mm, cnt, callback, user);
+}
+
+/*
+ * The memory mapped reader leaves its packets in place, so they are
+ * gathered into batches and their flow lookups overlapped with
+ * process_packet_prefetch().  Expired flows are still looked for after
+ * every NUM_PACKETS_IN_LOOP packets, as with libpcap, so the flows are
+ * split in the same way; hence a batch holds a multiple of that many.
+ */
+#define OFFLINE_BATCH_SIZE (PKT_BATCH_SIZE - PKT_BATCH_SIZE % NUM_PACKETS_IN_LOOP)
+
+typedef struct joy_batch_ {
+    unsigned int num_packets;
+    struct pcap_pkthdr headers[OFFLINE_BATCH_SIZE];
+    const unsigned char *packets[OFFLINE_BATCH_SIZE];
+    pkt_desc_t descs[OFFLINE_BATCH_SIZE];
+} joy_batch_t;
+
+/**
+ * \fn void batch_packet (unsigned char *arg, const struct pcap_pkthdr *header,
+                          const unsigned char *packet)
+ * \brief pcap callback that adds a packet to a batch
+ */
+static void batch_packet (unsigned char *arg, const struct pcap_pkthdr *header,
+                          const unsigned char *packet) {
+    joy_batch_t *batch = (joy_batch_t *)arg;
+
+    batch->headers[batch->num_packets] = *header;
+    batch->packets[batch->num_packets++] = packet;
+}
+
+/**
+ * \fn int offline_process (joy_offline_t *in, joy_ctx_data *ctx)
+ * \brief process the next packets of a pcap file, and print out the flows that expire
+ * \param in the reader
+ * \param ctx the context that processes the packets
+ * \return what offline_dispatch() does; 0 at the end of the file
+ */
+static int offline_process (joy_offline_t *in, joy_ctx_data *ctx) {
+    joy_batch_t batch;
+    unsigned int i;
+    int more;
+
+    if (in->pcap) {
+        /* libpcap reuses its buffer for the next packet */
+        more = offline_dispatch(in, NUM_PACKETS_IN_LOOP, libpcap_process_packet, (unsigned char *)ctx);
+        flow_record_list_print_json(ctx, JOY_EXPIRED_FLOWS);
+        return more;
+    }
+
+    batch.num_packets = 0;
+    more = offline_dispatch(in, OFFLINE_BATCH_SIZE, batch_packet, (unsigned char *)&batch);
+    process_packet_prefetch(ctx, batch.num_packets, batch.headers, batch.packets, batch.descs);
+    for (i = 0; i < batch.num_packets; i++) {
+        process_decoded_packet((unsigned char *)ctx, &batch.headers[i], batch.packets[i], &batch.descs[i]);
+        if ((i + 1) % NUM_PACKETS_IN_LOOP == 0) {
+            flow_record_list_print_json(ctx, JOY_EXPIRED_FLOWS);
+        }
+    }
+    if (batch.num_packets % NUM_PACKETS_IN_LOOP || batch.num_packets == 0) {
+        /* as after the last, partial batch of libpcap */
+        flow_record_list_print_json(ctx, JOY_EXPIRED_FLOWS);
+    }
+
+    return more;
+}
+
+/**
+ * \fn void offline_close (joy_offline_t *in, const char *filtr_exp, struct bpf_program *fp)
+ * \brief close a pcap file opened with offline_open()
+ */
+static void offline_close (joy_offline_t *in, const char *filtr_exp, struct bpf_program *fp) {
+    if (in->pcap) {
+        if (filtr_exp) {
+            pcap_freecode(fp);
+        }
+        pcap_close(in->pcap);
+        in->pcap = NULL;
+    } else {
+        pcap_mmap_close(&in->mm);
+    }
+}
+
+/*
+ * Input files processed at the same time (jobs=N)
+ *
+ * When every input file gets an output file of its own, the files do
+ * not depend on each other.  process_directory_of_files() and
+ * process_multiple_input_files() then only queue them, with the output
+ * file names they would have used, and file_jobs_run() has a pool of N
+ * threads work through the queue, largest file first.  Each file is
+ * processed in a context of its own.
+ */
+typedef struct joy_file_job_ {
+    char *input;
+    char *output;
+    uint64_t size;
+    unsigned int index;  /* position in the queue, for a stable order */
+    int rc;
+} joy_file_job_t;
+
+static joy_file_job_t *file_jobs = NULL;
+static unsigned int num_file_jobs = 0;
+static unsigned int max_file_jobs = 0;
+static unsigned int next_file_job = 0;
+static unsigned int file_jobs_failed = 0;
+static pthread_mutex_t file_jobs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * \fn int file_jobs_add (const char *input, const char *output)
+ * \brief queue an input file and the name of its output file
+ * \param input name of the pcap file
+ * \param output name of the output file
+ * \return 0 success, -1 out of memory
+ */
+static int file_jobs_add (const char *input, const char *output) {
+    joy_file_job_t *tmp, *job;
+    struct stat st;
+
+    if (num_file_jobs == max_file_jobs) {
+        tmp = realloc(file_jobs, (max_file_jobs * 2 + 16) * sizeof(joy_file_job_t));
+        if (tmp == NULL) {
+            joy_log_err("out of memory");
+            return -1;
+        }
+        file_jobs = tmp;
+        max_file_jobs = max_file_jobs * 2 + 16;
+    }
+
+    job = &file_jobs[num_file_jobs];
+    memset_s(job, sizeof(joy_file_job_t), 0x00, sizeof(joy_file_job_t));
+    job->input = strdup(input);
+    job->output = strdup(output);
+    if (job->input == NULL || job->output == NULL) {
+        joy_log_err("out of memory");
+        free(job->input);
+        free(job->output);
+        return -1;
+    }
+    if (stat(input, &st) == 0) {
+        job->size = (uint64_t)st.st_size;
+    }
+    job->index = num_file_jobs++;
+
+    return 0;
+}
+
+/**
+ * \brief Order file jobs by decreasing size, then by position in the queue.
+ */
+static int file_job_cmp (const void *a, const void *b) {
+    const joy_file_job_t *ja = (const joy_file_job_t *)a;
+    const joy_file_job_t *jb = (const joy_file_job_t *)b;
+
+    if (ja->size != jb->size) {
+        return (ja->size > jb->size) ? -1 : 1;
+    }
+    return (ja->index < jb->index) ? -1 : (ja->index > jb->index);
+}
+
+/**
+ * \fn int file_job_process (joy_file_job_t *job, unsigned int id)
+ * \brief process one queued file into its own output file, like
+ *        process_pcap_file() does for the main context
+ * \param job the file job
+ * \param id number of the thread that runs the job
+ * \return 0 success, negative number on the same errors as process_pcap_file()
+ */
+static int file_job_process (joy_file_job_t *job, unsigned int id) {
+    bpf_u_int32 net = PCAP_NETMASK_UNKNOWN;
+    struct bpf_program fp;
+    joy_offline_t in;
+    joy_ctx_data *ctx;
+    int more = 1;
+    int rc;
+
+    ctx = calloc(1, sizeof(joy_ctx_data));
+    if (ctx == NULL) {
+        joy_log_err("out of memory");
+        return -1;
+    }
+    ctx->ctx_id = id;
+    ctx->output = zopen(job->output, "w");
+    if (ctx->output == NULL) {
+        joy_log_err("could not open output file %s", job->output);
+        free(ctx);
+        return -1;
+    }
+    config_print_json(ctx->output, glb_config);
+    flow_record_list_init(ctx);
+    flocap_stats_timer_init(ctx);
+
+    joy_log_info("reading pcap file %s", job->input);
+    memset_s(&fp, sizeof(struct bpf_program), 0x00, sizeof(struct bpf_program));
+
+    rc = offline_open(&in, job->input, filter_exp, &net, &fp);
+    if (rc == 0) {
+        while (more) {
+            more = offline_process(&in, ctx);
+        }
+        joy_log_info("all flows processed for %s", job->input);
+        offline_close(&in, filter_exp, &fp);
+        flow_record_list_print_json(ctx, JOY_ALL_FLOWS);
+    }
+    flow_record_list_free(ctx);
+    zclose(ctx->output);
+    free(ctx);
+
+    return rc;
+}
+
+/**
+ * \fn void *file_jobs_worker (void *arg)
+ * \brief take jobs off the queue until it is empty or a job has failed
+ * \param arg number of the thread
+ * \return NULL
+ */
+static void *file_jobs_worker (void *arg) {
+    unsigned int id = (unsigned int)(uintptr_t)arg;
+    joy_file_job_t *job;
+
+    while (1) {
+        pthread_mutex_lock(&file_jobs_lock);
+        if (file_jobs_failed || next_file_job == num_file_jobs) {
+            pthread_mutex_unlock(&file_jobs_lock);
+            break;
+        }
+        job = &file_jobs[next_file_job++];
+        pthread_mutex_unlock(&file_jobs_lock);
+
+        job->rc = file_job_process(job, id);
+        if (job->rc < 0) {
+            pthread_mutex_lock(&file_jobs_lock);
+            file_jobs_failed = 1;
+            pthread_mutex_unlock(&file_jobs_lock);
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * \fn int file_jobs_run (void)
+ * \brief process all queued files, up to jobs=N of them at the same time
+ *
+ * The calling thread is one of the N.  Once a job fails, no new ones
+ * are started, and the error of the first failed job in queue order is
+ * returned, as if the files had been processed one after another.
+ *
+ * \return 0 success, negative number for processing error
+ */
+static int file_jobs_run (void) {
+    pthread_t threads[MAX_NUM_THREADS];
+    unsigned int num_threads = 0;
+    unsigned int i;
+    int rc = 0;
+    int first = -1;
+
+    if (num_file_jobs == 0) {
+        return 0;
+    }
+
+    qsort(file_jobs, num_file_jobs, sizeof(joy_file_job_t), file_job_cmp);
+    next_file_job = 0;
+    file_jobs_failed = 0;
+
+    while (num_threads + 1 < glb_config->num_jobs && num_threads + 1 < num_file_jobs) {
+        if (pthread_create(&threads[num_threads], NULL, file_jobs_worker,
+                           (void *)(uintptr_t)(num_threads + 1)) != 0) {
+            joy_log_warn("could only start %u threads for jobs", num_threads + 1);
+            break;
+        }
+        num_threads++;
+    }
+    file_jobs_worker((void *)(uintptr_t)0);
+    for (i = 0; i < num_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    for (i = 0; i < num_file_jobs; i++) {
+        if (file_jobs[i].rc < 0 && (first < 0 || file_jobs[i].index < file_jobs[first].index)) {
+            first = (int)i;
+        }
+        free(file_jobs[i].input);
+        free(file_jobs[i].output);
+    }
+    if (first >= 0) {
+        rc = file_jobs[first].rc;
+    }
+    free(file_jobs);
+    file_jobs = NULL;
+    num_file_jobs = max_file_jobs = 0;
+
+    return rc;
+}
+
 /**
  \fn int process_directory_of_files (char *input_directory, char *output_filename)
  \brief logic to handle a directory of input files
@@ -1052,11 +1767,10 @@ int process_directory_of_files (char *input_directory, char *output_filename) {
                 }
                 strcat_s(pcap_filename, MAX_FILENAME_LEN, ent->d_name);
 
-                /* open new output file for multi-file processing */
+                /* name of the output file for multi-file processing */
                 if (glb_config->filename) {
                     sprintf(dir_output, "%s\\%s_%d_json%s", output_filename, ent->d_name, fc_cnt, zsuffix);
                     ++fc_cnt;
-                    main_ctx.output = zopen(dir_output, "w");
                 }
 #else
                 if (pcap_filename[strlen(pcap_filename)-1] != '/') {
@@ -1064,13 +1778,26 @@ int process_directory_of_files (char *input_directory, char *output_filename) {
                 }
                 strcat(pcap_filename, ent->d_name);
 
-                /* open new output file for multi-file processing */
+                /* name of the output file for multi-file processing */
                 if (glb_config->filename) {
                     sprintf(dir_output, "%s/%s_%d_json%s", output_filename, ent->d_name, fc_cnt, zsuffix);
                     ++fc_cnt;
-                    main_ctx.output = zopen(dir_output, "w");
                 }
 #endif
+                /* with jobs=N, the file is processed later on, by file_jobs_run() */
+                if (glb_config->num_jobs > 1) {
+                    if (file_jobs_add(pcap_filename, dir_output)) {
+                        closedir(dir);
+                        return -1;
+                    }
+                    continue;
+                }
+
+                /* open new output file for multi-file processing */
+                if (glb_config->filename) {
+                    main_ctx.output = zopen(dir_output, "w");
+                }
+
                 /* initialize the outputfile and processing structures */
                 if (glb_config->filename) {
                     config_print_json(main_ctx.output, glb_config);
@@ -1171,6 +1898,11 @@ int process_multiple_input_files (char *input_filename, char *output_filename, i
     }
 #endif
 
+    /* with jobs=N, the file is processed later on, by file_jobs_run() */
+    if (glb_config->num_jobs > 1) {
+        return file_jobs_add(input_filename, dir_output);
+    }
+
     /* open new output file for multi-file processing */
     if (glb_config->filename) {
         main_ctx.output = zopen(dir_output, "w");
@@ -1392,8 +2124,14 @@ int main (int argc, char **argv) {
         signal(SIGHUP, sig_reload);
 #endif
 
+        if (glb_config->afpacket) {
+            /* open the capture sockets, with the filter, while we are still privileged */
+            if (live_capture_open(capture_if)) {
+                return -3;
+            }
+
         /* interface is already open, apply any filter expressions */
-        if (filter_exp) {
+        } else if (filter_exp) {
 
             /* compile the filter expression */
             if (pcap_compile(handle, &fp, filter_exp, 0, net) == -1) {
@@ -1492,15 +2230,39 @@ int main (int argc, char **argv) {
          */ 
         config_print_json(main_ctx.output, glb_config);
 
+        if (live_workers && live_workers_start()) {
+            live_workers_stop();
+            return -8;
+        }
+
         while(1) {
-            /* 
-             * Loop over packets captured from interface.
-             */
-            pcap_loop(handle, NUM_PACKETS_IN_LOOP, libpcap_process_packet, (unsigned char*)&main_ctx);
+            unsigned long int num_packets = main_ctx.stats.num_packets;
+
+            if (live_workers) {
+                /*
+                 * The capture threads process the packets; look after
+                 * the output file now and then.
+                 */
+                sleep(1);
+            } else if (glb_config->afpacket) {
+                /*
+                 * Process the packets of the next block of the ring.
+                 */
+                if (af_packet_dispatch(&live_sock, AF_PACKET_POLL_MS, libpcap_process_packet,
+                                       (unsigned char*)&main_ctx) < 0) {
+                    fprintf(info, "error: could not read from capture socket\n");
+                    return -1;
+                }
+            } else {
+                /* 
+                 * Loop over packets captured from interface.
+                 */
+                pcap_loop(handle, NUM_PACKETS_IN_LOOP, libpcap_process_packet, (unsigned char*)&main_ctx);
+            }
       
             joy_log_info("PCAP processing loop done");
 
-            if (glb_config->report_exe) {
+            if (glb_config->report_exe && num_packets != main_ctx.stats.num_packets) {
                   /*
                    * periodically obtain host/process flow data
                    */ 
@@ -1509,14 +2271,30 @@ int main (int argc, char **argv) {
                   }
            }
 
-           /* Periodically report on progress */
-           if ((main_ctx.stats.num_packets % NUM_PACKETS_BETWEEN_STATS_OUTPUT) == 0) {
+           /*
+            * Periodically report on progress; a block of the ring holds
+            * any number of packets, so look for the count passing a
+            * multiple of NUM_PACKETS_BETWEEN_STATS_OUTPUT
+            */
+           if (num_packets / NUM_PACKETS_BETWEEN_STATS_OUTPUT != main_ctx.stats.num_packets / NUM_PACKETS_BETWEEN_STATS_OUTPUT) {
+                  capture_stats_update(&main_ctx, &live_sock);
                   flocap_stats_output(&main_ctx,info);
            }
 
            /* Print out expired flows */
            flow_record_list_print_json(&main_ctx, JOY_EXPIRED_FLOWS);
 
+           if (glb_config->max_records) {
+                  /* the records handed to the output writer count towards the file */
+                  flow_record_list_flush(&main_ctx);
+           }
+
+           if (live_workers) {
+                  /* the capture threads may be writing to the output, or to the log */
+                  pthread_mutex_lock(&output_lock);
+                  main_ctx.records_in_file = live_workers_records_in_file();
+           }
+
            if (glb_config->filename) {
     
                   /* rotate output file if needed */
@@ -1525,6 +2303,7 @@ int main (int argc, char **argv) {
                       /*
                        * write JSON postamble
                        */
+                      flow_record_list_flush_chunk(&main_ctx);
                       zclose(main_ctx.output);
                       if (glb_config->upload_servername) {
                           upload_file(output_filename);
@@ -1539,7 +2318,14 @@ int main (int argc, char **argv) {
                           perror("error: could not open output file");
                           return -1;
                       }
+                      if (glb_config->output_format != OUTPUT_FORMAT_JSON) {
+                          /* binary and Arrow files cannot be read without their header */
+                          config_print_json(main_ctx.output, glb_config);
+                      }
                       main_ctx.records_in_file = 0;
+                      if (live_workers) {
+                          live_workers_set_output(main_ctx.output);
+                      }
                   }
       
                   /*
@@ -1558,13 +2344,22 @@ int main (int argc, char **argv) {
                  return -1;
               }
            }
-        }
 
-        if (filter_exp) {
-            pcap_freecode(&fp);
+           if (live_workers) {
+                  pthread_mutex_unlock(&output_lock);
+           }
         }
 
-        pcap_close(handle);
+        if (glb_config->afpacket) {
+            live_workers_stop();
+            af_packet_close(&live_sock);
+        } else {
+            if (filter_exp) {
+                pcap_freecode(&fp);
+            }
+
+            pcap_close(handle);
+        }
  
 
     } else if (joy_mode == MODE_IPFIX_COLLECT_ONLINE) {
@@ -1616,6 +2411,7 @@ int main (int argc, char **argv) {
         /* close out the existing open output file and remove it */
         if (glb_config->filename) {
             zclose(main_ctx.output);
+            main_ctx.output = NULL;
             if (remove(output_filename) == -1) {
 		fprintf(stderr, "error:failed to remove %s\n", output_filename);
 		return -1;
@@ -1654,6 +2450,12 @@ int main (int argc, char **argv) {
                 }
             }
         }
+
+        /* process the files that were queued with jobs=N */
+        tmp_ret = file_jobs_run();
+        if (tmp_ret < 0) {
+            return tmp_ret;
+        }
     }
 
     if (joy_mode != MODE_OFFLINE) {
@@ -1680,6 +2482,179 @@ int main (int argc, char **argv) {
 }
 
 
+/*
+ * Worker threads for pcap files (threads=N)
+ *
+ * The main thread reads the pcap file and hashes every packet to one of
+ * the workers, which gets a copy of the packet through its packet ring.
+ * Each worker has a context of its own, and runs the same packet
+ * processing on it as the single threaded loop does.  Expired flows are
+ * looked for at the same points in the capture as in that loop: after
+ * every NUM_PACKETS_IN_LOOP packets, and after the last packet, all of
+ * the workers get the capture time as a tick (if it has moved on), so
+ * the workers split flows just like the single threaded loop.
+ * The workers write to the same output, a whole flow record at a time.
+ */
+typedef struct joy_worker_ {
+    pthread_t thread;
+    struct joy_ctx_data ctx;
+    pkt_ring_t ring;
+} joy_worker_t;
+
+static joy_worker_t *workers = NULL;
+
+/* state of the reader: packets read, latest capture time, time of the last sweep */
+static unsigned long int workers_packets = 0;
+static struct timeval workers_time;
+static struct timeval workers_sweep;
+
+/**
+ * \fn void *worker_main (void *arg)
+ * \brief process the packets of a worker until its ring is closed
+ * \param arg the worker
+ * \return NULL
+ */
+static void *worker_main (void *arg) {
+    joy_worker_t *w = (joy_worker_t *)arg;
+    const pkt_ring_entry_t *e;
+    struct pcap_pkthdr header;
+    unsigned long int num_packets = 0;
+
+    while ((e = pkt_ring_peek(&w->ring)) != NULL) {
+        if (e->flags & PKT_RING_TICK) {
+            /* the capture has moved on; flows of this worker may have expired */
+            if (joy_timer_lt(&w->ctx.global_time, &e->ts)) {
+                w->ctx.global_time = e->ts;
+            }
+            pkt_ring_pop(&w->ring);
+            flow_record_list_print_json(&w->ctx, JOY_EXPIRED_FLOWS);
+            continue;
+        }
+
+        header.ts = e->ts;
+        header.caplen = e->caplen;
+        header.len = e->len;
+        process_decoded_packet((unsigned char *)&w->ctx, &header, pkt_ring_entry_data(e), &e->desc);
+        pkt_ring_pop(&w->ring);
+        num_packets++;
+    }
+
+    flow_record_list_print_json(&w->ctx, JOY_ALL_FLOWS);
+    flow_record_list_free(&w->ctx);
+    joy_log_info("worker %u processed %lu packets, reader waited %llu times",
+                 w->ctx.ctx_id, num_packets, (unsigned long long)w->ring.num_waits);
+
+    return NULL;
+}
+
+/**
+ * \fn void workers_stop (unsigned int num_workers)
+ * \brief let the workers finish their packets and flows, and wait for them
+ * \param num_workers number of workers that were started
+ * \return none
+ */
+static void workers_stop (unsigned int num_workers) {
+    unsigned int i;
+
+    for (i = 0; i < num_workers; i++) {
+        pkt_ring_close(&workers[i].ring);
+    }
+    for (i = 0; i < num_workers; i++) {
+        pthread_join(workers[i].thread, NULL);
+        pkt_ring_destroy(&workers[i].ring);
+    }
+}
+
+/**
+ * \fn int workers_start (void)
+ * \brief set up the contexts of the workers and start their threads
+ * \return 0 success, -1 failure
+ */
+static int workers_start (void) {
+    joy_worker_t *w;
+    unsigned int i;
+
+    if (workers == NULL) {
+        workers = calloc(glb_config->num_threads, sizeof(joy_worker_t));
+        if (workers == NULL) {
+            joy_log_err("out of memory");
+            return -1;
+        }
+    }
+    workers_packets = 0;
+    memset_s(&workers_time, sizeof(struct timeval), 0x00, sizeof(struct timeval));
+    memset_s(&workers_sweep, sizeof(struct timeval), 0x00, sizeof(struct timeval));
+
+    for (i = 0; i < glb_config->num_threads; i++) {
+        w = &workers[i];
+        w->ctx.ctx_id = i;
+        w->ctx.output = main_ctx.output;
+        w->ctx.output_lock = &output_lock;
+        if (pkt_ring_init(&w->ring, PKT_RING_SIZE) != ok) {
+            workers_stop(i);
+            return -1;
+        }
+        flow_record_list_init(&w->ctx);
+        flocap_stats_timer_init(&w->ctx);
+        if (pthread_create(&w->thread, NULL, worker_main, w) != 0) {
+            joy_log_err("could not start worker thread %u", i);
+            flow_record_list_free(&w->ctx);
+            pkt_ring_destroy(&w->ring);
+            workers_stop(i);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * \fn void workers_tick (void)
+ * \brief if capture time has moved on since the last sweep, tell all of the workers
+ * \return none
+ */
+static void workers_tick (void) {
+    unsigned int i;
+
+    if (joy_timer_lt(&workers_sweep, &workers_time)) {
+        for (i = 0; i < glb_config->num_threads; i++) {
+            pkt_ring_push_tick(&workers[i].ring, &workers_time);
+        }
+    }
+    workers_sweep = workers_time;
+}
+
+/**
+ * \fn void shard_packet (unsigned char *arg, const struct pcap_pkthdr *header,
+                          const unsigned char *packet)
+ * \brief pcap callback that hands a packet to the worker of its flow
+ * \param arg unused
+ * \param header pcap header of the packet
+ * \param packet the packet
+ * \return none
+ */
+static void shard_packet (unsigned char *arg, const struct pcap_pkthdr *header,
+                          const unsigned char *packet) {
+    pkt_desc_t desc;
+    int shard;
+
+    (void)arg;
+    decode_packet(packet, header->caplen, &desc);
+    shard = get_packet_shard(&desc, glb_config->num_threads);
+    pkt_ring_push(&workers[shard < 0 ? 0 : shard].ring, header, packet, &desc);
+
+    /* like process_packet(), only count the time of packets that are part of a flow */
+    if (shard >= 0 && joy_timer_lt(&workers_time, &header->ts)) {
+        workers_time = header->ts;
+    }
+    if (++workers_packets % NUM_PACKETS_IN_LOOP) {
+        return;
+    }
+
+    /* the single threaded loop would look for expired flows here */
+    workers_tick();
+}
+
 /**
  * \fn int process_pcap_file (char *file_name, char *filter_exp, bpf_u_int32 *net, struct bpf_program *fp)
  * \brief process pcap packet data from a given file
@@ -1690,52 +2665,57 @@ int main (int argc, char **argv) {
  * \return -1 could not open pcap file error
  * \return -2 could not parse filter error
  * \return -3 could not install filter
+ * \return -4 could not start the worker threads
  * \return 0 success
  */
 int process_pcap_file (char *file_name, const char *filtr_exp, bpf_u_int32 *net, struct bpf_program *fp) {
-    char errbuf[PCAP_ERRBUF_SIZE]; 
+    joy_offline_t in;
     int more = 1;
+    int rc;
 
     joy_log_info("reading pcap file %s", file_name);
 
-    handle = pcap_open_offline(file_name, errbuf);    
-    if (handle == NULL) { 
-        fprintf(stderr,"Couldn't open pcap file %s: %s\n", file_name, errbuf); 
-        return -1;
-    }   
-    
-    if (filtr_exp) {
-      
-        /* compile the filter expression */
-        if (pcap_compile(handle, fp, filtr_exp, 0, *net) == -1) {
-            fprintf(stderr, "error: could not parse filter %s: %s\n",
-                    filtr_exp, pcap_geterr(handle));
-            return -2;
+    rc = offline_open(&in, file_name, filtr_exp, net, fp);
+    if (rc < 0) {
+        return rc;
+    }
+    /* lets a signal break the loop, when libpcap reads the file */
+    handle = in.pcap;
+
+    if (glb_config->num_threads > 1) {
+        if (workers_start()) {
+            offline_close(&in, filtr_exp, fp);
+            handle = NULL;
+            return -4;
         }
-    
-        /* apply the compiled filter */
-        if (pcap_setfilter(handle, fp) == -1) {
-            fprintf(stderr, "error: could not install filter %s: %s\n",
-                    filtr_exp, pcap_geterr(handle));
-            return -3;
+
+        /* Hand all packets in capture file to the workers */
+        while (more) {
+            more = offline_dispatch(&in, GET_ALL_PACKETS, shard_packet, NULL);
         }
+        /* as after the last, partial batch of the single threaded loop */
+        workers_tick();
+
+        /* The workers print and free their flows as they finish */
+        workers_stop(glb_config->num_threads);
+
+        joy_log_info("all flows processed");
+        offline_close(&in, filtr_exp, fp);
+        handle = NULL;
+
+        return 0;
     }
-  
+
     while (more) {
-        /* Loop over all packets in capture file */
-        more = pcap_dispatch(handle, NUM_PACKETS_IN_LOOP, libpcap_process_packet, (unsigned char *)&main_ctx);
-        /* Print out expired flows */
-        flow_record_list_print_json(&main_ctx, JOY_EXPIRED_FLOWS);
+        /* Loop over all packets in capture file, printing out expired flows */
+        more = offline_process(&in, &main_ctx);
     }
 
     joy_log_info("all flows processed");
   
     /* Cleanup */
-    if (filtr_exp) {
-        pcap_freecode(fp);
-    }
-  
-    pcap_close(handle);
+    offline_close(&in, filtr_exp, fp);
+    handle = NULL;
   
     flow_record_list_print_json(&main_ctx, JOY_ALL_FLOWS);
     flow_record_list_free(&main_ctx);
@@ -112,11 +112,14 @@ static unsigned int joy_splt_format_data(flow_record_t *rec,
     unsigned int entries_used = 0;
     unsigned int num_of_pkts = 0;
     unsigned int data_len = 0;
-    struct timeval ts;
+    int64_t ipt;
     uint16_t *formatted_data = (uint16_t*)data;
 
     /* see how many packets we have to process - max is MAX_NFV9_SPLT_SALT_PKTS */
-    num_of_pkts = (rec->op < MAX_NFV9_SPLT_SALT_PKTS) ? rec->op : MAX_NFV9_SPLT_SALT_PKTS;
+    num_of_pkts = flow_record_num_pkts(rec);
+    if (num_of_pkts > MAX_NFV9_SPLT_SALT_PKTS) {
+        num_of_pkts = MAX_NFV9_SPLT_SALT_PKTS;
+    }
 
     /* figure out the length of the data we are formatting */
     if (export_frmt == JOY_NFV9_EXPORT) {
@@ -144,12 +147,12 @@ static unsigned int joy_splt_format_data(flow_record_t *rec,
         /* loop through the SPLT times and store appropriately */
         for (i=0; i < num_of_pkts; ++i) {
             if (i > 0) {
-                joy_timer_sub(&rec->pkt_time[i], &rec->pkt_time[i-1], &ts);
+                ipt = (int64_t)rec->pkt_time[i] - rec->pkt_time[i-1];
             } else {
-                joy_timer_sub(&rec->pkt_time[i], &rec->start, &ts);
+                ipt = joy_time_delta_to_usec(&rec->pkt_time_base, rec->pkt_time[i]) - joy_timeval_to_usec(&rec->start);
             }
             *(formatted_data+MAX_NFV9_SPLT_SALT_PKTS+i) =
-                 (uint16_t)joy_timeval_to_milliseconds(ts);
+                 (uint16_t)joy_usec_to_milliseconds(ipt);
         }
 
         if (num_of_pkts < MAX_NFV9_SPLT_SALT_PKTS) {
@@ -172,12 +175,12 @@ static unsigned int joy_splt_format_data(flow_record_t *rec,
         /* loop through the SPLT times and store appropriately */
         for (i=0; i < num_of_pkts; ++i) {
             if (i > 0) {
-                joy_timer_sub(&rec->pkt_time[i], &rec->pkt_time[i-1], &ts);
+                ipt = (int64_t)rec->pkt_time[i] - rec->pkt_time[i-1];
             } else {
-                joy_timer_sub(&rec->pkt_time[i], &rec->start, &ts);
+                ipt = joy_time_delta_to_usec(&rec->pkt_time_base, rec->pkt_time[i]) - joy_timeval_to_usec(&rec->start);
             }
             *(formatted_data+entries_used+i) =
-                 (uint16_t)joy_timeval_to_milliseconds(ts);
+                 (uint16_t)joy_usec_to_milliseconds(ipt);
         }
     }
 
@@ -210,7 +213,7 @@ static unsigned int joy_salt_format_data(flow_record_t *rec,
     unsigned int entries_used = 0;
     unsigned int num_of_pkts = 0;
     unsigned int data_len = 0;
-    struct timeval ts;
+    int64_t ipt;
     uint16_t *formatted_data = (uint16_t*)data;
 
     /* sanity check SALT structure */
@@ -249,12 +252,12 @@ static unsigned int joy_salt_format_data(flow_record_t *rec,
         /* loop through the SALT times and store appropriately */
         for (i=0; i < num_of_pkts; ++i) {
             if (i > 0) {
-                joy_timer_sub(&rec->salt->pkt_time[i], &rec->salt->pkt_time[i-1], &ts);
+                ipt = (int64_t)rec->salt->pkt_time[i] - rec->salt->pkt_time[i-1];
             } else {
-                joy_timer_sub(&rec->salt->pkt_time[i], &rec->start, &ts);
+                ipt = joy_time_delta_to_usec(&rec->salt->pkt_time_base, rec->salt->pkt_time[i]) - joy_timeval_to_usec(&rec->start);
             }
             *(formatted_data+MAX_NFV9_SPLT_SALT_PKTS+i) =
-                 (uint16_t)joy_timeval_to_milliseconds(ts);
+                 (uint16_t)joy_usec_to_milliseconds(ipt);
         }
 
         /* see if we need to pad the time array */
@@ -278,12 +281,12 @@ static unsigned int joy_salt_format_data(flow_record_t *rec,
         /* loop through the SALT times and store appropriately */
         for (i=0; i < num_of_pkts; ++i) {
             if (i > 0) {
-                joy_timer_sub(&rec->salt->pkt_time[i], &rec->salt->pkt_time[i-1], &ts);
+                ipt = (int64_t)rec->salt->pkt_time[i] - rec->salt->pkt_time[i-1];
             } else {
-                joy_timer_sub(&rec->salt->pkt_time[i], &rec->start, &ts);
+                ipt = joy_time_delta_to_usec(&rec->salt->pkt_time_base, rec->salt->pkt_time[i]) - joy_timeval_to_usec(&rec->start);
             }
             *(formatted_data+entries_used+i) =
-                 (uint16_t)joy_timeval_to_milliseconds(ts);
+                 (uint16_t)joy_usec_to_milliseconds(ipt);
         }
     }
 
@@ -318,7 +321,7 @@ static unsigned int joy_bd_format_data(flow_record_t *rec, unsigned char *data)
 
     /* store the byte counts into the data buffer */
     for (i=0; i < MAX_BYTE_COUNT_ARRAY_LENGTH; ++i) {
-        *(formatted_data+i) = (uint16_t)rec->byte_count[i];
+        *(formatted_data+i) = rec->byte_count ? (uint16_t)rec->byte_count[i] : 0;
     }
 
     return data_len;
@@ -433,6 +436,34 @@ int joy_initialize(joy_init_t *init_data,
         glb_config->num_pkts = init_data->num_pkts;
     }
 
+    /* setup the initial flow table capacity */
+    if (init_data->flow_table_size > FLOW_TABLE_MAX_CAPACITY) {
+        glb_config->flow_table_size = FLOW_TABLE_MAX_CAPACITY;
+    } else {
+        glb_config->flow_table_size = init_data->flow_table_size;
+    }
+    if (init_data->max_flows > FLOW_TABLE_MAX_CAPACITY) {
+        glb_config->max_flows = FLOW_TABLE_MAX_CAPACITY;
+    } else {
+        glb_config->max_flows = init_data->max_flows;
+    }
+    glb_config->dedup = init_data->dedup;
+    glb_config->writer_queue = init_data->writer_queue;
+    glb_config->backpressure = init_data->backpressure;
+    glb_config->compress_threads = init_data->compress_threads;
+    if (init_data->compress_level > 9) {
+        glb_config->compress_level = 9;
+    } else {
+        glb_config->compress_level = init_data->compress_level;
+    }
+    if (init_data->output_format == OUTPUT_FORMAT_BINARY) {
+        glb_config->output_format = OUTPUT_FORMAT_BINARY;
+    } else if (init_data->output_format == OUTPUT_FORMAT_ARROW) {
+        glb_config->output_format = OUTPUT_FORMAT_ARROW;
+    } else {
+        glb_config->output_format = OUTPUT_FORMAT_JSON;
+    }
+
     /* setup the inactive and active timeouts for a flow record */
     flow_record_update_timeouts(init_data->inact_timeout, init_data->act_timeout);
 
@@ -468,6 +499,14 @@ int joy_initialize(joy_init_t *init_data,
     glb_config->preemptive_timeout = ((init_data->bitmask & JOY_PREMPTIVE_TMO_ON) ? 1 : 0);
     glb_config->report_ppi = ((init_data->bitmask & JOY_PPI_ON) ? 1 : 0);
     glb_config->report_salt = ((init_data->bitmask & JOY_SALT_ON) ? 1 : 0);
+    glb_config->hugepages = ((init_data->bitmask & JOY_HUGEPAGES_ON) ? 1 : 0);
+    glb_config->admission = ((init_data->bitmask & JOY_ADMISSION_ON) ? 1 : 0);
+
+    /* binary records and arrow columns cannot carry the data of the feature modules */
+    if (config_check_format(glb_config) != ok) {
+        JOY_API_FREE_CONTEXT(ctx_data);
+        return failure;
+    }
 
     /* check if IDP option is set */
     if (init_data->bitmask & JOY_IDP_ON) {
@@ -507,6 +546,9 @@ int joy_initialize(joy_init_t *init_data,
         return failure;
     }
 
+    /* pick the packet pipeline for the configuration */
+    pkt_proc_set_pipeline(PKT_PIPELINE_AUTO);
+
     /* initialize all the data context structures */
     for (i=0; i < JOY_MAX_CTX_INDEX(ctx_data); ++i) {
         struct joy_ctx_data *this = JOY_CTX_AT_INDEX(ctx_data,i);
@@ -773,7 +815,7 @@ int joy_update_compact_bd(const char *filename)
     fp = fopen(filename, "r");
     if (fp != NULL) {
         while (fscanf(fp, "%hu\t%hu", &b_value, &map_b_value) != EOF) {
-	    if (b_value < COMPACT_BD_MAP_MAX) {
+	    if (b_value < 256 && map_b_value < COMPACT_BD_MAP_MAX) {
 		glb_config->compact_bd_mapping[b_value] = map_b_value;
 		count++;
 		if (count >= MAX_BYTE_COUNT_ARRAY_LENGTH) {
@@ -909,6 +951,84 @@ void joy_update_ctx_global_time(uint8_t ctx_index,
     ctx->global_time.tv_usec = new_time->tv_usec;
 }
 
+/* the library keeps a pkt_desc_t in the storage of a joy_packet_desc_t */
+typedef char joy_packet_desc_size_check[sizeof(pkt_desc_t) <= sizeof(joy_packet_desc_t) ? 1 : -1];
+
+#define JOY_PKT_DESC(d) ((pkt_desc_t *)(void *)(d)->opaque)
+#define JOY_CONST_PKT_DESC(d) ((const pkt_desc_t *)(const void *)(d)->opaque)
+
+/*
+ * Function: joy_decode_packet
+ *
+ * Description: This function decodes the headers of a packet once,
+ *      so that the result can be handed to both
+ *      joy_packet_desc_to_context() and joy_process_decoded_packet().
+ *      Ethernet with any number of VLAN tags and MPLS labels, and
+ *      IPv4 and IPv6 are understood.
+ *
+ * Parameters:
+ *      header - libpcap header of the packet, or NULL if the captured
+ *               length is not known
+ *      packet - pointer to the packet data
+ *      desc - filled in with the decoded packet
+ *
+ * Returns:
+ *      1 - success
+ *      0 - the packet is not part of any flow; desc still has to be
+ *          handed to joy_process_decoded_packet(), to count the packet
+ *
+ */
+int joy_decode_packet(const struct pcap_pkthdr *header,
+                      const unsigned char *packet,
+                      joy_packet_desc_t *desc)
+{
+    /* check library initialization */
+    if (!joy_library_initialized) {
+        joy_log_crit("Joy Library has not been initialized!");
+        return 0;
+    }
+
+    if (desc == NULL) {
+        joy_log_err("NULL packet descriptor");
+        return 0;
+    }
+    return decode_packet(packet, header ? header->caplen : PKT_DECODE_NO_CAPLEN, JOY_PKT_DESC(desc));
+}
+
+/*
+ * Function: joy_packet_desc_to_context
+ *
+ * Description: This function uses the 5-tuple of a packet decoded by
+ *      joy_decode_packet() to determine which context it should be
+ *      sent to for data feature processing.
+ *
+ * Parameters:
+ *      desc - the packet, as decoded by joy_decode_packet()
+ *      num_contexts - number of contexts to use for distribution
+ *
+ * Returns:
+ *      context - the context number the packet belongs to for JOY processing.
+ *          Bidirectional flows stay in the same context; packets that
+ *          are not part of any flow go to context 0.
+ *
+ */
+uint8_t joy_packet_desc_to_context(const joy_packet_desc_t *desc, uint8_t num_contexts) {
+    int context;
+
+    if (desc == NULL || num_contexts == 0) {
+        return 0;
+    }
+
+    context = get_packet_shard(JOY_CONST_PKT_DESC(desc), num_contexts);
+    if (context < 0) {
+        joy_log_err("Failed to retrieve the 5-tuple key, using default context 0");
+        return 0;
+    }
+
+    joy_log_debug("Packet goes into context (%d)", context);
+    return (uint8_t)context;
+}
+
 /*
  * Function: joy_packet_to_context
  *
@@ -918,6 +1038,9 @@ void joy_update_ctx_global_time(uint8_t ctx_index,
  *      that use the JOY library and want to use the libraries default
  *      scheme for dividing up traffic among various worker contexts.
  *
+ *      The packet is decoded here and again when it is processed;
+ *      joy_decode_packet() and joy_packet_desc_to_context() avoid that.
+ *
  * Parameters:
  *      packet - pointer to the IP packet data
  *      num_contexts - number of contexts to use for distribution
@@ -928,39 +1051,10 @@ void joy_update_ctx_global_time(uint8_t ctx_index,
  *
  */
 uint8_t joy_packet_to_context(const unsigned char *packet, uint8_t num_contexts) {
-    uint8_t rc = 0;
-    uint8_t context = 0;
-    unsigned int sum = 0;
-    flow_key_t key;
-
-    /* clear the key buffer */
-    memset_s(&key, sizeof(flow_key_t), 0x00, sizeof(flow_key_t));
+    joy_packet_desc_t desc;
 
-    /* get the 5-tuple key for this packet */
-    rc = get_packet_5tuple_key(packet, &key);
-    if (rc == 0) {
-        joy_log_err("Failed to retrieve the 5-tuple key, using default context 0");
-        return 0;
-    }
-
-    /* generate a nice hash to use for the 5-tuple. This calcualtion is essentially
-     * a mod 257 on the sum of the 5-tuple. This algortihm also keeps client->server and
-     * server->client flows in the same context.
-     */
-    sum += (unsigned int)key.sa.s_addr;
-    sum += (unsigned int)key.da.s_addr;
-    sum += (unsigned int)key.sp;
-    sum += (unsigned int)key.dp;
-    sum += (unsigned int)key.prot;
-    sum *= 0x6B;
-    sum -= (sum >> 8);
-    sum &= 0xff;
-
-    /* fit the mod 257 hash into the number of contexts configured */
-    context = sum % num_contexts;
-
-    joy_log_debug("Packet goes into context (%d)", context);
-    return context;
+    joy_decode_packet(NULL, packet, &desc);
+    return joy_packet_desc_to_context(&desc, num_contexts);
 }
 
 /*
@@ -995,6 +1089,39 @@ void* joy_process_packet(unsigned char *ctx_index,
                         const unsigned char *packet,
                         unsigned int app_data_len,
                         const unsigned char *app_data)
+{
+    joy_packet_desc_t desc;
+
+    joy_decode_packet(header, packet, &desc);
+    return joy_process_decoded_packet(ctx_index, header, packet, &desc, app_data_len, app_data);
+}
+
+/*
+ * Function: joy_process_decoded_packet
+ *
+ * Description: This function is joy_process_packet() for a packet
+ *      that joy_decode_packet() has decoded already, so that its
+ *      headers are not looked at again.
+ *
+ * Parameters:
+ *      ctx_index - index of the thread context to use
+ *      header - libpcap header which contains timestamp, cap length
+ *               and length
+ *      packet - the actual data packet
+ *      desc - the packet, as decoded by joy_decode_packet()
+ *      app_data_len - length of the application specific data
+ *      app_data - pointer to the application data
+ *
+ * Returns:
+ *      Pointer to the flow record
+ *
+ */
+void* joy_process_decoded_packet(unsigned char *ctx_index,
+                        const struct pcap_pkthdr *header,
+                        const unsigned char *packet,
+                        const joy_packet_desc_t *desc,
+                        unsigned int app_data_len,
+                        const unsigned char *app_data)
 {
     uint64_t index = 0;
     joy_ctx_data *ctx = NULL;
@@ -1017,9 +1144,14 @@ void* joy_process_packet(unsigned char *ctx_index,
         return NULL;
     }
 
+    if (desc == NULL) {
+        joy_log_err("NULL packet descriptor");
+        return NULL;
+    }
+
     /* process the packet */
     ctx = JOY_CTX_AT_INDEX(ctx_data,index);
-    record = process_packet((unsigned char*)ctx, header, packet);
+    record = process_decoded_packet((unsigned char*)ctx, header, packet, JOY_CONST_PKT_DESC(desc));
 
     /* see if there is any app data to store */
     if ((app_data_len == 0) || (app_data == NULL)) {
@@ -1105,6 +1237,57 @@ void joy_libpcap_process_packet(unsigned char *ctx_index,
     process_packet((unsigned char*)ctx, header, packet);
 }
 
+/*
+ * Function: joy_process_packet_batch
+ *
+ * Description: This function processes a vector of packets, such
+ *      as a poller hands over, in the order given.  The packets are
+ *      parsed and hashed first, and their flow table slots and flow
+ *      records are prefetched, before any of them is processed, so
+ *      that the cache misses of the flow lookups overlap.  The result
+ *      is the same as calling joy_libpcap_process_packet() for each
+ *      of the packets.
+ *
+ * Parameters:
+ *      ctx_index - index of the thread context to use
+ *      num_packets - number of packets in the vector
+ *      headers - array of num_packets libpcap headers, which contain
+ *               timestamp, cap length and length
+ *      packets - array of num_packets pointers to the packets
+ *
+ * Returns:
+ *      none
+ *
+ */
+void joy_process_packet_batch(unsigned char *ctx_index,
+                        unsigned int num_packets,
+                        const struct pcap_pkthdr *headers,
+                        const unsigned char *const *packets)
+{
+    uint64_t index = 0;
+    joy_ctx_data *ctx = NULL;
+
+    /* check library initialization */
+    if (!joy_library_initialized) {
+        joy_log_crit("Joy Library has not been initialized!");
+        return;
+    }
+
+    /* ctx_index has the int value of the data context
+     * This number is between 0 and max configured contexts
+     */
+    index = (uint64_t)ctx_index;
+
+    /* sanity check the index being used */
+    if (index >= joy_num_contexts ) {
+        joy_log_crit("Joy Library invalid context (%d) for packet processing!", (uint8_t)index);
+        return;
+    }
+
+    ctx = JOY_CTX_AT_INDEX(ctx_data,index);
+    process_packet_batch((unsigned char*)ctx, num_packets, headers, packets);
+}
+
 
 /*
  * Function: joy_print_flow_data
@@ -1159,9 +1342,11 @@ void joy_print_flow_data(uint8_t index, joy_flow_type_e type)
 
     /* see if we need to rotate the output files */
     if (glb_config->max_records) {
+        flow_record_list_flush(ctx);
         if (ctx->records_in_file >= glb_config->max_records) {
             char output_filename[MAX_FILENAME_LEN];
 
+            flow_record_list_flush_chunk(ctx);
             zclose(ctx->output);
             ctx->records_in_file = 0;
             memset_s(output_filename, MAX_FILENAME_LEN, 0x00, MAX_FILENAME_LEN);
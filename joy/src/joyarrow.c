@@ -0,0 +1,1309 @@
+/*
+ *
+ * Copyright (c) 2018 Cisco Systems, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials provided
+ *   with the distribution.
+ *
+ *   Neither the name of the Cisco Systems, Inc. nor the names of its
+ *   contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+/**
+ * \file joyarrow.c
+ *
+ * \brief flow records in column chunks, written as an Apache Arrow IPC stream
+ *
+ ** See joyarrow.h for the columns.  The messages of the stream are
+ *  put together here without the Arrow or FlatBuffers libraries: each
+ *  is a continuation marker, the length of its metadata, the metadata
+ *  as a FlatBuffer, and a body that holds the buffers of the columns,
+ *  each padded to 8 bytes.  The FlatBuffer builder below writes front
+ *  to back, so that a table comes before the strings, vectors and
+ *  tables that it points to, and the offsets to them are filled in
+ *  once they are written.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include "safe_lib.h"
+#include "joyarrow.h"
+
+/* external declaration of the file destinations */
+extern FILE *info;
+
+/* Arrow metadata version V5, and the message headers */
+#define ARROW_METADATA_V5          4
+#define ARROW_HEADER_SCHEMA        1
+#define ARROW_HEADER_DICTIONARY    2
+#define ARROW_HEADER_RECORD_BATCH  3
+
+/* Arrow types, as numbered in the Type union of Schema.fbs */
+#define ARROW_TYPE_INT             2
+#define ARROW_TYPE_FLOATING_POINT  3
+#define ARROW_TYPE_BINARY          4
+#define ARROW_TYPE_UTF8            5
+#define ARROW_TYPE_BOOL            6
+#define ARROW_TYPE_TIMESTAMP       10
+#define ARROW_TYPE_LIST            12
+#define ARROW_TYPE_FIXED_SIZE_LIST 16
+
+#define ARROW_PRECISION_DOUBLE     2
+#define ARROW_UNIT_MICROSECOND     2
+
+/* kinds of addresses, the first byte of a dictionary key */
+#define KEY_IPV4 0
+#define KEY_IPV6 1
+#define KEY_ANON 2
+
+/** columns, in the order in which they are in a chunk */
+enum {
+    COL_SA, COL_DA, COL_PR, COL_SP, COL_DP,
+    COL_BYTES_OUT, COL_NUM_PKTS_OUT, COL_BYTES_IN, COL_NUM_PKTS_IN,
+    COL_TIME_START, COL_TIME_END,
+    COL_PKT_LEN, COL_PKT_OUT, COL_PKT_IPT,
+    COL_BYTE_DIST, COL_BYTE_DIST_MEAN, COL_BYTE_DIST_STD, COL_COMPACT_BYTE_DIST,
+    COL_ENTROPY, COL_TOTAL_ENTROPY, COL_P_MALWARE,
+    COL_TTL_OUT, COL_TTL_IN, COL_IP_ID_OUT, COL_IP_ID_IN,
+    COL_FIRST_SEQ, COL_TCP_FLAGS_OUT, COL_TCP_FLAGS_IN, COL_WINDOW_OUT, COL_WINDOW_IN,
+    COL_IDP_OUT, COL_IDP_IN,
+    COL_TCP_RETRANS, COL_INVALID, COL_EXPIRE_TYPE
+};
+
+/** the columns; an integer of width 0 is a bool */
+static const struct {
+    const char *name;
+    joyarrow_type_e type;
+    unsigned int width;                    /* bytes of a value, or of an item of a list */
+    unsigned int is_signed;
+    unsigned int nullable;
+    unsigned int list_size;                /* items of a fixed size list */
+    unsigned int field;                    /* joybin_field_e bit that the column needs, or 0 */
+} joyarrow_columns[JOYARROW_MAX_COLUMNS] = {
+    { "sa", JOYARROW_DICT, 4, 1, 0, 0, 0 },
+    { "da", JOYARROW_DICT, 4, 1, 0, 0, 0 },
+    { "pr", JOYARROW_INT, 1, 0, 0, 0, 0 },
+    { "sp", JOYARROW_INT, 2, 0, 1, 0, 0 },
+    { "dp", JOYARROW_INT, 2, 0, 1, 0, 0 },
+    { "bytes_out", JOYARROW_INT, 4, 0, 0, 0, 0 },
+    { "num_pkts_out", JOYARROW_INT, 4, 0, 0, 0, 0 },
+    { "bytes_in", JOYARROW_INT, 4, 0, 1, 0, 0 },
+    { "num_pkts_in", JOYARROW_INT, 4, 0, 1, 0, 0 },
+    { "time_start", JOYARROW_TIMESTAMP, 8, 1, 0, 0, 0 },
+    { "time_end", JOYARROW_TIMESTAMP, 8, 1, 0, 0, 0 },
+    { "pkt_len", JOYARROW_LIST, 2, 1, 0, 0, 0 },
+    { "pkt_out", JOYARROW_LIST, 0, 0, 0, 0, 0 },
+    { "pkt_ipt", JOYARROW_LIST, 4, 0, 0, 0, 0 },
+    { "byte_dist", JOYARROW_FIXED_LIST, 1, 0, 0, 256, JOYBIN_BYTE_DIST },
+    { "byte_dist_mean", JOYARROW_DOUBLE, 8, 1, 1, 0, JOYBIN_BYTE_DIST },
+    { "byte_dist_std", JOYARROW_DOUBLE, 8, 1, 1, 0, JOYBIN_BYTE_DIST },
+    { "compact_byte_dist", JOYARROW_FIXED_LIST, 1, 0, 0, 16, JOYBIN_COMPACT_BYTE_DIST },
+    { "entropy", JOYARROW_DOUBLE, 8, 1, 1, 0, JOYBIN_ENTROPY },
+    { "total_entropy", JOYARROW_DOUBLE, 8, 1, 1, 0, JOYBIN_ENTROPY },
+    { "p_malware", JOYARROW_DOUBLE, 8, 1, 0, 0, JOYBIN_P_MALWARE },
+    { "ttl_out", JOYARROW_INT, 1, 0, 0, 0, 0 },
+    { "ttl_in", JOYARROW_INT, 1, 0, 1, 0, 0 },
+    { "ip_id_out", JOYARROW_LIST, 2, 0, 0, 0, 0 },
+    { "ip_id_in", JOYARROW_LIST, 2, 0, 1, 0, 0 },
+    { "first_seq", JOYARROW_INT, 4, 0, 1, 0, 0 },
+    { "tcp_flags_out", JOYARROW_INT, 1, 0, 1, 0, 0 },
+    { "tcp_flags_in", JOYARROW_INT, 1, 0, 1, 0, 0 },
+    { "window_out", JOYARROW_INT, 2, 0, 1, 0, 0 },
+    { "window_in", JOYARROW_INT, 2, 0, 1, 0, 0 },
+    { "idp_out", JOYARROW_BINARY, 1, 0, 1, 0, JOYBIN_IDP },
+    { "idp_in", JOYARROW_BINARY, 1, 0, 1, 0, JOYBIN_IDP },
+    { "tcp_retrans", JOYARROW_INT, 4, 0, 0, 0, 0 },
+    { "invalid", JOYARROW_INT, 4, 0, 0, 0, 0 },
+    { "expire_type", JOYARROW_UTF8, 1, 0, 1, 0, 0 }
+};
+
+/* most field nodes and buffers of a record batch */
+#define JOYARROW_MAX_NODES (2 * JOYARROW_MAX_COLUMNS)
+#define JOYARROW_MAX_BUFFERS (4 * JOYARROW_MAX_COLUMNS)
+
+/* the body of a record batch or dictionary batch, before it is written */
+typedef struct joyarrow_body_ {
+    unsigned int num_nodes;
+    unsigned int num_buffers;
+    int64_t node_length[JOYARROW_MAX_NODES];
+    int64_t node_nulls[JOYARROW_MAX_NODES];
+    const uint8_t *data[JOYARROW_MAX_BUFFERS];
+    size_t len[JOYARROW_MAX_BUFFERS];
+} joyarrow_body_t;
+
+static inline size_t pad8 (size_t len) {
+    return (len + 7) & ~(size_t)7;
+}
+
+static inline void put_le (uint8_t *p, uint64_t x, unsigned int width) {
+    unsigned int i;
+
+    for (i = 0; i < width; i++) {
+        p[i] = (uint8_t)(x >> (8 * i));
+    }
+}
+
+/*
+ * FlatBuffers.  Every write goes through fb_room(), which sets bad
+ * once there is no more room, so that only the end result has to be
+ * checked.
+ */
+
+typedef struct fb_ {
+    uint8_t *base;
+    size_t len;
+    size_t size;
+    int bad;
+} fb_t;
+
+/* a field of a table; absent if size is 0 */
+typedef struct fb_slot_ {
+    unsigned int size;                     /* 1, 2, 4 or 8 bytes */
+    uint64_t value;                        /* an offset is filled in with fb_set_offset() */
+    size_t pos;                            /* where the field went */
+} fb_slot_t;
+
+static uint8_t *fb_room (fb_t *fb, size_t len) {
+    uint8_t *p;
+
+    if (fb->bad || fb->size - fb->len < len) {
+        fb->bad = 1;
+        return NULL;
+    }
+    p = fb->base + fb->len;
+    memset_s(p, len, 0, len);
+    fb->len += len;
+    return p;
+}
+
+/* pad with zeros up to a position that is mod modulo align */
+static void fb_pad (fb_t *fb, size_t align, size_t mod) {
+    while (!fb->bad && fb->len % align != mod) {
+        fb_room(fb, 1);
+    }
+}
+
+/* point the offset at pos to target, which comes after it */
+static void fb_set_offset (fb_t *fb, size_t pos, size_t target) {
+    if (!fb->bad) {
+        put_le(fb->base + pos, target - pos, 4);
+    }
+}
+
+/* write a table, its vtable first; returns its position */
+static size_t fb_table (fb_t *fb, fb_slot_t *slot, unsigned int num_slots) {
+    static const unsigned int sizes[] = { 8, 4, 2, 1 };
+    unsigned int i, j, off = 4;
+    size_t vtable, table;
+    uint8_t *p;
+
+    /* the fields go largest first, the 8 byte ones right after the vtable offset */
+    fb_pad(fb, 2, 0);
+    vtable = fb->len;
+    p = fb_room(fb, 4 + 2 * num_slots);
+    for (j = 0; j < 4; j++) {
+        for (i = 0; i < num_slots; i++) {
+            if (slot[i].size == sizes[j]) {
+                if (p != NULL) {
+                    put_le(p + 4 + 2 * i, off, 2);
+                }
+                slot[i].pos = off;
+                off += slot[i].size;
+            }
+        }
+    }
+    if (p != NULL) {
+        put_le(p, 4 + 2 * num_slots, 2);
+        put_le(p + 2, off, 2);
+    }
+
+    fb_pad(fb, 8, 4);
+    table = fb->len;
+    p = fb_room(fb, off);
+    if (p == NULL) {
+        return 0;
+    }
+    put_le(p, table - vtable, 4);
+    for (i = 0; i < num_slots; i++) {
+        if (slot[i].size) {
+            put_le(p + slot[i].pos, slot[i].value, slot[i].size);
+            slot[i].pos += table;
+        }
+    }
+    return table;
+}
+
+/* write a string; returns its position */
+static size_t fb_string (fb_t *fb, const char *s, size_t len) {
+    size_t pos;
+    uint8_t *p;
+
+    fb_pad(fb, 4, 0);
+    pos = fb->len;
+    p = fb_room(fb, 4 + len + 1);
+    if (p != NULL) {
+        put_le(p, len, 4);
+        if (len) {
+            memcpy_s(p + 4, len + 1, s, len);
+        }
+    }
+    return pos;
+}
+
+/* write a vector of num elements of elem_size bytes, zeroed; returns its position */
+static size_t fb_vector (fb_t *fb, unsigned int num, size_t elem_size) {
+    size_t pos;
+    uint8_t *p;
+
+    /* elements of 8 bytes are aligned to 8, the length before them to 4 */
+    fb_pad(fb, elem_size == 8 || elem_size == 16 ? 8 : 4, elem_size == 8 || elem_size == 16 ? 4 : 0);
+    pos = fb->len;
+    p = fb_room(fb, 4 + num * elem_size);
+    if (p != NULL) {
+        put_le(p, num, 4);
+    }
+    return pos;
+}
+
+/* write a table of a type that has an int32 field, or no field if value is negative */
+static size_t fb_type_table (fb_t *fb, int value, unsigned int size) {
+    fb_slot_t slot[1] = {{0, 0, 0}};
+
+    if (value < 0) {
+        return fb_table(fb, slot, 0);
+    }
+    slot[0].size = size;
+    slot[0].value = (uint64_t)value;
+    return fb_table(fb, slot, 1);
+}
+
+/* write an Int type */
+static size_t fb_int_type (fb_t *fb, unsigned int bits, unsigned int is_signed) {
+    fb_slot_t slot[2] = {{0, 0, 0}};
+
+    slot[0].size = 4;
+    slot[0].value = bits;
+    slot[1].size = is_signed ? 1 : 0;
+    slot[1].value = 1;
+    return fb_table(fb, slot, 2);
+}
+
+/**
+ * \brief Write a Field of the schema, with its type and children.
+ * \param fb Builder
+ * \param name Name of the field
+ * \param nullable 1 if the field may be null
+ * \param type Type of the field; an integer of width 0 is a bool
+ * \param width Bytes of a value, or of an item of a list
+ * \param is_signed 1 for signed integers
+ * \param list_size Items of a fixed size list
+ * \param dict_id Id of the dictionary of a JOYARROW_DICT field
+ * \return position of the Field
+ */
+static size_t fb_field (fb_t *fb, const char *name, unsigned int nullable,
+                        joyarrow_type_e type, unsigned int width, unsigned int is_signed,
+                        unsigned int list_size, int64_t dict_id) {
+    enum { FIELD_NAME, FIELD_NULLABLE, FIELD_TYPE_TYPE, FIELD_TYPE, FIELD_DICTIONARY,
+           FIELD_CHILDREN, FIELD_NUM_SLOTS };
+    fb_slot_t slot[FIELD_NUM_SLOTS] = {{0, 0, 0}};
+    unsigned int type_id = 0;
+    size_t field, pos, children;
+
+    switch (type) {
+    case JOYARROW_INT:
+        type_id = width ? ARROW_TYPE_INT : ARROW_TYPE_BOOL;
+        break;
+    case JOYARROW_DOUBLE:
+        type_id = ARROW_TYPE_FLOATING_POINT;
+        break;
+    case JOYARROW_TIMESTAMP:
+        type_id = ARROW_TYPE_TIMESTAMP;
+        break;
+    case JOYARROW_UTF8:
+    case JOYARROW_DICT:
+        type_id = ARROW_TYPE_UTF8;
+        break;
+    case JOYARROW_BINARY:
+        type_id = ARROW_TYPE_BINARY;
+        break;
+    case JOYARROW_LIST:
+        type_id = ARROW_TYPE_LIST;
+        break;
+    case JOYARROW_FIXED_LIST:
+        type_id = ARROW_TYPE_FIXED_SIZE_LIST;
+        break;
+    default:
+        break;
+    }
+
+    slot[FIELD_NAME].size = 4;
+    slot[FIELD_NULLABLE].size = nullable ? 1 : 0;
+    slot[FIELD_NULLABLE].value = 1;
+    slot[FIELD_TYPE_TYPE].size = 1;
+    slot[FIELD_TYPE_TYPE].value = type_id;
+    slot[FIELD_TYPE].size = 4;
+    slot[FIELD_DICTIONARY].size = type == JOYARROW_DICT ? 4 : 0;
+    slot[FIELD_CHILDREN].size = 4;
+    field = fb_table(fb, slot, FIELD_NUM_SLOTS);
+
+    fb_set_offset(fb, slot[FIELD_NAME].pos, fb_string(fb, name, strlen(name)));
+
+    switch (type_id) {
+    case ARROW_TYPE_INT:
+        pos = fb_int_type(fb, width * 8, is_signed);
+        break;
+    case ARROW_TYPE_FLOATING_POINT:
+        pos = fb_type_table(fb, ARROW_PRECISION_DOUBLE, 2);
+        break;
+    case ARROW_TYPE_TIMESTAMP:
+        pos = fb_type_table(fb, ARROW_UNIT_MICROSECOND, 2);
+        break;
+    case ARROW_TYPE_FIXED_SIZE_LIST:
+        pos = fb_type_table(fb, (int)list_size, 4);
+        break;
+    default:
+        pos = fb_type_table(fb, -1, 0);
+        break;
+    }
+    fb_set_offset(fb, slot[FIELD_TYPE].pos, pos);
+
+    if (type == JOYARROW_DICT) {
+        fb_slot_t dict[2] = {{0, 0, 0}};
+
+        /* id, and int32 indices */
+        dict[0].size = 8;
+        dict[0].value = (uint64_t)dict_id;
+        dict[1].size = 4;
+        pos = fb_table(fb, dict, 2);
+        fb_set_offset(fb, slot[FIELD_DICTIONARY].pos, pos);
+        fb_set_offset(fb, dict[1].pos, fb_int_type(fb, 32, 1));
+    }
+
+    if (type == JOYARROW_LIST || type == JOYARROW_FIXED_LIST) {
+        children = fb_vector(fb, 1, 4);
+        fb_set_offset(fb, slot[FIELD_CHILDREN].pos, children);
+        pos = fb_field(fb, "item", 1, JOYARROW_INT, width, is_signed, 0, 0);
+        fb_set_offset(fb, children + 4, pos);
+    } else {
+        fb_set_offset(fb, slot[FIELD_CHILDREN].pos, fb_vector(fb, 0, 4));
+    }
+
+    return field;
+}
+
+/* write a KeyValue of the custom metadata */
+static size_t fb_key_value (fb_t *fb, const char *key, const char *value, size_t value_len) {
+    fb_slot_t slot[2] = {{0, 0, 0}};
+    size_t table;
+
+    slot[0].size = 4;
+    slot[1].size = 4;
+    table = fb_table(fb, slot, 2);
+    fb_set_offset(fb, slot[0].pos, fb_string(fb, key, strlen(key)));
+    fb_set_offset(fb, slot[1].pos, fb_string(fb, value, value_len));
+    return table;
+}
+
+/* start a message; returns the slot of its header, to point at the header table */
+static size_t fb_message (fb_t *fb, unsigned int header_type, size_t body_len) {
+    enum { MSG_VERSION, MSG_HEADER_TYPE, MSG_HEADER, MSG_BODY_LENGTH, MSG_NUM_SLOTS };
+    fb_slot_t slot[MSG_NUM_SLOTS] = {{0, 0, 0}};
+    size_t root;
+
+    root = fb->len;
+    fb_room(fb, 4);
+    slot[MSG_VERSION].size = 2;
+    slot[MSG_VERSION].value = ARROW_METADATA_V5;
+    slot[MSG_HEADER_TYPE].size = 1;
+    slot[MSG_HEADER_TYPE].value = header_type;
+    slot[MSG_HEADER].size = 4;
+    slot[MSG_BODY_LENGTH].size = 8;
+    slot[MSG_BODY_LENGTH].value = body_len;
+    fb_set_offset(fb, root, fb_table(fb, slot, MSG_NUM_SLOTS));
+    return slot[MSG_HEADER].pos;
+}
+
+/*
+ * Framing.  A message is the continuation marker, the length of its
+ * metadata, padded to 8 bytes, the metadata and the body.
+ */
+
+static void fb_init (fb_t *fb, uint8_t *buf, size_t size) {
+    fb->base = buf + 8;
+    fb->len = 0;
+    fb->size = size < 8 ? 0 : size - 8;
+    if (fb->size > JOYARROW_META_MAX) {
+        fb->size = JOYARROW_META_MAX;
+    }
+    fb->bad = 0;
+}
+
+/* end the metadata of a message and write its frame and body; returns its length, or 0 */
+static size_t fb_finish (fb_t *fb, uint8_t *buf, size_t size, const joyarrow_body_t *body) {
+    unsigned int i;
+    size_t len;
+    uint8_t *p;
+
+    fb_pad(fb, 8, 0);
+    if (fb->bad) {
+        return 0;
+    }
+    len = 8 + fb->len;
+    if (body != NULL) {
+        for (i = 0; i < body->num_buffers; i++) {
+            len += pad8(body->len[i]);
+        }
+    }
+    if (len > size) {
+        return 0;
+    }
+
+    put_le(buf, 0xffffffff, 4);
+    put_le(buf + 4, fb->len, 4);
+    p = buf + 8 + fb->len;
+    if (body != NULL) {
+        for (i = 0; i < body->num_buffers; i++) {
+            size_t pad = pad8(body->len[i]) - body->len[i];
+
+            if (body->len[i]) {
+                memcpy_s(p, body->len[i], body->data[i], body->len[i]);
+            }
+            if (pad) {
+                memset_s(p + body->len[i], pad, 0, pad);
+            }
+            p += pad8(body->len[i]);
+        }
+    }
+    return len;
+}
+
+/**
+ * \brief Encode the schema message that starts a stream.
+ * \param buf Where to encode it
+ * \param size Bytes of buf
+ * \param schema Schema of the flow records, for the optional columns and the omitted features
+ * \param config The configuration line, without its newline
+ * \param config_len Bytes of the configuration line
+ * \return length of the message, or 0 if size is too small
+ */
+size_t joyarrow_schema_encode (uint8_t *buf, size_t size, const joybin_schema_t *schema,
+                               const char *config, size_t config_len) {
+    char omitted[JOYBIN_MAX_OMITTED * JOYBIN_MAX_NAME];
+    size_t omitted_len = 0;
+    fb_slot_t slot[3] = {{0, 0, 0}};
+    size_t header, fields, metadata;
+    unsigned int i, num_fields = 0;
+    int64_t dict_id = 0;
+    fb_t fb;
+
+    for (i = 0; i < schema->num_omitted; i++) {
+        size_t len = strnlen_s(schema->omitted[i], JOYBIN_MAX_NAME);
+
+        if (i) {
+            omitted[omitted_len++] = ',';
+        }
+        memcpy_s(omitted + omitted_len, sizeof(omitted) - omitted_len, schema->omitted[i], len);
+        omitted_len += len;
+    }
+
+    for (i = 0; i < JOYARROW_MAX_COLUMNS; i++) {
+        if (!joyarrow_columns[i].field || (schema->fields & joyarrow_columns[i].field)) {
+            num_fields++;
+        }
+    }
+
+    fb_init(&fb, buf, size);
+    header = fb_message(&fb, ARROW_HEADER_SCHEMA, 0);
+
+    /* endianness is little, as it is by default; fields; custom_metadata */
+    slot[0].size = 0;
+    slot[1].size = 4;
+    slot[2].size = 4;
+    fb_set_offset(&fb, header, fb_table(&fb, slot, 3));
+
+    fields = fb_vector(&fb, num_fields, 4);
+    fb_set_offset(&fb, slot[1].pos, fields);
+    num_fields = 0;
+    for (i = 0; i < JOYARROW_MAX_COLUMNS; i++) {
+        if (!joyarrow_columns[i].field || (schema->fields & joyarrow_columns[i].field)) {
+            size_t field = fb_field(&fb, joyarrow_columns[i].name, joyarrow_columns[i].nullable,
+                                    joyarrow_columns[i].type, joyarrow_columns[i].width,
+                                    joyarrow_columns[i].is_signed, joyarrow_columns[i].list_size,
+                                    joyarrow_columns[i].type == JOYARROW_DICT ? dict_id++ : 0);
+            fb_set_offset(&fb, fields + 4 + 4 * num_fields++, field);
+        }
+    }
+
+    metadata = fb_vector(&fb, 2, 4);
+    fb_set_offset(&fb, slot[2].pos, metadata);
+    fb_set_offset(&fb, metadata + 4, fb_key_value(&fb, "config", config, config_len));
+    fb_set_offset(&fb, metadata + 8, fb_key_value(&fb, "omitted", omitted, omitted_len));
+
+    return fb_finish(&fb, buf, size, NULL);
+}
+
+/* write a RecordBatch table of length rows, with its nodes and buffers */
+static size_t fb_record_batch (fb_t *fb, int64_t length, const joyarrow_body_t *body) {
+    fb_slot_t slot[3] = {{0, 0, 0}};
+    size_t table, pos, off = 0;
+    unsigned int i;
+
+    slot[0].size = 8;
+    slot[0].value = (uint64_t)length;
+    slot[1].size = 4;
+    slot[2].size = 4;
+    table = fb_table(fb, slot, 3);
+
+    pos = fb_vector(fb, body->num_nodes, 16);
+    fb_set_offset(fb, slot[1].pos, pos);
+    for (i = 0; i < body->num_nodes && !fb->bad; i++) {
+        put_le(fb->base + pos + 4 + 16 * i, (uint64_t)body->node_length[i], 8);
+        put_le(fb->base + pos + 12 + 16 * i, (uint64_t)body->node_nulls[i], 8);
+    }
+
+    pos = fb_vector(fb, body->num_buffers, 16);
+    fb_set_offset(fb, slot[2].pos, pos);
+    for (i = 0; i < body->num_buffers && !fb->bad; i++) {
+        put_le(fb->base + pos + 4 + 16 * i, off, 8);
+        put_le(fb->base + pos + 12 + 16 * i, body->len[i], 8);
+        off += pad8(body->len[i]);
+    }
+    return table;
+}
+
+static size_t body_len (const joyarrow_body_t *body) {
+    size_t len = 0;
+    unsigned int i;
+
+    for (i = 0; i < body->num_buffers; i++) {
+        len += pad8(body->len[i]);
+    }
+    return len;
+}
+
+static void body_node (joyarrow_body_t *body, int64_t length, int64_t nulls) {
+    body->node_length[body->num_nodes] = length;
+    body->node_nulls[body->num_nodes] = nulls;
+    body->num_nodes++;
+}
+
+static void body_buffer (joyarrow_body_t *body, const uint8_t *data, size_t len) {
+    body->data[body->num_buffers] = data;
+    body->len[body->num_buffers] = len;
+    body->num_buffers++;
+}
+
+/*
+ * Columns
+ */
+
+static int buf_reserve (joyarrow_buf_t *b, size_t len) {
+    uint8_t *data;
+    size_t size;
+
+    if (b->size - b->len >= len) {
+        return 0;
+    }
+    size = b->size ? b->size : 1024;
+    while (size - b->len < len) {
+        size *= 2;
+    }
+    data = realloc(b->data, size);
+    if (data == NULL) {
+        return -1;
+    }
+    b->data = data;
+    b->size = size;
+    return 0;
+}
+
+static void buf_free (joyarrow_buf_t *b) {
+    free(b->data);
+    b->data = NULL;
+    b->len = b->size = 0;
+}
+
+/* empty a column, keeping its memory */
+static void column_reset (joyarrow_column_t *c) {
+    c->null_count = 0;
+    c->num_items = 0;
+    c->validity.len = 0;
+    c->values.len = 0;
+    c->offsets.len = 4;
+    memset_s(c->offsets.data, 4, 0, 4);
+    if (c->dict.slots != NULL) {
+        memset_s(c->dict.slots, JOYARROW_DICT_SLOTS * sizeof(uint32_t), 0,
+                 JOYARROW_DICT_SLOTS * sizeof(uint32_t));
+        c->dict.num_entries = 0;
+        c->dict.data.len = 0;
+        c->dict.offsets.len = 4;
+        memset_s(c->dict.offsets.data, 4, 0, 4);
+    }
+}
+
+static void column_free (joyarrow_column_t *c) {
+    buf_free(&c->validity);
+    buf_free(&c->offsets);
+    buf_free(&c->values);
+    free(c->dict.slots);
+    free(c->dict.keys);
+    buf_free(&c->dict.offsets);
+    buf_free(&c->dict.data);
+}
+
+/**
+ * \brief Allocate a chunk for the columns of a schema.
+ * \param schema Schema of the flow records
+ * \return the chunk, or NULL if there is no memory
+ */
+joyarrow_batch_t *joyarrow_batch_new (const joybin_schema_t *schema) {
+    joyarrow_batch_t *b;
+    unsigned int i;
+
+    b = calloc(1, sizeof(joyarrow_batch_t));
+    if (b == NULL) {
+        return NULL;
+    }
+    b->fields = schema->fields;
+    for (i = 0; i < JOYARROW_MAX_COLUMNS; i++) {
+        joyarrow_column_t *c = &b->columns[i];
+
+        if (joyarrow_columns[i].field && !(schema->fields & joyarrow_columns[i].field)) {
+            continue;
+        }
+        c->active = 1;
+        if (buf_reserve(&c->validity, JOYARROW_BATCH_ROWS / 8 + 1) ||
+            buf_reserve(&c->offsets, 4 * (JOYARROW_BATCH_ROWS + 1))) {
+            joyarrow_batch_free(b);
+            return NULL;
+        }
+        if (joyarrow_columns[i].type == JOYARROW_DICT) {
+            c->dict.slots = calloc(JOYARROW_DICT_SLOTS, sizeof(uint32_t));
+            c->dict.keys = malloc(JOYARROW_BATCH_ROWS * JOYARROW_KEY_LEN);
+            if (c->dict.slots == NULL || c->dict.keys == NULL ||
+                buf_reserve(&c->dict.offsets, 4 * (JOYARROW_BATCH_ROWS + 1))) {
+                joyarrow_batch_free(b);
+                return NULL;
+            }
+        }
+        column_reset(c);
+    }
+    return b;
+}
+
+/**
+ * \brief Free a chunk.
+ * \param b Chunk, or NULL
+ * \return none
+ */
+void joyarrow_batch_free (joyarrow_batch_t *b) {
+    unsigned int i;
+
+    if (b == NULL) {
+        return;
+    }
+    for (i = 0; i < JOYARROW_MAX_COLUMNS; i++) {
+        column_free(&b->columns[i]);
+    }
+    free(b);
+}
+
+/* items that a record adds to a column: list items, bytes, or 1 */
+static size_t row_items (unsigned int col, const joybin_record_t *rec) {
+    int twin = rec->flags & JOYBIN_TWIN;
+
+    switch (col) {
+    case COL_PKT_LEN:
+    case COL_PKT_OUT:
+    case COL_PKT_IPT:
+        return rec->num_pkts;
+    case COL_BYTE_DIST:
+    case COL_COMPACT_BYTE_DIST:
+        return joyarrow_columns[col].list_size;
+    case COL_IP_ID_OUT:
+        return rec->num_id_out;
+    case COL_IP_ID_IN:
+        return twin ? rec->num_id_in : 0;
+    case COL_IDP_OUT:
+        return (rec->flags & JOYBIN_IDP_OUT) ? rec->idp_len_out : 0;
+    case COL_IDP_IN:
+        return (rec->flags & JOYBIN_IDP_IN) ? rec->idp_len_in : 0;
+    case COL_EXPIRE_TYPE:
+        return rec->expire_type ? 1 : 0;
+    default:
+        return 1;
+    }
+}
+
+/* make room in a column for a row of items */
+static int column_reserve (joyarrow_column_t *c, unsigned int col, size_t items) {
+    size_t values;
+
+    if (joyarrow_columns[col].width) {
+        values = items * joyarrow_columns[col].width;
+    } else {
+        values = (c->num_items + items + 7) / 8 - c->values.len;
+    }
+    if (buf_reserve(&c->validity, 1) || buf_reserve(&c->offsets, 4) ||
+        buf_reserve(&c->values, values)) {
+        return -1;
+    }
+    if (joyarrow_columns[col].type == JOYARROW_DICT &&
+        (buf_reserve(&c->dict.offsets, 4) || buf_reserve(&c->dict.data, JOYBIN_ADDR_STRLEN))) {
+        return -1;
+    }
+    return 0;
+}
+
+/* set the validity bit of a row */
+static void column_row (joyarrow_column_t *c, unsigned int row, int valid) {
+    if (row % 8 == 0) {
+        c->validity.data[c->validity.len++] = 0;
+    }
+    if (valid) {
+        c->validity.data[row / 8] |= (uint8_t)(1 << (row % 8));
+    } else {
+        c->null_count++;
+    }
+}
+
+/* append an integer, a timestamp or a double's bits */
+static void column_value (joyarrow_column_t *c, unsigned int col, unsigned int row,
+                          uint64_t x, int valid) {
+    column_row(c, row, valid);
+    put_le(c->values.data + c->values.len, valid ? x : 0, joyarrow_columns[col].width);
+    c->values.len += joyarrow_columns[col].width;
+}
+
+static void column_double (joyarrow_column_t *c, unsigned int col, unsigned int row,
+                           double x, int valid) {
+    uint64_t bits;
+
+    memcpy_s(&bits, sizeof(bits), &x, sizeof(x));
+    column_value(c, col, row, bits, valid);
+}
+
+/* append an item of a list; bools are packed into bits */
+static void column_item (joyarrow_column_t *c, unsigned int col, uint64_t x) {
+    unsigned int width = joyarrow_columns[col].width;
+
+    if (width) {
+        put_le(c->values.data + c->values.len, x, width);
+        c->values.len += width;
+    } else {
+        if (c->num_items % 8 == 0) {
+            c->values.data[c->values.len++] = 0;
+        }
+        if (x) {
+            c->values.data[c->num_items / 8] |= (uint8_t)(1 << (c->num_items % 8));
+        }
+    }
+    c->num_items++;
+}
+
+/* end the row of a list, or of a string or binary that num_items counts the bytes of */
+static void column_end_row (joyarrow_column_t *c, unsigned int row, int valid) {
+    column_row(c, row, valid);
+    if (c->offsets.data != NULL) {
+        put_le(c->offsets.data + c->offsets.len, c->num_items, 4);
+        c->offsets.len += 4;
+    }
+}
+
+static void column_bytes (joyarrow_column_t *c, unsigned int row,
+                          const uint8_t *data, size_t len, int valid) {
+    if (len) {
+        memcpy_s(c->values.data + c->values.len, len, data, len);
+        c->values.len += len;
+        c->num_items += len;
+    }
+    column_end_row(c, row, valid);
+}
+
+static inline uint32_t key_hash (const uint8_t *key) {
+    uint32_t h = 2166136261u;
+    unsigned int i;
+
+    for (i = 0; i < JOYARROW_KEY_LEN; i++) {
+        h = (h ^ key[i]) * 16777619u;
+    }
+    return h;
+}
+
+/* append an address, as the index of its entry in the dictionary of the chunk */
+static void column_addr (joyarrow_column_t *c, unsigned int row, const uint8_t *addr,
+                         uint8_t flags, uint8_t anon_flag) {
+    joyarrow_dict_t *d = &c->dict;
+    uint8_t key[JOYARROW_KEY_LEN];
+    uint32_t h, index;
+    char str[JOYBIN_ADDR_STRLEN];
+    size_t len;
+
+    memset_s(key, sizeof(key), 0, sizeof(key));
+    if (flags & JOYBIN_IPV6) {
+        key[0] = KEY_IPV6;
+        memcpy_s(key + 1, 16, addr, 16);
+    } else if (flags & anon_flag) {
+        key[0] = KEY_ANON;
+        memcpy_s(key + 1, 16, addr, 16);
+    } else {
+        key[0] = KEY_IPV4;
+        memcpy_s(key + 1, 16, addr, 4);
+    }
+
+    h = key_hash(key) & (JOYARROW_DICT_SLOTS - 1);
+    while (d->slots[h] &&
+           memcmp(d->keys + (d->slots[h] - 1) * JOYARROW_KEY_LEN, key, JOYARROW_KEY_LEN)) {
+        h = (h + 1) & (JOYARROW_DICT_SLOTS - 1);
+    }
+    if (d->slots[h]) {
+        index = d->slots[h] - 1;
+    } else {
+        /* a chunk has no more addresses than rows, so there is room for this one */
+        index = d->num_entries++;
+        d->slots[h] = index + 1;
+        memcpy_s(d->keys + index * JOYARROW_KEY_LEN, JOYARROW_KEY_LEN, key, JOYARROW_KEY_LEN);
+        joybin_addr_string(str, addr, flags, anon_flag);
+        len = strnlen_s(str, sizeof(str));
+        memcpy_s(d->data.data + d->data.len, len, str, len);
+        d->data.len += len;
+        put_le(d->offsets.data + d->offsets.len, d->data.len, 4);
+        d->offsets.len += 4;
+    }
+
+    column_row(c, row, 1);
+    put_le(c->values.data + c->values.len, index, 4);
+    c->values.len += 4;
+}
+
+static inline int prot_has_ports (uint8_t prot) {
+    return prot == 6 || prot == 17;
+}
+
+/**
+ * \brief Add a record to a chunk as a row.
+ * \param b Chunk
+ * \param rec Record
+ * \return 0, or -1 if the chunk is full or there is no memory for the
+ *     row, in which case the chunk is left as it was
+ */
+int joyarrow_batch_append (joyarrow_batch_t *b, const joybin_record_t *rec) {
+    joyarrow_column_t *c = b->columns;
+    unsigned int row = b->num_rows;
+    int twin = (rec->flags & JOYBIN_TWIN) != 0;
+    int tcp = rec->prot == 6;
+    unsigned int i;
+
+    if (b->num_rows >= JOYARROW_BATCH_ROWS) {
+        return -1;
+    }
+    for (i = 0; i < JOYARROW_MAX_COLUMNS; i++) {
+        if (c[i].active && column_reserve(&c[i], i, row_items(i, rec))) {
+            return -1;
+        }
+    }
+
+    column_addr(&c[COL_SA], row, rec->sa, rec->flags, JOYBIN_SA_ANON);
+    column_addr(&c[COL_DA], row, rec->da, rec->flags, JOYBIN_DA_ANON);
+    column_value(&c[COL_PR], COL_PR, row, rec->prot, 1);
+    column_value(&c[COL_SP], COL_SP, row, rec->sp, prot_has_ports(rec->prot));
+    column_value(&c[COL_DP], COL_DP, row, rec->dp, prot_has_ports(rec->prot));
+    column_value(&c[COL_BYTES_OUT], COL_BYTES_OUT, row, rec->bytes_out, 1);
+    column_value(&c[COL_NUM_PKTS_OUT], COL_NUM_PKTS_OUT, row, rec->num_pkts_out, 1);
+    column_value(&c[COL_BYTES_IN], COL_BYTES_IN, row, rec->bytes_in, twin);
+    column_value(&c[COL_NUM_PKTS_IN], COL_NUM_PKTS_IN, row, rec->num_pkts_in, twin);
+    column_value(&c[COL_TIME_START], COL_TIME_START, row, (uint64_t)rec->time_start, 1);
+    column_value(&c[COL_TIME_END], COL_TIME_END, row, (uint64_t)rec->time_end, 1);
+
+    for (i = 0; i < rec->num_pkts; i++) {
+        /* {"rep":n} comes as a length of 65536 - n, which is -n as an int16 */
+        column_item(&c[COL_PKT_LEN], COL_PKT_LEN, rec->pkts[i].len);
+        column_item(&c[COL_PKT_OUT], COL_PKT_OUT, rec->pkts[i].in);
+        column_item(&c[COL_PKT_IPT], COL_PKT_IPT, rec->pkts[i].ipt);
+    }
+    column_end_row(&c[COL_PKT_LEN], row, 1);
+    column_end_row(&c[COL_PKT_OUT], row, 1);
+    column_end_row(&c[COL_PKT_IPT], row, 1);
+
+    if (b->fields & JOYBIN_BYTE_DIST) {
+        for (i = 0; i < 256; i++) {
+            column_item(&c[COL_BYTE_DIST], COL_BYTE_DIST, rec->byte_dist[i]);
+        }
+        column_row(&c[COL_BYTE_DIST], row, 1);
+        column_double(&c[COL_BYTE_DIST_MEAN], COL_BYTE_DIST_MEAN, row, rec->byte_dist_mean,
+                      rec->flags & JOYBIN_BD_STATS);
+        column_double(&c[COL_BYTE_DIST_STD], COL_BYTE_DIST_STD, row, rec->byte_dist_std,
+                      rec->flags & JOYBIN_BD_STATS);
+    }
+    if (b->fields & JOYBIN_COMPACT_BYTE_DIST) {
+        for (i = 0; i < 16; i++) {
+            column_item(&c[COL_COMPACT_BYTE_DIST], COL_COMPACT_BYTE_DIST, rec->compact_byte_dist[i]);
+        }
+        column_row(&c[COL_COMPACT_BYTE_DIST], row, 1);
+    }
+    if (b->fields & JOYBIN_ENTROPY) {
+        column_double(&c[COL_ENTROPY], COL_ENTROPY, row, rec->entropy,
+                      rec->flags & JOYBIN_HAS_ENTROPY);
+        column_double(&c[COL_TOTAL_ENTROPY], COL_TOTAL_ENTROPY, row, rec->total_entropy,
+                      rec->flags & JOYBIN_HAS_ENTROPY);
+    }
+    if (b->fields & JOYBIN_P_MALWARE) {
+        column_double(&c[COL_P_MALWARE], COL_P_MALWARE, row, rec->p_malware, 1);
+    }
+
+    column_value(&c[COL_TTL_OUT], COL_TTL_OUT, row, rec->ttl_out, 1);
+    column_value(&c[COL_TTL_IN], COL_TTL_IN, row, rec->ttl_in, twin);
+    for (i = 0; i < rec->num_id_out; i++) {
+        column_item(&c[COL_IP_ID_OUT], COL_IP_ID_OUT, rec->id_out[i]);
+    }
+    column_end_row(&c[COL_IP_ID_OUT], row, 1);
+    for (i = 0; twin && i < rec->num_id_in; i++) {
+        column_item(&c[COL_IP_ID_IN], COL_IP_ID_IN, rec->id_in[i]);
+    }
+    column_end_row(&c[COL_IP_ID_IN], row, twin);
+
+    column_value(&c[COL_FIRST_SEQ], COL_FIRST_SEQ, row, rec->first_seq, tcp);
+    column_value(&c[COL_TCP_FLAGS_OUT], COL_TCP_FLAGS_OUT, row, rec->tcp_flags_out, tcp);
+    column_value(&c[COL_TCP_FLAGS_IN], COL_TCP_FLAGS_IN, row, rec->tcp_flags_in, tcp && twin);
+    column_value(&c[COL_WINDOW_OUT], COL_WINDOW_OUT, row, rec->window_out, tcp);
+    column_value(&c[COL_WINDOW_IN], COL_WINDOW_IN, row, rec->window_in, tcp && twin);
+
+    if (b->fields & JOYBIN_IDP) {
+        column_bytes(&c[COL_IDP_OUT], row, rec->idp_out, row_items(COL_IDP_OUT, rec),
+                     rec->flags & JOYBIN_IDP_OUT);
+        column_bytes(&c[COL_IDP_IN], row, rec->idp_in, row_items(COL_IDP_IN, rec),
+                     rec->flags & JOYBIN_IDP_IN);
+    }
+
+    column_value(&c[COL_TCP_RETRANS], COL_TCP_RETRANS, row, rec->tcp_retrans, 1);
+    column_value(&c[COL_INVALID], COL_INVALID, row, rec->invalid, 1);
+    column_bytes(&c[COL_EXPIRE_TYPE], row, (const uint8_t *)&rec->expire_type,
+                 row_items(COL_EXPIRE_TYPE, rec), rec->expire_type != 0);
+
+    b->num_rows++;
+    return 0;
+}
+
+/* bytes of what the columns of a chunk hold */
+static size_t batch_bytes (const joyarrow_batch_t *b) {
+    size_t len = 0;
+    unsigned int i;
+
+    for (i = 0; i < JOYARROW_MAX_COLUMNS; i++) {
+        const joyarrow_column_t *c = &b->columns[i];
+
+        len += c->validity.len + c->offsets.len + c->values.len +
+               c->dict.offsets.len + c->dict.data.len;
+    }
+    return len;
+}
+
+/**
+ * \brief Tell whether a chunk is to be written out before more rows are added.
+ * \param b Chunk
+ * \return 1 if it has JOYARROW_BATCH_ROWS rows or JOYARROW_BATCH_BYTES bytes, 0 otherwise
+ */
+int joyarrow_batch_full (const joyarrow_batch_t *b) {
+    return b->num_rows >= JOYARROW_BATCH_ROWS || batch_bytes(b) >= JOYARROW_BATCH_BYTES;
+}
+
+/**
+ * \brief Get the most bytes that the messages of a chunk take.
+ * \param b Chunk
+ * \return bytes
+ */
+size_t joyarrow_batch_encoded_size (const joyarrow_batch_t *b) {
+    /* each buffer may be padded by 7 bytes, and there are three messages */
+    return batch_bytes(b) + 7 * 6 * JOYARROW_MAX_COLUMNS + 3 * (8 + JOYARROW_META_MAX);
+}
+
+/* put the buffers of a column, and its nodes, into a body */
+static void column_body (joyarrow_body_t *body, const joyarrow_column_t *c,
+                         unsigned int col, unsigned int num_rows) {
+    size_t validity = c->null_count ? c->validity.len : 0;
+
+    body_node(body, num_rows, c->null_count);
+    body_buffer(body, c->validity.data, validity);
+    switch (joyarrow_columns[col].type) {
+    case JOYARROW_INT:
+    case JOYARROW_DOUBLE:
+    case JOYARROW_TIMESTAMP:
+    case JOYARROW_DICT:
+        body_buffer(body, c->values.data, c->values.len);
+        break;
+    case JOYARROW_UTF8:
+    case JOYARROW_BINARY:
+        body_buffer(body, c->offsets.data, c->offsets.len);
+        body_buffer(body, c->values.data, c->values.len);
+        break;
+    case JOYARROW_LIST:
+        body_buffer(body, c->offsets.data, c->offsets.len);
+        body_node(body, (int64_t)c->num_items, 0);
+        body_buffer(body, NULL, 0);
+        body_buffer(body, c->values.data, c->values.len);
+        break;
+    case JOYARROW_FIXED_LIST:
+        body_node(body, (int64_t)c->num_items, 0);
+        body_buffer(body, NULL, 0);
+        body_buffer(body, c->values.data, c->values.len);
+        break;
+    default:
+        break;
+    }
+}
+
+/**
+ * \brief Encode the messages of a chunk, and empty it.
+ *
+ * The messages are the dictionaries of the chunk, then its record batch.
+ *
+ * \param buf Where to encode them
+ * \param size Bytes of buf, joyarrow_batch_encoded_size() of them being enough
+ * \param b Chunk
+ * \return length of the messages, or 0 if size is too small, in which
+ *     case the chunk is kept
+ */
+size_t joyarrow_batch_encode (uint8_t *buf, size_t size, joyarrow_batch_t *b) {
+    joyarrow_body_t body;
+    size_t header, n, len = 0;
+    unsigned int i;
+    int64_t dict_id = 0;
+    fb_t fb;
+
+    for (i = 0; i < JOYARROW_MAX_COLUMNS; i++) {
+        const joyarrow_column_t *c = &b->columns[i];
+        fb_slot_t slot[2] = {{0, 0, 0}};
+
+        if (!c->active || joyarrow_columns[i].type != JOYARROW_DICT) {
+            continue;
+        }
+        body.num_nodes = body.num_buffers = 0;
+        body_node(&body, c->dict.num_entries, 0);
+        body_buffer(&body, NULL, 0);
+        body_buffer(&body, c->dict.offsets.data, c->dict.offsets.len);
+        body_buffer(&body, c->dict.data.data, c->dict.data.len);
+
+        /* id and data; isDelta is false, so that it replaces the one of the chunk before */
+        fb_init(&fb, buf + len, size - len);
+        header = fb_message(&fb, ARROW_HEADER_DICTIONARY, body_len(&body));
+        slot[0].size = 8;
+        slot[0].value = (uint64_t)dict_id++;
+        slot[1].size = 4;
+        fb_set_offset(&fb, header, fb_table(&fb, slot, 2));
+        fb_set_offset(&fb, slot[1].pos, fb_record_batch(&fb, c->dict.num_entries, &body));
+        n = fb_finish(&fb, buf + len, size - len, &body);
+        if (n == 0) {
+            return 0;
+        }
+        len += n;
+    }
+
+    body.num_nodes = body.num_buffers = 0;
+    for (i = 0; i < JOYARROW_MAX_COLUMNS; i++) {
+        if (b->columns[i].active) {
+            column_body(&body, &b->columns[i], i, b->num_rows);
+        }
+    }
+    fb_init(&fb, buf + len, size - len);
+    header = fb_message(&fb, ARROW_HEADER_RECORD_BATCH, body_len(&body));
+    fb_set_offset(&fb, header, fb_record_batch(&fb, b->num_rows, &body));
+    n = fb_finish(&fb, buf + len, size - len, &body);
+    if (n == 0) {
+        return 0;
+    }
+    len += n;
+
+    for (i = 0; i < JOYARROW_MAX_COLUMNS; i++) {
+        if (b->columns[i].active) {
+            column_reset(&b->columns[i]);
+        }
+    }
+    b->num_rows = 0;
+    return len;
+}
+
+/* finds len bytes of s in the n bytes of buf */
+static int joyarrow_test_find (const uint8_t *buf, size_t n, const char *s) {
+    size_t i, len = strlen(s);
+
+    for (i = 0; i + len <= n; i++) {
+        if (memcmp(buf + i, s, len) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* checks the frame of the message at buf; returns the length of its metadata, or 0 */
+static size_t joyarrow_test_frame (const uint8_t *buf, size_t n) {
+    size_t meta_len;
+
+    if (n < 8 || buf[0] != 0xff || buf[1] != 0xff || buf[2] != 0xff || buf[3] != 0xff) {
+        return 0;
+    }
+    meta_len = buf[4] | (buf[5] << 8) | (buf[6] << 16) | ((size_t)buf[7] << 24);
+    if (meta_len == 0 || meta_len % 8 || 8 + meta_len > n) {
+        return 0;
+    }
+    return meta_len;
+}
+
+/**
+ * \brief Unit test for the column chunks.
+ *
+ * Puts a UDP record and two TCP ones together into a chunk, and checks
+ * the nulls and the dictionaries of its columns, and that the schema
+ * and the chunk encode into messages that are framed as they should
+ * be.  The messages themselves are checked against pyarrow, which is
+ * not at hand here.
+ *
+ * \param none
+ * \return Number of failures
+ */
+int joyarrow_unit_test (void) {
+    joybin_schema_t schema;
+    joybin_record_t *rec = NULL;
+    joyarrow_batch_t *b = NULL;
+    uint8_t *buf = NULL;
+    size_t size, len;
+    int num_fails = 0;
+    unsigned int i;
+
+    fprintf(info, "\n******************************\n");
+    fprintf(info, "Arrow column chunk Unit Test starting...\n");
+
+    memset_s(&schema, sizeof(schema), 0, sizeof(schema));
+    schema.num_pkts = 50;
+    schema.fields = JOYBIN_BYTE_DIST | JOYBIN_IDP;
+    strcpy_s(schema.omitted[schema.num_omitted++], JOYBIN_MAX_NAME, "dns");
+    strcpy_s(schema.omitted[schema.num_omitted++], JOYBIN_MAX_NAME, "tls");
+
+    rec = calloc(3, sizeof(*rec));
+    b = joyarrow_batch_new(&schema);
+    buf = malloc(JOYARROW_META_MAX);
+    if (rec == NULL || b == NULL || buf == NULL) {
+        fprintf(info, "error: could not allocate the chunk\n");
+        num_fails++;
+        goto end;
+    }
+
+    len = joyarrow_schema_encode(buf, JOYARROW_META_MAX, &schema, "{\"num_pkts\":50}", 15);
+    if (len == 0 || joyarrow_test_frame(buf, len) + 8 != len ||
+        !joyarrow_test_find(buf, len, "byte_dist") || joyarrow_test_find(buf, len, "entropy") ||
+        !joyarrow_test_find(buf, len, "dns,tls") || !joyarrow_test_find(buf, len, "{\"num_pkts\":50}")) {
+        fprintf(info, "error: the schema did not encode as it should\n");
+        num_fails++;
+    }
+    if (joyarrow_schema_encode(buf, len - 1, &schema, "{\"num_pkts\":50}", 15) != 0) {
+        fprintf(info, "error: the schema encoded into too little room\n");
+        num_fails++;
+    }
+
+    /* a one-way UDP flow, and two TCP flows from the same address */
+    rec[0].sa[0] = rec[0].da[0] = 10;
+    rec[0].sa[3] = 1;
+    rec[0].da[3] = 2;
+    rec[0].prot = 17;
+    rec[0].num_pkts = 2;
+    rec[0].pkts[1].len = 65535;
+    rec[0].expire_type = 'i';
+    for (i = 1; i < 3; i++) {
+        rec[i] = rec[0];
+        rec[i].flags = JOYBIN_TWIN | JOYBIN_IDP_IN;
+        rec[i].prot = 6;
+        rec[i].da[3] = (uint8_t)(2 + i);
+        rec[i].num_id_in = 1;
+        rec[i].idp_in = (const uint8_t *)"idp";
+        rec[i].idp_len_in = 3;
+        rec[i].expire_type = 0;
+    }
+    for (i = 0; i < 3; i++) {
+        if (joyarrow_batch_append(b, &rec[i]) != 0) {
+            fprintf(info, "error: could not append record %u\n", i);
+            num_fails++;
+        }
+    }
+    if (b->num_rows != 3 || b->columns[COL_SA].dict.num_entries != 1 ||
+        b->columns[COL_DA].dict.num_entries != 3 || b->columns[COL_BYTES_IN].null_count != 1 ||
+        b->columns[COL_FIRST_SEQ].null_count != 1 || b->columns[COL_IP_ID_IN].null_count != 1 ||
+        b->columns[COL_IDP_OUT].null_count != 3 || b->columns[COL_EXPIRE_TYPE].null_count != 2 ||
+        b->columns[COL_PKT_OUT].num_items != 6 || b->columns[COL_BYTE_DIST].num_items != 3 * 256 ||
+        b->columns[COL_ENTROPY].active || joyarrow_batch_full(b)) {
+        fprintf(info, "error: the columns do not hold the records as they should\n");
+        num_fails++;
+    }
+
+    size = joyarrow_batch_encoded_size(b);
+    free(buf);
+    buf = malloc(size);
+    if (buf == NULL) {
+        fprintf(info, "error: could not allocate the messages\n");
+        num_fails++;
+        goto end;
+    }
+    if (joyarrow_batch_encode(buf, 64, b) != 0 || b->num_rows != 3) {
+        fprintf(info, "error: the chunk encoded into too little room\n");
+        num_fails++;
+    }
+    len = joyarrow_batch_encode(buf, size, b);
+    if (len == 0 || joyarrow_test_frame(buf, len) == 0 || b->num_rows != 0 ||
+        !joyarrow_test_find(buf, len, "10.0.0.1") || !joyarrow_test_find(buf, len, "10.0.0.4") ||
+        b->columns[COL_DA].dict.num_entries != 0 || b->columns[COL_BYTES_IN].null_count != 0) {
+        fprintf(info, "error: the chunk did not encode as it should\n");
+        num_fails++;
+    }
+
+    /* a chunk fills up at JOYARROW_BATCH_ROWS rows */
+    for (i = 0; i < JOYARROW_BATCH_ROWS; i++) {
+        if (joyarrow_batch_append(b, &rec[i % 3]) != 0) {
+            break;
+        }
+    }
+    if (i != JOYARROW_BATCH_ROWS || !joyarrow_batch_full(b) ||
+        joyarrow_batch_append(b, &rec[0]) == 0 || b->columns[COL_DA].dict.num_entries != 3) {
+        fprintf(info, "error: the chunk did not fill up as it should\n");
+        num_fails++;
+    }
+
+ end:
+    joyarrow_batch_free(b);
+    free(buf);
+    free(rec);
+
+    if (num_fails) {
+        fprintf(info, "Finished - failures: %d\n", num_fails);
+    } else {
+        fprintf(info, "Finished - success\n");
+    }
+    fprintf(info, "******************************\n\n");
+
+    return num_fails;
+}
@@ -0,0 +1,1174 @@
+/*
+ *
+ * Copyright (c) 2018 Cisco Systems, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials provided
+ *   with the distribution.
+ *
+ *   Neither the name of the Cisco Systems, Inc. nor the names of its
+ *   contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/**
+ * \file joybin.c
+ *
+ * \brief compact binary flow records, and a streaming reader for them
+ *
+ ** See joybin.h for the layout of a file.  The encoder and the decoder
+ *  below go through the fields of a record in the same order, and
+ *  joybin_record_print_json() prints them as flow_record_print_json()
+ *  does, so that the two have to be changed together.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "joy_config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include "safe_lib.h"
+#include "joybin.h"
+
+#ifdef WIN32
+#include "Ws2tcpip.h"
+#else
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#endif
+
+/* external declaration of the file destinations */
+extern FILE *info;
+
+/** names of the optional fields, in the order in which records carry them */
+static const struct {
+    joybin_field_e field;
+    const char *name;
+} joybin_fields[] = {
+    { JOYBIN_BYTE_DIST, "byte_dist" },
+    { JOYBIN_COMPACT_BYTE_DIST, "compact_byte_dist" },
+    { JOYBIN_ENTROPY, "entropy" },
+    { JOYBIN_P_MALWARE, "p_malware" },
+    { JOYBIN_IDP, "idp" }
+};
+
+#define JOYBIN_NUM_FIELDS (sizeof(joybin_fields) / sizeof(joybin_fields[0]))
+
+/* bytes in the header before the schema */
+#define JOYBIN_PREAMBLE_LEN 8
+
+/*
+ * Encoding.  The encoders do not check for room; joybin_record_encode()
+ * makes sure that there is JOYBIN_RECORD_MAX of it first.
+ */
+
+static inline uint8_t *put_u16 (uint8_t *p, uint16_t x) {
+    p[0] = (uint8_t)x;
+    p[1] = (uint8_t)(x >> 8);
+    return p + 2;
+}
+
+static inline uint8_t *put_u32 (uint8_t *p, uint32_t x) {
+    p[0] = (uint8_t)x;
+    p[1] = (uint8_t)(x >> 8);
+    p[2] = (uint8_t)(x >> 16);
+    p[3] = (uint8_t)(x >> 24);
+    return p + 4;
+}
+
+static inline uint8_t *put_u64 (uint8_t *p, uint64_t x) {
+    p = put_u32(p, (uint32_t)x);
+    return put_u32(p, (uint32_t)(x >> 32));
+}
+
+static inline uint8_t *put_varint (uint8_t *p, uint64_t x) {
+    while (x >= 0x80) {
+        *p++ = (uint8_t)(x | 0x80);
+        x >>= 7;
+    }
+    *p++ = (uint8_t)x;
+    return p;
+}
+
+static inline uint8_t *put_double (uint8_t *p, double x) {
+    uint64_t bits;
+
+    memcpy_s(&bits, sizeof(bits), &x, sizeof(x));
+    return put_u64(p, bits);
+}
+
+static inline uint8_t *put_bytes (uint8_t *p, const uint8_t *data, size_t len) {
+    if (len) {
+        memcpy_s(p, len, data, len);
+    }
+    return p + len;
+}
+
+/*
+ * Decoding.  A cursor runs over the bytes of a record; once it runs
+ * off their end, every read returns 0 and bad is set.
+ */
+
+typedef struct joybin_cursor_ {
+    const uint8_t *p;
+    const uint8_t *end;
+    int bad;
+} joybin_cursor_t;
+
+static inline int cursor_has (joybin_cursor_t *c, size_t len) {
+    if ((size_t)(c->end - c->p) < len) {
+        c->bad = 1;
+        c->p = c->end;
+        return 0;
+    }
+    return 1;
+}
+
+static inline uint8_t get_u8 (joybin_cursor_t *c) {
+    if (!cursor_has(c, 1)) {
+        return 0;
+    }
+    return *c->p++;
+}
+
+static inline uint16_t get_u16 (joybin_cursor_t *c) {
+    uint16_t x;
+
+    if (!cursor_has(c, 2)) {
+        return 0;
+    }
+    x = (uint16_t)(c->p[0] | (c->p[1] << 8));
+    c->p += 2;
+    return x;
+}
+
+static inline uint32_t get_u32 (joybin_cursor_t *c) {
+    uint32_t x;
+
+    if (!cursor_has(c, 4)) {
+        return 0;
+    }
+    x = (uint32_t)c->p[0] | ((uint32_t)c->p[1] << 8) |
+        ((uint32_t)c->p[2] << 16) | ((uint32_t)c->p[3] << 24);
+    c->p += 4;
+    return x;
+}
+
+static inline uint64_t get_u64 (joybin_cursor_t *c) {
+    uint64_t lo = get_u32(c);
+
+    return lo | ((uint64_t)get_u32(c) << 32);
+}
+
+static inline uint64_t get_varint (joybin_cursor_t *c) {
+    uint64_t x = 0;
+    unsigned int shift = 0;
+
+    while (c->p < c->end && shift < 64) {
+        uint8_t b = *c->p++;
+
+        x |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            return x;
+        }
+        shift += 7;
+    }
+    c->bad = 1;
+    c->p = c->end;
+    return 0;
+}
+
+static inline double get_double (joybin_cursor_t *c) {
+    uint64_t bits = get_u64(c);
+    double x;
+
+    memcpy_s(&x, sizeof(x), &bits, sizeof(bits));
+    return x;
+}
+
+static inline void get_bytes (joybin_cursor_t *c, uint8_t *data, size_t len) {
+    if (!cursor_has(c, len)) {
+        return;
+    }
+    if (len) {
+        memcpy_s(data, len, c->p, len);
+    }
+    c->p += len;
+}
+
+/* zigzag encoding, so that small negative differences stay small */
+static inline uint64_t zigzag (int64_t x) {
+    return ((uint64_t)x << 1) ^ (uint64_t)(x >> 63);
+}
+
+static inline int64_t unzigzag (uint64_t x) {
+    return (int64_t)(x >> 1) ^ -(int64_t)(x & 1);
+}
+
+/* bytes that an address takes; IPv4 addresses are anonymized into 16 */
+static inline size_t addr_len (uint8_t flags, uint8_t anon_flag) {
+    return (flags & (JOYBIN_IPV6 | anon_flag)) ? 16 : 4;
+}
+
+static inline int prot_has_ports (uint8_t prot) {
+    return prot == 6 || prot == 17;
+}
+
+static uint8_t *put_name (uint8_t *p, const char *name) {
+    size_t len = strnlen_s(name, JOYBIN_MAX_NAME - 1);
+
+    *p++ = (uint8_t)len;
+    return put_bytes(p, (const uint8_t *)name, len);
+}
+
+/*
+ * IP ids mostly go up one by one, so each is encoded as its zigzagged
+ * difference from the one before, which takes a byte
+ */
+static uint8_t *put_ip_ids (uint8_t *p, const uint16_t *id, unsigned int num_id) {
+    unsigned int i;
+    uint16_t last = 0;
+
+    if (num_id > JOYBIN_MAX_IP_ID) {
+        num_id = JOYBIN_MAX_IP_ID;
+    }
+    *p++ = (uint8_t)num_id;
+    for (i = 0; i < num_id; i++) {
+        p = put_varint(p, zigzag((int16_t)(uint16_t)(id[i] - last)));
+        last = id[i];
+    }
+    return p;
+}
+
+static unsigned int get_ip_ids (joybin_cursor_t *c, uint16_t *id) {
+    unsigned int i, num_id = get_u8(c);
+    uint16_t last = 0;
+
+    if (num_id > JOYBIN_MAX_IP_ID) {
+        c->bad = 1;
+        return 0;
+    }
+    for (i = 0; i < num_id; i++) {
+        last = (uint16_t)(last + (uint16_t)unzigzag(get_varint(c)));
+        id[i] = last;
+    }
+    return num_id;
+}
+
+/**
+ * \brief Encode the header of a binary flow record file.
+ *
+ * The configuration line, which completes the header, is not
+ * encoded; it is written after it, as config_print_json() prints it.
+ *
+ * \param buf Buffer to encode into
+ * \param size Bytes in buf
+ * \param schema Schema of the records in the file
+ * \return Length of the header, or 0 if size is too small
+ */
+size_t joybin_header_encode (uint8_t *buf, size_t size, const joybin_schema_t *schema) {
+    uint8_t *p, *count;
+    unsigned int i, num_omitted;
+    size_t schema_len;
+
+    num_omitted = schema->num_omitted > JOYBIN_MAX_OMITTED ? JOYBIN_MAX_OMITTED : schema->num_omitted;
+    if (size < JOYBIN_PREAMBLE_LEN + 4 + (JOYBIN_NUM_FIELDS + num_omitted) * JOYBIN_MAX_NAME) {
+        return 0;
+    }
+
+    memcpy_s(buf, 4, JOYBIN_MAGIC, 4);
+    put_u16(buf + 4, JOYBIN_VERSION);
+    p = buf + JOYBIN_PREAMBLE_LEN;
+
+    p = put_u16(p, (uint16_t)schema->num_pkts);
+    count = p++;
+    *count = 0;
+    for (i = 0; i < JOYBIN_NUM_FIELDS; i++) {
+        if (schema->fields & joybin_fields[i].field) {
+            p = put_name(p, joybin_fields[i].name);
+            (*count)++;
+        }
+    }
+    *p++ = (uint8_t)num_omitted;
+    for (i = 0; i < num_omitted; i++) {
+        p = put_name(p, schema->omitted[i]);
+    }
+
+    schema_len = (size_t)(p - buf) - JOYBIN_PREAMBLE_LEN;
+    put_u16(buf + 6, (uint16_t)schema_len);
+    return (size_t)(p - buf);
+}
+
+/**
+ * \brief Decode the schema part of a file header.
+ * \param schema Schema to decode into
+ * \param buf The schema
+ * \param len Its length
+ * \return 0, or -1 if it is malformed or names a field that is not known
+ */
+static int joybin_schema_decode (joybin_schema_t *schema, const uint8_t *buf, size_t len) {
+    joybin_cursor_t c = { buf, buf + len, 0 };
+    char name[JOYBIN_MAX_NAME];
+    unsigned int i, j, n, name_len;
+
+    memset_s(schema, sizeof(*schema), 0, sizeof(*schema));
+    schema->num_pkts = get_u16(&c);
+    n = get_u8(&c);
+    for (i = 0; i < n && !c.bad; i++) {
+        name_len = get_u8(&c);
+        if (name_len >= JOYBIN_MAX_NAME) {
+            return -1;
+        }
+        get_bytes(&c, (uint8_t *)name, name_len);
+        name[name_len] = 0;
+        for (j = 0; j < JOYBIN_NUM_FIELDS; j++) {
+            if (strcmp(name, joybin_fields[j].name) == 0) {
+                schema->fields |= joybin_fields[j].field;
+                break;
+            }
+        }
+        if (j == JOYBIN_NUM_FIELDS) {
+            /* records carry a field that this reader cannot skip */
+            return -1;
+        }
+    }
+    n = get_u8(&c);
+    for (i = 0; i < n && !c.bad; i++) {
+        name_len = get_u8(&c);
+        if (name_len >= JOYBIN_MAX_NAME || i >= JOYBIN_MAX_OMITTED) {
+            return -1;
+        }
+        get_bytes(&c, (uint8_t *)schema->omitted[i], name_len);
+        schema->omitted[i][name_len] = 0;
+        schema->num_omitted++;
+    }
+
+    return c.bad ? -1 : 0;
+}
+
+/**
+ * \brief Encode a flow record.
+ * \param buf Buffer to encode into
+ * \param size Bytes in buf, which needs to be at least JOYBIN_RECORD_MAX
+ * \param schema Schema of the file
+ * \param rec Record to encode
+ * \return Length of the record, its length included, or 0 if size is too small
+ */
+size_t joybin_record_encode (uint8_t *buf, size_t size,
+                             const joybin_schema_t *schema, const joybin_record_t *rec) {
+    unsigned int i, n;
+    uint8_t flags = rec->flags;
+    uint8_t *p;
+
+    if (size < JOYBIN_RECORD_MAX) {
+        return 0;
+    }
+    if (!(rec->flags & JOYBIN_TWIN)) {
+        flags &= (uint8_t)~JOYBIN_IDP_IN;
+    }
+    p = buf + 4;
+
+    *p++ = flags;
+    p = put_bytes(p, rec->sa, addr_len(flags, JOYBIN_SA_ANON));
+    p = put_bytes(p, rec->da, addr_len(flags, JOYBIN_DA_ANON));
+    *p++ = rec->prot;
+    if (prot_has_ports(rec->prot)) {
+        p = put_u16(p, rec->sp);
+        p = put_u16(p, rec->dp);
+    }
+
+    p = put_u32(p, rec->bytes_out);
+    p = put_u32(p, rec->num_pkts_out);
+    if (flags & JOYBIN_TWIN) {
+        p = put_u32(p, rec->bytes_in);
+        p = put_u32(p, rec->num_pkts_in);
+    }
+    p = put_u64(p, (uint64_t)rec->time_start);
+    p = put_varint(p, zigzag(rec->time_end - rec->time_start));
+
+    n = rec->num_pkts > JOYBIN_MAX_PKTS ? JOYBIN_MAX_PKTS : rec->num_pkts;
+    p = put_varint(p, n);
+    for (i = 0; i < n; i++) {
+        p = put_varint(p, ((uint32_t)rec->pkts[i].len << 1) | (rec->pkts[i].in & 1));
+        p = put_varint(p, rec->pkts[i].ipt);
+    }
+
+    if (schema->fields & JOYBIN_BYTE_DIST) {
+        p = put_bytes(p, rec->byte_dist, sizeof(rec->byte_dist));
+        if (flags & JOYBIN_BD_STATS) {
+            p = put_double(p, rec->byte_dist_mean);
+            p = put_double(p, rec->byte_dist_std);
+        }
+    }
+    if (schema->fields & JOYBIN_COMPACT_BYTE_DIST) {
+        p = put_bytes(p, rec->compact_byte_dist, sizeof(rec->compact_byte_dist));
+    }
+    if ((schema->fields & JOYBIN_ENTROPY) && (flags & JOYBIN_HAS_ENTROPY)) {
+        p = put_double(p, rec->entropy);
+        p = put_double(p, rec->total_entropy);
+    }
+    if (schema->fields & JOYBIN_P_MALWARE) {
+        p = put_double(p, rec->p_malware);
+    }
+
+    *p++ = rec->ttl_out;
+    p = put_ip_ids(p, rec->id_out, rec->num_id_out);
+    if (flags & JOYBIN_TWIN) {
+        *p++ = rec->ttl_in;
+        p = put_ip_ids(p, rec->id_in, rec->num_id_in);
+    }
+
+    if (rec->prot == 6) {
+        p = put_u32(p, rec->first_seq);
+        *p++ = rec->tcp_flags_out;
+        p = put_u16(p, rec->window_out);
+        if (flags & JOYBIN_TWIN) {
+            *p++ = rec->tcp_flags_in;
+            p = put_u16(p, rec->window_in);
+        }
+    }
+
+    if (schema->fields & JOYBIN_IDP) {
+        if (flags & JOYBIN_IDP_OUT) {
+            n = rec->idp_len_out > JOYBIN_MAX_IDP ? JOYBIN_MAX_IDP : rec->idp_len_out;
+            p = put_varint(p, n);
+            p = put_bytes(p, rec->idp_out, n);
+        }
+        if (flags & JOYBIN_IDP_IN) {
+            n = rec->idp_len_in > JOYBIN_MAX_IDP ? JOYBIN_MAX_IDP : rec->idp_len_in;
+            p = put_varint(p, n);
+            p = put_bytes(p, rec->idp_in, n);
+        }
+    }
+
+    p = put_varint(p, rec->tcp_retrans);
+    p = put_varint(p, rec->invalid);
+    *p++ = (uint8_t)rec->expire_type;
+
+    put_u32(buf, (uint32_t)(p - buf - 4));
+    return (size_t)(p - buf);
+}
+
+/**
+ * \brief Decode a flow record.
+ *
+ * The idp_out and idp_in of the record point into buf, so that they
+ * are only good for as long as buf is.
+ *
+ * \param rec Record to decode into
+ * \param schema Schema of the file
+ * \param buf The record, after its length
+ * \param len Its length
+ * \return 0, or -1 if the record is malformed
+ */
+int joybin_record_decode (joybin_record_t *rec, const joybin_schema_t *schema,
+                          const uint8_t *buf, size_t len) {
+    joybin_cursor_t c = { buf, buf + len, 0 };
+    unsigned int i;
+    uint64_t n;
+
+    rec->flags = get_u8(&c);
+    get_bytes(&c, rec->sa, addr_len(rec->flags, JOYBIN_SA_ANON));
+    get_bytes(&c, rec->da, addr_len(rec->flags, JOYBIN_DA_ANON));
+    rec->prot = get_u8(&c);
+    rec->sp = rec->dp = 0;
+    if (prot_has_ports(rec->prot)) {
+        rec->sp = get_u16(&c);
+        rec->dp = get_u16(&c);
+    }
+
+    rec->bytes_out = get_u32(&c);
+    rec->num_pkts_out = get_u32(&c);
+    rec->bytes_in = rec->num_pkts_in = 0;
+    if (rec->flags & JOYBIN_TWIN) {
+        rec->bytes_in = get_u32(&c);
+        rec->num_pkts_in = get_u32(&c);
+    }
+    rec->time_start = (int64_t)get_u64(&c);
+    rec->time_end = rec->time_start + unzigzag(get_varint(&c));
+
+    n = get_varint(&c);
+    if (n > JOYBIN_MAX_PKTS) {
+        return -1;
+    }
+    rec->num_pkts = (unsigned int)n;
+    for (i = 0; i < rec->num_pkts; i++) {
+        uint64_t x = get_varint(&c);
+
+        rec->pkts[i].len = (uint16_t)(x >> 1);
+        rec->pkts[i].in = (uint8_t)(x & 1);
+        rec->pkts[i].ipt = (uint32_t)get_varint(&c);
+    }
+
+    if (schema->fields & JOYBIN_BYTE_DIST) {
+        get_bytes(&c, rec->byte_dist, sizeof(rec->byte_dist));
+        if (rec->flags & JOYBIN_BD_STATS) {
+            rec->byte_dist_mean = get_double(&c);
+            rec->byte_dist_std = get_double(&c);
+        }
+    }
+    if (schema->fields & JOYBIN_COMPACT_BYTE_DIST) {
+        get_bytes(&c, rec->compact_byte_dist, sizeof(rec->compact_byte_dist));
+    }
+    if ((schema->fields & JOYBIN_ENTROPY) && (rec->flags & JOYBIN_HAS_ENTROPY)) {
+        rec->entropy = get_double(&c);
+        rec->total_entropy = get_double(&c);
+    }
+    if (schema->fields & JOYBIN_P_MALWARE) {
+        rec->p_malware = get_double(&c);
+    }
+
+    rec->ttl_out = get_u8(&c);
+    rec->num_id_out = get_ip_ids(&c, rec->id_out);
+    rec->ttl_in = 0;
+    rec->num_id_in = 0;
+    if (rec->flags & JOYBIN_TWIN) {
+        rec->ttl_in = get_u8(&c);
+        rec->num_id_in = get_ip_ids(&c, rec->id_in);
+    }
+
+    rec->first_seq = 0;
+    rec->tcp_flags_out = rec->tcp_flags_in = 0;
+    rec->window_out = rec->window_in = 0;
+    if (rec->prot == 6) {
+        rec->first_seq = get_u32(&c);
+        rec->tcp_flags_out = get_u8(&c);
+        rec->window_out = get_u16(&c);
+        if (rec->flags & JOYBIN_TWIN) {
+            rec->tcp_flags_in = get_u8(&c);
+            rec->window_in = get_u16(&c);
+        }
+    }
+
+    rec->idp_out = rec->idp_in = NULL;
+    rec->idp_len_out = rec->idp_len_in = 0;
+    if (schema->fields & JOYBIN_IDP) {
+        if (rec->flags & JOYBIN_IDP_OUT) {
+            n = get_varint(&c);
+            if (n > JOYBIN_MAX_IDP || !cursor_has(&c, (size_t)n)) {
+                return -1;
+            }
+            rec->idp_out = c.p;
+            rec->idp_len_out = (unsigned int)n;
+            c.p += n;
+        }
+        if (rec->flags & JOYBIN_IDP_IN) {
+            n = get_varint(&c);
+            if (n > JOYBIN_MAX_IDP || !cursor_has(&c, (size_t)n)) {
+                return -1;
+            }
+            rec->idp_in = c.p;
+            rec->idp_len_in = (unsigned int)n;
+            c.p += n;
+        }
+    }
+
+    rec->tcp_retrans = (uint32_t)get_varint(&c);
+    rec->invalid = (uint32_t)get_varint(&c);
+    rec->expire_type = (char)get_u8(&c);
+
+    /* anything after what this version knows about is skipped */
+    return c.bad ? -1 : 0;
+}
+
+/**
+ * \brief Format an address of a record as flow_record_print_json() does.
+ * \param str Where to put the string, JOYBIN_ADDR_STRLEN bytes
+ * \param addr sa or da of the record
+ * \param flags Flags of the record
+ * \param anon_flag JOYBIN_SA_ANON or JOYBIN_DA_ANON, for addr
+ * \return str
+ */
+const char *joybin_addr_string (char *str, const uint8_t *addr,
+                                uint8_t flags, uint8_t anon_flag) {
+    unsigned int i;
+
+    if (flags & JOYBIN_IPV6) {
+        inet_ntop(AF_INET6, addr, str, JOYBIN_ADDR_STRLEN);
+    } else if (flags & anon_flag) {
+        for (i = 0; i < 16; i++) {
+            snprintf(str + 2 * i, 3, "%02x", addr[i]);
+        }
+    } else {
+        inet_ntop(AF_INET, addr, str, JOYBIN_ADDR_STRLEN);
+    }
+    return str;
+}
+
+static void print_addr (FILE *f, const char *name, const uint8_t *addr,
+                        uint8_t flags, uint8_t anon_flag) {
+    char str[JOYBIN_ADDR_STRLEN];
+
+    fprintf(f, "\"%s\":\"%s\",", name, joybin_addr_string(str, addr, flags, anon_flag));
+}
+
+static void print_time (FILE *f, const char *name, int64_t usec) {
+    fprintf(f, ",\"%s\":%lld.%06ld", name, (long long)(usec / 1000000), (long)(usec % 1000000));
+}
+
+static void print_ip_ids (FILE *f, uint8_t ttl, const uint16_t *id, unsigned int num_id) {
+    unsigned int i;
+
+    fprintf(f, "{\"ttl\":%u", ttl);
+    if (num_id) {
+        fputs(",\"id\":[", f);
+        for (i = 0; i < num_id; i++) {
+            fprintf(f, i ? ",%u" : "%u", id[i]);
+        }
+        fputc(']', f);
+    }
+    fputc('}', f);
+}
+
+static void print_tcp_dir (FILE *f, uint8_t flags, uint16_t window) {
+    static const char letters[] = "FSRPAUEC";
+    unsigned int i;
+
+    fputc('{', f);
+    if (flags) {
+        fputs("\"flags\":\"", f);
+        for (i = 0; i < 8; i++) {
+            if (flags & (1 << i)) {
+                fputc(letters[i], f);
+            }
+        }
+        fputc('"', f);
+    }
+    if (window) {
+        fprintf(f, flags ? ",\"first_window_size\":%u" : "\"first_window_size\":%u", window);
+    }
+    fputc('}', f);
+}
+
+static void print_hex (FILE *f, const uint8_t *data, unsigned int len) {
+    unsigned int i;
+
+    fputc('"', f);
+    for (i = 0; i < len; i++) {
+        fprintf(f, "%02x", data[i]);
+    }
+    fputc('"', f);
+}
+
+/**
+ * \brief Print a flow record as flow_record_print_json() does.
+ * \param f File to print to
+ * \param schema Schema of the file
+ * \param rec Record to print
+ * \return none
+ */
+void joybin_record_print_json (FILE *f, const joybin_schema_t *schema,
+                               const joybin_record_t *rec) {
+    unsigned int i;
+    int twin = rec->flags & JOYBIN_TWIN;
+
+    fputc('{', f);
+    print_addr(f, "sa", rec->sa, rec->flags, JOYBIN_SA_ANON);
+    print_addr(f, "da", rec->da, rec->flags, JOYBIN_DA_ANON);
+    fprintf(f, "\"pr\":%u,", rec->prot);
+    if (prot_has_ports(rec->prot)) {
+        fprintf(f, "\"sp\":%u,\"dp\":%u,", rec->sp, rec->dp);
+    } else {
+        fputs("\"sp\":null,\"dp\":null,", f);
+    }
+
+    fprintf(f, "\"bytes_out\":%u,\"num_pkts_out\":%u", rec->bytes_out, rec->num_pkts_out);
+    if (twin) {
+        fprintf(f, ",\"bytes_in\":%u,\"num_pkts_in\":%u", rec->bytes_in, rec->num_pkts_in);
+    }
+    print_time(f, "time_start", rec->time_start);
+    print_time(f, "time_end", rec->time_end);
+
+    fputs(",\"packets\":[", f);
+    for (i = 0; i < rec->num_pkts; i++) {
+        const joybin_pkt_t *pkt = &rec->pkts[i];
+
+        if (pkt->len < 32768) {
+            fprintf(f, "%s{\"b\":%u", i ? "," : "", pkt->len);
+        } else {
+            fprintf(f, "%s{\"rep\":%u", i ? "," : "", 65536 - pkt->len);
+        }
+        fprintf(f, ",\"dir\":\"%s\",\"ipt\":%u}", pkt->in ? ">" : "<", pkt->ipt);
+    }
+    fputc(']', f);
+
+    if (schema->fields & JOYBIN_BYTE_DIST) {
+        fputs(",\"byte_dist\":[", f);
+        for (i = 0; i < 256; i++) {
+            fprintf(f, i ? ",%u" : "%u", rec->byte_dist[i]);
+        }
+        fputc(']', f);
+        if (rec->flags & JOYBIN_BD_STATS) {
+            fprintf(f, ",\"byte_dist_mean\":%f,\"byte_dist_std\":%f",
+                    rec->byte_dist_mean, rec->byte_dist_std);
+        }
+    }
+    if (schema->fields & JOYBIN_COMPACT_BYTE_DIST) {
+        fputs(",\"compact_byte_dist\":[", f);
+        for (i = 0; i < 16; i++) {
+            fprintf(f, i ? ",%u" : "%u", rec->compact_byte_dist[i]);
+        }
+        fputc(']', f);
+    }
+    if ((schema->fields & JOYBIN_ENTROPY) && (rec->flags & JOYBIN_HAS_ENTROPY)) {
+        fprintf(f, ",\"entropy\":%f,\"total_entropy\":%f", rec->entropy, rec->total_entropy);
+    }
+    if (schema->fields & JOYBIN_P_MALWARE) {
+        fprintf(f, ",\"p_malware\":%f", rec->p_malware);
+    }
+
+    fputs(",\"ip\":{\"out\":", f);
+    print_ip_ids(f, rec->ttl_out, rec->id_out, rec->num_id_out);
+    if (twin) {
+        fputs(",\"in\":", f);
+        print_ip_ids(f, rec->ttl_in, rec->id_in, rec->num_id_in);
+    }
+    fputc('}', f);
+
+    if (rec->prot == 6) {
+        int out = rec->tcp_flags_out || rec->window_out;
+        int in = twin && (rec->tcp_flags_in || rec->window_in);
+
+        if (rec->first_seq || out || in) {
+            fputs(",\"tcp\":{", f);
+            if (rec->first_seq) {
+                fprintf(f, "\"first_seq\":%u", rec->first_seq);
+            }
+            if (out) {
+                fputs(rec->first_seq ? ",\"out\":" : "\"out\":", f);
+                print_tcp_dir(f, rec->tcp_flags_out, rec->window_out);
+            }
+            if (in) {
+                fputs((rec->first_seq || out) ? ",\"in\":" : "\"in\":", f);
+                print_tcp_dir(f, rec->tcp_flags_in, rec->window_in);
+            }
+            fputc('}', f);
+        }
+    }
+
+    if (schema->fields & JOYBIN_IDP) {
+        if (rec->flags & JOYBIN_IDP_OUT) {
+            fputs(",\"idp_out\":", f);
+            print_hex(f, rec->idp_out, rec->idp_len_out);
+            fprintf(f, ",\"idp_len_out\":%u", rec->idp_len_out);
+        }
+        if (rec->flags & JOYBIN_IDP_IN) {
+            fputs(",\"idp_in\":", f);
+            print_hex(f, rec->idp_in, rec->idp_len_in);
+            fprintf(f, ",\"idp_len_in\":%u", rec->idp_len_in);
+        }
+    }
+
+    if (rec->tcp_retrans || rec->invalid) {
+        fputs(",\"debug\":{", f);
+        if (rec->tcp_retrans) {
+            fprintf(f, "\"tcp_retrans\":%u", rec->tcp_retrans);
+        }
+        if (rec->invalid) {
+            fprintf(f, rec->tcp_retrans ? ",\"invalid\":%u" : "\"invalid\":%u", rec->invalid);
+        }
+        fputc('}', f);
+    }
+
+    if (rec->expire_type) {
+        fprintf(f, ",\"expire_type\":\"%c\"", rec->expire_type);
+    }
+
+    fputs("}\n", f);
+}
+
+#ifdef USE_GZIP
+#define joybin_open(fname) gzopen(fname, "rb")
+#define joybin_read(f, buf, len) gzread(f, buf, (unsigned int)(len))
+#define joybin_close(f) gzclose(f)
+#else
+#define joybin_open(fname) fopen(fname, "rb")
+#define joybin_read(f, buf, len) (int)fread(buf, 1, len, f)
+#define joybin_close(f) fclose(f)
+#endif
+
+/**
+ * \brief Get len bytes of the file into the buffer of a reader, from
+ * r->pos on, reading more of the file if need be.
+ * \param r Reader
+ * \param len Bytes needed
+ * \return 0, or -1 if the file ends first or there is no memory
+ */
+static int joybin_reader_fill (joybin_reader_t *r, size_t len) {
+    int n;
+
+    if (r->len - r->pos >= len) {
+        return 0;
+    }
+
+    /* move what is left to the front, and make room for the rest */
+    if (r->pos) {
+        memmove(r->buf, r->buf + r->pos, r->len - r->pos);
+        r->len -= r->pos;
+        r->pos = 0;
+    }
+    if (len > r->size) {
+        size_t size = len > 2 * r->size ? len : 2 * r->size;
+        uint8_t *buf = realloc(r->buf, size);
+
+        if (buf == NULL) {
+            return -1;
+        }
+        r->buf = buf;
+        r->size = size;
+    }
+
+    while (r->len < len) {
+        n = joybin_read(r->f, r->buf + r->len, r->size - r->len);
+        if (n <= 0) {
+            return -1;
+        }
+        r->len += (size_t)n;
+    }
+    return 0;
+}
+
+/**
+ * \brief Open a binary flow record file, gzip compressed or not, and
+ * read its header.
+ * \param r Reader
+ * \param fname Name of the file
+ * \return 0, or -1 if the file cannot be read or is not a binary flow record file
+ */
+int joybin_reader_open (joybin_reader_t *r, const char *fname) {
+    const uint8_t *p;
+    size_t schema_len, len;
+
+    memset_s(r, sizeof(*r), 0, sizeof(*r));
+    r->f = joybin_open(fname);
+    if (r->f == NULL) {
+        return -1;
+    }
+    r->buf = malloc(JOYBIN_READ_SIZE);
+    if (r->buf == NULL) {
+        joybin_reader_close(r);
+        return -1;
+    }
+    r->size = JOYBIN_READ_SIZE;
+
+    if (joybin_reader_fill(r, JOYBIN_PREAMBLE_LEN) ||
+        memcmp(r->buf, JOYBIN_MAGIC, 4) != 0 ||
+        (r->buf[4] | (r->buf[5] << 8)) != JOYBIN_VERSION) {
+        joybin_reader_close(r);
+        return -1;
+    }
+    schema_len = (size_t)(r->buf[6] | (r->buf[7] << 8));
+    r->pos = JOYBIN_PREAMBLE_LEN;
+    if (joybin_reader_fill(r, schema_len) ||
+        joybin_schema_decode(&r->schema, r->buf + r->pos, schema_len)) {
+        joybin_reader_close(r);
+        return -1;
+    }
+    r->pos += schema_len;
+
+    /* the configuration line */
+    len = 0;
+    do {
+        if (joybin_reader_fill(r, ++len)) {
+            joybin_reader_close(r);
+            return -1;
+        }
+        p = r->buf + r->pos;
+    } while (p[len - 1] != '\n');
+    r->config = malloc(len + 1);
+    if (r->config == NULL) {
+        joybin_reader_close(r);
+        return -1;
+    }
+    memcpy_s(r->config, len, p, len);
+    r->config[len] = 0;
+    r->pos += len;
+
+    return 0;
+}
+
+/**
+ * \brief Read and decode the next record of a file.
+ * \param r Reader
+ * \param rec Record to decode into; its idp_out and idp_in are good
+ * until the next call
+ * \return 1, 0 at the end of the file, or -1 if the file is cut short
+ * or malformed
+ */
+int joybin_reader_next (joybin_reader_t *r, joybin_record_t *rec) {
+    const uint8_t *p;
+    size_t len;
+
+    if (joybin_reader_fill(r, 4)) {
+        /* a clean end of file leaves nothing behind */
+        return r->len == r->pos ? 0 : -1;
+    }
+    p = r->buf + r->pos;
+    len = (size_t)p[0] | ((size_t)p[1] << 8) | ((size_t)p[2] << 16) | ((size_t)p[3] << 24);
+    if (joybin_reader_fill(r, 4 + len)) {
+        return -1;
+    }
+    p = r->buf + r->pos + 4;
+    r->pos += 4 + len;
+
+    return joybin_record_decode(rec, &r->schema, p, len) ? -1 : 1;
+}
+
+/**
+ * \brief Close a binary flow record file.
+ * \param r Reader
+ * \return none
+ */
+void joybin_reader_close (joybin_reader_t *r) {
+    if (r->f != NULL) {
+        joybin_close(r->f);
+        r->f = NULL;
+    }
+    free(r->buf);
+    r->buf = NULL;
+    r->size = r->len = r->pos = 0;
+    free(r->config);
+    r->config = NULL;
+}
+
+#define JOYBIN_TEST_FILE "joybin_test.bin"
+#define JOYBIN_TEST_CONFIG "{\"version\":\"test\",\"end-config\":1}\n"
+
+/*
+ * a UDP flow, which prints as flow_record_print_json() would print it
+ */
+static const char joybin_test_udp_json[] =
+    "{\"sa\":\"10.0.0.1\",\"da\":\"10.0.0.2\",\"pr\":17,\"sp\":53,\"dp\":4096,"
+    "\"bytes_out\":40000,\"num_pkts_out\":2,\"time_start\":1500000000.000042,"
+    "\"time_end\":1500000001.500000,\"packets\":[{\"b\":100,\"dir\":\"<\",\"ipt\":0},"
+    "{\"rep\":1,\"dir\":\"<\",\"ipt\":1499}],\"compact_byte_dist\":[0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,7],"
+    "\"p_malware\":0.250000,\"ip\":{\"out\":{\"ttl\":64,\"id\":[1,65535]}},"
+    "\"debug\":{\"invalid\":1},\"expire_type\":\"i\"}\n";
+
+static void joybin_test_records (joybin_record_t *udp, joybin_record_t *tcp) {
+    static const uint8_t idp[] = { 0x16, 0x03, 0x01, 0x00, 0xff };
+    unsigned int i;
+
+    memset_s(udp, sizeof(*udp), 0, sizeof(*udp));
+    udp->sa[0] = udp->da[0] = 10;
+    udp->sa[3] = 1;
+    udp->da[3] = 2;
+    udp->prot = 17;
+    udp->sp = 53;
+    udp->dp = 4096;
+    udp->bytes_out = 40000;
+    udp->num_pkts_out = 2;
+    udp->time_start = 1500000000000042LL;
+    udp->time_end = 1500000001500000LL;
+    udp->num_pkts = 2;
+    udp->pkts[0].len = 100;
+    udp->pkts[1].len = 65535;
+    udp->pkts[1].ipt = 1499;
+    udp->compact_byte_dist[15] = 7;
+    udp->p_malware = 0.25;
+    udp->ttl_out = 64;
+    udp->num_id_out = 2;
+    udp->id_out[0] = 1;
+    udp->id_out[1] = 65535;
+    udp->invalid = 1;
+    udp->expire_type = 'i';
+
+    memset_s(tcp, sizeof(*tcp), 0, sizeof(*tcp));
+    tcp->flags = JOYBIN_IPV6 | JOYBIN_TWIN | JOYBIN_BD_STATS | JOYBIN_HAS_ENTROPY |
+                 JOYBIN_IDP_OUT | JOYBIN_IDP_IN;
+    for (i = 0; i < 16; i++) {
+        tcp->sa[i] = (uint8_t)i;
+        tcp->da[i] = (uint8_t)(255 - i);
+    }
+    tcp->prot = 6;
+    tcp->sp = 443;
+    tcp->dp = 50000;
+    tcp->bytes_out = 4000000000U;
+    tcp->num_pkts_out = JOYBIN_MAX_PKTS / 2;
+    tcp->bytes_in = 1;
+    tcp->num_pkts_in = JOYBIN_MAX_PKTS / 2;
+    tcp->time_start = 1500000000000000LL;
+    tcp->time_end = tcp->time_start - 5;
+    tcp->num_pkts = JOYBIN_MAX_PKTS;
+    for (i = 0; i < JOYBIN_MAX_PKTS; i++) {
+        tcp->pkts[i].len = (uint16_t)(i * 331);
+        tcp->pkts[i].in = (uint8_t)(i & 1);
+        tcp->pkts[i].ipt = i * i * i;
+    }
+    for (i = 0; i < 256; i++) {
+        tcp->byte_dist[i] = (uint8_t)i;
+    }
+    tcp->byte_dist_mean = 127.5;
+    tcp->byte_dist_std = 1e-300;
+    tcp->entropy = 7.99999999;
+    tcp->total_entropy = 1234567.0000005;
+    tcp->ttl_out = 1;
+    tcp->ttl_in = 255;
+    tcp->num_id_out = JOYBIN_MAX_IP_ID;
+    tcp->num_id_in = 1;
+    for (i = 0; i < JOYBIN_MAX_IP_ID; i++) {
+        tcp->id_out[i] = (uint16_t)(i * 1000);
+    }
+    tcp->first_seq = 0xdeadbeef;
+    tcp->tcp_flags_out = 0x12;
+    tcp->window_in = 65535;
+    tcp->idp_out = idp;
+    tcp->idp_len_out = sizeof(idp);
+    tcp->idp_in = idp;
+    tcp->idp_len_in = 1;
+    tcp->tcp_retrans = 100000;
+}
+
+/**
+ * \brief Unit test for the binary flow record encoder and reader.
+ *
+ * Writes a file with a record of each kind, reads it back and checks
+ * that the records encode as they did, that a cut short record is not
+ * decoded, and that a record prints as it would in JSON.
+ *
+ * \param none
+ * \return Number of failures
+ */
+int joybin_unit_test (void) {
+    joybin_schema_t schema;
+    joybin_reader_t r;
+    joybin_record_t *rec = NULL;
+    uint8_t *buf = NULL, *buf2 = NULL;
+    size_t len[2], header_len, n;
+    char json[1024];
+    FILE *f = NULL;
+    int num_fails = 0;
+    unsigned int i;
+
+    fprintf(info, "\n******************************\n");
+    fprintf(info, "Binary flow record Unit Test starting...\n");
+
+    rec = malloc(3 * sizeof(*rec));
+    buf = malloc(2 * JOYBIN_RECORD_MAX);
+    buf2 = malloc(JOYBIN_RECORD_MAX);
+    if (rec == NULL || buf == NULL || buf2 == NULL) {
+        fprintf(info, "error: could not allocate the records\n");
+        num_fails++;
+        goto end;
+    }
+    joybin_test_records(&rec[0], &rec[1]);
+
+    memset_s(&schema, sizeof(schema), 0, sizeof(schema));
+    schema.num_pkts = JOYBIN_MAX_PKTS / 2;
+    schema.fields = JOYBIN_COMPACT_BYTE_DIST | JOYBIN_P_MALWARE;
+    strcpy_s(schema.omitted[schema.num_omitted++], JOYBIN_MAX_NAME, "dns");
+    strcpy_s(schema.omitted[schema.num_omitted++], JOYBIN_MAX_NAME, "tls");
+
+    /* the UDP record, printed as JSON */
+    len[0] = joybin_record_encode(buf, JOYBIN_RECORD_MAX, &schema, &rec[0]);
+    if (len[0] == 0 || joybin_record_decode(&rec[2], &schema, buf + 4, len[0] - 4)) {
+        fprintf(info, "error: could not encode and decode the UDP record\n");
+        num_fails++;
+    } else {
+        f = tmpfile();
+        if (f != NULL) {
+            joybin_record_print_json(f, &schema, &rec[2]);
+            rewind(f);
+            n = fread(json, 1, sizeof(json) - 1, f);
+            json[n] = 0;
+            fclose(f);
+            f = NULL;
+        }
+        if (strcmp(json, joybin_test_udp_json) != 0) {
+            fprintf(info, "error: the UDP record printed as\n%sinstead of\n%s", json, joybin_test_udp_json);
+            num_fails++;
+        }
+    }
+    if (joybin_record_decode(&rec[2], &schema, buf + 4, len[0] - 5) == 0) {
+        fprintf(info, "error: decoded a record that was cut short\n");
+        num_fails++;
+    }
+
+    /* both records, through a file */
+    schema.fields |= JOYBIN_BYTE_DIST | JOYBIN_ENTROPY | JOYBIN_IDP;
+    f = fopen(JOYBIN_TEST_FILE, "wb");
+    if (f == NULL) {
+        fprintf(info, "error: could not open %s\n", JOYBIN_TEST_FILE);
+        num_fails++;
+        goto end;
+    }
+    header_len = joybin_header_encode(buf2, JOYBIN_RECORD_MAX, &schema);
+    len[0] = joybin_record_encode(buf, JOYBIN_RECORD_MAX, &schema, &rec[0]);
+    len[1] = joybin_record_encode(buf + len[0], JOYBIN_RECORD_MAX, &schema, &rec[1]);
+    fwrite(buf2, 1, header_len, f);
+    fputs(JOYBIN_TEST_CONFIG, f);
+    fwrite(buf, 1, len[0] + len[1], f);
+    fclose(f);
+    f = NULL;
+
+    if (joybin_reader_open(&r, JOYBIN_TEST_FILE)) {
+        fprintf(info, "error: could not read the header of %s\n", JOYBIN_TEST_FILE);
+        num_fails++;
+        goto end;
+    }
+    if (r.schema.num_pkts != schema.num_pkts || r.schema.fields != schema.fields ||
+        r.schema.num_omitted != 2 || strcmp(r.schema.omitted[1], "tls") != 0 ||
+        strcmp(r.config, JOYBIN_TEST_CONFIG) != 0) {
+        fprintf(info, "error: the header did not read back as it was written\n");
+        num_fails++;
+    }
+    for (i = 0; i < 2; i++) {
+        if (joybin_reader_next(&r, &rec[2]) != 1) {
+            fprintf(info, "error: could not read record %u\n", i);
+            num_fails++;
+            break;
+        }
+        n = joybin_record_encode(buf2, JOYBIN_RECORD_MAX, &schema, &rec[2]);
+        if (n != len[i] || memcmp(buf2, buf + (i ? len[0] : 0), n) != 0) {
+            fprintf(info, "error: record %u did not read back as it was written\n", i);
+            num_fails++;
+        }
+    }
+    if (joybin_reader_next(&r, &rec[2]) != 0) {
+        fprintf(info, "error: read past the last record\n");
+        num_fails++;
+    }
+    joybin_reader_close(&r);
+
+ end:
+    remove(JOYBIN_TEST_FILE);
+    free(buf2);
+    free(buf);
+    free(rec);
+
+    if (num_fails) {
+        fprintf(info, "Finished - failures: %d\n", num_fails);
+    } else {
+        fprintf(info, "Finished - success\n");
+    }
+    fprintf(info, "******************************\n\n");
+
+    return num_fails;
+}
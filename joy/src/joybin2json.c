@@ -0,0 +1,155 @@
+/*
+ *      
+ * Copyright (c) 2016-2018 Cisco Systems, Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ *   Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 
+ *   Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials provided
+ *   with the distribution.
+ * 
+ *   Neither the name of the Cisco Systems, Inc. nor the names of its
+ *   contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+/**
+ * \file joybin2json.c
+ *
+ * \brief converts binary flow records back to JSON
+ *
+ ** \verbatim
+  joybin2json [ -c ] file [ file ... ]
+     file is binary flow record output of joy (format=binary), gzip
+     compressed or not; it is printed as the JSON that joy would have
+     written, minus what binary records do not carry
+     -c only counts the records of each file
+ \endverbatim
+ */
+#ifdef HAVE_CONFIG_H
+#include "joy_config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "joybin.h"
+
+/* where libjoy reports errors */
+extern FILE *info;
+
+static int usage (char *name) {
+    fprintf(stderr, "usage:\n%s [-c] <file> [ <file2> ... ]\n", name);
+    fprintf(stderr, "where:\n"
+                "   <file> contains binary flow records, written by joy with format=binary;\n"
+                "   they are printed as JSON\n\n"
+                "   -c causes the records of each file to be counted, not printed\n\n");
+    return 1;
+}
+
+/**
+ \fn int joybin2json (const char *fname, int count)
+ \brief prints or counts the records of a file
+ \param fname name of the file
+ \param count set to count the records, rather than print them
+ \return 0 success
+ \return 1 the file could not be read
+ */
+static int joybin2json (const char *fname, int count) {
+    joybin_reader_t r;
+    joybin_record_t *rec;
+    unsigned long long num_records = 0;
+    unsigned int i;
+    int status;
+
+    rec = malloc(sizeof(joybin_record_t));
+    if (rec == NULL) {
+        fprintf(stderr, "error: out of memory\n");
+        return 1;
+    }
+    if (joybin_reader_open(&r, fname)) {
+        fprintf(stderr, "error: %s is not a binary flow record file\n", fname);
+        free(rec);
+        return 1;
+    }
+
+    if (!count) {
+        fputs(r.config, stdout);
+    } else if (r.schema.num_omitted) {
+        fprintf(stderr, "%s: not carried:", fname);
+        for (i = 0; i < r.schema.num_omitted; i++) {
+            fprintf(stderr, " %s", r.schema.omitted[i]);
+        }
+        fprintf(stderr, "\n");
+    }
+    while ((status = joybin_reader_next(&r, rec)) == 1) {
+        if (!count) {
+            joybin_record_print_json(stdout, &r.schema, rec);
+        }
+        num_records++;
+    }
+    joybin_reader_close(&r);
+    free(rec);
+
+    if (count) {
+        printf("%s: %llu records\n", fname, num_records);
+    }
+    if (status < 0) {
+        fprintf(stderr, "error: %s is cut short or malformed after %llu records\n",
+                fname, num_records);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ \fn int main (int argc, char *argv[])
+ \brief converts each file named on the command line
+ \param argc command line argument count
+ \param argv command line arguments
+ \return 1 usage, or a file could not be read
+ \return 0 success
+ */
+int main (int argc, char *argv[]) {
+    int count = 0, opt, i, status = 0;
+
+    info = stderr;
+
+    while ((opt = getopt(argc, argv, "c")) != -1) {
+        switch (opt) {
+            case 'c':
+                count = 1;
+                break;
+            default:
+                return usage(argv[0]);
+        }
+    }
+    if (optind >= argc) {
+        return usage(argv[0]);
+    }
+
+    for (i = optind; i < argc; i++) {
+        status |= joybin2json(argv[i], count);
+    }
+    return status;
+}
@@ -0,0 +1,428 @@
+/*
+ *
+ * Copyright (c) 2018 Cisco Systems, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials provided
+ *   with the distribution.
+ *
+ *   Neither the name of the Cisco Systems, Inc. nor the names of its
+ *   contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/**
+ * \file json_bench.c
+ *
+ * \brief benchmark for the JSON output of flow records
+ *
+ ** Measures the rate, in records per second, at which flow records are
+ *  written out by joy_print_flow_data(), for the MOTIF configuration
+ *  (bidir=1 num_pkts=50) and for one that adds 200 packet lengths and
+ *  times, the byte distribution and the entropy.  The records go to a
+ *  file in the given directory (/tmp/ by default), compressed if the
+ *  library was built that way, and the file is removed afterwards.
+ *
+ *  It also compares the cost of formatting the packet array and byte
+ *  distribution of a record with a zprintf() for each element, as
+ *  flow_record_print_json() used to, with a json_buf_t that is written
+ *  out once, both to /dev/null through this program's own zfile.
+ *
+ *  usage: json_bench [-r runs] [-o output_dir] [num_flows]
+ *
+ *  The packets are made up in memory and the flow records are filled
+ *  in before the clock is started, so only the output is measured.
+ *  Each figure is the best of the runs (5 by default).
+ */
+#ifdef HAVE_CONFIG_H
+#include "joy_config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "safe_lib.h"
+#include "p2f.h"
+#include "config.h"
+#include "pkt_proc.h"
+#include "joy_api.h"
+#include "json_buf.h"
+
+/** packets of each flow, half in each direction */
+#define BENCH_PKTS_PER_FLOW 64
+
+/** room for an ethernet, IPv4 and TCP header and a payload of up to 1024 bytes */
+#define BENCH_PKT_LEN (14 + 20 + 20 + 1024)
+
+/** name of the output file, in the output directory */
+#define BENCH_OUTPUT_FILE "json_bench"
+
+typedef struct bench_pkts_ {
+    unsigned int num;
+    struct pcap_pkthdr *headers;
+    unsigned char *data;
+    joy_packet_desc_t *descs;
+} bench_pkts_t;
+
+/*
+ * xorshift64, so that runs are repeatable
+ */
+static uint64_t bench_rand (uint64_t *state) {
+    uint64_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+static void bench_put16 (unsigned char *p, unsigned int x) {
+    p[0] = (unsigned char)(x >> 8);
+    p[1] = (unsigned char)x;
+}
+
+static void bench_put32 (unsigned char *p, uint32_t x) {
+    bench_put16(p, x >> 16);
+    bench_put16(p + 2, x & 0xffff);
+}
+
+/**
+ * \brief Make up the packets of num_flows TCP conversations, with
+ *        requests and responses of random lengths, and the packets of
+ *        the flows interleaved.
+ * \param pkts filled in with the packets
+ * \param num_flows number of flows
+ * \return 0 on success, 1 on error
+ */
+static int bench_make_packets (bench_pkts_t *pkts, unsigned int num_flows) {
+    uint64_t state = 0x9e3779b97f4a7c15ULL;
+    unsigned int i, n = num_flows * BENCH_PKTS_PER_FLOW;
+
+    pkts->num = n;
+    pkts->headers = calloc(n, sizeof(struct pcap_pkthdr));
+    pkts->data = calloc(n, BENCH_PKT_LEN);
+    pkts->descs = calloc(n, sizeof(joy_packet_desc_t));
+    if (pkts->headers == NULL || pkts->data == NULL || pkts->descs == NULL) {
+        fprintf(stderr, "error: could not allocate memory for %u packets\n", n);
+        return 1;
+    }
+
+    for (i = 0; i < n; i++) {
+        unsigned char *p = pkts->data + (size_t)i * BENCH_PKT_LEN;
+        unsigned int flow = i % num_flows, seq = i / num_flows, j;
+        unsigned int len = seq ? bench_rand(&state) % 1024 : 0;
+        uint32_t client = 0x0a000000 | flow, server = 0xc0a80000 | (flow & 0xff);
+        unsigned int cport = 1024 + (flow & 0x7fff), sport = 443;
+        int reply = seq & 1;
+
+        /* ethernet */
+        memset_s(p, 12, 0x02, 12);
+        bench_put16(p + 12, 0x0800);
+
+        /* IPv4, requests from one of many clients and replies from one of a few servers */
+        p[14] = 0x45;
+        bench_put16(p + 16, 40 + len);
+        bench_put16(p + 18, (unsigned int)bench_rand(&state));
+        p[22] = 64;
+        p[23] = 6;
+        bench_put32(p + 26, reply ? server : client);
+        bench_put32(p + 30, reply ? client : server);
+
+        /* TCP, a SYN, a SYN/ACK and then data */
+        bench_put16(p + 34, reply ? sport : cport);
+        bench_put16(p + 36, reply ? cport : sport);
+        bench_put32(p + 38, 1000 + seq * 1024);
+        bench_put32(p + 42, seq ? 1 : 0);
+        p[46] = 0x50;
+        p[47] = seq > 1 ? 0x18 : (seq ? 0x12 : 0x02);
+        bench_put16(p + 48, 65535);
+        for (j = 0; j < len; j += 8) {
+            uint64_t r = bench_rand(&state);
+
+            memcpy_s(p + 54 + j, 8, &r, 8);
+        }
+
+        pkts->headers[i].ts.tv_sec = 1500000000 + i / 100000;
+        pkts->headers[i].ts.tv_usec = (i % 100000) * 10;
+        pkts->headers[i].caplen = pkts->headers[i].len = 54 + len;
+        if (!joy_decode_packet(&pkts->headers[i], p, &pkts->descs[i])) {
+            fprintf(stderr, "error: packet %u did not decode\n", i);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * The MOTIF configuration: bidirectional flows, 50 packet lengths and
+ * times, and nothing else
+ */
+static void bench_config_motif (void) {
+    glb_config->num_pkts = 50;
+    glb_config->byte_distribution = 0;
+    glb_config->report_entropy = 0;
+}
+
+/*
+ * Every packet length and time that a record can keep, the byte
+ * distribution and the entropy
+ */
+static void bench_config_dist (void) {
+    glb_config->num_pkts = MAX_NUM_PKT_LEN;
+    glb_config->byte_distribution = 1;
+    glb_config->report_entropy = 1;
+}
+
+static double bench_elapsed (const struct timeval *start) {
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return (double)(now.tv_sec - start->tv_sec) + (double)(now.tv_usec - start->tv_usec) / 1e6;
+}
+
+/**
+ * \brief Fill in flow records from the packets, and time writing them out.
+ * \param pkts packets
+ * \return the time taken, in seconds
+ */
+static double bench_print (const bench_pkts_t *pkts) {
+    uint64_t index = 0;
+    struct timeval start;
+    unsigned int i;
+
+    for (i = 0; i < pkts->num; i++) {
+        joy_process_decoded_packet((unsigned char *)index, &pkts->headers[i],
+                                   pkts->data + (size_t)i * BENCH_PKT_LEN, &pkts->descs[i], 0, NULL);
+    }
+
+    gettimeofday(&start, NULL);
+    joy_print_flow_data(0, JOY_ALL_FLOWS);
+    return bench_elapsed(&start);
+}
+
+/**
+ * \brief Measure the output of one configuration.
+ * \param name name of the configuration
+ * \param config function that sets the configuration
+ * \param pkts packets
+ * \param num_flows number of flow records that the packets make
+ * \param runs number of runs
+ * \return 0 on success, 1 on error
+ */
+static int bench_run (const char *name, void (*config)(void), const bench_pkts_t *pkts,
+                      unsigned int num_flows, unsigned int runs) {
+    double best = -1.0;
+    unsigned int r;
+
+    config();
+    if (pkt_proc_set_pipeline(PKT_PIPELINE_AUTO) != 0) {
+        fprintf(stderr, "error: no pipeline for the %s configuration\n", name);
+        return 1;
+    }
+    for (r = 0; r < runs; r++) {
+        double seconds = bench_print(pkts);
+
+        if (best < 0.0 || seconds < best) {
+            best = seconds;
+        }
+    }
+
+    printf("%-6s | %9.0f records/s\n", name, num_flows / best);
+    return 0;
+}
+
+/*
+ * The packet array and byte distribution of a record, with a zprintf()
+ * for each element
+ */
+static void bench_format_zprintf (zfile f, const uint16_t *len, const uint32_t *ipt,
+                                  unsigned int num_pkts, const uint8_t *bd) {
+    unsigned int i;
+
+    zprintf(f, "{\"packets\":[");
+    for (i = 0; i < num_pkts; i++) {
+        zprintf(f, "{\"b\":%u,\"dir\":\"%s\",\"ipt\":%u}%s",
+                len[i], (i & 1) ? "<" : ">", ipt[i], i < num_pkts - 1 ? "," : "");
+    }
+    zprintf(f, "]");
+    zprintf(f, ",\"byte_dist\":[");
+    for (i = 0; i < 255; i++) {
+        zprintf(f, "%u,", bd[i]);
+    }
+    zprintf(f, "%u]", bd[i]);
+    zprintf(f, "}\n");
+}
+
+/*
+ * The same, put together in a json_buf_t and written out once
+ */
+static void bench_format_json_buf (zfile f, json_buf_t *json, const uint16_t *len, const uint32_t *ipt,
+                                   unsigned int num_pkts, const uint8_t *bd) {
+    unsigned int i;
+
+    json_buf_puts(json, "{\"packets\":[");
+    for (i = 0; i < num_pkts; i++) {
+        json_buf_puts(json, "{\"b\":");
+        json_buf_uint(json, len[i]);
+        json_buf_puts(json, (i & 1) ? ",\"dir\":\"<\",\"ipt\":" : ",\"dir\":\">\",\"ipt\":");
+        json_buf_uint(json, ipt[i]);
+        json_buf_putc(json, '}');
+        if (i < num_pkts - 1) {
+            json_buf_putc(json, ',');
+        }
+    }
+    json_buf_puts(json, "],\"byte_dist\":[");
+    for (i = 0; i < 255; i++) {
+        json_buf_uint(json, bd[i]);
+        json_buf_putc(json, ',');
+    }
+    json_buf_uint(json, bd[i]);
+    json_buf_puts(json, "]}\n");
+
+    /* as json_buf_commit(), with the output of this program */
+    zwrite(f, json->data, json->len);
+    json->len = 0;
+}
+
+/**
+ * \brief Compare formatting with zprintf() and with a json_buf_t.
+ * \param num_records number of records to format with each
+ * \return 0 on success, 1 on error
+ */
+static int bench_format (unsigned int num_records) {
+    uint16_t len[50];
+    uint32_t ipt[50];
+    uint8_t bd[256];
+    uint64_t state = 0x2545f4914f6cdd1dULL;
+    double seconds[2];
+    struct timeval start;
+    json_buf_t json;
+    zfile f;
+    unsigned int i;
+
+    for (i = 0; i < 50; i++) {
+        len[i] = (uint16_t)(bench_rand(&state) % 1500);
+        ipt[i] = (uint32_t)(bench_rand(&state) % 300);
+    }
+    for (i = 0; i < 256; i++) {
+        bd[i] = (uint8_t)bench_rand(&state);
+    }
+    f = zopen("/dev/null", "w");
+    if (f == NULL || json_buf_init(&json, JSON_BUF_INITIAL_SIZE) != ok) {
+        fprintf(stderr, "error: could not set up the format comparison\n");
+        if (f) {
+            zclose(f);
+        }
+        return 1;
+    }
+
+    gettimeofday(&start, NULL);
+    for (i = 0; i < num_records; i++) {
+        bench_format_zprintf(f, len, ipt, 50, bd);
+    }
+    seconds[0] = bench_elapsed(&start);
+
+    gettimeofday(&start, NULL);
+    for (i = 0; i < num_records; i++) {
+        bench_format_json_buf(f, &json, len, ipt, 50, bd);
+    }
+    seconds[1] = bench_elapsed(&start);
+
+    printf("format | zprintf %9.0f records/s | json_buf %9.0f records/s | %.2fx\n",
+           num_records / seconds[0], num_records / seconds[1], seconds[0] / seconds[1]);
+
+    json_buf_free(&json);
+    zclose(f);
+    return 0;
+}
+
+/**
+ * \fn int main (int argc, char* argv[])
+ * \brief main entry point for the JSON output benchmark
+ * \return 0 on success, 1 on error
+ */
+int main (int argc, char *argv[]) {
+    joy_init_t init_data;
+    bench_pkts_t pkts;
+    const char *output_dir = "/tmp/";
+    char output_filename[MAX_FILENAME_LEN];
+    unsigned long num_flows = 10000, runs = 5;
+    int i, rc = 0;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            runs = strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            output_dir = argv[++i];
+        } else {
+            num_flows = strtoul(argv[i], NULL, 0);
+        }
+    }
+    if (runs == 0 || num_flows == 0 || num_flows > 0x7fff) {
+        fprintf(stderr, "usage: %s [-r runs] [-o output_dir] [num_flows]\n", argv[0]);
+        return 1;
+    }
+
+    /* setup the joy options we want */
+    memset_s(&init_data, sizeof(joy_init_t), 0x00, sizeof(joy_init_t));
+    init_data.verbosity = JOY_LOG_ERR;
+    init_data.contexts = 1;
+    init_data.num_pkts = 50;
+    init_data.bitmask = JOY_BIDIR_ON;
+
+    /* intialize joy */
+    if (joy_initialize(&init_data, output_dir, BENCH_OUTPUT_FILE, NULL) != 0) {
+        printf(" -= Joy Initialized Failed =-\n");
+        return -1;
+    }
+
+    memset_s(&pkts, sizeof(pkts), 0x00, sizeof(pkts));
+    if (bench_make_packets(&pkts, (unsigned int)num_flows) == 0) {
+        printf("%lu bidirectional flows of %u packets\n", num_flows, BENCH_PKTS_PER_FLOW);
+        rc |= bench_run("motif", bench_config_motif, &pkts, (unsigned int)num_flows, (unsigned int)runs);
+        rc |= bench_run("dist", bench_config_dist, &pkts, (unsigned int)num_flows, (unsigned int)runs);
+        rc |= bench_format((unsigned int)num_flows * 10);
+    } else {
+        rc = 1;
+    }
+    free(pkts.headers);
+    free(pkts.data);
+    free(pkts.descs);
+
+    joy_context_cleanup(0);
+    joy_shutdown();
+
+    /* the library may add a suffix for compressed output */
+    snprintf(output_filename, sizeof(output_filename), "%s%s.ctx0", output_dir, BENCH_OUTPUT_FILE);
+    remove(output_filename);
+    snprintf(output_filename, sizeof(output_filename), "%s%s.ctx0.gz", output_dir, BENCH_OUTPUT_FILE);
+    remove(output_filename);
+    snprintf(output_filename, sizeof(output_filename), "%s%s.ctx0.bz2", output_dir, BENCH_OUTPUT_FILE);
+    remove(output_filename);
+    return rc;
+}
@@ -0,0 +1,462 @@
+/*
+ *
+ * Copyright (c) 2018 Cisco Systems, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials provided
+ *   with the distribution.
+ *
+ *   Neither the name of the Cisco Systems, Inc. nor the names of its
+ *   contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/**
+ * \file json_buf.c
+ *
+ * \brief growable buffer in which a JSON flow record is put together
+ *
+ ** The number formatting matches what the zprintf() formats that it
+ *  replaces printed, byte for byte; json_buf_unit_test() holds it to
+ *  that against snprintf().  Doubles are converted exactly, by scaling
+ *  the significand by a million in 128 bits and rounding half to even
+ *  as the C library does; the few values that do not fit that, such
+ *  as infinities and numbers beyond 2^64, go through snprintf().
+ *
+ */
+
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include "safe_lib.h"
+#include "p2f.h"
+#include "json_buf.h"
+#include "err.h"
+
+/** room for the digits of a 64 bit integer, a sign and a fraction */
+#define JSON_BUF_NUM_LEN 48
+
+static const char json_buf_hex_digits[] = "0123456789abcdef";
+
+/**
+ * \brief Allocate the buffer.
+ * \param b Buffer to initialize
+ * \param size Number of bytes to start with
+ * \return ok, or failure if there is not enough memory
+ */
+joy_status_e json_buf_init (json_buf_t *b, size_t size) {
+    b->len = 0;
+    b->failed = 0;
+    b->data = malloc(size);
+    if (b->data == NULL) {
+        b->size = 0;
+        return failure;
+    }
+    b->size = size;
+
+    return ok;
+}
+
+/**
+ * \brief Release the buffer.
+ * \param b Buffer to release
+ * \return none
+ */
+void json_buf_free (json_buf_t *b) {
+    free(b->data);
+    b->data = NULL;
+    b->len = b->size = 0;
+}
+
+/**
+ * \brief Make room for more bytes, doubling the buffer until they fit.
+ *
+ * If the memory cannot be had, the buffer is marked as failed, and what
+ * is appended from then on is dropped until json_buf_commit().
+ *
+ * \param b Buffer
+ * \param len Number of bytes that are about to be appended
+ * \return 1 if there is room, 0 if not
+ */
+int json_buf_grow (json_buf_t *b, size_t len) {
+    size_t size = b->size ? b->size : JSON_BUF_INITIAL_SIZE;
+    char *data;
+
+    if (b->failed) {
+        return 0;
+    }
+    while (size - b->len < len) {
+        size *= 2;
+    }
+    data = realloc(b->data, size);
+    if (data == NULL) {
+        b->failed = 1;
+        return 0;
+    }
+    b->data = data;
+    b->size = size;
+
+    return 1;
+}
+
+/**
+ * \brief Write what is in the buffer to the output, and empty the buffer.
+ *
+ * A record that could not be put together in full is not written, as
+ * half a record would make the rest of the file unreadable.
+ *
+ * \param b Buffer
+ * \param f Output
+ * \return none
+ */
+void json_buf_commit (json_buf_t *b, zfile f) {
+    if (b->failed) {
+        joy_log_err("out of memory for a %zu byte record, dropping it", b->len);
+    } else if (b->len) {
+        zwrite(f, b->data, b->len);
+    }
+    b->len = 0;
+    b->failed = 0;
+}
+
+/*
+ * Write the decimal digits of x, right aligned, so that they end at
+ * end; returns where they start.
+ */
+static char *json_buf_digits (char *end, uint64_t x) {
+    do {
+        *--end = (char)('0' + x % 10);
+        x /= 10;
+    } while (x);
+    return end;
+}
+
+/**
+ * \brief Append an unsigned integer.
+ * \param b Buffer
+ * \param x Integer
+ * \return none
+ */
+void json_buf_uint (json_buf_t *b, uint64_t x) {
+    char num[JSON_BUF_NUM_LEN];
+    char *end = num + sizeof(num);
+    char *start = json_buf_digits(end, x);
+
+    json_buf_write(b, start, end - start);
+}
+
+/**
+ * \brief Append a signed integer.
+ * \param b Buffer
+ * \param x Integer
+ * \return none
+ */
+void json_buf_int (json_buf_t *b, int64_t x) {
+    char num[JSON_BUF_NUM_LEN];
+    char *end = num + sizeof(num);
+    char *start;
+
+    if (x < 0) {
+        start = json_buf_digits(end, 0 - (uint64_t)x);
+        *--start = '-';
+    } else {
+        start = json_buf_digits(end, (uint64_t)x);
+    }
+    json_buf_write(b, start, end - start);
+}
+
+/*
+ * Append an integer part and six digits of fraction, the fraction
+ * given in millionths.
+ */
+static void json_buf_fixed6 (json_buf_t *b, int negative, uint64_t whole, uint32_t millionths) {
+    char num[JSON_BUF_NUM_LEN];
+    char *end = num + sizeof(num);
+    char *start = end - 6;
+    unsigned int i;
+
+    for (i = 0; i < 6; i++) {
+        start[5 - i] = (char)('0' + millionths % 10);
+        millionths /= 10;
+    }
+    *--start = '.';
+    start = json_buf_digits(start, whole);
+    if (negative) {
+        *--start = '-';
+    }
+    json_buf_write(b, start, end - start);
+}
+
+/**
+ * \brief Append a double with six digits after the point.
+ * \param b Buffer
+ * \param x Number
+ * \return none
+ */
+void json_buf_double (json_buf_t *b, double x) {
+    uint64_t bits, m, lo, hi, n, rest, half, a, c;
+    int negative, e;
+    unsigned int k;
+
+    memcpy_s(&bits, sizeof(bits), &x, sizeof(x));
+    negative = (int)(bits >> 63);
+    e = (int)((bits >> 52) & 0x7ff);
+    m = bits & (((uint64_t)1 << 52) - 1);
+    if (e == 0x7ff) {
+        json_buf_printf(b, "%f", x);
+        return;
+    }
+    if (e == 0) {
+        e = -1074;
+    } else {
+        m |= (uint64_t)1 << 52;
+        e -= 1075;
+    }
+
+    /* the number is m * 2^e */
+    if (e >= 0) {
+        if (e > 11) {
+            json_buf_printf(b, "%f", x);
+            return;
+        }
+        json_buf_fixed6(b, negative, m << e, 0);
+        return;
+    }
+
+    /* a million times the significand, in 128 bits as hi:lo */
+    a = (m >> 32) * 1000000;
+    c = (m & 0xffffffff) * 1000000;
+    lo = (a << 32) + c;
+    hi = (a >> 32) + (lo < c);
+
+    /* divide by 2^k, and round half to even */
+    k = (unsigned int)-e;
+    if (k > 74) {
+        /* less than half a millionth */
+        n = 0;
+    } else if (k >= 64) {
+        k -= 64;
+        n = k ? hi >> k : hi;
+        half = k ? (uint64_t)1 << (k - 1) : 0;
+        rest = k ? hi & (((uint64_t)1 << k) - 1) : 0;
+        if (k == 0) {
+            /* the top bit of lo is the half */
+            if ((lo >> 63) && ((lo << 1) || (n & 1))) {
+                n++;
+            }
+        } else if (rest > half || (rest == half && (lo || (n & 1)))) {
+            n++;
+        }
+    } else {
+        if (hi >> k) {
+            json_buf_printf(b, "%f", x);
+            return;
+        }
+        n = (lo >> k) | (hi << (64 - k));
+        half = (uint64_t)1 << (k - 1);
+        rest = lo & (((uint64_t)1 << k) - 1);
+        if (rest > half || (rest == half && (n & 1))) {
+            n++;
+        }
+    }
+    json_buf_fixed6(b, negative, n / 1000000, (uint32_t)(n % 1000000));
+}
+
+/**
+ * \brief Append a time as seconds and microseconds.
+ * \param b Buffer
+ * \param sec Seconds
+ * \param usec Microseconds, from 0 to 999999
+ * \return none
+ */
+void json_buf_time (json_buf_t *b, int64_t sec, long usec) {
+    if (sec < 0 || usec < 0 || usec > 999999) {
+        json_buf_printf(b, "%lld.%06ld", (long long)sec, usec);
+        return;
+    }
+    json_buf_fixed6(b, 0, (uint64_t)sec, (uint32_t)usec);
+}
+
+/**
+ * \brief Append data as a quoted string of hex digits.
+ * \param b Buffer
+ * \param data The data to append
+ * \param len Length of the data (in bytes)
+ * \return none
+ */
+void json_buf_hex (json_buf_t *b, const unsigned char *data, unsigned int len) {
+    char *out;
+    unsigned int i;
+
+    if (b->size - b->len < 2 * (size_t)len + 2 && !json_buf_grow(b, 2 * (size_t)len + 2)) {
+        return;
+    }
+    out = b->data + b->len;
+    *out++ = '"';   /* quotes needed for JSON */
+    for (i = 0; i < len; i++) {
+        *out++ = json_buf_hex_digits[data[i] >> 4];
+        *out++ = json_buf_hex_digits[data[i] & 0x0f];
+    }
+    *out++ = '"';
+    b->len = out - b->data;
+}
+
+/**
+ * \brief Append formatted text.
+ * \param b Buffer
+ * \param format printf() format
+ * \return none
+ */
+void json_buf_printf (json_buf_t *b, const char *format, ...) {
+    va_list args;
+    int n;
+
+    va_start(args, format);
+    n = vsnprintf(b->data + b->len, b->size - b->len, format, args);
+    va_end(args);
+    if (n < 0) {
+        return;
+    }
+    if ((size_t)n >= b->size - b->len) {
+        if (!json_buf_grow(b, (size_t)n + 1)) {
+            return;
+        }
+        va_start(args, format);
+        vsnprintf(b->data + b->len, b->size - b->len, format, args);
+        va_end(args);
+    }
+    b->len += n;
+}
+
+/*
+ * Compare what the buffer holds with what snprintf() makes of the
+ * same value; returns 1 if they differ.
+ */
+static int json_buf_test_same (json_buf_t *b, const char *expected, const char *what) {
+    int differ = b->len != strlen(expected) || memcmp(b->data, expected, b->len) != 0;
+
+    if (differ) {
+        joy_log_err("%s: got \"%.*s\", expected \"%s\"", what, (int)b->len, b->data, expected);
+    }
+    b->len = 0;
+    return differ;
+}
+
+int json_buf_unit_test (void) {
+    static const double doubles[] = {
+        0.0, -0.0, 1.0, -1.0, 0.5, 0.0000005, 0.0000015, 0.0000025, -0.0000005,
+        0.1, 0.3, 2.5e-7, 1e-300, 4.9e-324, 123.4567895, 7.99999999,
+        1234567.0000005, 9007199254740993.0, 18446744073709549568.0,
+        1e20, 1e300, 3.14159265358979, 255.999999500001, 8.0
+    };
+    static const uint64_t uints[] = {
+        0, 1, 9, 10, 99, 100, 65535, 4294967295ULL, 18446744073709551615ULL
+    };
+    unsigned char bytes[256];
+    char expected[1024];
+    json_buf_t b;
+    uint64_t state = 0x9e3779b97f4a7c15ULL;
+    unsigned int i;
+    int num_fails = 0;
+
+    fprintf(info, "\n******************************\n");
+    fprintf(info, "JSON buffer Unit Test starting...\n");
+
+    /* start small, so that every kind of append has to grow it */
+    if (json_buf_init(&b, 4) != ok) {
+        joy_log_err("could not allocate the buffer");
+        fprintf(info, "Finished - failures: 1\n");
+        fprintf(info, "******************************\n\n");
+        return 1;
+    }
+
+    for (i = 0; i < sizeof(uints) / sizeof(uints[0]); i++) {
+        json_buf_uint(&b, uints[i]);
+        snprintf(expected, sizeof(expected), "%llu", (unsigned long long)uints[i]);
+        num_fails += json_buf_test_same(&b, expected, "uint");
+
+        json_buf_int(&b, -(int64_t)(uints[i] >> 1) - 1);
+        snprintf(expected, sizeof(expected), "%lld", -(long long)(uints[i] >> 1) - 1);
+        num_fails += json_buf_test_same(&b, expected, "int");
+    }
+
+    for (i = 0; i < sizeof(doubles) / sizeof(doubles[0]); i++) {
+        json_buf_double(&b, doubles[i]);
+        snprintf(expected, sizeof(expected), "%f", doubles[i]);
+        num_fails += json_buf_test_same(&b, expected, "double");
+    }
+
+    /* doubles of every magnitude, and ones half way between two outputs */
+    for (i = 0; i < 100000; i++) {
+        double x;
+
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        if (i & 1) {
+            x = (double)(state >> 40) / 2000000.0;
+        } else {
+            memcpy_s(&x, sizeof(x), &state, sizeof(state));
+        }
+        json_buf_double(&b, x);
+        snprintf(expected, sizeof(expected), "%f", x);
+        if (json_buf_test_same(&b, expected, "double")) {
+            num_fails++;
+            break;
+        }
+    }
+
+    json_buf_time(&b, 1500000000, 42);
+    num_fails += json_buf_test_same(&b, "1500000000.000042", "time");
+
+    for (i = 0; i < sizeof(bytes); i++) {
+        bytes[i] = (unsigned char)(i * 7);
+    }
+    json_buf_hex(&b, bytes, sizeof(bytes));
+    expected[0] = '"';
+    for (i = 0; i < sizeof(bytes); i++) {
+        snprintf(expected + 1 + 2 * i, 3, "%02x", bytes[i]);
+    }
+    expected[1 + 2 * sizeof(bytes)] = '"';
+    expected[2 + 2 * sizeof(bytes)] = 0;
+    num_fails += json_buf_test_same(&b, expected, "hex");
+
+    json_buf_puts(&b, "{\"b\":");
+    json_buf_printf(&b, "%u,\"dir\":\"%s\"", 1500, "<");
+    json_buf_putc(&b, '}');
+    num_fails += json_buf_test_same(&b, "{\"b\":1500,\"dir\":\"<\"}", "string");
+
+    json_buf_free(&b);
+
+    if (num_fails) {
+        fprintf(info, "Finished - failures: %d\n", num_fails);
+    } else {
+        fprintf(info, "Finished - success\n");
+    }
+    fprintf(info, "******************************\n\n");
+
+    return num_fails;
+}
@@ -61,6 +61,7 @@
 #include "tls.h"
 #include "config.h"
 #include "err.h"
+#include "joy_api_private.h"
 
 /*
  * External objects, defined in joy
@@ -204,8 +205,8 @@ static void nfv9_process_times (flow_record_t *nf_record,
         if (tmp_packet_length < 0 && tmp_packet_length != -32768) {
             int repeated_length = tmp_packet_length * -1 - 1;
             while (repeated_length > 0) {
-                if (pkt_time_index < MAX_NUM_PKT_LEN) {
-                    nf_record->pkt_time[pkt_time_index] = *old_val_time;
+                if (pkt_time_index < nf_record->pkt_cap) {
+                    nf_record->pkt_time[pkt_time_index] = joy_time_delta(&nf_record->pkt_time_base, old_val_time);
                     pkt_time_index++;
                 } else {
                     break;
@@ -225,8 +226,8 @@ static void nfv9_process_times (flow_record_t *nf_record,
                 old_val_time->tv_usec %= 1000000;
             }
       
-            if (pkt_time_index < MAX_NUM_PKT_LEN) {
-                nf_record->pkt_time[pkt_time_index] = *old_val_time;
+            if (pkt_time_index < nf_record->pkt_cap) {
+                nf_record->pkt_time[pkt_time_index] = joy_time_delta(&nf_record->pkt_time_base, old_val_time);
                 pkt_time_index++;
             } else {
                 break;
@@ -237,8 +238,8 @@ static void nfv9_process_times (flow_record_t *nf_record,
             repeated_times = tmp_packet_time * -1;
             int k;
             for (k = 0; k < repeated_times; k++) {
-                if (pkt_time_index < MAX_NUM_PKT_LEN) {
-                    nf_record->pkt_time[pkt_time_index] = *old_val_time;
+                if (pkt_time_index < nf_record->pkt_cap) {
+                    nf_record->pkt_time[pkt_time_index] = joy_time_delta(&nf_record->pkt_time_base, old_val_time);
                     pkt_time_index++;
                 } else {
                     break;
@@ -262,7 +263,7 @@ static void nfv9_process_lengths (flow_record_t *nf_record,
                 nf_record->op += 1;
             }
             old_val = tmp_packet_length;
-            if (pkt_len_index < MAX_NUM_PKT_LEN) {
+            if (pkt_len_index < nf_record->pkt_cap) {
                 nf_record->pkt_len[pkt_len_index] = tmp_packet_length;
                 pkt_len_index++;
             } else {
@@ -279,7 +280,7 @@ static void nfv9_process_lengths (flow_record_t *nf_record,
             nf_record->op += repeated_length;
             int k;
             for (k = 0; k < repeated_length; k++) {
-                if (pkt_len_index < MAX_NUM_PKT_LEN) {
+                if (pkt_len_index < nf_record->pkt_cap) {
                     nf_record->pkt_len[pkt_len_index] = old_val;
                     pkt_len_index++;
                 } else {
@@ -339,6 +340,8 @@ static int nfv9_process_flow_time_milli(const void *flow_data,
 void nfv9_flow_key_init (flow_key_t *key, 
       const struct nfv9_template *cur_template, const char *flow_data) {
     int i;
+
+    memset_s(key, sizeof(flow_key_t), 0x00, sizeof(flow_key_t));
     for (i = 0; i < cur_template->hdr.FieldCount; i++) {
         switch (htons(cur_template->fields[i].FieldType)) {
             case IPV4_SRC_ADDR:
@@ -449,21 +452,24 @@ static int nfv9_skip_idp_header(flow_record_t *nf_record,
 }
 
 /**
- * \fn void nfv9_process_flow_record (flow_record_t *nf_record, 
+ * \fn void nfv9_process_flow_record (joy_ctx_data *ctx, flow_record_t *nf_record, 
         const struct nfv9_template *cur_template, const void *header,
         unsigned int header_len, const void *flow_data, int record_num)
+ * \param ctx context the record belongs to
  * \param nf_record
  * \param cur_template
  * \param flow_data
  * \param record_num
  * \return none
 */
-void nfv9_process_flow_record (flow_record_t *nf_record, 
+void nfv9_process_flow_record (joy_ctx_data *ctx,
+			       flow_record_t *nf_record, 
 			       const struct nfv9_template *cur_template, 
 			       const char *flow_data, int record_num) {
 
     const struct pcap_pkthdr *header = NULL;   /* dummy */
     struct timeval old_val_time;
+    struct timeval ts;
     unsigned int total_ms = 0;
     const unsigned char *payload = NULL;
     unsigned int size_payload = 0;
@@ -522,7 +528,7 @@ void nfv9_process_flow_record (flow_record_t *nf_record,
             case TLS_SRLT:
                 /* if TLS structure is NULL get one */
                 if (nf_record->tls == NULL) {
-                    tls_init(&nf_record->tls);
+                    tls_init(&nf_record->tls, &ctx->feature_pools.tls);
                     /* if still NULL bail on this processing */
                     if (nf_record->tls == NULL) {
                         flow_data += htons(cur_template->fields[i].FieldLength);
@@ -541,8 +547,9 @@ void nfv9_process_flow_record (flow_record_t *nf_record,
                     }
 
                     nf_record->tls->lengths[j] = htons(*(const unsigned short *)(flow_data+j*2));
-                    nf_record->tls->times[j].tv_sec = (total_ms+htons(*(const unsigned short *)(flow_data+40+j*2))+nf_record->start.tv_sec*1000+nf_record->start.tv_usec/1000)/1000;
-                    nf_record->tls->times[j].tv_usec = ((total_ms+htons(*(const unsigned short *)(flow_data+40+j*2))+nf_record->start.tv_sec*1000+nf_record->start.tv_usec/1000)%1000)*1000;
+                    ts.tv_sec = (total_ms+htons(*(const unsigned short *)(flow_data+40+j*2))+nf_record->start.tv_sec*1000+nf_record->start.tv_usec/1000)/1000;
+                    ts.tv_usec = ((total_ms+htons(*(const unsigned short *)(flow_data+40+j*2))+nf_record->start.tv_sec*1000+nf_record->start.tv_usec/1000)%1000)*1000;
+                    nf_record->tls->times[j] = joy_time_delta(&nf_record->tls->times_base, &ts);
                     total_ms += htons(*(const unsigned short *)(flow_data+40+j*2));
 
                     nf_record->tls->msg_stats[j].content_type = *(const unsigned char *)(flow_data+80+j);
@@ -556,7 +563,7 @@ void nfv9_process_flow_record (flow_record_t *nf_record,
             case TLS_CS:
                 /* if TLS structure is NULL get one */
                 if (nf_record->tls == NULL) {
-                    tls_init(&nf_record->tls);
+                    tls_init(&nf_record->tls, &ctx->feature_pools.tls);
                     /* if still NULL bail on this processing */
                     if (nf_record->tls == NULL) {
                         flow_data += htons(cur_template->fields[i].FieldLength);
@@ -581,7 +588,7 @@ void nfv9_process_flow_record (flow_record_t *nf_record,
             case TLS_EXT:
                 /* if TLS structure is NULL get one */
                 if (nf_record->tls == NULL) {
-                    tls_init(&nf_record->tls);
+                    tls_init(&nf_record->tls, &ctx->feature_pools.tls);
                     /* if still NULL bail on this processing */
                     if (nf_record->tls == NULL) {
                         flow_data += htons(cur_template->fields[i].FieldLength);
@@ -608,7 +615,7 @@ void nfv9_process_flow_record (flow_record_t *nf_record,
             case TLS_VERSION:
                 /* if TLS structure is NULL get one */
                 if (nf_record->tls == NULL) {
-                    tls_init(&nf_record->tls);
+                    tls_init(&nf_record->tls, &ctx->feature_pools.tls);
                     /* if still NULL bail on this processing */
                     if (nf_record->tls == NULL) {
                         flow_data += htons(cur_template->fields[i].FieldLength);
@@ -626,7 +633,7 @@ void nfv9_process_flow_record (flow_record_t *nf_record,
             case TLS_CLIENT_KEY_LENGTH:
                 /* if TLS structure is NULL get one */
                 if (nf_record->tls == NULL) {
-                    tls_init(&nf_record->tls);
+                    tls_init(&nf_record->tls, &ctx->feature_pools.tls);
                     /* if still NULL bail on this processing */
                     if (nf_record->tls == NULL) {
                         flow_data += htons(cur_template->fields[i].FieldLength);
@@ -644,7 +651,7 @@ void nfv9_process_flow_record (flow_record_t *nf_record,
             case TLS_SESSION_ID:
                 /* if TLS structure is NULL get one */
                 if (nf_record->tls == NULL) {
-                    tls_init(&nf_record->tls);
+                    tls_init(&nf_record->tls, &ctx->feature_pools.tls);
                     /* if still NULL bail on this processing */
                     if (nf_record->tls == NULL) {
                         flow_data += htons(cur_template->fields[i].FieldLength);
@@ -664,7 +671,7 @@ void nfv9_process_flow_record (flow_record_t *nf_record,
             case TLS_HELLO_RANDOM:
                 /* if TLS structure is NULL get one */
                 if (nf_record->tls == NULL) {
-                    tls_init(&nf_record->tls);
+                    tls_init(&nf_record->tls, &ctx->feature_pools.tls);
                     /* if still NULL bail on this processing */
                     if (nf_record->tls == NULL) {
                         flow_data += htons(cur_template->fields[i].FieldLength);
@@ -714,14 +721,16 @@ void nfv9_process_flow_record (flow_record_t *nf_record,
                 int pkt_len_index = nf_record->op;
                 int pkt_time_index = nf_record->op;
 
+                flow_record_reserve_pkts(ctx, nf_record, MAX_NUM_PKT_LEN);
+
                 // process the lengths array in the SPLT data
                 nfv9_process_lengths(nf_record, length_data, max_length_array, pkt_len_index);
 
                 // initialize the time <- this is where we should use the nfv9 timestamp
         
-                if (pkt_time_index > 0) {
-                    old_val_time.tv_sec = nf_record->pkt_time[pkt_time_index-1].tv_sec;
-                    old_val_time.tv_usec = nf_record->pkt_time[pkt_time_index-1].tv_usec;
+                if (pkt_time_index > 0 && pkt_time_index <= nf_record->pkt_cap) {
+                    joy_time_delta_to_timeval(&nf_record->pkt_time_base,
+                                              nf_record->pkt_time[pkt_time_index-1], &old_val_time);
                 } else {
                     old_val_time.tv_sec = nf_record->start.tv_sec;
                     old_val_time.tv_usec = nf_record->start.tv_usec;
@@ -737,6 +746,10 @@ void nfv9_process_flow_record (flow_record_t *nf_record,
             case BYTE_DISTRIBUTION: ;
                 field_length = htons(cur_template->fields[i].FieldLength);
                 bytes_per_val = field_length/256;
+                if (flow_record_byte_count(ctx, nf_record) == NULL) {
+                    flow_data += htons(cur_template->fields[i].FieldLength);
+                    break;
+                }
                 for (j = 0; j < 256; j++) { 
                     // 1 byte vals
                     if (bytes_per_val == 1) {
@@ -0,0 +1,527 @@
+/*
+ *
+ * Copyright (c) 2018 Cisco Systems, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials provided
+ *   with the distribution.
+ *
+ *   Neither the name of the Cisco Systems, Inc. nor the names of its
+ *   contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/**
+ * \file output_writer.c
+ *
+ * \brief thread that writes out the flow records of a context
+ *
+ ** The packet thread puts a record in slot head and then stores the
+ *  new head with release semantics; the writer stores the new written
+ *  count the same way once it is done with a record, so the packet
+ *  thread sees everything the writer did to the record before it
+ *  releases it.
+ *
+ ** An idle writer yields the processor for a while, and then naps, so
+ *  that it does not keep a core busy between bursts of expired flows.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <time.h>
+#include <pthread.h>
+#ifdef WIN32
+#include <windows.h>
+#endif
+#include "safe_lib.h"
+#include "p2f.h"
+#include "output_writer.h"
+#include "err.h"
+
+#ifdef WIN32
+/* volatile accesses have acquire and release semantics with MSVC */
+#define output_writer_load_acquire(p)     (*(volatile size_t *)(p))
+#define output_writer_store_release(p, v) (*(volatile size_t *)(p) = (v))
+#else
+#define output_writer_load_acquire(p)     __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define output_writer_store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#endif
+
+/** smallest ring that is accepted */
+#define OUTPUT_WRITER_MIN_SIZE 16
+
+/** times an idle writer yields before it starts to nap */
+#define OUTPUT_WRITER_SPINS 1000
+
+/** length of a nap of an idle writer, in microseconds */
+#define OUTPUT_WRITER_NAP_USEC 200
+
+/**
+ * \brief Let an idle writer wait for a while.
+ *
+ * \param idle Number of times in a row that the writer found nothing to do
+ * \return none
+ */
+static void output_writer_idle (unsigned int idle) {
+    if (idle < OUTPUT_WRITER_SPINS) {
+        sched_yield();
+        return;
+    }
+#ifdef WIN32
+    Sleep(1);
+#else
+    {
+        struct timespec nap = { 0, OUTPUT_WRITER_NAP_USEC * 1000 };
+
+        nanosleep(&nap, NULL);
+    }
+#endif
+}
+
+/**
+ * \brief Body of the writer thread.
+ *
+ * \param arg Writer
+ * \return NULL
+ */
+static void *output_writer_main (void *arg) {
+    output_writer_t *w = (output_writer_t *)arg;
+    size_t written = w->written;
+    unsigned int idle = 0;
+
+    while (1) {
+        if (output_writer_load_acquire(&w->head) != written) {
+            w->write(w->arg, w->slots[written & (w->size - 1)]);
+            written++;
+            output_writer_store_release(&w->written, written);
+            idle = 0;
+            continue;
+        }
+        if (output_writer_load_acquire(&w->stop)) {
+            /* everything handed over before the stop is visible now */
+            if (output_writer_load_acquire(&w->head) == written) {
+                break;
+            }
+            continue;
+        }
+        output_writer_idle(idle++);
+    }
+
+    return NULL;
+}
+
+/**
+ * \brief Start a writer thread.
+ *
+ * \param w Writer
+ * \param size Number of slots of the ring, rounded up to a power of two
+ * \param backpressure What to do with a record when the ring is full
+ * \param write Function that writes a record, called on the writer thread
+ * \param release Function that releases a record, called on the thread
+ *        that hands records over, once the record is written or dropped
+ * \param arg First argument of write and release
+ * \return ok, failure
+ */
+joy_status_e output_writer_start (output_writer_t *w, size_t size, output_backpressure_e backpressure,
+                                  output_writer_fn *write, output_writer_fn *release, void *arg) {
+    size_t slots = OUTPUT_WRITER_MIN_SIZE;
+
+    while (slots < size) {
+        slots <<= 1;
+    }
+
+    memset_s(w, sizeof(output_writer_t), 0x00, sizeof(output_writer_t));
+    w->slots = calloc(slots, sizeof(void *));
+    if (w->slots == NULL) {
+        joy_log_err("could not allocate an output ring of %zu records", slots);
+        return failure;
+    }
+    w->size = slots;
+    w->write = write;
+    w->release = release;
+    w->arg = arg;
+    w->backpressure = backpressure;
+
+    if (pthread_create(&w->thread, NULL, output_writer_main, w) != 0) {
+        joy_log_err("could not start the output writer thread");
+        free(w->slots);
+        w->slots = NULL;
+        return failure;
+    }
+
+    return ok;
+}
+
+/**
+ * \brief Release the records that the writer is done with.
+ *
+ * \param w Writer
+ * \return none
+ */
+void output_writer_reclaim (output_writer_t *w) {
+    size_t written = output_writer_load_acquire(&w->written);
+
+    while (w->tail != written) {
+        w->release(w->arg, w->slots[w->tail & (w->size - 1)]);
+        w->tail++;
+    }
+}
+
+/**
+ * \brief Put a record in the ring, if there is room.
+ *
+ * \param w Writer
+ * \param record Record to hand over
+ * \return 1 if the record went in, 0 if the ring is full
+ */
+static int output_writer_put (output_writer_t *w, void *record) {
+    if (w->head - w->tail == w->size) {
+        output_writer_reclaim(w);
+        if (w->head - w->tail == w->size) {
+            return 0;
+        }
+    }
+    w->slots[w->head & (w->size - 1)] = record;
+    output_writer_store_release(&w->head, w->head + 1);
+
+    return 1;
+}
+
+/**
+ * \brief Put a record in the ring, waiting for room if it is full.
+ *
+ * \param w Writer
+ * \param record Record to hand over
+ * \return none
+ */
+static void output_writer_put_wait (output_writer_t *w, void *record) {
+    if (output_writer_put(w, record)) {
+        return;
+    }
+    w->num_waits++;
+    while (!output_writer_put(w, record)) {
+        sched_yield();
+    }
+}
+
+/**
+ * \brief Move spilled records into the ring, oldest first.
+ *
+ * \param w Writer
+ * \param wait Wait for room, so that the spill list ends up empty
+ * \return none
+ */
+static void output_writer_unspill (output_writer_t *w, int wait) {
+    while (w->num_spill) {
+        if (wait) {
+            output_writer_put_wait(w, w->spill[w->spill_first]);
+        } else if (!output_writer_put(w, w->spill[w->spill_first])) {
+            return;
+        }
+        w->spill_first++;
+        w->num_spill--;
+    }
+    w->spill_first = 0;
+}
+
+/**
+ * \brief Add a record to the end of the spill list.
+ *
+ * \param w Writer
+ * \param record Record that found the ring full
+ * \return ok, failure if the list could not grow
+ */
+static joy_status_e output_writer_add_spill (output_writer_t *w, void *record) {
+    void **spill;
+    size_t size;
+
+    if (w->spill_first + w->num_spill == w->spill_size) {
+        if (w->spill_first) {
+            /* move the waiting records to the front */
+            memmove(w->spill, w->spill + w->spill_first, w->num_spill * sizeof(void *));
+            w->spill_first = 0;
+        } else {
+            size = w->spill_size ? w->spill_size * 2 : w->size;
+            spill = realloc(w->spill, size * sizeof(void *));
+            if (spill == NULL) {
+                return failure;
+            }
+            w->spill = spill;
+            w->spill_size = size;
+        }
+    }
+    w->spill[w->spill_first + w->num_spill] = record;
+    w->num_spill++;
+    w->num_spilled++;
+
+    return ok;
+}
+
+/**
+ * \brief Hand a record to the writer.
+ *
+ * Records that were spilled earlier go into the ring first, so that
+ * the records are written in the order they were handed over.
+ *
+ * \param w Writer
+ * \param record Record to write
+ * \return ok, or failure if the ring was full and the record was
+ *         dropped; it has been released in that case
+ */
+joy_status_e output_writer_submit (output_writer_t *w, void *record) {
+    output_writer_reclaim(w);
+    output_writer_unspill(w, 0);
+    if (w->num_spill == 0 && output_writer_put(w, record)) {
+        return ok;
+    }
+
+    switch (w->backpressure) {
+    case OUTPUT_WRITER_DROP:
+        w->num_dropped++;
+        w->release(w->arg, record);
+        return failure;
+    case OUTPUT_WRITER_SPILL:
+        if (output_writer_add_spill(w, record) == ok) {
+            return ok;
+        }
+        /* out of memory; the record has to wait after all */
+        output_writer_unspill(w, 1);
+        output_writer_put_wait(w, record);
+        return ok;
+    case OUTPUT_WRITER_BLOCK:
+    default:
+        output_writer_put_wait(w, record);
+        return ok;
+    }
+}
+
+/**
+ * \brief Wait until every record handed over has been written.
+ *
+ * The records are released, and the writer is idle when this returns,
+ * so the output can be closed or changed.
+ *
+ * \param w Writer
+ * \return none
+ */
+void output_writer_flush (output_writer_t *w) {
+    output_writer_unspill(w, 1);
+    while (output_writer_load_acquire(&w->written) != w->head) {
+        sched_yield();
+    }
+    output_writer_reclaim(w);
+}
+
+/**
+ * \brief Flush the writer, stop its thread and free the ring.
+ *
+ * \param w Writer
+ * \return none
+ */
+void output_writer_stop (output_writer_t *w) {
+    if (!output_writer_running(w)) {
+        return;
+    }
+    output_writer_flush(w);
+    output_writer_store_release(&w->stop, 1);
+    pthread_join(w->thread, NULL);
+    free(w->slots);
+    free(w->spill);
+    memset_s(w, sizeof(output_writer_t), 0x00, sizeof(output_writer_t));
+}
+
+/**
+ * \brief Name of a backpressure setting.
+ *
+ * \param backpressure OUTPUT_WRITER_BLOCK, OUTPUT_WRITER_DROP or OUTPUT_WRITER_SPILL
+ * \return The name, as used in the configuration
+ */
+const char *output_writer_backpressure_name (unsigned int backpressure) {
+    switch (backpressure) {
+    case OUTPUT_WRITER_DROP:
+        return "drop";
+    case OUTPUT_WRITER_SPILL:
+        return "spill";
+    default:
+        return "block";
+    }
+}
+
+/*
+ * unit test
+ */
+
+#define OUTPUT_WRITER_TEST_RECORDS 200000
+
+/** the writer takes a break after every OUTPUT_WRITER_TEST_PAUSE records */
+#define OUTPUT_WRITER_TEST_PAUSE 5000
+
+typedef struct output_writer_test_rec_ {
+    uint32_t seq;
+    uint32_t written;
+} output_writer_test_rec_t;
+
+typedef struct output_writer_test_ {
+    output_writer_test_rec_t *recs;
+    uint32_t next_written;                 /*!< smallest seq the writer may see next */
+    uint32_t num_written;
+    uint32_t num_released;
+    int write_fails;                       /*!< failures seen by the writer */
+    int release_fails;                     /*!< failures seen by the packet thread */
+} output_writer_test_t;
+
+static void output_writer_test_write (void *arg, void *record) {
+    output_writer_test_t *t = (output_writer_test_t *)arg;
+    output_writer_test_rec_t *r = (output_writer_test_rec_t *)record;
+    unsigned int i;
+
+    if (r->seq < t->next_written || r->written) {
+        t->write_fails++;
+    }
+    r->written = 1;
+    t->next_written = r->seq + 1;
+    t->num_written++;
+
+    /* fall behind now and then, so that the ring fills up */
+    if (r->seq % OUTPUT_WRITER_TEST_PAUSE == 0) {
+        for (i = 0; i < 100; i++) {
+            sched_yield();
+        }
+    }
+}
+
+static void output_writer_test_release (void *arg, void *record) {
+    output_writer_test_t *t = (output_writer_test_t *)arg;
+    output_writer_test_rec_t *r = (output_writer_test_rec_t *)record;
+
+    if (r->written > 1) {
+        t->release_fails++;
+    }
+    r->written = 2;
+    t->num_released++;
+}
+
+static int output_writer_test_policy (output_backpressure_e backpressure) {
+    output_writer_t w;
+    output_writer_test_t t;
+    uint32_t i, num_dropped = 0;
+    uint64_t num_waits, num_spilled;
+    int num_fails = 0;
+
+    memset_s(&t, sizeof(t), 0x00, sizeof(t));
+    t.recs = calloc(OUTPUT_WRITER_TEST_RECORDS, sizeof(output_writer_test_rec_t));
+    if (t.recs == NULL) {
+        joy_log_err("out of memory");
+        return 1;
+    }
+    if (output_writer_start(&w, 100, backpressure, output_writer_test_write,
+                            output_writer_test_release, &t) != ok || w.size != 128) {
+        joy_log_err("writer setup failed");
+        free(t.recs);
+        return 1;
+    }
+
+    for (i = 0; i < OUTPUT_WRITER_TEST_RECORDS; i++) {
+        t.recs[i].seq = i;
+        if (output_writer_submit(&w, &t.recs[i]) != ok) {
+            if (t.recs[i].written != 2) {
+                joy_log_err("dropped record %u was not released", i);
+                num_fails++;
+            }
+            num_dropped++;
+        }
+    }
+    output_writer_flush(&w);
+    if (t.num_released != OUTPUT_WRITER_TEST_RECORDS) {
+        joy_log_err("%u records released, expected %u", t.num_released, OUTPUT_WRITER_TEST_RECORDS);
+        num_fails++;
+    }
+    if (t.num_written + num_dropped != OUTPUT_WRITER_TEST_RECORDS || num_dropped != w.num_dropped) {
+        joy_log_err("%u records written and %u dropped, out of %u", t.num_written, num_dropped,
+                    OUTPUT_WRITER_TEST_RECORDS);
+        num_fails++;
+    }
+    if (backpressure != OUTPUT_WRITER_DROP && num_dropped) {
+        joy_log_err("%u records dropped with backpressure %s", num_dropped,
+                    output_writer_backpressure_name(backpressure));
+        num_fails++;
+    }
+    if (backpressure != OUTPUT_WRITER_SPILL && w.num_spilled) {
+        joy_log_err("records spilled with backpressure %s", output_writer_backpressure_name(backpressure));
+        num_fails++;
+    }
+
+    num_waits = w.num_waits;
+    num_spilled = w.num_spilled;
+
+    /* a second round, on a writer that has been idle */
+    t.recs[0].written = 0;
+    t.next_written = 0;
+    if (output_writer_submit(&w, &t.recs[0]) != ok) {
+        joy_log_err("record refused by an idle writer");
+        num_fails++;
+    }
+    output_writer_stop(&w);
+    if (t.recs[0].written != 2 || output_writer_running(&w)) {
+        joy_log_err("record not written before the writer stopped");
+        num_fails++;
+    }
+    num_fails += t.write_fails + t.release_fails;
+    fprintf(info, "backpressure %s: %u written, %u dropped, %u spilled, %u waits\n",
+            output_writer_backpressure_name(backpressure), t.num_written, num_dropped,
+            (unsigned int)num_spilled, (unsigned int)num_waits);
+
+    free(t.recs);
+    return num_fails;
+}
+
+/**
+ * \brief Unit test for the output writer.
+ *
+ * \param none
+ * \return Number of failures
+ */
+int output_writer_unit_test (void) {
+    int num_fails = 0;
+
+    fprintf(info, "\n******************************\n");
+    fprintf(info, "Output writer Unit Test starting...\n");
+
+    num_fails += output_writer_test_policy(OUTPUT_WRITER_BLOCK);
+    num_fails += output_writer_test_policy(OUTPUT_WRITER_DROP);
+    num_fails += output_writer_test_policy(OUTPUT_WRITER_SPILL);
+
+    if (num_fails) {
+        fprintf(info, "Finished - failures: %d\n", num_fails);
+    } else {
+        fprintf(info, "Finished - success\n");
+    }
+    fprintf(info, "******************************\n\n");
+
+    return num_fails;
+}
@@ -71,6 +71,13 @@
 #include "utils.h"
 #include "config.h"
 #include "joy_api_private.h"
+#include "flow_timer.h" /* expiry timer wheel            */
+#include "flow_table.h" /* flow cache                    */
+#include "payload_stats.h" /* byte distribution statistics */
+#include "json_buf.h"   /* buffered JSON records         */
+#include "output_writer.h" /* output writer thread       */
+#include "joybin.h"     /* binary flow records           */
+#include "joyarrow.h"   /* column chunks of flow records */
 
 /*
  * The VERSION variable should be set by a compiler directive, based
@@ -81,6 +88,11 @@
 # define VERSION "unknown"
 #endif
 
+/* a binary record has to hold what a flow record does */
+#if JOYBIN_MAX_PKTS < 2 * MAX_NUM_PKT_LEN || JOYBIN_MAX_IP_ID < MAX_NUM_IP_ID || JOYBIN_MAX_IDP < MAX_IDP
+#error "joybin.h limits are smaller than those of a flow record"
+#endif
+
 /*
  * by default, we use a 10-second flow inactivity timeout window
  * and a 20-second activity timeout; the active_timeout represents
@@ -100,12 +112,21 @@ static const int include_os = 1;
 #define expiration_type_reserved 'z'
 #define expiration_type_active  'a'
 #define expiration_type_inactive 'i'
+#define expiration_type_evicted 'e'
+
+/** number of the oldest flows looked at to pick one to evict */
+#define FLOW_EVICT_SAMPLE 8
+
+/** number of entries in the admission filter (a power of two) */
+#define FLOW_ADMISSION_SLOTS 65536
 
 /*
  * Local prototypes
  */
 static void flow_record_delete(joy_ctx_data *ctx, flow_record_t *r);
 static void flow_record_print_and_delete(joy_ctx_data *ctx, flow_record_t *record);
+static void flow_record_write(void *arg, void *record);
+static void flow_record_release(void *arg, void *record);
 
 /* ***********************************************
  * -----------------------------------------------
@@ -144,8 +165,41 @@ void flocap_stats_output (joy_ctx_data *ctx, FILE *f) {
 #else
         strftime(time_str, sizeof(time_str) - 1, "%a %b %d %H:%M:%S %Z %Y", localtime(&now.tv_sec));
 #endif
+    ctx->stats.flow_table_load = flow_table_load(&ctx->flow_table);
+    ctx->stats.flow_table_grows = ctx->flow_table.num_grows;
+    ctx->stats.flow_table_shrinks = ctx->flow_table.num_shrinks;
+    ctx->stats.spilled_records = ctx->writer.num_spilled;
+    ctx->stats.writer_waits = ctx->writer.num_waits;
+
     fprintf(f, "%s info: %lu packets, %lu active records, %lu records output, %lu alloc fails, %.4e bytes/sec, %.4e packets/sec, %.4e records/sec\n",
               time_str, ctx->stats.num_packets, ctx->stats.num_records_in_table, ctx->stats.num_records_output, ctx->stats.malloc_fail, bps, pps, rps);
+    fprintf(f, "%s info: flow table %u slots, %.2f load, %lu grows, %lu shrinks\n",
+              time_str, flow_table_num_slots(&ctx->flow_table), ctx->stats.flow_table_load,
+              ctx->stats.flow_table_grows, ctx->stats.flow_table_shrinks);
+    if (ctx->stats.capture_packets || ctx->stats.capture_drops) {
+        fprintf(f, "%s info: capture %lu packets, %lu dropped (%lu since last), %lu ring full\n",
+                  time_str, ctx->stats.capture_packets, ctx->stats.capture_drops,
+                  ctx->stats.capture_drops - ctx->last_stats.capture_drops, ctx->stats.capture_freezes);
+    }
+    if (ctx->stats.saturated_records) {
+        fprintf(f, "%s info: %lu saturated records, %lu fast path packets\n",
+                  time_str, ctx->stats.saturated_records, ctx->stats.fast_path_packets);
+    }
+    if (ctx->stats.evicted_records || ctx->stats.refused_records) {
+        fprintf(f, "%s info: %lu evicted records, %lu refused records\n",
+                  time_str, ctx->stats.evicted_records, ctx->stats.refused_records);
+    }
+    if (ctx->stats.duplicate_packets) {
+        fprintf(f, "%s info: %lu duplicate packets dropped\n", time_str, ctx->stats.duplicate_packets);
+    }
+    if (output_writer_running(&ctx->writer)) {
+        fprintf(f, "%s info: output writer %lu records queued, %lu dropped, %lu spilled, %lu waits\n",
+                  time_str, (unsigned long int)(ctx->writer.head - ctx->writer.tail),
+                  ctx->stats.dropped_records, ctx->stats.spilled_records, ctx->stats.writer_waits);
+    }
+    flow_pool_print_stats(&ctx->record_pool, time_str, f);
+    flow_pool_set_print_stats(&ctx->cold_pools, time_str, f);
+    print_all_feature_pool_stats(feature_list);
     fflush(f);
 
     ctx->last_stats_output_time = now;
@@ -154,6 +208,20 @@ void flocap_stats_output (joy_ctx_data *ctx, FILE *f) {
     ctx->last_stats.num_records_in_table = ctx->stats.num_records_in_table;
     ctx->last_stats.num_records_output = ctx->stats.num_records_output;
     ctx->last_stats.malloc_fail = ctx->stats.malloc_fail;
+    ctx->last_stats.flow_table_load = ctx->stats.flow_table_load;
+    ctx->last_stats.flow_table_grows = ctx->stats.flow_table_grows;
+    ctx->last_stats.flow_table_shrinks = ctx->stats.flow_table_shrinks;
+    ctx->last_stats.capture_packets = ctx->stats.capture_packets;
+    ctx->last_stats.capture_drops = ctx->stats.capture_drops;
+    ctx->last_stats.capture_freezes = ctx->stats.capture_freezes;
+    ctx->last_stats.saturated_records = ctx->stats.saturated_records;
+    ctx->last_stats.fast_path_packets = ctx->stats.fast_path_packets;
+    ctx->last_stats.evicted_records = ctx->stats.evicted_records;
+    ctx->last_stats.refused_records = ctx->stats.refused_records;
+    ctx->last_stats.duplicate_packets = ctx->stats.duplicate_packets;
+    ctx->last_stats.dropped_records = ctx->stats.dropped_records;
+    ctx->last_stats.spilled_records = ctx->stats.spilled_records;
+    ctx->last_stats.writer_waits = ctx->stats.writer_waits;
 }
 
 /**
@@ -170,106 +238,110 @@ void flocap_stats_timer_init (joy_ctx_data *ctx) {
 
 /**
  * \brief Calculate the hash of a given flow_key.
+ *
+ * This is the hash of the flow table, which always looks up the exact
+ * 5-tuple, whichever flow_key_match_method is in use.
+ *
  * \param f The flow_key to hash
  * \return Hash of \p f
  */
-static unsigned int flow_key_hash (const flow_key_t *f) {
-    uint32_t hash = 0;
-
-    if (glb_config->flow_key_match_method == EXACT_MATCH) {
-
-        hash += (uint32_t)f->sa.s_addr;
-        hash += (uint32_t)f->da.s_addr;
-        hash += (uint32_t)f->sp;
-        hash += (uint32_t)f->dp;
-        hash += (uint32_t)f->prot;
-
-        hash *= 0xFFD9;
-        hash -= (hash >> 16);
-        hash &= flow_key_hash_mask;
+static uint32_t flow_key_hash (const flow_key_t *f) {
+    return flow_table_hash(f);
+}
 
-    } else {  /* flow_key_match_method == NEAR_MATCH */
-        /*
-         * To make it possible to identify NAT'ed twins, the hash of the
-         * flows (sa, da, sp, dp, pr) and (*, *, dp, sp, pr) are identical.
-         * This is done by omitting addresses and sorting the ports into
-         * order before hashing.
-         */
-        hash += (uint32_t)f->sp;
-        hash += (uint32_t)f->dp;
-        hash += (uint32_t)f->prot;
+/**
+ * \brief Calculate the hash of a given flow_key in the NAT index.
+ *
+ * To make it possible to identify NAT'ed twins, the hash of the
+ * flows (sa, da, sp, dp, pr) and (*, *, dp, sp, pr) are identical.
+ * This is done by omitting addresses and sorting the ports into
+ * order before hashing.  Only the records that are waiting for a
+ * twin are hashed this way, so that the few ports that most flows
+ * use do not slow down the lookups of the flow table.
+ *
+ * \param f The flow_key to hash
+ * \return Hash of \p f
+ */
+static uint32_t flow_key_nat_hash (const flow_key_t *f) {
+    flow_key_t k;
 
-        hash *= 0xFFD9;
-        hash -= (hash >> 16);
-        hash &= flow_key_hash_mask;
-    }
+    memset_s(&k, sizeof(flow_key_t), 0, sizeof(flow_key_t));
+    k.sp = (f->sp < f->dp) ? f->sp : f->dp;
+    k.dp = (f->sp < f->dp) ? f->dp : f->sp;
+    k.prot = f->prot;
 
-    return hash;
+    return flow_table_hash(&k);
 }
 
 /**
- * \brief Initialize the flow_record_list.
+ * \brief Initialize the flow table and chrono list.
  * \param none
  * \param return
  */
 void flow_record_list_init (joy_ctx_data *ctx) {
     ctx->flow_record_chrono_first = ctx->flow_record_chrono_last = NULL;
-    memset_s(ctx->flow_record_list_array,  sizeof(ctx->flow_record_list_array), 0x00, sizeof(ctx->flow_record_list_array));
+    ctx->flow_record_seq = 0;
+    flow_timer_init(&ctx->expiry_wheel);
+    flow_table_init(&ctx->flow_table, glb_config->flow_table_size);
+    flow_table_init(&ctx->nat_index, 0);
+    if (glb_config->admission) {
+        ctx->admission_filter = calloc(FLOW_ADMISSION_SLOTS, sizeof(uint32_t));
+        if (ctx->admission_filter == NULL) {
+            joy_log_err("could not allocate the admission filter; admitting every flow");
+        }
+    }
+    if (glb_config->dedup && pkt_dedup_init(&ctx->dedup, glb_config->dedup) != ok) {
+        joy_log_err("could not allocate the dedup set; keeping duplicate packets");
+    }
+    if (json_buf_init(&ctx->json, JSON_BUF_INITIAL_SIZE) != ok) {
+        joy_log_err("could not allocate the JSON buffer");
+    }
+    flow_pool_init(&ctx->record_pool, "flow_record", sizeof(flow_record_t), glb_config->hugepages);
+    flow_pool_set_init(&ctx->cold_pools, glb_config->hugepages);
+    init_all_feature_pools(feature_list);
+    if (glb_config->writer_queue &&
+        output_writer_start(&ctx->writer, glb_config->writer_queue, glb_config->backpressure,
+                            flow_record_write, flow_record_release, ctx) != ok) {
+        joy_log_err("could not start the output writer; writing flow records on the packet thread");
+    }
 }
 
 /**
- * \brief Free up all flow_records within the flow_record_list.
+ * \brief Free up all flow_records within the flow table.
  * \param none
  * \return none
  */
 void flow_record_list_free (joy_ctx_data *ctx) {
     flow_record_t *record = NULL;
-    flow_record_t *tmp = NULL;
     unsigned int i, count = 0;
 
-    for (i=0; i<FLOW_RECORD_LIST_LEN; i++) {
-        record = ctx->flow_record_list_array[i];
-        while (record != NULL) {
-            tmp = record->next;
+    /* the records that the writer still has go first */
+    output_writer_stop(&ctx->writer);
+
+    for (i=0; i<flow_table_num_slots(&ctx->flow_table); i++) {
+        record = flow_table_record_at(&ctx->flow_table, i);
+        if (record != NULL) {
             flow_record_delete(ctx, record);
-            record = tmp;
             count++;
         }
-        ctx->flow_record_list_array[i] = NULL;
     }
     ctx->flow_record_chrono_first = NULL;
     ctx->flow_record_chrono_last = NULL;
+    flow_timer_free(&ctx->expiry_wheel);
+    flow_table_free(&ctx->flow_table);
+    flow_table_free(&ctx->nat_index);
+    free(ctx->admission_filter);
+    ctx->admission_filter = NULL;
+    pkt_dedup_destroy(&ctx->dedup);
+    json_buf_free(&ctx->json);
+    joyarrow_batch_free(ctx->columns);
+    ctx->columns = NULL;
+    flow_pool_destroy(&ctx->record_pool);
+    flow_pool_set_destroy(&ctx->cold_pools);
+    destroy_all_feature_pools(feature_list);
     joy_log_debug("(%d) flow records free'd from context(%d)", count, ctx->ctx_id);
 }
 
-/**
- * \brief Compare two flow_keys to see if they are equal.
- * \param a The first flow_key
- * \param b The second flow_key
- * \return 0 for equality, 1 for not
- */
-static int flow_key_is_eq (const flow_key_t *a,
-                           const flow_key_t *b) {
-    if (a->prot != b->prot) {
-        return 1;
-    }
-    if (a->sp != b->sp) {
-        return 1;
-    }
-    if (a->dp != b->dp) {
-        return 1;
-    }
-    if (a->sa.s_addr != b->sa.s_addr) {
-        return 1;
-    }
-    if (a->da.s_addr != b->da.s_addr) {
-        return 1;
-    }
-
-    /* Match was found */
-    return 0;
-}
-
 /**
  * \brief Check if two flow_keys are twins.
  * \param a The first flow_key
@@ -288,20 +360,24 @@ static int flow_key_is_twin (const flow_key_t *a,
          * Translation (NAT), and not Port Address Translation (PAT).  NAT
          * is commonly done with and without PAT.
          */
-        if (a->sa.s_addr != b->da.s_addr && a->da.s_addr != b->sa.s_addr) {
+        if (!flow_key_addr_eq(a->sa6, b->da6, a->ipv6) &&
+            !flow_key_addr_eq(a->da6, b->sa6, a->ipv6)) {
             return 1;
         }
     } else {
         /*
          * Require that both addresses match, that is, (sa, da) == (da, sa)
          */
-        if (a->sa.s_addr != b->da.s_addr) {
+        if (!flow_key_addr_eq(a->sa6, b->da6, a->ipv6)) {
             return 1;
         }
-        if (a->da.s_addr != b->sa.s_addr) {
+        if (!flow_key_addr_eq(a->da6, b->sa6, a->ipv6)) {
             return 1;
         }
     }
+    if (a->ipv6 != b->ipv6) {
+        return 1;
+    }
     if (a->sp != b->dp) {
         return 1;
     }
@@ -323,176 +399,293 @@ static int flow_key_is_twin (const flow_key_t *a,
  * \return none
  */
 static void flow_key_copy (flow_key_t *dst, const flow_key_t *src) {
-    dst->sa.s_addr = src->sa.s_addr;
-    dst->da.s_addr = src->da.s_addr;
+    dst->sa6 = src->sa6;
+    dst->da6 = src->da6;
     dst->sp = src->sp;
     dst->dp = src->dp;
     dst->prot = src->prot;
+    dst->ipv6 = src->ipv6;
 }
 
 #define MAX_TTL 255
 
 static flow_record_t *flow_key_get_twin(joy_ctx_data *ctx,
-                                        const flow_key_t *key,
-                                        unsigned int key_hash);
+                                        const flow_key_t *key);
+static void flow_record_nat_index_add(joy_ctx_data *ctx, flow_record_t *record);
+static void flow_record_nat_index_remove(joy_ctx_data *ctx, flow_record_t *record);
+
+/* ***********************************************
+ * -----------------------------------------------
+ *          Cold sections of flow records
+ * -----------------------------------------------
+ * ***********************************************
+ */
+
+/** read-only stand-ins for the cold sections that were never allocated */
+static const uint32_t zero_byte_count[256];
+static const uint32_t zero_compact_byte_count[16];
+static const header_description_t zero_header_description;
 
 /**
- * \brief Initialize a flow_record.
- * \param[out] record Flow record
- * \param[in] Flow key to be used for identifiying the record
- * \return none
+ * \brief Work out how far to grow a cold array.
+ *
+ * The array roughly doubles, and then takes all of the room of the
+ * size class of the cold pools that it ends up in.
+ *
+ * \param cap Current number of elements
+ * \param need Number of elements that are needed
+ * \param elem_bytes Size of an element
+ * \param first Number of elements of the first allocation
+ * \param max Maximum number of elements
+ * \return New number of elements
  */
-static void flow_record_init (joy_ctx_data *ctx,
-                              flow_record_t *record,
-                              const flow_key_t *key) {
+static unsigned int flow_record_grow_cap (unsigned int cap, unsigned int need, size_t elem_bytes,
+                                          unsigned int first, unsigned int max) {
+    unsigned int want = cap ? 2 * cap : first;
+    size_t room;
 
-    /* Increment the stats flow record count */
-    flocap_stats_incr_records_in_table(ctx);
+    if (want < need) {
+        want = need;
+    }
+    if (want > max) {
+        want = max;
+    }
+    room = flow_pool_set_class_size(want * elem_bytes) / elem_bytes;
 
-    /* Zero out the flow_record structure */
-    memset_s(record, sizeof(flow_record_t), 0, sizeof(flow_record_t));
+    return (room < max) ? (unsigned int)room : max;
+}
 
-    /* Set the flow_key and TTL */
-    flow_key_copy(&record->key, key);
-    record->ip.ttl = MAX_TTL;
+/**
+ * \brief Make room in the per-packet arrays of a flow record.
+ *
+ * The arrays share one block from the cold pools, which starts out with
+ * room for a few packets and grows with the flow up to num_pkts
+ * entries, which is all that is ever reported.
+ *
+ * \param ctx Context the record belongs to
+ * \param rec Flow record
+ * \param n Number of entries needed (capped at num_pkts)
+ * \return Number of entries the arrays can hold, which is less than
+ *         \p n if they could not be grown
+ */
+unsigned int flow_record_reserve_pkts (joy_ctx_data *ctx, flow_record_t *rec, unsigned int n) {
+    unsigned int old_cap = rec->pkt_cap;
+    unsigned int cap;
+    unsigned char *block;
+
+    if (n > glb_config->num_pkts) {
+        n = glb_config->num_pkts;
+    }
+    if (n <= old_cap) {
+        return old_cap;
+    }
+
+    cap = flow_record_grow_cap(old_cap, n, FLOW_RECORD_PKT_BYTES, 4, glb_config->num_pkts);
+    block = flow_pool_set_calloc(&ctx->cold_pools, cap * FLOW_RECORD_PKT_BYTES);
+    if (block == NULL) {
+        flocap_stats_incr_malloc_fail(ctx);
+        return old_cap;
+    }
+
+    if (old_cap) {
+        memcpy_s(block, cap * sizeof(joy_time_delta_t),
+                 rec->pkt_time, old_cap * sizeof(joy_time_delta_t));
+        memcpy_s(block + cap * sizeof(joy_time_delta_t), cap * sizeof(uint16_t),
+                 rec->pkt_len, old_cap * sizeof(uint16_t));
+        memcpy_s(block + cap * (sizeof(joy_time_delta_t) + sizeof(uint16_t)), cap,
+                 rec->pkt_flags, old_cap);
+        flow_pool_set_free(&ctx->cold_pools, rec->pkt_time, old_cap * FLOW_RECORD_PKT_BYTES);
+    }
+    rec->pkt_time = (joy_time_delta_t *)block;
+    rec->pkt_len = (uint16_t *)(block + cap * sizeof(joy_time_delta_t));
+    rec->pkt_flags = block + cap * (sizeof(joy_time_delta_t) + sizeof(uint16_t));
+    rec->pkt_cap = (uint8_t)cap;
+
+    return cap;
 }
 
 /**
- * \brief Check if the flow record is in chrono list.
- * \param record Flow_record
- * \return Valid pointer if in list, NULL otherwise
+ * \brief Make room in the per-packet arrays for the next packet.
+ *
+ * Once the arrays could not be grown they are left alone for good, so
+ * that the entries they hold are always the first ones of the flow;
+ * rec->op keeps counting packets either way.
+ *
+ * \param ctx Context the record belongs to
+ * \param rec Flow record
+ * \return 1 if the packet at index rec->op can be stored, 0 otherwise
  */
-static inline unsigned int flow_record_is_in_chrono_list (joy_ctx_data *ctx, const flow_record_t *record) {
-    if (record->time_next || record->time_prev) {
+unsigned int flow_record_reserve_pkt (joy_ctx_data *ctx, flow_record_t *rec) {
+    if (rec->op < rec->pkt_cap) {
         return 1;
     }
-    if (record == ctx->flow_record_chrono_first) {
-        /* Corner case when there is a single record in the list */
-        return 1;
+    if (rec->op > rec->pkt_cap) {
+        return 0;
     }
-    return 0;
+    return flow_record_reserve_pkts(ctx, rec, rec->op + 1u) > rec->op;
 }
 
 /**
- * \brief Find the flow record in list, if it exists.
- * \param list The list of flow_records to search
- * \param key The flow_key used to identify the flow_record
- * \return Valid flow_record or NULL
+ * \brief Number of packets held in the per-packet arrays.
+ * \param rec Flow record
+ * \return Number of valid entries of pkt_len, pkt_time and pkt_flags
  */
-static flow_record_t *flow_record_list_find_record_by_key (const flow_record_list *list,
-                                                                const flow_key_t *key) {
-    flow_record_t *record = *list;
+unsigned int flow_record_num_pkts (const flow_record_t *rec) {
+    return (rec->op < rec->pkt_cap) ? rec->op : rec->pkt_cap;
+}
 
-    /* Find a record matching the flow key, if it exists */
-    while (record != NULL) {
-        if (flow_key_is_eq(key, &record->key) == 0) {
-            joy_log_debug("LIST (head location: %p) record %p found\n", list, record);
-            return record;
-        }
-        record = record->next;
+/**
+ * \brief Append an IP id to a flow record.
+ *
+ * The first MAX_NUM_IP_ID ids of the flow are kept, in an array that
+ * grows as they come in.
+ *
+ * \param ctx Context the record belongs to
+ * \param rec Flow record
+ * \param id IP id, in host byte order
+ * \return none
+ */
+void flow_record_add_ip_id (joy_ctx_data *ctx, flow_record_t *rec, uint16_t id) {
+    ip_info_t *ip = &rec->ip;
+
+    if (ip->num_id >= MAX_NUM_IP_ID) {
+        return;
     }
-    joy_log_debug("LIST (head location: %p) did not find record\n", list);
+    if (ip->num_id == ip->id_cap) {
+        unsigned int cap = flow_record_grow_cap(ip->id_cap, ip->id_cap + 1u, sizeof(uint16_t),
+                                                8, MAX_NUM_IP_ID);
+        uint16_t *ids = flow_pool_set_alloc(&ctx->cold_pools, cap * sizeof(uint16_t));
 
-    return NULL;
+        if (ids == NULL) {
+            flocap_stats_incr_malloc_fail(ctx);
+            return;
+        }
+        if (ip->id_cap) {
+            memcpy_s(ids, cap * sizeof(uint16_t), ip->id, ip->num_id * sizeof(uint16_t));
+            flow_pool_set_free(&ctx->cold_pools, ip->id, ip->id_cap * sizeof(uint16_t));
+        }
+        ip->id = ids;
+        ip->id_cap = (unsigned char)cap;
+    }
+    ip->id[ip->num_id++] = id;
 }
 
 /**
- * \brief Find the twin of the flow_key in the flow_record_list.
- * \param list The list of flow_records to search
- * \param key The flow_key of the record whose twin we will search for.
- * \return The twin flow_record or NULL
+ * \brief Get the byte count of a flow record.
+ * \param ctx Context the record belongs to
+ * \param rec Flow record
+ * \return Array of 256 counts (zeroed when new), or NULL if out of memory
  */
-static flow_record_t *flow_record_list_find_twin_by_key (const flow_record_list *list,
-                                                              const flow_key_t *key) {
-    flow_record_t *record = *list;
+uint32_t *flow_record_byte_count (joy_ctx_data *ctx, flow_record_t *rec) {
+    if (rec->byte_count == NULL) {
+        rec->byte_count = flow_pool_set_calloc(&ctx->cold_pools, 256 * sizeof(uint32_t));
+        if (rec->byte_count == NULL) {
+            flocap_stats_incr_malloc_fail(ctx);
+        }
+    }
+    return rec->byte_count;
+}
 
-    /* find a record matching the flow key, if it exists */
-    while (record != NULL) {
-        if (flow_key_is_twin(key, &record->key) == 0) {
-            joy_log_debug("LIST (head location: %p) record %p found\n", list, record);
-            return record;
+/**
+ * \brief Get the TCP retransmission buffer of a flow record.
+ *
+ * The buffer is allocated (zeroed) when the flow sees its first TCP
+ * packet with a payload or sequence number to remember.
+ *
+ * \param ctx Context the record belongs to
+ * \param rec Flow record
+ * \return Buffer of MAX_TCP_RETRANS_BUFFER entries, or NULL if out of memory
+ */
+tcp_retrans_t *flow_record_tcp_retrans (joy_ctx_data *ctx, flow_record_t *rec) {
+    if (rec->tcp_retrans == NULL) {
+        rec->tcp_retrans = flow_pool_set_calloc(&ctx->cold_pools,
+                                                MAX_TCP_RETRANS_BUFFER * sizeof(tcp_retrans_t));
+        if (rec->tcp_retrans == NULL) {
+            flocap_stats_incr_malloc_fail(ctx);
         }
-        record = record->next;
     }
-    joy_log_debug("LIST (head location: %p) did not find record\n", list);
+    return rec->tcp_retrans;
+}
 
-    return NULL;
+/**
+ * \brief Get the header description of a flow record.
+ * \param ctx Context the record belongs to
+ * \param rec Flow record
+ * \return Header description (zeroed when new), or NULL if out of memory
+ */
+header_description_t *flow_record_header_description (joy_ctx_data *ctx, flow_record_t *rec) {
+    if (rec->hd == NULL) {
+        rec->hd = flow_pool_set_calloc(&ctx->cold_pools, sizeof(header_description_t));
+        if (rec->hd == NULL) {
+            flocap_stats_incr_malloc_fail(ctx);
+        }
+    }
+    return rec->hd;
 }
 
 /**
- * \brief Set the \p head a flow_record_list to the given \p record.
- * \param list The list of flow records
- * \param record The flow_record that will be prepended to the \p list
+ * \brief Release the cold sections of a flow record.
+ * \param ctx Context the record belongs to
+ * \param r Flow record
  * \return none
  */
-static void flow_record_list_prepend (flow_record_list *head,
-                                      flow_record_t *record) {
-    flow_record_t *tmp;
+static void flow_record_free_cold (joy_ctx_data *ctx, flow_record_t *r) {
+    flow_pool_set_t *pools = &ctx->cold_pools;
 
-    tmp = *head;
-    if (tmp == record) {
-        printf("setting record->next to record! (%p)\n", record);
+    if (r->pkt_cap) {
+        flow_pool_set_free(pools, r->pkt_time, r->pkt_cap * FLOW_RECORD_PKT_BYTES);
     }
-    if (tmp != NULL) {
-        tmp->prev = record;
-        record->next = tmp;
+    if (r->ip.id_cap) {
+        flow_pool_set_free(pools, r->ip.id, r->ip.id_cap * sizeof(uint16_t));
     }
-    *head = record;
-    joy_log_debug("LIST (head location %p) head set to %p (prev: %p, next: %p)\n",
-                     head, *head, record->prev, record->next);
+    flow_pool_set_free(pools, r->byte_count, 256 * sizeof(uint32_t));
+    flow_pool_set_free(pools, r->compact_byte_count, 16 * sizeof(uint32_t));
+    flow_pool_set_free(pools, r->hd, sizeof(header_description_t));
+    flow_pool_set_free(pools, r->tcp_retrans, MAX_TCP_RETRANS_BUFFER * sizeof(tcp_retrans_t));
 }
 
+/* every feature needs a bit in the features mask of a flow record */
+typedef char flow_record_features_size_check[num_features <= 8 * sizeof(((flow_record_t *)0)->features) ? 1 : -1];
+
 /**
- * \brief Remove a flow record from the list.
- * \param head The list of records
- * \param r The flow_record that will be removed from the \p list
+ * \brief Initialize a flow_record.
+ * \param[out] record Flow record
+ * \param[in] Flow key to be used for identifiying the record
  * \return none
  */
-static unsigned int flow_record_list_remove (flow_record_list *head,
-                                             flow_record_t *r) {
+static void flow_record_init (joy_ctx_data *ctx,
+                              flow_record_t *record,
+                              const flow_key_t *key) {
 
-    if (r == NULL) {
-        return 1;    /* don't process NULL pointers; probably an error to get here */
-    }
+    /* Increment the stats flow record count */
+    flocap_stats_incr_records_in_table(ctx);
 
-    joy_log_debug("LIST (head location %p) removing record at %p (prev: %p, next: %p)\n",
-                   head, r, r->prev, r->next);
+    /* Zero out the flow_record structure */
+    memset_s(record, sizeof(flow_record_t), 0, sizeof(flow_record_t));
 
-    if (r->prev == NULL) {
-        /*
-         * r is the first (or only) record within its flow_record_list, so
-         * the head of the list must be set
-         */
-        if (*head != r) {
-            printf("error: frla[hk] != r\n");
-            exit(1);
-        }
-        *head = r->next;
-        if (*head != NULL) {
-            /*
-             * the list is not empty, so we need to set the prev pointer in
-             * the first record to indicate that it is the head of the list
-             */
-          (*head)->prev = NULL;
-        }
-    } else {
-        /*
-         * r needs to be stitched out of its flow_record_list, by setting
-         * its previous entry to point to its next entry
-         */
-        r->prev->next = r->next;
-        joy_log_debug("LIST (head location %p) now prev->next: %p\n", head, r->prev->next);
-        if (r->next != NULL) {
-            /*
-             * the next entry's previous pointer must be made to point to
-             * the previous entry
-             */
-            r->next->prev = r->prev;
-            joy_log_debug("LIST (head location %p) now next->prev: %p\n", head, r->next->prev);
-        }
-    }
+    /* Set the flow_key and TTL */
+    flow_key_copy(&record->key, key);
+    record->ip.ttl = MAX_TTL;
+    record->seq = ++ctx->flow_record_seq;
+
+    /* resolve the features that apply to the flow once, not per packet */
+    record->features = feature_mask(feature_list);
+}
 
-    return 0; /* indicate success */
+/**
+ * \brief Check if the flow record is in chrono list.
+ * \param record Flow_record
+ * \return Valid pointer if in list, NULL otherwise
+ */
+static inline unsigned int flow_record_is_in_chrono_list (joy_ctx_data *ctx, const flow_record_t *record) {
+    if (record->time_next || record->time_prev) {
+        return 1;
+    }
+    if (record == ctx->flow_record_chrono_first) {
+        /* Corner case when there is a single record in the list */
+        return 1;
+    }
+    return 0;
 }
 
 /**
@@ -501,6 +694,12 @@ static unsigned int flow_record_list_remove (flow_record_list *head,
  * \return none
  */
 static void flow_record_chrono_list_append (joy_ctx_data *ctx, flow_record_t *record) {
+    /*
+     * The start and end times of a new record are not known yet, so
+     * have the next expiry sweep look at it and schedule it properly
+     */
+    flow_timer_add(&ctx->expiry_wheel, record, flow_timer_tick(&ctx->global_time));
+
     if (ctx->flow_record_chrono_first == NULL) {
         ctx->flow_record_chrono_first = record;
         ctx->flow_record_chrono_last = record;
@@ -518,6 +717,8 @@ static void flow_record_chrono_list_append (joy_ctx_data *ctx, flow_record_t *re
  */
 static void flow_record_chrono_list_remove (joy_ctx_data *ctx, flow_record_t *record) {
 
+    flow_timer_del(&ctx->expiry_wheel, record);
+
     if (record == ctx->flow_record_chrono_first) {
         ctx->flow_record_chrono_first = record->time_next;
     }
@@ -625,67 +826,385 @@ unsigned int flow_record_is_expired(joy_ctx_data *ctx, flow_record_t *record) {
 }
 
 /**
- * \brief Retrieve a flow record using a \p key to find it.
- * \param key The flow_key to use for lookup of flow record
- * \param create_new_records Flag for whether a new record should be created
- * \return pointer to the flow record structure
- * \return NULL if expired or could not create or retrieve record
+ * \brief Calculate the tick at which a flow_record will expire.
+ *
+ * This mirrors flow_record_is_expired(): the record expires once the
+ * global time is past the returned tick, assuming that neither it nor
+ * its twin sees any more packets.
+ *
+ * \param record - A flow_record on the chrono list
+ * \return uint64_t - expiry tick (milliseconds)
  */
-flow_record_t *flow_key_get_record (joy_ctx_data *ctx,
-                                         const flow_key_t *key,
-                                         unsigned int create_new_records,
-                                         const struct pcap_pkthdr *header) {
-    flow_record_t *record;
-    unsigned int hash_key;
+static uint64_t flow_record_expiry_tick (const flow_record_t *record) {
+    const struct timeval *start = &record->start;
+    const struct timeval *end = &record->end;
+    uint64_t active_tick, inactive_tick;
+
+    if (record->twin) {
+        if (joy_timer_lt(start, &record->twin->start)) {
+            start = &record->twin->start;
+        }
+        if (joy_timer_lt(end, &record->twin->end)) {
+            end = &record->twin->end;
+        }
+    }
 
-    /* Find a record matching the flow key, if it exists */
-    hash_key = flow_key_hash(key);
-    record = flow_record_list_find_record_by_key(&ctx->flow_record_list_array[hash_key], key);
+    active_tick = flow_timer_tick(start) + (uint64_t)(time_window.tv_sec + active_timeout.tv_sec) * 1000;
+    inactive_tick = flow_timer_tick(end) + (uint64_t)time_window.tv_sec * 1000;
 
-    if (record != NULL) {
-       if (create_new_records && flow_record_is_in_chrono_list(ctx, record)
-           && flow_record_is_active_expired(record, header)) {
-            /*
-             *  Active-timeout exceeded for this flow_record; print and delete
-             *  it, then set record = NULL to cause the creation of a new
-             *  flow_record to be used in further packet processing
-             */
-           /* WMH NEED TO ADJUST THIS */
-           /* FOR NON PRINTING APPLICATIONS, JUST DROP PACKET */
-           flow_record_print_and_delete(ctx, record);
-           record = NULL;
-       } else {
-           return record;
-       }
+    return (active_tick < inactive_tick) ? active_tick : inactive_tick;
+}
+
+/**
+ * \brief Keep the expiry timer of a flow_record up to date when it is looked up.
+ *
+ * The timer of a bidirectional flow lives on whichever record of the
+ * pair is on the chrono list.  Its scheduled tick only has to be a lower
+ * bound on the real expiry time, so a new packet only moves it when the
+ * packet is older than the ones seen so far.  Lookups without a packet
+ * header may be followed by arbitrary changes to the record times
+ * (e.g. IPFIX collection), so those are looked at again on the next sweep.
+ *
+ * \param ctx - the joy context
+ * \param record - the flow_record that was looked up
+ * \param header - header of the packet that is being processed, or NULL
+ * \return none
+ */
+static void flow_record_expiry_touch (joy_ctx_data *ctx,
+                                      flow_record_t *record,
+                                      const struct pcap_pkthdr *header) {
+    uint64_t tick;
+
+    if (record->wheel_pprev == NULL) {
+        record = record->twin;
+        if (record == NULL || record->wheel_pprev == NULL) {
+            return;
+        }
     }
 
-    /* if we get here, then record == NULL  */
+    if (header) {
+        tick = flow_timer_tick(&header->ts) + (uint64_t)time_window.tv_sec * 1000;
+    } else {
+        tick = flow_timer_tick(&ctx->global_time);
+    }
+    if (tick < record->wheel_expires) {
+        flow_timer_mod(&ctx->expiry_wheel, record, tick);
+    }
+}
 
-    if (create_new_records) {
+/**
+ * \brief Order flow_records by their position in the chrono list.
+ */
+static int flow_record_chrono_cmp (const void *a, const void *b) {
+    const flow_record_t *ra = *(flow_record_t * const *)a;
+    const flow_record_t *rb = *(flow_record_t * const *)b;
 
-        /* allocate and initialize a new flow record */
-        record = calloc(1, sizeof(flow_record_t));
-        joy_log_debug("LIST record %p allocated\n", record);
+    if (ra->seq < rb->seq) {
+        return -1;
+    }
+    return (ra->seq > rb->seq);
+}
 
-        if (record == NULL) {
-            joy_log_warn("could not allocate memory for flow_record");
-            flocap_stats_incr_malloc_fail(ctx);
-            return NULL;
-        }
+/**
+ * \brief Find the flow_records that have expired.
+ *
+ * Only the records whose expiry timer is due are examined; those that
+ * are not expired after all are rescheduled.  The expired records are
+ * returned in chrono list order, so output is in the same order as a
+ * walk over the whole chrono list would produce.
+ *
+ * \param ctx - the joy context
+ * \param[out] num_expired - number of expired records
+ * \return flow_record_t ** - array of expired records (owned by the context)
+ */
+static flow_record_t **flow_record_list_get_expired (joy_ctx_data *ctx,
+                                                     unsigned int *num_expired) {
+    flow_timer_wheel_t *wheel = &ctx->expiry_wheel;
+    flow_record_t *record = NULL;
+    flow_record_t *next_record = NULL;
+    flow_record_t **tmp = NULL;
+    unsigned int n = 0;
 
-        flow_record_init(ctx, record, key);
-        record->key_hash = hash_key;
+    record = flow_timer_expire(wheel, flow_timer_tick(&ctx->global_time));
+    while (record != NULL) {
+        next_record = record->wheel_next;
+        record->wheel_next = NULL;
 
-        /* enter record into flow_record_list */
-        flow_record_list_prepend(&ctx->flow_record_list_array[hash_key], record);
+        if (!flow_record_is_expired(ctx, record)) {
+            flow_timer_add(wheel, record, flow_record_expiry_tick(record));
+            record = next_record;
+            continue;
+        }
 
-        /*
-         * if we are tracking bidirectional flows, and if record has a
+        if (n == wheel->batch_size) {
+            tmp = realloc(wheel->batch, (wheel->batch_size * 2 + 64) * sizeof(flow_record_t *));
+            if (tmp == NULL) {
+                /* leave it for the next sweep */
+                joy_log_warn("could not allocate memory for expired flow_records");
+                flocap_stats_incr_malloc_fail(ctx);
+                flow_timer_add(wheel, record, 0);
+                record = next_record;
+                continue;
+            }
+            wheel->batch = tmp;
+            wheel->batch_size = wheel->batch_size * 2 + 64;
+        }
+        wheel->batch[n++] = record;
+        record = next_record;
+    }
+
+    if (n > 1) {
+        qsort(wheel->batch, n, sizeof(flow_record_t *), flow_record_chrono_cmp);
+    }
+    *num_expired = n;
+    return wheel->batch;
+}
+
+/**
+ * \brief Start loading the flow table slot that a lookup of \p key looks at.
+ *
+ * This is the first step in getting the flow records of a batch of
+ * packets into the cache before they are processed; see
+ * flow_key_prefetch_record().
+ *
+ * \param ctx Context whose flow table is going to be searched
+ * \param key The flow key of a packet
+ * \return The hash of \p key, for flow_key_prefetch_record()
+ */
+uint32_t flow_key_prefetch_slot (joy_ctx_data *ctx, const flow_key_t *key) {
+    uint32_t hash_key = flow_key_hash(key);
+
+    flow_table_prefetch(&ctx->flow_table, hash_key);
+    return hash_key;
+}
+
+/**
+ * \brief Start loading the flow record with flow key \p key, if there is one.
+ *
+ * The record is only looked up; the table and the record are left as
+ * they are, and the lines of the record that are used for every packet
+ * (the start, the TCP state, and the links at the end) are prefetched.
+ *
+ * \param ctx Context whose flow table is searched
+ * \param key The flow key of a packet
+ * \param hash_key Hash of \p key, from flow_key_prefetch_slot()
+ * \return none
+ */
+void flow_key_prefetch_record (joy_ctx_data *ctx, const flow_key_t *key, uint32_t hash_key) {
+    const flow_record_t *record = flow_table_find(&ctx->flow_table, key, hash_key);
+
+    if (record != NULL) {
+        joy_prefetch(record);
+        joy_prefetch(&record->tcp);
+        joy_prefetch(&record->twin);
+    }
+}
+
+/**
+ * \brief Check whether a flow has been seen before, in the admission filter.
+ *
+ * The filter is a direct mapped table of the hashes of flows that have
+ * sent one packet.  A flow passes on its second packet, unless a flow
+ * with the same slot came in between; a hash collision lets a flow in
+ * early, which is harmless.
+ *
+ * \param ctx Joy context
+ * \param hash_key Hash of the flow key, from flow_key_hash()
+ * \return 1 if the flow was seen before, 0 otherwise
+ */
+static int flow_admission_seen (joy_ctx_data *ctx, uint32_t hash_key) {
+    uint32_t *slot = &ctx->admission_filter[hash_key & (FLOW_ADMISSION_SLOTS - 1)];
+    uint32_t tag = hash_key ? hash_key : 1;
+
+    if (*slot == tag) {
+        *slot = 0;
+        return 1;
+    }
+    *slot = tag;
+    return 0;
+}
+
+/**
+ * \brief Time of the last packet of a flow, in either direction.
+ * \param record A flow_record on the chrono list
+ * \return The end time of \p record or of its twin, whichever is later
+ */
+static const struct timeval *flow_record_last_active (const flow_record_t *record) {
+    if (record->twin && joy_timer_lt(&record->end, &record->twin->end)) {
+        return &record->twin->end;
+    }
+    return &record->end;
+}
+
+/**
+ * \brief Output and delete a flow early, to make room for a new one.
+ *
+ * The victim is the least recently active of the FLOW_EVICT_SAMPLE
+ * oldest flows on the chrono list, which approximates LRU without
+ * having to move records around on every packet.  Its record (and its
+ * twin) get an expire_type of 'e'.
+ *
+ * \param ctx Joy context
+ * \param keep A record that must not be evicted, or NULL
+ * \return ok, or failure if there was nothing to evict
+ */
+static joy_status_e flow_record_evict (joy_ctx_data *ctx, const flow_record_t *keep) {
+    flow_record_t *record = ctx->flow_record_chrono_first;
+    flow_record_t *victim = NULL;
+    unsigned int i;
+
+    for (i = 0; i < FLOW_EVICT_SAMPLE && record != NULL; record = record->time_next) {
+        if (record == keep || (keep != NULL && record->twin == keep)) {
+            continue;
+        }
+        if (victim == NULL ||
+            joy_timer_lt(flow_record_last_active(record), flow_record_last_active(victim))) {
+            victim = record;
+        }
+        i++;
+    }
+    if (victim == NULL) {
+        return failure;
+    }
+
+    victim->exp_type = expiration_type_evicted;
+    if (victim->twin) {
+        victim->twin->exp_type = expiration_type_evicted;
+    }
+    flocap_stats_incr_evicted_records(ctx);
+    flow_record_print_and_delete(ctx, victim);
+
+    return ok;
+}
+
+/**
+ * \brief Decide whether a new flow gets a flow record.
+ *
+ * With admission control, a flow is only let in once its second packet
+ * is seen, or if it answers a flow that already has a record.  With a
+ * max_flows budget, flows are evicted to make room for it.  The
+ * records that the output writer holds count against the budget until
+ * they are freed, so the writer is waited for (or the flow refused, if
+ * the writer is not to be waited for) while they fill it.  A flow that
+ * is not let in is counted in refused_records.
+ *
+ * \param ctx Joy context
+ * \param key The flow_key of the new flow
+ * \param hash_key Hash of \p key, from flow_key_hash()
+ * \return 1 if a record can be created, 0 otherwise
+ */
+static int flow_key_admit (joy_ctx_data *ctx, const flow_key_t *key, uint32_t hash_key) {
+    const flow_record_t *twin = NULL;
+    unsigned long int held;
+
+    if (glb_config->bidir) {
+        twin = flow_key_get_twin(ctx, key);
+    }
+
+    if (ctx->admission_filter && twin == NULL && !flow_admission_seen(ctx, hash_key)) {
+        flocap_stats_incr_refused_records(ctx);
+        return 0;
+    }
+
+    while (glb_config->max_flows &&
+           ctx->stats.num_records_in_table + ctx->records_held >= glb_config->max_flows) {
+        if (ctx->records_held) {
+            /* evicting more would not make room until the writer is done */
+            held = ctx->records_held;
+            output_writer_reclaim(&ctx->writer);
+            if (ctx->records_held == held) {
+                if (glb_config->backpressure != OUTPUT_WRITER_BLOCK) {
+                    flocap_stats_incr_refused_records(ctx);
+                    return 0;
+                }
+                output_writer_flush(&ctx->writer);
+            }
+            continue;
+        }
+        if (flow_record_evict(ctx, twin) != ok) {
+            flocap_stats_incr_refused_records(ctx);
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/**
+ * \brief Retrieve a flow record using a \p key to find it.
+ * \param key The flow_key to use for lookup of flow record
+ * \param create_new_records Flag for whether a new record should be created
+ * \return pointer to the flow record structure
+ * \return NULL if expired or could not create or retrieve record
+ */
+flow_record_t *flow_key_get_record (joy_ctx_data *ctx,
+                                         const flow_key_t *key,
+                                         unsigned int create_new_records,
+                                         const struct pcap_pkthdr *header) {
+    flow_record_t *record;
+    uint32_t hash_key;
+
+    /* Find a record matching the flow key, if it exists */
+    hash_key = flow_key_hash(key);
+    record = flow_table_find(&ctx->flow_table, key, hash_key);
+
+    if (record != NULL) {
+       if (create_new_records && flow_record_is_in_chrono_list(ctx, record)
+           && flow_record_is_active_expired(record, header)) {
+            /*
+             *  Active-timeout exceeded for this flow_record; print and delete
+             *  it, then set record = NULL to cause the creation of a new
+             *  flow_record to be used in further packet processing
+             */
+           /* WMH NEED TO ADJUST THIS */
+           /* FOR NON PRINTING APPLICATIONS, JUST DROP PACKET */
+           flow_record_print_and_delete(ctx, record);
+           record = NULL;
+       } else {
+           flow_record_expiry_touch(ctx, record, header);
+           return record;
+       }
+    }
+
+    /* if we get here, then record == NULL  */
+
+    if (create_new_records && (glb_config->max_flows || ctx->admission_filter)) {
+        if (!flow_key_admit(ctx, key, hash_key)) {
+            return NULL;
+        }
+    }
+
+    if (create_new_records) {
+
+        /* allocate and initialize a new flow record */
+        record = flow_pool_alloc(&ctx->record_pool, sizeof(flow_record_t));
+        joy_log_debug("LIST record %p allocated\n", record);
+
+        if (record == NULL) {
+            joy_log_warn("could not allocate memory for flow_record");
+            flocap_stats_incr_malloc_fail(ctx);
+            return NULL;
+        }
+
+        flow_record_init(ctx, record, key);
+        record->key_hash = hash_key;
+
+        /* enter record into the flow table */
+        if (flow_table_insert(&ctx->flow_table, record, hash_key) != ok) {
+            joy_log_warn("could not add flow_record to flow table");
+            flocap_stats_incr_malloc_fail(ctx);
+            flocap_stats_decr_records_in_table(ctx);
+            flow_pool_free(&ctx->record_pool, record);
+            return NULL;
+        }
+
+        /*
+         * if we are tracking bidirectional flows, and if record has a
          * twin, then set both twin pointers; otherwise, enter the
          * record into the chronological list
          */
         if (glb_config->bidir) {
-            record->twin = flow_key_get_twin(ctx, key, hash_key);
+            record->twin = flow_key_get_twin(ctx, key);
             joy_log_debug("LIST record %p is twin of %p\n", record, record->twin);
         }
         if (record->twin != NULL) {
@@ -698,11 +1217,16 @@ flow_record_t *flow_key_get_record (joy_ctx_data *ctx,
                 flow_record_chrono_list_append(ctx, record);
             } else {
                 record->twin->twin = record;
+                flow_record_nat_index_remove(ctx, record->twin);
+                flow_record_expiry_touch(ctx, record, header);
             }
         } else {
 
             /* this flow has no twin, so add it to chronological list */
             flow_record_chrono_list_append(ctx, record);
+            if (glb_config->bidir) {
+                flow_record_nat_index_add(ctx, record);
+            }
         }
     }
 
@@ -710,18 +1234,23 @@ flow_record_t *flow_key_get_record (joy_ctx_data *ctx,
 }
 
 /**
- * \brief Delete a flow record.
- * \param r The flow_record to delete
- * \return none
+ * \brief Take a flow record out of the flow table and the context counts.
+ *
+ * The record itself is left alone, so that it can still be printed;
+ * flow_record_free() releases it.
+ *
+ * \param r The flow_record to take out
+ * \return ok, failure if it was not in the flow table
  */
-static void flow_record_delete (joy_ctx_data *ctx, flow_record_t *r) {
+static joy_status_e flow_record_unlink (joy_ctx_data *ctx, flow_record_t *r) {
 
-    if (flow_record_list_remove(&ctx->flow_record_list_array[r->key_hash], r) != 0) {
-        joy_log_err("problem removing flow record %p from list", r);
-        return;
+    if (flow_table_remove(&ctx->flow_table, r, r->key_hash) != ok) {
+        joy_log_err("problem removing flow record %p from flow table", r);
+        return failure;
     }
 
     flocap_stats_decr_records_in_table(ctx);
+    flow_record_nat_index_remove(ctx, r);
 
     /* update context counts */
     if (r->idp_len > 0) {
@@ -748,6 +1277,16 @@ static void flow_record_delete (joy_ctx_data *ctx, flow_record_t *r) {
         }
     }
 
+    return ok;
+}
+
+/**
+ * \brief Free a flow record that has been taken out of the flow table.
+ * \param r The flow_record to free
+ * \return none
+ */
+static void flow_record_free (joy_ctx_data *ctx, flow_record_t *r) {
+
     /*
      * free the memory allocated inside of flow record
      */
@@ -757,6 +1296,7 @@ static void flow_record_delete (joy_ctx_data *ctx, flow_record_t *r) {
     free(r->file_version);
     free(r->file_hash);
     free(r->joy_app_data);
+    flow_record_free_cold(ctx, r);
 
     delete_all_features(feature_list);
 
@@ -765,10 +1305,21 @@ static void flow_record_delete (joy_ctx_data *ctx, flow_record_t *r) {
      * records will result in crashes rather than silent errors)
      */
     memset_s(r, sizeof(flow_record_t), 0, sizeof(flow_record_t));
-    free(r);
+    flow_pool_free(&ctx->record_pool, r);
     r = NULL;
 }
 
+/**
+ * \brief Delete a flow record.
+ * \param r The flow_record to delete
+ * \return none
+ */
+static void flow_record_delete (joy_ctx_data *ctx, flow_record_t *r) {
+    if (flow_record_unlink(ctx, r) == ok) {
+        flow_record_free(ctx, r);
+    }
+}
+
 /**
 * \fn int flow_key_set_process_info (const flow_key_t *key, const host_flow_t *data)
 * \param key flow key structure
@@ -823,16 +1374,28 @@ void flow_record_update_timeouts (unsigned int inact, unsigned int act) {
 }
 
 /**
- * \brief Update the byte count for the flow record.
+ * \brief Update the byte distribution statistics and the walsh-hadamard
+ *        transform of the flow record with a payload.
+ * \param ctx Context the record belongs to
  * \param f Flow record
- * \param x Data to use for update
- * \param len Length of the data (in bytes)
+ * \param x Payload
+ * \param len Length of the payload (in bytes)
  * \return none
  */
-void flow_record_update_byte_count (flow_record_t *f, const void *x, unsigned int len) {
-    const unsigned char *data = x;
-    unsigned int i;
+void flow_record_update_payload_stats (joy_ctx_data *ctx, flow_record_t *f, const void *x, unsigned int len) {
+    payload_stats_t stats;
+    uint32_t *byte_count = NULL;
+    uint32_t *compact_byte_count = NULL;
+    unsigned int byte_count_len = 0;
     unsigned int current_count = 0;
+    int want_stats = 0;
+
+    if (glb_config->report_wht && f->wht == NULL) {
+        wht_init(&f->wht, &ctx->feature_pools.wht);
+    }
+    if (len == 0) {
+        return;
+    }
 
     /*
      * implementation note: The spec says that 4000 octets is enough of a
@@ -846,54 +1409,36 @@ void flow_record_update_byte_count (flow_record_t *f, const void *x, unsigned in
 
     if (glb_config->byte_distribution || glb_config->report_entropy) {
         if (current_count < ETTA_MIN_OCTETS) {
-            for (i=0; i<len; i++) {
-                f->byte_count[data[i]]++;
-                current_count++;
-                if (current_count >= ETTA_MIN_OCTETS) {
-                   break;
-                }
-            }
+            byte_count = flow_record_byte_count(ctx, f);
+            byte_count_len = ETTA_MIN_OCTETS - current_count;
         }
+        want_stats = 1;
     }
-}
-
-/**
- * \brief Update the compact byte count for the flow record.
- * \param f Flow record
- * \param x Data to use for update
- * \param len Length of the data (in bytes)
- * \return none
- */
-void flow_record_update_compact_byte_count (flow_record_t *f, const void *x, unsigned int len) {
-    const unsigned char *data = x;
-    unsigned int i;
 
     if (glb_config->compact_byte_distribution) {
-        for (i=0; i<len; i++) {
-            f->compact_byte_count[glb_config->compact_bd_mapping[data[i]]]++;
+        if (f->compact_byte_count == NULL) {
+            f->compact_byte_count = flow_pool_set_calloc(&ctx->cold_pools, 16 * sizeof(uint32_t));
+            if (f->compact_byte_count == NULL) {
+                flocap_stats_incr_malloc_fail(ctx);
+            }
         }
+        compact_byte_count = f->compact_byte_count;
     }
-}
 
-/**
- * \brief Update the byte distribution mean for the flow record.
- * \param f Flow record
- * \param x Data to use for update
- * \param len Length of the data (in bytes)
- * \return none
- */
-void flow_record_update_byte_dist_mean_var (flow_record_t *f, const void *x, unsigned int len) {
-    const unsigned char *data = x;
-    double delta;
-    unsigned int i;
+    if (f->wht != NULL) {
+        want_stats = 1;
+    }
+
+    payload_stats_scan(x, len, byte_count, byte_count_len, compact_byte_count,
+                       glb_config->compact_bd_mapping, want_stats ? &stats : NULL);
 
     if (glb_config->byte_distribution || glb_config->report_entropy) {
-        for (i=0; i<len; i++) {
-            f->num_bytes += 1;
-            delta = ((double)data[i] - f->bd_mean);
-            f->bd_mean += delta/((double)f->num_bytes);
-            f->bd_variance += delta*((double)data[i] - f->bd_mean);
-        }
+        f->num_bytes += len;
+        f->bd_sum += stats.sum;
+        f->bd_sum_sq += stats.sum_sq;
+    }
+    if (f->wht != NULL) {
+        wht_update_spectrum(f->wht, len, stats.wht);
     }
 }
 
@@ -912,18 +1457,21 @@ static float flow_record_get_byte_count_entropy (const uint32_t byte_count[256],
     return sum / logf(2.0);
 }
 
-static void print_bytes_dir_time (joy_ctx_data *ctx,
-                                  unsigned short int pkt_len,
-                                  const char *dir,
-                                  struct timeval ts,
+static void print_bytes_dir_time (json_buf_t *j,
+                                  const joybin_pkt_t *pkt,
                                   const char *term) {
-    if (pkt_len < 32768) {
-        zprintf(ctx->output, "{\"b\":%u,\"dir\":\"%s\",\"ipt\":%u}%s",
-                    pkt_len, dir, joy_timeval_to_milliseconds(ts), term);
+    if (pkt->len < 32768) {
+        json_buf_write(j, "{\"b\":", 5);
+        json_buf_uint(j, pkt->len);
     } else {
-        zprintf(ctx->output, "{\"rep\":%u,\"dir\":\"%s\",\"ipt\":%u}%s",
-                    65536-pkt_len, dir, joy_timeval_to_milliseconds(ts), term);
-    }
+        json_buf_write(j, "{\"rep\":", 7);
+        json_buf_uint(j, 65536-pkt->len);
+    }
+    json_buf_write(j, pkt->in ? ",\"dir\":\">" : ",\"dir\":\"<", 9);
+    json_buf_write(j, "\",\"ipt\":", 8);
+    json_buf_uint(j, pkt->ipt);
+    json_buf_putc(j, '}');
+    json_buf_puts(j, term);
 }
 
 /**
@@ -936,14 +1484,21 @@ static void print_bytes_dir_time (joy_ctx_data *ctx,
 void zprintf_raw_as_hex (zfile f,
                          const unsigned char *data,
                          unsigned int len) {
-    const unsigned char *x = data;
-    const unsigned char *end = data + len;
-
-    zprintf(f, "\"");   /* quotes needed for JSON */
-    while (x < end) {
-        zprintf(f, "%02x", *x++);
+    static const char hex[] = "0123456789abcdef";
+    char out[512];
+    unsigned int n = 0;
+
+    out[n++] = '"';   /* quotes needed for JSON */
+    while (len--) {
+        if (n > sizeof(out) - 3) {
+            zwrite(f, out, n);
+            n = 0;
+        }
+        out[n++] = hex[*data >> 4];
+        out[n++] = hex[*data++ & 0x0f];
     }
-    zprintf(f, "\"");
+    out[n++] = '"';
+    zwrite(f, out, n);
 }
 
 static void reduce_bd_bits (uint32_t *bd,
@@ -978,54 +1533,71 @@ static void reduce_bd_bits (uint32_t *bd,
  *
  * \return none
  */
-static void print_executable_json (zfile f, const flow_record_t *rec) {
+static void print_executable_json (json_buf_t *j, const flow_record_t *rec) {
     uint8_t comma = 0;
 
     if (rec->exe_name || rec->full_path ||
         rec->file_version || rec->file_hash) {
 
-        zprintf(f, ",\"exe\":{");
+        json_buf_puts(j, ",\"exe\":{");
         if (rec->exe_name) {
-            zprintf(f, "\"name\":\"%s\"", rec->exe_name);
+            json_buf_puts(j, "\"name\":\"");
+            json_buf_puts(j, rec->exe_name);
+            json_buf_putc(j, '"');
             comma = 1;
         }
         if (rec->full_path) {
             if (comma) {
-                zprintf(f, ",\"path\":\"%s\"", rec->full_path);
+                json_buf_puts(j, ",\"path\":\"");
+                json_buf_puts(j, rec->full_path);
+                json_buf_putc(j, '"');
             } else {
-                zprintf(f, "\"path\":\"%s\"", rec->full_path);
+                json_buf_puts(j, "\"path\":\"");
+                json_buf_puts(j, rec->full_path);
+                json_buf_putc(j, '"');
                 comma = 1;
             }
         }
         if (rec->file_version) {
             if (comma) {
-                zprintf(f, ",\"version\":\"%s\"", rec->file_version);
+                json_buf_puts(j, ",\"version\":\"");
+                json_buf_puts(j, rec->file_version);
+                json_buf_putc(j, '"');
             } else {
-                zprintf(f, "\"version\":\"%s\"", rec->file_version);
+                json_buf_puts(j, "\"version\":\"");
+                json_buf_puts(j, rec->file_version);
+                json_buf_putc(j, '"');
                 comma = 1;
             }
         }
         if (rec->file_hash) {
             if (comma) {
-                zprintf(f, ",\"hash\":\"%s\"", rec->file_hash);
+                json_buf_puts(j, ",\"hash\":\"");
+                json_buf_puts(j, rec->file_hash);
+                json_buf_putc(j, '"');
             } else {
-                zprintf(f, "\"hash\":\"%s\"", rec->file_hash);
+                json_buf_puts(j, "\"hash\":\"");
+                json_buf_puts(j, rec->file_hash);
+                json_buf_putc(j, '"');
                 comma = 1;
             }
         }
         if (rec->uptime_seconds > 0) {
             if (comma) {
-                zprintf(f, ",\"uptime\":%llu", (unsigned long long)rec->uptime_seconds);
+                json_buf_puts(j, ",\"uptime\":");
+                json_buf_uint(j, rec->uptime_seconds);
             } else {
-                zprintf(f, "\"uptime\":%llu", (unsigned long long)rec->uptime_seconds);
+                json_buf_puts(j, "\"uptime\":");
+                json_buf_uint(j, rec->uptime_seconds);
                 comma = 1;
             }
         }
-        zprintf(f, "}");
+        json_buf_putc(j, '}');
     }
 }
 
-static void print_tcp_json (zfile f, const flow_record_t *rec) {
+static void print_tcp_json (joy_ctx_data *ctx, const flow_record_t *rec) {
+    json_buf_t *j = &ctx->json;
     int top_com = 0;
     int com = 0;
     int empty = 1;
@@ -1055,13 +1627,15 @@ static void print_tcp_json (zfile f, const flow_record_t *rec) {
         return;
     }
 
-    zprintf(f, ",\"tcp\":{");
+    json_buf_puts(j, ",\"tcp\":{");
 
     if (rec->tcp.first_seq) {
-        zprintf(f, "\"first_seq\":%u", rec->tcp.first_seq);
+        json_buf_puts(j, "\"first_seq\":");
+        json_buf_uint(j, rec->tcp.first_seq);
         top_com = 1;
     } else if (rec->twin != NULL && rec->twin->tcp.first_seq) {
-        zprintf(f, "\"first_seq\":%u", rec->twin->tcp.first_seq);
+        json_buf_puts(j, "\"first_seq\":");
+        json_buf_uint(j, rec->twin->tcp.first_seq);
         top_com = 1;
     }
 
@@ -1069,38 +1643,46 @@ static void print_tcp_json (zfile f, const flow_record_t *rec) {
         char out_flags_string[9] = {0};
 
         if (top_com) {
-            zprintf(f, ",\"out\":{");
+            json_buf_puts(j, ",\"out\":{");
         } else {
-            zprintf(f, "\"out\":{");
+            json_buf_puts(j, "\"out\":{");
             top_com = 1;
         }
 
         if (rec->tcp.flags) {
             tcp_flags_to_string(rec->tcp.flags, out_flags_string);
-            zprintf(f, "\"flags\":\"%s\"", out_flags_string);
+            json_buf_puts(j, "\"flags\":\"");
+            json_buf_puts(j, out_flags_string);
+            json_buf_putc(j, '"');
             com = 1;
         }
 
         if (rec->tcp.first_window_size) {
             if (com) {
-                zprintf(f, ",\"first_window_size\":%u", rec->tcp.first_window_size);
+                json_buf_puts(j, ",\"first_window_size\":");
+                json_buf_uint(j, rec->tcp.first_window_size);
             } else {
-                zprintf(f, "\"first_window_size\":%u", rec->tcp.first_window_size);
+                json_buf_puts(j, "\"first_window_size\":");
+                json_buf_uint(j, rec->tcp.first_window_size);
                 com = 1;
             }
         }
 
         if (rec->tcp.opt_len) {
             if (com) {
-                zprintf(f, ",\"opt_len\":%u", rec->tcp.opt_len);
+                json_buf_puts(j, ",\"opt_len\":");
+                json_buf_uint(j, rec->tcp.opt_len);
             } else {
-                zprintf(f, "\"opt_len\":%u", rec->tcp.opt_len);
+                json_buf_puts(j, "\"opt_len\":");
+                json_buf_uint(j, rec->tcp.opt_len);
             }
-            tcp_opt_print_json(f, rec->tcp.opts, rec->tcp.opt_len);
+            /* the options print through the output, so what is buffered goes first */
+            json_buf_commit(j, ctx->output);
+            tcp_opt_print_json(ctx->output, rec->tcp.opts, rec->tcp.opt_len);
         }
 
         /* End out object */
-        zprintf(f, "}");
+        json_buf_putc(j, '}');
     }
 
     if (!in_empty) {
@@ -1108,76 +1690,89 @@ static void print_tcp_json (zfile f, const flow_record_t *rec) {
         com = 0;
 
         if (top_com) {
-            zprintf(f, ",\"in\":{");
+            json_buf_puts(j, ",\"in\":{");
         } else {
-            zprintf(f, "\"in\":{");
+            json_buf_puts(j, "\"in\":{");
         }
 
         if (rec->twin->tcp.flags) {
             tcp_flags_to_string(rec->twin->tcp.flags, in_flags_string);
-            zprintf(f, "\"flags\":\"%s\"", in_flags_string);
+            json_buf_puts(j, "\"flags\":\"");
+            json_buf_puts(j, in_flags_string);
+            json_buf_putc(j, '"');
             com = 1;
         }
 
         if (rec->twin->tcp.first_window_size) {
             if (com) {
-                zprintf(f, ",\"first_window_size\":%u", rec->twin->tcp.first_window_size);
+                json_buf_puts(j, ",\"first_window_size\":");
+                json_buf_uint(j, rec->twin->tcp.first_window_size);
             } else {
-                zprintf(f, "\"first_window_size\":%u", rec->twin->tcp.first_window_size);
+                json_buf_puts(j, "\"first_window_size\":");
+                json_buf_uint(j, rec->twin->tcp.first_window_size);
                 com = 1;
             }
         }
 
         if (rec->twin->tcp.opt_len) {
             if (com) {
-                zprintf(f, ",\"opt_len\":%u", rec->twin->tcp.opt_len);
+                json_buf_puts(j, ",\"opt_len\":");
+                json_buf_uint(j, rec->twin->tcp.opt_len);
             } else {
-                zprintf(f, "\"opt_len\":%u", rec->twin->tcp.opt_len);
+                json_buf_puts(j, "\"opt_len\":");
+                json_buf_uint(j, rec->twin->tcp.opt_len);
             }
-            tcp_opt_print_json(f, rec->twin->tcp.opts, rec->twin->tcp.opt_len);
+            json_buf_commit(j, ctx->output);
+            tcp_opt_print_json(ctx->output, rec->twin->tcp.opts, rec->twin->tcp.opt_len);
         }
 
         /* End in object */
-        zprintf(f, "}");
+        json_buf_putc(j, '}');
     }
 
     /* End tcp object */
-    zprintf(f, "}");
+    json_buf_putc(j, '}');
 }
 
-static void print_ip_json (zfile f, const flow_record_t *rec) {
+static void print_ip_json (json_buf_t *j, const flow_record_t *rec) {
     int k = 0;
 
-    zprintf(f, ",\"ip\":{");
+    json_buf_puts(j, ",\"ip\":{");
 
-    zprintf(f, "\"out\":{");
-    zprintf(f, "\"ttl\":%u", rec->ip.ttl);
+    json_buf_puts(j, "\"out\":{");
+    json_buf_puts(j, "\"ttl\":");
+    json_buf_uint(j, rec->ip.ttl);
     if (rec->ip.num_id) {
-        zprintf(f, ",\"id\":[");
+        json_buf_puts(j, ",\"id\":[");
         for (k = 0; k < rec->ip.num_id - 1; k++) {
-            zprintf(f, "%u,", rec->ip.id[k]);
+            json_buf_uint(j, rec->ip.id[k]);
+            json_buf_putc(j, ',');
         }
-        zprintf(f, "%u]", rec->ip.id[k]);
+        json_buf_uint(j, rec->ip.id[k]);
+        json_buf_putc(j, ']');
     }
     /* End out object */
-    zprintf(f, "}");
+    json_buf_putc(j, '}');
 
     if (rec->twin) {
-        zprintf(f, ",\"in\":{");
-        zprintf(f, "\"ttl\":%u", rec->twin->ip.ttl);
+        json_buf_puts(j, ",\"in\":{");
+        json_buf_puts(j, "\"ttl\":");
+        json_buf_uint(j, rec->twin->ip.ttl);
         if (rec->twin->ip.num_id) {
-            zprintf(f, ",\"id\":[");
+            json_buf_puts(j, ",\"id\":[");
             for (k = 0; k < rec->twin->ip.num_id - 1; k++) {
-                zprintf(f, "%u,", rec->twin->ip.id[k]);
+                json_buf_uint(j, rec->twin->ip.id[k]);
+                json_buf_putc(j, ',');
             }
-            zprintf(f, "%u]", rec->twin->ip.id[k]);
+            json_buf_uint(j, rec->twin->ip.id[k]);
+            json_buf_putc(j, ']');
         }
         /* End in object */
-        zprintf(f, "}");
+        json_buf_putc(j, '}');
     }
 
     /* End IP object */
-    zprintf(f, "}");
+    json_buf_putc(j, '}');
 }
 
 static const flow_record_t *tcp_client_flow(const flow_record_t *a,
@@ -1239,27 +1834,20 @@ static const flow_record_t *get_client_flow(const flow_record_t *a,
     return tcp_client_flow(a, b);
 }
 
-#define OUT "<"
-#define IN  ">"
-
 /**
- * \brief Print a flow record to the JSON output.
+ * \brief Pick the client side of a flow, and the times at which it
+ * started and ended.
  *
  * \param record Flow record to print
+ * \param ts_start Start of the flow
+ * \param ts_end End of the flow
  *
- * \return none
+ * \return The record of the client side, which is record or its twin
  */
-static void flow_record_print_json
- (joy_ctx_data *ctx, const flow_record_t *record) {
-    unsigned int i, j, imax, jmax;
-    struct timeval ts, ts_last, ts_start, ts_end, ts_tmp;
+static const flow_record_t *flow_record_client (const flow_record_t *record,
+                                                struct timeval *ts_start,
+                                                struct timeval *ts_end) {
     const flow_record_t *rec = NULL;
-    unsigned int pkt_len;
-    const char *dir;
-    char ipv4_addr[INET_ADDRSTRLEN];
-
-    flocap_stats_incr_records_output(ctx);
-    ctx->records_in_file++;
 
     if (record->twin != NULL) {
         /*
@@ -1269,18 +1857,18 @@ static void flow_record_print_json
          */
         rec = get_client_flow(record, record->twin);
         if (rec != NULL) {
-            ts_start = rec->start;
-            ts_end = record->end;
+            *ts_start = rec->start;
+            *ts_end = record->end;
         } else {
             /*
              * Get start time.
              * Use the smaller of the 2 time values.
              */
             if (joy_timer_lt(&record->start, &record->twin->start)) {
-                ts_start = record->start;
+                *ts_start = record->start;
                 rec = record;
             } else {
-                ts_start = record->twin->start;
+                *ts_start = record->twin->start;
                 rec = record->twin;
             }
 
@@ -1289,249 +1877,381 @@ static void flow_record_print_json
              * Use the larger of the 2 time values.
              */
             if (joy_timer_lt(&record->end, &record->twin->end)) {
-                ts_end = record->twin->end;
+                *ts_end = record->twin->end;
             } else {
-                ts_end = record->end;
+                *ts_end = record->end;
             }
         }
     } else {
         /*
          * The flow is unidirectional. Easy enough.
          */
-        ts_start = record->start;
-        ts_end = record->end;
+        *ts_start = record->start;
+        *ts_end = record->end;
         rec = record;
     }
+    return rec;
+}
 
-    /*****************************************************************
-     * ---------------------------------------------------------------
-     * Flow Record object start
-     * ---------------------------------------------------------------
-     *****************************************************************
-     */
-    zprintf(ctx->output, "{");
+/**
+ * \brief Merge the packets of a flow and its twin in order of arrival.
+ *
+ * The packets of rec go ">" and those of its twin "<", unless the
+ * flow is unidirectional, in which case they all go "<".
+ *
+ * \param rec Record of the client side, from flow_record_client()
+ * \param ts_start Start of the flow
+ * \param pkts Receives the packets, of which there are at most JOYBIN_MAX_PKTS
+ *
+ * \return Number of packets
+ */
+static unsigned int flow_record_merge_pkts (const flow_record_t *rec,
+                                            const struct timeval *ts_start,
+                                            joybin_pkt_t *pkts) {
+    unsigned int i, j, imax, jmax, n = 0;
 
-    if (ipv4_addr_needs_anonymization(&rec->key.sa)) {
-        zprintf(ctx->output, "\"sa\":\"%s\",", addr_get_anon_hexstring(&rec->key.sa));
-    } else {
-        inet_ntop(AF_INET, &rec->key.sa, ipv4_addr, INET_ADDRSTRLEN);
-        zprintf(ctx->output, "\"sa\":\"%s\",", ipv4_addr);
-    }
-    if (ipv4_addr_needs_anonymization(&rec->key.da)) {
-        zprintf(ctx->output, "\"da\":\"%s\",", addr_get_anon_hexstring(&rec->key.da));
+    if (rec->twin == NULL) {
+        imax = flow_record_num_pkts(rec);
+        for (i = 0; i < imax; i++) {
+            pkts[i].len = rec->pkt_len[i];
+            pkts[i].in = 0;
+            pkts[i].ipt = i ? joy_usec_to_milliseconds((int64_t)rec->pkt_time[i] - rec->pkt_time[i-1]) : 0;
+        }
+        n = imax;
     } else {
-        inet_ntop(AF_INET, &rec->key.da, ipv4_addr, INET_ADDRSTRLEN);
-        zprintf(ctx->output, "\"da\":\"%s\",", ipv4_addr);
-    }
-    zprintf(ctx->output, "\"pr\":%u,", rec->key.prot);
+        const flow_record_t *twin = rec->twin;
+        int64_t t, t_rec = 0, t_twin = 0, t_last;
 
-    if (rec->key.prot == 6 || rec->key.prot == 17) {
-        zprintf(ctx->output, "\"sp\":%u,", rec->key.sp);
-        zprintf(ctx->output, "\"dp\":%u,", rec->key.dp);
-    } else {
-        /* Make dp/sp null so that they can still be compared */
-        zprintf(ctx->output, "\"sp\":null,");
-        zprintf(ctx->output, "\"dp\":null,");
+        imax = flow_record_num_pkts(rec);
+        jmax = flow_record_num_pkts(twin);
+        i = j = 0;
+        t_last = joy_timeval_to_usec(ts_start);
+
+        /* arrival times are merged as microseconds since the epoch */
+        if (imax) {
+            t_rec = joy_time_delta_to_usec(&rec->pkt_time_base, rec->pkt_time[0]);
+        }
+        if (jmax) {
+            t_twin = joy_time_delta_to_usec(&twin->pkt_time_base, twin->pkt_time[0]);
+        }
+        while ((i < imax) || (j < jmax)) {
+            /* use the list with the lowest time, until one is exhausted */
+            if (j >= jmax || (i < imax && t_rec < t_twin)) {
+                pkts[n].in = 1;
+                pkts[n].len = rec->pkt_len[i];
+                t = t_rec;
+                if (++i < imax) {
+                    t_rec = joy_time_delta_to_usec(&rec->pkt_time_base, rec->pkt_time[i]);
+                }
+            } else {
+                pkts[n].in = 0;
+                pkts[n].len = twin->pkt_len[j];
+                t = t_twin;
+                if (++j < jmax) {
+                    t_twin = joy_time_delta_to_usec(&twin->pkt_time_base, twin->pkt_time[j]);
+                }
+            }
+            pkts[n++].ipt = joy_usec_to_milliseconds(t - t_last);
+            t_last = t;
+        }
     }
+    return n;
+}
 
-    /*
-     * if src or dst address matches a subnets associated with labels,
-     * then print out those labels
-     */
-    if (glb_config->num_subnets) {
-        attr_flags flag;
+/**
+ * \brief Add up the byte distribution of a flow and its twin.
+ *
+ * \param rec Record of the client side, from flow_record_client()
+ * \param bd Receives the byte counts
+ * \param compact_bd Receives the compact byte counts
+ * \param num_bytes Receives the number of bytes of application data
+ * \param mean Receives the mean of the bytes
+ * \param std Receives their standard deviation
+ *
+ * \return none
+ */
+static void flow_record_byte_dist (const flow_record_t *rec,
+                                   uint32_t *bd,
+                                   uint32_t *compact_bd,
+                                   unsigned int *num_bytes,
+                                   double *mean,
+                                   double *std) {
+    const uint32_t *byte_count = rec->byte_count ? rec->byte_count : zero_byte_count;
+    const uint32_t *compact_byte_count = rec->compact_byte_count ?
+                                         rec->compact_byte_count : zero_compact_byte_count;
+    double variance = 0.0;
+    unsigned int i;
 
-        flag = radix_trie_lookup_addr(glb_config->rt, rec->key.sa);
-        attr_flags_json_print_labels(glb_config->rt, flag, "sa_labels", ctx->output);
-        flag = radix_trie_lookup_addr(glb_config->rt, rec->key.da);
-        attr_flags_json_print_labels(glb_config->rt, flag, "da_labels", ctx->output);
-    }
+    *mean = 0.0;
+    *std = 0.0;
 
     /*
-     * Flow stats
+     * Sum up the byte_count array for outbound and inbound flows,
+     * if this flow is bidirectional
      */
-    zprintf(ctx->output, "\"bytes_out\":%u,", rec->ob);
-    zprintf(ctx->output, "\"num_pkts_out\":%u,", rec->np); /* not just packets with data */
-    if (rec->twin != NULL) {
-        zprintf(ctx->output, "\"bytes_in\":%u,", rec->twin->ob);
-        zprintf(ctx->output, "\"num_pkts_in\":%u,", rec->twin->np);
-    }
-#ifdef WIN32
-        zprintf(ctx->output, "\"time_start\":%i.%06i,", ts_start.tv_sec, ts_start.tv_usec);
-        zprintf(ctx->output, "\"time_end\":%i.%06i,", ts_end.tv_sec, ts_end.tv_usec);
-#else
-    zprintf(ctx->output, "\"time_start\":%zd.%06zd,", ts_start.tv_sec, (long)ts_start.tv_usec);
-    zprintf(ctx->output, "\"time_end\":%zd.%06zd,", ts_end.tv_sec, (long)ts_end.tv_usec);
-#endif
+    if (rec->twin == NULL) {
+        *num_bytes = rec->ob;
 
-    /*****************************************************************
-     * Packet length and time array
-     *****************************************************************
-     */
-    zprintf(ctx->output, "\"packets\":[");
+        for (i=0; i<256; i++) {
+            bd[i] = byte_count[i];
+        }
+        for (i=0; i<16; i++) {
+            compact_bd[i] = compact_byte_count[i];
+        }
 
-    if (rec->twin == NULL) {
+        if (rec->num_bytes != 0) {
+            payload_stats_moments(rec->num_bytes, rec->bd_sum, rec->bd_sum_sq, mean, &variance);
+            variance = variance/(rec->num_bytes - 1);
+            variance = sqrt(variance);
 
-        imax = rec->op > glb_config->num_pkts ? glb_config->num_pkts : rec->op;
-        if (imax == 0) {
-            ; /* no packets had data, so we print out nothing */
-        } else {
-            for (i = 0; i < imax-1; i++) {
-                if (i > 0) {
-                    joy_timer_sub(&rec->pkt_time[i], &rec->pkt_time[i-1], &ts);
-                } else {
-                    joy_timer_clear(&ts);
-                }
-                print_bytes_dir_time(ctx, rec->pkt_len[i], OUT, ts, ",");
-            }
-            if (i == 0) {        /* TODO this code could be simplified */
-                joy_timer_clear(&ts);
-            } else {
-                joy_timer_sub(&rec->pkt_time[i], &rec->pkt_time[i-1], &ts);
+            if (rec->num_bytes == 1) {
+                variance = 0.0;
             }
-            print_bytes_dir_time(ctx, rec->pkt_len[i], OUT, ts, "");
         }
-        zprintf(ctx->output, "]");
     } else {
-        imax = rec->op > glb_config->num_pkts ? glb_config->num_pkts : rec->op;
-        jmax = rec->twin->op > glb_config->num_pkts ? glb_config->num_pkts : rec->twin->op;
-        i = j = 0;
-        ts_last = ts_start;
+        const uint32_t *twin_byte_count = rec->twin->byte_count ?
+                                          rec->twin->byte_count : zero_byte_count;
+        const uint32_t *twin_compact_byte_count = rec->twin->compact_byte_count ?
+                                                  rec->twin->compact_byte_count : zero_compact_byte_count;
 
-        while ((i < imax) || (j < jmax)) {
-            if (i >= imax) {
-                /* record list is exhausted, so use twin */
-                    dir = OUT;
-                    ts = rec->twin->pkt_time[j];
-                    pkt_len = rec->twin->pkt_len[j];
-                    j++;
-            } else if (j >= jmax) {
-                /* twin list is exhausted, so use record */
-                dir = IN;
-                ts = rec->pkt_time[i];
-                pkt_len = rec->pkt_len[i];
-                i++;
-            } else {
-                /* Neither list is exhausted, so use list with lowest time */
-                if (joy_timer_lt(&rec->pkt_time[i], &rec->twin->pkt_time[j])) {
-                    ts = rec->pkt_time[i];
-                    pkt_len = rec->pkt_len[i];
-                    dir = IN;
-                    if (i < imax) i++;
-                } else {
-                    ts = rec->twin->pkt_time[j];
-                    pkt_len = rec->twin->pkt_len[j];
-                    dir = OUT;
-                    if (j < jmax) j++;
-                }
-            }
+        for (i=0; i<256; i++) {
+            bd[i] = byte_count[i] + twin_byte_count[i];
+        }
+        for (i=0; i<16; i++) {
+            compact_bd[i] = compact_byte_count[i] + twin_compact_byte_count[i];
+        }
+        *num_bytes = rec->ob + rec->twin->ob;
+
+        if (rec->num_bytes + rec->twin->num_bytes != 0) {
+            double bd_mean, bd_variance, twin_bd_mean, twin_bd_variance;
+
+            payload_stats_moments(rec->num_bytes, rec->bd_sum, rec->bd_sum_sq, &bd_mean, &bd_variance);
+            payload_stats_moments(rec->twin->num_bytes, rec->twin->bd_sum, rec->twin->bd_sum_sq,
+                                  &twin_bd_mean, &twin_bd_variance);
+            *mean = ((double)rec->num_bytes)/((double)(rec->num_bytes+rec->twin->num_bytes))*bd_mean +
+                    ((double)rec->twin->num_bytes)/((double)(rec->num_bytes+rec->twin->num_bytes))*twin_bd_mean;
 
-            joy_timer_sub(&ts, &ts_last, &ts_tmp);
-            print_bytes_dir_time(ctx, pkt_len, dir, ts_tmp, "");
-            ts_last = ts;
+            variance = ((double)rec->num_bytes)/((double)(rec->num_bytes+rec->twin->num_bytes))*bd_variance +
+                       ((double)rec->twin->num_bytes)/((double)(rec->num_bytes+rec->twin->num_bytes))*twin_bd_variance;
 
-            if (!((i == imax) & (j == jmax))) {
-                /* Done */
-                zprintf(ctx->output, ",");
+            variance = variance/((double)(rec->num_bytes + rec->twin->num_bytes - 1));
+            variance = sqrt(variance);
+            if (rec->num_bytes + rec->twin->num_bytes == 1) {
+                variance = 0.0;
             }
         }
-        zprintf(ctx->output, "]");
     }
+    *std = variance;
+}
 
-    if (glb_config->byte_distribution || glb_config->report_entropy || glb_config->compact_byte_distribution) {
-        const uint32_t *array = NULL;
-        const uint32_t *compact_array = NULL;
-        uint32_t tmp[256];
-        uint32_t compact_tmp[16];
-        unsigned int num_bytes;
-        double mean = 0.0, variance = 0.0;
+/**
+ * \brief Classify a flow inline.
+ *
+ * \param rec Record of the client side, from flow_record_client()
+ *
+ * \return Probability that the flow is malware
+ */
+static float flow_record_classify (const flow_record_t *rec) {
+    if (rec->twin) {
+        return classify(rec->pkt_len, rec->pkt_time, &rec->pkt_time_base,
+                        rec->twin->pkt_len, rec->twin->pkt_time, &rec->twin->pkt_time_base,
+                        rec->start, rec->twin->start,
+                        glb_config->num_pkts, rec->key.sp, rec->key.dp, rec->np, rec->twin->np,
+                        flow_record_num_pkts(rec), flow_record_num_pkts(rec->twin),
+                        rec->ob, rec->twin->ob, glb_config->byte_distribution,
+                        rec->byte_count ? rec->byte_count : zero_byte_count,
+                        rec->twin->byte_count ? rec->twin->byte_count : zero_byte_count);
+    }
+    return classify(rec->pkt_len, rec->pkt_time, &rec->pkt_time_base,
+                    NULL, NULL, NULL, rec->start, rec->start,
+                    glb_config->num_pkts, rec->key.sp, rec->key.dp, rec->np, 0,
+                    flow_record_num_pkts(rec), 0,
+                    rec->ob, 0, glb_config->byte_distribution,
+                    rec->byte_count ? rec->byte_count : zero_byte_count, NULL);
+}
 
-        /*
-         * Sum up the byte_count array for outbound and inbound flows,
-         * if this flow is bidirectional
-         */
-        if (rec->twin == NULL) {
-            array = rec->byte_count;
-            //compact_array = rec->compact_byte_count; //overwritten below fixme
-            num_bytes = rec->ob;
+/*
+ * The feature modules print through the output, so what is buffered
+ * for the record goes out before each of them
+ */
+#define print_feature_after_json(f) \
+    if (rec->f != NULL) { \
+        json_buf_commit(&ctx->json, ctx->output); \
+        f##_print_json(rec->f, (rec->twin ? rec->twin->f : NULL), ctx->output); \
+    }
+#define print_all_features_after_json(feature_list) MAP(print_feature_after_json, feature_list)
 
-            for (i=0; i<256; i++) {
-                      tmp[i] = rec->byte_count[i];
-            }
-            for (i=0; i<16; i++) {
-                      compact_tmp[i] = rec->compact_byte_count[i];
-            }
+/**
+ * \brief Print a flow record to the JSON output.
+ *
+ * \param record Flow record to print
+ *
+ * \return none
+ */
+static void flow_record_print_json
+ (joy_ctx_data *ctx, const flow_record_t *record) {
+    unsigned int i, n;
+    struct timeval ts_start, ts_end;
+    const flow_record_t *rec = NULL;
+    json_buf_t *json = &ctx->json;
+    joybin_pkt_t pkts[JOYBIN_MAX_PKTS];
+    char ipv4_addr[INET_ADDRSTRLEN];
+    char ipv6_addr[INET6_ADDRSTRLEN];
 
-            if (rec->num_bytes != 0) {
-                mean = rec->bd_mean;
-                variance = rec->bd_variance/(rec->num_bytes - 1);
-                variance = sqrt(variance);
+    ctx->records_in_file++;
 
-                if (rec->num_bytes == 1) {
-                    variance = 0.0;
-                }
-            }
+    rec = flow_record_client(record, &ts_start, &ts_end);
+
+    /*****************************************************************
+     * ---------------------------------------------------------------
+     * Flow Record object start
+     * ---------------------------------------------------------------
+     *****************************************************************
+     */
+    json_buf_putc(json, '{');
+
+    if (rec->key.ipv6) {
+        /* anonymization and subnet labels only know about IPv4 */
+        inet_ntop(AF_INET6, &rec->key.sa6, ipv6_addr, INET6_ADDRSTRLEN);
+        json_buf_puts(json, "\"sa\":\"");
+        json_buf_puts(json, ipv6_addr);
+        json_buf_write(json, "\",", 2);
+        inet_ntop(AF_INET6, &rec->key.da6, ipv6_addr, INET6_ADDRSTRLEN);
+        json_buf_puts(json, "\"da\":\"");
+        json_buf_puts(json, ipv6_addr);
+        json_buf_write(json, "\",", 2);
+    } else {
+        if (ipv4_addr_needs_anonymization(&rec->key.sa)) {
+            json_buf_puts(json, "\"sa\":\"");
+            json_buf_puts(json, addr_get_anon_hexstring(&rec->key.sa));
+            json_buf_write(json, "\",", 2);
         } else {
-            for (i=0; i<256; i++) {
-                      tmp[i] = rec->byte_count[i] + rec->twin->byte_count[i];
-            }
-            for (i=0; i<16; i++) {
-                      compact_tmp[i] = rec->compact_byte_count[i] + rec->twin->compact_byte_count[i];
-            }
-            array = tmp;
-            compact_array = compact_tmp;
-            num_bytes = rec->ob + rec->twin->ob;
-
-            if (rec->num_bytes + rec->twin->num_bytes != 0) {
-                mean = ((double)rec->num_bytes)/((double)(rec->num_bytes+rec->twin->num_bytes))*rec->bd_mean +
-                           ((double)rec->twin->num_bytes)/((double)(rec->num_bytes+rec->twin->num_bytes))*rec->twin->bd_mean;
-
-                    variance = ((double)rec->num_bytes)/((double)(rec->num_bytes+rec->twin->num_bytes))*rec->bd_variance +
-                               ((double)rec->twin->num_bytes)/((double)(rec->num_bytes+rec->twin->num_bytes))*rec->twin->bd_variance;
-
-                    variance = variance/((double)(rec->num_bytes + rec->twin->num_bytes - 1));
-                    variance = sqrt(variance);
-                    if (rec->num_bytes + rec->twin->num_bytes == 1) {
-                        variance = 0.0;
-                    }
-            }
+            inet_ntop(AF_INET, &rec->key.sa, ipv4_addr, INET_ADDRSTRLEN);
+            json_buf_puts(json, "\"sa\":\"");
+            json_buf_puts(json, ipv4_addr);
+            json_buf_write(json, "\",", 2);
+        }
+        if (ipv4_addr_needs_anonymization(&rec->key.da)) {
+            json_buf_puts(json, "\"da\":\"");
+            json_buf_puts(json, addr_get_anon_hexstring(&rec->key.da));
+            json_buf_write(json, "\",", 2);
+        } else {
+            inet_ntop(AF_INET, &rec->key.da, ipv4_addr, INET_ADDRSTRLEN);
+            json_buf_puts(json, "\"da\":\"");
+            json_buf_puts(json, ipv4_addr);
+            json_buf_write(json, "\",", 2);
         }
+    }
+    json_buf_puts(json, "\"pr\":");
+    json_buf_uint(json, rec->key.prot);
+    json_buf_putc(json, ',');
+
+    if (rec->key.prot == 6 || rec->key.prot == 17) {
+        json_buf_puts(json, "\"sp\":");
+        json_buf_uint(json, rec->key.sp);
+        json_buf_puts(json, ",\"dp\":");
+        json_buf_uint(json, rec->key.dp);
+        json_buf_putc(json, ',');
+    } else {
+        /* Make dp/sp null so that they can still be compared */
+        json_buf_puts(json, "\"sp\":null,\"dp\":null,");
+    }
+
+    /*
+     * if src or dst address matches a subnets associated with labels,
+     * then print out those labels
+     */
+    if (glb_config->num_subnets && !rec->key.ipv6) {
+        attr_flags flag;
+
+        /* the labels print through the output, so what is buffered goes first */
+        json_buf_commit(json, ctx->output);
+        flag = radix_trie_lookup_addr(glb_config->rt, rec->key.sa);
+        attr_flags_json_print_labels(glb_config->rt, flag, "sa_labels", ctx->output);
+        flag = radix_trie_lookup_addr(glb_config->rt, rec->key.da);
+        attr_flags_json_print_labels(glb_config->rt, flag, "da_labels", ctx->output);
+    }
+
+    /*
+     * Flow stats
+     */
+    json_buf_puts(json, "\"bytes_out\":");
+    json_buf_uint(json, rec->ob);
+    json_buf_puts(json, ",\"num_pkts_out\":");
+    json_buf_uint(json, rec->np); /* not just packets with data */
+    if (rec->twin != NULL) {
+        json_buf_puts(json, ",\"bytes_in\":");
+        json_buf_uint(json, rec->twin->ob);
+        json_buf_puts(json, ",\"num_pkts_in\":");
+        json_buf_uint(json, rec->twin->np);
+    }
+    json_buf_puts(json, ",\"time_start\":");
+    json_buf_time(json, ts_start.tv_sec, (long)ts_start.tv_usec);
+    json_buf_puts(json, ",\"time_end\":");
+    json_buf_time(json, ts_end.tv_sec, (long)ts_end.tv_usec);
+    json_buf_putc(json, ',');
+
+    /*****************************************************************
+     * Packet length and time array
+     *****************************************************************
+     */
+    json_buf_puts(json, "\"packets\":[");
+    n = flow_record_merge_pkts(rec, &ts_start, pkts);
+    for (i = 0; i < n; i++) {
+        print_bytes_dir_time(json, &pkts[i], i < n-1 ? "," : "");
+    }
+    json_buf_putc(json, ']');
+
+    if (glb_config->byte_distribution || glb_config->report_entropy || glb_config->compact_byte_distribution) {
+        uint32_t tmp[256];
+        uint32_t compact_tmp[16];
+        unsigned int num_bytes;
+        double mean, variance;
+
+        flow_record_byte_dist(rec, tmp, compact_tmp, &num_bytes, &mean, &variance);
 
         if (glb_config->byte_distribution) {
             reduce_bd_bits(tmp, 256);
-            array = tmp;
 
-            zprintf(ctx->output, ",\"byte_dist\":[");
+            json_buf_puts(json, ",\"byte_dist\":[");
             for (i = 0; i < 255; i++) {
-                zprintf(ctx->output, "%u,", (unsigned char)array[i]);
+                json_buf_uint(json, (unsigned char)tmp[i]);
+                json_buf_putc(json, ',');
             }
-            zprintf(ctx->output, "%u]", (unsigned char)array[i]);
+            json_buf_uint(json, (unsigned char)tmp[i]);
+            json_buf_putc(json, ']');
 
             /* Output the mean */
             if (num_bytes != 0) {
-                zprintf(ctx->output, ",\"byte_dist_mean\":%f", mean);
-                zprintf(ctx->output, ",\"byte_dist_std\":%f", variance);
+                json_buf_puts(json, ",\"byte_dist_mean\":");
+                json_buf_double(json, mean);
+                json_buf_puts(json, ",\"byte_dist_std\":");
+                json_buf_double(json, variance);
             }
 
         }
 
         if (glb_config->compact_byte_distribution) {
             reduce_bd_bits(compact_tmp, 16);
-            compact_array = compact_tmp;
 
-            zprintf(ctx->output, ",\"compact_byte_dist\":[");
+            json_buf_puts(json, ",\"compact_byte_dist\":[");
             for (i = 0; i < 15; i++) {
-                zprintf(ctx->output, "%u,", (unsigned char)compact_array[i]);
+                json_buf_uint(json, (unsigned char)compact_tmp[i]);
+                json_buf_putc(json, ',');
             }
-            zprintf(ctx->output, "%u]", (unsigned char)compact_array[i]);
+            json_buf_uint(json, (unsigned char)compact_tmp[i]);
+            json_buf_putc(json, ']');
         }
 
         if (glb_config->report_entropy) {
             if (num_bytes != 0) {
-                double entropy = flow_record_get_byte_count_entropy(array, num_bytes);
+                /* the counts, reduced if the byte distribution was printed */
+                double entropy = flow_record_get_byte_count_entropy(tmp, num_bytes);
 
-                zprintf(ctx->output, ",\"entropy\":%f", entropy);
-                zprintf(ctx->output, ",\"total_entropy\":%f", entropy * num_bytes);
+                json_buf_puts(json, ",\"entropy\":");
+                json_buf_double(json, entropy);
+                json_buf_puts(json, ",\"total_entropy\":");
+                json_buf_double(json, entropy * num_bytes);
             }
         }
     }
@@ -1540,41 +2260,27 @@ static void flow_record_print_json
      * Inline classification of flows
      */
     if (glb_config->include_classifier) {
-        float score = 0.0;
-
-        if (rec->twin) {
-            score = classify(rec->pkt_len, rec->pkt_time, rec->twin->pkt_len, rec->twin->pkt_time,
-                                     rec->start, rec->twin->start,
-                                     glb_config->num_pkts, rec->key.sp, rec->key.dp, rec->np, rec->twin->np, rec->op, rec->twin->op,
-                                     rec->ob, rec->twin->ob, glb_config->byte_distribution,
-                                     rec->byte_count, rec->twin->byte_count);
-        } else {
-            score = classify(rec->pkt_len, rec->pkt_time, NULL, NULL,   rec->start, rec->start,
-                                     glb_config->num_pkts, rec->key.sp, rec->key.dp, rec->np, 0, rec->op, 0,
-                                     rec->ob, 0, glb_config->byte_distribution,
-                                     rec->byte_count, NULL);
-        }
-
-        zprintf(ctx->output, ",\"p_malware\":%f", score);
+        json_buf_puts(json, ",\"p_malware\":");
+        json_buf_double(json, flow_record_classify(rec));
     }
 
     /* IP object */
-    print_ip_json(ctx->output, rec);
+    print_ip_json(json, rec);
 
     if (rec->key.prot == 6) {
         /* TCP object */
-        print_tcp_json(ctx->output, rec);
+        print_tcp_json(ctx, rec);
     }
 
     /*
      * All of the feature modules
      */
-    print_all_features(feature_list);
+    print_all_features_after_json(feature_list);
 
     /*
      * Host executable
      */
-    print_executable_json(ctx->output, rec);
+    print_executable_json(json, rec);
 
     if (glb_config->report_hd) {
         /*
@@ -1582,13 +2288,16 @@ static void flow_record_print_json
          * be changed sometime soon, but for now, this will give some
          * experience with this type of data
          */
-        header_description_printf(&rec->hd, ctx->output, glb_config->report_hd);
+        json_buf_commit(json, ctx->output);
+        header_description_printf(rec->hd ? rec->hd : &zero_header_description,
+                                  ctx->output, glb_config->report_hd);
     }
 
     /*
      * Operating system
      */
     if (include_os) {
+        json_buf_commit(json, ctx->output);
         if (rec->twin) {
             os_printf(ctx->output, rec->ip.ttl, rec->tcp.first_window_size, rec->twin->ip.ttl, rec->twin->tcp.first_window_size);
         } else {
@@ -1601,14 +2310,16 @@ static void flow_record_print_json
      */
     if (glb_config->idp) {
         if (rec->idp != NULL) {
-            zprintf(ctx->output, ",\"idp_out\":");
-            zprintf_raw_as_hex(ctx->output, rec->idp, rec->idp_len);
-            zprintf(ctx->output, ",\"idp_len_out\":%u", rec->idp_len);
+            json_buf_puts(json, ",\"idp_out\":");
+            json_buf_hex(json, rec->idp, rec->idp_len);
+            json_buf_puts(json, ",\"idp_len_out\":");
+            json_buf_uint(json, rec->idp_len);
         }
         if (rec->twin && (rec->twin->idp != NULL)) {
-            zprintf(ctx->output, ",\"idp_in\":");
-            zprintf_raw_as_hex(ctx->output, rec->twin->idp, rec->twin->idp_len);
-            zprintf(ctx->output, ",\"idp_len_in\":%u", rec->twin->idp_len);
+            json_buf_puts(json, ",\"idp_in\":");
+            json_buf_hex(json, rec->twin->idp, rec->twin->idp_len);
+            json_buf_puts(json, ",\"idp_len_in\":");
+            json_buf_uint(json, rec->twin->idp_len);
         }
     }
 
@@ -1624,35 +2335,361 @@ static void flow_record_print_json
 
         if (retrans || invalid) {
             uint8_t comma = 0;
-            zprintf(ctx->output, ",\"debug\":{");
+            json_buf_puts(json, ",\"debug\":{");
             if (retrans) {
-                zprintf(ctx->output, "\"tcp_retrans\":%u", retrans);
+                json_buf_puts(json, "\"tcp_retrans\":");
+                json_buf_uint(json, retrans);
                 comma = 1;
             }
             if (invalid) {
                 if (comma) {
-                    zprintf(ctx->output, ",\"invalid\":%u", invalid);
+                    json_buf_puts(json, ",\"invalid\":");
                 } else {
-                    zprintf(ctx->output, "\"invalid\":%u", invalid);
+                    json_buf_puts(json, "\"invalid\":");
                 }
+                json_buf_uint(json, invalid);
             }
-            zprintf(ctx->output, "}");
+            json_buf_putc(json, '}');
         }
 
     }
 
     if (rec->exp_type) {
-        zprintf(ctx->output, ",\"expire_type\":\"%c\"", rec->exp_type);
+        json_buf_puts(json, ",\"expire_type\":\"");
+        json_buf_putc(json, rec->exp_type);
+        json_buf_putc(json, '"');
     }
 
     /*****************************************************************
      * Flow Record object end
      *****************************************************************
      */
-    zprintf(ctx->output, "}\n");
+    json_buf_write(json, "}\n", 2);
+    json_buf_commit(json, ctx->output);
+}
+
+
+
+/**
+ * \brief Fill in a binary record from a flow record.
+ *
+ * The record carries what flow_record_print_json() prints, except for
+ * what joybin.h lists as JSON only; the two have to be changed
+ * together.
+ *
+ * \param record Flow record
+ * \param fields Optional fields to fill in, as joybin_field_e bits
+ * \param bin Binary record to fill in
+ *
+ * \return none
+ */
+static void flow_record_to_binary
+ (const flow_record_t *record, unsigned int fields, joybin_record_t *bin) {
+    struct timeval ts_start, ts_end;
+    const flow_record_t *rec = NULL;
+    const flow_record_t *twin = NULL;
+    unsigned int i;
+
+    rec = flow_record_client(record, &ts_start, &ts_end);
+    twin = rec->twin;
+
+    bin->flags = 0;
+    if (rec->key.ipv6) {
+        bin->flags |= JOYBIN_IPV6;
+        memcpy_s(bin->sa, sizeof(bin->sa), &rec->key.sa6, sizeof(struct in6_addr));
+        memcpy_s(bin->da, sizeof(bin->da), &rec->key.da6, sizeof(struct in6_addr));
+    } else {
+        if (ipv4_addr_needs_anonymization(&rec->key.sa)) {
+            bin->flags |= JOYBIN_SA_ANON;
+            addr_get_anon_bytes(&rec->key.sa, bin->sa);
+        } else {
+            memcpy_s(bin->sa, sizeof(bin->sa), &rec->key.sa, sizeof(struct in_addr));
+        }
+        if (ipv4_addr_needs_anonymization(&rec->key.da)) {
+            bin->flags |= JOYBIN_DA_ANON;
+            addr_get_anon_bytes(&rec->key.da, bin->da);
+        } else {
+            memcpy_s(bin->da, sizeof(bin->da), &rec->key.da, sizeof(struct in_addr));
+        }
+    }
+    bin->prot = rec->key.prot;
+    bin->sp = rec->key.sp;
+    bin->dp = rec->key.dp;
+
+    /*
+     * Flow stats
+     */
+    bin->bytes_out = rec->ob;
+    bin->num_pkts_out = rec->np;
+    if (twin != NULL) {
+        bin->flags |= JOYBIN_TWIN;
+        bin->bytes_in = twin->ob;
+        bin->num_pkts_in = twin->np;
+    }
+    bin->time_start = joy_timeval_to_usec(&ts_start);
+    bin->time_end = joy_timeval_to_usec(&ts_end);
+    bin->num_pkts = flow_record_merge_pkts(rec, &ts_start, bin->pkts);
+
+    if (fields & (JOYBIN_BYTE_DIST | JOYBIN_COMPACT_BYTE_DIST | JOYBIN_ENTROPY)) {
+        uint32_t tmp[256];
+        uint32_t compact_tmp[16];
+        unsigned int num_bytes;
+
+        flow_record_byte_dist(rec, tmp, compact_tmp, &num_bytes,
+                              &bin->byte_dist_mean, &bin->byte_dist_std);
+
+        if (fields & JOYBIN_BYTE_DIST) {
+            reduce_bd_bits(tmp, 256);
+            for (i = 0; i < 256; i++) {
+                bin->byte_dist[i] = (unsigned char)tmp[i];
+            }
+            if (num_bytes != 0) {
+                bin->flags |= JOYBIN_BD_STATS;
+            }
+        }
+        if (fields & JOYBIN_COMPACT_BYTE_DIST) {
+            reduce_bd_bits(compact_tmp, 16);
+            for (i = 0; i < 16; i++) {
+                bin->compact_byte_dist[i] = (unsigned char)compact_tmp[i];
+            }
+        }
+        if ((fields & JOYBIN_ENTROPY) && num_bytes != 0) {
+            bin->flags |= JOYBIN_HAS_ENTROPY;
+            bin->entropy = flow_record_get_byte_count_entropy(tmp, num_bytes);
+            bin->total_entropy = bin->entropy * num_bytes;
+        }
+    }
+    if (fields & JOYBIN_P_MALWARE) {
+        bin->p_malware = flow_record_classify(rec);
+    }
+
+    /* IP */
+    bin->ttl_out = rec->ip.ttl;
+    bin->num_id_out = rec->ip.num_id;
+    for (i = 0; i < rec->ip.num_id && i < JOYBIN_MAX_IP_ID; i++) {
+        bin->id_out[i] = rec->ip.id[i];
+    }
+    if (twin != NULL) {
+        bin->ttl_in = twin->ip.ttl;
+        bin->num_id_in = twin->ip.num_id;
+        for (i = 0; i < twin->ip.num_id && i < JOYBIN_MAX_IP_ID; i++) {
+            bin->id_in[i] = twin->ip.id[i];
+        }
+    }
+
+    /* TCP, without the options */
+    if (rec->key.prot == 6) {
+        bin->first_seq = rec->tcp.first_seq;
+        if (!bin->first_seq && twin != NULL) {
+            bin->first_seq = twin->tcp.first_seq;
+        }
+        bin->tcp_flags_out = rec->tcp.flags;
+        bin->window_out = rec->tcp.first_window_size;
+        if (twin != NULL) {
+            bin->tcp_flags_in = twin->tcp.flags;
+            bin->window_in = twin->tcp.first_window_size;
+        }
+    }
+
+    /*
+     * Initial data packet (IDP)
+     */
+    if (fields & JOYBIN_IDP) {
+        if (rec->idp != NULL) {
+            bin->flags |= JOYBIN_IDP_OUT;
+            bin->idp_out = rec->idp;
+            bin->idp_len_out = rec->idp_len;
+        }
+        if (twin != NULL && twin->idp != NULL) {
+            bin->flags |= JOYBIN_IDP_IN;
+            bin->idp_in = twin->idp;
+            bin->idp_len_in = twin->idp_len;
+        }
+    }
+
+    bin->tcp_retrans = rec->tcp.retrans;
+    bin->invalid = rec->invalid;
+    if (twin != NULL) {
+        bin->tcp_retrans += twin->tcp.retrans;
+        bin->invalid += twin->invalid;
+    }
+    bin->expire_type = (char)rec->exp_type;
+}
+
+/**
+ * \brief Print a flow record to the binary output.
+ *
+ * \param record Flow record to print
+ *
+ * \return none
+ */
+static void flow_record_print_binary
+ (joy_ctx_data *ctx, const flow_record_t *record) {
+    json_buf_t *buf = &ctx->json;
+    joybin_schema_t schema;
+    joybin_record_t bin;
+    size_t len;
+
+    ctx->records_in_file++;
+
+    /* the encoder only looks at the fields of the schema */
+    schema.num_pkts = glb_config->num_pkts;
+    schema.fields = config_binary_fields(glb_config);
+    schema.num_omitted = 0;
+
+    flow_record_to_binary(record, schema.fields, &bin);
+
+    if (buf->size - buf->len < JOYBIN_RECORD_MAX && !json_buf_grow(buf, JOYBIN_RECORD_MAX)) {
+        return;
+    }
+    len = joybin_record_encode((uint8_t *)buf->data + buf->len, buf->size - buf->len, &schema, &bin);
+    buf->len += len;
+    json_buf_commit(buf, ctx->output);
+}
+
+/**
+ * \brief Write the column chunk of the Arrow output, and empty it.
+ *
+ * \return none
+ */
+static void flow_record_write_chunk (joy_ctx_data *ctx) {
+    json_buf_t *buf = &ctx->json;
+    size_t size, len;
+
+    size = joyarrow_batch_encoded_size(ctx->columns);
+    if (buf->size - buf->len < size && !json_buf_grow(buf, size)) {
+        return;
+    }
+    len = joyarrow_batch_encode((uint8_t *)buf->data + buf->len, buf->size - buf->len, ctx->columns);
+    buf->len += len;
+    json_buf_commit(buf, ctx->output);
+}
+
+/**
+ * \brief Add a flow record to the column chunk of the Arrow output,
+ * which is written once it is full.
+ *
+ * \param record Flow record to print
+ *
+ * \return none
+ */
+static void flow_record_print_arrow
+ (joy_ctx_data *ctx, const flow_record_t *record) {
+    joybin_record_t bin;
+
+    if (ctx->columns == NULL) {
+        joybin_schema_t schema;
+
+        config_binary_schema(glb_config, &schema);
+        ctx->columns = joyarrow_batch_new(&schema);
+        if (ctx->columns == NULL) {
+            joy_log_err("could not allocate the column chunk");
+            return;
+        }
+    }
+
+    ctx->records_in_file++;
+    flow_record_to_binary(record, ctx->columns->fields, &bin);
+    if (joyarrow_batch_append(ctx->columns, &bin) != 0) {
+        joy_log_err("could not add a flow record to the column chunk");
+        return;
+    }
+    if (joyarrow_batch_full(ctx->columns)) {
+        flow_record_write_chunk(ctx);
+    }
+}
+
+/**
+ * \brief Print a flow record in the output format of the configuration.
+ *
+ * \param record Flow record to print
+ *
+ * \return none
+ */
+static void flow_record_print (joy_ctx_data *ctx, const flow_record_t *record) {
+    if (glb_config->output_format == OUTPUT_FORMAT_BINARY) {
+        flow_record_print_binary(ctx, record);
+    } else if (glb_config->output_format == OUTPUT_FORMAT_ARROW) {
+        flow_record_print_arrow(ctx, record);
+    } else {
+        flow_record_print_json(ctx, record);
+    }
+}
+
+/**
+ * \brief Print a flow record on the output writer thread.
+ *
+ * \param arg Joy context of the writer
+ * \param record Flow record handed over by flow_record_hand_over()
+ *
+ * \return none
+ */
+static void flow_record_write (void *arg, void *record) {
+    joy_ctx_data *ctx = (joy_ctx_data *)arg;
+
+    if (ctx->output_lock) {
+        pthread_mutex_lock(ctx->output_lock);
+    }
+    flow_record_print(ctx, (flow_record_t *)record);
+    if (ctx->output_lock) {
+        pthread_mutex_unlock(ctx->output_lock);
+    }
+}
+
+/**
+ * \brief Free a flow record, and its twin, once the output writer is done with it.
+ *
+ * \param arg Joy context of the writer
+ * \param record Flow record handed over by flow_record_hand_over()
+ *
+ * \return none
+ */
+static void flow_record_release (void *arg, void *record) {
+    joy_ctx_data *ctx = (joy_ctx_data *)arg;
+    flow_record_t *r = (flow_record_t *)record;
+
+    if (r->twin != NULL) {
+        flow_record_free(ctx, r->twin);
+        ctx->records_held--;
+    }
+    flow_record_free(ctx, r);
+    ctx->records_held--;
 }
 
+/**
+ * \brief Hand a flow record over to the output writer.
+ *
+ * The record and its twin leave the flow table and the chrono list
+ * straight away, as they do when they are printed and deleted, but
+ * their memory is only freed by flow_record_release(), once the
+ * writer is done with them.  If IPFIX export is enabled, the record
+ * is exported first.
+ *
+ * \param record Flow record to write
+ *
+ * \return none
+ */
+static void flow_record_hand_over (joy_ctx_data *ctx, flow_record_t *record) {
+#ifndef JOY_LIB_API
+    if (glb_config->ipfix_export_port) {
+        ipfix_export_main(ctx, record);
+    }
+#endif
+    if (record->twin != NULL) {
+        flow_record_unlink(ctx, record->twin);
+    }
+    flow_record_chrono_list_remove(ctx, record);
+    if (flow_record_unlink(ctx, record) != ok) {
+        return;
+    }
+    ctx->records_held += (record->twin != NULL) ? 2 : 1;
 
+    if (output_writer_submit(&ctx->writer, record) == ok) {
+        flocap_stats_incr_records_output(ctx);
+    } else {
+        flocap_stats_incr_dropped_records(ctx);
+    }
+}
 
 /**
  * \brief Print a flow record to output and delete.
@@ -1666,10 +2703,22 @@ static void flow_record_print_json
  * \return none
  */
 static void flow_record_print_and_delete (joy_ctx_data *ctx, flow_record_t *record) {
+    if (output_writer_running(&ctx->writer)) {
+        flow_record_hand_over(ctx, record);
+        return;
+    }
+
     /*
-     * Print the record to JSON output
+     * Print the record to the output
      */
-    flow_record_print_json(ctx, record);
+    flocap_stats_incr_records_output(ctx);
+    if (ctx->output_lock) {
+        pthread_mutex_lock(ctx->output_lock);
+    }
+    flow_record_print(ctx, record);
+    if (ctx->output_lock) {
+        pthread_mutex_unlock(ctx->output_lock);
+    }
 
 #ifndef JOY_LIB_API
     /*
@@ -1688,7 +2737,36 @@ static void flow_record_print_and_delete (joy_ctx_data *ctx, flow_record_t *reco
         flow_record_delete(ctx, record->twin);
     }
 
-    /* Remove record from chrono list, then delete from flow_record_list_array */
+    /* Remove record from chrono list, then delete from flow table */
+    flow_record_chrono_list_remove(ctx, record);
+    flow_record_delete(ctx, record);
+}
+
+/**
+ * \brief Export a flow record over IPFIX and delete it.
+ *
+ * \param record Flow record to export and delete
+ *
+ * \return none
+ */
+static void flow_record_export_and_delete (joy_ctx_data *ctx, flow_record_t *record) {
+    /*
+     * Export this record before deletion if running in
+     * IPFIX exporter mode.
+     */
+    if (glb_config->ipfix_export_port) {
+        ipfix_export_main(ctx,record);
+    }
+
+    /*
+     * Delete twin, if there is one
+     */
+    if (record->twin != NULL) {
+        joy_log_debug("LIST deleting twin\n");
+        flow_record_delete(ctx, record->twin);
+    }
+
+    /* Remove record from chrono list, then delete from flow table */
     flow_record_chrono_list_remove(ctx, record);
     flow_record_delete(ctx, record);
 }
@@ -1705,6 +2783,17 @@ static void flow_record_print_and_delete (joy_ctx_data *ctx, flow_record_t *reco
 void flow_record_export_as_ipfix (joy_ctx_data *ctx, unsigned int export_type) {
     flow_record_t *record = NULL;
     flow_record_t *next_record = NULL;
+    flow_record_t **expired = NULL;
+    unsigned int i, num_expired = 0;
+
+    if (export_type == JOY_EXPIRED_FLOWS) {
+        /* Only visit the flows whose expiry timer is due */
+        expired = flow_record_list_get_expired(ctx, &num_expired);
+        for (i = 0; i < num_expired; i++) {
+            flow_record_export_and_delete(ctx, expired[i]);
+        }
+        return;
+    }
 
     /* The head of chrono record list */
     record = ctx->flow_record_chrono_first;
@@ -1713,33 +2802,7 @@ void flow_record_export_as_ipfix (joy_ctx_data *ctx, unsigned int export_type) {
         /* setup next record */
         next_record = record->time_next;
 
-        if (export_type == JOY_EXPIRED_FLOWS) {
-            /* Avoid printing flows that might still be active */
-            if (!flow_record_is_expired(ctx,record)) {
-                record = next_record;
-                continue;
-            }
-        }
-
-        /*
-         * Export this record before deletion if running in
-         * IPFIX exporter mode.
-         */
-        if (glb_config->ipfix_export_port) {
-            ipfix_export_main(ctx,record);
-        }
-
-        /*
-         * Delete twin, if there is one
-         */
-        if (record->twin != NULL) {
-            joy_log_debug("LIST deleting twin\n");
-            flow_record_delete(ctx, record->twin);
-        }
-
-        /* Remove record from chrono list, then delete from flow_record_list_array */
-        flow_record_chrono_list_remove(ctx, record);
-        flow_record_delete(ctx, record);
+        flow_record_export_and_delete(ctx, record);
 
         /* Advance to next record on chrono list */
         record = next_record;
@@ -1758,6 +2821,22 @@ void flow_record_export_as_ipfix (joy_ctx_data *ctx, unsigned int export_type) {
 void flow_record_list_print_json (joy_ctx_data *ctx, unsigned int print_type) {
     flow_record_t *record = NULL;
     flow_record_t *next_record = NULL;
+    flow_record_t **expired = NULL;
+    unsigned int i, num_expired = 0;
+
+    if (output_writer_running(&ctx->writer)) {
+        /* free the records that the writer is done with */
+        output_writer_reclaim(&ctx->writer);
+    }
+
+    if (print_type == JOY_EXPIRED_FLOWS) {
+        /* Only visit the flows whose expiry timer is due */
+        expired = flow_record_list_get_expired(ctx, &num_expired);
+        for (i = 0; i < num_expired; i++) {
+            flow_record_print_and_delete(ctx, expired[i]);
+        }
+        return;
+    }
 
     /* The head of chrono record list */
     record = ctx->flow_record_chrono_first;
@@ -1766,14 +2845,6 @@ void flow_record_list_print_json (joy_ctx_data *ctx, unsigned int print_type) {
         /* setup next record */
         next_record = record->time_next;
 
-        if (print_type == JOY_EXPIRED_FLOWS) {
-            /* Avoid printing flows that might still be active */
-            if (!flow_record_is_expired(ctx,record)) {
-                record = next_record;
-                continue;
-            }
-        }
-
         /* print and remove the record */
         flow_record_print_and_delete(ctx, record);
 
@@ -1781,10 +2852,54 @@ void flow_record_list_print_json (joy_ctx_data *ctx, unsigned int print_type) {
         record = next_record;
     }
 
+    /* all of them are in the output when this returns */
+    flow_record_list_flush(ctx);
+    flow_record_list_flush_chunk(ctx);
+
     // note: we might need to call flush in the future
     // zflush(ctx->output);
 }
 
+/**
+ * \brief Wait until the output writer has written every record handed to it.
+ *
+ * The output can be closed or changed afterwards, and records_in_file
+ * is up to date.  Nothing is done if there is no writer.
+ *
+ * \param ctx Joy context
+ *
+ * \return none
+ */
+void flow_record_list_flush (joy_ctx_data *ctx) {
+    if (output_writer_running(&ctx->writer)) {
+        output_writer_flush(&ctx->writer);
+    }
+}
+
+/**
+ * \brief Write out the column chunk of the Arrow output, if it has rows.
+ *
+ * The flow records that the output writer has been handed have to be
+ * written first, with flow_record_list_flush().  Nothing is done for
+ * the other output formats, which write each record as it comes.
+ *
+ * \param ctx Joy context
+ *
+ * \return none
+ */
+void flow_record_list_flush_chunk (joy_ctx_data *ctx) {
+    if (ctx->columns == NULL || ctx->columns->num_rows == 0 || ctx->output == NULL) {
+        return;
+    }
+    if (ctx->output_lock) {
+        pthread_mutex_lock(ctx->output_lock);
+    }
+    flow_record_write_chunk(ctx);
+    if (ctx->output_lock) {
+        pthread_mutex_unlock(ctx->output_lock);
+    }
+}
+
 /**
  * \brief Removes the record and its twin from the list and the flow records
  *     structure.
@@ -1801,7 +2916,7 @@ void remove_record_and_update_list(joy_ctx_data *ctx, flow_record_t *rec)
         flow_record_delete(ctx, rec->twin);
     }
 
-    /* Remove from chrono list, then delete from flow_record_list_array */
+    /* Remove from chrono list, then delete from flow table */
     flow_record_chrono_list_remove(ctx, rec);
     flow_record_delete(ctx, rec);
 }
@@ -1812,121 +2927,367 @@ void remove_record_and_update_list(joy_ctx_data *ctx, flow_record_t *rec)
  *
  * \param ctx Joy context to use for the lookup
  * \param key flow_key that we will try to find it's twin
- * \param key_hash hash array to look in for the twin
  *
  * \return The twin flow_key, or NULL
  */
 flow_record_t *flow_key_get_twin (joy_ctx_data *ctx,
-                                  const flow_key_t *key,
-                                  unsigned int key_hash) {
+                                  const flow_key_t *key) {
     if (glb_config->flow_key_match_method == EXACT_MATCH) {
         flow_key_t twin;
 
         /*
-         * we use the passed in key_hash to determine the list because
-         * the twin will has the same hash value. we use find_record_by_key
-         * because we are searching based on the entire key.
+         * the twin is an ordinary lookup of the reversed key, which
+         * has a hash value of its own
          */
-        twin.sa.s_addr = key->da.s_addr;
-        twin.da.s_addr = key->sa.s_addr;
+        twin.sa6 = key->da6;
+        twin.da6 = key->sa6;
         twin.sp = key->dp;
         twin.dp = key->sp;
         twin.prot = key->prot;
+        twin.ipv6 = key->ipv6;
 
-        return flow_record_list_find_record_by_key(&ctx->flow_record_list_array[key_hash], &twin);
+        return flow_table_find(&ctx->flow_table, &twin, flow_key_hash(&twin));
 
     } else {
         /*
-         * we use the passed in key_hash because in NEAR_MATCH cases, the addresses are omitted
-         * from the hash calculation. Therefore, the record and twin will have the same hash.
-         * we use find_twin_by_key because we need to at least match one address in the records
-         * to have a good chance at determining this is the NAT'd twin.
+         * the candidates are in the NAT index, where the addresses are
+         * omitted from the hash, so that the record and its twin have
+         * the same hash there; we use flow_key_is_twin because we need
+         * to at least match one address in the records to have a good
+         * chance at determining this is the NAT'd twin.
          */
-        return flow_record_list_find_twin_by_key(&ctx->flow_record_list_array[key_hash], key);
+        return flow_table_find_match(&ctx->nat_index, key, flow_key_nat_hash(key), flow_key_is_twin);
+    }
+}
+
+/**
+ * \brief Enter a record that has no twin into the NAT index.
+ *
+ * Nothing is done unless NAT twin matching is in use.  If the index
+ * cannot grow, the record stays out of it, and will not be found as
+ * the twin of a later flow.
+ *
+ * \param ctx Joy context the record belongs to
+ * \param record Flow record without a twin
+ *
+ * \return none
+ */
+static void flow_record_nat_index_add (joy_ctx_data *ctx, flow_record_t *record) {
+    if (glb_config->flow_key_match_method != NEAR_MATCH) {
+        return;
+    }
+    if (flow_table_insert(&ctx->nat_index, record, flow_key_nat_hash(&record->key)) != ok) {
+        joy_log_warn("could not add flow_record to NAT index");
+        flocap_stats_incr_malloc_fail(ctx);
+        return;
     }
+    record->twin_candidate = 1;
 }
 
 /**
- * \brief Unit test for the flow_record list functionality.
+ * \brief Take a record out of the NAT index, if it is in there.
+ *
+ * \param ctx Joy context the record belongs to
+ * \param record Flow record that found its twin, or is being deleted
+ *
+ * \return none
+ */
+static void flow_record_nat_index_remove (joy_ctx_data *ctx, flow_record_t *record) {
+    if (!record->twin_candidate) {
+        return;
+    }
+    if (flow_table_remove(&ctx->nat_index, record, flow_key_nat_hash(&record->key)) != ok) {
+        joy_log_err("problem removing flow record %p from NAT index", record);
+    }
+    record->twin_candidate = 0;
+}
+
+/**
+ * \brief Unit test for the flow table lookups done by p2f.
  *
  * \param none
  *
  * \return Number of failures
  */
-static int p2f_test_flow_record_list(joy_ctx_data *ctx) {
-    flow_record_list list = NULL;
-    flow_record_t a, b, c, d;
+static int p2f_test_flow_table(joy_ctx_data *ctx) {
+    flow_record_t a, b, c;
     flow_record_t *rp;
-    flow_key_t k1 = { { 0xcafe }, { 0xbabe }, 0xfa, 0xce, 0xdd };
-    flow_key_t k2 = { { 0xdead }, { 0xbeef }, 0xfa, 0xce, 0xdd };
+    flow_key_t k1 = { { { 0xcafe } }, { { 0xbabe } }, 0xfa, 0xce, 0xdd, 0 };
+    flow_key_t k2 = { { { 0xdead } }, { { 0xbeef } }, 0xfa, 0xce, 0xdd, 0 };
+    flow_key_t k3 = { { { 0xbabe } }, { { 0xcafe } }, 0xce, 0xfa, 0xdd, 0 };
     int num_fails = 0;
 
+    flow_record_list_init(ctx);
     flow_record_init(ctx, &a, &k1);
     flow_record_init(ctx, &b, &k2);
-    flow_record_init(ctx, &c, &k1);
-    flow_record_init(ctx, &d, &k1);
-
-    flow_record_list_prepend(&list, &a);
-    rp = flow_record_list_find_record_by_key(&list, &k1);
-    if (!rp) {
+    flow_record_init(ctx, &c, &k3);
+    a.key_hash = flow_key_hash(&k1);
+    b.key_hash = flow_key_hash(&k2);
+    c.key_hash = flow_key_hash(&k3);
+
+    flow_table_insert(&ctx->flow_table, &a, a.key_hash);
+    rp = flow_table_find(&ctx->flow_table, &k1, a.key_hash);
+    if (rp != &a) {
         joy_log_err("did not find a");
         num_fails++;
     }
 
-    flow_record_list_remove(&list, &a);
-    rp = flow_record_list_find_record_by_key(&list, &k1);
+    flow_table_remove(&ctx->flow_table, &a, a.key_hash);
+    rp = flow_table_find(&ctx->flow_table, &k1, a.key_hash);
     if (rp) {
         joy_log_err("found a, but should not have");
         num_fails++;
     }
 
-    flow_record_list_prepend(&list, &b);
-    rp = flow_record_list_find_record_by_key(&list, &k2);
-    if (!rp) {
+    flow_table_insert(&ctx->flow_table, &a, a.key_hash);
+    flow_table_insert(&ctx->flow_table, &b, b.key_hash);
+    rp = flow_table_find(&ctx->flow_table, &k1, a.key_hash);
+    if (rp != &a) {
+        joy_log_err("did not find a");
+        num_fails++;
+    }
+
+    rp = flow_table_find(&ctx->flow_table, &k2, b.key_hash);
+    if (rp != &b) {
         joy_log_err("did not find b");
         num_fails++;
     }
 
-    flow_record_list_remove(&list, &b);
-    rp = flow_record_list_find_record_by_key(&list, &k2);
+    /* c is the reverse of a, so they are twins */
+    rp = flow_key_get_twin(ctx, &k3);
+    if (rp != &a) {
+        joy_log_err("did not find a as twin of c");
+        num_fails++;
+    }
+
+    flow_table_insert(&ctx->flow_table, &c, c.key_hash);
+    rp = flow_key_get_twin(ctx, &k1);
+    if (rp != &c) {
+        joy_log_err("did not find c as twin of a");
+        num_fails++;
+    }
+
+    flow_table_remove(&ctx->flow_table, &b, b.key_hash);
+    rp = flow_table_find(&ctx->flow_table, &k2, b.key_hash);
     if (rp) {
         joy_log_err("found b, but should not have");
         num_fails++;
     }
+    if (flow_table_size(&ctx->flow_table) != 2) {
+        joy_log_err("flow table holds %u records, expected 2", flow_table_size(&ctx->flow_table));
+        num_fails++;
+    }
 
-    flow_record_list_prepend(&list, &a);
-    flow_record_list_prepend(&list, &b);
-    rp = flow_record_list_find_record_by_key(&list, &k1);
-    if (!rp) {
-        joy_log_err("did not find a");
+    /* prefetching only looks, whether or not the record is there */
+    if (flow_key_prefetch_slot(ctx, &k1) != a.key_hash ||
+        flow_key_prefetch_slot(ctx, &k2) != b.key_hash) {
+        joy_log_err("prefetch hashed a key differently from lookups");
+        num_fails++;
+    }
+    flow_key_prefetch_record(ctx, &k1, a.key_hash);
+    flow_key_prefetch_record(ctx, &k2, b.key_hash);
+    if (flow_table_size(&ctx->flow_table) != 2 ||
+        flow_table_find(&ctx->flow_table, &k1, a.key_hash) != &a) {
+        joy_log_err("prefetch changed the flow table");
         num_fails++;
     }
 
-    rp = flow_record_list_find_record_by_key(&list, &k2);
-    if (!rp) {
-        joy_log_err("did not find b");
+    flow_table_free(&ctx->flow_table);
+
+    return num_fails;
+}
+
+/**
+ * \brief Unit test for the NAT index used to find NAT'ed twins.
+ *
+ * \param none
+ *
+ * \return Number of failures
+ */
+static int p2f_test_nat_index(joy_ctx_data *ctx) {
+    flow_record_t a, b;
+    flow_key_t k1 = { { { 0xcafe } }, { { 0xbabe } }, 0xfa, 0xce, 0x06, 0 };
+    flow_key_t k2 = { { { 0xcafe } }, { { 0xbabe } }, 0xfa, 0xcf, 0x06, 0 };
+    flow_key_t nat = { { { 0xbabe } }, { { 0x1234 } }, 0xce, 0xfa, 0x06, 0 };
+    bool saved_method = glb_config->flow_key_match_method;
+    bool saved_bidir = glb_config->bidir;
+    int num_fails = 0;
+
+    glb_config->flow_key_match_method = NEAR_MATCH;
+    glb_config->bidir = 1;
+    flow_table_init(&ctx->nat_index, 0);
+    flow_record_init(ctx, &a, &k1);
+    flow_record_init(ctx, &b, &k2);
+
+    flow_record_nat_index_add(ctx, &a);
+    flow_record_nat_index_add(ctx, &b);
+    if (!a.twin_candidate || flow_table_size(&ctx->nat_index) != 2) {
+        joy_log_err("records without twins are not in the NAT index");
         num_fails++;
     }
 
-    flow_record_list_remove(&list, &a);
-    rp = flow_record_list_find_record_by_key(&list, &k1);
-    if (rp) {
-        joy_log_err("found a, but should not have");
+    /* only one address matches, and the ports are reversed */
+    if (flow_key_get_twin(ctx, &nat) != &a) {
+        joy_log_err("did not find a as the NAT'ed twin");
         num_fails++;
     }
 
-    flow_record_list_remove(&list, &b);
-    rp = flow_record_list_find_record_by_key(&list, &k2);
-    if (rp) {
-        joy_log_err("found a, but should not have");
+    flow_record_nat_index_remove(ctx, &a);
+    if (a.twin_candidate || flow_key_get_twin(ctx, &nat) != NULL) {
+        joy_log_err("found a in the NAT index after it was removed");
+        num_fails++;
+    }
+    flow_record_nat_index_remove(ctx, &a);
+    flow_record_nat_index_remove(ctx, &b);
+    if (flow_table_size(&ctx->nat_index) != 0) {
+        joy_log_err("NAT index holds %u records, expected 0", flow_table_size(&ctx->nat_index));
         num_fails++;
     }
 
-    flow_record_list_prepend(&list, &a);
-    flow_record_list_prepend(&list, &c);
-    rp = flow_record_list_find_record_by_key(&list, &k1);
-    if (!rp) {
-        joy_log_err("did not find a");
+    flow_table_free(&ctx->nat_index);
+    glb_config->flow_key_match_method = saved_method;
+    glb_config->bidir = saved_bidir;
+
+    return num_fails;
+}
+
+/**
+ * \brief Unit test for the cold sections of flow records.
+ *
+ * \param none
+ *
+ * \return Number of failures
+ */
+static int p2f_test_cold_sections(joy_ctx_data *ctx) {
+    flow_record_t r;
+    flow_key_t k = { { { 0xcafe } }, { { 0xbabe } }, 0xfa, 0xce, 0x11, 0 };
+    unsigned int saved_num_pkts = glb_config->num_pkts;
+    unsigned int i;
+    int num_fails = 0;
+
+    flow_pool_set_init(&ctx->cold_pools, 0);
+    flow_record_init(ctx, &r, &k);
+    glb_config->num_pkts = 50;
+
+    /* the per-packet arrays grow up to num_pkts, while op keeps counting */
+    for (i = 0; i < 60; i++) {
+        if (flow_record_reserve_pkt(ctx, &r)) {
+            r.pkt_len[r.op] = (uint16_t)i;
+            r.pkt_time[r.op] = (joy_time_delta_t)i;
+        }
+        r.op++;
+        if (i == 0 && (r.pkt_cap == 0 || r.pkt_cap >= 50)) {
+            joy_log_err("first packet array holds %u packets", r.pkt_cap);
+            num_fails++;
+        }
+    }
+    if (r.op != 60 || r.pkt_cap != 50 || flow_record_num_pkts(&r) != 50) {
+        joy_log_err("op %u, capacity %u after 60 packets", r.op, r.pkt_cap);
+        num_fails++;
+    }
+    for (i = 0; i < flow_record_num_pkts(&r); i++) {
+        if (r.pkt_len[i] != i || r.pkt_time[i] != (joy_time_delta_t)i) {
+            joy_log_err("packet %u lost when the arrays grew", i);
+            num_fails++;
+            break;
+        }
+    }
+
+    /* IP ids stop at MAX_NUM_IP_ID */
+    for (i = 0; i < MAX_NUM_IP_ID + 10; i++) {
+        flow_record_add_ip_id(ctx, &r, (uint16_t)(1000 + i));
+    }
+    if (r.ip.num_id != MAX_NUM_IP_ID || r.ip.id[0] != 1000 ||
+        r.ip.id[MAX_NUM_IP_ID - 1] != 1000 + MAX_NUM_IP_ID - 1) {
+        joy_log_err("wrong IP ids after growing");
+        num_fails++;
+    }
+
+    /* the other sections are allocated zeroed on first use */
+    if (r.byte_count != NULL || r.hd != NULL || r.tcp_retrans != NULL) {
+        joy_log_err("cold sections allocated before use");
+        num_fails++;
+    }
+    if (flow_record_byte_count(ctx, &r) == NULL || r.byte_count[0xff] != 0 ||
+        flow_record_header_description(ctx, &r) == NULL || r.hd->num_headers_seen != 0 ||
+        flow_record_tcp_retrans(ctx, &r) == NULL || r.tcp_retrans[0].seq != 0) {
+        joy_log_err("cold sections not allocated zeroed");
+        num_fails++;
+    }
+
+    flow_record_free_cold(ctx, &r);
+    for (i = 0; i < FLOW_POOL_SET_CLASSES; i++) {
+        if (ctx->cold_pools.pools[i].in_use) {
+            joy_log_err("%lu objects left in pool %s", ctx->cold_pools.pools[i].in_use,
+                        ctx->cold_pools.pools[i].name);
+            num_fails++;
+        }
+    }
+
+    glb_config->num_pkts = saved_num_pkts;
+    flow_pool_set_destroy(&ctx->cold_pools);
+
+    return num_fails;
+}
+
+/**
+ * \brief Unit test for packet times stored as offsets from a base time.
+ *
+ * \param none
+ *
+ * \return Number of failures
+ */
+static int p2f_test_time_delta(void) {
+    joy_time_base_t base = { 0, 0 };
+    struct timeval start = { 1500000000, 999999 };
+    struct timeval t, diff;
+    joy_time_delta_t d;
+    long int offsets[] = { 0, 1, 999, 1000, 1001, 1999999, -1, -1001, -2000001 };
+    unsigned int i;
+    int num_fails = 0;
+
+    /* the first time stored becomes the base */
+    if (joy_time_delta(&base, &start) != 0 || !base.set) {
+        joy_log_err("first time did not set the base");
+        num_fails++;
+    }
+
+    for (i = 0; i < sizeof(offsets) / sizeof(offsets[0]); i++) {
+        t = start;
+        t.tv_usec += offsets[i];
+        t.tv_sec += t.tv_usec / 1000000;
+        t.tv_usec %= 1000000;
+        if (t.tv_usec < 0) {
+            t.tv_usec += 1000000;
+            t.tv_sec--;
+        }
+
+        d = joy_time_delta(&base, &t);
+        joy_time_delta_to_timeval(&base, d, &diff);
+        if (d != offsets[i] || diff.tv_sec != t.tv_sec || diff.tv_usec != t.tv_usec) {
+            joy_log_err("offset %ld stored as %d", offsets[i], d);
+            num_fails++;
+        }
+
+        /* milliseconds must match what the timeval arithmetic printed */
+        joy_timer_sub(&t, &start, &diff);
+        if (joy_usec_to_milliseconds(offsets[i]) != joy_timeval_to_milliseconds(diff)) {
+            joy_log_err("offset %ld gives %u ms, expected %u", offsets[i],
+                        joy_usec_to_milliseconds(offsets[i]), joy_timeval_to_milliseconds(diff));
+            num_fails++;
+        }
+    }
+
+    /* offsets that do not fit saturate */
+    t = start;
+    t.tv_sec += 3600;
+    if (joy_time_delta(&base, &t) != INT32_MAX) {
+        joy_log_err("offset of an hour did not saturate");
+        num_fails++;
+    }
+    t.tv_sec -= 7200;
+    if (joy_time_delta(&base, &t) != INT32_MIN) {
+        joy_log_err("offset of minus an hour did not saturate");
         num_fails++;
     }
 
@@ -1946,7 +3307,10 @@ void p2f_unit_test() {
     fprintf(info, "\n******************************\n");
     fprintf(info, "P2F Unit Test starting...\n");
 
-    num_fails += p2f_test_flow_record_list(main_ctx);
+    num_fails += p2f_test_flow_table(main_ctx);
+    num_fails += p2f_test_nat_index(main_ctx);
+    num_fails += p2f_test_cold_sections(main_ctx);
+    num_fails += p2f_test_time_delta();
 
     if (num_fails) {
         fprintf(info, "Finished - failures: %d\n", num_fails);
@@ -54,15 +54,16 @@
  * \brief Initialize the memory of the payload struct.
  *
  * \param payload_handle contains payload structure to init
+ * \param pool pool to allocate the structure from, or NULL for the heap
  *
  * \return none
  */
-__inline void payload_init (struct payload **payload_handle) {
+__inline void payload_init (struct payload **payload_handle, flow_pool_t *pool) {
    if (*payload_handle != NULL) {
-        payload_delete(payload_handle);
+        payload_delete(payload_handle, pool);
     }
 
-    *payload_handle = malloc(sizeof(struct payload));
+    *payload_handle = flow_pool_calloc(pool, sizeof(struct payload));
     if (*payload_handle == NULL) {
         /* Allocation failed */
         joy_log_err("malloc failed");
@@ -137,10 +138,11 @@ void payload_print_json (const struct payload *x1, const struct payload *x2, zfi
  * \brief Delete the memory of Payload struct.
  *
  * \param payload_handle contains payload structure to delete
+ * \param pool pool that the structure was allocated from, or NULL
  *
  * \return none
  */
-void payload_delete (struct payload **payload_handle) { 
+void payload_delete (struct payload **payload_handle, flow_pool_t *pool) { 
     struct payload *payload = *payload_handle;
 
     if (payload == NULL) {
@@ -148,7 +150,7 @@ void payload_delete (struct payload **payload_handle) {
     }
 
     /* Free the memory and set to NULL */
-    free(payload);
+    flow_pool_free(pool, payload);
     *payload_handle = NULL;
 }
 
@@ -172,14 +174,14 @@ void payload_unit_test () {
     };
 
     fprintf(stdout, "running unit test for payload feature...");
-    payload_init(&payload1);
-    payload_init(&payload2);
+    payload_init(&payload1, NULL);
+    payload_init(&payload2, NULL);
     payload_update(payload1, header, data1, sizeof(data1), 1);
     payload_update(payload2, header, data2, sizeof(data2), 1);
     // no print test yet 
     // payload_print_json (payload1, NULL, f);    
-    payload_delete(&payload1);
-    payload_delete(&payload2);
+    payload_delete(&payload1, NULL);
+    payload_delete(&payload2, NULL);
     fprintf(stdout, "done (success)\n");
 } 
 
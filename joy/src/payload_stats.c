@@ -0,0 +1,557 @@
+/*
+ *
+ * Copyright (c) 2018 Cisco Systems, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials provided
+ *   with the distribution.
+ *
+ *   Neither the name of the Cisco Systems, Inc. nor the names of its
+ *   contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/**
+ * \file payload_stats.c
+ *
+ * \brief statistics gathered from the bytes of each payload in one pass
+ *
+ ** The arithmetic statistics come from three numbers per offset modulo
+ *  four: with S0..S3 the sums of the bytes at offsets 0, 1, 2 and 3
+ *  modulo four, the walsh-hadamard spectrum of the payload (cut into
+ *  groups of four bytes, the last one padded with zeros) is
+ *
+ *      [ S0+S1+S2+S3, S0-S1+S2-S3, S0+S1-S2-S3, S0-S1-S2+S3 ]
+ *
+ *  and its first element is the sum of the bytes.  The vector versions
+ *  widen the bytes to 16 bits and get the other three elements with a
+ *  multiply-add against vectors of +1 and -1, the sum with a sum of
+ *  absolute differences against zero, and the sum of the squares with
+ *  a multiply-add of the widened bytes with themselves.  Their 32 bit
+ *  lanes are added into 64 bit totals after every PAYLOAD_STATS_BLOCK
+ *  bytes, well before they could overflow.
+ *
+ ** The byte counts are plain table increments, done in the same call
+ *  while the payload is still in the first level cache.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "safe_lib.h"
+#include "p2f.h"
+#include "payload_stats.h"
+#include "err.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define PAYLOAD_STATS_USE_SSE2 1
+#endif
+
+#if defined(PAYLOAD_STATS_USE_SSE2) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+/* not necessarily built for AVX2, but it can be used if present */
+#include <immintrin.h>
+#define PAYLOAD_STATS_AVX2_DISPATCH 1
+#endif
+
+/** bytes that the vector versions take before adding up their lanes */
+#define PAYLOAD_STATS_BLOCK 16384
+
+typedef void (*payload_stats_arith_f)(const uint8_t *d, unsigned int len, payload_stats_t *s);
+
+/**
+ * \brief Add up bytes i to len of a payload, by offset modulo four.
+ * \param d Payload
+ * \param i Offset of the first byte to add
+ * \param len Length of the payload
+ * \param lane Sums of the bytes at each offset modulo four
+ * \param sum_sq Sum of the squares of the bytes
+ */
+static inline void payload_stats_add_bytes (const uint8_t *d, unsigned int i, unsigned int len,
+                                            uint64_t lane[4], uint64_t *sum_sq) {
+    uint64_t sq = 0;
+
+    for (; i < len && (i & 3); i++) {
+        lane[i & 3] += d[i];
+        sq += d[i] * d[i];
+    }
+    for (; i + 4 <= len; i += 4) {
+        lane[0] += d[i];
+        lane[1] += d[i + 1];
+        lane[2] += d[i + 2];
+        lane[3] += d[i + 3];
+        sq += d[i] * d[i] + d[i + 1] * d[i + 1] + d[i + 2] * d[i + 2] + d[i + 3] * d[i + 3];
+    }
+    for (; i < len; i++) {
+        lane[i & 3] += d[i];
+        sq += d[i] * d[i];
+    }
+    *sum_sq += sq;
+}
+
+/**
+ * \brief Add the sums by offset modulo four into a payload_stats_t.
+ */
+static inline void payload_stats_add_lanes (payload_stats_t *s, const uint64_t lane[4]) {
+    int64_t s0 = (int64_t)lane[0], s1 = (int64_t)lane[1];
+    int64_t s2 = (int64_t)lane[2], s3 = (int64_t)lane[3];
+
+    s->sum += lane[0] + lane[1] + lane[2] + lane[3];
+    s->wht[0] += s0 + s1 + s2 + s3;
+    s->wht[1] += s0 - s1 + s2 - s3;
+    s->wht[2] += s0 + s1 - s2 - s3;
+    s->wht[3] += s0 - s1 - s2 + s3;
+}
+
+/**
+ * \brief payload_stats_scan() arithmetic, one byte at a time.
+ */
+static void payload_stats_arith_scalar (const uint8_t *d, unsigned int len, payload_stats_t *s) {
+    uint64_t lane[4] = { 0, 0, 0, 0 };
+
+    memset_s(s, sizeof(*s), 0, sizeof(*s));
+    payload_stats_add_bytes(d, 0, len, lane, &s->sum_sq);
+    payload_stats_add_lanes(s, lane);
+}
+
+#ifdef PAYLOAD_STATS_USE_SSE2
+static inline uint64_t payload_stats_hsum64 (__m128i v) {
+    uint64_t t[2];
+
+    _mm_storeu_si128((__m128i *)t, v);
+    return t[0] + t[1];
+}
+
+static inline int64_t payload_stats_hsum32 (__m128i v) {
+    int32_t t[4];
+
+    _mm_storeu_si128((__m128i *)t, v);
+    return (int64_t)t[0] + t[1] + t[2] + t[3];
+}
+
+static inline uint64_t payload_stats_hsum32u (__m128i v) {
+    uint32_t t[4];
+
+    _mm_storeu_si128((__m128i *)t, v);
+    return (uint64_t)t[0] + t[1] + t[2] + t[3];
+}
+
+/**
+ * \brief payload_stats_scan() arithmetic, sixteen bytes at a time.
+ */
+static void payload_stats_arith_sse2 (const uint8_t *d, unsigned int len, payload_stats_t *s) {
+    const __m128i zero = _mm_setzero_si128();
+    /* signs of the words at offsets 0 to 3 modulo four in spectrum elements 1 to 3 */
+    const __m128i w1 = _mm_setr_epi16(1, -1, 1, -1, 1, -1, 1, -1);
+    const __m128i w2 = _mm_setr_epi16(1, 1, -1, -1, 1, 1, -1, -1);
+    const __m128i w3 = _mm_setr_epi16(1, -1, -1, 1, 1, -1, -1, 1);
+    uint64_t lane[4] = { 0, 0, 0, 0 };
+    unsigned int i = 0, end;
+
+    memset_s(s, sizeof(*s), 0, sizeof(*s));
+    while (len - i >= 16) {
+        __m128i sum = zero, sq = zero, a1 = zero, a2 = zero, a3 = zero;
+
+        end = len - i >= PAYLOAD_STATS_BLOCK ? i + PAYLOAD_STATS_BLOCK : len - ((len - i) & 15);
+        for (; i < end; i += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(d + i));
+            __m128i lo = _mm_unpacklo_epi8(v, zero);
+            __m128i hi = _mm_unpackhi_epi8(v, zero);
+            __m128i x = _mm_add_epi16(lo, hi);    /* word j holds offsets j and j + 8 */
+
+            sum = _mm_add_epi64(sum, _mm_sad_epu8(v, zero));
+            sq = _mm_add_epi32(sq, _mm_add_epi32(_mm_madd_epi16(lo, lo), _mm_madd_epi16(hi, hi)));
+            a1 = _mm_add_epi32(a1, _mm_madd_epi16(x, w1));
+            a2 = _mm_add_epi32(a2, _mm_madd_epi16(x, w2));
+            a3 = _mm_add_epi32(a3, _mm_madd_epi16(x, w3));
+        }
+        s->sum += payload_stats_hsum64(sum);
+        s->sum_sq += payload_stats_hsum32u(sq);
+        s->wht[1] += payload_stats_hsum32(a1);
+        s->wht[2] += payload_stats_hsum32(a2);
+        s->wht[3] += payload_stats_hsum32(a3);
+    }
+    s->wht[0] = (int64_t)s->sum;
+
+    payload_stats_add_bytes(d, i, len, lane, &s->sum_sq);
+    payload_stats_add_lanes(s, lane);
+}
+#endif
+
+#ifdef PAYLOAD_STATS_AVX2_DISPATCH
+__attribute__((target("avx2")))
+static inline uint64_t payload_stats_hsum64_avx2 (__m256i v) {
+    uint64_t t[4];
+
+    _mm256_storeu_si256((__m256i *)t, v);
+    return t[0] + t[1] + t[2] + t[3];
+}
+
+__attribute__((target("avx2")))
+static inline int64_t payload_stats_hsum32_avx2 (__m256i v) {
+    int32_t t[8];
+
+    _mm256_storeu_si256((__m256i *)t, v);
+    return (int64_t)t[0] + t[1] + t[2] + t[3] + t[4] + t[5] + t[6] + t[7];
+}
+
+__attribute__((target("avx2")))
+static inline uint64_t payload_stats_hsum32u_avx2 (__m256i v) {
+    uint32_t t[8];
+
+    _mm256_storeu_si256((__m256i *)t, v);
+    return (uint64_t)t[0] + t[1] + t[2] + t[3] + t[4] + t[5] + t[6] + t[7];
+}
+
+/**
+ * \brief payload_stats_scan() arithmetic, thirty-two bytes at a time.
+ *
+ * The unpack instructions work within each 128 bit half, so word j of
+ * either half still holds offsets that are j modulo four, and the sign
+ * vectors are those of payload_stats_arith_sse2() twice over.
+ */
+__attribute__((target("avx2")))
+static void payload_stats_arith_avx2 (const uint8_t *d, unsigned int len, payload_stats_t *s) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i w1 = _mm256_setr_epi16(1, -1, 1, -1, 1, -1, 1, -1, 1, -1, 1, -1, 1, -1, 1, -1);
+    const __m256i w2 = _mm256_setr_epi16(1, 1, -1, -1, 1, 1, -1, -1, 1, 1, -1, -1, 1, 1, -1, -1);
+    const __m256i w3 = _mm256_setr_epi16(1, -1, -1, 1, 1, -1, -1, 1, 1, -1, -1, 1, 1, -1, -1, 1);
+    uint64_t lane[4] = { 0, 0, 0, 0 };
+    unsigned int i = 0, end;
+
+    memset_s(s, sizeof(*s), 0, sizeof(*s));
+    while (len - i >= 32) {
+        __m256i sum = zero, sq = zero, a1 = zero, a2 = zero, a3 = zero;
+
+        end = len - i >= PAYLOAD_STATS_BLOCK ? i + PAYLOAD_STATS_BLOCK : len - ((len - i) & 31);
+        for (; i < end; i += 32) {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(d + i));
+            __m256i lo = _mm256_unpacklo_epi8(v, zero);
+            __m256i hi = _mm256_unpackhi_epi8(v, zero);
+            __m256i x = _mm256_add_epi16(lo, hi);
+
+            sum = _mm256_add_epi64(sum, _mm256_sad_epu8(v, zero));
+            sq = _mm256_add_epi32(sq, _mm256_add_epi32(_mm256_madd_epi16(lo, lo), _mm256_madd_epi16(hi, hi)));
+            a1 = _mm256_add_epi32(a1, _mm256_madd_epi16(x, w1));
+            a2 = _mm256_add_epi32(a2, _mm256_madd_epi16(x, w2));
+            a3 = _mm256_add_epi32(a3, _mm256_madd_epi16(x, w3));
+        }
+        s->sum += payload_stats_hsum64_avx2(sum);
+        s->sum_sq += payload_stats_hsum32u_avx2(sq);
+        s->wht[1] += payload_stats_hsum32_avx2(a1);
+        s->wht[2] += payload_stats_hsum32_avx2(a2);
+        s->wht[3] += payload_stats_hsum32_avx2(a3);
+    }
+    s->wht[0] = (int64_t)s->sum;
+
+    payload_stats_add_bytes(d, i, len, lane, &s->sum_sq);
+    payload_stats_add_lanes(s, lane);
+}
+#endif
+
+/** the implementation in use, NULL until the first scan or payload_stats_set_impl() */
+static payload_stats_arith_f payload_stats_arith = NULL;
+static const char *payload_stats_name = "scalar";
+
+/**
+ * \fn int payload_stats_set_impl (payload_stats_impl_e impl)
+ * \brief Pick the implementation used by payload_stats_scan().
+ * \param impl Implementation, or PAYLOAD_STATS_AUTO for the best one available
+ * \return 0 on success, -1 if \p impl is not available
+ */
+int payload_stats_set_impl (payload_stats_impl_e impl) {
+    switch (impl) {
+    case PAYLOAD_STATS_AUTO:
+#ifdef PAYLOAD_STATS_AVX2_DISPATCH
+        if (payload_stats_set_impl(PAYLOAD_STATS_AVX2) == 0) {
+            return 0;
+        }
+#endif
+#ifdef PAYLOAD_STATS_USE_SSE2
+        return payload_stats_set_impl(PAYLOAD_STATS_SSE2);
+#else
+        return payload_stats_set_impl(PAYLOAD_STATS_SCALAR);
+#endif
+    case PAYLOAD_STATS_SCALAR:
+        payload_stats_name = "scalar";
+        payload_stats_arith = payload_stats_arith_scalar;
+        return 0;
+#ifdef PAYLOAD_STATS_USE_SSE2
+    case PAYLOAD_STATS_SSE2:
+        payload_stats_name = "sse2";
+        payload_stats_arith = payload_stats_arith_sse2;
+        return 0;
+#endif
+#ifdef PAYLOAD_STATS_AVX2_DISPATCH
+    case PAYLOAD_STATS_AVX2:
+        if (!__builtin_cpu_supports("avx2")) {
+            return -1;
+        }
+        payload_stats_name = "avx2";
+        payload_stats_arith = payload_stats_arith_avx2;
+        return 0;
+#endif
+    default:
+        return -1;
+    }
+}
+
+/**
+ * \fn const char *payload_stats_impl_name (void)
+ * \return name of the implementation used by payload_stats_scan()
+ */
+const char *payload_stats_impl_name (void) {
+    if (payload_stats_arith == NULL) {
+        payload_stats_set_impl(PAYLOAD_STATS_AUTO);
+    }
+    return payload_stats_name;
+}
+
+/**
+ * \fn void payload_stats_scan (const void *data,
+                                unsigned int len,
+                                uint32_t *byte_count,
+                                unsigned int byte_count_len,
+                                uint32_t *compact_byte_count,
+                                const uint16_t *compact_map,
+                                payload_stats_t *stats)
+ * \brief Gather the statistics of a payload.
+ * \param data Payload
+ * \param len Length of the payload
+ * \param byte_count Counts of each byte value, or NULL
+ * \param byte_count_len Number of leading bytes to count in \p byte_count
+ * \param compact_byte_count Counts of each compact bin, or NULL
+ * \param compact_map Compact bin of each byte value
+ * \param stats Sums and spectrum of the payload, or NULL
+ * \return none
+ */
+void payload_stats_scan (const void *data, unsigned int len,
+                         uint32_t *byte_count, unsigned int byte_count_len,
+                         uint32_t *compact_byte_count, const uint16_t *compact_map,
+                         payload_stats_t *stats) {
+    const uint8_t *d = data;
+    unsigned int i;
+
+    if (stats != NULL) {
+        if (payload_stats_arith == NULL) {
+            payload_stats_set_impl(PAYLOAD_STATS_AUTO);
+        }
+        payload_stats_arith(d, len, stats);
+    }
+
+    if (byte_count != NULL) {
+        if (byte_count_len > len) {
+            byte_count_len = len;
+        }
+        for (i = 0; i < byte_count_len; i++) {
+            byte_count[d[i]]++;
+        }
+    }
+
+    if (compact_byte_count != NULL) {
+        for (i = 0; i < len; i++) {
+            compact_byte_count[compact_map[d[i]]]++;
+        }
+    }
+}
+
+/**
+ * \fn void payload_stats_moments (uint32_t n, uint64_t sum, uint64_t sum_sq,
+                                   double *mean, double *sq_dev)
+ * \brief Mean and sum of squared deviations from the mean of n bytes.
+ * \param n Number of bytes
+ * \param sum Sum of the bytes
+ * \param sum_sq Sum of the squares of the bytes
+ * \param mean Mean of the bytes
+ * \param sq_dev Sum of the squared deviations of the bytes from \p mean
+ * \return none
+ */
+void payload_stats_moments (uint32_t n, uint64_t sum, uint64_t sum_sq,
+                            double *mean, double *sq_dev) {
+    uint64_t q, r;
+
+    if (n == 0) {
+        *mean = 0.0;
+        *sq_dev = 0.0;
+        return;
+    }
+
+    /*
+     * sq_dev = sum_sq - sum * sum / n; with sum = q * n + r, the part
+     * q * q * n + 2 * q * r of sum * sum / n is an integer, so only
+     * r * r / n is left to round
+     */
+    q = sum / n;
+    r = sum % n;
+    *mean = (double)sum / (double)n;
+    *sq_dev = (double)(sum_sq - q * q * n - 2 * q * r) - (double)(r * r) / (double)n;
+}
+
+/* END payload statistics */
+
+#define PAYLOAD_STATS_TEST_LEN 70000
+
+/*
+ * the statistics of a payload, the way that each of them was worked
+ * out before payload_stats_scan(), to check it against
+ */
+static void payload_stats_test_reference (const uint8_t *d, unsigned int len,
+                                          payload_stats_t *s, double *mean, double *sq_dev) {
+    uint8_t b[4];
+    unsigned int i, j;
+    int16_t x[4];
+
+    memset_s(s, sizeof(*s), 0, sizeof(*s));
+    *mean = 0.0;
+    *sq_dev = 0.0;
+    for (i = 0; i < len; i++) {
+        double delta = (double)d[i] - *mean;
+
+        *mean += delta / (double)(i + 1);
+        *sq_dev += delta * ((double)d[i] - *mean);
+        s->sum += d[i];
+        s->sum_sq += d[i] * d[i];
+    }
+    for (i = 0; i < len; i += 4) {
+        for (j = 0; j < 4; j++) {
+            b[j] = i + j < len ? d[i + j] : 0;
+        }
+        x[0] = b[0] + b[2];
+        x[1] = b[1] + b[3];
+        x[2] = b[0] - b[2];
+        x[3] = b[1] - b[3];
+        s->wht[0] += (x[0] + x[1]);
+        s->wht[1] += (x[0] - x[1]);
+        s->wht[2] += (x[2] + x[3]);
+        s->wht[3] += (x[2] - x[3]);
+    }
+}
+
+static int payload_stats_test_one (const uint8_t *d, unsigned int len, const char *what) {
+    payload_stats_t s, ref;
+    uint32_t byte_count[256], compact_byte_count[16], ref_count[256];
+    uint16_t compact_map[256];
+    double mean, sq_dev, ref_mean, ref_sq_dev;
+    unsigned int i, cap = len / 3;
+
+    for (i = 0; i < 256; i++) {
+        compact_map[i] = i >> 4;
+    }
+    memset_s(byte_count, sizeof(byte_count), 0, sizeof(byte_count));
+    memset_s(compact_byte_count, sizeof(compact_byte_count), 0, sizeof(compact_byte_count));
+    memset_s(ref_count, sizeof(ref_count), 0, sizeof(ref_count));
+
+    payload_stats_scan(d, len, byte_count, cap, compact_byte_count, compact_map, &s);
+    payload_stats_test_reference(d, len, &ref, &ref_mean, &ref_sq_dev);
+    payload_stats_moments(len, s.sum, s.sum_sq, &mean, &sq_dev);
+
+    if (s.sum != ref.sum || s.sum_sq != ref.sum_sq || s.wht[0] != ref.wht[0] ||
+        s.wht[1] != ref.wht[1] || s.wht[2] != ref.wht[2] || s.wht[3] != ref.wht[3]) {
+        joy_log_err("%s: %s, %u bytes: wrong sums or spectrum", payload_stats_impl_name(), what, len);
+        return 1;
+    }
+    if (fabs(mean - ref_mean) > 1e-9 || fabs(sq_dev - ref_sq_dev) > 1e-9 * (ref_sq_dev + 1.0)) {
+        joy_log_err("%s: %s, %u bytes: mean %f, sq_dev %f instead of %f, %f",
+                    payload_stats_impl_name(), what, len, mean, sq_dev, ref_mean, ref_sq_dev);
+        return 1;
+    }
+    for (i = 0; i < cap; i++) {
+        ref_count[d[i]]++;
+    }
+    for (i = 0; i < 256; i++) {
+        if (byte_count[i] != ref_count[i]) {
+            joy_log_err("%s: %s, %u bytes: wrong byte count", payload_stats_impl_name(), what, len);
+            return 1;
+        }
+    }
+    for (i = 0; i < 16; i++) {
+        unsigned int j, n = 0;
+
+        for (j = 0; j < len; j++) {
+            n += (d[j] >> 4) == i;
+        }
+        if (compact_byte_count[i] != n) {
+            joy_log_err("%s: %s, %u bytes: wrong compact byte count", payload_stats_impl_name(), what, len);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int payload_stats_unit_test (void) {
+    static const payload_stats_impl_e impls[] = {
+        PAYLOAD_STATS_SCALAR, PAYLOAD_STATS_SSE2, PAYLOAD_STATS_AVX2
+    };
+    uint8_t *buf;
+    uint32_t x = 12345;
+    unsigned int i, k, len;
+    int num_fails = 0;
+
+    fprintf(info, "\n******************************\n");
+    fprintf(info, "Payload statistics Unit Test starting...\n");
+
+    buf = malloc(PAYLOAD_STATS_TEST_LEN + 1);
+    if (buf == NULL) {
+        joy_log_err("malloc failed");
+        return 1;
+    }
+    for (i = 0; i < PAYLOAD_STATS_TEST_LEN + 1; i++) {
+        x = x * 1103515245 + 12345;
+        buf[i] = (uint8_t)(x >> 16);
+    }
+
+    for (k = 0; k < sizeof(impls) / sizeof(impls[0]); k++) {
+        if (payload_stats_set_impl(impls[k]) != 0) {
+            fprintf(info, "implementation %d not available\n", impls[k]);
+            continue;
+        }
+        /* every tail length, from both an even and an odd address */
+        for (len = 0; len < 200 && !num_fails; len++) {
+            num_fails += payload_stats_test_one(buf, len, "random");
+            num_fails += payload_stats_test_one(buf + 1, len, "random, unaligned");
+        }
+        /* longer than a block, to cover the lane totals */
+        num_fails += payload_stats_test_one(buf + 1, PAYLOAD_STATS_TEST_LEN, "random, long");
+        memset_s(buf, PAYLOAD_STATS_TEST_LEN + 1, 0xff, PAYLOAD_STATS_TEST_LEN + 1);
+        num_fails += payload_stats_test_one(buf, PAYLOAD_STATS_TEST_LEN + 1, "all ones");
+        for (i = 0; i < PAYLOAD_STATS_TEST_LEN + 1; i++) {
+            x = x * 1103515245 + 12345;
+            buf[i] = (uint8_t)(x >> 16);
+        }
+    }
+    payload_stats_set_impl(PAYLOAD_STATS_AUTO);
+    free(buf);
+
+    if (num_fails) {
+        fprintf(info, "Finished - failures: %d\n", num_fails);
+    } else {
+        fprintf(info, "Finished - success\n");
+    }
+    fprintf(info, "******************************\n\n");
+
+    return num_fails;
+}
@@ -0,0 +1,287 @@
+/*
+ *
+ * Copyright (c) 2018 Cisco Systems, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials provided
+ *   with the distribution.
+ *
+ *   Neither the name of the Cisco Systems, Inc. nor the names of its
+ *   contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/**
+ * \file payload_stats_bench.c
+ *
+ * \brief microbenchmark for the payload statistics
+ *
+ ** Compares the cost, per payload byte, of the byte distribution,
+ *  compact byte distribution, byte mean and variance and walsh-hadamard
+ *  transform as they were computed before payload_stats_scan() (three
+ *  byte loops, with a division for every byte, and a fourth pass for the
+ *  transform) with payload_stats_scan() in each implementation that the
+ *  processor supports, at several payload lengths.
+ *
+ *  usage: payload_stats_bench [payload_len ...]
+ *
+ *  With no arguments, payloads of 64, 512, 1460 and 9000 bytes are
+ *  measured.  Speeds are in bytes per time stamp counter tick where
+ *  there is one, which is about a cycle at the nominal clock rate.
+ */
+#ifdef HAVE_CONFIG_H
+#include "joy_config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "safe_lib.h"
+#include "payload_stats.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#define BENCH_HAVE_TSC 1
+#endif
+
+/** payload bytes scanned for each measurement */
+#define BENCH_NUM_BYTES (256 * 1024 * 1024)
+
+/** distinct payloads that the measurements go round */
+#define BENCH_NUM_PAYLOADS 64
+
+/** the statistics of a flow, as kept before payload_stats_scan() */
+typedef struct bench_flow_ {
+    uint32_t byte_count[256];
+    uint32_t compact_byte_count[16];
+    uint32_t num_bytes;
+    double bd_mean;
+    double bd_variance;
+    uint32_t wht_b;
+    int32_t spectrum[4];
+} bench_flow_t;
+
+/*
+ * The per-payload updates of p2f.c and wht.c before payload_stats_scan()
+ */
+static void legacy_update_byte_count (bench_flow_t *f, const uint8_t *data, unsigned int len) {
+    unsigned int i;
+
+    for (i = 0; i < len; i++) {
+        f->byte_count[data[i]]++;
+    }
+}
+
+static void legacy_update_compact_byte_count (bench_flow_t *f, const uint8_t *data, unsigned int len,
+                                              const uint16_t *compact_map) {
+    unsigned int i;
+
+    for (i = 0; i < len; i++) {
+        f->compact_byte_count[compact_map[data[i]]]++;
+    }
+}
+
+static void legacy_update_byte_dist_mean_var (bench_flow_t *f, const uint8_t *data, unsigned int len) {
+    double delta;
+    unsigned int i;
+
+    for (i = 0; i < len; i++) {
+        f->num_bytes += 1;
+        delta = ((double)data[i] - f->bd_mean);
+        f->bd_mean += delta/((double)f->num_bytes);
+        f->bd_variance += delta*((double)data[i] - f->bd_mean);
+    }
+}
+
+static void legacy_wht_process_four_bytes (bench_flow_t *f, const uint8_t *d) {
+    int16_t x[4];
+
+    x[0] = d[0] + d[2];
+    x[1] = d[1] + d[3];
+    x[2] = d[0] - d[2];
+    x[3] = d[1] - d[3];
+    f->spectrum[0] += (x[0] + x[1]);
+    f->spectrum[1] += (x[0] - x[1]);
+    f->spectrum[2] += (x[2] + x[3]);
+    f->spectrum[3] += (x[2] - x[3]);
+}
+
+static void legacy_wht_update (bench_flow_t *f, const uint8_t *d, unsigned int len) {
+    f->wht_b += len;
+    while (len > 4) {
+        legacy_wht_process_four_bytes(f, d);
+        d += 4;
+        len -= 4;
+    }
+    if (len > 0) {
+        uint8_t buffer[4] = { 0, 0, 0, 0 };
+
+        memcpy_s(buffer, len, d, len);
+        legacy_wht_process_four_bytes(f, buffer);
+    }
+}
+
+static double bench_elapsed (const struct timeval *start) {
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return (double)(now.tv_sec - start->tv_sec) + (double)(now.tv_usec - start->tv_usec) / 1e6;
+}
+
+static uint64_t bench_ticks (void) {
+#ifdef BENCH_HAVE_TSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static void bench_report (const char *name, unsigned int len, uint64_t bytes,
+                          double seconds, uint64_t ticks) {
+    if (ticks) {
+        printf("%6u byte payloads | %-7s %6.2f bytes/tick %8.2f MB/s\n",
+               len, name, (double)bytes / (double)ticks, bytes / seconds / 1e6);
+    } else {
+        printf("%6u byte payloads | %-7s %8.2f MB/s\n", len, name, bytes / seconds / 1e6);
+    }
+}
+
+static int bench_run (unsigned int len) {
+    static const payload_stats_impl_e impls[] = {
+        PAYLOAD_STATS_SCALAR, PAYLOAD_STATS_SSE2, PAYLOAD_STATS_AVX2
+    };
+    uint8_t *buf;
+    uint16_t compact_map[256];
+    bench_flow_t *legacy;
+    uint32_t byte_count[256], compact_byte_count[16];
+    payload_stats_t stats;
+    uint64_t state = 0x9e3779b97f4a7c15ULL, n, sum = 0, ticks;
+    int64_t spectrum = 0;
+    struct timeval start;
+    unsigned int i, k, num_payloads = BENCH_NUM_BYTES / len;
+
+    buf = malloc((size_t)len * BENCH_NUM_PAYLOADS);
+    legacy = calloc(1, sizeof(bench_flow_t));
+    if (buf == NULL || legacy == NULL) {
+        fprintf(stderr, "error: could not allocate memory for %u byte payloads\n", len);
+        free(buf);
+        free(legacy);
+        return 1;
+    }
+    for (i = 0; i < len * BENCH_NUM_PAYLOADS; i++) {
+        /* xorshift64, so that runs are repeatable */
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        buf[i] = (uint8_t)state;
+    }
+    for (i = 0; i < 256; i++) {
+        compact_map[i] = i >> 4;
+    }
+    n = (uint64_t)num_payloads * len;
+
+    gettimeofday(&start, NULL);
+    ticks = bench_ticks();
+    for (i = 0; i < num_payloads; i++) {
+        const uint8_t *d = buf + (size_t)(i % BENCH_NUM_PAYLOADS) * len;
+
+        legacy_update_byte_count(legacy, d, len);
+        legacy_update_compact_byte_count(legacy, d, len, compact_map);
+        legacy_update_byte_dist_mean_var(legacy, d, len);
+        legacy_wht_update(legacy, d, len);
+    }
+    ticks = bench_ticks() - ticks;
+    bench_report("before", len, n, bench_elapsed(&start), ticks);
+
+    for (k = 0; k < sizeof(impls) / sizeof(impls[0]); k++) {
+        if (payload_stats_set_impl(impls[k]) != 0) {
+            continue;
+        }
+        memset_s(byte_count, sizeof(byte_count), 0, sizeof(byte_count));
+        memset_s(compact_byte_count, sizeof(compact_byte_count), 0, sizeof(compact_byte_count));
+        sum = 0;
+        spectrum = 0;
+
+        gettimeofday(&start, NULL);
+        ticks = bench_ticks();
+        for (i = 0; i < num_payloads; i++) {
+            const uint8_t *d = buf + (size_t)(i % BENCH_NUM_PAYLOADS) * len;
+
+            payload_stats_scan(d, len, byte_count, len, compact_byte_count, compact_map, &stats);
+            sum += stats.sum;
+            spectrum += stats.wht[1];
+        }
+        ticks = bench_ticks() - ticks;
+        bench_report(payload_stats_impl_name(), len, n, bench_elapsed(&start), ticks);
+
+        /* the new code has to agree with the old one */
+        if (byte_count[0] != legacy->byte_count[0] ||
+            compact_byte_count[15] != legacy->compact_byte_count[15] ||
+            (int32_t)spectrum != legacy->spectrum[1] ||
+            (double)sum / (double)n - legacy->bd_mean > 1e-6 ||
+            legacy->bd_mean - (double)sum / (double)n > 1e-6) {
+            fprintf(stderr, "error: %s does not agree with the old statistics\n", payload_stats_impl_name());
+            free(buf);
+            free(legacy);
+            return 1;
+        }
+    }
+    payload_stats_set_impl(PAYLOAD_STATS_AUTO);
+
+    free(buf);
+    free(legacy);
+    return 0;
+}
+
+/**
+ * \fn int main (int argc, char* argv[])
+ * \brief main entry point for the payload statistics benchmark
+ * \return 0 on success, 1 on error
+ */
+int main (int argc, char *argv[]) {
+    static const unsigned int default_lens[] = { 64, 512, 1460, 9000 };
+    int i, rc = 0;
+
+    if (argc > 1) {
+        for (i = 1; i < argc; i++) {
+            unsigned long len = strtoul(argv[i], NULL, 0);
+
+            if (len == 0 || len > 65535) {
+                fprintf(stderr, "error: invalid payload length \"%s\"\n", argv[i]);
+                rc = 1;
+                continue;
+            }
+            rc |= bench_run((unsigned int)len);
+        }
+    } else {
+        for (i = 0; i < (int)(sizeof(default_lens) / sizeof(default_lens[0])); i++) {
+            rc |= bench_run(default_lens[i]);
+        }
+    }
+
+    return rc;
+}
@@ -0,0 +1,951 @@
+/*
+ *
+ * Copyright (c) 2018 Cisco Systems, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials provided
+ *   with the distribution.
+ *
+ *   Neither the name of the Cisco Systems, Inc. nor the names of its
+ *   contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+/**
+ * \file pcap_mmap.c
+ *
+ * \brief reader for pcap and pcapng files that maps them into memory
+ *
+ ** A classic pcap file is a file header followed by records, each of
+ *  which is a 16 byte header and the captured bytes.  A pcapng file is
+ *  a sequence of blocks; a Section Header Block sets the byte order of
+ *  the blocks that follow it, Interface Description Blocks describe the
+ *  link type and timestamp resolution of each interface, and Enhanced,
+ *  Simple and (obsolete) Packet Blocks carry the packets.  Other blocks
+ *  are skipped.
+ *
+ ** Packets and their headers are checked the way libpcap checks them,
+ *  and timestamps are converted to microseconds the way libpcap does
+ *  for pcap_open_offline(), so that joy sees the same packets either
+ *  way.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifndef WIN32
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+#include "safe_lib.h"
+#include "p2f.h"
+#include "pkt.h"
+#include "pcap_mmap.h"
+#include "err.h"
+
+#define PCAP_MAGIC          0xa1b2c3d4
+#define PCAP_MAGIC_NSEC     0xa1b23c4d
+#define PCAP_HDR_LEN        24
+#define PCAP_REC_HDR_LEN    16
+
+#define PCAPNG_SHB          0x0a0d0d0a
+#define PCAPNG_BYTE_ORDER   0x1a2b3c4d
+#define PCAPNG_IDB          1
+#define PCAPNG_PB           2
+#define PCAPNG_SPB          3
+#define PCAPNG_EPB          6
+#define PCAPNG_OPT_TSRESOL  9
+#define PCAPNG_OPT_TSOFFSET 14
+
+#define LINKTYPE_ETHERNET   1
+
+/** zeroed bytes after the copy of the end of the file */
+#define PCAP_MMAP_TAIL_PAD  64
+
+static uint32_t pcap_mmap_swap32 (uint32_t v) {
+    return (v >> 24) | ((v >> 8) & 0xff00) | ((v << 8) & 0xff0000) | (v << 24);
+}
+
+static uint32_t pcap_mmap_get32 (const pcap_mmap_t *r, const unsigned char *p) {
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return r->swapped ? pcap_mmap_swap32(v) : v;
+}
+
+static uint16_t pcap_mmap_get16 (const pcap_mmap_t *r, const unsigned char *p) {
+    uint16_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return r->swapped ? (uint16_t)((v >> 8) | (v << 8)) : v;
+}
+
+static uint64_t pcap_mmap_get64 (const pcap_mmap_t *r, const unsigned char *p) {
+    uint64_t v;
+
+    if (r->swapped) {
+        /* the high word comes first in the file */
+        v = ((uint64_t)pcap_mmap_get32(r, p) << 32) | pcap_mmap_get32(r, p + 4);
+    } else {
+        memcpy(&v, p, sizeof(v));
+    }
+    return v;
+}
+
+/**
+ * \brief Ask the kernel to read the next part of the file, once the
+ * packets that are being processed get close to the end of the part
+ * that was asked for before.
+ */
+static void pcap_mmap_readahead (pcap_mmap_t *r) {
+#ifndef WIN32
+    size_t len;
+
+    if (r->advised == r->size || r->offset + PCAP_MMAP_READAHEAD / 2 < r->advised) {
+        return;
+    }
+    len = r->size - r->advised;
+    if (len > PCAP_MMAP_READAHEAD) {
+        len = PCAP_MMAP_READAHEAD;
+    }
+    madvise((void *)(r->base + r->advised), len, MADV_WILLNEED);
+    r->advised += len;
+#else
+    (void)r;
+#endif
+}
+
+/**
+ * \brief The equivalent of the BPF filter "ip or ip6 or mpls or vlan" on Ethernet.
+ */
+static int pcap_mmap_ip_only (const unsigned char *packet, uint32_t caplen) {
+    uint16_t ether_type;
+
+    if (caplen < ETHERNET_HDR_LEN) {
+        return 0;
+    }
+    ether_type = (uint16_t)((packet[12] << 8) | packet[13]);
+    return ether_type == ETH_TYPE_IP || ether_type == ETH_TYPE_IPV6 ||
+           ether_type == ETH_TYPE_MPLS || ether_type == ETH_TYPE_DOT1Q ||
+           ether_type == ETH_TYPE_QNQ || ether_type == ETH_TYPE_QINQ_OLD;
+}
+
+/**
+ * \brief Hand a packet to the callback, if it passes the filter.
+ *
+ * \return 1 if the packet was handed over, 0 if it was filtered out,
+ *         -1 on failure
+ */
+static int pcap_mmap_deliver (pcap_mmap_t *r, struct pcap_pkthdr *header,
+                              const unsigned char *packet,
+                              pcap_handler callback, unsigned char *user) {
+    if (r->ip_only && !pcap_mmap_ip_only(packet, header->caplen)) {
+        return 0;
+    }
+
+    /*
+     * The packet parsers may look a little past the captured bytes,
+     * which libpcap's buffer allows for; the end of the mapping does not.
+     * The rest of the file is copied once, when the first packet gets
+     * that close to its end, so that packets already handed over stay
+     * where they are.
+     */
+    if (r->tail == NULL &&
+        (size_t)(r->base + r->size - packet) < header->caplen + PCAP_MMAP_TAIL_PAD) {
+        size_t len = (size_t)(r->base + r->size - packet);
+
+        r->bounce = malloc(len + PCAP_MMAP_TAIL_PAD);
+        if (r->bounce == NULL) {
+            joy_log_err("out of memory");
+            return -1;
+        }
+        memcpy_s(r->bounce, len, packet, len);
+        memset_s(r->bounce + len, PCAP_MMAP_TAIL_PAD, 0x00, PCAP_MMAP_TAIL_PAD);
+        r->tail = packet;
+    }
+    if (r->tail != NULL) {
+        packet = r->bounce + (packet - r->tail);
+    }
+
+    callback(user, header, packet);
+    return 1;
+}
+
+/**
+ * \brief Read the next record of a classic pcap file.
+ *
+ * \return 1 on success with the packet in header and packet, 0 at the
+ *         end of the file, -1 if the file is corrupt
+ */
+static int pcap_mmap_next_pcap (pcap_mmap_t *r, struct pcap_pkthdr *header,
+                                const unsigned char **packet) {
+    const unsigned char *p = r->base + r->offset;
+    uint32_t ts_sec, ts_frac, caplen, len, tmp;
+
+    if (r->offset == r->size) {
+        return 0;
+    }
+    if (r->size - r->offset < PCAP_REC_HDR_LEN) {
+        joy_log_err("truncated record header at offset %lu", (unsigned long)r->offset);
+        return -1;
+    }
+    ts_sec = pcap_mmap_get32(r, p);
+    ts_frac = pcap_mmap_get32(r, p + 4);
+    caplen = pcap_mmap_get32(r, p + 8);
+    len = pcap_mmap_get32(r, p + 12);
+
+    /* before version 2.3, and sometimes in it, the lengths were the other way around */
+    if (r->old_version == 1 || (r->old_version == 2 && caplen > len)) {
+        tmp = caplen;
+        caplen = len;
+        len = tmp;
+    }
+    if (caplen > PCAP_MMAP_MAX_SNAPLEN || caplen > r->size - r->offset - PCAP_REC_HDR_LEN) {
+        joy_log_err("bad or truncated record at offset %lu", (unsigned long)r->offset);
+        return -1;
+    }
+    *packet = p + PCAP_REC_HDR_LEN;
+    r->offset += PCAP_REC_HDR_LEN + caplen;
+
+    header->ts.tv_sec = ts_sec;
+    header->ts.tv_usec = r->nsec ? ts_frac / 1000 : ts_frac;
+    header->caplen = (caplen > r->snaplen) ? r->snaplen : caplen;
+    header->len = len;
+
+    return 1;
+}
+
+/**
+ * \brief Add the interface described by an Interface Description Block.
+ *
+ * \return 0 success, -1 if the block is bad or not for Ethernet
+ */
+static int pcap_mmap_add_if (pcap_mmap_t *r, const unsigned char *body, size_t body_len) {
+    pcap_mmap_if_t *ifp, *tmp;
+    const unsigned char *opt = body + 8;
+    const unsigned char *end = body + body_len;
+    uint16_t code, len;
+    unsigned int i;
+
+    if (body_len < 8) {
+        return -1;
+    }
+    if (pcap_mmap_get16(r, body) != LINKTYPE_ETHERNET) {
+        return -1;
+    }
+
+    if (r->num_ifs == r->max_ifs) {
+        tmp = realloc(r->ifs, (r->max_ifs * 2 + 4) * sizeof(pcap_mmap_if_t));
+        if (tmp == NULL) {
+            joy_log_err("out of memory");
+            return -1;
+        }
+        r->ifs = tmp;
+        r->max_ifs = r->max_ifs * 2 + 4;
+    }
+    ifp = &r->ifs[r->num_ifs];
+    ifp->snaplen = pcap_mmap_get32(r, body + 4);
+    ifp->tsresol = 1000000;
+    ifp->tsresol_bin = 0;
+    ifp->tsresol_exp = 6;
+    ifp->tsoffset = 0;
+
+    while (end - opt >= 4) {
+        code = pcap_mmap_get16(r, opt);
+        len = pcap_mmap_get16(r, opt + 2);
+        opt += 4;
+        if (code == 0 || (size_t)(end - opt) < len) {
+            break;
+        }
+        if (code == PCAPNG_OPT_TSRESOL && len == 1) {
+            ifp->tsresol_bin = (opt[0] & 0x80) ? 1 : 0;
+            ifp->tsresol_exp = opt[0] & 0x7f;
+            if ((ifp->tsresol_bin && ifp->tsresol_exp > 63) ||
+                (!ifp->tsresol_bin && ifp->tsresol_exp > 19)) {
+                joy_log_err("timestamp resolution of interface %u is too high", r->num_ifs);
+                return -1;
+            }
+            ifp->tsresol = 1;
+            for (i = 0; i < ifp->tsresol_exp; i++) {
+                ifp->tsresol *= ifp->tsresol_bin ? 2 : 10;
+            }
+        } else if (code == PCAPNG_OPT_TSOFFSET && len == 8) {
+            ifp->tsoffset = (int64_t)pcap_mmap_get64(r, opt);
+        }
+        opt += (len + 3) & ~3;
+    }
+
+    /* like libpcap, the first interface sets the snapshot length */
+    if (r->snaplen == 0) {
+        r->snaplen = ifp->snaplen;
+        if (r->snaplen == 0 || r->snaplen > PCAP_MMAP_MAX_SNAPLEN) {
+            r->snaplen = PCAP_MMAP_MAX_SNAPLEN;
+        }
+    }
+    r->num_ifs++;
+
+    return 0;
+}
+
+/**
+ * \brief Convert a pcapng timestamp of an interface to a timeval.
+ */
+static void pcap_mmap_ts (const pcap_mmap_if_t *ifp, uint64_t t, struct timeval *tv) {
+    uint64_t frac = t % ifp->tsresol;
+    uint64_t usec;
+    unsigned int i;
+
+    if (ifp->tsresol_bin) {
+        if (ifp->tsresol_exp <= 40) {
+            usec = (frac * 1000000) >> ifp->tsresol_exp;
+        } else {
+            usec = ((frac >> (ifp->tsresol_exp - 40)) * 1000000) >> 40;
+        }
+    } else {
+        usec = frac;
+        for (i = ifp->tsresol_exp; i < 6; i++) {
+            usec *= 10;
+        }
+        for (i = 6; i < ifp->tsresol_exp; i++) {
+            usec /= 10;
+        }
+    }
+    tv->tv_sec = (time_t)((int64_t)(t / ifp->tsresol) + ifp->tsoffset);
+    tv->tv_usec = (long)usec;
+}
+
+/**
+ * \brief Read the next block of a pcapng file.
+ *
+ * \return 1 if it is a packet block, with the packet in header and
+ *         packet, 0 for other blocks, -1 if the file is corrupt
+ */
+static int pcap_mmap_block (pcap_mmap_t *r, struct pcap_pkthdr *header,
+                            const unsigned char **packet) {
+    const unsigned char *p = r->base + r->offset;
+    const unsigned char *body;
+    uint32_t type, block_len, bom, if_id, caplen;
+    size_t body_len;
+
+    if (r->size - r->offset < 12) {
+        joy_log_err("truncated block header at offset %lu", (unsigned long)r->offset);
+        return -1;
+    }
+    memcpy(&type, p, sizeof(type));
+    if (type == PCAPNG_SHB) {
+        /* a new section, possibly with the other byte order */
+        memcpy(&bom, p + 8, sizeof(bom));
+        if (bom == PCAPNG_BYTE_ORDER) {
+            r->swapped = 0;
+        } else if (pcap_mmap_swap32(bom) == PCAPNG_BYTE_ORDER) {
+            r->swapped = 1;
+        } else {
+            joy_log_err("bad byte order magic at offset %lu", (unsigned long)r->offset);
+            return -1;
+        }
+        r->num_ifs = 0;
+    } else {
+        type = pcap_mmap_get32(r, p);
+    }
+    block_len = pcap_mmap_get32(r, p + 4);
+    if (block_len < 12 || (block_len & 3) || block_len > r->size - r->offset) {
+        joy_log_err("bad or truncated block at offset %lu", (unsigned long)r->offset);
+        return -1;
+    }
+    body = p + 8;
+    body_len = block_len - 12;
+
+    switch (type) {
+    case PCAPNG_IDB:
+        if (pcap_mmap_add_if(r, body, body_len)) {
+            joy_log_err("bad or non-Ethernet interface at offset %lu", (unsigned long)r->offset);
+            return -1;
+        }
+        r->offset += block_len;
+        return 0;
+    case PCAPNG_EPB:
+    case PCAPNG_PB:
+        if (body_len < 20) {
+            joy_log_err("bad packet block at offset %lu", (unsigned long)r->offset);
+            return -1;
+        }
+        if (type == PCAPNG_EPB) {
+            if_id = pcap_mmap_get32(r, body);
+        } else {
+            if_id = pcap_mmap_get16(r, body);
+        }
+        caplen = pcap_mmap_get32(r, body + 12);
+        if (if_id >= r->num_ifs || caplen > body_len - 20 || caplen > PCAP_MMAP_MAX_SNAPLEN) {
+            joy_log_err("bad packet block at offset %lu", (unsigned long)r->offset);
+            return -1;
+        }
+        pcap_mmap_ts(&r->ifs[if_id],
+                     ((uint64_t)pcap_mmap_get32(r, body + 4) << 32) | pcap_mmap_get32(r, body + 8),
+                     &header->ts);
+        header->caplen = caplen;
+        header->len = pcap_mmap_get32(r, body + 16);
+        *packet = body + 20;
+        break;
+    case PCAPNG_SPB:
+        if (body_len < 4 || r->num_ifs == 0) {
+            joy_log_err("bad simple packet block at offset %lu", (unsigned long)r->offset);
+            return -1;
+        }
+        header->len = pcap_mmap_get32(r, body);
+        caplen = header->len;
+        if (caplen > body_len - 4) {
+            caplen = (uint32_t)(body_len - 4);
+        }
+        if (r->ifs[0].snaplen && caplen > r->ifs[0].snaplen) {
+            caplen = r->ifs[0].snaplen;
+        }
+        header->ts.tv_sec = 0;
+        header->ts.tv_usec = 0;
+        header->caplen = caplen;
+        *packet = body + 4;
+        break;
+    default:
+        r->offset += block_len;
+        return 0;
+    }
+
+    if (header->caplen > r->snaplen) {
+        header->caplen = r->snaplen;
+    }
+    r->offset += block_len;
+    return 1;
+}
+
+/**
+ * \brief Read blocks of a pcapng file up to and including the next packet.
+ *
+ * \return 1 on success with the packet in header and packet, 0 at the
+ *         end of the file, -1 if the file is corrupt
+ */
+static int pcap_mmap_next_pcapng (pcap_mmap_t *r, struct pcap_pkthdr *header,
+                                  const unsigned char **packet) {
+    int rc;
+
+    while (r->offset != r->size) {
+        rc = pcap_mmap_block(r, header, packet);
+        if (rc != 0) {
+            return rc;
+        }
+    }
+    return 0;
+}
+
+/**
+ * \brief Type of the next block of a pcapng file, without reading it.
+ */
+static uint32_t pcap_mmap_peek (const pcap_mmap_t *r) {
+    uint32_t type;
+
+    if (r->size - r->offset < 12) {
+        return 0;
+    }
+    memcpy(&type, r->base + r->offset, sizeof(type));
+    if (type != PCAPNG_SHB && r->swapped) {
+        type = pcap_mmap_swap32(type);
+    }
+    return type;
+}
+
+/**
+ * \fn joy_status_e pcap_mmap_open (pcap_mmap_t *r, const char *file_name, int ip_only)
+ *
+ * \brief Map a pcap or pcapng file into memory.
+ *
+ * \param r Reader
+ * \param file_name Name of the file
+ * \param ip_only Only hand over the packets that match "ip or ip6 or mpls or vlan"
+ * \return ok, or failure if the file is not an Ethernet capture that can be mapped
+ */
+joy_status_e pcap_mmap_open (pcap_mmap_t *r, const char *file_name, int ip_only) {
+#ifdef WIN32
+    memset_s(r, sizeof(pcap_mmap_t), 0x00, sizeof(pcap_mmap_t));
+    (void)file_name;
+    (void)ip_only;
+    return failure;
+#else
+    struct stat st;
+    void *map;
+    uint32_t magic, type;
+    struct pcap_pkthdr header;
+    const unsigned char *packet;
+    uint16_t version_major, version_minor;
+    int fd;
+
+    memset_s(r, sizeof(pcap_mmap_t), 0x00, sizeof(pcap_mmap_t));
+
+    fd = open(file_name, O_RDONLY);
+    if (fd < 0) {
+        return failure;
+    }
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size < PCAP_HDR_LEN ||
+        (uint64_t)st.st_size > (uint64_t)SIZE_MAX) {
+        close(fd);
+        return failure;
+    }
+    map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return failure;
+    }
+    r->base = map;
+    r->size = (size_t)st.st_size;
+    r->ip_only = ip_only ? 1 : 0;
+    madvise(map, r->size, MADV_SEQUENTIAL);
+
+    memcpy(&magic, r->base, sizeof(magic));
+    if (magic == PCAP_MAGIC || magic == PCAP_MAGIC_NSEC ||
+        pcap_mmap_swap32(magic) == PCAP_MAGIC || pcap_mmap_swap32(magic) == PCAP_MAGIC_NSEC) {
+        r->swapped = (magic != PCAP_MAGIC && magic != PCAP_MAGIC_NSEC);
+        r->nsec = (pcap_mmap_get32(r, r->base) == PCAP_MAGIC_NSEC);
+        version_major = pcap_mmap_get16(r, r->base + 4);
+        version_minor = pcap_mmap_get16(r, r->base + 6);
+        if (version_major < 2 || (version_major == 2 && version_minor < 3)) {
+            r->old_version = 1;
+        } else if (version_major == 2 && version_minor == 3) {
+            r->old_version = 2;
+        }
+        r->snaplen = pcap_mmap_get32(r, r->base + 16);
+        if (r->snaplen == 0 || r->snaplen > PCAP_MMAP_MAX_SNAPLEN) {
+            r->snaplen = PCAP_MMAP_MAX_SNAPLEN;
+        }
+        if (pcap_mmap_get32(r, r->base + 20) != LINKTYPE_ETHERNET) {
+            pcap_mmap_close(r);
+            return failure;
+        }
+        r->offset = PCAP_HDR_LEN;
+    } else if (magic == PCAPNG_SHB) {
+        r->pcapng = 1;
+        /* read the section header and interfaces up to the first packet */
+        while ((type = pcap_mmap_peek(r)) != 0 &&
+               type != PCAPNG_EPB && type != PCAPNG_PB && type != PCAPNG_SPB) {
+            if (type == PCAPNG_IDB && pcap_mmap_get16(r, r->base + r->offset + 8) != LINKTYPE_ETHERNET) {
+                break;
+            }
+            if (pcap_mmap_block(r, &header, &packet) < 0) {
+                break;
+            }
+        }
+        if (r->num_ifs == 0 || (r->offset != r->size &&
+                                type != PCAPNG_EPB && type != PCAPNG_PB && type != PCAPNG_SPB)) {
+            pcap_mmap_close(r);
+            return failure;
+        }
+    } else {
+        pcap_mmap_close(r);
+        return failure;
+    }
+
+    pcap_mmap_readahead(r);
+    return ok;
+#endif
+}
+
+/**
+ * \fn int pcap_mmap_dispatch (pcap_mmap_t *r, int cnt, pcap_handler callback, unsigned char *user)
+ *
+ * \brief Hand the next packets of the file to a callback, like pcap_dispatch().
+ *
+ * Packets that do not pass the filter are skipped and not counted.
+ *
+ * \param r Reader
+ * \param cnt Most packets to hand over, all of them if cnt <= 0
+ * \param callback Called for each packet
+ * \param user Passed on to the callback
+ * \return number of packets handed over, 0 at the end of the file, -1 if the file is corrupt
+ */
+int pcap_mmap_dispatch (pcap_mmap_t *r, int cnt, pcap_handler callback, unsigned char *user) {
+    struct pcap_pkthdr header;
+    const unsigned char *packet = NULL;
+    int n = 0;
+    int rc;
+
+    while (cnt <= 0 || n < cnt) {
+        if (r->offset + PCAP_MMAP_READAHEAD / 2 >= r->advised) {
+            pcap_mmap_readahead(r);
+        }
+        if (r->pcapng) {
+            rc = pcap_mmap_next_pcapng(r, &header, &packet);
+        } else {
+            rc = pcap_mmap_next_pcap(r, &header, &packet);
+        }
+        if (rc == 1) {
+            rc = pcap_mmap_deliver(r, &header, packet, callback, user);
+        }
+        if (rc < 0) {
+            /* like libpcap, report the error once; the file ends here */
+            r->offset = r->size;
+            return -1;
+        }
+        if (rc == 0 && r->offset == r->size) {
+            break;
+        }
+        n += rc;
+    }
+
+    return n;
+}
+
+/**
+ * \fn void pcap_mmap_close (pcap_mmap_t *r)
+ *
+ * \brief Unmap a file and release the reader.
+ *
+ * \param r Reader
+ * \return none
+ */
+void pcap_mmap_close (pcap_mmap_t *r) {
+#ifndef WIN32
+    if (r->base) {
+        munmap((void *)r->base, r->size);
+    }
+#endif
+    free(r->ifs);
+    free(r->bounce);
+    memset_s(r, sizeof(pcap_mmap_t), 0x00, sizeof(pcap_mmap_t));
+}
+
+/*
+ * Unit test: small capture files written out in every format that the
+ * reader knows, read back through pcap_mmap_dispatch()
+ */
+
+#ifndef WIN32
+
+#define PCAP_MMAP_TEST_PACKETS 4
+
+/* ethernet types of the test packets; the ARP packet does not pass the filter */
+static const uint16_t pcap_mmap_test_type[PCAP_MMAP_TEST_PACKETS] = {
+    ETH_TYPE_IP, 0x0806, ETH_TYPE_DOT1Q, ETH_TYPE_IP
+};
+
+typedef struct pcap_mmap_test_buf_ {
+    unsigned char data[4096];
+    size_t len;
+    int swap;
+} pcap_mmap_test_buf_t;
+
+typedef struct pcap_mmap_test_seen_ {
+    unsigned int num_packets;
+    struct pcap_pkthdr headers[PCAP_MMAP_TEST_PACKETS];
+    unsigned char first_bytes[PCAP_MMAP_TEST_PACKETS][16];
+} pcap_mmap_test_seen_t;
+
+static unsigned int pcap_mmap_test_caplen (unsigned int i) {
+    return 60 + 20 * i;
+}
+
+static void pcap_mmap_test_put32 (pcap_mmap_test_buf_t *b, uint32_t v) {
+    if (b->swap) {
+        v = pcap_mmap_swap32(v);
+    }
+    memcpy(b->data + b->len, &v, sizeof(v));
+    b->len += sizeof(v);
+}
+
+static void pcap_mmap_test_put16 (pcap_mmap_test_buf_t *b, uint16_t v) {
+    if (b->swap) {
+        v = (uint16_t)((v >> 8) | (v << 8));
+    }
+    memcpy(b->data + b->len, &v, sizeof(v));
+    b->len += sizeof(v);
+}
+
+static void pcap_mmap_test_put_packet (pcap_mmap_test_buf_t *b, unsigned int i) {
+    unsigned int j, caplen = pcap_mmap_test_caplen(i);
+
+    for (j = 0; j < caplen; j++) {
+        b->data[b->len + j] = (unsigned char)(i * 16 + j);
+    }
+    b->data[b->len + 12] = (unsigned char)(pcap_mmap_test_type[i] >> 8);
+    b->data[b->len + 13] = (unsigned char)(pcap_mmap_test_type[i] & 0xff);
+    b->len += caplen;
+    while (b->len & 3) {
+        b->data[b->len++] = 0;
+    }
+}
+
+/* classic pcap; nanosecond timestamps if nsec */
+static void pcap_mmap_test_pcap (pcap_mmap_test_buf_t *b, int nsec) {
+    unsigned int i;
+
+    b->len = 0;
+    pcap_mmap_test_put32(b, nsec ? PCAP_MAGIC_NSEC : PCAP_MAGIC);
+    pcap_mmap_test_put16(b, 2);
+    pcap_mmap_test_put16(b, 4);
+    pcap_mmap_test_put32(b, 0);
+    pcap_mmap_test_put32(b, 0);
+    pcap_mmap_test_put32(b, 65535);
+    pcap_mmap_test_put32(b, LINKTYPE_ETHERNET);
+    for (i = 0; i < PCAP_MMAP_TEST_PACKETS; i++) {
+        pcap_mmap_test_put32(b, 1000 + i);
+        pcap_mmap_test_put32(b, nsec ? (500000 + i) * 1000 + 999 : 500000 + i);
+        pcap_mmap_test_put32(b, pcap_mmap_test_caplen(i));
+        pcap_mmap_test_put32(b, pcap_mmap_test_caplen(i) + 100);
+        pcap_mmap_test_put_packet(b, i);
+        /* records are not padded in classic pcap */
+        b->len -= (4 - pcap_mmap_test_caplen(i) % 4) % 4;
+    }
+}
+
+/* pcapng with nanosecond timestamps; the last packet is in a simple packet block */
+static void pcap_mmap_test_pcapng (pcap_mmap_test_buf_t *b) {
+    uint64_t t;
+    unsigned int i;
+    size_t start;
+
+    b->len = 0;
+    pcap_mmap_test_put32(b, PCAPNG_SHB);
+    pcap_mmap_test_put32(b, 28);
+    pcap_mmap_test_put32(b, PCAPNG_BYTE_ORDER);
+    pcap_mmap_test_put16(b, 1);
+    pcap_mmap_test_put16(b, 0);
+    pcap_mmap_test_put32(b, 0xffffffff);
+    pcap_mmap_test_put32(b, 0xffffffff);
+    pcap_mmap_test_put32(b, 28);
+
+    /* interface with if_tsresol = 9 */
+    pcap_mmap_test_put32(b, PCAPNG_IDB);
+    pcap_mmap_test_put32(b, 32);
+    pcap_mmap_test_put16(b, LINKTYPE_ETHERNET);
+    pcap_mmap_test_put16(b, 0);
+    pcap_mmap_test_put32(b, 65535);
+    pcap_mmap_test_put16(b, PCAPNG_OPT_TSRESOL);
+    pcap_mmap_test_put16(b, 1);
+    b->data[b->len] = 9;
+    memset_s(b->data + b->len + 1, 3, 0x00, 3);
+    b->len += 4;
+    pcap_mmap_test_put32(b, 0);
+    pcap_mmap_test_put32(b, 32);
+
+    /* a block that the reader does not know */
+    pcap_mmap_test_put32(b, 0x0bad);
+    pcap_mmap_test_put32(b, 16);
+    pcap_mmap_test_put32(b, 0);
+    pcap_mmap_test_put32(b, 16);
+
+    for (i = 0; i < PCAP_MMAP_TEST_PACKETS - 1; i++) {
+        start = b->len;
+        t = (uint64_t)(1000 + i) * 1000000000 + (uint64_t)(500000 + i) * 1000 + 999;
+        pcap_mmap_test_put32(b, PCAPNG_EPB);
+        pcap_mmap_test_put32(b, 0);
+        pcap_mmap_test_put32(b, 0);
+        pcap_mmap_test_put32(b, (uint32_t)(t >> 32));
+        pcap_mmap_test_put32(b, (uint32_t)t);
+        pcap_mmap_test_put32(b, pcap_mmap_test_caplen(i));
+        pcap_mmap_test_put32(b, pcap_mmap_test_caplen(i) + 100);
+        pcap_mmap_test_put_packet(b, i);
+        pcap_mmap_test_put32(b, (uint32_t)(b->len - start + 4));
+        memcpy(b->data + start + 4, b->data + b->len - 4, 4);
+    }
+    start = b->len;
+    pcap_mmap_test_put32(b, PCAPNG_SPB);
+    pcap_mmap_test_put32(b, 0);
+    pcap_mmap_test_put32(b, pcap_mmap_test_caplen(i));
+    pcap_mmap_test_put_packet(b, i);
+    pcap_mmap_test_put32(b, (uint32_t)(b->len - start + 4));
+    memcpy(b->data + start + 4, b->data + b->len - 4, 4);
+}
+
+static void pcap_mmap_test_callback (unsigned char *arg, const struct pcap_pkthdr *header,
+                                     const unsigned char *packet) {
+    pcap_mmap_test_seen_t *seen = (pcap_mmap_test_seen_t *)arg;
+
+    if (seen->num_packets < PCAP_MMAP_TEST_PACKETS) {
+        seen->headers[seen->num_packets] = *header;
+        memcpy(seen->first_bytes[seen->num_packets], packet, 16);
+    }
+    seen->num_packets++;
+}
+
+/* write a test file to a new temporary file; returns 0 on success */
+static int pcap_mmap_test_file (const pcap_mmap_test_buf_t *b, char *file_name, size_t size) {
+    int fd;
+
+    strncpy_s(file_name, size, "/tmp/joy_pcap_mmap_XXXXXX", size - 1);
+    fd = mkstemp(file_name);
+    if (fd < 0) {
+        joy_log_err("could not create a temporary file");
+        return 1;
+    }
+    if (write(fd, b->data, b->len) != (ssize_t)b->len) {
+        joy_log_err("could not write %s", file_name);
+        close(fd);
+        unlink(file_name);
+        return 1;
+    }
+    close(fd);
+    return 0;
+}
+
+/* read a test file back; returns the number of failures */
+static int pcap_mmap_test_read (const pcap_mmap_test_buf_t *b, int ip_only, int pcapng) {
+    char file_name[32];
+    pcap_mmap_test_seen_t seen;
+    pcap_mmap_t r;
+    unsigned int i, k;
+    int n, num_fails = 0;
+
+    if (pcap_mmap_test_file(b, file_name, sizeof(file_name))) {
+        return 1;
+    }
+
+    memset_s(&seen, sizeof(seen), 0x00, sizeof(seen));
+    if (pcap_mmap_open(&r, file_name, ip_only) != ok) {
+        joy_log_err("could not open the test file");
+        unlink(file_name);
+        return 1;
+    }
+    /* one packet at a time, to check the counts */
+    while ((n = pcap_mmap_dispatch(&r, 1, pcap_mmap_test_callback, (unsigned char *)&seen)) > 0) {
+        if (n != 1) {
+            joy_log_err("dispatch handed over %d packets", n);
+            num_fails++;
+        }
+    }
+    if (n < 0) {
+        joy_log_err("dispatch failed");
+        num_fails++;
+    }
+    pcap_mmap_close(&r);
+    unlink(file_name);
+
+    if (seen.num_packets != (ip_only ? PCAP_MMAP_TEST_PACKETS - 1 : PCAP_MMAP_TEST_PACKETS)) {
+        joy_log_err("%u packets read", seen.num_packets);
+        return num_fails + 1;
+    }
+    for (i = 0, k = 0; i < PCAP_MMAP_TEST_PACKETS; i++) {
+        if (ip_only && pcap_mmap_test_type[i] == 0x0806) {
+            continue;
+        }
+        if (seen.headers[k].caplen != pcap_mmap_test_caplen(i) ||
+            seen.headers[k].len != pcap_mmap_test_caplen(i) + (pcapng && i == PCAP_MMAP_TEST_PACKETS - 1 ? 0 : 100) ||
+            seen.first_bytes[k][0] != (unsigned char)(i * 16) ||
+            seen.first_bytes[k][13] != (unsigned char)(pcap_mmap_test_type[i] & 0xff)) {
+            joy_log_err("packet %u is wrong", i);
+            num_fails++;
+        }
+        if (pcapng && i == PCAP_MMAP_TEST_PACKETS - 1) {
+            /* simple packet blocks have no timestamp */
+            if (seen.headers[k].ts.tv_sec != 0 || seen.headers[k].ts.tv_usec != 0) {
+                joy_log_err("packet %u has a timestamp", i);
+                num_fails++;
+            }
+        } else if (seen.headers[k].ts.tv_sec != (time_t)(1000 + i) ||
+                   seen.headers[k].ts.tv_usec != (long)(500000 + i)) {
+            joy_log_err("packet %u has a wrong timestamp", i);
+            num_fails++;
+        }
+        k++;
+    }
+
+    return num_fails;
+}
+
+#endif /* WIN32 */
+
+int pcap_mmap_unit_test (void) {
+#ifndef WIN32
+    pcap_mmap_test_buf_t b;
+    char file_name[32];
+    pcap_mmap_test_seen_t seen;
+    pcap_mmap_t r;
+#endif
+    int num_fails = 0;
+
+    fprintf(info, "\n******************************\n");
+    fprintf(info, "Pcap mmap reader Unit Test starting...\n");
+
+#ifdef WIN32
+    fprintf(info, "not available on this platform\n");
+#else
+    memset_s(&b, sizeof(b), 0x00, sizeof(b));
+
+    /* classic pcap, in both byte orders and timestamp resolutions */
+    for (b.swap = 0; b.swap < 2; b.swap++) {
+        pcap_mmap_test_pcap(&b, b.swap);
+        num_fails += pcap_mmap_test_read(&b, 0, 0);
+        num_fails += pcap_mmap_test_read(&b, 1, 0);
+
+        b.swap = !b.swap;
+        pcap_mmap_test_pcapng(&b);
+        b.swap = !b.swap;
+        num_fails += pcap_mmap_test_read(&b, 0, 1);
+        num_fails += pcap_mmap_test_read(&b, 1, 1);
+    }
+
+    /* a truncated file is an error, after the packets before the cut */
+    b.swap = 0;
+    pcap_mmap_test_pcap(&b, 0);
+    b.len -= 10;
+    if (pcap_mmap_test_file(&b, file_name, sizeof(file_name))) {
+        num_fails++;
+    } else {
+        memset_s(&seen, sizeof(seen), 0x00, sizeof(seen));
+        if (pcap_mmap_open(&r, file_name, 0) != ok) {
+            joy_log_err("could not open the truncated file");
+            num_fails++;
+        } else {
+            if (pcap_mmap_dispatch(&r, 0, pcap_mmap_test_callback, (unsigned char *)&seen) != -1 ||
+                seen.num_packets != PCAP_MMAP_TEST_PACKETS - 1 ||
+                pcap_mmap_dispatch(&r, 0, pcap_mmap_test_callback, (unsigned char *)&seen) != 0) {
+                joy_log_err("truncated file not reported");
+                num_fails++;
+            }
+            pcap_mmap_close(&r);
+        }
+        unlink(file_name);
+    }
+
+    /* other link types are left to libpcap */
+    pcap_mmap_test_pcap(&b, 0);
+    b.data[20] = 101;
+    if (pcap_mmap_test_file(&b, file_name, sizeof(file_name))) {
+        num_fails++;
+    } else {
+        if (pcap_mmap_open(&r, file_name, 0) == ok) {
+            joy_log_err("raw IP capture was accepted");
+            pcap_mmap_close(&r);
+            num_fails++;
+        }
+        unlink(file_name);
+    }
+#endif
+
+    if (num_fails) {
+        fprintf(info, "Finished - failures: %d\n", num_fails);
+    } else {
+        fprintf(info, "Finished - success\n");
+    }
+    fprintf(info, "******************************\n\n");
+
+    return num_fails;
+}
@@ -0,0 +1,294 @@
+/*
+ *
+ * Copyright (c) 2018 Cisco Systems, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials provided
+ *   with the distribution.
+ *
+ *   Neither the name of the Cisco Systems, Inc. nor the names of its
+ *   contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/**
+ * \file pcap_mmap_bench.c
+ *
+ * \brief benchmark for the memory mapped pcap reader
+ *
+ ** Compares the rate at which packets are delivered from a capture
+ *  file by libpcap (pcap_dispatch() with joy's default filter) and by
+ *  the memory mapped reader (pcap_mmap.c), first to a callback that
+ *  only touches the packet, then to the joy packet processing.
+ *
+ *  usage: pcap_mmap_bench [-r runs] file [file ...]
+ *
+ *  Each measurement is the best of the runs (3 by default), with the
+ *  file already in the page cache.
+ */
+#ifdef HAVE_CONFIG_H
+#include "joy_config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "safe_lib.h"
+#include "pcap_mmap.h"
+#include "joy_api.h"
+
+/** the filter that joy installs on capture files by default */
+#define BENCH_FILTER "ip or ip6 or mpls or vlan"
+
+/** packets handed to the callback per dispatch, as in joy */
+#define BENCH_DISPATCH_CNT 5
+
+typedef struct bench_count_ {
+    unsigned long int packets;
+    unsigned long int bytes;
+    unsigned int sum;
+} bench_count_t;
+
+typedef struct bench_result_ {
+    double seconds;
+    unsigned long int packets;
+    unsigned long int bytes;
+} bench_result_t;
+
+/*
+ * Callback that reads the first and last byte of every packet, so
+ * that each packet is brought into the cache, as any real consumer
+ * would do
+ */
+static void bench_touch (unsigned char *arg, const struct pcap_pkthdr *header,
+                         const unsigned char *packet) {
+    bench_count_t *count = (bench_count_t *)arg;
+
+    count->packets++;
+    count->bytes += header->caplen;
+    if (header->caplen) {
+        count->sum += packet[0] + packet[header->caplen - 1];
+    }
+}
+
+/*
+ * Callback that counts the packet and hands it to joy context 0
+ */
+static void bench_process (unsigned char *arg, const struct pcap_pkthdr *header,
+                           const unsigned char *packet) {
+    bench_count_t *count = (bench_count_t *)arg;
+
+    count->packets++;
+    count->bytes += header->caplen;
+    joy_libpcap_process_packet(NULL, header, packet);
+}
+
+static double bench_elapsed (const struct timeval *start) {
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return (double)(now.tv_sec - start->tv_sec) + (double)(now.tv_usec - start->tv_usec) / 1e6;
+}
+
+/**
+ * \brief Read a file once with libpcap.
+ * \param file_name capture file
+ * \param callback pcap callback to hand the packets to
+ * \param result filled in with the time taken and the amount read
+ * \return 0 on success, 1 on error
+ */
+static int bench_libpcap (const char *file_name, pcap_handler callback, bench_result_t *result) {
+    char errbuf[PCAP_ERRBUF_SIZE];
+    struct bpf_program fp;
+    bench_count_t count;
+    struct timeval start;
+    pcap_t *pcap;
+
+    memset_s(&count, sizeof(count), 0x00, sizeof(count));
+    gettimeofday(&start, NULL);
+    pcap = pcap_open_offline(file_name, errbuf);
+    if (pcap == NULL) {
+        fprintf(stderr, "error: could not open %s: %s\n", file_name, errbuf);
+        return 1;
+    }
+    if (pcap_compile(pcap, &fp, BENCH_FILTER, 1, PCAP_NETMASK_UNKNOWN) == -1 ||
+        pcap_setfilter(pcap, &fp) == -1) {
+        fprintf(stderr, "error: could not install filter \"%s\"\n", BENCH_FILTER);
+        pcap_close(pcap);
+        return 1;
+    }
+    while (pcap_dispatch(pcap, BENCH_DISPATCH_CNT, callback, (unsigned char *)&count) > 0) {
+        ;
+    }
+    pcap_freecode(&fp);
+    pcap_close(pcap);
+    result->seconds = bench_elapsed(&start);
+    result->packets = count.packets;
+    result->bytes = count.bytes;
+
+    return 0;
+}
+
+/**
+ * \brief Read a file once with the memory mapped reader.
+ * \param file_name capture file
+ * \param callback pcap callback to hand the packets to
+ * \param result filled in with the time taken and the amount read
+ * \return 0 on success, 1 on error
+ */
+static int bench_mmap (const char *file_name, pcap_handler callback, bench_result_t *result) {
+    bench_count_t count;
+    struct timeval start;
+    pcap_mmap_t r;
+
+    memset_s(&count, sizeof(count), 0x00, sizeof(count));
+    gettimeofday(&start, NULL);
+    if (pcap_mmap_open(&r, file_name, 1) != ok) {
+        fprintf(stderr, "error: could not map %s\n", file_name);
+        return 1;
+    }
+    while (pcap_mmap_dispatch(&r, BENCH_DISPATCH_CNT, callback, (unsigned char *)&count) > 0) {
+        ;
+    }
+    pcap_mmap_close(&r);
+    result->seconds = bench_elapsed(&start);
+    result->packets = count.packets;
+    result->bytes = count.bytes;
+
+    return 0;
+}
+
+/**
+ * \brief Run one reader over a file several times and keep the best run.
+ * \param reader bench_libpcap or bench_mmap
+ * \param file_name capture file
+ * \param callback pcap callback to hand the packets to
+ * \param runs number of runs
+ * \param best filled in with the fastest run
+ * \return 0 on success, 1 on error
+ */
+static int bench_best (int (*reader)(const char *, pcap_handler, bench_result_t *),
+                       const char *file_name, pcap_handler callback,
+                       unsigned int runs, bench_result_t *best) {
+    bench_result_t result;
+    unsigned int i;
+
+    best->seconds = 0.0;
+    for (i = 0; i < runs; i++) {
+        if (reader(file_name, callback, &result)) {
+            return 1;
+        }
+        if (callback == bench_process) {
+            /* start every run from an empty flow table */
+            joy_context_cleanup(0);
+        }
+        if (i == 0 || result.seconds < best->seconds) {
+            *best = result;
+        }
+    }
+
+    return 0;
+}
+
+static void bench_print (const char *what, const bench_result_t *r) {
+    double seconds = r->seconds > 0.0 ? r->seconds : 1e-9;
+
+    printf("  %-16s %10lu pkts %8.3f s %9.2f Mpkts/s %9.2f MB/s\n", what, r->packets,
+           r->seconds, r->packets / seconds / 1e6, r->bytes / seconds / 1e6);
+}
+
+/**
+ * \brief Run the benchmark for one capture file.
+ * \param file_name capture file
+ * \param runs number of runs of each measurement
+ * \return 0 on success, 1 on error
+ */
+static int bench_run (const char *file_name, unsigned int runs) {
+    bench_result_t lp_touch, mm_touch, lp_proc, mm_proc;
+
+    /* one untimed pass, so that the file is in the page cache */
+    if (bench_best(bench_mmap, file_name, bench_touch, 1, &mm_touch)) {
+        return 1;
+    }
+    if (bench_best(bench_libpcap, file_name, bench_touch, runs, &lp_touch) ||
+        bench_best(bench_mmap, file_name, bench_touch, runs, &mm_touch) ||
+        bench_best(bench_libpcap, file_name, bench_process, runs, &lp_proc) ||
+        bench_best(bench_mmap, file_name, bench_process, runs, &mm_proc)) {
+        return 1;
+    }
+
+    printf("%s\n", file_name);
+    bench_print("libpcap read", &lp_touch);
+    bench_print("mmap read", &mm_touch);
+    bench_print("libpcap + joy", &lp_proc);
+    bench_print("mmap + joy", &mm_proc);
+    if (lp_touch.packets != mm_touch.packets || lp_touch.bytes != mm_touch.bytes) {
+        fprintf(stderr, "error: libpcap read %lu packets (%lu bytes), the mmap reader %lu (%lu bytes)\n",
+                lp_touch.packets, lp_touch.bytes, mm_touch.packets, mm_touch.bytes);
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * \fn int main (int argc, char* argv[])
+ * \brief main entry point for the pcap reader benchmark
+ * \return 0 on success, 1 on error
+ */
+int main (int argc, char *argv[]) {
+    joy_init_t init_data;
+    unsigned int runs = 3;
+    int i = 1, rc = 0;
+
+    if (argc > 2 && strcmp(argv[1], "-r") == 0) {
+        runs = (unsigned int)strtoul(argv[2], NULL, 0);
+        i = 3;
+    }
+    if (i >= argc || runs == 0) {
+        fprintf(stderr, "usage: %s [-r runs] file [file ...]\n", argv[0]);
+        return 1;
+    }
+
+    /* setup the joy options we want */
+    memset_s(&init_data, sizeof(joy_init_t), 0x00, sizeof(joy_init_t));
+    init_data.verbosity = JOY_LOG_WARN;
+
+    /* intialize joy */
+    if (joy_initialize(&init_data, NULL, NULL, NULL) != 0) {
+        printf(" -= Joy Initialized Failed =-\n");
+        return -1;
+    }
+
+    for (; i < argc; i++) {
+        rc |= bench_run(argv[i], runs);
+    }
+
+    joy_context_cleanup(0);
+    joy_shutdown();
+    return rc;
+}
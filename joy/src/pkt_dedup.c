@@ -0,0 +1,297 @@
+/*
+ *
+ * Copyright (c) 2018 Cisco Systems, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials provided
+ *   with the distribution.
+ *
+ *   Neither the name of the Cisco Systems, Inc. nor the names of its
+ *   contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/**
+ * \file pkt_dedup.c
+ *
+ * \brief time windowed set of packet fingerprints, to drop duplicates
+ *
+ ** The high bits of a fingerprint pick a bucket and the low 32 bits are
+ *  stored in it, so two different packets are only mistaken for each
+ *  other if they agree on all 64 bits; with a window of a millisecond
+ *  or so that does not happen in practice.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "safe_lib.h"
+#include "p2f.h"
+#include "pkt_dedup.h"
+#include "err.h"
+
+/** a bucket takes one cache line */
+#define PKT_DEDUP_ALIGN 64
+
+/** number of transport header bytes that go into a fingerprint */
+#define PKT_DEDUP_L4_BYTES 20
+
+/**
+ * \brief Allocate the fingerprint set.
+ * \param d Set to initialize
+ * \param window Microseconds within which a copy of a packet is dropped
+ * \return ok, or failure if there is not enough memory
+ */
+joy_status_e pkt_dedup_init (pkt_dedup_t *d, uint32_t window) {
+    size_t bytes = (size_t)PKT_DEDUP_BUCKETS * PKT_DEDUP_WAYS * sizeof(pkt_dedup_entry_t);
+
+    d->mem = calloc(1, bytes + PKT_DEDUP_ALIGN);
+    if (d->mem == NULL) {
+        d->entries = NULL;
+        return failure;
+    }
+    d->entries = (pkt_dedup_entry_t *)(((uintptr_t)d->mem + PKT_DEDUP_ALIGN - 1) &
+                                       ~(uintptr_t)(PKT_DEDUP_ALIGN - 1));
+    d->window = window;
+
+    return ok;
+}
+
+/**
+ * \brief Release the fingerprint set.
+ * \param d Set to release
+ * \return none
+ */
+void pkt_dedup_destroy (pkt_dedup_t *d) {
+    free(d->mem);
+    d->mem = NULL;
+    d->entries = NULL;
+}
+
+/**
+ * \brief Fold a value into a fingerprint.
+ */
+static inline uint64_t pkt_dedup_mix (uint64_t h, uint64_t v) {
+    h ^= v;
+    h *= 0xff51afd7ed558ccdULL;
+    return h ^ (h >> 32);
+}
+
+/**
+ * \brief Work out the fingerprint of a packet.
+ *
+ * The fingerprint covers the flow key, the length of the IP packet,
+ * the IPv4 id and fragment field (or the IPv6 flow label), and the
+ * start of the transport header, which holds the ports, the TCP
+ * sequence numbers and the checksum.  The TTL, the IPv4 header
+ * checksum and the traffic class are left out, so that a copy taken
+ * after a router has forwarded the packet still matches.
+ *
+ * \param packet Packet, starting with the ethernet header
+ * \param caplen Number of captured bytes of \p packet
+ * \param desc The packet, as decode_packet() found it
+ * \return 64 bit fingerprint
+ */
+uint64_t pkt_dedup_fingerprint (const unsigned char *packet, unsigned int caplen,
+                                const pkt_desc_t *desc) {
+    const unsigned char *ip = packet + desc->l3_offset;
+    uint64_t h = pkt_dedup_mix(desc->hash, ((uint64_t)desc->ip_len << 8) | desc->key.prot);
+    unsigned char l4[PKT_DEDUP_L4_BYTES];
+    unsigned int n = 0;
+    uint64_t w;
+    unsigned int i;
+
+    if (desc->ip_version == 4) {
+        /* id, flags and fragment offset */
+        h = pkt_dedup_mix(h, ((uint64_t)ip[4] << 24) | ((uint64_t)ip[5] << 16) |
+                             ((uint64_t)ip[6] << 8) | ip[7]);
+    } else {
+        /* flow label */
+        h = pkt_dedup_mix(h, ((uint64_t)(ip[1] & 0x0f) << 16) | ((uint64_t)ip[2] << 8) | ip[3]);
+    }
+
+    if (caplen > desc->l4_offset) {
+        n = caplen - desc->l4_offset;
+        if (n > desc->ip_len - (desc->l4_offset - desc->l3_offset)) {
+            n = desc->ip_len - (desc->l4_offset - desc->l3_offset);
+        }
+        if (n > PKT_DEDUP_L4_BYTES) {
+            n = PKT_DEDUP_L4_BYTES;
+        }
+    }
+    memset_s(l4, sizeof(l4), 0x00, sizeof(l4));
+    memcpy_s(l4, sizeof(l4), packet + desc->l4_offset, n);
+    for (i = 0; i + 8 <= PKT_DEDUP_L4_BYTES; i += 8) {
+        memcpy_s(&w, sizeof(w), l4 + i, sizeof(w));
+        h = pkt_dedup_mix(h, w);
+    }
+    w = 0;
+    memcpy_s(&w, sizeof(w), l4 + i, PKT_DEDUP_L4_BYTES - i);
+
+    return pkt_dedup_mix(h, w);
+}
+
+/**
+ * \brief Look a packet up in the set, and remember it.
+ *
+ * \param d Fingerprint set
+ * \param fp Fingerprint of the packet, from pkt_dedup_fingerprint()
+ * \param ts Arrival time of the packet
+ * \return 1 if a packet with the same fingerprint arrived less than the
+ *         window before \p ts, 0 otherwise
+ */
+int pkt_dedup_check (pkt_dedup_t *d, uint64_t fp, const struct timeval *ts) {
+    pkt_dedup_entry_t *bucket = d->entries + (size_t)((fp >> 32) & (PKT_DEDUP_BUCKETS - 1)) * PKT_DEDUP_WAYS;
+    uint32_t tag = (uint32_t)fp ? (uint32_t)fp : 1;
+    uint32_t now = (uint32_t)((uint64_t)ts->tv_sec * 1000000 + (uint64_t)ts->tv_usec);
+    uint32_t age, oldest_age = 0;
+    unsigned int i, victim = 0;
+
+    for (i = 0; i < PKT_DEDUP_WAYS; i++) {
+        if (bucket[i].tag == 0) {
+            victim = i;
+            oldest_age = UINT32_MAX;
+            continue;
+        }
+        age = now - bucket[i].time;
+        if (bucket[i].tag == tag) {
+            if (age <= d->window) {
+                return 1;
+            }
+            /* the same packet again, but too late to be a copy */
+            victim = i;
+            break;
+        }
+        if (age >= oldest_age) {
+            oldest_age = age;
+            victim = i;
+        }
+    }
+
+    bucket[victim].tag = tag;
+    bucket[victim].time = now;
+
+    return 0;
+}
+
+/**
+ * \brief Unit test for the fingerprint set.
+ * \param none
+ * \return Number of failures
+ */
+int pkt_dedup_unit_test (void) {
+    static const unsigned char pkt[] = {
+        0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x08, 0x00,
+        0x45, 0x00, 0x00, 0x28, 0x12, 0x34, 0x40, 0x00, 0x40, 0x06, 0x00, 0x00,
+        0x0a, 0x00, 0x00, 0x01, 0x0a, 0x00, 0x00, 0x02,
+        0x04, 0xd2, 0x00, 0x50, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00,
+        0x50, 0x02, 0x20, 0x00, 0x00, 0x00, 0x00, 0x00
+    };
+    unsigned char copy[sizeof(pkt)];
+    pkt_desc_t desc, copy_desc;
+    struct timeval ts = { 1500000000, 0 };
+    pkt_dedup_t d;
+    uint64_t fp;
+    unsigned int i;
+    int num_fails = 0;
+
+    fprintf(info, "\n******************************\n");
+    fprintf(info, "Packet dedup Unit Test starting...\n");
+
+    if (pkt_dedup_init(&d, 1000) != ok) {
+        joy_log_err("could not allocate the fingerprint set");
+        fprintf(info, "Finished - failures: 1\n");
+        fprintf(info, "******************************\n\n");
+        return 1;
+    }
+    if (((uintptr_t)d.entries & (PKT_DEDUP_ALIGN - 1)) != 0) {
+        joy_log_err("buckets are not aligned on cache lines");
+        num_fails++;
+    }
+
+    decode_packet(pkt, sizeof(pkt), &desc);
+    fp = pkt_dedup_fingerprint(pkt, sizeof(pkt), &desc);
+    if (pkt_dedup_check(&d, fp, &ts) != 0) {
+        joy_log_err("first packet taken for a duplicate");
+        num_fails++;
+    }
+
+    /* a copy with a lower TTL (and so another checksum) is still a copy */
+    memcpy_s(copy, sizeof(copy), pkt, sizeof(pkt));
+    copy[22] = 0x3f;
+    copy[24] = 0xff;
+    decode_packet(copy, sizeof(copy), &copy_desc);
+    ts.tv_usec = 500;
+    if (pkt_dedup_fingerprint(copy, sizeof(copy), &copy_desc) != fp ||
+        pkt_dedup_check(&d, fp, &ts) != 1) {
+        joy_log_err("copy of a packet not taken for a duplicate");
+        num_fails++;
+    }
+
+    /* another IP id, or another sequence number, is another packet */
+    copy[19] = 0x35;
+    decode_packet(copy, sizeof(copy), &copy_desc);
+    if (pkt_dedup_fingerprint(copy, sizeof(copy), &copy_desc) == fp) {
+        joy_log_err("packets with different IP ids have the same fingerprint");
+        num_fails++;
+    }
+    copy[19] = 0x34;
+    copy[41] = 0x02;
+    decode_packet(copy, sizeof(copy), &copy_desc);
+    if (pkt_dedup_fingerprint(copy, sizeof(copy), &copy_desc) == fp) {
+        joy_log_err("packets with different sequence numbers have the same fingerprint");
+        num_fails++;
+    }
+
+    /* outside of the window, it is a new packet again */
+    ts.tv_usec = 2000;
+    if (pkt_dedup_check(&d, fp, &ts) != 0) {
+        joy_log_err("packet outside of the window taken for a duplicate");
+        num_fails++;
+    }
+
+    /* a full bucket makes room, and keeps the newest fingerprints */
+    for (i = 0; i < 2 * PKT_DEDUP_WAYS; i++) {
+        ts.tv_usec = 2001 + i;
+        pkt_dedup_check(&d, (fp & ~(uint64_t)0xffffffff) | (i + 1), &ts);
+    }
+    if (pkt_dedup_check(&d, (fp & ~(uint64_t)0xffffffff) | (2 * PKT_DEDUP_WAYS), &ts) != 1 ||
+        pkt_dedup_check(&d, (fp & ~(uint64_t)0xffffffff) | 1, &ts) != 0) {
+        joy_log_err("full bucket did not keep the newest fingerprints");
+        num_fails++;
+    }
+
+    pkt_dedup_destroy(&d);
+
+    if (num_fails) {
+        fprintf(info, "Finished - failures: %d\n", num_fails);
+    } else {
+        fprintf(info, "Finished - success\n");
+    }
+    fprintf(info, "******************************\n\n");
+
+    return num_fails;
+}
@@ -65,16 +65,56 @@ static u_short num_templates = 0;
 
 pthread_mutex_t nfv9_lock = PTHREAD_MUTEX_INITIALIZER;
 
+/*
+ * Packet pipelines
+ *
+ * process_decoded_packet_pipe() and the functions that it calls take a
+ * mask, pipe, of the PKT_PIPE_* options that may be on.  An option that
+ * is not in the mask is known to be off, so the compiler drops its
+ * configuration test and its code.  define_pkt_pipeline() instantiates
+ * the pipeline for one mask, and pkt_proc_set_pipeline() picks, once,
+ * the instantiation with the fewest options that still covers the
+ * configuration; the generic one has every option, and covers any.
+ */
+#define PKT_PIPE_LOG      0x01  /* verbosity of info or debug            */
+#define PKT_PIPE_ZEROES   0x02  /* include_zeroes                        */
+#define PKT_PIPE_RETRANS  0x04  /* include_retrans                       */
+#define PKT_PIPE_STATS    0x08  /* byte distributions, entropy or wht    */
+#define PKT_PIPE_IDP      0x10  /* idp                                   */
+#define PKT_PIPE_HD       0x20  /* report_hd                             */
+#define PKT_PIPE_COLLECT  0x40  /* netflow v9 or ipfix collection        */
+#define PKT_PIPE_GENERIC  0x7f
+
+/** the options of the full pipeline: all but logging and flow collection */
+#define PKT_PIPE_FULL (PKT_PIPE_ZEROES | PKT_PIPE_RETRANS | PKT_PIPE_STATS | PKT_PIPE_IDP | PKT_PIPE_HD)
+
+/** true if option opt may be on in pipe, and expr says it is */
+#define pkt_pipe_on(pipe, opt, expr) (((pipe) & (opt)) && (expr))
+
+/** joy_log_info() and joy_log_debug(), if pipe may log them */
+#define pkt_log_info(pipe, ...) do { if ((pipe) & PKT_PIPE_LOG) joy_log_info(__VA_ARGS__) } while (0)
+#define pkt_log_debug(pipe, ...) do { if ((pipe) & PKT_PIPE_LOG) joy_log_debug(__VA_ARGS__) } while (0)
+
+#if defined(__GNUC__)
+#define PKT_PIPE_INLINE static inline __attribute__((always_inline))
+#elif defined(_MSC_VER)
+#define PKT_PIPE_INLINE static __forceinline
+#else
+#define PKT_PIPE_INLINE static inline
+#endif
+
 /*
  * re-implement this function to handle SPLT properly by itself. SALT
  * is handled by the function feature update function in the feature module.
  * The original function is conditionally compiled out and still exists
  * in its entirty below this implementation.
  */
-static void flow_record_process_packet_length_and_time_ack (flow_record_t *record,
-                                                            unsigned int length,
-                                                            const struct timeval *time,
-                                                            const struct tcp_hdr *tcp) {
+PKT_PIPE_INLINE void flow_record_process_packet_length_and_time_ack (joy_ctx_data *ctx,
+                                                                     flow_record_t *record,
+                                                                     unsigned int length,
+                                                                     const struct timeval *time,
+                                                                     const struct tcp_hdr *tcp,
+                                                                     unsigned int pipe) {
 
     /* make sure we have room in the array */
     if (record->op >= (MAX_NUM_PKT_LEN-1)) {
@@ -85,17 +125,24 @@ static void flow_record_process_packet_length_and_time_ack (flow_record_t *recor
      * let's figure out the SPLT values
      * This is the "raw" case from the original function below
      */
-    if (glb_config->include_zeroes || (length != 0)) {
-        record->pkt_len[record->op] = length;
-        record->pkt_time[record->op] = *time;
+    if (pkt_pipe_on(pipe, PKT_PIPE_ZEROES, glb_config->include_zeroes) || (length != 0)) {
+        if (flow_record_reserve_pkt(ctx, record)) {
+            record->pkt_len[record->op] = length;
+            record->pkt_time[record->op] = joy_time_delta(&record->pkt_time_base, time);
+        }
         record->op++;
     }
 
-    record->pkt_flags[record->op] = tcp->tcp_flags;
+    if (record->op < record->pkt_cap) {
+        record->pkt_flags[record->op] = tcp->tcp_flags;
+    }
     record->tcp.seq = ntohl(tcp->tcp_seq);
     record->tcp.ack = ntohl(tcp->tcp_ack);
 
     /* store the sequence number and length into the retransmission buffer */
+    if (flow_record_tcp_retrans(ctx, record) == NULL) {
+        return;
+    }
     record->tcp_retrans[record->tcp_retrans_tail].seq = ntohl(tcp->tcp_seq);
     record->tcp_retrans[record->tcp_retrans_tail].len = length;
     record->tcp_retrans_tail++;
@@ -391,9 +438,9 @@ static joy_status_e process_nfv9 (joy_ctx_data *ctx,
                               // fill out record
                               if ((memcmp_s(&key, sizeof(flow_key_t), &prev_key, sizeof(flow_key_t), &cmp_ind) == EOK) 
                                   && (cmp_ind != 0)) {
-                                  nfv9_process_flow_record(nf_record, cur_template, flow_data, 0);
+                                  nfv9_process_flow_record(ctx, nf_record, cur_template, flow_data, 0);
                               } else {
-                                  nfv9_process_flow_record(nf_record, cur_template, flow_data, 1);
+                                  nfv9_process_flow_record(ctx, nf_record, cur_template, flow_data, 1);
                               }
                               memcpy_s(&prev_key,sizeof(flow_key_t), &key, sizeof(flow_key_t));
 
@@ -415,6 +462,59 @@ static joy_status_e process_nfv9 (joy_ctx_data *ctx,
     return ok;
 }
 
+/**
+ * \fn int flow_record_is_saturated (const flow_record_t *record)
+ * \brief check whether another packet could change anything in a flow
+ *        record other than its counters
+ * \param record flow record
+ * \return 1 - only the counters can change, 0 - otherwise
+ */
+static int flow_record_is_saturated (const flow_record_t *record) {
+    unsigned int is_tcp = (record->key.prot == IPPROTO_TCP);
+
+    /* the SPLT ready count, and the SPLT export of joy_api, look at op */
+    if (record->op < ETTA_MIN_PACKETS) {
+        return 0;
+    }
+
+    /*
+     * packet lengths and times: done once num_pkts of them are stored,
+     * once the arrays could not be grown, or once op stops counting
+     */
+    if (flow_record_num_pkts(record) < glb_config->num_pkts &&
+        record->op <= record->pkt_cap &&
+        record->op < (is_tcp ? MAX_NUM_PKT_LEN-1 : MAX_NUM_PKT_LEN)) {
+        return 0;
+    }
+
+    /* the byte distributions and entropy look at every byte */
+    if (glb_config->byte_distribution || glb_config->compact_byte_distribution ||
+        glb_config->report_entropy) {
+        return 0;
+    }
+
+    /* netflow and ipfix collection parse every packet */
+    if (glb_config->nfv9_capture_port || glb_config->ipfix_collect_port) {
+        return 0;
+    }
+
+    if (!record->key.ipv6 && record->ip.num_id < MAX_NUM_IP_ID) {
+        return 0;
+    }
+    if (glb_config->idp && record->idp_len == 0) {
+        return 0;
+    }
+    if (is_tcp && glb_config->report_hd &&
+        (record->hd == NULL || !header_description_done(record->hd))) {
+        return 0;
+    }
+
+    if (!all_features_done(payload_feature_list)) {
+        return 0;
+    }
+    return !is_tcp || all_features_done(tcp_feature_list);
+}
+
 /*
  * Function: retrans_detected
  *
@@ -431,10 +531,14 @@ static joy_status_e process_nfv9 (joy_ctx_data *ctx,
  *         1 - retransmission with same data detected
  *         2 - retransmission with new data detected
  */
-static int retrans_detected (flow_record_t *rec, uint32_t seq_num, uint16_t len) {
+static int retrans_detected (joy_ctx_data *ctx, flow_record_t *rec, uint32_t seq_num, uint16_t len) {
     int i;
     int rc = 0;
 
+    if (flow_record_tcp_retrans(ctx, rec) == NULL) {
+        return rc;
+    }
+
     /* look for the sequence number in the stored array */
     for (i=0; i < MAX_TCP_RETRANS_BUFFER; ++i) {
         if (rec->tcp_retrans[i].seq == seq_num) {
@@ -456,15 +560,15 @@ static int retrans_detected (flow_record_t *rec, uint32_t seq_num, uint16_t len)
     return rc;
 }
 
-static flow_record_t *
-process_tcp (joy_ctx_data *ctx, const struct pcap_pkthdr *header, const char *tcp_start, int tcp_len, flow_key_t *key) {
+PKT_PIPE_INLINE flow_record_t *
+process_tcp (joy_ctx_data *ctx, const struct pcap_pkthdr *header, const char *tcp_start, int tcp_len, flow_key_t *key, unsigned int pipe) {
     int tcp_hdr_len;
     const char *payload;
     unsigned int size_payload;
     const struct tcp_hdr *tcp = (const struct tcp_hdr *)tcp_start;
     flow_record_t *record = NULL;
 
-    joy_log_info("Protocol: TCP");
+    pkt_log_info(pipe, "Protocol: TCP");
 
     tcp_hdr_len = tcp_hdr_length(tcp);
     if (tcp_hdr_len < 20 || tcp_hdr_len > tcp_len) {
@@ -478,44 +582,51 @@ process_tcp (joy_ctx_data *ctx, const struct pcap_pkthdr *header, const char *tc
     /* compute tcp payload (segment) size */
     size_payload = tcp_len - tcp_hdr_len;
 
-    joy_log_info("Src port: %d\nDst port: %d\nPayload len: %u\n", ntohs(tcp->src_port),ntohs(tcp->dst_port),size_payload);
-    joy_log_debug("TCP len: %u\nTCP hdr len: %u\nflags (0x%x):", tcp_len,tcp_hdr_len,tcp->tcp_flags);
-    if (tcp->tcp_flags & TCP_FIN) { joy_log_debug("* FIN"); }
-    if (tcp->tcp_flags & TCP_SYN) { joy_log_debug("* SYN"); }
-    if (tcp->tcp_flags & TCP_RST) { joy_log_debug("* RST"); }
-    if (tcp->tcp_flags & TCP_PSH) { joy_log_debug("* PSH"); }
-    if (tcp->tcp_flags & TCP_ACK) { joy_log_debug("* ACK"); }
-    if (tcp->tcp_flags & TCP_URG) { joy_log_debug("* URG"); }
-    if (tcp->tcp_flags & TCP_ECE) { joy_log_debug("* ECE"); }
-    if (tcp->tcp_flags & TCP_CWR) { joy_log_debug("* CWR"); }
+    pkt_log_info(pipe, "Src port: %d\nDst port: %d\nPayload len: %u\n", ntohs(tcp->src_port),ntohs(tcp->dst_port),size_payload);
+    pkt_log_debug(pipe, "TCP len: %u\nTCP hdr len: %u\nflags (0x%x):", tcp_len,tcp_hdr_len,tcp->tcp_flags);
+    if (tcp->tcp_flags & TCP_FIN) { pkt_log_debug(pipe, "* FIN"); }
+    if (tcp->tcp_flags & TCP_SYN) { pkt_log_debug(pipe, "* SYN"); }
+    if (tcp->tcp_flags & TCP_RST) { pkt_log_debug(pipe, "* RST"); }
+    if (tcp->tcp_flags & TCP_PSH) { pkt_log_debug(pipe, "* PSH"); }
+    if (tcp->tcp_flags & TCP_ACK) { pkt_log_debug(pipe, "* ACK"); }
+    if (tcp->tcp_flags & TCP_URG) { pkt_log_debug(pipe, "* URG"); }
+    if (tcp->tcp_flags & TCP_ECE) { pkt_log_debug(pipe, "* ECE"); }
+    if (tcp->tcp_flags & TCP_CWR) { pkt_log_debug(pipe, "* CWR"); }
 
     key->sp = ntohs(tcp->src_port);
     key->dp = ntohs(tcp->dst_port);
 
     record = flow_key_get_record(ctx, key, CREATE_RECORDS, header);
     if (record == NULL) {
-        joy_log_err("Couldn't allocate a new record structure!");
+        /* refused by admission control, or out of memory; both are counted in the stats */
         return NULL;
     }
 
-    joy_log_debug("SEQ: %d -- relative SEQ: %d", ntohl(tcp->tcp_seq), ntohl(tcp->tcp_seq) - record->tcp.seq);
-    joy_log_debug("ACK: %d -- relative ACK: %d", ntohl(tcp->tcp_ack), ntohl(tcp->tcp_ack) - record->tcp.ack);
+    pkt_log_debug(pipe, "SEQ: %d -- relative SEQ: %d", ntohl(tcp->tcp_seq), ntohl(tcp->tcp_seq) - record->tcp.seq);
+    pkt_log_debug(pipe, "ACK: %d -- relative ACK: %d", ntohl(tcp->tcp_ack), ntohl(tcp->tcp_ack) - record->tcp.ack);
 
     /* see if this is a retransmission */
     if (size_payload > 0) {
         uint32_t curr_seq = ntohl(tcp->tcp_seq);
-        record->is_tcp_retrans = retrans_detected(record, curr_seq, (uint16_t)size_payload);
+        record->is_tcp_retrans = retrans_detected(ctx, record, curr_seq, (uint16_t)size_payload);
         if (record->is_tcp_retrans != 0) {
             record->tcp.retrans++;
-            if (!glb_config->include_retrans) {
+            if (!pkt_pipe_on(pipe, PKT_PIPE_RETRANS, glb_config->include_retrans)) {
                 // do not process TCP retransmissions
                 return NULL;
             }
         }
     }
 
-    if (glb_config->include_zeroes || size_payload > 0) {
-          flow_record_process_packet_length_and_time_ack(record, size_payload, &header->ts, tcp);
+    /* a saturated flow only counts its bytes, unless this is a SYN */
+    if (record->saturated && !(tcp->tcp_flags & TCP_SYN)) {
+        record->ob += size_payload;
+        flocap_stats_incr_fast_path_packets(ctx);
+        return record;
+    }
+
+    if (pkt_pipe_on(pipe, PKT_PIPE_ZEROES, glb_config->include_zeroes) || size_payload > 0) {
+          flow_record_process_packet_length_and_time_ack(ctx, record, size_payload, &header->ts, tcp, pipe);
     }
 
     if (tcp->tcp_flags == 2 || tcp->tcp_flags == 18) { // SYN==2, SYN/ACK==18
@@ -550,9 +661,9 @@ process_tcp (joy_ctx_data *ctx, const struct pcap_pkthdr *header, const char *tc
 
     record->ob += size_payload;
 
-    flow_record_update_byte_count(record, payload, size_payload);
-    flow_record_update_compact_byte_count(record, payload, size_payload);
-    flow_record_update_byte_dist_mean_var(record, payload, size_payload);
+    if (pipe & PKT_PIPE_STATS) {
+        flow_record_update_payload_stats(ctx, record, payload, size_payload);
+    }
 
     /*
      * Estimate the TCP application protocol
@@ -563,19 +674,24 @@ process_tcp (joy_ctx_data *ctx, const struct pcap_pkthdr *header, const char *tc
         if (pi != NULL) {
             record->app = pi->app;
             record->dir = pi->dir;
+            record->features = feature_mask(feature_list);
         }
     }
 
     /*
      * Run protocol modules!
      */
-    update_all_features(payload_feature_list);
+    update_all_features(parsed_feature_list);
 
     /*
      * update header description
      */
-    if (size_payload >= glb_config->report_hd) {
-        header_description_update(&record->hd, payload, glb_config->report_hd);
+    if (pkt_pipe_on(pipe, PKT_PIPE_HD, glb_config->report_hd) && size_payload >= glb_config->report_hd) {
+        header_description_t *hd = flow_record_header_description(ctx, record);
+
+        if (hd != NULL) {
+            header_description_update(hd, payload, glb_config->report_hd);
+        }
     }
 
     /* look for IDP packet potential before retrans detection for OOO packets */
@@ -599,15 +715,15 @@ process_tcp (joy_ctx_data *ctx, const struct pcap_pkthdr *header, const char *tc
     return record;
 }
 
-static flow_record_t *
-process_udp (joy_ctx_data *ctx, const struct pcap_pkthdr *header, const char *udp_start, int udp_len, flow_key_t *key) {
+PKT_PIPE_INLINE flow_record_t *
+process_udp (joy_ctx_data *ctx, const struct pcap_pkthdr *header, const char *udp_start, int udp_len, flow_key_t *key, unsigned int pipe) {
     uint8_t udp_hdr_len;
     const char *payload;
     unsigned int size_payload;
     const struct udp_hdr *udp = (const struct udp_hdr *)udp_start;
     flow_record_t *record = NULL;
 
-    joy_log_info("Protocol: UDP");
+    pkt_log_info(pipe, "Protocol: UDP");
 
     udp_hdr_len = 8;
     if (udp_len < 8) {
@@ -618,28 +734,35 @@ process_udp (joy_ctx_data *ctx, const struct pcap_pkthdr *header, const char *ud
     payload = (const char *)(udp_start + udp_hdr_len);
     size_payload = udp_len - udp_hdr_len;
 
-    joy_log_info("Src port: %d\nDst port: %d\nPayload len: %d", ntohs(udp->src_port),ntohs(udp->dst_port),size_payload);
+    pkt_log_info(pipe, "Src port: %d\nDst port: %d\nPayload len: %d", ntohs(udp->src_port),ntohs(udp->dst_port),size_payload);
 
     key->sp = ntohs(udp->src_port);
     key->dp = ntohs(udp->dst_port);
 
     record = flow_key_get_record(ctx, key, CREATE_RECORDS, header);
     if (record == NULL) {
-        joy_log_err("Couldn't allocate a new record structure!");
+        /* refused by admission control, or out of memory; both are counted in the stats */
         return NULL;
     }
+    if (record->saturated) {
+        record->ob += size_payload;
+        flocap_stats_incr_fast_path_packets(ctx);
+        return record;
+    }
     if (record->op < MAX_NUM_PKT_LEN) {
-        if (glb_config->include_zeroes || (size_payload != 0)) {
-            record->pkt_len[record->op] = size_payload;
-            record->pkt_time[record->op] = header->ts;
+        if (pkt_pipe_on(pipe, PKT_PIPE_ZEROES, glb_config->include_zeroes) || (size_payload != 0)) {
+            if (flow_record_reserve_pkt(ctx, record)) {
+                record->pkt_len[record->op] = size_payload;
+                record->pkt_time[record->op] = joy_time_delta(&record->pkt_time_base, &header->ts);
+            }
             record->op++;
         }
     }
     record->ob += size_payload;
 
-    flow_record_update_byte_count(record, payload, size_payload);
-    flow_record_update_compact_byte_count(record, payload, size_payload);
-    flow_record_update_byte_dist_mean_var(record, payload, size_payload);
+    if (pipe & PKT_PIPE_STATS) {
+        flow_record_update_payload_stats(ctx, record, payload, size_payload);
+    }
 
     /*
      * Estimate the UDP application protocol
@@ -650,36 +773,39 @@ process_udp (joy_ctx_data *ctx, const struct pcap_pkthdr *header, const char *ud
         if (pi != NULL) {
             record->app = pi->app;
             record->dir = pi->dir;
+            record->features = feature_mask(feature_list);
         }
     }
 
     /*
      * Run protocol modules!
      */
-    update_all_features(payload_feature_list);
+    update_all_features(parsed_feature_list);
 
-    if ((glb_config->nfv9_capture_port > 0) && (key->dp == glb_config->nfv9_capture_port)) {
+    if (pkt_pipe_on(pipe, PKT_PIPE_COLLECT, glb_config->nfv9_capture_port > 0) &&
+        (key->dp == glb_config->nfv9_capture_port)) {
         pthread_mutex_lock(&nfv9_lock);
         process_nfv9(ctx, payload, size_payload, record);
         pthread_mutex_unlock(&nfv9_lock);
     }
 
-    if ((glb_config->ipfix_collect_port > 0) && (key->dp == glb_config->ipfix_collect_port)) {
+    if (pkt_pipe_on(pipe, PKT_PIPE_COLLECT, glb_config->ipfix_collect_port > 0) &&
+        (key->dp == glb_config->ipfix_collect_port)) {
       process_ipfix(ctx, payload, size_payload, record);
     }
 
     return record;
 }
 
-static flow_record_t *
-process_icmp (joy_ctx_data *ctx, const struct pcap_pkthdr *header, const char *start, int len, flow_key_t *key) {
+PKT_PIPE_INLINE flow_record_t *
+process_icmp (joy_ctx_data *ctx, const struct pcap_pkthdr *header, const char *start, int len, flow_key_t *key, unsigned int pipe) {
     uint8_t size_icmp_hdr;
     const char *payload;
     int size_payload;
     const struct icmp_hdr *icmp = (const struct icmp_hdr *)start;
     flow_record_t *record = NULL;
 
-    joy_log_info("Protocol: ICMP");
+    pkt_log_info(pipe, "Protocol: ICMP");
 
     size_icmp_hdr = 8;
     if (len < size_icmp_hdr) {
@@ -687,7 +813,7 @@ process_icmp (joy_ctx_data *ctx, const struct pcap_pkthdr *header, const char *s
         return NULL;
     }
 
-    joy_log_info("Type: %d\nCode: %d", icmp->type, icmp->code);
+    pkt_log_info(pipe, "Type: %d\nCode: %d", icmp->type, icmp->code);
 
     payload = (const char *)(start + size_icmp_hdr);
     size_payload = len - size_icmp_hdr;
@@ -702,137 +828,108 @@ process_icmp (joy_ctx_data *ctx, const struct pcap_pkthdr *header, const char *s
 
     record = flow_key_get_record(ctx, key, CREATE_RECORDS, header);
     if (record == NULL) {
-        joy_log_err("Couldn't allocate a new record structure!");
+        /* refused by admission control, or out of memory; both are counted in the stats */
         return NULL;
     }
+    if (record->saturated) {
+        record->ob += size_payload;
+        flocap_stats_incr_fast_path_packets(ctx);
+        return record;
+    }
     if (record->op < MAX_NUM_PKT_LEN) {
-        if (glb_config->include_zeroes || (size_payload != 0)) {
-            record->pkt_len[record->op] = size_payload;
-            record->pkt_time[record->op] = header->ts;
+        if (pkt_pipe_on(pipe, PKT_PIPE_ZEROES, glb_config->include_zeroes) || (size_payload != 0)) {
+            if (flow_record_reserve_pkt(ctx, record)) {
+                record->pkt_len[record->op] = size_payload;
+                record->pkt_time[record->op] = joy_time_delta(&record->pkt_time_base, &header->ts);
+            }
             record->op++;
         }
     }
     record->ob += size_payload;
 
-    flow_record_update_byte_count(record, payload, size_payload);
-    flow_record_update_compact_byte_count(record, payload, size_payload);
-    flow_record_update_byte_dist_mean_var(record, payload, size_payload);
-    update_all_features(payload_feature_list);
+    if (pipe & PKT_PIPE_STATS) {
+        flow_record_update_payload_stats(ctx, record, payload, size_payload);
+    }
+    update_all_features(parsed_feature_list);
 
     return record;
 }
 
-static flow_record_t *
-process_ip (joy_ctx_data *ctx, const struct pcap_pkthdr *header, const void *ip_start, int ip_len, flow_key_t *key) {
+PKT_PIPE_INLINE flow_record_t *
+process_ip (joy_ctx_data *ctx, const struct pcap_pkthdr *header, const void *ip_start, int ip_len, flow_key_t *key, unsigned int pipe) {
     const char *payload;
     int size_payload;
     flow_record_t *record = NULL;
 
-    joy_log_info("Protocol: IP");
+    pkt_log_info(pipe, "Protocol: IP");
 
     payload = (const char *)(ip_start);
     size_payload = ip_len;
 
     record = flow_key_get_record(ctx, key, CREATE_RECORDS, header);
     if (record == NULL) {
-        joy_log_err("Couldn't allocate a new record structure!");
+        /* refused by admission control, or out of memory; both are counted in the stats */
         return NULL;
     }
+    if (record->saturated) {
+        record->ob += size_payload;
+        flocap_stats_incr_fast_path_packets(ctx);
+        return record;
+    }
     if (record->op < MAX_NUM_PKT_LEN) {
-        if (glb_config->include_zeroes || (size_payload != 0)) {
-            record->pkt_len[record->op] = size_payload;
-            record->pkt_time[record->op] = header->ts;
+        if (pkt_pipe_on(pipe, PKT_PIPE_ZEROES, glb_config->include_zeroes) || (size_payload != 0)) {
+            if (flow_record_reserve_pkt(ctx, record)) {
+                record->pkt_len[record->op] = size_payload;
+                record->pkt_time[record->op] = joy_time_delta(&record->pkt_time_base, &header->ts);
+            }
             record->op++;
         }
     }
     record->ob += size_payload;
 
-    flow_record_update_byte_count(record, payload, size_payload);
-    flow_record_update_compact_byte_count(record, payload, size_payload);
-    flow_record_update_byte_dist_mean_var(record, payload, size_payload);
-    update_all_features(payload_feature_list);
+    if (pipe & PKT_PIPE_STATS) {
+        flow_record_update_payload_stats(ctx, record, payload, size_payload);
+    }
+    update_all_features(parsed_feature_list);
 
     return record;
 }
 
+/** most VLAN tags or MPLS labels that decode_packet() goes through */
+#define PKT_DECODE_MAX_TAGS 8
+
+/** most IPv6 extension headers that decode_packet() goes through */
+#define PKT_DECODE_MAX_EXT_HDRS 8
+
 /**
- * \fn int get_packet_5tuple_key (const unsigned char *packet,
-                               flow_key_t *key)
+ * \fn int decode_ipv4 (const unsigned char *packet,
+                        unsigned int caplen,
+                        pkt_desc_t *desc)
+ * \brief fill in the IPv4 part of a packet descriptor
  * \param packet pointer to the packet
- * \param key pointer to the key structure to be filled in
+ * \param caplen number of bytes captured
+ * \param desc descriptor, with l3_offset filled in
  * \return 0 - failed, 1 - success
  */
-uint8_t get_packet_5tuple_key (const unsigned char *packet, flow_key_t *key) {
-    uint8_t rc = 0;
-    uint16_t ether_type = 0;
-    uint16_t vlan_ether_type = 0;
-    uint16_t vlan2_ether_type = 0;
-    const struct ip_hdr *ip = NULL;
-    unsigned int ip_hdr_len = 0;
-    const void *transport_start = NULL;
-
-    /* clear the key structure */
-    memset_s(key, sizeof(flow_key_t), 0x00, sizeof(flow_key_t));
-
-    /* make sure we have a packet */
-    if (packet == NULL) {
-        joy_log_err(" NULL packet passed in");
-        return rc;
-    }
-
-    ether_type = ntohs(*(const uint16_t *)(packet + 12));//Offset to get ETH_TYPE
-
-    /* Support for both normal ethernet, 802.1q and 802.1ad. Distinguish between
-     * the three accepted types
-     */
-    switch(ether_type) {
-       case ETH_TYPE_IP:
-           joy_log_info("Ethernet type - IP");
-           ip = (const struct ip_hdr*)(packet + ETHERNET_HDR_LEN);
-           ip_hdr_len = ip_hdr_length(ip);
-           break;
-       case ETH_TYPE_DOT1Q:
-       case ETH_TYPE_QNQ:
-           joy_log_info("Ethernet type - 802.1q VLAN #1");
-           //Offset to get VLAN_TYPE
-           vlan_ether_type = ntohs(*(const uint16_t *)(packet + ETHERNET_HDR_LEN + 2));
-           switch(vlan_ether_type) {
-               case ETH_TYPE_IP:
-                   joy_log_info("Ethernet type - IP with VLAN #1");
-                   ip = (const struct ip_hdr*)(packet + ETHERNET_HDR_LEN + DOT1Q_HDR_LEN);
-                   ip_hdr_len = ip_hdr_length(ip);
-                   break;
-               case ETH_TYPE_DOT1Q:
-               case ETH_TYPE_QNQ:
-                   joy_log_info("Ethernet type - 802.1q VLAN #2");
-                    //Offset to get VLAN_TYPE
-                   vlan2_ether_type = ntohs(*(const uint16_t *)(packet + ETHERNET_HDR_LEN + DOT1Q_HDR_LEN + 2));
-                   switch(vlan2_ether_type) {
-                       case ETH_TYPE_IP:
-                           joy_log_info("Ethernet type - IP with 802.1q VLAN #2");
-                           ip = (const struct ip_hdr*)(packet + ETHERNET_HDR_LEN + DOT1Q_HDR_LEN + DOT1Q_HDR_LEN);
-                           ip_hdr_len = ip_hdr_length(ip);
-                           break;
-                       default :
-                           joy_log_info("Ethernet type - Unknown with 802.1q VLAN #2");
-                           return rc;
-                   }
-                   break;
-               default :
-                   joy_log_info("Ethernet type - Unknown with 802.1q VLAN #1");
-                   return rc;
-           }
-           break;
-       default:
-           return rc;
+static int decode_ipv4 (const unsigned char *packet, unsigned int caplen, pkt_desc_t *desc) {
+    const struct ip_hdr *ip = (const struct ip_hdr *)(packet + desc->l3_offset);
+    unsigned int ip_hdr_len;
+    unsigned int ip_len;
+
+    if (caplen - desc->l3_offset < sizeof(struct ip_hdr)) {
+        joy_log_err("Truncated IP header");
+        return 0;
     }
 
+    ip_hdr_len = ip_hdr_length(ip);
     if (ip_hdr_len < 20) {
         joy_log_err("Invalid IP header length: %u bytes", ip_hdr_len);
-        return rc;
+        return 0;
     }
 
-    if (ntohs(ip->ip_len) < sizeof(struct ip_hdr)) {
+    ip_len = ntohs(ip->ip_len);
+    if (ip_len < sizeof(struct ip_hdr) || ip_len < ip_hdr_len ||
+        ip_len > caplen - desc->l3_offset) {
         /*
          * IP packet is malformed (shorter than a complete IP header, or
          * claims to be longer than it is), or not entirely captured by
@@ -840,41 +937,275 @@ uint8_t get_packet_5tuple_key (const unsigned char *packet, flow_key_t *key) {
          * the latter if need be).
          */
         joy_log_err("Malformed IP packet");
-        return rc;
+        return 0;
     }
 
-    /* we are able to fill out the key structure */
-    rc = 1;
+    desc->key.sa = ip->ip_src;
+    desc->key.da = ip->ip_dst;
     if (ip_fragment_offset(ip) == 0) {
-        /* fill out IP-specific fields of flow key, plus proto selector */
-        key->sa = ip->ip_src;
-        key->da = ip->ip_dst;
-        key->prot = ip->ip_prot;
-
-    }  else {
+        desc->key.prot = ip->ip_prot;
+    } else {
         /*
          * select IP processing, since we don't have a TCP or UDP header
          */
-        key->sa = ip->ip_src;
-        key->da = ip->ip_dst;
-        key->prot = IPPROTO_IP;
-    }
-
-    transport_start = (const char *)ip + ip_hdr_len;
-    if (key->prot == IPPROTO_TCP) {
-        const struct tcp_hdr *tcp = (const struct tcp_hdr *)transport_start;
-        key->sp = ntohs(tcp->src_port);
-        key->dp = ntohs(tcp->dst_port);
-    } else if (key->prot == IPPROTO_UDP) {
-        const struct udp_hdr *udp = (const struct udp_hdr *)transport_start;
-        key->sp = ntohs(udp->src_port);
-        key->dp = ntohs(udp->dst_port);
-    } else {
-        key->sp = 0;
-        key->dp = 0;
+        desc->key.prot = IPPROTO_IP;
     }
+    desc->ip_len = ip_len;
+    desc->l4_offset = desc->l3_offset + ip_hdr_len;
+    desc->ip_version = 4;
 
-    return rc;
+    return 1;
+}
+
+/**
+ * \fn int decode_ipv6 (const unsigned char *packet,
+                        unsigned int caplen,
+                        pkt_desc_t *desc)
+ * \brief fill in the IPv6 part of a packet descriptor
+ *
+ * The extension headers are skipped, so that the key has the protocol
+ * of the transport header.  Like IPv4 ones, fragments other than the
+ * first get protocol 0.
+ *
+ * \param packet pointer to the packet
+ * \param caplen number of bytes captured
+ * \param desc descriptor, with l3_offset filled in
+ * \return 0 - failed, 1 - success
+ */
+static int decode_ipv6 (const unsigned char *packet, unsigned int caplen, pkt_desc_t *desc) {
+    const struct ipv6_hdr *ip = (const struct ipv6_hdr *)(packet + desc->l3_offset);
+    const unsigned char *ext;
+    unsigned int ip_len;
+    unsigned int off = IPV6_HDR_LEN;
+    unsigned int ext_len;
+    unsigned int i;
+    uint8_t next;
+
+    if (caplen - desc->l3_offset < IPV6_HDR_LEN) {
+        joy_log_err("Truncated IPv6 header");
+        return 0;
+    }
+
+    ip_len = IPV6_HDR_LEN + ntohs(ip->ipv6_plen);
+    if (ip_len > caplen - desc->l3_offset) {
+        /* not entirely captured, as with IPv4 */
+        joy_log_err("Malformed IPv6 packet");
+        return 0;
+    }
+
+    next = ip->ipv6_next;
+    for (i = 0; i < PKT_DECODE_MAX_EXT_HDRS; i++) {
+        if (next != IPPROTO_HOPOPTS && next != IPPROTO_ROUTING && next != IPPROTO_DSTOPTS &&
+            next != IPPROTO_AH && next != IPPROTO_FRAGMENT) {
+            break;
+        }
+        if (off + 8 > ip_len) {
+            joy_log_err("Malformed IPv6 extension header");
+            return 0;
+        }
+        ext = (const unsigned char *)ip + off;
+        if (next == IPPROTO_FRAGMENT) {
+            const struct ipv6_frag_hdr *frag = (const struct ipv6_frag_hdr *)ext;
+
+            off += sizeof(struct ipv6_frag_hdr);
+            if (ntohs(frag->frag_off) & IPV6_FOFF) {
+                next = IPPROTO_IP;
+                break;
+            }
+            next = frag->next;
+            continue;
+        }
+        ext_len = (next == IPPROTO_AH) ? (ext[1] + 2u) * 4 : (ext[1] + 1u) * 8;
+        next = ext[0];
+        off += ext_len;
+    }
+    if (off > ip_len) {
+        joy_log_err("Malformed IPv6 extension header");
+        return 0;
+    }
+
+    desc->key.sa6 = ip->ipv6_src;
+    desc->key.da6 = ip->ipv6_dst;
+    desc->key.ipv6 = 1;
+    desc->key.prot = next;
+    desc->ip_len = ip_len;
+    desc->l4_offset = desc->l3_offset + off;
+    desc->ip_version = 6;
+
+    return 1;
+}
+
+/**
+ * \fn uint32_t flow_key_symmetric_hash (const flow_key_t *key)
+ * \brief hash a flow key so that both directions of the flow get the same value
+ *
+ * With nat=1 the twin of a flow may have a different address, so only
+ * the ports and protocol are hashed then.
+ *
+ * \param key the flow key
+ * \return hash value
+ */
+static uint32_t flow_key_symmetric_hash (const flow_key_t *key) {
+    uint32_t h, p;
+
+    /* sums and xors do not depend on the direction of the packet */
+    p = (uint32_t)(key->sp + key->dp) | ((uint32_t)(key->sp ^ key->dp) << 16);
+    h = p ^ ((uint32_t)key->prot << 24);
+    if (glb_config->flow_key_match_method != NEAR_MATCH) {
+        if (key->ipv6) {
+            uint32_t sa[4], da[4];
+            unsigned int i;
+
+            memcpy_s(sa, sizeof(sa), &key->sa6, sizeof(sa));
+            memcpy_s(da, sizeof(da), &key->da6, sizeof(da));
+            for (i = 0; i < 4; i++) {
+                h = (h ^ ((sa[i] + da[i]) * 0x9e3779b1) ^ sa[i] ^ da[i]) * 0x85ebca6b;
+            }
+        } else {
+            h ^= (key->sa.s_addr + key->da.s_addr) * 0x9e3779b1;
+            h ^= key->sa.s_addr ^ key->da.s_addr;
+        }
+    }
+
+    /* final mix of murmur3, so that every bit of h counts */
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+
+    return h;
+}
+
+/**
+ * \fn int decode_packet (const unsigned char *packet,
+                          unsigned int caplen,
+                          pkt_desc_t *desc)
+ * \brief find the IP and transport headers of a packet, the key of
+        its flow and a hash of the key
+ *
+ * This is the only place where the link and network headers are
+ * parsed; the descriptor is handed on to process_decoded_packet().
+ * The ethernet header may be followed by a stack of 802.1q and 802.1ad
+ * tags, and then by an MPLS label stack, below which the version of
+ * the IP header says whether it is IPv4 or IPv6.
+ *
+ * \param packet pointer to the packet
+ * \param caplen number of bytes captured, or PKT_DECODE_NO_CAPLEN
+ * \param desc descriptor to fill in; its ip_version is 0 on failure
+ * \return 0 - the packet is not part of any flow, 1 - success
+ */
+int decode_packet (const unsigned char *packet, unsigned int caplen, pkt_desc_t *desc) {
+    unsigned int off = ETHERNET_HDR_LEN;
+    const unsigned char *transport;
+    uint16_t ether_type;
+    unsigned int i;
+    int rc;
+
+    memset_s(desc, sizeof(pkt_desc_t), 0x00, sizeof(pkt_desc_t));
+
+    /* make sure we have a packet */
+    if (packet == NULL) {
+        joy_log_err(" NULL packet passed in");
+        return 0;
+    }
+    if (caplen < ETHERNET_HDR_LEN) {
+        return 0;
+    }
+
+    ether_type = ntohs(*(const uint16_t *)(packet + 12));//Offset to get ETH_TYPE
+
+    /* 802.1q and 802.1ad tags, each with the type of what follows it */
+    for (i = 0; ether_type == ETH_TYPE_DOT1Q || ether_type == ETH_TYPE_QNQ ||
+                ether_type == ETH_TYPE_QINQ_OLD; i++) {
+        if (i == PKT_DECODE_MAX_TAGS || caplen - off < DOT1Q_HDR_LEN) {
+            return 0;
+        }
+        joy_log_info("Ethernet type - 802.1q VLAN #%u", i + 1);
+        ether_type = ntohs(*(const uint16_t *)(packet + off + 2));
+        off += DOT1Q_HDR_LEN;
+    }
+
+    /* MPLS labels do not say what is below them, but IP says what version it is */
+    if (ether_type == ETH_TYPE_MPLS || ether_type == ETH_TYPE_MPLS_MC) {
+        for (i = 0; ; i++) {
+            if (i == PKT_DECODE_MAX_TAGS || caplen - off < MPLS_HDR_LEN + 1) {
+                return 0;
+            }
+            off += MPLS_HDR_LEN;
+            if (mpls_bottom_of_stack(packet + off - MPLS_HDR_LEN)) {
+                break;
+            }
+        }
+        joy_log_info("Ethernet type - MPLS, %u labels", i + 1);
+        switch (packet[off] >> 4) {
+            case 4:
+                ether_type = ETH_TYPE_IP;
+                break;
+            case 6:
+                ether_type = ETH_TYPE_IPV6;
+                break;
+            default:
+                return 0;
+        }
+    }
+
+    desc->l3_offset = (uint16_t)off;
+    switch (ether_type) {
+        case ETH_TYPE_IP:
+            joy_log_info("Ethernet type - IP");
+            rc = decode_ipv4(packet, caplen, desc);
+            break;
+        case ETH_TYPE_IPV6:
+            joy_log_info("Ethernet type - IPv6");
+            rc = decode_ipv6(packet, caplen, desc);
+            break;
+        default:
+            rc = 0;
+            break;
+    }
+    if (rc == 0) {
+        desc->ip_version = 0;
+        return 0;
+    }
+
+    /* the ports may be beyond the end of a malformed IP packet, but not of the capture */
+    transport = packet + desc->l4_offset;
+    if ((desc->key.prot == IPPROTO_TCP || desc->key.prot == IPPROTO_UDP) &&
+        caplen - desc->l4_offset >= 4) {
+        /* TCP and UDP headers both start with the ports */
+        desc->key.sp = ntohs(((const struct udp_hdr *)transport)->src_port);
+        desc->key.dp = ntohs(((const struct udp_hdr *)transport)->dst_port);
+    }
+    desc->hash = flow_key_symmetric_hash(&desc->key);
+
+    return 1;
+}
+
+/**
+ * \fn int get_packet_shard (const pkt_desc_t *desc,
+                            unsigned int num_shards)
+ * \brief pick the shard (worker context) that processes a packet
+ *
+ * The hash of the 5-tuple is symmetric, so that both directions of a
+ * flow end up in the same shard and can be merged into a
+ * bidirectional record there.
+ *
+ * \param desc the packet, as decode_packet() found it
+ * \param num_shards number of shards
+ * \return shard number, below num_shards
+ * \return -1 if process_packet() would not put the packet in any flow
+ */
+int get_packet_shard (const pkt_desc_t *desc, unsigned int num_shards) {
+    if (desc->ip_version == 0) {
+        return -1;
+    }
+
+    if (num_shards <= 1) {
+        return 0;
+    }
+
+    return (int)(((uint64_t)desc->hash * num_shards) >> 32);
 }
 
 /**
@@ -889,20 +1220,43 @@ uint8_t get_packet_5tuple_key (const unsigned char *packet, flow_key_t *key) {
 void* process_packet (unsigned char *ctx_ptr,
                      const struct pcap_pkthdr *pkt_header,
                      const unsigned char *packet) {
+    pkt_desc_t desc;
+
+    decode_packet(packet, pkt_header ? pkt_header->caplen : PKT_DECODE_NO_CAPLEN, &desc);
+    return process_decoded_packet(ctx_ptr, pkt_header, packet, &desc);
+}
+
+/**
+ * \fn void* process_decoded_packet_pipe (unsigned char *ctx_ptr,
+                                          const struct pcap_pkthdr *pkt_header,
+                                          const unsigned char *packet,
+                                          const pkt_desc_t *desc,
+                                          unsigned int pipe)
+ * \param ctx_ptr currently used to store the context data pointer
+ * \param pkt_header pointer to the packer header structure
+ * \param packet pointer to the packet
+ * \param desc what decode_packet() found in the packet
+ * \param pipe PKT_PIPE_* options that may be on
+ * \return pointer to the flow record
+ */
+PKT_PIPE_INLINE void* process_decoded_packet_pipe (unsigned char *ctx_ptr,
+                                                   const struct pcap_pkthdr *pkt_header,
+                                                   const unsigned char *packet,
+                                                   const pkt_desc_t *desc,
+                                                   unsigned int pipe) {
     flow_record_t *record = NULL;
     bool allocated_packet_header = 0;
-    uint16_t ether_type = 0,vlan_ether_type = 0, vlan2_ether_type = 0;
-    char ipv4_addr[INET_ADDRSTRLEN];
+    char ip_addr[INET6_ADDRSTRLEN];
     const struct pcap_pkthdr *header =  pkt_header;
     struct pcap_pkthdr *dyn_header = NULL;
 
     /* declare pointers to packet headers */
-    const struct ip_hdr *ip = NULL;
+    const unsigned char *ip = NULL;
     unsigned int transport_len = 0;
-    unsigned int ip_hdr_len = 0;
     const void *transport_start = NULL;
     flow_key_t key;
-    uint16_t ip_len = 0;
+    unsigned int ip_len = 0;
+    unsigned long int refused;
 
     /* grab the context for this packet */
     joy_ctx_data *ctx = (joy_ctx_data*)ctx_ptr;
@@ -911,63 +1265,17 @@ void* process_packet (unsigned char *ctx_ptr,
         return NULL;
     }
 
-    memset_s(&key, sizeof(flow_key_t), 0x00, sizeof(flow_key_t));
-
     flocap_stats_incr_num_packets(ctx);
-    joy_log_info("++++++++++ Packet %lu ++++++++++", ctx->stats.num_packets);
-    //  packet_count++;
+    pkt_log_info(pipe, "++++++++++ Packet %lu ++++++++++", ctx->stats.num_packets);
 
-    // ethernet = (struct ethernet_hdr*)(packet);
-    ether_type = ntohs(*(const uint16_t *)(packet + 12));//Offset to get ETH_TYPE
-    /* Support for both normal ethernet, 802.1q and 802.1ad. Distinguish between 
-     * the three accepted types
-    */
-    switch(ether_type) {
-       case ETH_TYPE_IP:
-           joy_log_info("Ethernet type - IP");
-           ip = (const struct ip_hdr*)(packet + ETHERNET_HDR_LEN);
-           ip_hdr_len = ip_hdr_length(ip);
-           break;
-       case ETH_TYPE_DOT1Q:
-       case ETH_TYPE_QNQ:
-           joy_log_info("Ethernet type - 802.1q VLAN #1");
-           //Offset to get VLAN_TYPE
-           vlan_ether_type = ntohs(*(const uint16_t *)(packet + ETHERNET_HDR_LEN + 2));
-           switch(vlan_ether_type) {
-               case ETH_TYPE_IP:
-                   joy_log_info("Ethernet type - IP with VLAN #1");
-                   ip = (const struct ip_hdr*)(packet + ETHERNET_HDR_LEN + DOT1Q_HDR_LEN);
-                   ip_hdr_len = ip_hdr_length(ip);
-                   break;
-               case ETH_TYPE_DOT1Q:
-               case ETH_TYPE_QNQ:
-                   joy_log_info("Ethernet type - 802.1q VLAN #2");
-                    //Offset to get VLAN_TYPE
-                   vlan2_ether_type = ntohs(*(const uint16_t *)(packet + ETHERNET_HDR_LEN + DOT1Q_HDR_LEN + 2));
-                   switch(vlan2_ether_type) {
-                       case ETH_TYPE_IP:
-                           joy_log_info("Ethernet type - IP with 802.1q VLAN #2");
-                           ip = (const struct ip_hdr*)(packet + ETHERNET_HDR_LEN + DOT1Q_HDR_LEN + DOT1Q_HDR_LEN);
-                           ip_hdr_len = ip_hdr_length(ip);
-                           break;
-                       default :
-                           joy_log_info("Ethernet type - Unknown with 802.1q VLAN #2");
-                           return NULL;
-                   }
-                   break;
-               default :
-                   joy_log_info("Ethernet type - Unknown with 802.1q VLAN #1");
-                   return NULL;
-           }
-           break;
-       default:
-           return NULL;
-    }  
-    
-    if (ip_hdr_len < 20) {
-        joy_log_err(" Invalid IP header length: %u bytes", ip_hdr_len);
+    if (desc->ip_version == 0) {
+        /* not IP, or malformed */
         return NULL;
     }
+    ip = packet + desc->l3_offset;
+    ip_len = desc->ip_len;
+    transport_len = ip_len - (desc->l4_offset - desc->l3_offset);
+    key = desc->key;
 
     /* make sure we have a valid packet header */
     if (header == NULL) {
@@ -982,51 +1290,32 @@ void* process_packet (unsigned char *ctx_ptr,
         gettimeofday(&now,NULL);
         dyn_header->ts.tv_sec = now.tv_sec;
         dyn_header->ts.tv_usec = now.tv_usec;
-        dyn_header->caplen = ip->ip_len;
-        dyn_header->len = ip->ip_len;
+        dyn_header->caplen = desc->l3_offset + ip_len;
+        dyn_header->len = desc->l3_offset + ip_len;
         header = dyn_header;
     }
 
-    ip_len = ntohs(ip->ip_len);
-    if (ip_len < sizeof(struct ip_hdr) || ip_len > header->caplen) {
-        /*
-         * IP packet is malformed (shorter than a complete IP header, or
-         * claims to be longer than it is), or not entirely captured by
-         * libpcap (which will depend on MTU and SNAPLEN; you can change
-         * the latter if need be).
-         */
-        if (allocated_packet_header)
+    /* drop copies of a packet that was just seen, before any flow is looked up */
+    if (ctx->dedup.entries != NULL &&
+        pkt_dedup_check(&ctx->dedup, pkt_dedup_fingerprint(packet, header->caplen, desc), &header->ts)) {
+        flocap_stats_incr_duplicate_packets(ctx);
+        if (allocated_packet_header) {
             free(dyn_header);
+        }
         return NULL;
     }
-    transport_len =  ip_len - ip_hdr_len;
 
     /* print source and destination IP addresses */
-    if (glb_config->verbosity != JOY_LOG_OFF && glb_config->verbosity <= JOY_LOG_INFO) { \
-        inet_ntop(AF_INET, &ip->ip_src, ipv4_addr, INET_ADDRSTRLEN);
-        joy_log_info("Source IP: %s", ipv4_addr);
-        inet_ntop(AF_INET, &ip->ip_dst, ipv4_addr, INET_ADDRSTRLEN);
-        joy_log_info("Dest IP: %s", ipv4_addr);
+    if (pkt_pipe_on(pipe, PKT_PIPE_LOG,
+                    glb_config->verbosity != JOY_LOG_OFF && glb_config->verbosity <= JOY_LOG_INFO)) {
+        int af = key.ipv6 ? AF_INET6 : AF_INET;
+
+        inet_ntop(af, &key.sa6, ip_addr, INET6_ADDRSTRLEN);
+        joy_log_info("Source IP: %s", ip_addr);
+        inet_ntop(af, &key.da6, ip_addr, INET6_ADDRSTRLEN);
+        joy_log_info("Dest IP: %s", ip_addr);
         joy_log_info("Len: %u", ip_len);
-        joy_log_debug("IP header len: %u", ip_hdr_len);
-    }
-
-    if (ip_fragment_offset(ip) == 0) {
-
-        /* fill out IP-specific fields of flow key */
-        key.sa = ip->ip_src;
-        key.da = ip->ip_dst;
-        key.prot = ip->ip_prot;
-
-    }  else {
-        // fprintf(info, "found IP fragment (offset: %02x)\n", ip_fragment_offset(ip));
-
-        /*
-         * select IP processing, since we don't have a TCP or UDP header
-         */
-        key.sa = ip->ip_src;
-        key.da = ip->ip_dst;
-        key.prot = IPPROTO_IP;
+        joy_log_debug("IP header len: %u", desc->l4_offset - desc->l3_offset);
     }
 
     /*
@@ -1042,12 +1331,15 @@ void* process_packet (unsigned char *ctx_ptr,
 
     /* determine transport protocol and handle appropriately */
 
-    transport_start = (const char *)ip + ip_hdr_len;
+    refused = ctx->stats.refused_records;
+    transport_start = packet + desc->l4_offset;
     switch(key.prot) {
         case IPPROTO_TCP:
-            record = process_tcp(ctx, header, transport_start, transport_len, &key);
+            record = process_tcp(ctx, header, transport_start, transport_len, &key, pipe);
             if (record) {
-                update_all_tcp_features(tcp_feature_list);
+                if (!record->saturated) {
+                    update_all_tcp_features(tcp_feature_list);
+                }
             } else {
                 /*
                  * if record is NULL at this point, it is either a retransmission or
@@ -1089,14 +1381,15 @@ void* process_packet (unsigned char *ctx_ptr,
             }
             break;
         case IPPROTO_UDP:
-            record = process_udp(ctx, header, transport_start, transport_len, &key);
+            record = process_udp(ctx, header, transport_start, transport_len, &key, pipe);
             break;
         case IPPROTO_ICMP:
-            record = process_icmp(ctx, header, transport_start, transport_len, &key);
+        case IPPROTO_ICMPV6:
+            record = process_icmp(ctx, header, transport_start, transport_len, &key, pipe);
             break;
         case IPPROTO_IP:
         default:
-            record = process_ip(ctx, header, transport_start, transport_len, &key);
+            record = process_ip(ctx, header, transport_start, transport_len, &key, pipe);
             break;
     }
 
@@ -1105,8 +1398,15 @@ void* process_packet (unsigned char *ctx_ptr,
      * functions will return NULL; we deal with that case by treating it
      * as just an IP packet
      */
+    if (record == NULL && ctx->stats.refused_records != refused) {
+        /* the flow did not get a record; the packet itself is fine */
+        if (allocated_packet_header) {
+            free(dyn_header);
+        }
+        return NULL;
+    }
     if (record == NULL) {
-        record = process_ip(ctx, header, transport_start, transport_len, &key);
+        record = process_ip(ctx, header, transport_start, transport_len, &key, pipe);
         if (record == NULL) {
             joy_log_err("Unable to process ip packet (improper length or otherwise malformed)");
 	    if (allocated_packet_header) {
@@ -1117,19 +1417,27 @@ void* process_packet (unsigned char *ctx_ptr,
         record->invalid = 1;
     }
 
-    /*
-     * Get IP ID
-     */
-    if (record->ip.num_id < MAX_NUM_IP_ID) {
-        record->ip.id[record->ip.num_id] = ntohs(ip->ip_id);
-        record->ip.num_id++;
-    }
+    if (desc->ip_version == 4) {
+        const struct ip_hdr *ip4 = (const struct ip_hdr *)ip;
 
-    /*
-     * Set minimum ttl in flow record
-     */
-    if (record->ip.ttl > ip->ip_ttl) {
-        record->ip.ttl = ip->ip_ttl;
+        /*
+         * Get IP ID
+         */
+        flow_record_add_ip_id(ctx, record, ntohs(ip4->ip_id));
+
+        /*
+         * Set minimum ttl in flow record
+         */
+        if (record->ip.ttl > ip4->ip_ttl) {
+            record->ip.ttl = ip4->ip_ttl;
+        }
+    } else {
+        /* IPv6 has no ID outside of fragments, and calls the TTL the hop limit */
+        const struct ipv6_hdr *ip6 = (const struct ipv6_hdr *)ip;
+
+        if (record->ip.ttl > ip6->ipv6_hlim) {
+            record->ip.ttl = ip6->ipv6_hlim;
+        }
     }
 
     /* increment packet count in flow record */
@@ -1146,7 +1454,7 @@ void* process_packet (unsigned char *ctx_ptr,
      * copy initial data packet, if configured to report idp, and this
      * is the first packet in the flow with nonzero data payload
      */
-    if ((glb_config->idp) && record->op && (record->idp_len == 0)) {
+    if (pkt_pipe_on(pipe, PKT_PIPE_IDP, glb_config->idp) && record->op && (record->idp_len == 0)) {
         if (record->idp != NULL) {
             free(record->idp);
         }
@@ -1165,7 +1473,7 @@ void* process_packet (unsigned char *ctx_ptr,
             if (record->idp_packet == 1) {
                 memcpy_s(record->idp,  record->idp_len, ip, record->idp_len);
                 record->idp_packet = 0;
-                joy_log_debug("Stashed %u bytes of IDP", record->idp_len);
+                pkt_log_debug(pipe, "Stashed %u bytes of IDP", record->idp_len);
             } else {
                 /* not IDP packet, free up resources */
                 record->idp_len = 0;
@@ -1174,7 +1482,7 @@ void* process_packet (unsigned char *ctx_ptr,
             }
         } else {
             memcpy_s(record->idp, record->idp_len, ip, record->idp_len);
-            joy_log_debug("Stashed %u bytes of IDP", record->idp_len);
+            pkt_log_debug(pipe, "Stashed %u bytes of IDP", record->idp_len);
         }
     }
 
@@ -1184,12 +1492,144 @@ void* process_packet (unsigned char *ctx_ptr,
     /* set the feature ready flags for this flow record */
     flow_record_set_feature_ready_flags(ctx,record);
 
+    /* once nothing but the counters can change, take the fast path */
+    if (!record->saturated && flow_record_is_saturated(record)) {
+        record->saturated = 1;
+        flocap_stats_incr_saturated_records(ctx);
+    }
+
     /* if we allocated the packet header, then free it now */
     if (allocated_packet_header)
         free(dyn_header);
     return record;
 }
 
+/** define_pkt_pipeline(name, pipe) instantiates the pipeline for pipe */
+#define define_pkt_pipeline(name, pipe)                                           \
+static void* process_decoded_packet_##name (unsigned char *ctx_ptr,               \
+                                            const struct pcap_pkthdr *header,     \
+                                            const unsigned char *packet,          \
+                                            const pkt_desc_t *desc) {             \
+    return process_decoded_packet_pipe(ctx_ptr, header, packet, desc, (pipe));    \
+}
+
+/* counters, packet lengths and times, and the feature modules only */
+define_pkt_pipeline(basic, 0)
+
+/* the basic pipeline and the byte statistics */
+define_pkt_pipeline(stats, PKT_PIPE_STATS)
+
+/* everything but logging and flow collection */
+define_pkt_pipeline(full, PKT_PIPE_FULL)
+
+define_pkt_pipeline(generic, PKT_PIPE_GENERIC)
+
+typedef void* (*pkt_pipeline_func)(unsigned char *ctx_ptr, const struct pcap_pkthdr *header,
+                                   const unsigned char *packet, const pkt_desc_t *desc);
+
+/** the pipelines, in the order that pkt_proc_set_pipeline() tries them */
+static const struct pkt_pipeline {
+    pkt_pipeline_e id;
+    const char *name;
+    unsigned int pipe;
+    pkt_pipeline_func func;
+} pkt_pipelines[] = {
+    { PKT_PIPELINE_BASIC, "basic", 0, process_decoded_packet_basic },
+    { PKT_PIPELINE_STATS, "stats", PKT_PIPE_STATS, process_decoded_packet_stats },
+    { PKT_PIPELINE_FULL, "full", PKT_PIPE_FULL, process_decoded_packet_full },
+    { PKT_PIPELINE_GENERIC, "generic", PKT_PIPE_GENERIC, process_decoded_packet_generic }
+};
+
+#define NUM_PKT_PIPELINES (sizeof(pkt_pipelines) / sizeof(pkt_pipelines[0]))
+
+/** the pipeline in use; the generic one until pkt_proc_set_pipeline() */
+static const struct pkt_pipeline *pkt_pipeline = &pkt_pipelines[NUM_PKT_PIPELINES - 1];
+
+/**
+ * \fn unsigned int pkt_proc_config_pipe (void)
+ * \brief work out the PKT_PIPE_* options that the configuration has on
+ * \return mask of the options
+ */
+static unsigned int pkt_proc_config_pipe (void) {
+    unsigned int pipe = 0;
+
+    if (glb_config->verbosity != JOY_LOG_OFF && glb_config->verbosity <= JOY_LOG_INFO) {
+        pipe |= PKT_PIPE_LOG;
+    }
+    if (glb_config->include_zeroes) {
+        pipe |= PKT_PIPE_ZEROES;
+    }
+    if (glb_config->include_retrans) {
+        pipe |= PKT_PIPE_RETRANS;
+    }
+    if (glb_config->byte_distribution || glb_config->compact_byte_distribution ||
+        glb_config->report_entropy || glb_config->report_wht) {
+        pipe |= PKT_PIPE_STATS;
+    }
+    if (glb_config->idp) {
+        pipe |= PKT_PIPE_IDP;
+    }
+    if (glb_config->report_hd) {
+        pipe |= PKT_PIPE_HD;
+    }
+    if (glb_config->nfv9_capture_port || glb_config->ipfix_collect_port) {
+        pipe |= PKT_PIPE_COLLECT;
+    }
+    return pipe;
+}
+
+/**
+ * \fn int pkt_proc_set_pipeline (pkt_pipeline_e id)
+ * \brief pick the pipeline that process_decoded_packet() runs packets
+ *        through; the configuration must not change afterwards
+ * \param id pipeline, or PKT_PIPELINE_AUTO for the smallest one that
+ *        covers the configuration
+ * \return 0 - success, -1 - the pipeline does not cover the configuration
+ */
+int pkt_proc_set_pipeline (pkt_pipeline_e id) {
+    unsigned int pipe = pkt_proc_config_pipe();
+    unsigned int i;
+
+    for (i = 0; i < NUM_PKT_PIPELINES; i++) {
+        if (id != PKT_PIPELINE_AUTO && pkt_pipelines[i].id != id) {
+            continue;
+        }
+        if ((pipe & ~pkt_pipelines[i].pipe) == 0) {
+            pkt_pipeline = &pkt_pipelines[i];
+            joy_log_info("packet pipeline: %s", pkt_pipeline->name);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * \fn const char *pkt_proc_pipeline_name (void)
+ * \return name of the pipeline that process_decoded_packet() runs
+ */
+const char *pkt_proc_pipeline_name (void) {
+    return pkt_pipeline->name;
+}
+
+/**
+ * \fn void* process_decoded_packet (unsigned char *ctx_ptr,
+                                     const struct pcap_pkthdr *pkt_header,
+                                     const unsigned char *packet,
+                                     const pkt_desc_t *desc)
+ * \brief run a packet through the pipeline picked by pkt_proc_set_pipeline()
+ * \param ctx_ptr currently used to store the context data pointer
+ * \param pkt_header pointer to the packer header structure
+ * \param packet pointer to the packet
+ * \param desc what decode_packet() found in the packet
+ * \return pointer to the flow record
+ */
+void* process_decoded_packet (unsigned char *ctx_ptr,
+                              const struct pcap_pkthdr *pkt_header,
+                              const unsigned char *packet,
+                              const pkt_desc_t *desc) {
+    return pkt_pipeline->func(ctx_ptr, pkt_header, packet, desc);
+}
+
 /**
  * \fn void libpcap_process_packet (unsigned char *ctx_ptr,
                                     const struct pcap_pkthdr *pkt_header,
@@ -1206,4 +1646,475 @@ void libpcap_process_packet (unsigned char *ctx_ptr, const struct pcap_pkthdr *p
     process_packet(ctx_ptr, pkt_header, packet);
 }
 
+/**
+ * \fn void process_packet_prefetch (joy_ctx_data *ctx,
+                                     unsigned int num_packets,
+                                     const struct pcap_pkthdr *headers,
+                                     const unsigned char *const *packets,
+                                     pkt_desc_t *descs)
+ * \brief decode a batch of packets, and get their flow table slots and
+        flow records on their way into the cache, before the packets
+        are processed
+ *
+ * The work is done in stages, each one over the whole batch: the packets
+ * are decoded and their keys hashed, and the flow table slots that the
+ * lookups are going to look at are prefetched; then the records are
+ * looked up and prefetched.  The cache misses of the packets of a stage
+ * overlap rather than being taken one after the other.  Nothing is
+ * changed, so the packets must still be handed to
+ * process_decoded_packet() with their descriptors.
+ *
+ * \param ctx the context that is going to process the packets
+ * \param num_packets number of packets; only the first PKT_BATCH_SIZE are looked at
+ * \param headers pcap headers of the packets
+ * \param packets the packets
+ * \param descs filled in with the descriptors of the packets
+ * \return none
+ */
+void process_packet_prefetch (joy_ctx_data *ctx, unsigned int num_packets,
+                              const struct pcap_pkthdr *headers,
+                              const unsigned char *const *packets,
+                              pkt_desc_t *descs) {
+    uint32_t hashes[PKT_BATCH_SIZE];
+    unsigned int i;
+
+    if (num_packets > PKT_BATCH_SIZE) {
+        num_packets = PKT_BATCH_SIZE;
+    }
+
+    /* decode and hash every packet, and prefetch the slot of its flow */
+    for (i = 0; i < num_packets; i++) {
+        if (decode_packet(packets[i], headers[i].caplen, &descs[i])) {
+            hashes[i] = flow_key_prefetch_slot(ctx, &descs[i].key);
+        }
+    }
+
+    /* by now the slots are in the cache, or on their way; prefetch the records */
+    for (i = 0; i < num_packets; i++) {
+        if (descs[i].ip_version) {
+            flow_key_prefetch_record(ctx, &descs[i].key, hashes[i]);
+        }
+    }
+}
+
+/**
+ * \fn void process_packet_batch (unsigned char *ctx_ptr,
+                                  unsigned int num_packets,
+                                  const struct pcap_pkthdr *headers,
+                                  const unsigned char *const *packets)
+ * \brief process a batch of packets, in order, with the flow table
+        lookups of each PKT_BATCH_SIZE of them overlapped
+ *
+ * The result is the same as handing the packets to process_packet()
+ * one at a time.
+ *
+ * \param ctx_ptr currently used to store the context data pointer
+ * \param num_packets number of packets
+ * \param headers pcap headers of the packets, one for each packet
+ * \param packets the packets
+ * \return none
+ */
+void process_packet_batch (unsigned char *ctx_ptr, unsigned int num_packets,
+                           const struct pcap_pkthdr *headers,
+                           const unsigned char *const *packets) {
+    joy_ctx_data *ctx = (joy_ctx_data*)ctx_ptr;
+    pkt_desc_t descs[PKT_BATCH_SIZE];
+    unsigned int i, j, n;
+
+    if (ctx == NULL || headers == NULL || packets == NULL) {
+        joy_log_err("NULL Data Context Pointer or packets");
+        return;
+    }
+
+    for (i = 0; i < num_packets; i += n) {
+        n = num_packets - i < PKT_BATCH_SIZE ? num_packets - i : PKT_BATCH_SIZE;
+        process_packet_prefetch(ctx, n, headers + i, packets + i, descs);
+        for (j = 0; j < n; j++) {
+            process_decoded_packet(ctx_ptr, &headers[i + j], packets[i + j], &descs[j]);
+        }
+    }
+}
+
+/*
+ * unit test
+ */
+
+/** TCP from 10.0.0.1:1234 to 10.0.0.2:80, with a 40 byte IP packet */
+static const unsigned char pkt_test_ipv4_tcp[] = {
+    0x45, 0x00, 0x00, 0x28, 0x00, 0x01, 0x00, 0x00, 0x40, 0x06, 0x00, 0x00,
+    0x0a, 0x00, 0x00, 0x01, 0x0a, 0x00, 0x00, 0x02,
+    0x04, 0xd2, 0x00, 0x50, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00,
+    0x50, 0x02, 0x20, 0x00, 0x00, 0x00, 0x00, 0x00
+};
+
+/** UDP from 2001:db8::1 port 5353 to 2001:db8::2 port 53, behind a hop-by-hop header */
+static const unsigned char pkt_test_ipv6_udp[] = {
+    0x60, 0x00, 0x00, 0x00, 0x00, 0x14, 0x00, 0x39,
+    0x20, 0x01, 0x0d, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x01,
+    0x20, 0x01, 0x0d, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x02,
+    0x11, 0x00, 0x01, 0x04, 0x00, 0x00, 0x00, 0x00,
+    0x14, 0xe9, 0x00, 0x35, 0x00, 0x0c, 0x00, 0x00, 0xde, 0xad, 0xbe, 0xef
+};
+
+/** a fragment of a TCP packet, other than the first */
+static const unsigned char pkt_test_ipv6_frag[] = {
+    0x60, 0x00, 0x00, 0x00, 0x00, 0x10, 0x2c, 0x40,
+    0x20, 0x01, 0x0d, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x01,
+    0x20, 0x01, 0x0d, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x02,
+    0x06, 0x00, 0x05, 0xa8, 0x12, 0x34, 0x56, 0x78,
+    0x04, 0xd2, 0x00, 0x50, 0x00, 0x00, 0x00, 0x01
+};
+
+/**
+ * \brief make a test packet out of an ethernet header with the given
+ *        types, MPLS labels and an IP packet
+ * \return length of the packet
+ */
+static unsigned int pkt_proc_test_packet (unsigned char *buf, const uint16_t *types,
+                                          unsigned int num_types, unsigned int num_labels,
+                                          const unsigned char *ip, unsigned int ip_len) {
+    unsigned int len = 12, i;
+
+    memset_s(buf, len, 0x02, len);
+    for (i = 0; i < num_types; i++) {
+        /* each type but the first is in a VLAN tag, after the tag control */
+        if (i) {
+            buf[len++] = 0x00;
+            buf[len++] = (unsigned char)i;
+        }
+        buf[len++] = (unsigned char)(types[i] >> 8);
+        buf[len++] = (unsigned char)types[i];
+    }
+    for (i = 0; i < num_labels; i++) {
+        buf[len++] = 0x00;
+        buf[len++] = 0x01;
+        buf[len++] = (i + 1 == num_labels) ? 0x01 : 0x00;
+        buf[len++] = 0x40;
+    }
+    memcpy_s(buf + len, ip_len, ip, ip_len);
+
+    return len + ip_len;
+}
+
+static int pkt_proc_test_decode (void) {
+    static const uint16_t plain[] = { ETH_TYPE_IP };
+    static const uint16_t vlans[] = { ETH_TYPE_QNQ, ETH_TYPE_DOT1Q, ETH_TYPE_DOT1Q, ETH_TYPE_IP };
+    static const uint16_t mpls[] = { ETH_TYPE_MPLS };
+    static const uint16_t ipv6[] = { ETH_TYPE_IPV6 };
+    unsigned char buf[256], rev[256];
+    pkt_desc_t d, r;
+    unsigned int len;
+    int num_fails = 0;
+
+    len = pkt_proc_test_packet(buf, plain, 1, 0, pkt_test_ipv4_tcp, sizeof(pkt_test_ipv4_tcp));
+    if (!decode_packet(buf, len, &d) || d.ip_version != 4 || d.l3_offset != 14 ||
+        d.l4_offset != 34 || d.ip_len != 40 || d.key.prot != IPPROTO_TCP ||
+        d.key.sp != 1234 || d.key.dp != 80 || d.key.ipv6 || ntohl(d.key.sa.s_addr) != 0x0a000001) {
+        joy_log_err("IPv4 packet decoded wrong");
+        num_fails++;
+    }
+    if (decode_packet(buf, len - 1, &d) || d.ip_version != 0 || get_packet_shard(&d, 4) != -1) {
+        joy_log_err("truncated IPv4 packet decoded");
+        num_fails++;
+    }
+
+    len = pkt_proc_test_packet(buf, vlans, 4, 0, pkt_test_ipv4_tcp, sizeof(pkt_test_ipv4_tcp));
+    if (!decode_packet(buf, len, &d) || d.l3_offset != 26 || d.key.dp != 80) {
+        joy_log_err("IPv4 packet with three VLAN tags decoded wrong");
+        num_fails++;
+    }
+
+    len = pkt_proc_test_packet(buf, mpls, 1, 2, pkt_test_ipv4_tcp, sizeof(pkt_test_ipv4_tcp));
+    if (!decode_packet(buf, len, &d) || d.ip_version != 4 || d.l3_offset != 22 || d.key.sp != 1234) {
+        joy_log_err("IPv4 packet with two MPLS labels decoded wrong");
+        num_fails++;
+    }
+
+    len = pkt_proc_test_packet(buf, ipv6, 1, 0, pkt_test_ipv6_udp, sizeof(pkt_test_ipv6_udp));
+    if (!decode_packet(buf, len, &d) || d.ip_version != 6 || !d.key.ipv6 || d.l3_offset != 14 ||
+        d.l4_offset != 62 || d.ip_len != 60 || d.key.prot != IPPROTO_UDP ||
+        d.key.sp != 5353 || d.key.dp != 53 || d.key.da6.s6_addr[15] != 0x02) {
+        joy_log_err("IPv6 packet decoded wrong");
+        num_fails++;
+    }
+
+    /* the other direction: swap the addresses and the ports */
+    memcpy_s(rev, sizeof(rev), buf, len);
+    memcpy_s(rev + 22, 16, buf + 38, 16);
+    memcpy_s(rev + 38, 16, buf + 22, 16);
+    memcpy_s(rev + 62, 2, buf + 64, 2);
+    memcpy_s(rev + 64, 2, buf + 62, 2);
+    if (!decode_packet(rev, len, &r) || r.key.sp != 53 || r.hash != d.hash ||
+        get_packet_shard(&r, 7) != get_packet_shard(&d, 7)) {
+        joy_log_err("IPv6 packet in the other direction hashed differently");
+        num_fails++;
+    }
+
+    len = pkt_proc_test_packet(buf, mpls, 1, 1, pkt_test_ipv6_frag, sizeof(pkt_test_ipv6_frag));
+    if (!decode_packet(buf, len, &d) || d.ip_version != 6 || d.l3_offset != 18 ||
+        d.key.prot != IPPROTO_IP || d.key.sp != 0 || d.key.dp != 0) {
+        joy_log_err("IPv6 fragment decoded wrong");
+        num_fails++;
+    }
+
+    return num_fails;
+}
+
+static int pkt_proc_test_process (joy_ctx_data *ctx) {
+    static const uint16_t ipv6[] = { ETH_TYPE_IPV6 };
+    unsigned char buf[256];
+    struct pcap_pkthdr header;
+    flow_record_t *record;
+    pkt_desc_t d;
+    int num_fails = 0;
+
+    flow_record_list_init(ctx);
+    header.ts.tv_sec = 1500000000;
+    header.ts.tv_usec = 0;
+    header.caplen = header.len =
+        pkt_proc_test_packet(buf, ipv6, 1, 0, pkt_test_ipv6_udp, sizeof(pkt_test_ipv6_udp));
+
+    decode_packet(buf, header.caplen, &d);
+    record = process_decoded_packet((unsigned char *)ctx, &header, buf, &d);
+    if (record == NULL || !record->key.ipv6 || record->ip.ttl != 0x39 || record->ob != 4 ||
+        flow_key_get_record(ctx, &d.key, DONT_CREATE_RECORDS, &header) != record) {
+        joy_log_err("IPv6 packet not in the right flow");
+        num_fails++;
+    }
+
+    /* an IPv4 key with the same first address words is another flow */
+    d.key.ipv6 = 0;
+    if (flow_key_get_record(ctx, &d.key, DONT_CREATE_RECORDS, &header) != NULL) {
+        joy_log_err("IPv4 key found the IPv6 flow");
+        num_fails++;
+    }
+
+    /* only the features that are on and match the port get a bit */
+    glb_config->report_dns = glb_config->report_http = 1;
+    record = flow_key_get_record(ctx, &d.key, CREATE_RECORDS, &header);
+    if (record == NULL || record->features != feature_bit(dns)) {
+        joy_log_err("DNS flow has the wrong features");
+        num_fails++;
+    }
+    glb_config->report_dns = glb_config->report_http = 0;
+    flow_record_list_free(ctx);
+
+    return num_fails;
+}
+
+static int pkt_proc_test_saturation_at (joy_ctx_data *ctx, unsigned int num_pkts) {
+    static const uint16_t ipv6[] = { ETH_TYPE_IPV6 };
+    unsigned char buf[256];
+    struct pcap_pkthdr header;
+    flow_record_t *record = NULL;
+    pkt_desc_t d;
+    unsigned int saved_num_pkts = glb_config->num_pkts;
+    unsigned int full = (num_pkts < ETTA_MIN_PACKETS) ? ETTA_MIN_PACKETS : num_pkts;
+    unsigned long int saturated, fast_path;
+    unsigned int i;
+    int num_fails = 0;
+
+    glb_config->num_pkts = num_pkts;
+    flow_record_list_init(ctx);
+    saturated = ctx->stats.saturated_records;
+    fast_path = ctx->stats.fast_path_packets;
+    header.ts.tv_sec = 1500000000;
+    header.ts.tv_usec = 0;
+    header.caplen = header.len =
+        pkt_proc_test_packet(buf, ipv6, 1, 0, pkt_test_ipv6_udp, sizeof(pkt_test_ipv6_udp));
+
+    /* move the flow off port 53, so that no feature module claims it */
+    buf[64] = 0x27;
+    buf[65] = 0x0f;
+    decode_packet(buf, header.caplen, &d);
+
+    for (i = 0; i < full + 10; i++) {
+        header.ts.tv_usec = i;
+        record = process_decoded_packet((unsigned char *)ctx, &header, buf, &d);
+        if (record == NULL) {
+            joy_log_err("packet %u not in a flow", i);
+            num_fails++;
+            break;
+        }
+        if (i + 1 < full && record->saturated) {
+            joy_log_err("flow saturated after %u packets, num_pkts %u", i + 1, num_pkts);
+            num_fails++;
+            break;
+        }
+    }
+    if (record != NULL) {
+        if (!record->saturated || ctx->stats.saturated_records != saturated + 1 ||
+            ctx->stats.fast_path_packets != fast_path + 10) {
+            joy_log_err("flow not saturated after %u packets, num_pkts %u", i, num_pkts);
+            num_fails++;
+        }
+        if (record->np != full + 10 || record->ob != 4 * (full + 10) ||
+            record->op != full || flow_record_num_pkts(record) != num_pkts ||
+            record->end.tv_usec != full + 9) {
+            joy_log_err("saturated flow stopped counting, num_pkts %u", num_pkts);
+            num_fails++;
+        }
+    }
+    flow_record_list_free(ctx);
+    glb_config->num_pkts = saved_num_pkts;
+
+    return num_fails;
+}
+
+static int pkt_proc_test_saturation (joy_ctx_data *ctx) {
+    int num_fails = 0;
+
+    /* the flow is done once num_pkts packets are stored */
+    num_fails += pkt_proc_test_saturation_at(ctx, glb_config->num_pkts);
+
+    /* but not before op reaches ETTA_MIN_PACKETS */
+    num_fails += pkt_proc_test_saturation_at(ctx, 2);
+
+    return num_fails;
+}
+
+static int pkt_proc_test_admission (joy_ctx_data *ctx) {
+    static const uint16_t ipv4[] = { ETH_TYPE_IP };
+    static const uint16_t ipv6[] = { ETH_TYPE_IPV6 };
+    unsigned char buf[256], tmp[4];
+    struct pcap_pkthdr header;
+    flow_record_t *first = NULL, *record = NULL;
+    pkt_desc_t d;
+    unsigned long int refused = ctx->stats.refused_records;
+    unsigned long int evicted = ctx->stats.evicted_records;
+    bool saved_bidir = glb_config->bidir;
+    bool saved_admission = glb_config->admission;
+    uint32_t saved_max_flows = glb_config->max_flows;
+    FILE *out = tmpfile();
+    int num_fails = 0;
+
+    if (out == NULL) {
+        joy_log_err("could not open a temporary file");
+        return 1;
+    }
+    glb_config->bidir = 1;
+    glb_config->admission = 1;
+    glb_config->max_flows = 0;
+    flow_record_list_init(ctx);
+    ctx->output = zattach(out, "w");
+
+    header.ts.tv_sec = 1500000000;
+    header.ts.tv_usec = 0;
+    header.caplen = header.len =
+        pkt_proc_test_packet(buf, ipv6, 1, 0, pkt_test_ipv6_udp, sizeof(pkt_test_ipv6_udp));
+    buf[64] = 0x27;
+    buf[65] = 0x0f;
+    decode_packet(buf, header.caplen, &d);
+
+    /* the first packet of a flow is only remembered */
+    if (process_decoded_packet((unsigned char *)ctx, &header, buf, &d) != NULL ||
+        ctx->stats.refused_records != refused + 1 ||
+        flow_key_get_record(ctx, &d.key, DONT_CREATE_RECORDS, &header) != NULL) {
+        joy_log_err("first packet of a flow got a record");
+        num_fails++;
+    }
+    header.ts.tv_usec = 1;
+    first = process_decoded_packet((unsigned char *)ctx, &header, buf, &d);
+    if (first == NULL || first->np != 1) {
+        joy_log_err("second packet of a flow did not get a record");
+        num_fails++;
+    }
+
+    /* with room for one flow, the next flow evicts the first one */
+    glb_config->max_flows = 1;
+    buf[63] ^= 0x01;
+    decode_packet(buf, header.caplen, &d);
+    header.ts.tv_usec = 2;
+    process_decoded_packet((unsigned char *)ctx, &header, buf, &d);
+    header.ts.tv_usec = 3;
+    record = process_decoded_packet((unsigned char *)ctx, &header, buf, &d);
+    if (record == NULL || ctx->stats.evicted_records != evicted + 1 ||
+        ctx->stats.num_records_in_table != 1 || ctx->stats.refused_records != refused + 2) {
+        joy_log_err("flow was not evicted to stay within max_flows");
+        num_fails++;
+    }
+
+    /* a RST that answers a refused SYN is not the second packet of its flow */
+    glb_config->max_flows = 0;
+    header.caplen = header.len =
+        pkt_proc_test_packet(buf, ipv4, 1, 0, pkt_test_ipv4_tcp, sizeof(pkt_test_ipv4_tcp));
+    decode_packet(buf, header.caplen, &d);
+    header.ts.tv_usec = 4;
+    process_decoded_packet((unsigned char *)ctx, &header, buf, &d);
+    memcpy_s(tmp, 4, buf + 26, 4);
+    memcpy_s(buf + 26, 4, buf + 30, 4);
+    memcpy_s(buf + 30, 4, tmp, 4);
+    memcpy_s(tmp, 2, buf + 34, 2);
+    memcpy_s(buf + 34, 2, buf + 36, 2);
+    memcpy_s(buf + 36, 2, tmp, 2);
+    buf[47] = 0x14;
+    decode_packet(buf, header.caplen, &d);
+    header.ts.tv_usec = 5;
+    if (process_decoded_packet((unsigned char *)ctx, &header, buf, &d) != NULL ||
+        ctx->stats.refused_records != refused + 4) {
+        joy_log_err("answer to a refused packet got a record");
+        num_fails++;
+    }
+
+    flow_record_list_free(ctx);
+    zclose(ctx->output);
+    ctx->output = NULL;
+    glb_config->bidir = saved_bidir;
+    glb_config->admission = saved_admission;
+    glb_config->max_flows = saved_max_flows;
+
+    return num_fails;
+}
+
+static int pkt_proc_test_pipeline (void) {
+    int num_fails = 0;
+
+    if (pkt_proc_set_pipeline(PKT_PIPELINE_AUTO) != 0 || strcmp(pkt_proc_pipeline_name(), "basic") != 0) {
+        joy_log_err("plain configuration got the %s pipeline", pkt_proc_pipeline_name());
+        num_fails++;
+    }
+
+    /* a pipeline without an option that is on can not be picked */
+    glb_config->include_zeroes = 1;
+    if (pkt_proc_set_pipeline(PKT_PIPELINE_BASIC) != -1 || pkt_proc_set_pipeline(PKT_PIPELINE_AUTO) != 0 ||
+        strcmp(pkt_proc_pipeline_name(), "full") != 0) {
+        joy_log_err("zeroes configuration got the %s pipeline", pkt_proc_pipeline_name());
+        num_fails++;
+    }
+    glb_config->include_zeroes = 0;
+    pkt_proc_set_pipeline(PKT_PIPELINE_AUTO);
+
+    return num_fails;
+}
+
+int pkt_proc_unit_test (void) {
+    joy_ctx_data *ctx;
+    int num_fails = 0;
+
+    fprintf(info, "\n******************************\n");
+    fprintf(info, "Packet decoding Unit Test starting...\n");
+
+    num_fails += pkt_proc_test_decode();
+    num_fails += pkt_proc_test_pipeline();
+    ctx = calloc(1, sizeof(joy_ctx_data));
+    if (ctx == NULL) {
+        joy_log_err("Out of memory");
+        num_fails++;
+    } else {
+        num_fails += pkt_proc_test_process(ctx);
+        num_fails += pkt_proc_test_saturation(ctx);
+        num_fails += pkt_proc_test_admission(ctx);
+        free(ctx);
+    }
+
+    if (num_fails) {
+        fprintf(info, "Finished - failures: %d\n", num_fails);
+    } else {
+        fprintf(info, "Finished - success\n");
+    }
+    fprintf(info, "******************************\n\n");
+
+    return num_fails;
+}
+
 /* END packet processing */
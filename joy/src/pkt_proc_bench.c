@@ -0,0 +1,357 @@
+/*
+ *
+ * Copyright (c) 2018 Cisco Systems, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials provided
+ *   with the distribution.
+ *
+ *   Neither the name of the Cisco Systems, Inc. nor the names of its
+ *   contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+/**
+ * \file pkt_proc_bench.c
+ *
+ * \brief benchmark for the specialized packet pipelines
+ *
+ ** Compares the rate at which process_decoded_packet() handles packets
+ *  in the generic pipeline and in the pipeline that
+ *  pkt_proc_set_pipeline() picks for the configuration, for the MOTIF
+ *  configuration (bidir=1 num_pkts=50, no byte distribution, no TLS)
+ *  and for one with every feature module and option on.
+ *
+ *  usage: pkt_proc_bench [-r runs] [num_flows]
+ *
+ *  The packets are made up in memory and decoded before the clock is
+ *  started, so only the packet processing is measured.  Each figure is
+ *  the best of the runs (5 by default), each into fresh flow records.
+ */
+#ifdef HAVE_CONFIG_H
+#include "joy_config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "safe_lib.h"
+#include "p2f.h"
+#include "config.h"
+#include "pkt_proc.h"
+#include "joy_api.h"
+#include "joy_api_private.h"
+
+/** packets of each flow */
+#define BENCH_PKTS_PER_FLOW 64
+
+/** TCP payload of each packet but the first of a flow */
+#define BENCH_PAYLOAD_LEN 512
+
+/** room for an ethernet, IPv4 and TCP header and the payload */
+#define BENCH_PKT_LEN (14 + 20 + 20 + BENCH_PAYLOAD_LEN)
+
+typedef struct bench_pkts_ {
+    unsigned int num;
+    struct pcap_pkthdr *headers;
+    unsigned char *data;
+    pkt_desc_t *descs;
+} bench_pkts_t;
+
+/*
+ * xorshift64, so that runs are repeatable
+ */
+static uint64_t bench_rand (uint64_t *state) {
+    uint64_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+static void bench_put16 (unsigned char *p, unsigned int x) {
+    p[0] = (unsigned char)(x >> 8);
+    p[1] = (unsigned char)x;
+}
+
+static void bench_put32 (unsigned char *p, uint32_t x) {
+    bench_put16(p, x >> 16);
+    bench_put16(p + 2, x & 0xffff);
+}
+
+/**
+ * \brief Make up the packets of num_flows TCP flows, to a mix of web,
+ *        TLS and other ports, with the packets of the flows interleaved.
+ * \param pkts filled in with the packets
+ * \param num_flows number of flows
+ * \return 0 on success, 1 on error
+ */
+static int bench_make_packets (bench_pkts_t *pkts, unsigned int num_flows) {
+    static const uint16_t ports[] = { 80, 443, 8080, 22, 993, 3389 };
+    uint64_t state = 0x9e3779b97f4a7c15ULL;
+    unsigned int i, n = num_flows * BENCH_PKTS_PER_FLOW;
+
+    pkts->num = n;
+    pkts->headers = calloc(n, sizeof(struct pcap_pkthdr));
+    pkts->data = calloc(n, BENCH_PKT_LEN);
+    pkts->descs = calloc(n, sizeof(pkt_desc_t));
+    if (pkts->headers == NULL || pkts->data == NULL || pkts->descs == NULL) {
+        fprintf(stderr, "error: could not allocate memory for %u packets\n", n);
+        return 1;
+    }
+
+    for (i = 0; i < n; i++) {
+        unsigned char *p = pkts->data + (size_t)i * BENCH_PKT_LEN;
+        unsigned int flow = i % num_flows, seq = i / num_flows, j;
+        unsigned int len = seq ? BENCH_PAYLOAD_LEN : 0;
+
+        /* ethernet */
+        memset_s(p, 12, 0x02, 12);
+        bench_put16(p + 12, 0x0800);
+
+        /* IPv4, from one of many clients to one of a few servers */
+        p[14] = 0x45;
+        bench_put16(p + 16, 40 + len);
+        bench_put16(p + 18, seq);
+        p[22] = 64;
+        p[23] = 6;
+        bench_put32(p + 26, 0x0a000000 | flow);
+        bench_put32(p + 30, 0xc0a80000 | (flow & 0xff));
+
+        /* TCP, a SYN and then data */
+        bench_put16(p + 34, 1024 + (flow & 0x7fff));
+        bench_put16(p + 36, ports[flow % (sizeof(ports) / sizeof(ports[0]))]);
+        bench_put32(p + 38, 1000 + (seq ? 1 + (seq - 1) * BENCH_PAYLOAD_LEN : 0));
+        bench_put32(p + 42, seq ? 1 : 0);
+        p[46] = 0x50;
+        p[47] = seq ? 0x18 : 0x02;
+        bench_put16(p + 48, 65535);
+        for (j = 0; j < len; j += 8) {
+            uint64_t r = bench_rand(&state);
+
+            memcpy_s(p + 54 + j, 8, &r, 8);
+        }
+
+        pkts->headers[i].ts.tv_sec = 1500000000 + i / 100000;
+        pkts->headers[i].ts.tv_usec = (i % 100000) * 10;
+        pkts->headers[i].caplen = pkts->headers[i].len = 54 + len;
+        if (!decode_packet(p, pkts->headers[i].caplen, &pkts->descs[i])) {
+            fprintf(stderr, "error: packet %u did not decode\n", i);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * The MOTIF configuration: bidirectional flows, 50 packet lengths and
+ * times, and nothing else
+ */
+static void bench_config_motif (void) {
+    glb_config->bidir = 1;
+    glb_config->num_pkts = 50;
+    glb_config->include_zeroes = 0;
+    glb_config->include_retrans = 0;
+    glb_config->byte_distribution = 0;
+    glb_config->report_entropy = 0;
+    glb_config->report_wht = 0;
+    glb_config->report_hd = 0;
+    glb_config->idp = 0;
+    glb_config->report_tls = 0;
+    glb_config->report_http = 0;
+    glb_config->report_ssh = 0;
+    glb_config->report_salt = 0;
+    glb_config->report_ppi = 0;
+    glb_config->report_fpx = 0;
+    glb_config->report_payload = 0;
+}
+
+/*
+ * Every feature module that applies to TCP, and every option that the
+ * pipelines specialize on but logging and flow collection
+ */
+static void bench_config_full (void) {
+    bench_config_motif();
+    glb_config->num_pkts = MAX_NUM_PKT_LEN;
+    glb_config->include_zeroes = 1;
+    glb_config->include_retrans = 1;
+    glb_config->byte_distribution = 1;
+    glb_config->report_entropy = 1;
+    glb_config->report_wht = 1;
+    glb_config->report_hd = 1;
+    glb_config->idp = 1400;
+    glb_config->report_tls = 1;
+    glb_config->report_http = 1;
+    glb_config->report_ssh = 1;
+    glb_config->report_salt = 1;
+    glb_config->report_ppi = 1;
+    glb_config->report_fpx = 1;
+    glb_config->report_payload = 1;
+}
+
+static double bench_elapsed (const struct timeval *start) {
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return (double)(now.tv_sec - start->tv_sec) + (double)(now.tv_usec - start->tv_usec) / 1e6;
+}
+
+/**
+ * \brief Run the packets through process_decoded_packet() once, into
+ *        fresh flow records.
+ * \param pkts packets
+ * \param num_records set to the number of flow records made
+ * \return the time taken, in seconds, or a negative number on error
+ */
+static double bench_pipeline (const bench_pkts_t *pkts, unsigned long int *num_records) {
+    joy_ctx_data *ctx = calloc(1, sizeof(joy_ctx_data));
+    struct timeval start;
+    double seconds;
+    unsigned int i;
+
+    if (ctx == NULL) {
+        fprintf(stderr, "error: could not allocate a context\n");
+        return -1.0;
+    }
+    flow_record_list_init(ctx);
+
+    gettimeofday(&start, NULL);
+    for (i = 0; i < pkts->num; i++) {
+        process_decoded_packet((unsigned char *)ctx, &pkts->headers[i],
+                               pkts->data + (size_t)i * BENCH_PKT_LEN, &pkts->descs[i]);
+    }
+    seconds = bench_elapsed(&start);
+
+    *num_records = ctx->stats.num_records_in_table;
+    flow_record_list_free(ctx);
+    free(ctx);
+    return seconds;
+}
+
+/**
+ * \brief Measure the generic and the picked pipeline for one configuration.
+ *        The two take turns, after a run that is not timed, so that
+ *        neither gains from the warm up.
+ * \param name name of the configuration
+ * \param config function that sets the configuration
+ * \param pkts packets
+ * \param runs number of runs
+ * \return 0 on success, 1 on error
+ */
+static int bench_run (const char *name, void (*config)(void), const bench_pkts_t *pkts, unsigned int runs) {
+    static const pkt_pipeline_e pipelines[2] = { PKT_PIPELINE_GENERIC, PKT_PIPELINE_AUTO };
+    unsigned long int records[2] = { 0, 0 };
+    double best[2] = { -1.0, -1.0 };
+    const char *picked = NULL;
+    unsigned int r, k;
+
+    config();
+    if (pkt_proc_set_pipeline(PKT_PIPELINE_AUTO) != 0) {
+        fprintf(stderr, "error: no pipeline for the %s configuration\n", name);
+        return 1;
+    }
+    picked = pkt_proc_pipeline_name();
+    if (bench_pipeline(pkts, &records[0]) < 0.0) {
+        return 1;
+    }
+
+    for (r = 0; r < runs; r++) {
+        for (k = 0; k < 2; k++) {
+            double seconds;
+
+            pkt_proc_set_pipeline(pipelines[k]);
+            seconds = bench_pipeline(pkts, &records[k]);
+            if (seconds < 0.0) {
+                return 1;
+            }
+            if (best[k] < 0.0 || seconds < best[k]) {
+                best[k] = seconds;
+            }
+        }
+    }
+
+    printf("%-6s | generic %7.2f Mpkt/s | %-7s %7.2f Mpkt/s | %.2fx\n", name,
+           pkts->num / best[0] / 1e6, picked, pkts->num / best[1] / 1e6, best[0] / best[1]);
+    if (records[0] != records[1]) {
+        fprintf(stderr, "error: %lu flow records in the generic pipeline, %lu in %s\n",
+                records[0], records[1], picked);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * \fn int main (int argc, char* argv[])
+ * \brief main entry point for the packet pipeline benchmark
+ * \return 0 on success, 1 on error
+ */
+int main (int argc, char *argv[]) {
+    joy_init_t init_data;
+    bench_pkts_t pkts;
+    unsigned long num_flows = 4096, runs = 5;
+    int i, rc = 0;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            runs = strtoul(argv[++i], NULL, 0);
+        } else {
+            num_flows = strtoul(argv[i], NULL, 0);
+        }
+    }
+    if (runs == 0 || num_flows == 0 || num_flows > 0x10000) {
+        fprintf(stderr, "usage: %s [-r runs] [num_flows]\n", argv[0]);
+        return 1;
+    }
+
+    /* setup the joy options we want */
+    memset_s(&init_data, sizeof(joy_init_t), 0x00, sizeof(joy_init_t));
+    /* the made up payloads are not real TLS, so keep quiet about them */
+    init_data.verbosity = JOY_LOG_ERR;
+
+    /* intialize joy */
+    if (joy_initialize(&init_data, NULL, NULL, NULL) != 0) {
+        printf(" -= Joy Initialized Failed =-\n");
+        return -1;
+    }
+
+    memset_s(&pkts, sizeof(pkts), 0x00, sizeof(pkts));
+    if (bench_make_packets(&pkts, (unsigned int)num_flows) == 0) {
+        printf("%lu flows of %u packets, %u byte payloads\n", num_flows, BENCH_PKTS_PER_FLOW, BENCH_PAYLOAD_LEN);
+        rc |= bench_run("motif", bench_config_motif, &pkts, (unsigned int)runs);
+        rc |= bench_run("full", bench_config_full, &pkts, (unsigned int)runs);
+    } else {
+        rc = 1;
+    }
+    free(pkts.headers);
+    free(pkts.data);
+    free(pkts.descs);
+
+    joy_context_cleanup(0);
+    joy_shutdown();
+    return rc;
+}
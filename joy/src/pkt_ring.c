@@ -0,0 +1,403 @@
+/*
+ *
+ * Copyright (c) 2018 Cisco Systems, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials provided
+ *   with the distribution.
+ *
+ *   Neither the name of the Cisco Systems, Inc. nor the names of its
+ *   contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/**
+ * \file pkt_ring.c
+ *
+ * \brief single producer, single consumer ring of captured packets
+ *
+ ** Entries are laid out back to back in a power of two sized buffer.
+ *  The head and tail are byte counters that only ever grow; masking
+ *  them with the buffer size gives the position in the buffer.  An
+ *  entry never wraps around the end of the buffer: when it does not
+ *  fit, the producer writes a wrap marker (an entry size of zero) and
+ *  starts again at the beginning.
+ *
+ ** The producer publishes an entry by storing the new head with release
+ *  semantics after the entry has been written, and the consumer gives
+ *  the space back by storing the new tail the same way, so each side
+ *  sees the other's writes complete.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+#include "safe_lib.h"
+#include "p2f.h"
+#include "pkt_ring.h"
+#include "err.h"
+
+#ifdef WIN32
+/* volatile accesses have acquire and release semantics with MSVC */
+#define pkt_ring_load_acquire(p)     (*(volatile size_t *)(p))
+#define pkt_ring_store_release(p, v) (*(volatile size_t *)(p) = (v))
+#else
+#define pkt_ring_load_acquire(p)     __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define pkt_ring_store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#endif
+
+/** bytes taken by an entry of caplen captured bytes */
+#define PKT_RING_ENTRY_SIZE(caplen) \
+    ((sizeof(pkt_ring_entry_t) + (caplen) + PKT_RING_ALIGN - 1) & ~((size_t)PKT_RING_ALIGN - 1))
+
+/** smallest ring that is accepted */
+#define PKT_RING_MIN_SIZE 4096
+
+/**
+ * \brief Allocate the storage of a ring.
+ *
+ * \param r Ring
+ * \param size Bytes of storage, rounded up to a power of two
+ * \return ok, failure
+ */
+joy_status_e pkt_ring_init (pkt_ring_t *r, size_t size) {
+    size_t bytes = PKT_RING_MIN_SIZE;
+
+    while (bytes < size) {
+        bytes <<= 1;
+    }
+
+    memset_s(r, sizeof(pkt_ring_t), 0x00, sizeof(pkt_ring_t));
+    r->buf = malloc(bytes);
+    if (r->buf == NULL) {
+        joy_log_err("could not allocate a packet ring of %zu bytes", bytes);
+        return failure;
+    }
+    r->size = bytes;
+
+    return ok;
+}
+
+/**
+ * \brief Release the storage of a ring.
+ *
+ * \param r Ring
+ * \return none
+ */
+void pkt_ring_destroy (pkt_ring_t *r) {
+    free(r->buf);
+    r->buf = NULL;
+    r->size = 0;
+}
+
+/**
+ * \brief Wait until the producer has room for bytes more in the ring.
+ *
+ * \param r Ring
+ * \param bytes Room needed
+ * \return none
+ */
+static void pkt_ring_wait_for_room (pkt_ring_t *r, size_t bytes) {
+    while (r->size - (r->head - pkt_ring_load_acquire(&r->tail)) < bytes) {
+        r->num_waits++;
+        sched_yield();
+    }
+}
+
+/**
+ * \brief Reserve room for an entry at the head of the ring.
+ *
+ * Waits for the consumer when the ring is full.  The entry is not
+ * visible to the consumer until pkt_ring_publish() is called.
+ *
+ * \param r Ring
+ * \param caplen Number of captured bytes that the entry holds
+ * \return The entry, with its size set
+ */
+static pkt_ring_entry_t *pkt_ring_reserve (pkt_ring_t *r, size_t caplen) {
+    pkt_ring_entry_t *e;
+    size_t need, pos, room;
+
+    need = PKT_RING_ENTRY_SIZE(caplen);
+
+    pos = r->head & (r->size - 1);
+    room = r->size - pos;
+    if (room < need) {
+        /* skip the end of the buffer */
+        pkt_ring_wait_for_room(r, room);
+        ((pkt_ring_entry_t *)(r->buf + pos))->size = 0;
+        pkt_ring_store_release(&r->head, r->head + room);
+        pos = 0;
+    }
+    pkt_ring_wait_for_room(r, need);
+
+    e = (pkt_ring_entry_t *)(r->buf + pos);
+    e->size = (uint32_t)need;
+
+    return e;
+}
+
+/**
+ * \brief Make the entry reserved last visible to the consumer.
+ *
+ * \param r Ring
+ * \param e Entry
+ * \return none
+ */
+static void pkt_ring_publish (pkt_ring_t *r, const pkt_ring_entry_t *e) {
+    pkt_ring_store_release(&r->head, r->head + e->size);
+}
+
+/**
+ * \brief Copy a packet into the ring.
+ *
+ * Waits for the consumer when the ring is full.  A packet that would
+ * take more than a quarter of the ring is truncated to fit.
+ *
+ * \param r Ring
+ * \param header pcap header of the packet
+ * \param packet Captured bytes of the packet
+ * \param desc What decode_packet() found in the packet
+ * \return none
+ */
+void pkt_ring_push (pkt_ring_t *r, const struct pcap_pkthdr *header, const unsigned char *packet,
+                    const pkt_desc_t *desc) {
+    pkt_ring_entry_t *e;
+    size_t caplen = header->caplen;
+    size_t max_caplen = r->size / 4 - sizeof(pkt_ring_entry_t);
+
+    if (caplen > max_caplen) {
+        caplen = max_caplen;
+    }
+
+    e = pkt_ring_reserve(r, caplen);
+    e->caplen = (uint32_t)caplen;
+    e->len = header->len;
+    e->flags = 0;
+    e->ts = header->ts;
+    e->desc = *desc;
+    memcpy(e + 1, packet, caplen);
+    pkt_ring_publish(r, e);
+}
+
+/**
+ * \brief Push a tick, which carries a capture time but no packet.
+ *
+ * \param r Ring
+ * \param ts Capture time
+ * \return none
+ */
+void pkt_ring_push_tick (pkt_ring_t *r, const struct timeval *ts) {
+    pkt_ring_entry_t *e;
+
+    e = pkt_ring_reserve(r, 0);
+    e->caplen = 0;
+    e->len = 0;
+    e->flags = PKT_RING_TICK;
+    e->ts = *ts;
+    pkt_ring_publish(r, e);
+}
+
+/**
+ * \brief Tell the consumer that no more packets will be pushed.
+ *
+ * \param r Ring
+ * \return none
+ */
+void pkt_ring_close (pkt_ring_t *r) {
+    pkt_ring_store_release(&r->closed, 1);
+}
+
+/**
+ * \brief Get the oldest entry in the ring.
+ *
+ * Waits for the producer when the ring is empty.  The entry stays in
+ * the ring until pkt_ring_pop() is called.
+ *
+ * \param r Ring
+ * \return The entry, or NULL when the ring has been closed and all
+ *         entries have been consumed
+ */
+const pkt_ring_entry_t *pkt_ring_peek (pkt_ring_t *r) {
+    const pkt_ring_entry_t *e;
+    size_t pos;
+
+    while (1) {
+        if (pkt_ring_load_acquire(&r->head) != r->tail) {
+            pos = r->tail & (r->size - 1);
+            e = (const pkt_ring_entry_t *)(r->buf + pos);
+            if (e->size == 0) {
+                /* wrap marker */
+                pkt_ring_store_release(&r->tail, r->tail + (r->size - pos));
+                continue;
+            }
+            return e;
+        }
+        if (pkt_ring_load_acquire(&r->closed)) {
+            /* everything pushed before the close is visible now */
+            if (pkt_ring_load_acquire(&r->head) == r->tail) {
+                return NULL;
+            }
+            continue;
+        }
+        sched_yield();
+    }
+}
+
+/**
+ * \brief Release the entry returned by the last pkt_ring_peek().
+ *
+ * \param r Ring
+ * \return none
+ */
+void pkt_ring_pop (pkt_ring_t *r) {
+    const pkt_ring_entry_t *e = (const pkt_ring_entry_t *)(r->buf + (r->tail & (r->size - 1)));
+
+    pkt_ring_store_release(&r->tail, r->tail + e->size);
+}
+
+/*
+ * unit test
+ */
+
+#define PKT_RING_TEST_PACKETS 200000
+
+/** a tick follows every PKT_RING_TEST_TICK packets */
+#define PKT_RING_TEST_TICK 1000
+
+/** size of test packet i, which runs up to a bit over the ring's limit */
+#define pkt_ring_test_len(i) (((i) * 7919) % 1200)
+
+static void *pkt_ring_test_producer (void *arg) {
+    pkt_ring_t *r = (pkt_ring_t *)arg;
+    unsigned char packet[1200];
+    struct pcap_pkthdr header;
+    pkt_desc_t desc;
+    unsigned int i, j;
+
+    memset(&desc, 0, sizeof(desc));
+    for (i = 0; i < PKT_RING_TEST_PACKETS; i++) {
+        header.caplen = header.len = pkt_ring_test_len(i);
+        header.ts.tv_sec = i;
+        header.ts.tv_usec = i % 1000000;
+        for (j = 0; j < header.caplen; j++) {
+            packet[j] = (unsigned char)(i + j);
+        }
+        desc.hash = i;
+        pkt_ring_push(r, &header, packet, &desc);
+        if (i % PKT_RING_TEST_TICK == 0) {
+            pkt_ring_push_tick(r, &header.ts);
+        }
+    }
+    pkt_ring_close(r);
+
+    return NULL;
+}
+
+int pkt_ring_unit_test (void) {
+    pkt_ring_t ring;
+    pthread_t producer;
+    const pkt_ring_entry_t *e;
+    const unsigned char *packet;
+    unsigned int i = 0, j, caplen, num_ticks = 0;
+    int num_fails = 0;
+
+    fprintf(info, "\n******************************\n");
+    fprintf(info, "Packet ring Unit Test starting...\n");
+
+    /* a small ring, so that it wraps and fills up all the time */
+    if (pkt_ring_init(&ring, 1000) != ok || ring.size != PKT_RING_MIN_SIZE) {
+        joy_log_err("ring setup failed");
+        num_fails++;
+    } else if (pthread_create(&producer, NULL, pkt_ring_test_producer, &ring) != 0) {
+        joy_log_err("could not start the producer thread");
+        num_fails++;
+    } else {
+        while ((e = pkt_ring_peek(&ring)) != NULL) {
+            if (e->flags & PKT_RING_TICK) {
+                if (i == 0 || (i - 1) % PKT_RING_TEST_TICK != 0 ||
+                    e->ts.tv_sec != (time_t)(i - 1)) {
+                    joy_log_err("unexpected tick after packet %u", i);
+                    num_fails++;
+                    break;
+                }
+                num_ticks++;
+                pkt_ring_pop(&ring);
+                continue;
+            }
+            caplen = pkt_ring_test_len(i);
+            if (caplen > ring.size / 4 - sizeof(pkt_ring_entry_t)) {
+                caplen = ring.size / 4 - sizeof(pkt_ring_entry_t);
+            }
+            if (e->caplen != caplen || e->len != pkt_ring_test_len(i) ||
+                e->ts.tv_sec != (time_t)i || e->ts.tv_usec != (long)(i % 1000000) ||
+                e->desc.hash != i) {
+                joy_log_err("packet %u has a wrong header", i);
+                num_fails++;
+                break;
+            }
+            packet = pkt_ring_entry_data(e);
+            for (j = 0; j < caplen; j++) {
+                if (packet[j] != (unsigned char)(i + j)) {
+                    break;
+                }
+            }
+            if (j != caplen) {
+                joy_log_err("packet %u has wrong data at offset %u", i, j);
+                num_fails++;
+                break;
+            }
+            pkt_ring_pop(&ring);
+            i++;
+        }
+        if (e != NULL) {
+            /* let the producer finish */
+            do {
+                pkt_ring_pop(&ring);
+            } while (pkt_ring_peek(&ring) != NULL);
+        } else if (i != PKT_RING_TEST_PACKETS || num_ticks != PKT_RING_TEST_PACKETS / PKT_RING_TEST_TICK) {
+            joy_log_err("%u packets and %u ticks received", i, num_ticks);
+            num_fails++;
+        }
+        pthread_join(producer, NULL);
+        if (ring.head != ring.tail) {
+            joy_log_err("ring not empty after the last packet");
+            num_fails++;
+        }
+    }
+    pkt_ring_destroy(&ring);
+
+    if (num_fails) {
+        fprintf(info, "Finished - failures: %d\n", num_fails);
+    } else {
+        fprintf(info, "Finished - success\n");
+    }
+    fprintf(info, "******************************\n\n");
+
+    return num_fails;
+}
@@ -57,24 +57,23 @@ extern FILE *info;
 /* helper functions defined below */
 
 static void pkt_info_print_interleaved(zfile f,
-                                       const struct pkt_info *pkt_info,
-                                       unsigned int np,
-                                       const struct pkt_info *pkt_info2,
-                                       unsigned int np2);
+                                       const struct ppi *x1,
+                                       const struct ppi *x2);
 
 /**
  * \brief Initialize the memory of PPI struct.
  *
  * \param ppi_handle contains ppi structure to init
+ * \param pool pool to allocate the structure from, or NULL for the heap
  *
  * \return none
  */
-void ppi_init (struct ppi **ppi_handle) {
+void ppi_init (struct ppi **ppi_handle, flow_pool_t *pool) {
     if (*ppi_handle != NULL) {
-        ppi_delete(ppi_handle);
+        ppi_delete(ppi_handle, pool);
     }
 
-    *ppi_handle = calloc(1, sizeof(struct ppi));
+    *ppi_handle = flow_pool_calloc(pool, sizeof(struct ppi));
     if (*ppi_handle == NULL) {
         /* Allocation failed */
         joy_log_err("malloc failed");
@@ -123,7 +122,7 @@ void ppi_update (struct ppi *ppi,
             ppi->pkt_info[ppi->np].len = size_payload;
             ppi->pkt_info[ppi->np].opt_len = opt_len;
         if (header != NULL) {
-            ppi->pkt_info[ppi->np].time = header->ts;
+            ppi->pkt_info[ppi->np].time = joy_time_delta(&ppi->time_base, &header->ts);
         }
             if (opt_len) {
                 memcpy_s(ppi->pkt_info[ppi->np].opts,
@@ -145,11 +144,7 @@ void ppi_update (struct ppi *ppi,
  */
 void ppi_print_json (const struct ppi *x1, const struct ppi *x2, zfile f) {
 
-    pkt_info_print_interleaved(f, 
-                               x1->pkt_info, 
-                               x1->np, 
-                               x2 ? x2->pkt_info : NULL, 
-                               x2 ? x2->np : 0);
+    pkt_info_print_interleaved(f, x1, x2);
 
 }
 
@@ -157,10 +152,11 @@ void ppi_print_json (const struct ppi *x1, const struct ppi *x2, zfile f) {
  * \brief Delete the memory of PPI struct.
  *
  * \param ppi_handle contains ppi structure to delete
+ * \param pool pool that the structure was allocated from, or NULL
  *
  * \return none
  */
-void ppi_delete (struct ppi **ppi_handle) { 
+void ppi_delete (struct ppi **ppi_handle, flow_pool_t *pool) { 
     struct ppi *ppi = *ppi_handle;
 
     if (ppi == NULL) {
@@ -168,7 +164,7 @@ void ppi_delete (struct ppi **ppi_handle) {
     }
 
     /* Free the memory and set to NULL */
-    free(ppi);
+    flow_pool_free(pool, ppi);
     *ppi_handle = NULL;
 }
 
@@ -384,11 +380,10 @@ static void pkt_info_process(zfile f,
                              const struct pkt_info *pkt_info, 
                              struct tcp_state *tcp_state, 
                              struct tcp_state *rev_tcp_state,
-                             struct timeval ts) {
+                             int64_t t_usec) {
     long int rseq, rack;
     char flags_string[9];
     const char *dir = "?";
-    struct timeval tmp;
 
     if (pkt_info->flags & TCP_SYN) {
         tcp_state->seq = pkt_info->seq;
@@ -431,7 +426,6 @@ static void pkt_info_process(zfile f,
         dir = ">";
     }
 
-    joy_timer_sub(&pkt_info->time, &ts, &tmp); 
     tcp_flags_to_string(pkt_info->flags, flags_string);
     zprintf(f, 
             "{\"seq\":%u,\"ack\":%u,\"rseq\":%ld,\"rack\":%ld,\"b\":%u,\"olen\":%u,\"dir\":\"%s\",\"t\":%u,\"flags\":\"%s\"", 
@@ -442,7 +436,7 @@ static void pkt_info_process(zfile f,
             pkt_info->len, 
             pkt_info->opt_len, 
             dir, 
-            joy_timeval_to_milliseconds(tmp), // note: not pkt_info->time 
+            joy_usec_to_milliseconds(t_usec), // note: not pkt_info->time 
             flags_string);
     tcp_opt_print_json(f, pkt_info->opts, pkt_info->opt_len);
     zprintf(f, "}");
@@ -451,14 +445,19 @@ static void pkt_info_process(zfile f,
 
 
 
+/* arrival time of packet i of x, in microseconds since the epoch */
+#define ppi_pkt_usec(x, i) joy_time_delta_to_usec(&(x)->time_base, (x)->pkt_info[i].time)
+
 static void pkt_info_print_interleaved(zfile f,
-                                       const struct pkt_info *pkt_info,
-                                       unsigned int np,
-                                       const struct pkt_info *pkt_info2,
-                                       unsigned int np2) {
+                                       const struct ppi *x1,
+                                       const struct ppi *x2) {
     
+    const struct pkt_info *pkt_info = x1->pkt_info;
+    const struct pkt_info *pkt_info2 = x2 ? x2->pkt_info : NULL;
+    unsigned int np = x1->np;
+    unsigned int np2 = x2 ? x2->np : 0;
     unsigned int i, j, imax, jmax;
-    struct timeval ts_last;
+    int64_t t_first, t1, t2;
     struct tcp_state tcp_state = {0, 0};
     struct tcp_state rev_tcp_state = {0,0};
 
@@ -471,22 +470,21 @@ static void pkt_info_print_interleaved(zfile f,
         }
 
         zprintf(f, ",\"ppi\":[");
-        ts_last = pkt_info[0].time;
+        t_first = ppi_pkt_usec(x1, 0);
         for (i=0; i < imax; i++) { 
             if (i) { 
                 zprintf(f, ",");
             }
-            pkt_info_process(f, &pkt_info[i], &tcp_state, &rev_tcp_state, ts_last);
+            pkt_info_process(f, &pkt_info[i], &tcp_state, &rev_tcp_state,
+                             ppi_pkt_usec(x1, i) - t_first);
         }
         zprintf(f, "]");        
 
     } else { /*  bidirectional tcp flow in (pkt_info, pkt_info2), interleaving needed */
 
-        if (joy_timer_lt(&pkt_info[0].time, &pkt_info2[0].time)) {
-            ts_last = pkt_info[0].time;
-        } else {
-            ts_last = pkt_info2[0].time;
-        }
+        t1 = ppi_pkt_usec(x1, 0);
+        t2 = ppi_pkt_usec(x2, 0);
+        t_first = (t1 < t2) ? t1 : t2;
 
         jmax = np2 > glb_config->num_pkts ? glb_config->num_pkts : np2;
         if (!imax || !jmax) {
@@ -496,25 +494,17 @@ static void pkt_info_print_interleaved(zfile f,
         i = j = 0;
         while ((i < imax) || (j < jmax)) {      
           
-            if (i >= imax) {  /* record list is exhausted, so use twin */
-                pkt_info_process(f, &pkt_info2[j], &rev_tcp_state, &tcp_state, ts_last);
-                j++;
-            } else if (j >= jmax) {  /* twin list is exhausted, so use record */
-                pkt_info_process(f, &pkt_info[i], &tcp_state, &rev_tcp_state, ts_last);
-                i++;
-            } else { /* neither list is exhausted, so use list with lowest time */     
-
-                    if (joy_timer_lt(&pkt_info[i].time, &pkt_info2[j].time)) {
-                        pkt_info_process(f, &pkt_info[i], &tcp_state, &rev_tcp_state, ts_last);
-                        if (i < imax) {
-                            i++;
-                        }
-                    } else {
-                        pkt_info_process(f, &pkt_info2[j], &rev_tcp_state, &tcp_state, ts_last);
-                        if (j < jmax) {
-                            j++;
-                        }
-                    }
+            /* use the list with the lowest time, until one is exhausted */
+            if (j >= jmax || (i < imax && t1 < t2)) {
+                pkt_info_process(f, &pkt_info[i], &tcp_state, &rev_tcp_state, t1 - t_first);
+                if (++i < imax) {
+                    t1 = ppi_pkt_usec(x1, i);
+                }
+            } else {
+                pkt_info_process(f, &pkt_info2[j], &rev_tcp_state, &tcp_state, t2 - t_first);
+                if (++j < jmax) {
+                    t2 = ppi_pkt_usec(x2, j);
+                }
             }
             if (!((i == imax) & (j == jmax))) { /* we are done */
                 zprintf(f, ",");
@@ -444,6 +444,7 @@ int host_flow_table_add_tcp(int all_sockets) {
     // Make a second call to GetTcpTable2 to get
     // the actual data we require
     if ((dwRetVal = GetTcpTable2(pTcpTable, &ulSize, TRUE)) == NO_ERROR) {
+	memset_s(&key, sizeof(flow_key_t), 0, sizeof(flow_key_t));
 	for (i = 0; i < (int)pTcpTable->dwNumEntries; i++) {
 	    if ((pTcpTable->table[i].dwRemoteAddr != 0) || (all_sockets)) {
 		IpAddr.S_un.S_addr = (u_long)pTcpTable->table[i].dwLocalAddr;
@@ -1074,6 +1075,7 @@ int get_host_flow_data(joy_ctx_data *ctx) {
             /* we can stop, end of filled in entries in table */
             break;
         }
+        memset_s(&twin, sizeof(flow_key_t), 0, sizeof(flow_key_t));
         twin.sa = record->key.da;
         twin.da = record->key.sa;
         twin.sp = record->key.dp;
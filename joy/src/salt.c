@@ -57,15 +57,16 @@ extern FILE *info;
  * \brief Initialize the memory of SALT struct.
  *
  * \param salt_handle contains salt structure to init
+ * \param pool pool to allocate the structure from, or NULL for the heap
  *
  * \return none
  */
-void salt_init(struct salt **salt_handle) {
+void salt_init(struct salt **salt_handle, flow_pool_t *pool) {
     if (*salt_handle != NULL) {
-        salt_delete(salt_handle);
+        salt_delete(salt_handle, pool);
     }
 
-    *salt_handle = calloc(1, sizeof(struct salt));
+    *salt_handle = flow_pool_calloc(pool, sizeof(struct salt));
     if (*salt_handle == NULL) {
         /* Allocation failed */
         joy_log_err("malloc failed");
@@ -128,7 +129,7 @@ void salt_update (struct salt *salt,
                 salt->op++;
             }
             salt->pkt_len[salt->idx] += payload_len;
-            salt->pkt_time[salt->idx] = *time;
+            salt->pkt_time[salt->idx] = joy_time_delta(&salt->pkt_time_base, time);
         }
     }
 
@@ -191,17 +192,18 @@ void salt_print_json (const struct salt *x1, const struct salt *x2, zfile f) {
  * \brief Delete the memory of SALT struct.
  *
  * \param salt_handle contains salt structure to delete
+ * \param pool pool that the structure was allocated from, or NULL
  *
  * \return none
  */
-void salt_delete (struct salt **salt_handle) {
+void salt_delete (struct salt **salt_handle, flow_pool_t *pool) {
 
     if (*salt_handle == NULL) {
         return;
     }
 
     /* Free the memory and set to NULL */
-    free(*salt_handle);
+    flow_pool_free(pool, *salt_handle);
     *salt_handle = NULL;
 }
 
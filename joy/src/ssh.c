@@ -746,17 +746,18 @@ static void ssh_process(struct ssh *cli,
  * \brief Initialize the memory of SSH struct.
  *
  * \param ssh_handle contains ssh structure to initialize
+ * \param pool pool to allocate the structure from, or NULL for the heap
  *
  * \return none
  */
-inline void ssh_init(struct ssh **ssh_handle) {
+inline void ssh_init(struct ssh **ssh_handle, flow_pool_t *pool) {
     int i;
 
     if (*ssh_handle != NULL) {
-        ssh_delete(ssh_handle);
+        ssh_delete(ssh_handle, pool);
     }
 
-    *ssh_handle = calloc(1, sizeof(struct ssh));
+    *ssh_handle = flow_pool_calloc(pool, sizeof(struct ssh));
     if (*ssh_handle == NULL) {
         /* Allocation failed */
         joy_log_err("malloc failed");
@@ -996,10 +997,11 @@ void ssh_print_json(const struct ssh *x1,
  * \brief Delete the memory of SSH struct.
  *
  * \param ssh_handle contains ssh structure to delete
+ * \param pool pool that the structure was allocated from, or NULL
  *
  * \return none
  */
-void ssh_delete(struct ssh **ssh_handle) {
+void ssh_delete(struct ssh **ssh_handle, flow_pool_t *pool) {
     int i;
     struct ssh *ssh = *ssh_handle;
 
@@ -1034,7 +1036,7 @@ void ssh_delete(struct ssh **ssh_handle) {
     }
 
     /* Free the memory and set to NULL */
-    free(ssh);
+    flow_pool_free(pool, ssh);
     *ssh_handle = NULL;
 }
 
@@ -1491,13 +1493,13 @@ static int ssh_test_handshake(void) {
         0x00, 0x00, 0x00, 0x0c, 0x0a, 0x15, 0x00, 0x00,
         0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
 
-    ssh_init(&cli);
+    ssh_init(&cli, NULL);
     ssh_update(cli, NULL, c_protocol, sizeof(c_protocol), 1);
     ssh_update(cli, NULL, c_kexinit, sizeof(c_kexinit), 1);
     ssh_update(cli, NULL, c_dhkex, sizeof(c_dhkex), 1);
     ssh_update(cli, NULL, c_newkeys, sizeof(c_newkeys), 1);
 
-    ssh_init(&srv);
+    ssh_init(&srv, NULL);
     ssh_update(srv, NULL, s_protocol, sizeof(s_protocol), 1);
     ssh_update(srv, NULL, s_kexinit, sizeof(s_kexinit), 1);
     ssh_update(srv, NULL, s_dhkex_newkeys, sizeof(s_dhkex_newkeys), 1);
@@ -1533,8 +1535,8 @@ static int ssh_test_handshake(void) {
         num_fails++;
     }
 
-    ssh_delete(&cli);
-    ssh_delete(&srv);
+    ssh_delete(&cli, NULL);
+    ssh_delete(&srv, NULL);
     return num_fails;
 }
 
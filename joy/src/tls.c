@@ -76,7 +76,6 @@
 
 #define MAX_HANDSHAKE_LENGTH 11000
 
-#define TLS_HDR_LEN 5
 #define TLS_HANDSHAKE_HDR_LEN 4
 
 /* TLS mutex lock */
@@ -95,15 +94,16 @@ static void tls_certificate_print_json(const tls_certificate_t *data, zfile f);
  * \brief Initialize the memory of TLS struct.
  *
  * \param tls_handle contains tls structure to initialize
+ * \param pool pool to allocate the structure from, or NULL for the heap
  *
  * \return
  */
-void tls_init (tls_t **tls_handle) {
+void tls_init (tls_t **tls_handle, flow_pool_t *pool) {
     if (*tls_handle != NULL) {
-        tls_delete(tls_handle);
+        tls_delete(tls_handle, pool);
     }
 
-    *tls_handle = calloc(1, sizeof(tls_t));
+    *tls_handle = flow_pool_calloc(pool, sizeof(tls_t));
     if (*tls_handle == NULL) {
         /* Allocation failed */
         joy_log_err("malloc failed");
@@ -115,10 +115,11 @@ void tls_init (tls_t **tls_handle) {
  * \brief Delete the memory of TLS struct.
  *
  * \param tls_handle contains tls structure to delete
+ * \param pool pool that the structure was allocated from, or NULL
  *
  * \return
  */
-void tls_delete (tls_t **tls_handle) {
+void tls_delete (tls_t **tls_handle, flow_pool_t *pool) {
     int i, j = 0;
     tls_t *r = *tls_handle;
 
@@ -196,7 +197,7 @@ void tls_delete (tls_t **tls_handle) {
     }
 
     /* Free the memory and set to NULL */
-    free(r);
+    flow_pool_free(pool, r);
     *tls_handle = NULL;
 }
 
@@ -1595,9 +1596,9 @@ static void tls_write_message_stats(tls_t *r,
         if (pkt_hdr == NULL) {
             /* The pcap_pkthdr is not available, cannot get timestamp */
             const struct timeval ts = {0,0};
-            r->times[r->op] = ts;
+            r->times[r->op] = joy_time_delta(&r->times_base, &ts);
         } else {
-            r->times[r->op] = pkt_hdr->ts;
+            r->times[r->op] = joy_time_delta(&r->times_base, &pkt_hdr->ts);
         }
     }
 
@@ -1605,6 +1606,53 @@ static void tls_write_message_stats(tls_t *r,
     r->op++;
 }
 
+/**
+ * \brief Process the header of a TLS record.
+ *
+ * The handshake data collected so far is parsed once the first record
+ * after the handshake comes in, and the stats of the record are written.
+ *
+ * \param r TLS structure pointer
+ * \param hdr Header of the record; only its TLS_HDR_LEN bytes are read
+ * \param header pcap header of the packet that the record starts in
+ *
+ * \return 0 for success, 1 if the TLS version failed its sanity check
+ */
+static int tls_record_header_process (tls_t *r,
+                                      const tls_header_t *hdr,
+                                      const struct pcap_pkthdr *header) {
+    if (r->done_handshake == 0 && r->handshake_buffer &&
+        (hdr->content_type == TLS_CONTENT_CHANGE_CIPHER_SPEC ||
+         hdr->content_type == TLS_CONTENT_ALERT ||
+         hdr->content_type == TLS_CONTENT_APPLICATION_DATA)) {
+        /*
+         * After the handshake phase.
+         * We need to parse the contents of the handshake data
+         * that we previously collected.
+         */
+        tls_handshake_buffer_parse(r);
+        free(r->handshake_buffer);
+        r->handshake_buffer = NULL;
+        r->handshake_length = 0;
+
+        /* Set flag indicating the handshake data has been parsed */
+        r->done_handshake = 1;
+
+        if (!r->version) {
+            /* Write the TLS version to record if empty */
+            if (tls_header_version_capture(r, hdr)) {
+                /* TLS version sanity check failed */
+                return 1;
+            }
+        }
+    }
+
+    /* Write the stats for this message */
+    tls_write_message_stats(r, hdr, header);
+
+    return 0;
+}
+
 /**
  * \brief Parse, process, and record TLS payload data.
  *
@@ -1635,9 +1683,8 @@ void tls_update (tls_t *r,
         return;
     }
 
-    /* Cast beginning of payload to a tls_header */
+    /* Cast beginning of payload to a tls_header; only its first byte is read here */
     hdr = (const tls_header_t*)data;
-    msg_len = tls_header_get_length(hdr);
 
     if (r->done_handshake == 0 &&
         !(hdr->content_type == TLS_CONTENT_CHANGE_CIPHER_SPEC ||
@@ -1700,44 +1747,57 @@ void tls_update (tls_t *r,
         r->seg_offset = 0;
     }
 
+    if (r->seg_hdr_len) {
+        /* The previous packet ended in the header of a message; complete it */
+        int hdr_rem = TLS_HDR_LEN - r->seg_hdr_len;
+
+        if (hdr_rem > rem_len) {
+            hdr_rem = rem_len;
+        }
+        memcpy_s(r->seg_hdr + r->seg_hdr_len, TLS_HDR_LEN - r->seg_hdr_len, data, hdr_rem);
+        r->seg_hdr_len += hdr_rem;
+        data += hdr_rem;
+        rem_len -= hdr_rem;
+        if (r->seg_hdr_len < TLS_HDR_LEN) {
+            return;
+        }
+        r->seg_hdr_len = 0;
+
+        hdr = (const tls_header_t*)r->seg_hdr;
+        msg_len = tls_header_get_length(hdr);
+        if (tls_record_header_process(r, hdr, header)) {
+            return;
+        }
+        if (msg_len > rem_len) {
+            /* The message goes on in the next packet */
+            r->seg_offset = msg_len - rem_len;
+            return;
+        }
+        rem_len -= msg_len;
+        data += msg_len;
+    }
+
     while (rem_len > 0) {
+        if (rem_len < TLS_HDR_LEN) {
+            /* The header itself is split; keep its start for the next packet */
+            if (!glb_config->ipfix_collect_port) {
+                memcpy_s(r->seg_hdr, TLS_HDR_LEN, data, rem_len);
+                r->seg_hdr_len = rem_len;
+            }
+            break;
+        }
         hdr = (const tls_header_t*)data;
         msg_len = tls_header_get_length(hdr);
 
-        if ((msg_len > rem_len) && (!glb_config->ipfix_collect_port)) {
+        if ((msg_len > rem_len - TLS_HDR_LEN) && (!glb_config->ipfix_collect_port)) {
             /* The message has been split into segments */
             r->seg_offset = msg_len - (rem_len - TLS_HDR_LEN);
         }
 
-        if (r->done_handshake == 0 && r->handshake_buffer &&
-            (hdr->content_type == TLS_CONTENT_CHANGE_CIPHER_SPEC ||
-             hdr->content_type == TLS_CONTENT_ALERT ||
-             hdr->content_type == TLS_CONTENT_APPLICATION_DATA)) {
-            /*
-             * After the handshake phase.
-             * We need to parse the contents of the handshake data
-             * that we previously collected.
-             */
-            tls_handshake_buffer_parse(r);
-            free(r->handshake_buffer);
-            r->handshake_buffer = NULL;
-            r->handshake_length = 0;
-
-            /* Set flag indicating the handshake data has been parsed */
-            r->done_handshake = 1;
-
-            if (!r->version) {
-                /* Write the TLS version to record if empty */
-                if (tls_header_version_capture(r, hdr)) {
-                    /* TLS version sanity check failed */
-                    return;
-                }
-            }
+        if (tls_record_header_process(r, hdr, header)) {
+            return;
         }
 
-        /* Write the stats for this message */
-        tls_write_message_stats(r, hdr, header);
-
         /* Skip to the next message */
         rem_len -= msg_len + TLS_HDR_LEN;
         data += msg_len + TLS_HDR_LEN;
@@ -1795,12 +1855,12 @@ static void zprintf_raw_as_hex_tls (zfile f, const unsigned char *data, unsigned
 }
 
 static void print_bytes_dir_time_tls(unsigned short int pkt_len, const char *dir,
-                                     struct timeval ts, tls_message_stat_t m,
+                                     int64_t ipt_usec, tls_message_stat_t m,
                                      const char *term, zfile f) {
     int i = 0;
 
     zprintf(f, "{\"b\":%u,\"dir\":\"%s\",\"ipt\":%u,\"tp\":%u",
-            pkt_len, dir, joy_timeval_to_milliseconds(ts), m.content_type);
+            pkt_len, dir, joy_usec_to_milliseconds(ipt_usec), m.content_type);
 
     if (m.num_handshakes) {
         /*
@@ -1829,11 +1889,12 @@ static void print_bytes_dir_time_tls(unsigned short int pkt_len, const char *dir
 }
 
 static void len_time_print_interleaved_tls (unsigned int op, const unsigned short *len, 
-    const struct timeval *time, const tls_message_stat_t *msg_stat,
+    const joy_time_delta_t *time, const joy_time_base_t *time_base, const tls_message_stat_t *msg_stat,
     unsigned int op2, const unsigned short *len2, 
-    const struct timeval *time2, const tls_message_stat_t *msg_stat2, zfile f) {
+    const joy_time_delta_t *time2, const joy_time_base_t *time_base2,
+    const tls_message_stat_t *msg_stat2, zfile f) {
     unsigned int i, j, imax, jmax;
-    struct timeval ts, ts_last, ts_start, tmp;
+    int64_t t, t1, t2, t_last;
     unsigned int pkt_len;
     const char *dir;
     tls_message_stat_t stat;
@@ -1842,77 +1903,49 @@ static void len_time_print_interleaved_tls (unsigned int op, const unsigned shor
 
     if (len2 == NULL) {
       
-        ts_start = *time;
-
         imax = op > NUM_PKT_LEN_TLS ? NUM_PKT_LEN_TLS : op;
         if (imax == 0) { 
             ; /* no packets had data, so we print out nothing */
         } else {
-            for (i = 0; i < imax-1; i++) {
-                    if (i > 0) {
-                        joy_timer_sub(&time[i], &time[i-1], &ts);
-                    } else {
-                        joy_timer_clear(&ts);
-                    }
-                    print_bytes_dir_time_tls(len[i], OUT, ts, msg_stat[i], ",", f);
-            }
-            if (i == 0) {        /* this code could be simplified */    
-                    joy_timer_clear(&ts);  
-            } else {
-                    joy_timer_sub(&time[i], &time[i-1], &ts);
+            print_bytes_dir_time_tls(len[0], OUT, 0, msg_stat[0], imax > 1 ? "," : "", f);
+            for (i = 1; i < imax; i++) {
+                    print_bytes_dir_time_tls(len[i], OUT, (int64_t)time[i] - time[i-1], msg_stat[i],
+                                             i < imax-1 ? "," : "", f);
             }
-            print_bytes_dir_time_tls(len[i], OUT, ts, msg_stat[i], "", f);
         }
         zprintf(f, "]"); 
     } else {
 
-        if (joy_timer_lt(time, time2)) {
-            ts_start = *time;
-        } else {
-            ts_start = *time2;
-        }
+        /* arrival times are merged as microseconds since the epoch */
+        t1 = joy_time_delta_to_usec(time_base, time[0]);
+        t2 = joy_time_delta_to_usec(time_base2, time2[0]);
+        t_last = (t1 < t2) ? t1 : t2;
 
         imax = op > NUM_PKT_LEN_TLS ? NUM_PKT_LEN_TLS : op;
         jmax = op2 > NUM_PKT_LEN_TLS ? NUM_PKT_LEN_TLS : op2;
         i = j = 0;
-        ts_last = ts_start;
         while ((i < imax) || (j < jmax)) {      
 
-            if (i >= imax) {  /* record list is exhausted, so use twin */
-                    dir = OUT;
-                    ts = time2[j];
-                    pkt_len = len2[j];
-                    stat = msg_stat2[j];
-                    j++;
-            } else if (j >= jmax) {  /* twin list is exhausted, so use record */
-                    dir = IN;
-                    ts = time[i];
+            /* use the list with the lowest time, until one is exhausted */
+            if (j >= jmax || (i < imax && t1 < t2)) {
+                    t = t1;
                     pkt_len = len[i];
                     stat = msg_stat[i];
-                    i++;
-            } else { /* neither list is exhausted, so use list with lowest time */     
-
-                    if (joy_timer_lt(&time[i], &time2[j])) {
-                        ts = time[i];
-                        pkt_len = len[i];
-                        stat = msg_stat[i];
-                        dir = IN;
-                        if (i < imax) {
-                            i++;
-                        }
-                    } else {
-                        ts = time2[j];
-                        pkt_len = len2[j];
-                        stat = msg_stat2[j];
-                        dir = OUT;
-                        if (j < jmax) {
-                            j++;
-                        }
+                    dir = IN;
+                    if (++i < imax) {
+                        t1 = joy_time_delta_to_usec(time_base, time[i]);
+                    }
+            } else {
+                    t = t2;
+                    pkt_len = len2[j];
+                    stat = msg_stat2[j];
+                    dir = OUT;
+                    if (++j < jmax) {
+                        t2 = joy_time_delta_to_usec(time_base2, time2[j]);
                     }
             }
-            joy_timer_sub(&ts, &ts_last, &tmp);
-            print_bytes_dir_time_tls(pkt_len, dir, tmp, stat, "", f);
-            ts_last = ts;
+            print_bytes_dir_time_tls(pkt_len, dir, t - t_last, stat, "", f);
+            t_last = t;
             if (!((i == imax) & (j == jmax))) { /* we are done */
                     zprintf(f, ",");
             }
@@ -2249,14 +2282,16 @@ void tls_print_json (const tls_t *data,
     /* Print out TLS application data lengths and times, if any */
     if (data->op) {
         if (data_twin) {
-                len_time_print_interleaved_tls(data->op, data->lengths, data->times, data->msg_stats,
-                                       data_twin->op, data_twin->lengths, data_twin->times, data_twin->msg_stats, f);
+                len_time_print_interleaved_tls(data->op, data->lengths, data->times, &data->times_base,
+                                       data->msg_stats, data_twin->op, data_twin->lengths, data_twin->times,
+                                       &data_twin->times_base, data_twin->msg_stats, f);
         } else {
             /*
              * unidirectional TLS does not typically happen, but if it
              * does, we need to pass in zero/NULLs, since there is no twin
              */
-                len_time_print_interleaved_tls(data->op, data->lengths, data->times, data->msg_stats, 0, NULL, NULL, NULL, f);
+                len_time_print_interleaved_tls(data->op, data->lengths, data->times, &data->times_base,
+                                       data->msg_stats, 0, NULL, NULL, NULL, NULL, f);
         }
     }
 
@@ -2367,7 +2402,7 @@ static int tls_test_certificate_parsing(void) {
         const char *filename = test_cert_filenames[i];
 
         /* Preprare the temporary record */
-        tls_init(&tmp_tls_record);
+        tls_init(&tmp_tls_record, NULL);
         cert_record = &tmp_tls_record->certificates[0];
         tmp_tls_record->num_certificates++;
 
@@ -2858,7 +2893,7 @@ end_loop:
         if (fp) {
             fclose(fp);
         }
-        tls_delete(&tmp_tls_record);
+        tls_delete(&tmp_tls_record, NULL);
     }
 
     return num_fails;
@@ -2914,7 +2949,7 @@ static int tls_test_extract_client_hello(const unsigned char *data,
     int num_fails = 0;
     int cmp_ind;
 
-    tls_init(&record);
+    tls_init(&record, NULL);
 
     tls_hdr = (const tls_header_t*)data;
     body_len = tls_handshake_get_length(&tls_hdr->handshake);
@@ -3055,7 +3090,7 @@ static int tls_test_extract_client_hello(const unsigned char *data,
 
 end:
     /* Cleanup */
-    tls_delete(&record);
+    tls_delete(&record, NULL);
 
     return num_fails;
 }
@@ -3070,7 +3105,7 @@ static int tls_test_extract_server_hello(const unsigned char *data,
     int num_fails = 0;
     int cmp_ind;
 
-    tls_init(&record);
+    tls_init(&record, NULL);
 
     tls_hdr = (const tls_header_t*)data;
     body_len = tls_handshake_get_length(&tls_hdr->handshake);
@@ -3165,7 +3200,7 @@ static int tls_test_extract_server_hello(const unsigned char *data,
 
 end:
     /* Cleanup */
-    tls_delete(&record);
+    tls_delete(&record, NULL);
 
     return num_fails;
 }
@@ -3222,7 +3257,7 @@ static int tls_test_handshake_hello_get_version(void) {
     unsigned char tls_1_3[] = {0x03, 0x04};
     int num_fails = 0;
 
-    tls_init(&record);
+    tls_init(&record, NULL);
 
     tls_handshake_hello_get_version(record, ssl_v3);
     if (record->version != TLS_VERSION_SSLV3) {
@@ -3254,7 +3289,7 @@ static int tls_test_handshake_hello_get_version(void) {
         num_fails++;
     }
 
-    tls_delete(&record);
+    tls_delete(&record, NULL);
 
     return num_fails;
 }
@@ -3303,6 +3338,51 @@ static int tls_test_calculate_handshake_length(void) {
     return num_fails;
 }
 
+static int tls_test_split_record_header(void) {
+    tls_t *record = NULL;
+    /* a 3 byte record, then the first 2 bytes of the next header */
+    const unsigned char pkt1[] = { 0x17, 0x03, 0x03, 0x00, 0x03, 0xaa, 0xaa, 0xaa,
+                                   0x17, 0x03 };
+    /* one byte more of that header */
+    const unsigned char pkt2[] = { 0x03 };
+    /* the rest of it and its 4 byte record, then a 1 byte record */
+    const unsigned char pkt3[] = { 0x00, 0x04, 0xbb, 0xbb, 0xbb, 0xbb,
+                                   0x15, 0x03, 0x03, 0x00, 0x01, 0xcc };
+    int num_fails = 0;
+
+    tls_init(&record, NULL);
+    record->done_handshake = 1;
+
+    tls_update(record, NULL, pkt1, sizeof(pkt1), 1);
+    if (record->op != 1 || record->seg_hdr_len != 2) {
+        joy_log_err("fail, expected 1 record and 2 header bytes, got %u and %u",
+                    record->op, record->seg_hdr_len);
+        num_fails++;
+    }
+
+    tls_update(record, NULL, pkt2, sizeof(pkt2), 1);
+    if (record->op != 1 || record->seg_hdr_len != 3) {
+        joy_log_err("fail, expected 1 record and 3 header bytes, got %u and %u",
+                    record->op, record->seg_hdr_len);
+        num_fails++;
+    }
+
+    tls_update(record, NULL, pkt3, sizeof(pkt3), 1);
+    if (record->op != 3 || record->seg_hdr_len != 0 || record->seg_offset != 0) {
+        joy_log_err("fail, expected 3 records, got %u", record->op);
+        num_fails++;
+    } else if (record->lengths[1] != 4 || record->lengths[2] != 1 ||
+               record->msg_stats[1].content_type != TLS_CONTENT_APPLICATION_DATA ||
+               record->msg_stats[2].content_type != TLS_CONTENT_ALERT) {
+        joy_log_err("fail, split record header misread");
+        num_fails++;
+    }
+
+    tls_delete(&record, NULL);
+
+    return num_fails;
+}
+
 void tls_unit_test() {
     int num_fails = 0;
 
@@ -3315,6 +3395,8 @@ void tls_unit_test() {
 
     num_fails += tls_test_initial_handshake();
 
+    num_fails += tls_test_split_record_header();
+
     num_fails += tls_test_certificate_parsing();
 
     if (num_fails) {
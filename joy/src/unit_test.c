@@ -48,6 +48,20 @@
 #include "err.h"
 #include "safe_lib.h"
 #include "joy_api.h"
+#include "flow_timer.h"
+#include "flow_table.h"
+#include "flow_pool.h"
+#include "pkt_proc.h"
+#include "pkt_ring.h"
+#include "pkt_dedup.h"
+#include "json_buf.h"
+#include "output_writer.h"
+#include "zsink.h"
+#include "joybin.h"
+#include "joyarrow.h"
+#include "payload_stats.h"
+#include "pcap_mmap.h"
+#include "af_packet.h"
 
 /**
  * \fn int main ()
@@ -80,6 +94,48 @@ int main (void) {
     /* Test p2f.c */
     p2f_unit_test();
 
+    /* Test flow_timer.c */
+    flow_timer_unit_test();
+
+    /* Test flow_table.c */
+    flow_table_unit_test();
+
+    /* Test flow_pool.c */
+    flow_pool_unit_test();
+
+    /* Test pkt_proc.c */
+    pkt_proc_unit_test();
+
+    /* Test pkt_ring.c */
+    pkt_ring_unit_test();
+
+    /* Test pkt_dedup.c */
+    pkt_dedup_unit_test();
+
+    /* Test json_buf.c */
+    json_buf_unit_test();
+
+    /* Test output_writer.c */
+    output_writer_unit_test();
+
+    /* Test zsink.c */
+    zsink_unit_test();
+
+    /* Test joybin.c */
+    joybin_unit_test();
+
+    /* Test joyarrow.c */
+    joyarrow_unit_test();
+
+    /* Test payload_stats.c */
+    payload_stats_unit_test();
+
+    /* Test pcap_mmap.c */
+    pcap_mmap_unit_test();
+
+    /* Test af_packet.c */
+    af_packet_unit_test();
+
     /* Test all feature modules */
     unit_test_all_features(feature_list);
   
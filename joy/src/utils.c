@@ -354,6 +354,89 @@ unsigned int joy_timeval_to_milliseconds(struct timeval ts) {
     return result;
 }
 
+/**
+ * \brief Convert a timeval to microseconds since the epoch.
+ * \param t Timeval
+ * \return Microseconds
+ */
+int64_t joy_timeval_to_usec(const struct timeval *t) {
+    return (int64_t)t->tv_sec * 1000000 + t->tv_usec;
+}
+
+/**
+ * \brief Get the offset of a time from a base time.
+ *
+ * The first time given for a base becomes the base, and has offset 0.
+ *
+ * \param base Base time
+ * \param t Time
+ * \return Offset of \p t from the base, in microseconds (saturated)
+ */
+joy_time_delta_t joy_time_delta(joy_time_base_t *base, const struct timeval *t) {
+    int64_t d;
+
+    if (!base->set) {
+        base->ns = joy_timeval_to_usec(t) * 1000;
+        base->set = 1;
+        return 0;
+    }
+    d = joy_timeval_to_usec(t) - base->ns / 1000;
+    if (d > INT32_MAX) {
+        return INT32_MAX;
+    }
+    if (d < INT32_MIN) {
+        return INT32_MIN;
+    }
+    return (joy_time_delta_t)d;
+}
+
+/**
+ * \brief Convert an offset from a base time to microseconds since the epoch.
+ * \param base Base time
+ * \param d Offset
+ * \return Microseconds
+ */
+int64_t joy_time_delta_to_usec(const joy_time_base_t *base, joy_time_delta_t d) {
+    return base->ns / 1000 + d;
+}
+
+/**
+ * \brief Convert an offset from a base time to a timeval.
+ * \param base Base time
+ * \param d Offset
+ * \param[out] t Timeval
+ * \return none
+ */
+void joy_time_delta_to_timeval(const joy_time_base_t *base, joy_time_delta_t d,
+                               struct timeval *t) {
+    int64_t usec = joy_time_delta_to_usec(base, d);
+    int64_t sec = usec / 1000000;
+
+    if (usec % 1000000 < 0) {
+        sec--;
+    }
+    t->tv_sec = (time_t)sec;
+    t->tv_usec = (long)(usec - sec * 1000000);
+}
+
+/**
+ * \brief Calculate the milliseconds representation of a time difference.
+ *
+ * This gives the same result as joy_timeval_to_milliseconds() on the
+ * timeval that joy_timer_sub() produces for the same difference.
+ *
+ * \param usec Time difference in microseconds
+ * \return unsigned int - Milliseconds
+ */
+unsigned int joy_usec_to_milliseconds(int64_t usec) {
+    int64_t ms = usec / 1000;
+
+    if (usec % 1000 < 0) {
+        ms--;
+    }
+    return (unsigned int)ms;
+}
+
 void joy_log_timestamp(char *log_ts) {
     struct timeval tv;
     time_t nowtime;
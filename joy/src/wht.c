@@ -45,6 +45,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include "wht.h"     
+#include "payload_stats.h"
 #include "config.h"
 #include "err.h"
 
@@ -55,15 +56,16 @@ extern FILE *info;
  * \brief Initialize the memory of WHT struct.
  *
  * \param wht_handle contains wht structure to init
+ * \param pool pool to allocate the structure from, or NULL for the heap
  *
  * \return none
  */
-__inline void wht_init (wht_t **wht_handle) {
+__inline void wht_init (wht_t **wht_handle, flow_pool_t *pool) {
     if (*wht_handle != NULL) {
-        wht_delete(wht_handle);
+        wht_delete(wht_handle, pool);
     }
 
-    *wht_handle = calloc(1, sizeof(wht_t));
+    *wht_handle = flow_pool_calloc(pool, sizeof(wht_t));
     if (*wht_handle == NULL) {
         /* Allocation failed */
         joy_log_err("malloc failed");
@@ -71,23 +73,6 @@ __inline void wht_init (wht_t **wht_handle) {
     }
 }
 
-/*
- * process 4 bytes into transform
- *    pointers are sanity checked before calling this __inline function
- */
-static __inline void wht_process_four_bytes (wht_t *wht, const uint8_t *d) {
-    int16_t x[4];
-  
-    x[0] = d[0] + d[2];
-    x[1] = d[1] + d[3];
-    x[2] = d[0] - d[2];
-    x[3] = d[1] - d[3];
-    wht->spectrum[0] += (x[0] + x[1]);
-    wht->spectrum[1] += (x[0] - x[1]);
-    wht->spectrum[2] += (x[2] + x[3]);
-    wht->spectrum[3] += (x[2] - x[3]);
-}
-
 /**
  * \fn void wht_update (wht_t *wht,
  *                      const struct pcap_pkthdr *header,
@@ -102,7 +87,7 @@ static __inline void wht_process_four_bytes (wht_t *wht, const uint8_t *d) {
  * \return none
  */
 void wht_update (wht_t *wht, const struct pcap_pkthdr *header, const void *data, unsigned int len, unsigned int report_wht) {
-    const uint8_t *d = data;
+    payload_stats_t stats;
 
     /* sanity checks */
     if (data == NULL) {
@@ -114,21 +99,30 @@ void wht_update (wht_t *wht, const struct pcap_pkthdr *header, const void *data,
 
     /* see if we should process */
     if (report_wht) {
-        wht->b += len;
-        while (len > 4) {
-            wht_process_four_bytes(wht, d);
-            d += 4;
-            len -= 4;
-        }
-        if (len > 0) {
-            uint8_t buffer[4] = { 0, 0, 0, 0 };
-      
-            memcpy_s(buffer, len, d, len);
-            wht_process_four_bytes(wht, buffer);
-        }
+        payload_stats_scan(data, len, NULL, 0, NULL, NULL, &stats);
+        wht_update_spectrum(wht, len, stats.wht);
     }
 }
 
+/**
+ * \fn void wht_update_spectrum (wht_t *wht,
+                                 unsigned int len,
+                                 const int64_t spectrum[4])
+ * \brief add the spectrum of a payload, from payload_stats_scan(), into a
+ *        walsh-hadamard structure
+ * \param wht point to the structure
+ * \param len length of the payload
+ * \param spectrum unscaled spectrum of the payload
+ * \return none
+ */
+void wht_update_spectrum (wht_t *wht, unsigned int len, const int64_t spectrum[4]) {
+    wht->b += len;
+    wht->spectrum[0] += (int32_t)spectrum[0];
+    wht->spectrum[1] += (int32_t)spectrum[1];
+    wht->spectrum[2] += (int32_t)spectrum[2];
+    wht->spectrum[3] += (int32_t)spectrum[3];
+}
+
 /* print function for scaled walsh-hadamard structure */
 static void wht_printf_scaled (const wht_t *wht, zfile f) {
     unsigned int num_bytes = wht->b;
@@ -189,10 +183,11 @@ void wht_print_json (const wht_t *w1, const wht_t *w2, zfile f) {
  * \brief Delete the memory of WHT struct.
  *
  * \param wht_handle contains wht structure to delete
+ * \param pool pool that the structure was allocated from, or NULL
  *
  * \return none
  */
-void wht_delete (wht_t **wht_handle) {
+void wht_delete (wht_t **wht_handle, flow_pool_t *pool) {
     wht_t *wht = *wht_handle;
 
     if (wht == NULL) {
@@ -200,7 +195,7 @@ void wht_delete (wht_t **wht_handle) {
     }
 
     /* Free the memory and set to NULL */
-    free(wht);
+    flow_pool_free(pool, wht);
     *wht_handle = NULL;
 }
 
@@ -228,22 +223,22 @@ void wht_unit_test() {
           255, 254, 253, 252
     };
 
-    wht_init(&wht);
+    wht_init(&wht, NULL);
     wht_update(wht, header, buffer1, sizeof(buffer1), 1);
 
-    wht_init(&wht);
+    wht_init(&wht, NULL);
     wht_update(wht, header, buffer2, sizeof(buffer2), 1);
 
-    wht_init(&wht);
+    wht_init(&wht, NULL);
     wht_update(wht, header, buffer3, sizeof(buffer3), 1);
 
-    wht_init(&wht);
-    wht_init(&wht2);
+    wht_init(&wht, NULL);
+    wht_init(&wht2, NULL);
     wht_update(wht, header, buffer4, 1, 1); /* note: only reading first byte */
     wht_update(wht, header, buffer4, 1, 1); /* note: only reading first byte */
     wht_update(wht, header, buffer4, 1, 1); /* note: only reading first byte */
 
-    wht_delete(&wht);
-    wht_delete(&wht2);
+    wht_delete(&wht, NULL);
+    wht_delete(&wht2, NULL);
 } 
 
@@ -0,0 +1,676 @@
+/*
+ *
+ * Copyright (c) 2018 Cisco Systems, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials provided
+ *   with the distribution.
+ *
+ *   Neither the name of the Cisco Systems, Inc. nor the names of its
+ *   contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/**
+ * \file zsink.c
+ *
+ * \brief gzip compressed output file, compressed on a pool of threads
+ *
+ ** The blocks of a sink form a ring, and each block goes through the
+ *  states free, filled and done.  The thread that writes to the sink
+ *  fills block fill_seq; when it is full, the block is handed to the
+ *  compressing threads, and the writer moves on to the next block,
+ *  waiting for it to be free if need be.  A compressing thread takes
+ *  block compress_seq, compresses it without holding the lock, and
+ *  marks it done.  Then, unless another thread is at it already, it
+ *  writes out the done blocks from write_seq on, in order, and frees
+ *  them.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "joy_config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <pthread.h>
+#include "safe_lib.h"
+#include "p2f.h"
+#include "config.h"
+#include "zsink.h"
+#include "err.h"
+
+#ifdef USE_GZIP
+
+/** the block of a sequence number */
+#define zsink_block(z, seq) (&(z)->blocks[(seq) % (z)->num_blocks])
+
+/** gzip wrapper and largest window, for deflateInit2() */
+#define ZSINK_GZIP_WINDOW_BITS (15 + 16)
+
+/** memLevel for deflateInit2(), the zlib default */
+#define ZSINK_MEM_LEVEL 8
+
+/**
+ * \brief Compress a block into a gzip member.
+ *
+ * \param strm Deflate stream of the calling thread
+ * \param b Block
+ * \return ok, failure
+ */
+static joy_status_e zsink_compress (z_stream *strm, zsink_block_t *b) {
+    unsigned char *out;
+    size_t size;
+
+    b->out_len = 0;
+    if (deflateReset(strm) != Z_OK) {
+        return failure;
+    }
+    size = deflateBound(strm, (uLong)b->in_len);
+    if (size > b->out_size) {
+        out = realloc(b->out, size);
+        if (out == NULL) {
+            return failure;
+        }
+        b->out = out;
+        b->out_size = size;
+    }
+
+    strm->next_in = b->in;
+    strm->avail_in = (uInt)b->in_len;
+    strm->next_out = b->out;
+    strm->avail_out = (uInt)b->out_size;
+    if (deflate(strm, Z_FINISH) != Z_STREAM_END) {
+        return failure;
+    }
+    b->out_len = strm->total_out;
+
+    return ok;
+}
+
+/**
+ * \brief Write out the done blocks, in order, and free them.
+ *
+ * Called with the lock held; the lock is let go while writing.  Only
+ * one thread writes at a time; the others leave the blocks that they
+ * finish to it.
+ *
+ * \param z Sink
+ * \return none
+ */
+static void zsink_write_done (zsink_t *z) {
+    zsink_block_t *b;
+
+    if (z->writing) {
+        return;
+    }
+    z->writing = 1;
+    while (z->write_seq != z->fill_seq && zsink_block(z, z->write_seq)->state == ZSINK_BLOCK_DONE) {
+        b = zsink_block(z, z->write_seq);
+        pthread_mutex_unlock(&z->lock);
+        if (b->out_len && fwrite(b->out, 1, b->out_len, z->f) != b->out_len) {
+            if (!z->failed) {
+                joy_log_err("could not write compressed output");
+            }
+            z->failed = 1;
+        }
+        pthread_mutex_lock(&z->lock);
+        b->in_len = 0;
+        b->state = ZSINK_BLOCK_FREE;
+        z->write_seq++;
+        pthread_cond_broadcast(&z->room);
+    }
+    z->writing = 0;
+}
+
+/**
+ * \brief Body of a compressing thread.
+ *
+ * \param arg Sink
+ * \return NULL
+ */
+static void *zsink_thread_main (void *arg) {
+    zsink_t *z = (zsink_t *)arg;
+    zsink_block_t *b;
+    z_stream strm;
+    joy_status_e rc;
+    int ready;
+
+    memset_s(&strm, sizeof(z_stream), 0x00, sizeof(z_stream));
+    ready = (deflateInit2(&strm, z->level, Z_DEFLATED, ZSINK_GZIP_WINDOW_BITS,
+                          ZSINK_MEM_LEVEL, Z_DEFAULT_STRATEGY) == Z_OK);
+
+    pthread_mutex_lock(&z->lock);
+    while (1) {
+        while (!z->stop && z->compress_seq == z->fill_seq) {
+            pthread_cond_wait(&z->work, &z->lock);
+        }
+        if (z->compress_seq == z->fill_seq) {
+            break;
+        }
+        b = zsink_block(z, z->compress_seq);
+        z->compress_seq++;
+        pthread_mutex_unlock(&z->lock);
+
+        rc = ready ? zsink_compress(&strm, b) : failure;
+
+        pthread_mutex_lock(&z->lock);
+        if (rc != ok) {
+            if (!z->failed) {
+                joy_log_err("could not compress a block of output");
+            }
+            z->failed = 1;
+            b->out_len = 0;
+        }
+        b->state = ZSINK_BLOCK_DONE;
+        zsink_write_done(z);
+    }
+    pthread_mutex_unlock(&z->lock);
+
+    if (ready) {
+        deflateEnd(&strm);
+    }
+    return NULL;
+}
+
+/**
+ * \brief Free a sink and its blocks.
+ *
+ * \param z Sink
+ * \return none
+ */
+static void zsink_free (zsink_t *z) {
+    unsigned int i;
+
+    if (z->blocks != NULL) {
+        for (i = 0; i < z->num_blocks; i++) {
+            free(z->blocks[i].in);
+            free(z->blocks[i].out);
+        }
+        free(z->blocks);
+        pthread_mutex_destroy(&z->lock);
+        pthread_cond_destroy(&z->work);
+        pthread_cond_destroy(&z->room);
+    }
+    free(z);
+}
+
+/**
+ * \brief Make a sink that compresses on threads.
+ *
+ * \param f File to write to; it is closed if the sink cannot be made
+ * \param num_threads Number of compressing threads
+ * \param level zlib compression level, 0 for the default
+ * \return The sink, or NULL
+ */
+static zsink_t *zsink_start (FILE *f, unsigned int num_threads, unsigned int level) {
+    zsink_t *z;
+    unsigned int i;
+
+    z = calloc(1, sizeof(zsink_t));
+    if (z == NULL) {
+        fclose(f);
+        return NULL;
+    }
+    if (num_threads > ZSINK_MAX_THREADS) {
+        num_threads = ZSINK_MAX_THREADS;
+    }
+    z->f = f;
+    z->level = level ? (int)level : Z_DEFAULT_COMPRESSION;
+    z->num_blocks = 2 * num_threads;
+    z->blocks = calloc(z->num_blocks, sizeof(zsink_block_t));
+    if (z->blocks == NULL) {
+        joy_log_err("could not allocate the output blocks");
+        fclose(f);
+        free(z);
+        return NULL;
+    }
+    pthread_mutex_init(&z->lock, NULL);
+    pthread_cond_init(&z->work, NULL);
+    pthread_cond_init(&z->room, NULL);
+
+    for (i = 0; i < num_threads; i++) {
+        if (pthread_create(&z->threads[i], NULL, zsink_thread_main, z) != 0) {
+            joy_log_err("could not start output compression thread %u", i);
+            break;
+        }
+    }
+    z->num_threads = i;
+    if (z->num_threads == 0) {
+        fclose(f);
+        zsink_free(z);
+        return NULL;
+    }
+
+    return z;
+}
+
+/**
+ * \brief Make a sink around a gzFile.
+ *
+ * \param gz The gzFile, or NULL
+ * \return The sink, or NULL
+ */
+static zsink_t *zsink_gz (gzFile gz) {
+    zsink_t *z;
+
+    if (gz == NULL) {
+        return NULL;
+    }
+    z = calloc(1, sizeof(zsink_t));
+    if (z == NULL) {
+        gzclose(gz);
+        return NULL;
+    }
+    z->gz = gz;
+
+    return z;
+}
+
+/**
+ * \brief Put the compression level into a gzopen() mode.
+ *
+ * \param mode Mode as given to zopen()
+ * \param gz_mode Buffer for the mode
+ * \param size Size of the buffer
+ * \return gz_mode
+ */
+static const char *zsink_gz_mode (const char *mode, char *gz_mode, size_t size) {
+    if (glb_config->compress_level) {
+        snprintf(gz_mode, size, "%s%u", mode, glb_config->compress_level);
+    } else {
+        snprintf(gz_mode, size, "%s", mode);
+    }
+    return gz_mode;
+}
+
+/**
+ * \brief Open a file for compressed output.
+ *
+ * The compress_threads and compress_level settings of the
+ * configuration are used.
+ *
+ * \param fname Name of the file
+ * \param mode "w", or another writing mode of fopen()
+ * \return The sink, or NULL
+ */
+zsink_t *zsink_open (const char *fname, const char *mode) {
+    char gz_mode[16];
+    FILE *f;
+
+    if (glb_config->compress_threads == 0) {
+        return zsink_gz(gzopen(fname, zsink_gz_mode(mode, gz_mode, sizeof(gz_mode))));
+    }
+    f = fopen(fname, "wb");
+    if (f == NULL) {
+        return NULL;
+    }
+    return zsink_start(f, glb_config->compress_threads, glb_config->compress_level);
+}
+
+/**
+ * \brief Compress output to a file that is open already.
+ *
+ * \param f File, for instance stdout; it is closed with the sink
+ * \param mode "w", or another writing mode of fopen()
+ * \return The sink, or NULL
+ */
+zsink_t *zsink_attach (FILE *f, const char *mode) {
+    char gz_mode[16];
+
+    if (glb_config->compress_threads == 0) {
+#ifdef WIN32
+        return zsink_gz(gzdopen(_fileno(f), zsink_gz_mode(mode, gz_mode, sizeof(gz_mode))));
+#else
+        return zsink_gz(gzdopen(fileno(f), zsink_gz_mode(mode, gz_mode, sizeof(gz_mode))));
+#endif
+    }
+    return zsink_start(f, glb_config->compress_threads, glb_config->compress_level);
+}
+
+/**
+ * \brief Hand the block being filled to the compressing threads.
+ *
+ * Waits until the next block is free.
+ *
+ * \param z Sink
+ * \return none
+ */
+static void zsink_submit (zsink_t *z) {
+    pthread_mutex_lock(&z->lock);
+    zsink_block(z, z->fill_seq)->state = ZSINK_BLOCK_FILLED;
+    z->fill_seq++;
+    pthread_cond_signal(&z->work);
+    while (zsink_block(z, z->fill_seq)->state != ZSINK_BLOCK_FREE) {
+        pthread_cond_wait(&z->room, &z->lock);
+    }
+    pthread_mutex_unlock(&z->lock);
+}
+
+/**
+ * \brief Make room for len more bytes in a block.
+ *
+ * \param b Block
+ * \param len Bytes needed
+ * \return ok, failure
+ */
+static joy_status_e zsink_reserve (zsink_block_t *b, size_t len) {
+    unsigned char *in;
+    size_t size;
+
+    if (b->in_size - b->in_len >= len) {
+        return ok;
+    }
+    size = b->in_size ? b->in_size : ZSINK_BLOCK_SIZE;
+    while (size - b->in_len < len) {
+        size *= 2;
+    }
+    in = realloc(b->in, size);
+    if (in == NULL) {
+        joy_log_err("could not allocate a block of output");
+        return failure;
+    }
+    b->in = in;
+    b->in_size = size;
+
+    return ok;
+}
+
+/**
+ * \brief Write to a sink.
+ *
+ * \param z Sink
+ * \param buf Bytes to write
+ * \param len Number of bytes
+ * \return len, or 0 on error
+ */
+int zsink_write (zsink_t *z, const void *buf, size_t len) {
+    zsink_block_t *b;
+
+    if (z->gz != NULL) {
+        return gzwrite(z->gz, buf, (unsigned int)len);
+    }
+    if (len == 0) {
+        return 0;
+    }
+    b = zsink_block(z, z->fill_seq);
+    if (zsink_reserve(b, len) != ok) {
+        return 0;
+    }
+    memcpy_s(b->in + b->in_len, b->in_size - b->in_len, buf, len);
+    b->in_len += len;
+    if (b->in_len >= ZSINK_BLOCK_SIZE) {
+        zsink_submit(z);
+    }
+
+    return (int)len;
+}
+
+/**
+ * \brief Formatted output to a sink.
+ *
+ * \param z Sink
+ * \param format printf() format
+ * \return Number of bytes written, or a negative value on error
+ */
+int zsink_printf (zsink_t *z, const char *format, ...) {
+    zsink_block_t *b;
+    va_list args, retry;
+    int len;
+
+    va_start(args, format);
+    if (z->gz != NULL) {
+        len = gzvprintf(z->gz, format, args);
+        va_end(args);
+        return len;
+    }
+
+    b = zsink_block(z, z->fill_seq);
+    if (zsink_reserve(b, 1) != ok) {
+        va_end(args);
+        return -1;
+    }
+    va_copy(retry, args);
+    len = vsnprintf((char *)b->in + b->in_len, b->in_size - b->in_len, format, args);
+    if (len >= 0 && (size_t)len >= b->in_size - b->in_len) {
+        /* did not fit; vsnprintf() needs room for the terminating null as well */
+        if (zsink_reserve(b, (size_t)len + 1) != ok) {
+            len = -1;
+        } else {
+            len = vsnprintf((char *)b->in + b->in_len, b->in_size - b->in_len, format, retry);
+        }
+    }
+    va_end(retry);
+    va_end(args);
+    if (len < 0) {
+        return len;
+    }
+    b->in_len += len;
+    if (b->in_len >= ZSINK_BLOCK_SIZE) {
+        zsink_submit(z);
+    }
+
+    return len;
+}
+
+/**
+ * \brief Compress and write everything written to a sink so far.
+ *
+ * \param z Sink
+ * \return 0, or -1 on error
+ */
+int zsink_flush (zsink_t *z) {
+    if (z->gz != NULL) {
+        return (gzflush(z->gz, Z_SYNC_FLUSH) == Z_OK) ? 0 : -1;
+    }
+    if (zsink_block(z, z->fill_seq)->in_len) {
+        zsink_submit(z);
+    }
+    pthread_mutex_lock(&z->lock);
+    while (z->write_seq != z->fill_seq) {
+        pthread_cond_wait(&z->room, &z->lock);
+    }
+    pthread_mutex_unlock(&z->lock);
+    if (fflush(z->f) != 0) {
+        z->failed = 1;
+    }
+
+    return z->failed ? -1 : 0;
+}
+
+/**
+ * \brief Flush a sink, stop its threads, close the file and free the sink.
+ *
+ * \param z Sink
+ * \return 0, or -1 on error
+ */
+int zsink_close (zsink_t *z) {
+    unsigned int i;
+    int rc;
+
+    if (z->gz != NULL) {
+        rc = (gzclose(z->gz) == Z_OK) ? 0 : -1;
+        zsink_free(z);
+        return rc;
+    }
+
+    rc = zsink_flush(z);
+    pthread_mutex_lock(&z->lock);
+    z->stop = 1;
+    pthread_cond_broadcast(&z->work);
+    pthread_mutex_unlock(&z->lock);
+    for (i = 0; i < z->num_threads; i++) {
+        pthread_join(z->threads[i], NULL);
+    }
+    if (fclose(z->f) != 0) {
+        rc = -1;
+    }
+    zsink_free(z);
+
+    return rc;
+}
+
+/*
+ * unit test
+ */
+
+/** name of the file that the unit test writes and reads back */
+#define ZSINK_TEST_FILE "zsink_test.gz"
+
+/** bytes of output written by the unit test */
+#define ZSINK_TEST_BYTES (3 * 1024 * 1024)
+
+/**
+ * \brief Write a file of test output through a sink and read it back.
+ *
+ * \param threads compress_threads setting
+ * \param level compress_level setting
+ * \return Number of failures
+ */
+static int zsink_test_round_trip (unsigned int threads, unsigned int level) {
+    unsigned int saved_threads = glb_config->compress_threads;
+    unsigned int saved_level = glb_config->compress_level;
+    char *expected, *actual;
+    char big[4096];
+    size_t len = 0;
+    unsigned int i = 0;
+    int n, num_fails = 0;
+    zsink_t *z;
+    gzFile gz;
+
+    expected = malloc(ZSINK_TEST_BYTES + sizeof(big) * 2);
+    actual = malloc(ZSINK_TEST_BYTES + sizeof(big) * 2);
+    if (expected == NULL || actual == NULL) {
+        free(expected);
+        free(actual);
+        joy_log_err("out of memory");
+        return 1;
+    }
+    memset_s(big, sizeof(big), 'x', sizeof(big) - 1);
+    big[sizeof(big) - 1] = 0;
+
+    glb_config->compress_threads = threads;
+    glb_config->compress_level = level;
+    z = zsink_open(ZSINK_TEST_FILE, "w");
+    glb_config->compress_threads = saved_threads;
+    glb_config->compress_level = saved_level;
+    if (z == NULL) {
+        joy_log_err("could not open %s", ZSINK_TEST_FILE);
+        free(expected);
+        free(actual);
+        return 1;
+    }
+
+    /* records of all sizes, some of them bigger than the room left in a block */
+    while (len < ZSINK_TEST_BYTES) {
+        if (i % 3 == 0) {
+            n = snprintf(expected + len, sizeof(big) * 2, "{\"seq\":%u,\"pad\":\"%.*s\"}\n",
+                         i, (int)(i % sizeof(big)), big);
+            if (zsink_printf(z, "{\"seq\":%u,\"pad\":\"%.*s\"}\n", i, (int)(i % sizeof(big)), big) != n) {
+                num_fails++;
+            }
+        } else {
+            n = snprintf(expected + len, sizeof(big) * 2, "{\"seq\":%u}\n", i);
+            if (zsink_write(z, expected + len, (size_t)n) != n) {
+                num_fails++;
+            }
+        }
+        len += n;
+        if (i % 10000 == 5000 && zsink_flush(z) != 0) {
+            joy_log_err("flush failed");
+            num_fails++;
+        }
+        i++;
+    }
+    if (zsink_close(z) != 0) {
+        joy_log_err("close failed");
+        num_fails++;
+    }
+
+    /* zlib reads the members of the file one after the other */
+    gz = gzopen(ZSINK_TEST_FILE, "r");
+    if (gz == NULL) {
+        joy_log_err("could not read %s", ZSINK_TEST_FILE);
+        num_fails++;
+    } else {
+        n = gzread(gz, actual, (unsigned int)(ZSINK_TEST_BYTES + sizeof(big) * 2));
+        if (n < 0 || (size_t)n != len || memcmp(actual, expected, len) != 0) {
+            joy_log_err("%d bytes read back, %zu written, with %u threads", n, len, threads);
+            num_fails++;
+        }
+        gzclose(gz);
+    }
+    remove(ZSINK_TEST_FILE);
+
+    free(expected);
+    free(actual);
+    return num_fails;
+}
+
+/**
+ * \brief Unit test for the compressed output sink.
+ *
+ * \param none
+ * \return Number of failures
+ */
+int zsink_unit_test (void) {
+    int num_fails = 0;
+
+    fprintf(info, "\n******************************\n");
+    fprintf(info, "Compressed output Unit Test starting...\n");
+
+    num_fails += zsink_test_round_trip(0, 0);
+    num_fails += zsink_test_round_trip(1, 0);
+    num_fails += zsink_test_round_trip(4, 1);
+    num_fails += zsink_test_round_trip(3, 9);
+
+    if (num_fails) {
+        fprintf(info, "Finished - failures: %d\n", num_fails);
+    } else {
+        fprintf(info, "Finished - success\n");
+    }
+    fprintf(info, "******************************\n\n");
+
+    return num_fails;
+}
+
+#else
+
+/**
+ * \brief Unit test for the compressed output sink, which is not built
+ * without gzip output.
+ *
+ * \param none
+ * \return 0
+ */
+int zsink_unit_test (void) {
+    return 0;
+}
+
+#endif /* USE_GZIP */
@@ -255,6 +255,88 @@ class ValidateTLS(object):
             raise AssertionError
 
 
+class ValidateTLSReaders(object):
+    """
+    Run joy over a capture whose TLS record headers are split across
+    packets, once per packet reader, and check that every reader
+    reports the same TLS data for each flow.
+    """
+    def __init__(self, paths):
+        self.paths = paths
+        self.pcap = os.path.abspath(os.path.join(paths['pcap'], 'firefox58.pcap'))
+        # The default reader, the pcap reader (which a bpf filter selects) and the worker threads
+        self.readers = {'default': [],
+                        'bpf': ['bpf=ip'],
+                        'threads': ['threads=2']}
+        self.tmp_outputs = {'default': 'tmp-readers-default.json',
+                            'bpf': 'tmp-readers-bpf.json',
+                            'threads': 'tmp-readers-threads.json'}
+
+    def _cleanup_tmp_files(self):
+        for key, f in self.tmp_outputs.iteritems():
+            if os.path.isfile(f):
+                os.remove(f)
+
+    def _run_reader(self, reader):
+        proc = subprocess.Popen([self.paths['exec'],
+                                 'output=' + self.tmp_outputs[reader],
+                                 'bidir=1', 'num_pkts=50', 'tls=1'] +
+                                self.readers[reader] + [self.pcap])
+
+        # Let joy run to the end of the capture, so that every flow is in the output
+        proc.wait()
+
+        rc = end_process(proc)
+        if rc != 0:
+            self._cleanup_tmp_files()
+            logger.error("Subprocess Joy failure")
+            raise RuntimeError("Subprocess Joy failure")
+
+        ft = FileType(self.tmp_outputs[reader])
+        if ft.is_gz():
+            f = gzip.open(self.tmp_outputs[reader], 'r')
+        elif ft.is_bz2():
+            f = bz2.BZ2File(self.tmp_outputs[reader], 'r')
+        else:
+            f = open(self.tmp_outputs[reader], 'r')
+
+        tls_flows = dict()
+        for line in f:
+            try:
+                flow = json.loads(line)
+            except:
+                continue
+            if 'sa' not in flow:
+                # Skip if not a flow object
+                continue
+            key = (flow['sa'], flow['da'], flow.get('sp'), flow.get('dp'), flow['pr'])
+            tls_flows[key] = flow.get('tls')
+        f.close()
+
+        return tls_flows
+
+    def compare_readers(self):
+        reader_flows = dict()
+        for reader in self.readers:
+            reader_flows[reader] = self._run_reader(reader)
+
+        # Cleanup
+        self._cleanup_tmp_files()
+
+        mismatch = False
+        for reader, tls_flows in reader_flows.iteritems():
+            if reader == 'default':
+                continue
+            for key, tls in reader_flows['default'].iteritems():
+                if tls_flows.get(key) != tls:
+                    mismatch = True
+                    logger.warning('TLS mismatch ' + str(reader) + ' reader --> ' + str(key))
+
+        if mismatch:
+            logger.error("Failure, packet readers disagree on TLS data")
+            raise AssertionError
+
+
 def test_unix_os():
     """
     Prepare the module for testing within a UNIX-like enviroment,
@@ -277,6 +359,9 @@ def test_unix_os():
         validate_tls = ValidateTLS(paths)
         validate_tls.compare_new_against_base()
 
+        validate_readers = ValidateTLSReaders(paths)
+        validate_readers.compare_readers()
+
 
 def main_tls(baseline_dir=None,
              pcap_dir=None,